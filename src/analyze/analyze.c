@@ -1301,6 +1301,112 @@ static int dump(int argc, char *argv[], void *userdata) {
         return 0;
 }
 
+static void json_print_string(FILE *f, const char *s) {
+        const char *p;
+
+        fputc('"', f);
+
+        for (p = s; *p; p++)
+                if (IN_SET(*p, '"', '\\'))
+                        fprintf(f, "\\%c", *p);
+                else if ((unsigned char) *p < ' ')
+                        fprintf(f, "\\u%04x", (unsigned) *p);
+                else
+                        fputc(*p, f);
+
+        fputc('"', f);
+}
+
+static int trace(int argc, char *argv[], void *userdata) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        _cleanup_hashmap_free_free_ Hashmap *tids = NULL;
+        const char *phase, *name;
+        uint64_t begin, end;
+        unsigned n_tids = 0;
+        bool first = true;
+        int r;
+
+        /* Outputs the trace of the service manager's own work in the Trace Event Format, as understood by
+         * chrome://tracing and Perfetto. Each unit gets its own track, the manager-wide work is shown on track 0.
+         * Timestamps are CLOCK_MONOTONIC, i.e. relative to the kernel's boot. */
+
+        r = acquire_bus(false, &bus);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create bus connection: %m");
+
+        r = sd_bus_call_method(
+                        bus,
+                        "org.freedesktop.systemd1",
+                        "/org/freedesktop/systemd1",
+                        "org.freedesktop.systemd1.Manager",
+                        "GetTrace",
+                        &error,
+                        &reply,
+                        NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get trace: %s", bus_error_message(&error, r));
+
+        tids = hashmap_new(&string_hash_ops);
+        if (!tids)
+                return log_oom();
+
+        r = sd_bus_message_enter_container(reply, 'a', "(sstt)");
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", stdout);
+
+        while ((r = sd_bus_message_read(reply, "(sstt)", &phase, &name, &begin, &end)) > 0) {
+                unsigned tid = 0;
+
+                if (!isempty(name)) {
+                        void *v;
+
+                        v = hashmap_get(tids, name);
+                        if (v)
+                                tid = PTR_TO_UINT(v);
+                        else {
+                                _cleanup_free_ char *copy = NULL;
+
+                                copy = strdup(name);
+                                if (!copy)
+                                        return log_oom();
+
+                                tid = ++n_tids;
+                                r = hashmap_put(tids, copy, UINT_TO_PTR(tid));
+                                if (r < 0)
+                                        return log_oom();
+                                copy = NULL;
+
+                                /* Name the track after the unit */
+                                printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                                       first ? "" : ",", tid);
+                                json_print_string(stdout, name);
+                                fputs("}}", stdout);
+                                first = false;
+                        }
+                }
+
+                printf("%s\n{\"name\":", first ? "" : ",");
+                json_print_string(stdout, phase);
+                printf(",\"cat\":\"systemd\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 "}",
+                       tid, begin, end > begin ? end - begin : 0);
+                first = false;
+        }
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        fputs("\n]}\n", stdout);
+
+        r = sd_bus_message_exit_container(reply);
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        return 0;
+}
+
 static int set_log_level(int argc, char *argv[], void *userdata) {
         _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
         _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
@@ -1619,6 +1725,7 @@ static int help(int argc, char *argv[], void *userdata) {
                "  log-level [LEVEL]        Get/set logging threshold for manager\n"
                "  log-target [TARGET]      Get/set logging target for manager\n"
                "  dump                     Output state serialization of service manager\n"
+               "  trace                    Output trace of the service manager's work as JSON\n"
                "  syscall-filter [NAME...] Print list of syscalls in seccomp filter\n"
                "  verify FILE...           Check unit files for correctness\n"
                "  calendar SPEC...         Validate repetitive calendar time events\n"
@@ -1782,6 +1889,7 @@ int main(int argc, char *argv[]) {
                 { "set-log-target",    2,        2,        0,            set_log_target         },
                 { "get-log-target",    VERB_ANY, 1,        0,            get_log_target         },
                 { "dump",              VERB_ANY, 1,        0,            dump                   },
+                { "trace",             VERB_ANY, 1,        0,            trace                  },
                 { "syscall-filter",    VERB_ANY, VERB_ANY, 0,            dump_syscall_filters   },
                 { "verify",            2,        VERB_ANY, 0,            do_verify              },
                 { "calendar",          2,        VERB_ANY, 0,            test_calendar          },
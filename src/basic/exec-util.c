@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <stdio.h>
 
@@ -32,6 +33,7 @@
 #include "fd-util.h"
 #include "fileio.h"
 #include "hashmap.h"
+#include "io-util.h"
 #include "macro.h"
 #include "process-util.h"
 #include "set.h"
@@ -235,6 +237,129 @@ int execute_directories(
         return 0;
 }
 
+static int do_execute_binaries(char **paths, char **argvs[], usec_t timeout, int output_fd) {
+        _cleanup_free_ ExecResult *results = NULL;
+        _cleanup_free_ pid_t *pids = NULL;
+        size_t i, n, n_running = 0;
+        ssize_t l;
+        int r;
+
+        n = strv_length(paths);
+
+        results = new(ExecResult, n);
+        pids = new0(pid_t, n);
+        if (!results || !pids)
+                return log_oom();
+
+        if (timeout != USEC_INFINITY)
+                alarm((timeout + USEC_PER_SEC - 1) / USEC_PER_SEC);
+
+        for (i = 0; i < n; i++) {
+                pid_t pid;
+
+                results[i] = (ExecResult) {
+                        .begin = now(CLOCK_MONOTONIC),
+                        .status = -ETIME,
+                };
+
+                r = do_spawn(paths[i], argvs ? argvs[i] : NULL, -1, &pid);
+                if (r <= 0) {
+                        results[i].status = r;
+                        results[i].end = results[i].begin;
+                        continue;
+                }
+
+                pids[i] = pid;
+                n_running++;
+        }
+
+        while (n_running > 0) {
+                siginfo_t si = {};
+
+                if (waitid(P_ALL, 0, &si, WEXITED) < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return log_error_errno(errno, "Failed to wait for children: %m");
+                }
+
+                for (i = 0; i < n; i++)
+                        if (pids[i] == si.si_pid)
+                                break;
+                if (i >= n)
+                        continue;
+
+                pids[i] = 0;
+                results[i].end = now(CLOCK_MONOTONIC);
+                results[i].status = si.si_code == CLD_EXITED ? si.si_status : -EPROTO;
+                n_running--;
+
+                if (si.si_code != CLD_EXITED)
+                        log_error("%s terminated by signal %s.", paths[i], signal_to_string(si.si_status));
+                else if (si.si_status != EXIT_SUCCESS)
+                        log_error("%s failed with exit status %i.", paths[i], si.si_status);
+        }
+
+        l = write(output_fd, results, n * sizeof(ExecResult));
+        if (l < 0)
+                return log_error_errno(errno, "Failed to write results: %m");
+        if ((size_t) l != n * sizeof(ExecResult))
+                return log_error_errno(EIO, "Short write while writing results.");
+
+        return 0;
+}
+
+int execute_binaries(char **paths, char **argvs[], usec_t timeout, ExecResult *ret_results) {
+        _cleanup_close_ int fd = -1;
+        size_t i, n;
+        ssize_t l;
+        int r;
+
+        assert(ret_results);
+
+        /* Executes the specified binaries in parallel, each with its own argument vector (whose first entry is
+         * filled in), and waits for them to finish, like execute_directories(). Returns when and for how long each
+         * binary ran, as well as its exit status, in the array ret_results, which must have room for one entry per
+         * binary. A binary which did not finish within the timeout, or which couldn't be waited for, is reported
+         * with -ETIME as status. */
+
+        n = strv_length(paths);
+        for (i = 0; i < n; i++)
+                ret_results[i] = (ExecResult) {
+                        .status = -ETIME,
+                };
+
+        if (n == 0)
+                return 0;
+
+        fd = open_serialization_fd("exec-results");
+        if (fd < 0)
+                return log_error_errno(fd, "Failed to open serialization file: %m");
+
+        r = safe_fork("(sd-executor)", FORK_RESET_SIGNALS|FORK_DEATHSIG|FORK_LOG|FORK_WAIT, NULL);
+        if (r < 0)
+                return r;
+        if (r == 0) {
+                r = do_execute_binaries(paths, argvs, timeout, fd);
+                _exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        if (lseek(fd, 0, SEEK_SET) < 0)
+                return log_error_errno(errno, "Failed to rewind serialization fd: %m");
+
+        /* If the executor was killed because of the timeout we won't find anything here */
+        l = loop_read(fd, ret_results, n * sizeof(ExecResult), true);
+        if (l < 0)
+                return log_error_errno(l, "Failed to read results: %m");
+        if ((size_t) l != n * sizeof(ExecResult))
+                for (i = 0; i < n; i++)
+                        ret_results[i] = (ExecResult) {
+                                .status = -ETIME,
+                        };
+
+        return 0;
+}
+
 static int gather_environment_generate(int fd, void *arg) {
         char ***env = arg, **x, **y;
         _cleanup_fclose_ FILE *f = NULL;
@@ -38,4 +38,11 @@ int execute_directories(
                 void* const callback_args[_STDOUT_CONSUME_MAX],
                 char *argv[]);
 
+typedef struct ExecResult {
+        usec_t begin, end;      /* CLOCK_MONOTONIC */
+        int status;             /* The exit status, or a negative errno if the binary wasn't run to completion */
+} ExecResult;
+
+int execute_binaries(char **paths, char **argvs[], usec_t timeout, ExecResult *ret_results);
+
 extern const gather_stdout_callback_t gather_environment[_STDOUT_CONSUME_MAX];
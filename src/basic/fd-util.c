@@ -197,7 +197,7 @@ void stdio_unset_cloexec(void) {
         (void) fd_cloexec(STDERR_FILENO, false);
 }
 
-_pure_ static bool fd_in_set(int fd, const int fdset[], unsigned n_fdset) {
+bool fd_in_set(int fd, const int fdset[], unsigned n_fdset) {
         unsigned i;
 
         assert(n_fdset == 0 || fdset);
@@ -66,6 +66,7 @@ int fd_nonblock(int fd, bool nonblock);
 int fd_cloexec(int fd, bool cloexec);
 void stdio_unset_cloexec(void);
 
+bool fd_in_set(int fd, const int fdset[], unsigned n_fdset) _pure_;
 int close_all_fds(const int except[], unsigned n_except);
 
 int same_fd(int a, int b);
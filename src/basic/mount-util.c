@@ -24,7 +24,6 @@
 #include <string.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
-#include <sys/statvfs.h>
 #include <unistd.h>
 
 #include "alloc-util.h"
@@ -390,193 +389,341 @@ int umount_recursive(const char *prefix, int flags) {
         return r ? r : n;
 }
 
-static int get_mount_flags(const char *path, unsigned long *flags) {
-        struct statvfs buf;
+static unsigned long mount_options_to_flags(const char *options) {
+        static const struct {
+                const char *name;
+                unsigned long flag;
+        } table[] = {
+                { "ro",         MS_RDONLY     },
+                { "nosuid",     MS_NOSUID     },
+                { "nodev",      MS_NODEV      },
+                { "noexec",     MS_NOEXEC     },
+                { "noatime",    MS_NOATIME    },
+                { "nodiratime", MS_NODIRATIME },
+                { "relatime",   MS_RELATIME   },
+        };
+
+        unsigned long flags = 0;
+        const char *word, *state;
+        size_t l, i;
+
+        /* Converts the per-mount options as listed in /proc/self/mountinfo into the flags that may be passed along
+         * with MS_BIND|MS_REMOUNT, i.e. the same ones statvfs() reports. */
+
+        FOREACH_WORD_SEPARATOR(word, l, options, ",", state)
+                for (i = 0; i < ELEMENTSOF(table); i++)
+                        if (strlen(table[i].name) == l && memcmp(table[i].name, word, l) == 0) {
+                                flags |= table[i].flag;
+                                break;
+                        }
 
-        if (statvfs(path, &buf) < 0)
-                return -errno;
-        *flags = buf.f_flag;
-        return 0;
+        return flags;
 }
 
-/* Use this function only if do you have direct access to /proc/self/mountinfo
- * and need the caller to open it for you. This is the case when /proc is
- * masked or not mounted. Otherwise, use bind_remount_recursive. */
-int bind_remount_recursive_with_mountinfo(const char *prefix, bool ro, char **blacklist, FILE *proc_self_mountinfo) {
-        _cleanup_set_free_free_ Set *done = NULL;
-        _cleanup_free_ char *cleaned = NULL;
+typedef struct MountInfoLine {
+        char *path;
+        unsigned long flags;
+        bool autofs;
+        size_t order;
+} MountInfoLine;
+
+static int mount_info_line_compare(const void *a, const void *b) {
+        const MountInfoLine *x = a, *y = b;
         int r;
 
-        assert(proc_self_mountinfo);
+        r = path_compare(x->path, y->path);
+        if (r != 0)
+                return r;
 
-        /* Recursively remount a directory (and all its submounts) read-only or read-write. If the directory is already
-         * mounted, we reuse the mount and simply mark it MS_BIND|MS_RDONLY (or remove the MS_RDONLY for read-write
-         * operation). If it isn't we first make it one. Afterwards we apply MS_BIND|MS_RDONLY (or remove MS_RDONLY) to
-         * all submounts we can access, too. When mounts are stacked on the same mount point we only care for each
-         * individual "top-level" mount on each point, as we cannot influence/access the underlying mounts anyway. We
-         * do not have any effect on future submounts that might get propagated, they migt be writable. This includes
-         * future submounts that have been triggered via autofs.
-         *
-         * If the "blacklist" parameter is specified it may contain a list of subtrees to exclude from the
-         * remount operation. Note that we'll ignore the blacklist for the top-level path. */
+        /* Mounts on the same point are listed in the order they were stacked on each other */
+        return (x->order > y->order) - (x->order < y->order);
+}
 
-        cleaned = strdup(prefix);
-        if (!cleaned)
-                return -ENOMEM;
+static int mount_info_entry_compare(const void *a, const void *b) {
+        const MountInfoEntry *x = a, *y = b;
 
-        path_kill_slashes(cleaned);
+        return path_compare(x->path, y->path);
+}
 
-        done = set_new(&string_hash_ops);
-        if (!done)
-                return -ENOMEM;
+int mount_info_parse(FILE *proc_self_mountinfo, MountInfo **ret) {
+        _cleanup_(mount_info_freep) MountInfo *mi = NULL;
+        MountInfoLine *lines = NULL;
+        size_t n_lines = 0, n_allocated = 0, i;
+        int r;
+
+        assert(proc_self_mountinfo);
+        assert(ret);
+
+        /* Parses the mount table once, so that callers that need to look at many subtrees of it don't have to scan
+         * it again for each of them. */
+
+        rewind(proc_self_mountinfo);
 
         for (;;) {
-                _cleanup_set_free_free_ Set *todo = NULL;
-                bool top_autofs = false;
-                char *x;
-                unsigned long orig_flags;
+                _cleanup_free_ char *path = NULL, *options = NULL, *type = NULL, *p = NULL;
+                int k;
+
+                k = fscanf(proc_self_mountinfo,
+                           "%*s "       /* (1) mount id */
+                           "%*s "       /* (2) parent id */
+                           "%*s "       /* (3) major:minor */
+                           "%*s "       /* (4) root */
+                           "%ms "       /* (5) mount point */
+                           "%ms"        /* (6) mount options (bind mount) */
+                           "%*[^-]"     /* (7) optional fields */
+                           "- "         /* (8) separator */
+                           "%ms "       /* (9) file system type */
+                           "%*s"        /* (10) mount source */
+                           "%*s"        /* (11) mount options (superblock) */
+                           "%*[^\n]",   /* some rubbish at the end */
+                           &path,
+                           &options,
+                           &type);
+                if (k != 3) {
+                        if (k == EOF)
+                                break;
+
+                        continue;
+                }
 
-                todo = set_new(&string_hash_ops);
-                if (!todo)
-                        return -ENOMEM;
+                r = cunescape(path, UNESCAPE_RELAX, &p);
+                if (r < 0)
+                        goto finish;
 
-                rewind(proc_self_mountinfo);
+                if (!GREEDY_REALLOC(lines, n_allocated, n_lines + 1)) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
 
-                for (;;) {
-                        _cleanup_free_ char *path = NULL, *p = NULL, *type = NULL;
-                        int k;
+                lines[n_lines] = (MountInfoLine) {
+                        .path = p,
+                        .flags = mount_options_to_flags(options),
+                        .autofs = streq(type, "autofs"),
+                        .order = n_lines,
+                };
+                n_lines++;
+                p = NULL;
+        }
 
-                        k = fscanf(proc_self_mountinfo,
-                                   "%*s "       /* (1) mount id */
-                                   "%*s "       /* (2) parent id */
-                                   "%*s "       /* (3) major:minor */
-                                   "%*s "       /* (4) root */
-                                   "%ms "       /* (5) mount point */
-                                   "%*s"        /* (6) mount options (superblock) */
-                                   "%*[^-]"     /* (7) optional fields */
-                                   "- "         /* (8) separator */
-                                   "%ms "       /* (9) file system type */
-                                   "%*s"        /* (10) mount source */
-                                   "%*s"        /* (11) mount options (bind mount) */
-                                   "%*[^\n]",   /* some rubbish at the end */
-                                   &path,
-                                   &type);
-                        if (k != 2) {
-                                if (k == EOF)
-                                        break;
+        qsort_safe(lines, n_lines, sizeof(MountInfoLine), mount_info_line_compare);
 
-                                continue;
-                        }
+        mi = new0(MountInfo, 1);
+        if (!mi) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
-                        r = cunescape(path, UNESCAPE_RELAX, &p);
-                        if (r < 0)
-                                return r;
+        mi->entries = new0(MountInfoEntry, n_lines);
+        if (!mi->entries && n_lines > 0) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
-                        if (!path_startswith(p, cleaned))
-                                continue;
+        /* Collapse all mounts stacked on the same point into one entry. Only the topmost one is accessible, but
+         * autofs mounts are ignored: if they aren't triggered yet we don't want to trigger them, and if they are
+         * there's another mount on top of them. */
+        for (i = 0; i < n_lines; i++) {
+                MountInfoEntry *e;
+
+                if (mi->n_entries > 0 && path_equal(mi->entries[mi->n_entries - 1].path, lines[i].path))
+                        e = mi->entries + mi->n_entries - 1;
+                else {
+                        e = mi->entries + mi->n_entries++;
+                        e->path = lines[i].path;
+                        e->autofs = true;
+                        lines[i].path = NULL;
+                }
 
-                        /* Ignore this mount if it is blacklisted, but only if it isn't the top-level mount we shall
-                         * operate on. */
-                        if (!path_equal(cleaned, p)) {
-                                bool blacklisted = false;
-                                char **i;
+                if (!lines[i].autofs) {
+                        e->flags = lines[i].flags;
+                        e->autofs = false;
+                }
+        }
 
-                                STRV_FOREACH(i, blacklist) {
+        *ret = mi;
+        mi = NULL;
+        r = 0;
 
-                                        if (path_equal(*i, cleaned))
-                                                continue;
+finish:
+        for (i = 0; i < n_lines; i++)
+                free(lines[i].path);
+        free(lines);
 
-                                        if (!path_startswith(*i, cleaned))
-                                                continue;
+        return r;
+}
 
-                                        if (path_startswith(p, *i)) {
-                                                blacklisted = true;
-                                                log_debug("Not remounting %s, because blacklisted by %s, called for %s", p, *i, cleaned);
-                                                break;
-                                        }
-                                }
-                                if (blacklisted)
-                                        continue;
-                        }
+MountInfo *mount_info_free(MountInfo *mi) {
+        size_t i;
 
-                        /* Let's ignore autofs mounts.  If they aren't
-                         * triggered yet, we want to avoid triggering
-                         * them, as we don't make any guarantees for
-                         * future submounts anyway.  If they are
-                         * already triggered, then we will find
-                         * another entry for this. */
-                        if (streq(type, "autofs")) {
-                                top_autofs = top_autofs || path_equal(cleaned, p);
-                                continue;
-                        }
+        if (!mi)
+                return NULL;
+
+        for (i = 0; i < mi->n_entries; i++)
+                free(mi->entries[i].path);
+
+        free(mi->entries);
+        return mfree(mi);
+}
+
+MountInfoEntry *mount_info_find(MountInfo *mi, const char *path) {
+        MountInfoEntry key = {
+                .path = (char*) path,
+        };
+
+        assert(mi);
+        assert(path);
+
+        if (mi->n_entries == 0)
+                return NULL;
 
-                        if (!set_contains(done, p)) {
-                                r = set_consume(todo, p);
-                                p = NULL;
-                                if (r == -EEXIST)
-                                        continue;
-                                if (r < 0)
-                                        return r;
+        return bsearch(&key, mi->entries, mi->n_entries, sizeof(MountInfoEntry), mount_info_entry_compare);
+}
+
+int mount_info_mark_remount(MountInfo *mi, const char *prefix, char **blacklist) {
+        _cleanup_strv_free_ char **below = NULL;
+        MountInfoEntry *e, *end;
+        char **i;
+
+        assert(mi);
+        assert(prefix);
+
+        /* Marks the mount on prefix and all mounts below it for remounting by mount_info_apply_remount(), except
+         * for those in one of the subtrees listed in blacklist. The blacklist is ignored for prefix itself. Returns
+         * 0 if prefix isn't a mount point, in which case nothing is marked, and > 0 otherwise. */
+
+        e = mount_info_find(mi, prefix);
+        if (!e)
+                return 0;
+        if (e->autofs)
+                return 1;
+
+        /* Only the blacklist entries below prefix matter */
+        STRV_FOREACH(i, blacklist) {
+                if (path_equal(*i, prefix))
+                        continue;
+
+                if (!path_startswith(*i, prefix))
+                        continue;
+
+                if (strv_extend(&below, *i) < 0)
+                        return -ENOMEM;
+        }
+
+        e->remount = true;
+
+        /* Everything below prefix follows right after it */
+        end = mi->entries + mi->n_entries;
+        for (e++; e < end && path_startswith(e->path, prefix); e++) {
+                bool blacklisted = false;
+
+                STRV_FOREACH(i, below)
+                        if (path_startswith(e->path, *i)) {
+                                log_debug("Not remounting %s, because blacklisted by %s, called for %s", e->path, *i, prefix);
+                                blacklisted = true;
+                                break;
                         }
-                }
+                if (blacklisted)
+                        continue;
 
-                /* If we have no submounts to process anymore and if
-                 * the root is either already done, or an autofs, we
-                 * are done */
-                if (set_isempty(todo) &&
-                    (top_autofs || set_contains(done, cleaned)))
-                        return 0;
+                if (e->autofs)
+                        continue;
+
+                e->remount = true;
+        }
 
-                if (!set_contains(done, cleaned) &&
-                    !set_contains(todo, cleaned)) {
-                        /* The prefix directory itself is not yet a mount, make it one. */
-                        if (mount(cleaned, cleaned, NULL, MS_BIND|MS_REC, NULL) < 0)
-                                return -errno;
+        return 1;
+}
 
-                        orig_flags = 0;
-                        (void) get_mount_flags(cleaned, &orig_flags);
-                        orig_flags &= ~MS_RDONLY;
+int mount_info_apply_remount(MountInfo *mi, bool ro) {
+        size_t k;
+        int r;
 
-                        if (mount(NULL, prefix, NULL, orig_flags|MS_BIND|MS_REMOUNT|(ro ? MS_RDONLY : 0), NULL) < 0)
-                                return -errno;
+        assert(mi);
 
-                        log_debug("Made top-level directory %s a mount point.", prefix);
+        /* Remounts everything marked read-only or read-write. Each mount point is remounted at most once, even if
+         * it is marked again later. */
 
-                        x = strdup(cleaned);
-                        if (!x)
-                                return -ENOMEM;
+        for (k = 0; k < mi->n_entries; k++) {
+                MountInfoEntry *e = mi->entries + k;
 
-                        r = set_consume(done, x);
-                        if (r < 0)
-                                return r;
-                }
+                if (!e->remount || e->done)
+                        continue;
 
-                while ((x = set_steal_first(todo))) {
+                e->remount = false;
+                e->done = true;
 
-                        r = set_consume(done, x);
-                        if (IN_SET(r, 0, -EEXIST))
-                                continue;
-                        if (r < 0)
-                                return r;
+                /* Deal with mount points that are obstructed by a later mount */
+                r = path_is_mount_point(e->path, NULL, 0);
+                if (IN_SET(r, 0, -ENOENT))
+                        continue;
+                if (r < 0)
+                        return r;
 
-                        /* Deal with mount points that are obstructed by a later mount */
-                        r = path_is_mount_point(x, NULL, 0);
-                        if (IN_SET(r, 0, -ENOENT))
-                                continue;
-                        if (r < 0)
-                                return r;
+                /* Reuse the original flag set */
+                if (mount(NULL, e->path, NULL, (e->flags & ~MS_RDONLY)|MS_BIND|MS_REMOUNT|(ro ? MS_RDONLY : 0), NULL) < 0)
+                        return -errno;
 
-                        /* Try to reuse the original flag set */
-                        orig_flags = 0;
-                        (void) get_mount_flags(x, &orig_flags);
-                        orig_flags &= ~MS_RDONLY;
+                log_debug("Remounted %s %s.", e->path, ro ? "read-only" : "read-write");
+        }
 
-                        if (mount(NULL, x, NULL, orig_flags|MS_BIND|MS_REMOUNT|(ro ? MS_RDONLY : 0), NULL) < 0)
-                                return -errno;
+        return 0;
+}
 
-                        log_debug("Remounted %s read-only.", x);
-                }
+/* Use this function only if do you have direct access to /proc/self/mountinfo
+ * and need the caller to open it for you. This is the case when /proc is
+ * masked or not mounted. Otherwise, use bind_remount_recursive. */
+int bind_remount_recursive_with_mountinfo(const char *prefix, bool ro, char **blacklist, FILE *proc_self_mountinfo) {
+        _cleanup_(mount_info_freep) MountInfo *mi = NULL;
+        _cleanup_free_ char *cleaned = NULL;
+        int r;
+
+        assert(proc_self_mountinfo);
+
+        /* Recursively remount a directory (and all its submounts) read-only or read-write. If the directory is already
+         * mounted, we reuse the mount and simply mark it MS_BIND|MS_RDONLY (or remove the MS_RDONLY for read-write
+         * operation). If it isn't we first make it one. Afterwards we apply MS_BIND|MS_RDONLY (or remove MS_RDONLY) to
+         * all submounts we can access, too. When mounts are stacked on the same mount point we only care for each
+         * individual "top-level" mount on each point, as we cannot influence/access the underlying mounts anyway. We
+         * do not have any effect on future submounts that might get propagated, they migt be writable. This includes
+         * future submounts that have been triggered via autofs.
+         *
+         * If the "blacklist" parameter is specified it may contain a list of subtrees to exclude from the
+         * remount operation. Note that we'll ignore the blacklist for the top-level path. */
+
+        cleaned = strdup(prefix);
+        if (!cleaned)
+                return -ENOMEM;
+
+        path_kill_slashes(cleaned);
+
+        r = mount_info_parse(proc_self_mountinfo, &mi);
+        if (r < 0)
+                return r;
+
+        r = mount_info_mark_remount(mi, cleaned, blacklist);
+        if (r < 0)
+                return r;
+        if (r == 0) {
+                /* The prefix directory itself is not yet a mount, make it one. This brings along copies of all
+                 * submounts, hence read the mount table once more. */
+                if (mount(cleaned, cleaned, NULL, MS_BIND|MS_REC, NULL) < 0)
+                        return -errno;
+
+                log_debug("Made top-level directory %s a mount point.", prefix);
+
+                mi = mount_info_free(mi);
+                r = mount_info_parse(proc_self_mountinfo, &mi);
+                if (r < 0)
+                        return r;
+
+                r = mount_info_mark_remount(mi, cleaned, blacklist);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ENOENT;
         }
+
+        return mount_info_apply_remount(mi, ro);
 }
 
 int bind_remount_recursive(const char *prefix, bool ro, char **blacklist) {
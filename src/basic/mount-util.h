@@ -40,6 +40,30 @@ int path_is_mount_point(const char *path, const char *root, int flags);
 int repeat_unmount(const char *path, int flags);
 
 int umount_recursive(const char *target, int flags);
+
+typedef struct MountInfoEntry {
+        char *path;             /* The mount point, unescaped */
+        unsigned long flags;    /* The per-mount MS_RDONLY, MS_NOSUID, … flags of the topmost mount on this point */
+        bool autofs;            /* Only autofs mounts on this point, i.e. it isn't triggered yet */
+        bool remount;           /* Marked by mount_info_mark_remount() */
+        bool done;              /* Already remounted by mount_info_apply_remount() */
+} MountInfoEntry;
+
+/* A parsed copy of /proc/self/mountinfo with one entry per mount point, sorted with path_compare(), so that all mounts
+ * below some directory form a contiguous range right after it. */
+typedef struct MountInfo {
+        MountInfoEntry *entries;
+        size_t n_entries;
+} MountInfo;
+
+int mount_info_parse(FILE *proc_self_mountinfo, MountInfo **ret);
+MountInfo *mount_info_free(MountInfo *mi);
+DEFINE_TRIVIAL_CLEANUP_FUNC(MountInfo*, mount_info_free);
+
+MountInfoEntry *mount_info_find(MountInfo *mi, const char *path);
+int mount_info_mark_remount(MountInfo *mi, const char *prefix, char **blacklist);
+int mount_info_apply_remount(MountInfo *mi, bool ro);
+
 int bind_remount_recursive(const char *prefix, bool ro, char **blacklist);
 int bind_remount_recursive_with_mountinfo(const char *prefix, bool ro, char **blacklist, FILE *proc_self_mountinfo);
 
@@ -1404,6 +1404,59 @@ int fork_agent(const char *name, const int except[], unsigned n_except, pid_t *r
         _exit(EXIT_FAILURE);
 }
 
+#define CLONE_VFORK_STACK_SIZE (64U * 1024U)
+
+int clone_vfork(int (*fn)(void *userdata), void *userdata, pid_t *ret_pid) {
+#if CLONE_VFORK_SUPPORTED
+        sigset_t saved_ss, ss;
+        void *stack;
+        pid_t pid;
+        int r = 0;
+
+        assert(fn);
+        assert(ret_pid);
+
+        /* Like fork(), but the child shares our address space and the calling thread is suspended until it called
+         * execve() or exited, i.e. the page tables are not copied, which is expensive for processes with large
+         * heaps. The child runs fn() on its own stack. Since everything but the stack and the file descriptor table
+         * is shared with us, fn() may only issue system calls on data prepared beforehand: it must not allocate
+         * memory, take locks (another thread might hold them) or modify global state. If it returns, the child
+         * exits with its return value.
+         *
+         * The other threads carry on while the child runs, hence callers that must not block for long should call
+         * this from a separate thread, if the child does anything before execve() that might block.
+         *
+         * All signals are blocked while the child runs, so that none of our signal handlers is invoked in it. It
+         * inherits that mask, and hence needs to reset it before executing. */
+
+        stack = mmap(NULL, CLONE_VFORK_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED)
+                return -errno;
+
+        if (sigfillset(&ss) < 0 ||
+            sigprocmask(SIG_SETMASK, &ss, &saved_ss) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        /* The stack grows downwards on all architectures covered by CLONE_VFORK_SUPPORTED */
+        pid = clone(fn, (uint8_t*) stack + CLONE_VFORK_STACK_SIZE, CLONE_VM|CLONE_VFORK|SIGCHLD, userdata);
+        if (pid < 0)
+                r = -errno;
+
+        (void) sigprocmask(SIG_SETMASK, &saved_ss, NULL);
+
+        if (r >= 0)
+                *ret_pid = pid;
+
+finish:
+        (void) munmap(stack, CLONE_VFORK_STACK_SIZE);
+        return r;
+#else
+        return -EOPNOTSUPP;
+#endif
+}
+
 static const char *const ioprio_class_table[] = {
         [IOPRIO_CLASS_NONE] = "none",
         [IOPRIO_CLASS_RT] = "realtime",
@@ -185,6 +185,17 @@ static inline int safe_fork(const char *name, ForkFlags flags, pid_t *ret_pid) {
 
 int fork_agent(const char *name, const int except[], unsigned n_except, pid_t *pid, const char *path, ...);
 
+/* clone_vfork() hands the end of the child's stack to clone(), which is only right where the stack grows downwards
+ * and clone() takes a single stack pointer, i.e. not on hppa and ia64 */
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__) || defined(__arm__) || \
+    defined(__powerpc__) || defined(__s390__) || defined(__mips__) || defined(__riscv)
+#define CLONE_VFORK_SUPPORTED 1
+#else
+#define CLONE_VFORK_SUPPORTED 0
+#endif
+
+int clone_vfork(int (*fn)(void *userdata), void *userdata, pid_t *ret_pid);
+
 #if SIZEOF_PID_T == 4
 /* The highest possibly (theoretic) pid_t value on this architecture. */
 #define PID_T_MAX ((pid_t) INT32_MAX)
@@ -40,6 +40,9 @@
 
 #define CGROUP_CPU_QUOTA_PERIOD_USEC ((usec_t) 100 * USEC_PER_MSEC)
 
+/* How many units with empty cgroups to dispatch per event loop iteration */
+#define CGROUP_EMPTY_QUEUE_BATCH 64U
+
 bool unit_has_root_cgroup(Unit *u) {
         assert(u);
 
@@ -330,13 +333,183 @@ static int lookup_block_device(const char *p, dev_t *dev) {
         return 0;
 }
 
-static int whitelist_device(const char *path, const char *node, const char *acc) {
+static void unit_close_cgroup_fds(Unit *u) {
+        CGroupController c;
+
+        assert(u);
+
+        for (c = 0; c < _CGROUP_CONTROLLER_MAX; c++)
+                u->cgroup_fds[c] = safe_close(u->cgroup_fds[c]);
+}
+
+static void unit_forget_cgroup_attributes(Unit *u, CGroupMask keep) {
+        CGroupController c;
+        Iterator i;
+        char *k, *v;
+
+        assert(u);
+
+        /* Drops the remembered values of all controllers not in the specified mask */
+
+        if (cg_all_unified() <= 0)
+                for (c = 0; c < _CGROUP_CONTROLLER_MAX; c++)
+                        if (!(keep & CGROUP_CONTROLLER_TO_MASK(c))) {
+                                u->cgroup_fds[c] = safe_close(u->cgroup_fds[c]);
+                                u->cgroup_inodes[c] = 0;
+                        }
+
+        HASHMAP_FOREACH_KEY(v, k, u->cgroup_attribute_cache, i) {
+                _cleanup_free_ char *controller = NULL;
+
+                /* Attribute names are prefixed by the controller they belong to */
+                controller = strndup(k, strcspn(k, "."));
+                c = controller ? cgroup_controller_from_string(controller) : _CGROUP_CONTROLLER_INVALID;
+                if (c >= 0 && (keep & CGROUP_CONTROLLER_TO_MASK(c)))
+                        continue;
+
+                free(hashmap_remove2(u->cgroup_attribute_cache, k, (void**) &k));
+                free(k);
+        }
+}
+
+static void unit_flush_cgroup_attributes(Unit *u) {
+        assert(u);
+
+        unit_close_cgroup_fds(u);
+        zero(u->cgroup_inodes);
+
+        u->cgroup_attribute_cache = hashmap_free_free_free(u->cgroup_attribute_cache);
+}
+
+static int unit_get_cgroup_fd(Unit *u, const char *controller) {
+        _cleanup_free_ char *p = NULL;
+        _cleanup_close_ int fd = -1;
+        CGroupController c;
+        struct stat st;
+        bool unified;
+        int r;
+
+        assert(u);
+        assert(controller);
+
+        /* Returns an fd for the directory of the unit's cgroup in the hierarchy of the specified controller. On the
+         * unified hierarchy there's only one directory, hence all controllers share one fd. The fds are only kept
+         * while the unit is realized, see unit_realize_cgroup_now(). */
+
+        unified = cg_all_unified() > 0;
+        if (unified)
+                c = CGROUP_CONTROLLER_CPU;
+        else {
+                c = cgroup_controller_from_string(controller);
+                if (c < 0)
+                        return -EINVAL;
+        }
+
+        if (u->cgroup_fds[c] >= 0)
+                return u->cgroup_fds[c];
+
+        r = cg_get_path(controller, u->cgroup_path, NULL, &p);
+        if (r < 0)
+                return r;
+
+        fd = open(p, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        /* If the cgroup was removed and created again behind our back, its attributes start out with the defaults
+         * again, hence forget what we wrote to the old one. */
+        if (u->cgroup_inodes[c] != 0 && u->cgroup_inodes[c] != st.st_ino)
+                unit_forget_cgroup_attributes(u, unified ? 0 : ~CGROUP_CONTROLLER_TO_MASK(c));
+
+        u->cgroup_inodes[c] = st.st_ino;
+        u->cgroup_fds[c] = fd;
+        fd = -1;
+
+        return u->cgroup_fds[c];
+}
+
+static int unit_set_cgroup_attribute(Unit *u, const char *controller, const char *attribute, const char *value, bool cache) {
+        _cleanup_free_ char *k = NULL, *v = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        int dir_fd, fd, r;
+        const char *old;
+
+        assert(u);
+        assert(u->cgroup_path);
+        assert(attribute);
+        assert(value);
+
+        /* Like cg_set_attribute(), but relative to the directory fds of the unit. If 'cache' is true the write is
+         * skipped if the same value was written before. This must only be used for attributes that take a single
+         * value, and not for those which accumulate the lines written, such as devices.allow. */
+
+        dir_fd = unit_get_cgroup_fd(u, controller);
+        if (dir_fd < 0)
+                return dir_fd;
+
+        if (cache) {
+                old = hashmap_get(u->cgroup_attribute_cache, attribute);
+                if (streq_ptr(old, value))
+                        return 0;
+        }
+
+        fd = openat(dir_fd, attribute, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                r = -errno;
+        else {
+                f = fdopen(fd, "we");
+                if (!f) {
+                        r = -errno;
+                        safe_close(fd);
+                } else
+                        r = write_string_stream(f, value, 0);
+        }
+        if (r < 0) {
+                free(hashmap_remove2(u->cgroup_attribute_cache, attribute, (void**) &k));
+                return r;
+        }
+
+        if (!cache)
+                return 0;
+
+        /* Failing to remember the value is not fatal, we'll just write it again next time */
+        if (hashmap_ensure_allocated(&u->cgroup_attribute_cache, &string_hash_ops) < 0)
+                return 0;
+
+        v = strdup(value);
+        if (!v)
+                return 0;
+
+        old = hashmap_get2(u->cgroup_attribute_cache, attribute, (void**) &k);
+        if (old) {
+                assert_se(hashmap_update(u->cgroup_attribute_cache, k, v) >= 0);
+                free((char*) old);
+                k = NULL;
+        } else {
+                k = strdup(attribute);
+                if (!k)
+                        return 0;
+
+                if (hashmap_put(u->cgroup_attribute_cache, k, v) < 0)
+                        return 0;
+
+                k = NULL;
+        }
+
+        v = NULL;
+        return 0;
+}
+
+static int whitelist_device(Unit *u, const char *node, const char *acc) {
         char buf[2+DECIMAL_STR_MAX(dev_t)*2+2+4];
         struct stat st;
         bool ignore_notfound;
         int r;
 
-        assert(path);
+        assert(u);
         assert(acc);
 
         if (node[0] == '-') {
@@ -364,21 +537,21 @@ static int whitelist_device(const char *path, const char *node, const char *acc)
                 major(st.st_rdev), minor(st.st_rdev),
                 acc);
 
-        r = cg_set_attribute("devices", path, "devices.allow", buf);
+        r = unit_set_cgroup_attribute(u, "devices", "devices.allow", buf, false);
         if (r < 0)
                 log_full_errno(IN_SET(r, -ENOENT, -EROFS, -EINVAL, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
-                               "Failed to set devices.allow on %s: %m", path);
+                               "Failed to set devices.allow on %s: %m", u->cgroup_path);
 
         return r;
 }
 
-static int whitelist_major(const char *path, const char *name, char type, const char *acc) {
+static int whitelist_major(Unit *u, const char *name, char type, const char *acc) {
         _cleanup_fclose_ FILE *f = NULL;
         char line[LINE_MAX];
         bool good = false;
         int r;
 
-        assert(path);
+        assert(u);
         assert(acc);
         assert(IN_SET(type, 'b', 'c'));
 
@@ -435,10 +608,10 @@ static int whitelist_major(const char *path, const char *name, char type, const
                         maj,
                         acc);
 
-                r = cg_set_attribute("devices", path, "devices.allow", buf);
+                r = unit_set_cgroup_attribute(u, "devices", "devices.allow", buf, false);
                 if (r < 0)
                         log_full_errno(IN_SET(r, -ENOENT, -EROFS, -EINVAL, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
-                                       "Failed to set devices.allow on %s: %m", path);
+                                       "Failed to set devices.allow on %s: %m", u->cgroup_path);
         }
 
         return 0;
@@ -482,7 +655,7 @@ static void cgroup_apply_unified_cpu_config(Unit *u, uint64_t weight, uint64_t q
         int r;
 
         xsprintf(buf, "%" PRIu64 "\n", weight);
-        r = cg_set_attribute("cpu", u->cgroup_path, "cpu.weight", buf);
+        r = unit_set_cgroup_attribute(u, "cpu", "cpu.weight", buf, true);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set cpu.weight: %m");
@@ -493,7 +666,7 @@ static void cgroup_apply_unified_cpu_config(Unit *u, uint64_t weight, uint64_t q
         else
                 xsprintf(buf, "max " USEC_FMT "\n", CGROUP_CPU_QUOTA_PERIOD_USEC);
 
-        r = cg_set_attribute("cpu", u->cgroup_path, "cpu.max", buf);
+        r = unit_set_cgroup_attribute(u, "cpu", "cpu.max", buf, true);
 
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
@@ -505,22 +678,22 @@ static void cgroup_apply_legacy_cpu_config(Unit *u, uint64_t shares, uint64_t qu
         int r;
 
         xsprintf(buf, "%" PRIu64 "\n", shares);
-        r = cg_set_attribute("cpu", u->cgroup_path, "cpu.shares", buf);
+        r = unit_set_cgroup_attribute(u, "cpu", "cpu.shares", buf, true);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set cpu.shares: %m");
 
         xsprintf(buf, USEC_FMT "\n", CGROUP_CPU_QUOTA_PERIOD_USEC);
-        r = cg_set_attribute("cpu", u->cgroup_path, "cpu.cfs_period_us", buf);
+        r = unit_set_cgroup_attribute(u, "cpu", "cpu.cfs_period_us", buf, true);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set cpu.cfs_period_us: %m");
 
         if (quota != USEC_INFINITY) {
                 xsprintf(buf, USEC_FMT "\n", quota * CGROUP_CPU_QUOTA_PERIOD_USEC / USEC_PER_SEC);
-                r = cg_set_attribute("cpu", u->cgroup_path, "cpu.cfs_quota_us", buf);
+                r = unit_set_cgroup_attribute(u, "cpu", "cpu.cfs_quota_us", buf, true);
         } else
-                r = cg_set_attribute("cpu", u->cgroup_path, "cpu.cfs_quota_us", "-1");
+                r = unit_set_cgroup_attribute(u, "cpu", "cpu.cfs_quota_us", "-1", true);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set cpu.cfs_quota_us: %m");
@@ -592,7 +765,7 @@ static void cgroup_apply_io_device_weight(Unit *u, const char *dev_path, uint64_
                 return;
 
         xsprintf(buf, "%u:%u %" PRIu64 "\n", major(dev), minor(dev), io_weight);
-        r = cg_set_attribute("io", u->cgroup_path, "io.weight", buf);
+        r = unit_set_cgroup_attribute(u, "io", "io.weight", buf, false);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set io.weight: %m");
@@ -608,7 +781,7 @@ static void cgroup_apply_blkio_device_weight(Unit *u, const char *dev_path, uint
                 return;
 
         xsprintf(buf, "%u:%u %" PRIu64 "\n", major(dev), minor(dev), blkio_weight);
-        r = cg_set_attribute("blkio", u->cgroup_path, "blkio.weight_device", buf);
+        r = unit_set_cgroup_attribute(u, "blkio", "blkio.weight_device", buf, false);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set blkio.weight_device: %m");
@@ -638,7 +811,7 @@ static unsigned cgroup_apply_io_device_limit(Unit *u, const char *dev_path, uint
         xsprintf(buf, "%u:%u rbps=%s wbps=%s riops=%s wiops=%s\n", major(dev), minor(dev),
                  limit_bufs[CGROUP_IO_RBPS_MAX], limit_bufs[CGROUP_IO_WBPS_MAX],
                  limit_bufs[CGROUP_IO_RIOPS_MAX], limit_bufs[CGROUP_IO_WIOPS_MAX]);
-        r = cg_set_attribute("io", u->cgroup_path, "io.max", buf);
+        r = unit_set_cgroup_attribute(u, "io", "io.max", buf, false);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set io.max: %m");
@@ -658,7 +831,7 @@ static unsigned cgroup_apply_blkio_device_limit(Unit *u, const char *dev_path, u
         if (rbps != CGROUP_LIMIT_MAX)
                 n++;
         sprintf(buf, "%u:%u %" PRIu64 "\n", major(dev), minor(dev), rbps);
-        r = cg_set_attribute("blkio", u->cgroup_path, "blkio.throttle.read_bps_device", buf);
+        r = unit_set_cgroup_attribute(u, "blkio", "blkio.throttle.read_bps_device", buf, false);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set blkio.throttle.read_bps_device: %m");
@@ -666,7 +839,7 @@ static unsigned cgroup_apply_blkio_device_limit(Unit *u, const char *dev_path, u
         if (wbps != CGROUP_LIMIT_MAX)
                 n++;
         sprintf(buf, "%u:%u %" PRIu64 "\n", major(dev), minor(dev), wbps);
-        r = cg_set_attribute("blkio", u->cgroup_path, "blkio.throttle.write_bps_device", buf);
+        r = unit_set_cgroup_attribute(u, "blkio", "blkio.throttle.write_bps_device", buf, false);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set blkio.throttle.write_bps_device: %m");
@@ -685,7 +858,7 @@ static void cgroup_apply_unified_memory_limit(Unit *u, const char *file, uint64_
         if (v != CGROUP_LIMIT_MAX)
                 xsprintf(buf, "%" PRIu64 "\n", v);
 
-        r = cg_set_attribute("memory", u->cgroup_path, file, buf);
+        r = unit_set_cgroup_attribute(u, "memory", file, buf, true);
         if (r < 0)
                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                               "Failed to set %s: %m", file);
@@ -800,7 +973,7 @@ static void cgroup_context_apply(
                                 weight = CGROUP_WEIGHT_DEFAULT;
 
                         xsprintf(buf, "default %" PRIu64 "\n", weight);
-                        r = cg_set_attribute("io", path, "io.weight", buf);
+                        r = unit_set_cgroup_attribute(u, "io", "io.weight", buf, true);
                         if (r < 0)
                                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                                               "Failed to set io.weight: %m");
@@ -877,7 +1050,7 @@ static void cgroup_context_apply(
                                 weight = CGROUP_BLKIO_WEIGHT_DEFAULT;
 
                         xsprintf(buf, "%" PRIu64 "\n", weight);
-                        r = cg_set_attribute("blkio", path, "blkio.weight", buf);
+                        r = unit_set_cgroup_attribute(u, "blkio", "blkio.weight", buf, true);
                         if (r < 0)
                                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                                               "Failed to set blkio.weight: %m");
@@ -956,7 +1129,7 @@ static void cgroup_context_apply(
                         else
                                 xsprintf(buf, "%" PRIu64 "\n", val);
 
-                        r = cg_set_attribute("memory", path, "memory.limit_in_bytes", buf);
+                        r = unit_set_cgroup_attribute(u, "memory", "memory.limit_in_bytes", buf, true);
                         if (r < 0)
                                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                                               "Failed to set memory.limit_in_bytes: %m");
@@ -971,9 +1144,9 @@ static void cgroup_context_apply(
                  * here. */
 
                 if (c->device_allow || c->device_policy != CGROUP_AUTO)
-                        r = cg_set_attribute("devices", path, "devices.deny", "a");
+                        r = unit_set_cgroup_attribute(u, "devices", "devices.deny", "a", false);
                 else
-                        r = cg_set_attribute("devices", path, "devices.allow", "a");
+                        r = unit_set_cgroup_attribute(u, "devices", "devices.allow", "a", false);
                 if (r < 0)
                         log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EINVAL, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                                       "Failed to reset devices.list: %m");
@@ -995,10 +1168,10 @@ static void cgroup_context_apply(
                         const char *x, *y;
 
                         NULSTR_FOREACH_PAIR(x, y, auto_devices)
-                                whitelist_device(path, x, y);
+                                whitelist_device(u, x, y);
 
                         /* PTS (/dev/pts) devices may not be duplicated, but accessed */
-                        whitelist_major(path, "pts", 'c', "rw");
+                        whitelist_major(u, "pts", 'c', "rw");
                 }
 
                 LIST_FOREACH(device_allow, a, c->device_allow) {
@@ -1018,11 +1191,11 @@ static void cgroup_context_apply(
                         acc[k++] = 0;
 
                         if (path_startswith(a->path, "/dev/"))
-                                whitelist_device(path, a->path, acc);
+                                whitelist_device(u, a->path, acc);
                         else if ((val = startswith(a->path, "block-")))
-                                whitelist_major(path, val, 'b', acc);
+                                whitelist_major(u, val, 'b', acc);
                         else if ((val = startswith(a->path, "char-")))
-                                whitelist_major(path, val, 'c', acc);
+                                whitelist_major(u, val, 'c', acc);
                         else
                                 log_unit_debug(u, "Ignoring device %s while writing cgroup attribute.", a->path);
                 }
@@ -1061,9 +1234,9 @@ static void cgroup_context_apply(
                                 char buf[DECIMAL_STR_MAX(uint64_t) + 2];
 
                                 sprintf(buf, "%" PRIu64 "\n", c->tasks_max);
-                                r = cg_set_attribute("pids", path, "pids.max", buf);
+                                r = unit_set_cgroup_attribute(u, "pids", "pids.max", buf, true);
                         } else
-                                r = cg_set_attribute("pids", path, "pids.max", "max");
+                                r = unit_set_cgroup_attribute(u, "pids", "pids.max", "max", true);
                         if (r < 0)
                                 log_unit_full(u, IN_SET(r, -ENOENT, -EROFS, -EACCES) ? LOG_DEBUG : LOG_WARNING, r,
                                               "Failed to set pids.max: %m");
@@ -1156,11 +1329,10 @@ CGroupMask unit_get_members_mask(Unit *u) {
         u->cgroup_members_mask = 0;
 
         if (u->type == UNIT_SLICE) {
-                void *v;
                 Unit *member;
-                Iterator i;
+                unsigned i;
 
-                HASHMAP_FOREACH_KEY(v, member, u->dependencies[UNIT_BEFORE], i) {
+                UNIT_FOREACH_DEPENDENCY(member, u, UNIT_BEFORE, i) {
 
                         if (member == u)
                                 continue;
@@ -1477,6 +1649,11 @@ static int unit_create_cgroup(
         if (r < 0)
                 return r;
 
+        /* Controllers we don't need anymore get their cgroups removed on the legacy hierarchies (and their
+         * attributes hidden on the unified one). If they are added back later they start out with the defaults,
+         * hence forget what we wrote for them. */
+        unit_forget_cgroup_attributes(u, target_mask);
+
         /* First, create our own group */
         r = cg_create_everywhere(u->manager->cgroup_supported, target_mask, u->cgroup_path);
         if (r < 0)
@@ -1589,6 +1766,7 @@ static void unit_remove_from_cgroup_realize_queue(Unit *u) {
 static int unit_realize_cgroup_now(Unit *u, ManagerState state) {
         CGroupMask target_mask, enable_mask;
         bool needs_bpf, apply_bpf;
+        usec_t begin;
         int r;
 
         assert(u);
@@ -1615,6 +1793,7 @@ static int unit_realize_cgroup_now(Unit *u, ManagerState state) {
         }
 
         /* And then do the real work */
+        begin = now(CLOCK_MONOTONIC);
         r = unit_create_cgroup(u, target_mask, enable_mask, needs_bpf);
         if (r < 0)
                 return r;
@@ -1623,35 +1802,100 @@ static int unit_realize_cgroup_now(Unit *u, ManagerState state) {
         cgroup_context_apply(u, target_mask, apply_bpf, state);
         cgroup_xattr_apply(u);
 
+        /* Don't keep the directories of every unit open between realizations */
+        unit_close_cgroup_fds(u);
+
+        manager_trace(u->manager, MANAGER_TRACE_CGROUP_REALIZE, u->id, begin);
         return 0;
 }
 
+typedef struct QueuedRealize {
+        Unit *unit;
+        unsigned depth;
+} QueuedRealize;
+
+static int queued_realize_compare(const void *a, const void *b) {
+        const QueuedRealize *x = a, *y = b;
+
+        if (x->depth < y->depth)
+                return -1;
+        if (x->depth > y->depth)
+                return 1;
+
+        return strcmp(x->unit->id, y->unit->id);
+}
+
+static bool unit_realize_queued_cgroup(Unit *u, ManagerState state) {
+        int r;
+
+        assert(u);
+
+        /* Realized already as parent of an earlier unit? */
+        if (!u->in_cgroup_realize_queue)
+                return false;
+
+        if (UNIT_IS_INACTIVE_OR_FAILED(unit_active_state(u))) {
+                /* Maybe things changed, and the unit is not actually active anymore? */
+                unit_remove_from_cgroup_realize_queue(u);
+                return false;
+        }
+
+        r = unit_realize_cgroup_now(u, state);
+        if (r < 0)
+                log_warning_errno(r, "Failed to realize cgroups for queued unit %s, ignoring: %m", u->id);
+
+        return true;
+}
+
 unsigned manager_dispatch_cgroup_realize_queue(Manager *m) {
+        _cleanup_free_ QueuedRealize *batch = NULL;
+        size_t n_batch = 0, k;
         ManagerState state;
         unsigned n = 0;
         Unit *i;
-        int r;
 
         assert(m);
 
         state = manager_state(m);
 
-        while ((i = m->cgroup_realize_queue)) {
-                assert(i->in_cgroup_realize_queue);
+        LIST_FOREACH(cgroup_realize_queue, i, m->cgroup_realize_queue)
+                n_batch++;
 
-                if (UNIT_IS_INACTIVE_OR_FAILED(unit_active_state(i))) {
-                        /* Maybe things changed, and the unit is not actually active anymore? */
-                        unit_remove_from_cgroup_realize_queue(i);
-                        continue;
-                }
+        batch = new(QueuedRealize, n_batch);
+        if (!batch) {
+                log_oom();
 
-                r = unit_realize_cgroup_now(i, state);
-                if (r < 0)
-                        log_warning_errno(r, "Failed to realize cgroups for queued unit %s, ignoring: %m", i->id);
+                /* Realizing a unit realizes its parents first anyway, so this works too, just less efficiently */
+                while ((i = m->cgroup_realize_queue))
+                        if (unit_realize_queued_cgroup(i, state))
+                                n++;
 
-                n++;
+                return n;
         }
 
+        /* Process the queued units level by level: first the ones closest to the root, then their children, and so
+         * on. This way every slice is realized once before its members, instead of being checked again recursively
+         * for each of them, and the members of a slice are handled in one go. Units queued while we are at it are
+         * left for the next iteration of the event loop. */
+
+        k = 0;
+        LIST_FOREACH(cgroup_realize_queue, i, m->cgroup_realize_queue) {
+                Unit *slice;
+
+                batch[k].unit = i;
+                batch[k].depth = 0;
+                for (slice = UNIT_DEREF(i->slice); slice; slice = UNIT_DEREF(slice->slice))
+                        batch[k].depth++;
+
+                k++;
+        }
+
+        qsort_safe(batch, n_batch, sizeof(QueuedRealize), queued_realize_compare);
+
+        for (k = 0; k < n_batch; k++)
+                if (unit_realize_queued_cgroup(batch[k].unit, state))
+                        n++;
+
         return n;
 }
 
@@ -1663,11 +1907,10 @@ static void unit_add_siblings_to_cgroup_realize_queue(Unit *u) {
          * neither the specified unit itself nor the parents.) */
 
         while ((slice = UNIT_DEREF(u->slice))) {
-                Iterator i;
+                unsigned i;
                 Unit *m;
-                void *v;
 
-                HASHMAP_FOREACH_KEY(v, m, u->dependencies[UNIT_BEFORE], i) {
+                UNIT_FOREACH_DEPENDENCY(m, u, UNIT_BEFORE, i) {
                         if (m == u)
                                 continue;
 
@@ -1726,6 +1969,9 @@ void unit_release_cgroup(Unit *u) {
 
         /* Forgets all cgroup details for this cgroup */
 
+        unit_flush_cgroup_attributes(u);
+        unit_invalidate_accounting_snapshot(u);
+
         if (u->cgroup_path) {
                 (void) hashmap_remove(u->manager->cgroup_unit, u->cgroup_path);
                 u->cgroup_path = mfree(u->cgroup_path);
@@ -1751,7 +1997,10 @@ void unit_prune_cgroup(Unit *u) {
         if (!u->cgroup_path)
                 return;
 
-        (void) unit_get_cpu_usage(u, NULL); /* Cache the last CPU usage value before we destroy the cgroup */
+        /* Cache the last CPU usage value before we destroy the cgroup. The snapshot might be older than the last
+         * moments of the cgroup, hence read the final value from the kernel. */
+        unit_invalidate_accounting_snapshot(u);
+        (void) unit_get_cpu_usage(u, NULL);
 
         is_root_slice = unit_has_name(u, SPECIAL_ROOT_SLICE);
 
@@ -1910,21 +2159,44 @@ int unit_watch_all_pids(Unit *u) {
         return unit_watch_pids_in_path(u, u->cgroup_path);
 }
 
+unsigned manager_dispatch_cgroup_empty_queue(Manager *m) {
+        unsigned n;
+
+        assert(m);
+
+        /* Dispatch a bounded batch of units per event loop iteration: when a large number of cgroups runs empty at
+         * once (for example on shutdown) handling them one at a time means one full event loop iteration each, but
+         * we also don't want to delay SIGCHLD handling, which has the higher priority, for too long. Returns the
+         * number of units dispatched. */
+
+        for (n = 0; n < CGROUP_EMPTY_QUEUE_BATCH; n++) {
+                Unit *u;
+
+                u = m->cgroup_empty_queue;
+                if (!u)
+                        break;
+
+                assert(u->in_cgroup_empty_queue);
+                u->in_cgroup_empty_queue = false;
+                LIST_REMOVE(cgroup_empty_queue, m->cgroup_empty_queue, u);
+
+                unit_add_to_gc_queue(u);
+
+                if (UNIT_VTABLE(u)->notify_cgroup_empty)
+                        UNIT_VTABLE(u)->notify_cgroup_empty(u);
+        }
+
+        return n;
+}
+
 static int on_cgroup_empty_event(sd_event_source *s, void *userdata) {
         Manager *m = userdata;
-        Unit *u;
         int r;
 
         assert(s);
         assert(m);
 
-        u = m->cgroup_empty_queue;
-        if (!u)
-                return 0;
-
-        assert(u->in_cgroup_empty_queue);
-        u->in_cgroup_empty_queue = false;
-        LIST_REMOVE(cgroup_empty_queue, m->cgroup_empty_queue, u);
+        (void) manager_dispatch_cgroup_empty_queue(m);
 
         if (m->cgroup_empty_queue) {
                 /* More stuff queued, let's make sure we remain enabled */
@@ -1933,11 +2205,6 @@ static int on_cgroup_empty_event(sd_event_source *s, void *userdata) {
                         log_debug_errno(r, "Failed to reenable cgroup empty event source: %m");
         }
 
-        unit_add_to_gc_queue(u);
-
-        if (UNIT_VTABLE(u)->notify_cgroup_empty)
-                UNIT_VTABLE(u)->notify_cgroup_empty(u);
-
         return 0;
 }
 
@@ -1963,6 +2230,8 @@ void unit_add_to_cgroup_empty_queue(Unit *u) {
          * (which might happen if the cgroup doesn't contain processes that are our own child, which is typically the
          * case for scope units). */
 
+        unit_invalidate_accounting_snapshot(u);
+
         if (u->in_cgroup_empty_queue)
                 return;
 
@@ -1987,12 +2256,20 @@ void unit_add_to_cgroup_empty_queue(Unit *u) {
 }
 
 static int on_cgroup_inotify_event(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        _cleanup_set_free_ Set *pending = NULL;
         Manager *m = userdata;
+        Iterator i;
+        Unit *u;
+        int r;
 
         assert(s);
         assert(fd >= 0);
         assert(m);
 
+        /* "cgroup.events" is modified on every "populated" transition of a cgroup and of each of its children, and
+         * busy cgroups hence might generate many events in a short time. Let's first collect the units from all
+         * events queued right now, and then check each of them only once. */
+
         for (;;) {
                 union inotify_event_buffer buffer;
                 struct inotify_event *e;
@@ -2001,9 +2278,10 @@ static int on_cgroup_inotify_event(sd_event_source *s, int fd, uint32_t revents,
                 l = read(fd, &buffer, sizeof(buffer));
                 if (l < 0) {
                         if (IN_SET(errno, EINTR, EAGAIN))
-                                return 0;
+                                break;
 
-                        return log_error_errno(errno, "Failed to read control group inotify events: %m");
+                        r = log_error_errno(errno, "Failed to read control group inotify events: %m");
+                        goto finish;
                 }
 
                 FOREACH_INOTIFY_EVENT(e, buffer, l) {
@@ -2025,9 +2303,24 @@ static int on_cgroup_inotify_event(sd_event_source *s, int fd, uint32_t revents,
                                  * this here safely. */
                                 continue;
 
-                        unit_add_to_cgroup_empty_queue(u);
+                        if (u->in_cgroup_empty_queue)
+                                continue;
+
+                        r = set_ensure_allocated(&pending, NULL);
+                        if (r >= 0)
+                                r = set_put(pending, u);
+                        if (r < 0) /* Let's not lose the event on OOM, check the cgroup right-away instead */
+                                unit_add_to_cgroup_empty_queue(u);
                 }
         }
+
+        r = 0;
+
+finish:
+        SET_FOREACH(u, pending, i)
+                unit_add_to_cgroup_empty_queue(u);
+
+        return r;
 }
 
 int manager_setup_cgroup(Manager *m) {
@@ -2283,10 +2576,74 @@ int manager_notify_cgroup_empty(Manager *m, const char *cgroup) {
         return 1;
 }
 
-int unit_get_memory_current(Unit *u, uint64_t *ret) {
+static int unit_get_cgroup_attribute(Unit *u, const char *controller, const char *attribute, char **ret) {
+        assert(u);
+        assert(u->cgroup_path);
+        assert(attribute);
+        assert(ret);
+
+        /* Returns the full contents of the attribute. The directory fds of the unit are only open while it is
+         * realized, hence this goes by path. */
+
+        return cg_get_attribute(controller, u->cgroup_path, attribute, ret);
+}
+
+static int unit_get_cgroup_attribute_u64(Unit *u, const char *controller, const char *attribute, uint64_t *ret) {
         _cleanup_free_ char *v = NULL;
         int r;
 
+        r = unit_get_cgroup_attribute(u, controller, attribute, &v);
+        if (r < 0)
+                return r;
+
+        return safe_atou64(strstrip(v), ret);
+}
+
+static bool unit_accounting_snapshot_get(Unit *u, CGroupAccountingSnapshotEntry e, uint64_t ret[static 2]) {
+        CGroupAccountingSnapshot *s;
+
+        assert(u);
+        assert(e >= 0 && e < _CGROUP_SNAPSHOT_ENTRY_MAX);
+
+        s = u->accounting_snapshot + e;
+        if (s->timestamp == 0 || u->manager->accounting_refresh_usec == 0)
+                return false;
+
+        if (now(CLOCK_MONOTONIC) >= usec_add(s->timestamp, u->manager->accounting_refresh_usec))
+                return false;
+
+        ret[0] = s->values[0];
+        ret[1] = s->values[1];
+        return true;
+}
+
+static void unit_accounting_snapshot_put(Unit *u, CGroupAccountingSnapshotEntry e, uint64_t a, uint64_t b) {
+        assert(u);
+        assert(e >= 0 && e < _CGROUP_SNAPSHOT_ENTRY_MAX);
+
+        if (u->manager->accounting_refresh_usec == 0)
+                return;
+
+        u->accounting_snapshot[e] = (CGroupAccountingSnapshot) {
+                .timestamp = now(CLOCK_MONOTONIC),
+                .values = { a, b },
+        };
+}
+
+void unit_invalidate_accounting_snapshot(Unit *u) {
+        assert(u);
+
+        /* Makes sure the next query reads the counters from the kernel again. Called whenever the counters are
+         * likely to have changed in a step rather than gradually: when processes are forked off or reaped, when the
+         * cgroup runs empty and when the unit changes state. Between these events the counters are at most
+         * AccountingRefreshSec= old. */
+        zero(u->accounting_snapshot);
+}
+
+int unit_get_memory_current(Unit *u, uint64_t *ret) {
+        uint64_t v[2];
+        int r;
+
         assert(u);
         assert(ret);
 
@@ -2299,23 +2656,29 @@ int unit_get_memory_current(Unit *u, uint64_t *ret) {
         if ((u->cgroup_realized_mask & CGROUP_MASK_MEMORY) == 0)
                 return -ENODATA;
 
+        if (unit_accounting_snapshot_get(u, CGROUP_SNAPSHOT_MEMORY_CURRENT, v)) {
+                *ret = v[0];
+                return 0;
+        }
+
         r = cg_all_unified();
         if (r < 0)
                 return r;
         if (r > 0)
-                r = cg_get_attribute("memory", u->cgroup_path, "memory.current", &v);
+                r = unit_get_cgroup_attribute_u64(u, "memory", "memory.current", ret);
         else
-                r = cg_get_attribute("memory", u->cgroup_path, "memory.usage_in_bytes", &v);
+                r = unit_get_cgroup_attribute_u64(u, "memory", "memory.usage_in_bytes", ret);
         if (r == -ENOENT)
                 return -ENODATA;
         if (r < 0)
                 return r;
 
-        return safe_atou64(v, ret);
+        unit_accounting_snapshot_put(u, CGROUP_SNAPSHOT_MEMORY_CURRENT, *ret, 0);
+        return 0;
 }
 
 int unit_get_tasks_current(Unit *u, uint64_t *ret) {
-        _cleanup_free_ char *v = NULL;
+        uint64_t v[2];
         int r;
 
         assert(u);
@@ -2330,22 +2693,28 @@ int unit_get_tasks_current(Unit *u, uint64_t *ret) {
         if ((u->cgroup_realized_mask & CGROUP_MASK_PIDS) == 0)
                 return -ENODATA;
 
+        if (unit_accounting_snapshot_get(u, CGROUP_SNAPSHOT_TASKS_CURRENT, v)) {
+                *ret = v[0];
+                return 0;
+        }
+
         /* The root cgroup doesn't expose this information, let's get it from /proc instead */
         if (unit_has_root_cgroup(u))
-                return procfs_tasks_get_current(ret);
-
-        r = cg_get_attribute("pids", u->cgroup_path, "pids.current", &v);
-        if (r == -ENOENT)
-                return -ENODATA;
+                r = procfs_tasks_get_current(ret);
+        else {
+                r = unit_get_cgroup_attribute_u64(u, "pids", "pids.current", ret);
+                if (r == -ENOENT)
+                        return -ENODATA;
+        }
         if (r < 0)
                 return r;
 
-        return safe_atou64(v, ret);
+        unit_accounting_snapshot_put(u, CGROUP_SNAPSHOT_TASKS_CURRENT, *ret, 0);
+        return 0;
 }
 
 static int unit_get_cpu_usage_raw(Unit *u, nsec_t *ret) {
-        _cleanup_free_ char *v = NULL;
-        uint64_t ns;
+        uint64_t ns, v[2];
         int r;
 
         assert(u);
@@ -2358,18 +2727,34 @@ static int unit_get_cpu_usage_raw(Unit *u, nsec_t *ret) {
         if (r < 0)
                 return r;
         if (r > 0) {
-                const char *keys[] = { "usage_usec", NULL };
-                _cleanup_free_ char *val = NULL;
+                _cleanup_free_ char *content = NULL;
+                char *p, *line;
                 uint64_t us;
 
                 if ((u->cgroup_realized_mask & CGROUP_MASK_CPU) == 0)
                         return -ENODATA;
 
-                r = cg_get_keyed_attribute("cpu", u->cgroup_path, "cpu.stat", keys, &val);
+                if (unit_accounting_snapshot_get(u, CGROUP_SNAPSHOT_CPU_USAGE, v)) {
+                        *ret = v[0];
+                        return 0;
+                }
+
+                r = unit_get_cgroup_attribute(u, "cpu", "cpu.stat", &content);
                 if (r < 0)
                         return r;
 
-                r = safe_atou64(val, &us);
+                r = -ENOENT;
+                p = content;
+                while ((line = strsep(&p, "\n"))) {
+                        const char *val;
+
+                        val = startswith(line, "usage_usec ");
+                        if (!val)
+                                continue;
+
+                        r = safe_atou64(val, &us);
+                        break;
+                }
                 if (r < 0)
                         return r;
 
@@ -2378,17 +2763,20 @@ static int unit_get_cpu_usage_raw(Unit *u, nsec_t *ret) {
                 if ((u->cgroup_realized_mask & CGROUP_MASK_CPUACCT) == 0)
                         return -ENODATA;
 
-                r = cg_get_attribute("cpuacct", u->cgroup_path, "cpuacct.usage", &v);
+                if (unit_accounting_snapshot_get(u, CGROUP_SNAPSHOT_CPU_USAGE, v)) {
+                        *ret = v[0];
+                        return 0;
+                }
+
+                r = unit_get_cgroup_attribute_u64(u, "cpuacct", "cpuacct.usage", &ns);
                 if (r == -ENOENT)
                         return -ENODATA;
                 if (r < 0)
                         return r;
-
-                r = safe_atou64(v, &ns);
-                if (r < 0)
-                        return r;
         }
 
+        unit_accounting_snapshot_put(u, CGROUP_SNAPSHOT_CPU_USAGE, ns, 0);
+
         *ret = ns;
         return 0;
 }
@@ -2435,7 +2823,9 @@ int unit_get_ip_accounting(
                 CGroupIPAccountingMetric metric,
                 uint64_t *ret) {
 
-        uint64_t value;
+        CGroupAccountingSnapshotEntry e;
+        uint64_t v[2];
+        bool bytes;
         int fd, r;
 
         assert(u);
@@ -2453,26 +2843,35 @@ int unit_get_ip_accounting(
         if (!UNIT_CGROUP_BOOL(u, ip_accounting))
                 return -ENODATA;
 
-        fd = IN_SET(metric, CGROUP_IP_INGRESS_BYTES, CGROUP_IP_INGRESS_PACKETS) ?
-                u->ip_accounting_ingress_map_fd :
-                u->ip_accounting_egress_map_fd;
+        if (IN_SET(metric, CGROUP_IP_INGRESS_BYTES, CGROUP_IP_INGRESS_PACKETS)) {
+                e = CGROUP_SNAPSHOT_IP_INGRESS;
+                fd = u->ip_accounting_ingress_map_fd;
+        } else {
+                e = CGROUP_SNAPSHOT_IP_EGRESS;
+                fd = u->ip_accounting_egress_map_fd;
+        }
         if (fd < 0)
                 return -ENODATA;
 
-        if (IN_SET(metric, CGROUP_IP_INGRESS_BYTES, CGROUP_IP_EGRESS_BYTES))
-                r = bpf_firewall_read_accounting(fd, &value, NULL);
-        else
-                r = bpf_firewall_read_accounting(fd, NULL, &value);
-        if (r < 0)
-                return r;
+        bytes = IN_SET(metric, CGROUP_IP_INGRESS_BYTES, CGROUP_IP_EGRESS_BYTES);
+
+        /* The map contains both the byte and the packet counter, hence read both at once and keep them in the
+         * snapshot, as they are usually queried together. */
+        if (!unit_accounting_snapshot_get(u, e, v)) {
+                r = bpf_firewall_read_accounting(fd, v + 0, v + 1);
+                if (r < 0)
+                        return r;
+
+                unit_accounting_snapshot_put(u, e, v[0], v[1]);
+        }
 
         /* Add in additional metrics from a previous runtime. Note that when reexecing/reloading the daemon we compile
          * all BPF programs and maps anew, but serialize the old counters. When deserializing we store them in the
          * ip_accounting_extra[] field, and add them in here transparently. */
 
-        *ret = value + u->ip_accounting_extra[metric];
+        *ret = (bytes ? v[0] : v[1]) + u->ip_accounting_extra[metric];
 
-        return r;
+        return 0;
 }
 
 int unit_reset_cpu_accounting(Unit *u) {
@@ -2482,6 +2881,7 @@ int unit_reset_cpu_accounting(Unit *u) {
         assert(u);
 
         u->cpu_usage_last = NSEC_INFINITY;
+        u->accounting_snapshot[CGROUP_SNAPSHOT_CPU_USAGE] = (CGroupAccountingSnapshot) {};
 
         r = unit_get_cpu_usage_raw(u, &ns);
         if (r < 0) {
@@ -2505,6 +2905,8 @@ int unit_reset_ip_accounting(Unit *u) {
                 q = bpf_firewall_reset_accounting(u->ip_accounting_egress_map_fd);
 
         zero(u->ip_accounting_extra);
+        u->accounting_snapshot[CGROUP_SNAPSHOT_IP_INGRESS] = (CGroupAccountingSnapshot) {};
+        u->accounting_snapshot[CGROUP_SNAPSHOT_IP_EGRESS] = (CGroupAccountingSnapshot) {};
 
         return r < 0 ? r : q;
 }
@@ -2548,10 +2950,9 @@ void unit_invalidate_cgroup_bpf(Unit *u) {
          * list of our children includes our own. */
         if (u->type == UNIT_SLICE) {
                 Unit *member;
-                Iterator i;
-                void *v;
+                unsigned i;
 
-                HASHMAP_FOREACH_KEY(v, member, u->dependencies[UNIT_BEFORE], i) {
+                UNIT_FOREACH_DEPENDENCY(member, u, UNIT_BEFORE, i) {
                         if (member == u)
                                 continue;
 
@@ -140,6 +140,23 @@ typedef enum CGroupIPAccountingMetric {
         _CGROUP_IP_ACCOUNTING_METRIC_INVALID = -1,
 } CGroupIPAccountingMetric;
 
+/* The counters kept in the accounting snapshot of a unit, so that repeated queries within the refresh interval don't
+ * have to go to the kernel each time */
+typedef enum CGroupAccountingSnapshotEntry {
+        CGROUP_SNAPSHOT_MEMORY_CURRENT,
+        CGROUP_SNAPSHOT_TASKS_CURRENT,
+        CGROUP_SNAPSHOT_CPU_USAGE,   /* raw, i.e. without the cpu_usage_base subtracted */
+        CGROUP_SNAPSHOT_IP_INGRESS,  /* bytes and packets, as they are read from the BPF map in one go */
+        CGROUP_SNAPSHOT_IP_EGRESS,
+        _CGROUP_SNAPSHOT_ENTRY_MAX,
+        _CGROUP_SNAPSHOT_ENTRY_INVALID = -1,
+} CGroupAccountingSnapshotEntry;
+
+typedef struct CGroupAccountingSnapshot {
+        usec_t timestamp;            /* CLOCK_MONOTONIC, 0 if there's no valid value */
+        uint64_t values[2];
+} CGroupAccountingSnapshot;
+
 #include "unit.h"
 
 void cgroup_context_init(CGroupContext *c);
@@ -184,6 +201,7 @@ int manager_setup_cgroup(Manager *m);
 void manager_shutdown_cgroup(Manager *m, bool delete);
 
 unsigned manager_dispatch_cgroup_realize_queue(Manager *m);
+unsigned manager_dispatch_cgroup_empty_queue(Manager *m);
 
 Unit *manager_get_unit_by_cgroup(Manager *m, const char *cgroup);
 Unit *manager_get_unit_by_pid_cgroup(Manager *m, pid_t pid);
@@ -201,6 +219,7 @@ int unit_get_ip_accounting(Unit *u, CGroupIPAccountingMetric metric, uint64_t *r
 
 int unit_reset_cpu_accounting(Unit *u);
 int unit_reset_ip_accounting(Unit *u);
+void unit_invalidate_accounting_snapshot(Unit *u);
 
 #define UNIT_CGROUP_BOOL(u, name)                       \
         ({                                              \
@@ -1159,6 +1159,225 @@ static int method_list_units_by_patterns(sd_bus_message *message, void *userdata
         return list_units_filtered(message, userdata, error, states, patterns);
 }
 
+static const char* const list_units_ex_properties[] = {
+        "Id",
+        "Description",
+        "LoadState",
+        "ActiveState",
+        "SubState",
+        "Following",
+        "ObjectPath",
+        "JobId",
+        "JobType",
+        "JobObjectPath",
+        NULL
+};
+
+static int reply_unit_info_ex(sd_bus_message *reply, Unit *u, char **properties) {
+        _cleanup_free_ char *unit_path = NULL, *job_path = NULL;
+        Unit *following;
+        int r;
+
+#define WANTS(p) (strv_isempty(properties) || strv_contains(properties, p))
+
+        r = sd_bus_message_open_container(reply, 'a', "{sv}");
+        if (r < 0)
+                return r;
+
+        if (WANTS("Id")) {
+                r = sd_bus_message_append(reply, "{sv}", "Id", "s", u->id);
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("Description")) {
+                r = sd_bus_message_append(reply, "{sv}", "Description", "s", unit_description(u));
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("LoadState")) {
+                r = sd_bus_message_append(reply, "{sv}", "LoadState", "s", unit_load_state_to_string(u->load_state));
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("ActiveState")) {
+                r = sd_bus_message_append(reply, "{sv}", "ActiveState", "s", unit_active_state_to_string(unit_active_state(u)));
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("SubState")) {
+                r = sd_bus_message_append(reply, "{sv}", "SubState", "s", unit_sub_state_to_string(u));
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("Following")) {
+                following = unit_following(u);
+
+                r = sd_bus_message_append(reply, "{sv}", "Following", "s", following ? following->id : "");
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("ObjectPath")) {
+                unit_path = unit_dbus_path(u);
+                if (!unit_path)
+                        return -ENOMEM;
+
+                r = sd_bus_message_append(reply, "{sv}", "ObjectPath", "o", unit_path);
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("JobId")) {
+                r = sd_bus_message_append(reply, "{sv}", "JobId", "u", u->job ? u->job->id : 0);
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("JobType")) {
+                r = sd_bus_message_append(reply, "{sv}", "JobType", "s", u->job ? job_type_to_string(u->job->type) : "");
+                if (r < 0)
+                        return r;
+        }
+
+        if (WANTS("JobObjectPath")) {
+                if (u->job) {
+                        job_path = job_dbus_path(u->job);
+                        if (!job_path)
+                                return -ENOMEM;
+                }
+
+                r = sd_bus_message_append(reply, "{sv}", "JobObjectPath", "o", job_path ?: "/");
+                if (r < 0)
+                        return r;
+        }
+
+#undef WANTS
+
+        return sd_bus_message_close_container(reply);
+}
+
+static int method_list_units_ex(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        _cleanup_strv_free_ char **states = NULL, **types = NULL, **patterns = NULL, **properties = NULL;
+        _cleanup_free_ Unit **units = NULL;
+        uint64_t since, type_mask = 0;
+        Manager *m = userdata;
+        const char *cursor;
+        size_t n_units, k;
+        uint32_t max;
+        bool more;
+        char **p;
+        int r;
+
+        assert(message);
+        assert(m);
+
+        /* Anyone can call this method */
+
+        r = mac_selinux_access_check(message, "status", error);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read_strv(message, &states);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read_strv(message, &types);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read_strv(message, &patterns);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read_strv(message, &properties);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_read(message, "tsu", &since, &cursor, &max);
+        if (r < 0)
+                return r;
+
+        STRV_FOREACH(p, types) {
+                UnitType t;
+
+                t = unit_type_from_string(*p);
+                if (t < 0)
+                        return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Unknown unit type: %s", *p);
+
+                type_mask |= UINT64_C(1) << t;
+        }
+
+        STRV_FOREACH(p, properties)
+                if (!strv_contains((char**) list_units_ex_properties, *p))
+                        return sd_bus_error_setf(error, SD_BUS_ERROR_INVALID_ARGS, "Unknown unit property: %s", *p);
+
+        /* Generation 0 means "everything", anything else must be one we handed out and still have the removals
+         * since then for */
+        if (since > 0 && (since < m->unit_tombstones_horizon || since > m->unit_generation))
+                return sd_bus_error_setf(error, BUS_ERROR_GENERATION_TOO_OLD,
+                                         "Changes since generation %" PRIu64 " are not known anymore, list all units instead.", since);
+
+        r = manager_list_units_page(m, states, type_mask, patterns, since, cursor, max, &units, &n_units, &more);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_new_method_return(message, &reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(reply, 'a', "a{sv}");
+        if (r < 0)
+                return r;
+
+        for (k = 0; k < n_units; k++) {
+                r = reply_unit_info_ex(reply, units[k], properties);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(reply, 'a', "s");
+        if (r < 0)
+                return r;
+
+        /* Removals are reported with the first page only */
+        if (since > 0 && isempty(cursor) && m->unit_tombstones) {
+                for (k = 0; k < UNIT_TOMBSTONES_MAX; k++) {
+                        UnitTombstone *t = m->unit_tombstones + k;
+
+                        if (!t->id || t->generation <= since)
+                                continue;
+
+                        if (!strv_isempty(patterns) &&
+                            !strv_fnmatch_or_empty(patterns, t->id, FNM_NOESCAPE))
+                                continue;
+
+                        r = sd_bus_message_append(reply, "s", t->id);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_append(reply, "ts", m->unit_generation, more ? units[n_units - 1]->id : "");
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(NULL, reply, NULL);
+}
+
 static int method_list_jobs(sd_bus_message *message, void *userdata, sd_bus_error *error) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
         Manager *m = userdata;
@@ -1292,6 +1511,47 @@ static int method_dump(sd_bus_message *message, void *userdata, sd_bus_error *er
         return sd_bus_reply_method_return(message, "s", dump);
 }
 
+static int method_get_trace(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        Manager *m = userdata;
+        ManagerTraceSpan *t;
+        size_t i;
+        int r;
+
+        assert(message);
+        assert(m);
+
+        /* Anyone can call this method */
+
+        r = mac_selinux_access_check(message, "status", error);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_new_method_return(message, &reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(reply, 'a', "(sstt)");
+        if (r < 0)
+                return r;
+
+        for (i = 0; (t = manager_trace_span(m, i)); i++) {
+                r = sd_bus_message_append(reply, "(sstt)",
+                                          manager_trace_phase_to_string(t->phase),
+                                          strempty(t->name),
+                                          t->begin,
+                                          t->end);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(NULL, reply, NULL);
+}
+
 static int method_refuse_snapshot(sd_bus_message *message, void *userdata, sd_bus_error *error) {
         return sd_bus_error_setf(error, SD_BUS_ERROR_NOT_SUPPORTED, "Support for snapshots has been removed.");
 }
@@ -1330,8 +1590,7 @@ int verify_run_space_and_log(const char *message) {
         return r;
 }
 
-static int method_reload(sd_bus_message *message, void *userdata, sd_bus_error *error) {
-        Manager *m = userdata;
+static int reload_common(sd_bus_message *message, Manager *m, ManagerExitCode code, sd_bus_error *error) {
         int r;
 
         assert(message);
@@ -1361,11 +1620,19 @@ static int method_reload(sd_bus_message *message, void *userdata, sd_bus_error *
         if (r < 0)
                 return r;
 
-        m->exit_code = MANAGER_RELOAD;
+        m->exit_code = code;
 
         return 1;
 }
 
+static int method_reload(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        return reload_common(message, userdata, MANAGER_RELOAD, error);
+}
+
+static int method_reload_incremental(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        return reload_common(message, userdata, MANAGER_RELOAD_INCREMENTAL, error);
+}
+
 static int method_reexecute(sd_bus_message *message, void *userdata, sd_bus_error *error) {
         Manager *m = userdata;
         int r;
@@ -2466,6 +2733,7 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_PROPERTY("DefaultLimitRTTIME", "t", bus_property_get_rlimit, offsetof(Manager, rlimit[RLIMIT_RTTIME]), SD_BUS_VTABLE_PROPERTY_CONST),
         SD_BUS_PROPERTY("DefaultLimitRTTIMESoft", "t", bus_property_get_rlimit, offsetof(Manager, rlimit[RLIMIT_RTTIME]), SD_BUS_VTABLE_PROPERTY_CONST),
         SD_BUS_PROPERTY("DefaultTasksMax", "t", NULL, offsetof(Manager, default_tasks_max), SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("AccountingRefreshUSec", "t", bus_property_get_usec, offsetof(Manager, accounting_refresh_usec), SD_BUS_VTABLE_PROPERTY_CONST),
         SD_BUS_PROPERTY("TimerSlackNSec", "t", property_get_timer_slack_nsec, 0, SD_BUS_VTABLE_PROPERTY_CONST),
 
         SD_BUS_METHOD("GetUnit", "s", "o", method_get_unit, SD_BUS_VTABLE_UNPRIVILEGED),
@@ -2497,13 +2765,16 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_METHOD("ListUnitsFiltered", "as", "a(ssssssouso)", method_list_units_filtered, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("ListUnitsByPatterns", "asas", "a(ssssssouso)", method_list_units_by_patterns, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("ListUnitsByNames", "as", "a(ssssssouso)", method_list_units_by_names, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("ListUnitsEx", "asasasastsu", "aa{sv}asts", method_list_units_ex, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("ListJobs", NULL, "a(usssoo)", method_list_jobs, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Subscribe", NULL, NULL, method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Unsubscribe", NULL, NULL, method_unsubscribe, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Dump", NULL, "s", method_dump, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("GetTrace", NULL, "a(sstt)", method_get_trace, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("CreateSnapshot", "sb", "o", method_refuse_snapshot, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("RemoveSnapshot", "s", NULL, method_refuse_snapshot, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Reload", NULL, NULL, method_reload, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("ReloadIncremental", NULL, NULL, method_reload_incremental, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Reexecute", NULL, NULL, method_reexecute, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Exit", NULL, NULL, method_exit, 0),
         SD_BUS_METHOD("Reboot", NULL, NULL, method_reboot, SD_BUS_VTABLE_CAPABILITY(CAP_SYS_BOOT)),
@@ -106,21 +106,22 @@ static int property_get_dependencies(
                 void *userdata,
                 sd_bus_error *error) {
 
-        Hashmap *h = *(Hashmap**) userdata;
-        Iterator j;
-        Unit *u;
-        void *v;
+        UnitDependencyList *l = userdata;
+        UnitDependencyEntry *e;
+        unsigned j;
         int r;
 
         assert(bus);
         assert(reply);
+        assert(l);
 
         r = sd_bus_message_open_container(reply, 'a', "s");
         if (r < 0)
                 return r;
 
-        HASHMAP_FOREACH_KEY(v, u, h, j) {
-                r = sd_bus_message_append(reply, "s", u->id);
+        e = unit_dependency_list_entries(l);
+        for (j = 0; j < unit_dependency_list_size(l); j++) {
+                r = sd_bus_message_append(reply, "s", e[j].unit->id);
                 if (r < 0)
                         return r;
         }
@@ -701,6 +701,9 @@ static int bus_on_connection(sd_event_source *s, int fd, uint32_t revents, void
                 return 0;
         }
 
+        /* We emit signals in bursts, let's write them out in batches */
+        (void) bus_set_coalesce_writes(bus, true);
+
         r = bus_setup_disconnected_match(m, bus);
         if (r < 0)
                 return 0;
@@ -867,6 +870,8 @@ static int bus_init_api(Manager *m) {
                 if (r < 0)
                         return log_error_errno(r, "Failed to attach API bus to event loop: %m");
 
+                (void) bus_set_coalesce_writes(bus, true);
+
                 r = bus_setup_disconnected_match(m, bus);
                 if (r < 0)
                         return r;
@@ -931,6 +936,8 @@ static int bus_init_system(Manager *m) {
         if (r < 0)
                 return log_error_errno(r, "Failed to attach system bus to event loop: %m");
 
+        (void) bus_set_coalesce_writes(bus, true);
+
         r = bus_setup_system(m, bus);
         if (r < 0)
                 return log_error_errno(r, "Failed to set up system bus: %m");
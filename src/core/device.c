@@ -26,6 +26,7 @@
 #include "alloc-util.h"
 #include "dbus-device.h"
 #include "device.h"
+#include "libudev-private.h"
 #include "log.h"
 #include "parse-util.h"
 #include "path-util.h"
@@ -329,13 +330,12 @@ static bool device_is_bound_by_mounts(Device *d, struct udev_device *dev) {
 
 static int device_upgrade_mount_deps(Unit *u) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
         int r;
 
         /* Let's upgrade Requires= to BindsTo= on us. (Used when SYSTEMD_MOUNT_DEVICE_BOUND is set) */
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REQUIRED_BY], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REQUIRED_BY, i) {
                 if (other->type != UNIT_MOUNT)
                         continue;
 
@@ -758,41 +758,23 @@ fail:
         device_shutdown(m);
 }
 
-static int device_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
-        _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
-        Manager *m = userdata;
+static void device_dispatch_udev_device(Manager *m, struct udev_device *dev) {
         const char *action, *sysfs;
         int r;
 
         assert(m);
-
-        if (revents != EPOLLIN) {
-                static RATELIMIT_DEFINE(limit, 10*USEC_PER_SEC, 5);
-
-                if (!ratelimit_test(&limit))
-                        log_error_errno(errno, "Failed to get udev event: %m");
-                if (!(revents & EPOLLIN))
-                        return 0;
-        }
-
-        /*
-         * libudev might filter-out devices which pass the bloom
-         * filter, so getting NULL here is not necessarily an error.
-         */
-        dev = udev_monitor_receive_device(m->udev_monitor);
-        if (!dev)
-                return 0;
+        assert(dev);
 
         sysfs = udev_device_get_syspath(dev);
         if (!sysfs) {
                 log_error("Failed to get udev sys path.");
-                return 0;
+                return;
         }
 
         action = udev_device_get_action(dev);
         if (!action) {
                 log_error("Failed to get udev action string.");
-                return 0;
+                return;
         }
 
         if (streq(action, "change"))  {
@@ -843,6 +825,34 @@ static int device_dispatch_io(sd_event_source *source, int fd, uint32_t revents,
 
                 device_update_found_by_sysfs(m, sysfs, false, DEVICE_FOUND_UDEV, true);
         }
+}
+
+static int device_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        struct udev_device *devs[UDEV_MONITOR_BATCH_MAX];
+        Manager *m = userdata;
+        int i, n;
+
+        assert(m);
+
+        if (revents != EPOLLIN) {
+                static RATELIMIT_DEFINE(limit, 10*USEC_PER_SEC, 5);
+
+                if (!ratelimit_test(&limit))
+                        log_error_errno(errno, "Failed to get udev event: %m");
+                if (!(revents & EPOLLIN))
+                        return 0;
+        }
+
+        /*
+         * During device storms many events are queued at once, pick them all
+         * up with a single call. libudev might filter-out devices which pass
+         * the bloom filter, so getting nothing here is not necessarily an error.
+         */
+        n = udev_monitor_receive_devices(m->udev_monitor, devs, ELEMENTSOF(devs));
+        for (i = 0; i < n; i++) {
+                device_dispatch_udev_device(m, devs[i]);
+                udev_device_unref(devs[i]);
+        }
 
         return 0;
 }
@@ -18,6 +18,7 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glob.h>
@@ -33,6 +34,7 @@
 #include <sys/shm.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -329,25 +331,24 @@ static int connect_journal_socket(int fd, uid_t uid, gid_t gid) {
         return r;
 }
 
-static int connect_logger_as(
+static int acquire_logger(
                 Unit *unit,
                 const ExecContext *context,
                 const ExecParameters *params,
                 ExecOutput output,
                 const char *ident,
-                int nfd,
                 uid_t uid,
                 gid_t gid) {
 
-        int fd, r;
+        _cleanup_close_ int fd = -1;
+        int r;
 
         assert(context);
         assert(params);
         assert(output < _EXEC_OUTPUT_MAX);
         assert(ident);
-        assert(nfd >= 0);
 
-        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
         if (fd < 0)
                 return -errno;
 
@@ -355,10 +356,8 @@ static int connect_logger_as(
         if (r < 0)
                 return r;
 
-        if (shutdown(fd, SHUT_RD) < 0) {
-                safe_close(fd);
+        if (shutdown(fd, SHUT_RD) < 0)
                 return -errno;
-        }
 
         (void) fd_inc_sndbuf(fd, SNDBUF_SIZE);
 
@@ -378,6 +377,30 @@ static int connect_logger_as(
                 is_kmsg_output(output),
                 is_terminal_output(output));
 
+        r = fd;
+        fd = -1;
+
+        return r;
+}
+
+static int connect_logger_as(
+                Unit *unit,
+                const ExecContext *context,
+                const ExecParameters *params,
+                ExecOutput output,
+                const char *ident,
+                int nfd,
+                uid_t uid,
+                gid_t gid) {
+
+        int fd;
+
+        assert(nfd >= 0);
+
+        fd = acquire_logger(unit, context, params, output, ident, uid, gid);
+        if (fd < 0)
+                return fd;
+
         return move_fd(fd, nfd, false);
 }
 static int open_terminal_as(const char *path, int flags, int nfd) {
@@ -2707,6 +2730,267 @@ static int compile_suggested_paths(const ExecContext *c, const ExecParameters *p
         return 0;
 }
 
+/* The credentials of the process to execute, and what to do with them. Shared by exec_child() and the fast path, see
+ * apply_resource_limits(), apply_credentials() and apply_privilege_restrictions(). */
+typedef struct ExecCredentials {
+        uid_t uid;
+        gid_t gid;
+        gid_t *supplementary_gids;
+        int n_supplementary_gids;
+
+        bool needs_sandboxing;     /* Do we need to set up full sandboxing? (i.e. all namespacing, all MAC stuff, caps, yadda yadda */
+        bool needs_setuid;         /* Do we need to do the actual setresuid()/setresgid() calls? */
+        bool needs_ambient_hack;   /* Do we need to apply the ambient capabilities hack? */
+        int no_new_privileges;     /* < 0 if to be determined after the UID change */
+} ExecCredentials;
+
+static void exec_credentials_init(
+                ExecCredentials *c,
+                const ExecCommand *command,
+                const ExecParameters *params) {
+
+        assert(c);
+        assert(command);
+        assert(params);
+
+        *c = (ExecCredentials) {
+                .uid = UID_INVALID,
+                .gid = GID_INVALID,
+                .no_new_privileges = -1,
+        };
+
+        /* We need sandboxing if the caller asked us to apply it and the command isn't explicitly excepted from it */
+        c->needs_sandboxing = (params->flags & EXEC_APPLY_SANDBOXING) && !(command->flags & EXEC_COMMAND_FULLY_PRIVILEGED);
+
+        /* We need the ambient capability hack, if the caller asked us to apply it and the command is marked for it, and the kernel doesn't actually support ambient caps */
+        c->needs_ambient_hack = (params->flags & EXEC_APPLY_SANDBOXING) && (command->flags & EXEC_COMMAND_AMBIENT_MAGIC) && !ambient_capabilities_supported();
+
+        /* We need setresuid() if the caller asked us to apply sandboxing and the command isn't explicitly excepted from either whole sandboxing or just setresuid() itself, and the ambient hack is not desired */
+        if (c->needs_ambient_hack)
+                c->needs_setuid = false;
+        else
+                c->needs_setuid = (params->flags & EXEC_APPLY_SANDBOXING) && !(command->flags & (EXEC_COMMAND_FULLY_PRIVILEGED|EXEC_COMMAND_NO_SETUID));
+}
+
+static int apply_resource_limits(const ExecContext *context, const ExecCredentials *c, int *exit_status) {
+        int i, r;
+
+        assert(context);
+        assert(c);
+        assert(exit_status);
+
+        /* Applies the resource limits. Shared by exec_child() and exec_fast_spawn_child(), and like
+         * apply_credentials() and apply_privilege_restrictions() below this only issues system calls and doesn't
+         * log, the caller does that based on the exit status. */
+
+        if (!c->needs_sandboxing)
+                return 0;
+
+        for (i = 0; i < _RLIMIT_MAX; i++) {
+
+                if (!context->rlimit[i])
+                        continue;
+
+                r = setrlimit_closest(i, context->rlimit[i]);
+                if (r < 0) {
+                        *exit_status = EXIT_LIMITS;
+                        return r;
+                }
+        }
+
+        /* Set the RTPRIO resource limit to 0, but only if nothing else was explicitly requested. */
+        if (context->restrict_realtime && !context->rlimit[RLIMIT_RTPRIO]) {
+                if (setrlimit(RLIMIT_RTPRIO, &RLIMIT_MAKE_CONST(0)) < 0) {
+                        *exit_status = EXIT_LIMITS;
+                        return -errno;
+                }
+        }
+
+        return 0;
+}
+
+static int apply_credentials(const ExecContext *context, const ExecCredentials *c, int *secure_bits, int *exit_status) {
+        int r;
+
+        assert(context);
+        assert(c);
+        assert(secure_bits);
+        assert(exit_status);
+
+        /* Drops the capabilities and changes the user, and returns the secure bits to apply afterwards. The groups
+         * are changed by the caller already. */
+
+        *secure_bits = context->secure_bits;
+
+        if (c->needs_sandboxing) {
+                uint64_t bset;
+
+                bset = context->capability_bounding_set;
+                /* If the ambient caps hack is enabled (which means the kernel can't do them, and the user asked for
+                 * our magic fallback), then let's add some extra caps, so that the service can drop privs of its own,
+                 * instead of us doing that */
+                if (c->needs_ambient_hack)
+                        bset |= (UINT64_C(1) << CAP_SETPCAP) |
+                                (UINT64_C(1) << CAP_SETUID) |
+                                (UINT64_C(1) << CAP_SETGID);
+
+                if (!cap_test_all(bset)) {
+                        r = capability_bounding_set_drop(bset, false);
+                        if (r < 0) {
+                                *exit_status = EXIT_CAPABILITIES;
+                                return r;
+                        }
+                }
+
+                /* This is done before enforce_user, but ambient set
+                 * does not survive over setresuid() if keep_caps is not set. */
+                if (!c->needs_ambient_hack &&
+                    context->capability_ambient_set != 0) {
+                        r = capability_ambient_set_apply(context->capability_ambient_set, true);
+                        if (r < 0) {
+                                *exit_status = EXIT_CAPABILITIES;
+                                return r;
+                        }
+                }
+        }
+
+        if (c->needs_setuid) {
+                if (context->user) {
+                        r = enforce_user(context, c->uid);
+                        if (r < 0) {
+                                *exit_status = EXIT_USER;
+                                return r;
+                        }
+
+                        if (!c->needs_ambient_hack &&
+                            context->capability_ambient_set != 0) {
+
+                                /* Fix the ambient capabilities after user change. */
+                                r = capability_ambient_set_apply(context->capability_ambient_set, false);
+                                if (r < 0) {
+                                        *exit_status = EXIT_CAPABILITIES;
+                                        return r;
+                                }
+
+                                /* If we were asked to change user and ambient capabilities
+                                 * were requested, we had to add keep-caps to the securebits
+                                 * so that we would maintain the inherited capability set
+                                 * through the setresuid(). Make sure that the bit is added
+                                 * also to the context secure_bits so that we don't try to
+                                 * drop the bit away next. */
+
+                                *secure_bits |= 1<<SECURE_KEEP_CAPS;
+                        }
+                }
+        }
+
+        return 0;
+}
+
+static int apply_privilege_restrictions(const ExecContext *context, const ExecCredentials *c, int secure_bits, int *exit_status) {
+        int no_new_privileges;
+
+        assert(context);
+        assert(c);
+        assert(exit_status);
+
+        if (!c->needs_sandboxing)
+                return 0;
+
+        /* PR_GET_SECUREBITS is not privileged, while PR_SET_SECUREBITS is. So to suppress potential EPERMs
+         * we'll try not to call PR_SET_SECUREBITS unless necessary. */
+        if (prctl(PR_GET_SECUREBITS) != secure_bits)
+                if (prctl(PR_SET_SECUREBITS, secure_bits) < 0) {
+                        *exit_status = EXIT_SECUREBITS;
+                        return -errno;
+                }
+
+        /* The fast path determines this beforehand, as it never changes the user */
+        no_new_privileges = c->no_new_privileges >= 0 ? c->no_new_privileges : context_has_no_new_privileges(context);
+        if (no_new_privileges)
+                if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
+                        *exit_status = EXIT_NO_NEW_PRIVILEGES;
+                        return -errno;
+                }
+
+        return 0;
+}
+
+static int build_accumulated_environment(
+                Unit *u,
+                const ExecContext *c,
+                const ExecParameters *p,
+                unsigned n_fds,
+                const char *home,
+                const char *username,
+                const char *shell,
+                dev_t journal_stream_dev,
+                ino_t journal_stream_ino,
+                char **files_env,
+                char ***ret) {
+
+        _cleanup_strv_free_ char **our_env = NULL, **pass_env = NULL;
+        char **accum_env;
+        int r;
+
+        assert(c);
+        assert(p);
+        assert(ret);
+
+        /* The environment of the process to execute, in the order of precedence. Shared by exec_child() and the
+         * fast path, which adds the PAM environment and drops UnsetEnvironment= on top of this. */
+
+        r = build_environment(
+                        u,
+                        c,
+                        p,
+                        n_fds,
+                        home,
+                        username,
+                        shell,
+                        journal_stream_dev,
+                        journal_stream_ino,
+                        &our_env);
+        if (r < 0)
+                return r;
+
+        r = build_pass_environment(c, &pass_env);
+        if (r < 0)
+                return r;
+
+        accum_env = strv_env_merge(5,
+                                   p->environment,
+                                   our_env,
+                                   pass_env,
+                                   c->environment,
+                                   files_env,
+                                   NULL);
+        if (!accum_env)
+                return -ENOMEM;
+
+        *ret = strv_env_clean(accum_env);
+        return 0;
+}
+
+static int apply_unset_environment(const ExecContext *c, char ***env) {
+        char **ee;
+
+        assert(c);
+        assert(env);
+
+        if (strv_isempty(c->unset_environment))
+                return 0;
+
+        ee = strv_env_delete(*env, 1, c->unset_environment);
+        if (!ee)
+                return -ENOMEM;
+
+        strv_free(*env);
+        *env = ee;
+
+        return 0;
+}
+
 static int exec_child(
                 Unit *unit,
                 ExecCommand *command,
@@ -2724,17 +3008,15 @@ static int exec_child(
                 int user_lookup_fd,
                 int *exit_status) {
 
-        _cleanup_strv_free_ char **our_env = NULL, **pass_env = NULL, **accum_env = NULL, **final_argv = NULL;
+        _cleanup_strv_free_ char **accum_env = NULL, **final_argv = NULL;
         _cleanup_free_ char *home_buffer = NULL;
         _cleanup_free_ gid_t *supplementary_gids = NULL;
         const char *username = NULL, *groupname = NULL;
         const char *home = NULL, *shell = NULL;
         dev_t journal_stream_dev = 0;
         ino_t journal_stream_ino = 0;
-        bool needs_sandboxing,          /* Do we need to set up full sandboxing? (i.e. all namespacing, all MAC stuff, caps, yadda yadda */
-                needs_setuid,           /* Do we need to do the actual setresuid()/setresgid() calls? */
-                needs_mount_namespace,  /* Do we need to set up a mount namespace for this kernel? */
-                needs_ambient_hack;     /* Do we need to apply the ambient capabilities hack? */
+        bool needs_mount_namespace;     /* Do we need to set up a mount namespace for this kernel? */
+        ExecCredentials creds;
 #if HAVE_SELINUX
         _cleanup_free_ char *mac_selinux_context_net = NULL;
         bool use_selinux = false;
@@ -2747,10 +3029,9 @@ static int exec_child(
 #endif
         uid_t uid = UID_INVALID;
         gid_t gid = GID_INVALID;
-        int i, r, ngids = 0;
+        int secure_bits, r, ngids = 0;
         unsigned n_fds;
         ExecDirectoryType dt;
-        int secure_bits;
 
         assert(unit);
         assert(command);
@@ -3035,7 +3316,7 @@ static int exec_child(
                         return log_unit_error_errno(unit, r, "Failed to set up special execution directory in %s: %m", params->prefix[dt]);
         }
 
-        r = build_environment(
+        r = build_accumulated_environment(
                         unit,
                         context,
                         params,
@@ -3045,31 +3326,13 @@ static int exec_child(
                         shell,
                         journal_stream_dev,
                         journal_stream_ino,
-                        &our_env);
+                        files_env,
+                        &accum_env);
         if (r < 0) {
                 *exit_status = EXIT_MEMORY;
                 return log_oom();
         }
 
-        r = build_pass_environment(context, &pass_env);
-        if (r < 0) {
-                *exit_status = EXIT_MEMORY;
-                return log_oom();
-        }
-
-        accum_env = strv_env_merge(5,
-                                   params->environment,
-                                   our_env,
-                                   pass_env,
-                                   context->environment,
-                                   files_env,
-                                   NULL);
-        if (!accum_env) {
-                *exit_status = EXIT_MEMORY;
-                return log_oom();
-        }
-        accum_env = strv_env_clean(accum_env);
-
         (void) umask(context->umask);
 
         r = setup_keyring(unit, context, params, uid, gid);
@@ -3078,19 +3341,13 @@ static int exec_child(
                 return log_unit_error_errno(unit, r, "Failed to set up kernel keyring: %m");
         }
 
-        /* We need sandboxing if the caller asked us to apply it and the command isn't explicitly excepted from it */
-        needs_sandboxing = (params->flags & EXEC_APPLY_SANDBOXING) && !(command->flags & EXEC_COMMAND_FULLY_PRIVILEGED);
-
-        /* We need the ambient capability hack, if the caller asked us to apply it and the command is marked for it, and the kernel doesn't actually support ambient caps */
-        needs_ambient_hack = (params->flags & EXEC_APPLY_SANDBOXING) && (command->flags & EXEC_COMMAND_AMBIENT_MAGIC) && !ambient_capabilities_supported();
-
-        /* We need setresuid() if the caller asked us to apply sandboxing and the command isn't explicitly excepted from either whole sandboxing or just setresuid() itself, and the ambient hack is not desired */
-        if (needs_ambient_hack)
-                needs_setuid = false;
-        else
-                needs_setuid = (params->flags & EXEC_APPLY_SANDBOXING) && !(command->flags & (EXEC_COMMAND_FULLY_PRIVILEGED|EXEC_COMMAND_NO_SETUID));
+        exec_credentials_init(&creds, command, params);
+        creds.uid = uid;
+        creds.gid = gid;
+        creds.supplementary_gids = supplementary_gids;
+        creds.n_supplementary_gids = ngids;
 
-        if (needs_sandboxing) {
+        if (creds.needs_sandboxing) {
                 /* MAC enablement checks need to be done before a new mount ns is created, as they rely on /sys being
                  * present. The actual MAC context application will happen later, as late as possible, to avoid
                  * impacting our own code paths. */
@@ -3106,7 +3363,7 @@ static int exec_child(
 #endif
         }
 
-        if (needs_setuid) {
+        if (creds.needs_setuid) {
                 if (context->pam_name && username) {
                         r = setup_pam(context->pam_name, username, uid, gid, context->tty_path, &accum_env, fds, n_fds);
                         if (r < 0) {
@@ -3142,7 +3399,7 @@ static int exec_child(
                 return log_unit_error_errno(unit, r, "Changing to the requested working directory failed: %m");
 
         /* Drop groups as early as possbile */
-        if (needs_setuid) {
+        if (creds.needs_setuid) {
                 r = enforce_groups(gid, supplementary_gids, ngids);
                 if (r < 0) {
                         *exit_status = EXIT_GROUP;
@@ -3150,7 +3407,7 @@ static int exec_child(
                 }
         }
 
-        if (needs_sandboxing) {
+        if (creds.needs_sandboxing) {
 #if HAVE_SELINUX
                 if (use_selinux && params->selinux_context_net && socket_fd >= 0) {
                         r = mac_selinux_get_child_mls_label(socket_fd, command->path, context->selinux_context, &mac_selinux_context_net);
@@ -3183,262 +3440,1293 @@ static int exec_child(
                 return log_unit_error_errno(unit, r, "Failed to adjust passed file descriptors: %m");
         }
 
-        secure_bits = context->secure_bits;
+        r = apply_resource_limits(context, &creds, exit_status);
+        if (r < 0)
+                return log_unit_error_errno(unit, r, "Failed to adjust resource limits: %m");
 
-        if (needs_sandboxing) {
-                uint64_t bset;
+#if ENABLE_SMACK
+        /* LSM Smack needs the capability CAP_MAC_ADMIN to change the current execution security context of the
+         * process. This is the latest place before dropping capabilities. Other MAC context are set later. */
+        if (creds.needs_sandboxing && use_smack) {
+                r = setup_smack(context, command);
+                if (r < 0) {
+                        *exit_status = EXIT_SMACK_PROCESS_LABEL;
+                        return log_unit_error_errno(unit, r, "Failed to set SMACK process label: %m");
+                }
+        }
+#endif
 
-                for (i = 0; i < _RLIMIT_MAX; i++) {
+        r = apply_credentials(context, &creds, &secure_bits, exit_status);
+        if (r < 0)
+                return log_unit_error_errno(unit, r, "Failed to change capabilities and user credentials (%s): %m",
+                                            exit_status_to_string(*exit_status, EXIT_STATUS_SYSTEMD));
 
-                        if (!context->rlimit[i])
-                                continue;
+        if (creds.needs_sandboxing) {
+                /* Apply other MAC contexts late, but before seccomp syscall filtering, as those should really be last to
+                 * influence our own codepaths as little as possible. Moreover, applying MAC contexts usually requires
+                 * syscalls that are subject to seccomp filtering, hence should probably be applied before the syscalls
+                 * are restricted. */
 
-                        r = setrlimit_closest(i, context->rlimit[i]);
-                        if (r < 0) {
-                                *exit_status = EXIT_LIMITS;
-                                return log_unit_error_errno(unit, r, "Failed to adjust resource limit %s: %m", rlimit_to_string(i));
-                        }
-                }
+#if HAVE_SELINUX
+                if (use_selinux) {
+                        char *exec_context = mac_selinux_context_net ?: context->selinux_context;
 
-                /* Set the RTPRIO resource limit to 0, but only if nothing else was explicitly requested. */
-                if (context->restrict_realtime && !context->rlimit[RLIMIT_RTPRIO]) {
-                        if (setrlimit(RLIMIT_RTPRIO, &RLIMIT_MAKE_CONST(0)) < 0) {
-                                *exit_status = EXIT_LIMITS;
-                                return log_unit_error_errno(unit, errno, "Failed to adjust RLIMIT_RTPRIO resource limit: %m");
+                        if (exec_context) {
+                                r = setexeccon(exec_context);
+                                if (r < 0) {
+                                        *exit_status = EXIT_SELINUX_CONTEXT;
+                                        return log_unit_error_errno(unit, r, "Failed to change SELinux context to %s: %m", exec_context);
+                                }
                         }
                 }
+#endif
 
-#if ENABLE_SMACK
-                /* LSM Smack needs the capability CAP_MAC_ADMIN to change the current execution security context of the
-                 * process. This is the latest place before dropping capabilities. Other MAC context are set later. */
-                if (use_smack) {
-                        r = setup_smack(context, command);
-                        if (r < 0) {
-                                *exit_status = EXIT_SMACK_PROCESS_LABEL;
-                                return log_unit_error_errno(unit, r, "Failed to set SMACK process label: %m");
+#if HAVE_APPARMOR
+                if (use_apparmor && context->apparmor_profile) {
+                        r = aa_change_onexec(context->apparmor_profile);
+                        if (r < 0 && !context->apparmor_profile_ignore) {
+                                *exit_status = EXIT_APPARMOR_PROFILE;
+                                return log_unit_error_errno(unit, errno, "Failed to prepare AppArmor profile change to %s: %m", context->apparmor_profile);
                         }
                 }
 #endif
+        }
 
-                bset = context->capability_bounding_set;
-                /* If the ambient caps hack is enabled (which means the kernel can't do them, and the user asked for
-                 * our magic fallback), then let's add some extra caps, so that the service can drop privs of its own,
-                 * instead of us doing that */
-                if (needs_ambient_hack)
-                        bset |= (UINT64_C(1) << CAP_SETPCAP) |
-                                (UINT64_C(1) << CAP_SETUID) |
-                                (UINT64_C(1) << CAP_SETGID);
+        r = apply_privilege_restrictions(context, &creds, secure_bits, exit_status);
+        if (r < 0)
+                return log_unit_error_errno(unit, r, "Failed to restrict privileges (%s): %m",
+                                            exit_status_to_string(*exit_status, EXIT_STATUS_SYSTEMD));
+
+        if (creds.needs_sandboxing) {
+                /* Apply seccomp last, as it should really influence our own codepaths as little as possible. */
+
+#if HAVE_SECCOMP
+                r = apply_address_families(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_ADDRESS_FAMILIES;
+                        return log_unit_error_errno(unit, r, "Failed to restrict address families: %m");
+                }
+
+                r = apply_memory_deny_write_execute(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to disable writing to executable memory: %m");
+                }
+
+                r = apply_restrict_realtime(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply realtime restrictions: %m");
+                }
+
+                r = apply_restrict_namespaces(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply namespace restrictions: %m");
+                }
+
+                r = apply_protect_sysctl(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply sysctl restrictions: %m");
+                }
+
+                r = apply_protect_kernel_modules(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply module loading restrictions: %m");
+                }
+
+                r = apply_private_devices(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to set up private devices: %m");
+                }
+
+                r = apply_syscall_archs(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply syscall architecture restrictions: %m");
+                }
+
+                r = apply_lock_personality(unit, context);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to lock personalities: %m");
+                }
+
+                /* This really should remain the last step before the execve(), to make sure our own code is unaffected
+                 * by the filter as little as possible. */
+                r = apply_syscall_filter(unit, context, creds.needs_ambient_hack);
+                if (r < 0) {
+                        *exit_status = EXIT_SECCOMP;
+                        return log_unit_error_errno(unit, r, "Failed to apply system call filters: %m");
+                }
+#endif
+        }
+
+        r = apply_unset_environment(context, &accum_env);
+        if (r < 0) {
+                *exit_status = EXIT_MEMORY;
+                return log_oom();
+        }
+
+        final_argv = replace_env_argv(argv, accum_env);
+        if (!final_argv) {
+                *exit_status = EXIT_MEMORY;
+                return log_oom();
+        }
+
+        if (DEBUG_LOGGING) {
+                _cleanup_free_ char *line;
+
+                line = exec_command_line(final_argv);
+                if (line) {
+                        log_struct(LOG_DEBUG,
+                                   "EXECUTABLE=%s", command->path,
+                                   LOG_UNIT_MESSAGE(unit, "Executing: %s", line),
+                                   LOG_UNIT_ID(unit),
+                                   LOG_UNIT_INVOCATION_ID(unit),
+                                   NULL);
+                }
+        }
+
+        execve(command->path, final_argv, accum_env);
+
+        if (errno == ENOENT && (command->flags & EXEC_COMMAND_IGNORE_FAILURE)) {
+
+                log_struct_errno(LOG_INFO, errno,
+                                 "MESSAGE_ID=" SD_MESSAGE_SPAWN_FAILED_STR,
+                                 LOG_UNIT_ID(unit),
+                                 LOG_UNIT_INVOCATION_ID(unit),
+                                 LOG_UNIT_MESSAGE(unit, "Executable %s missing, skipping: %m",
+                                                  command->path),
+                                 "EXECUTABLE=%s", command->path,
+                                 NULL);
+
+                return 0;
+        }
+
+        *exit_status = EXIT_EXEC;
+        return log_unit_error_errno(unit, errno, "Failed to execute command: %m");
+}
+
+typedef struct ExecFastSpawn {
+        /* Set up by the parent. Owned by the spawner thread once that runs, hence nothing in here refers to memory
+         * of the unit, as the manager carries on while the child is set up. */
+        ExecContext context;    /* only the fields the child looks at, see exec_fast_spawn_copy_context() */
+        char *path;
+        char **argv;
+        char **envp;
+        char *listen_pid;       /* point into envp, the child writes its PID there */
+        char *watchdog_pid;
+        int stdio[3];           /* -1 if the fd is left as it is */
+        char *stdio_logger[3];  /* if set, stdio[] is an unconnected socket, which the child connects to the journal
+                                 * and sends this header to */
+        bool stderr_from_stdout;
+        int *fds;               /* duplicates of the passed fds */
+        int *child_fds;         /* the same, the child renumbers them in place */
+        unsigned n_storage_fds;
+        unsigned n_socket_fds;
+        char **cgroup_procs;    /* the first one is mandatory, the others are best effort */
+        char *working_directory;
+        ExecCredentials credentials;
+        sd_id128_t invocation_id;
+        bool new_keyring;
+        bool ignore_enoent;
+        int report_fd;          /* the child writes its PID to it, the spawner thread the ExecFastSpawnReport */
+
+        /* Set by the child */
+        int exit_status;
+        int error;              /* if it failed before execve() */
+        int logger_error;       /* if it failed to connect to the journal */
+} ExecFastSpawn;
+
+typedef struct ExecFastSpawnReport {
+        int exit_status;
+        int error;
+        int logger_error;
+} ExecFastSpawnReport;
+
+/* What the manager needs to log the ExecFastSpawnReport, see exec_fast_spawn_dispatch_report() */
+typedef struct ExecFastSpawnReportContext {
+        Manager *manager;
+        char *unit_id;
+        char *path;
+} ExecFastSpawnReportContext;
+
+static ExecFastSpawn *exec_fast_spawn_free(ExecFastSpawn *s) {
+        unsigned i;
+
+        if (!s)
+                return NULL;
+
+        for (i = 0; i < _RLIMIT_MAX; i++)
+                free(s->context.rlimit[i]);
+        free(s->context.cpuset);
+
+        free(s->path);
+        strv_free(s->argv);
+        strv_free(s->envp);
+        strv_free(s->cgroup_procs);
+        free(s->working_directory);
+
+        close_many(s->fds, s->n_storage_fds + s->n_socket_fds);
+        free(s->fds);
+        free(s->child_fds);
+
+        /* stdout might be the same fd as stdin, see exec_fast_spawn_prepare_stdio() */
+        for (i = 0; i < 3; i++) {
+                if (s->stdio[i] >= 0 && !fd_in_set(s->stdio[i], s->stdio, i))
+                        safe_close(s->stdio[i]);
+                free(s->stdio_logger[i]);
+        }
+
+        safe_close(s->report_fd);
+
+        return mfree(s);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(ExecFastSpawn*, exec_fast_spawn_free);
+
+static ExecFastSpawnReportContext *exec_fast_spawn_report_context_free(ExecFastSpawnReportContext *c) {
+        if (!c)
+                return NULL;
+
+        free(c->unit_id);
+        free(c->path);
+
+        return mfree(c);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(ExecFastSpawnReportContext*, exec_fast_spawn_report_context_free);
+
+static bool exec_fast_spawn_supported(
+                Unit *unit,
+                const ExecCommand *command,
+                const ExecContext *context,
+                const ExecParameters *params,
+                const ExecRuntime *runtime,
+                char **argv) {
+
+        ExecDirectoryType dt;
+        char **i;
+        int r;
+
+        assert(unit);
+        assert(command);
+        assert(context);
+        assert(params);
+
+        /* The fast path only covers what can be set up in the child with plain system calls on data prepared in
+         * the parent: no user or group changes, PAM, namespaces, directories, MAC or seccomp. Everything else
+         * takes the fork() path. */
+
+        r = getenv_bool("SYSTEMD_EXEC_FAST_SPAWN");
+        if (r == 0)
+                return false;
+
+        if (!CLONE_VFORK_SUPPORTED)
+                return false;
+
+        if (unit_shall_confirm_spawn(unit))
+                return false;
+
+        if (params->idle_pipe ||
+            params->stdin_fd >= 0 || params->stdout_fd >= 0 || params->stderr_fd >= 0 ||
+            params->selinux_context_net)
+                return false;
+
+        /* Only the users and groups that are resolved without NSS */
+        if (context->dynamic_user ||
+            (context->user && !STR_IN_SET(context->user, "root", "0")) ||
+            (context->group && !STR_IN_SET(context->group, "root", "0")) ||
+            !strv_isempty(context->supplementary_groups) ||
+            context->pam_name)
+                return false;
+
+        /* ... and only if that's who we are already. In a multi-threaded process glibc implements the set*id()
+         * calls by signalling all threads, which the child can't do, see exec_spawn_fast() */
+        if ((context->user && getuid() != 0) ||
+            (context->group && getgid() != 0))
+                return false;
+
+        if (!IN_SET(context->std_input, EXEC_INPUT_NULL, EXEC_INPUT_SOCKET, EXEC_INPUT_NAMED_FD, EXEC_INPUT_DATA) ||
+            IN_SET(context->std_output, EXEC_OUTPUT_TTY, EXEC_OUTPUT_FILE) ||
+            IN_SET(context->std_error, EXEC_OUTPUT_TTY, EXEC_OUTPUT_FILE) ||
+            exec_context_needs_term(context) ||
+            context->tty_reset || context->tty_vhangup || context->tty_vt_disallocate ||
+            context->utmp_id)
+                return false;
+
+        if (context->root_directory ||
+            context->working_directory_home ||
+            exec_needs_mount_namespace(context, params, runtime) ||
+            context->private_network ||
+            context->private_users)
+                return false;
+
+        for (dt = 0; dt < _EXEC_DIRECTORY_TYPE_MAX; dt++)
+                if (!strv_isempty(context->directories[dt].paths))
+                        return false;
+
+        if (context->keyring_mode == EXEC_KEYRING_SHARED)
+                return false;
+
+        if (context->restrict_realtime ||
+            !cap_test_all(context->capability_bounding_set) ||
+            context->capability_ambient_set != 0 ||
+            context->selinux_context ||
+            context->apparmor_profile ||
+            context->smack_process_label ||
+            context_has_address_families(context) ||
+            context_has_syscall_filters(context) ||
+            !set_isempty(context->syscall_archs) ||
+            context->memory_deny_write_execute ||
+            exec_context_restrict_namespaces_set(context) ||
+            context->lock_personality)
+                return false;
+
+#if ENABLE_SMACK
+        if (mac_smack_use())
+                return false;
+#endif
+
+        if ((params->flags & EXEC_CGROUP_DELEGATE) && context->user)
+                return false;
+
+        /* The PIDs are only known in the child, after the command line has been expanded already */
+        STRV_FOREACH(i, argv)
+                if (strstr(*i, "LISTEN_PID") || strstr(*i, "WATCHDOG_PID"))
+                        return false;
+
+        return true;
+}
+
+static int exec_fast_spawn_prepare_output(
+                Unit *unit,
+                const ExecContext *context,
+                const ExecParameters *params,
+                ExecFastSpawn *s,
+                int fileno,
+                ExecOutput o,
+                int socket_fd,
+                int named_iofds[3],
+                const char *ident,
+                dev_t *journal_stream_dev,
+                ino_t *journal_stream_ino) {
+
+        struct stat st;
+        int fd;
+
+        /* The equivalent of the switch statement in setup_output(), for the output types we support */
+
+        switch (o) {
+
+        case EXEC_OUTPUT_NULL:
+                fd = open("/dev/null", O_WRONLY|O_NOCTTY|O_CLOEXEC);
+                if (fd < 0)
+                        return -errno;
+                break;
+
+        case EXEC_OUTPUT_SYSLOG:
+        case EXEC_OUTPUT_SYSLOG_AND_CONSOLE:
+        case EXEC_OUTPUT_KMSG:
+        case EXEC_OUTPUT_KMSG_AND_CONSOLE:
+        case EXEC_OUTPUT_JOURNAL:
+        case EXEC_OUTPUT_JOURNAL_AND_CONSOLE:
+                /* Connecting might block if journald is busy, so only the child does that, see
+                 * exec_fast_spawn_connect_logger(). The socket's inode is the same before and after. */
+                if (asprintf(&s->stdio_logger[fileno],
+                             "%s\n"
+                             "%s\n"
+                             "%i\n"
+                             "%i\n"
+                             "%i\n"
+                             "%i\n"
+                             "%i\n",
+                             context->syslog_identifier ?: ident,
+                             params->flags & EXEC_PASS_LOG_UNIT ? unit->id : "",
+                             context->syslog_priority,
+                             !!context->syslog_level_prefix,
+                             is_syslog_output(o),
+                             is_kmsg_output(o),
+                             is_terminal_output(o)) < 0) {
+                        s->stdio_logger[fileno] = NULL;
+                        return -ENOMEM;
+                }
+
+                fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+                if (fd < 0)
+                        return -errno;
+
+                if (fstat(fd, &st) >= 0 &&
+                    (*journal_stream_ino == 0 || fileno == STDERR_FILENO)) {
+                        *journal_stream_dev = st.st_dev;
+                        *journal_stream_ino = st.st_ino;
+                }
+                break;
+
+        case EXEC_OUTPUT_SOCKET:
+                assert(socket_fd >= 0);
+
+                fd = fcntl(socket_fd, F_DUPFD_CLOEXEC, 3);
+                if (fd < 0)
+                        return -errno;
+                break;
+
+        case EXEC_OUTPUT_NAMED_FD:
+                assert(named_iofds[fileno] >= 0);
+
+                (void) fd_nonblock(named_iofds[fileno], false);
+
+                fd = fcntl(named_iofds[fileno], F_DUPFD_CLOEXEC, 3);
+                if (fd < 0)
+                        return -errno;
+                break;
+
+        default:
+                assert_not_reached("Unsupported output type");
+        }
+
+        s->stdio[fileno] = fd;
+        return 0;
+}
+
+static int exec_fast_spawn_prepare_stdio(
+                Unit *unit,
+                const ExecCommand *command,
+                const ExecContext *context,
+                const ExecParameters *params,
+                ExecFastSpawn *s,
+                int socket_fd,
+                int named_iofds[3],
+                dev_t *journal_stream_dev,
+                ino_t *journal_stream_ino) {
+
+        const char *ident;
+        ExecOutput o, e;
+        ExecInput i;
+        int fd, r;
+
+        /* Acquires the fds setup_input() and setup_output() would set up in the child. Each one is a separate fd
+         * (or the same as the previous one), owned by us and closed again after the child executed. */
+
+        i = fixup_input(context, socket_fd, params->flags & EXEC_APPLY_TTY_STDIN);
+        o = fixup_output(context->std_output, socket_fd);
+        e = fixup_output(context->std_error, socket_fd);
+        ident = basename(command->path);
+
+        switch (i) {
+
+        case EXEC_INPUT_NULL:
+                fd = open("/dev/null", O_RDONLY|O_NOCTTY|O_CLOEXEC);
+                break;
+
+        case EXEC_INPUT_SOCKET:
+                assert(socket_fd >= 0);
+
+                fd = fcntl(socket_fd, F_DUPFD_CLOEXEC, 3);
+                break;
+
+        case EXEC_INPUT_NAMED_FD:
+                assert(named_iofds[STDIN_FILENO] >= 0);
+
+                (void) fd_nonblock(named_iofds[STDIN_FILENO], false);
+                fd = fcntl(named_iofds[STDIN_FILENO], F_DUPFD_CLOEXEC, 3);
+                break;
+
+        case EXEC_INPUT_DATA:
+                fd = acquire_data_fd(context->stdin_data, context->stdin_data_size, 0);
+                if (fd < 0)
+                        return fd;
+                break;
+
+        default:
+                assert_not_reached("Unsupported input type");
+        }
+        if (fd < 0)
+                return -errno;
+
+        s->stdio[STDIN_FILENO] = fd;
+
+        if (o == EXEC_OUTPUT_INHERIT) {
+                /* If the input is connected to anything that's not a /dev/null or a data fd, inherit that... */
+                if (!IN_SET(i, EXEC_INPUT_NULL, EXEC_INPUT_DATA))
+                        s->stdio[STDOUT_FILENO] = s->stdio[STDIN_FILENO];
+                else if (getpid_cached() != 1)
+                        /* ... and if we are not PID 1, let the child inherit our stdout */
+                        s->stdio[STDOUT_FILENO] = -1;
+                else
+                        o = EXEC_OUTPUT_NULL;
+        }
+        if (o != EXEC_OUTPUT_INHERIT) {
+                r = exec_fast_spawn_prepare_output(unit, context, params, s, STDOUT_FILENO, o, socket_fd, named_iofds, ident, journal_stream_dev, journal_stream_ino);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Don't change the stderr file descriptor if we inherit all the way, duplicate it from stdout if
+         * possible */
+        if (e == EXEC_OUTPUT_INHERIT && o == EXEC_OUTPUT_INHERIT && i == EXEC_INPUT_NULL && getpid_cached() != 1)
+                s->stdio[STDERR_FILENO] = -1;
+        else if ((e == o && e != EXEC_OUTPUT_NAMED_FD) || e == EXEC_OUTPUT_INHERIT)
+                s->stderr_from_stdout = true;
+        else {
+                r = exec_fast_spawn_prepare_output(unit, context, params, s, STDERR_FILENO, e, socket_fd, named_iofds, ident, journal_stream_dev, journal_stream_ino);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int exec_fast_spawn_prepare_cgroup(const ExecParameters *params, ExecFastSpawn *s) {
+        CGroupController c;
+        char *p;
+        int r;
+
+        assert(params);
+        assert(s);
+
+        /* The paths cg_attach_everywhere() would write to in the child. For the controllers other than ours we
+         * look for the closest existing cgroup here, like cg_attach_fallback() does. */
+
+        if (!params->cgroup_path)
+                return 0;
+
+        r = cg_get_path_and_check(SYSTEMD_CGROUP_CONTROLLER, params->cgroup_path, "cgroup.procs", &p);
+        if (r < 0)
+                return r;
+        r = strv_consume(&s->cgroup_procs, p);
+        if (r < 0)
+                return r;
+
+        r = cg_hybrid_unified();
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = cg_get_path(SYSTEMD_CGROUP_CONTROLLER_LEGACY, params->cgroup_path, "cgroup.procs", &p);
+                if (r < 0)
+                        return r;
+                r = strv_consume(&s->cgroup_procs, p);
+                if (r < 0)
+                        return r;
+        }
+
+        r = cg_all_unified();
+        if (r < 0)
+                return r;
+        if (r > 0)
+                return 0;
+
+        for (c = 0; c < _CGROUP_CONTROLLER_MAX; c++) {
+                char prefix[strlen(params->cgroup_path) + 1];
+                const char *controller;
+                bool found = false;
+
+                if (!(params->cgroup_supported & CGROUP_CONTROLLER_TO_MASK(c)))
+                        continue;
+
+                controller = cgroup_controller_to_string(c);
+
+                r = cg_get_path(controller, params->cgroup_path, "cgroup.procs", &p);
+                if (r < 0)
+                        return r;
+                if (access(p, F_OK) >= 0)
+                        found = true;
+                else {
+                        p = mfree(p);
+
+                        PATH_FOREACH_PREFIX(prefix, params->cgroup_path) {
+                                r = cg_get_path(controller, prefix, "cgroup.procs", &p);
+                                if (r < 0)
+                                        return r;
+                                if (access(p, F_OK) >= 0) {
+                                        found = true;
+                                        break;
+                                }
+
+                                p = mfree(p);
+                        }
+                }
+                if (!found)
+                        continue;
+
+                r = strv_consume(&s->cgroup_procs, p);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static char *exec_fast_spawn_pid_placeholder(char **env, const char *prefix) {
+        char **i;
+
+        /* Replaces the PID in the given variable by space for the child to write its PID into */
+
+        STRV_FOREACH(i, env) {
+                char *x;
+
+                if (!startswith(*i, prefix))
+                        continue;
+
+                x = new0(char, strlen(prefix) + DECIMAL_STR_MAX(pid_t) + 1);
+                if (!x)
+                        return NULL;
+
+                free_and_replace(*i, x);
+                return stpcpy(*i, prefix);
+        }
+
+        return NULL;
+}
+
+static int exec_fast_spawn_copy_context(ExecFastSpawn *s, const ExecContext *c) {
+        unsigned i;
+
+        /* Copies the settings exec_fast_spawn_child() and the apply_*() functions it calls look at */
+
+        s->context = (ExecContext) {
+                .umask = c->umask,
+                .working_directory_missing_ok = c->working_directory_missing_ok,
+                .oom_score_adjust = c->oom_score_adjust,
+                .oom_score_adjust_set = c->oom_score_adjust_set,
+                .nice = c->nice,
+                .nice_set = c->nice_set,
+                .ioprio = c->ioprio,
+                .ioprio_set = c->ioprio_set,
+                .cpu_sched_policy = c->cpu_sched_policy,
+                .cpu_sched_priority = c->cpu_sched_priority,
+                .cpu_sched_reset_on_fork = c->cpu_sched_reset_on_fork,
+                .cpu_sched_set = c->cpu_sched_set,
+                .cpuset_ncpus = c->cpuset_ncpus,
+                .timer_slack_nsec = c->timer_slack_nsec,
+                .ignore_sigpipe = c->ignore_sigpipe,
+                .same_pgrp = c->same_pgrp,
+                .non_blocking = c->non_blocking,
+                .personality = c->personality,
+                .restrict_realtime = c->restrict_realtime,
+                .capability_bounding_set = c->capability_bounding_set,
+                .capability_ambient_set = c->capability_ambient_set,
+                .secure_bits = c->secure_bits,
+        };
+
+        for (i = 0; i < _RLIMIT_MAX; i++) {
+                if (!c->rlimit[i])
+                        continue;
+
+                s->context.rlimit[i] = newdup(struct rlimit, c->rlimit[i], 1);
+                if (!s->context.rlimit[i])
+                        return -ENOMEM;
+        }
+
+        if (c->cpuset) {
+                s->context.cpuset = memdup(c->cpuset, CPU_ALLOC_SIZE(c->cpuset_ncpus));
+                if (!s->context.cpuset)
+                        return -ENOMEM;
+        }
+
+        return 0;
+}
+
+static int exec_fast_spawn_prepare(
+                Unit *unit,
+                const ExecCommand *command,
+                const ExecContext *context,
+                const ExecParameters *params,
+                char **argv,
+                int socket_fd,
+                int named_iofds[3],
+                int *fds,
+                unsigned n_storage_fds,
+                unsigned n_socket_fds,
+                char **files_env,
+                ExecFastSpawn *s) {
+
+        _cleanup_strv_free_ char **accum_env = NULL;
+        const char *username = NULL, *groupname = NULL, *home = NULL, *shell = NULL;
+        ExecCredentials *creds = &s->credentials;
+        dev_t journal_stream_dev = 0;
+        ino_t journal_stream_ino = 0;
+        unsigned n_fds;
+        int r;
+
+        r = exec_fast_spawn_copy_context(s, context);
+        if (r < 0)
+                return r;
+
+        s->path = strdup(command->path);
+        if (!s->path)
+                return -ENOMEM;
+
+        s->invocation_id = unit->invocation_id;
+        s->ignore_enoent = command->flags & EXEC_COMMAND_IGNORE_FAILURE;
+
+        exec_credentials_init(creds, command, params);
+
+        /* These don't do NSS lookups for root, see exec_fast_spawn_supported() */
+        r = get_fixed_user(context, &username, &creds->uid, &creds->gid, &home, &shell);
+        if (r < 0)
+                return r;
+        r = get_fixed_group(context, &groupname, &creds->gid);
+        if (r < 0)
+                return r;
+
+        /* This might need to look at our capabilities, which the child can't, see apply_credentials() */
+        creds->no_new_privileges = creds->needs_sandboxing && context_has_no_new_privileges(context);
+
+        r = send_user_lookup(unit, unit->manager->user_lookup_fds[1], creds->uid, creds->gid);
+        if (r < 0)
+                return r;
+
+        /* We are these already, see exec_fast_spawn_supported() */
+        creds->uid = UID_INVALID;
+        creds->gid = GID_INVALID;
+
+        /* Make sure cap_test_all() in apply_credentials() finds this cached */
+        (void) cap_last_cap();
+
+        r = exec_fast_spawn_prepare_stdio(unit, command, context, params, s, socket_fd, named_iofds, &journal_stream_dev, &journal_stream_ino);
+        if (r < 0)
+                return r;
+
+        r = exec_fast_spawn_prepare_cgroup(params, s);
+        if (r < 0)
+                return r;
+
+        /* Duplicate the passed fds, as the manager might close them before the child is spawned */
+        n_fds = n_storage_fds + n_socket_fds;
+        if (n_fds > 0) {
+                unsigned i;
+
+                s->fds = new(int, n_fds);
+                if (!s->fds)
+                        return -ENOMEM;
+
+                for (i = 0; i < n_fds; i++) {
+                        s->fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+                        if (s->fds[i] < 0) {
+                                r = -errno;
+                                close_many(s->fds, i);
+                                s->fds = mfree(s->fds);
+                                return r;
+                        }
+                }
+
+                s->n_storage_fds = n_storage_fds;
+                s->n_socket_fds = n_socket_fds;
+
+                s->child_fds = newdup(int, s->fds, n_fds);
+                if (!s->child_fds)
+                        return -ENOMEM;
+        }
+
+        s->working_directory = strdup(context->working_directory ?: "/");
+        if (!s->working_directory)
+                return -ENOMEM;
+        s->new_keyring = (params->flags & EXEC_NEW_KEYRING) && context->keyring_mode != EXEC_KEYRING_INHERIT;
+
+        r = build_accumulated_environment(unit, context, params, n_fds, home, username, shell, journal_stream_dev, journal_stream_ino, files_env, &accum_env);
+        if (r < 0)
+                return r;
+
+        r = apply_unset_environment(context, &accum_env);
+        if (r < 0)
+                return r;
+
+        s->argv = replace_env_argv(argv, accum_env);
+        if (!s->argv)
+                return -ENOMEM;
+
+        s->listen_pid = exec_fast_spawn_pid_placeholder(accum_env, "LISTEN_PID=");
+        s->watchdog_pid = exec_fast_spawn_pid_placeholder(accum_env, "WATCHDOG_PID=");
+
+        s->envp = accum_env;
+        accum_env = NULL;
+
+        return 0;
+}
+
+static void exec_fast_spawn_format_int(char *p, int i) {
+        char buf[DECIMAL_STR_MAX(int)];
+        unsigned u, n = 0;
+
+        /* Like xsprintf(p, "%i", i), but only touches the stack and the destination, see clone_vfork() */
+
+        if (i < 0) {
+                *(p++) = '-';
+                u = -(unsigned) i;
+        } else
+                u = i;
+
+        do {
+                buf[n++] = '0' + u % 10;
+                u /= 10;
+        } while (u > 0);
+
+        while (n > 0)
+                *(p++) = buf[--n];
+        *p = 0;
+}
+
+static int exec_fast_spawn_close_fds(const int except[], unsigned n_except) {
+        union {
+                struct dirent64 de;
+                uint8_t data[2048];
+        } buf;
+        struct rlimit rl;
+        int dir_fd, fd, r = 0;
+
+        /* Like close_all_fds(), but without allocating memory for the directory, see clone_vfork() */
+
+        dir_fd = open("/proc/self/fd", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dir_fd < 0) {
+                if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                        return -errno;
+
+                for (fd = 3; fd < (int) rl.rlim_max; fd++)
+                        if (!fd_in_set(fd, except, n_except))
+                                (void) close(fd);
+
+                return 0;
+        }
+
+        for (;;) {
+                ssize_t n, k;
+
+                n = syscall(SYS_getdents64, dir_fd, &buf, sizeof(buf));
+                if (n < 0) {
+                        r = -errno;
+                        break;
+                }
+                if (n == 0)
+                        break;
+
+                for (k = 0; k < n; ) {
+                        struct dirent64 *de = (struct dirent64*) (buf.data + k);
+
+                        k += de->d_reclen;
+
+                        if (safe_atoi(de->d_name, &fd) < 0)
+                                continue;
+
+                        if (fd < 3 || fd == dir_fd || fd_in_set(fd, except, n_except))
+                                continue;
+
+                        (void) close(fd);
+                }
+        }
+
+        (void) close(dir_fd);
+        return r;
+}
+
+noreturn static void exec_fast_spawn_fail(ExecFastSpawn *s, int exit_status, int error) {
+        s->exit_status = exit_status;
+        s->error = error;
+
+        _exit(exit_status);
+}
+
+static int exec_fast_spawn_connect_logger(int fd, const char *header) {
+        static const union sockaddr_union sa = {
+                .un.sun_family = AF_UNIX,
+                .un.sun_path = "/run/systemd/journal/stdout",
+        };
+
+        /* Like acquire_logger(), on the socket and the header exec_fast_spawn_prepare_output() set up */
+
+        if (connect(fd, &sa.sa, SOCKADDR_UN_LEN(sa.un)) < 0)
+                return -errno;
+
+        if (shutdown(fd, SHUT_RD) < 0)
+                return -errno;
+
+        (void) fd_inc_sndbuf(fd, SNDBUF_SIZE);
+
+        return loop_write(fd, header, strlen(header), false);
+}
+
+static int exec_fast_spawn_child(void *userdata) {
+        ExecFastSpawn *s = userdata;
+        const ExecContext *context = &s->context;
+        int secure_bits, exit_status = EXIT_SUCCESS;
+        unsigned n_fds;
+        pid_t pid;
+        char **p;
+        int i, r;
+
+        /* This runs in the address space of the manager. It hence may only issue system calls on the data
+         * prepared in 's', and reports errors back through it, see clone_vfork(). It follows the order of
+         * exec_child(), minus all the steps exec_fast_spawn_supported() excludes. */
+
+        /* The manager waits for this, but for nothing else */
+        pid = getpid();
+        if (write(s->report_fd, &pid, sizeof(pid)) != sizeof(pid))
+                exec_fast_spawn_fail(s, EXIT_FDS, errno > 0 ? -errno : -EIO);
+
+        (void) default_signals(SIGNALS_CRASH_HANDLER,
+                               SIGNALS_IGNORE, -1);
+
+        if (context->ignore_sigpipe)
+                (void) ignore_signals(SIGPIPE, -1);
+
+        r = reset_signal_mask();
+        if (r < 0)
+                exec_fast_spawn_fail(s, EXIT_SIGNAL_MASK, r);
 
-                if (!cap_test_all(bset)) {
-                        r = capability_bounding_set_drop(bset, false);
-                        if (r < 0) {
-                                *exit_status = EXIT_CAPABILITIES;
-                                return log_unit_error_errno(unit, r, "Failed to drop capabilities: %m");
-                        }
-                }
+        if (!context->same_pgrp)
+                if (setsid() < 0)
+                        exec_fast_spawn_fail(s, EXIT_SETSID, -errno);
 
-                /* This is done before enforce_user, but ambient set
-                 * does not survive over setresuid() if keep_caps is not set. */
-                if (!needs_ambient_hack &&
-                    context->capability_ambient_set != 0) {
-                        r = capability_ambient_set_apply(context->capability_ambient_set, true);
+        for (i = 0; i < 3; i++) {
+                int from = i == STDERR_FILENO && s->stderr_from_stdout ? STDOUT_FILENO : s->stdio[i];
+                int exit_status_stdio = i == STDIN_FILENO ? EXIT_STDIN : i == STDOUT_FILENO ? EXIT_STDOUT : EXIT_STDERR;
+
+                if (s->stdio_logger[i]) {
+                        r = exec_fast_spawn_connect_logger(s->stdio[i], s->stdio_logger[i]);
                         if (r < 0) {
-                                *exit_status = EXIT_CAPABILITIES;
-                                return log_unit_error_errno(unit, r, "Failed to apply ambient capabilities (before UID change): %m");
+                                /* Reported as warning, like setup_output() logs it */
+                                s->logger_error = r;
+
+                                r = open_null_as(O_WRONLY, i);
+                                if (r < 0)
+                                        exec_fast_spawn_fail(s, exit_status_stdio, r);
+
+                                continue;
                         }
                 }
+
+                if (from >= 0 && dup2(from, i) < 0)
+                        exec_fast_spawn_fail(s, exit_status_stdio, -errno);
         }
 
-        if (needs_setuid) {
-                if (context->user) {
-                        r = enforce_user(context, uid);
-                        if (r < 0) {
-                                *exit_status = EXIT_USER;
-                                return log_unit_error_errno(unit, r, "Failed to change UID to " UID_FMT ": %m", uid);
-                        }
+        (void) umask(context->umask);
 
-                        if (!needs_ambient_hack &&
-                            context->capability_ambient_set != 0) {
+        n_fds = s->n_storage_fds + s->n_socket_fds;
+        r = exec_fast_spawn_close_fds(s->child_fds, n_fds);
+        if (r < 0)
+                exec_fast_spawn_fail(s, EXIT_FDS, r);
 
-                                /* Fix the ambient capabilities after user change. */
-                                r = capability_ambient_set_apply(context->capability_ambient_set, false);
-                                if (r < 0) {
-                                        *exit_status = EXIT_CAPABILITIES;
-                                        return log_unit_error_errno(unit, r, "Failed to apply ambient capabilities (after UID change): %m");
-                                }
+        STRV_FOREACH(p, s->cgroup_procs) {
+                int fd;
 
-                                /* If we were asked to change user and ambient capabilities
-                                 * were requested, we had to add keep-caps to the securebits
-                                 * so that we would maintain the inherited capability set
-                                 * through the setresuid(). Make sure that the bit is added
-                                 * also to the context secure_bits so that we don't try to
-                                 * drop the bit away next. */
+                /* Writing 0 moves the writing process */
+                fd = open(*p, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+                if (fd >= 0) {
+                        r = write(fd, "0\n", 2) < 0 ? -errno : 0;
+                        (void) close(fd);
+                } else
+                        r = -errno;
 
-                                secure_bits |= 1<<SECURE_KEEP_CAPS;
-                        }
-                }
+                if (r < 0 && p == s->cgroup_procs)
+                        exec_fast_spawn_fail(s, EXIT_CGROUP, r);
         }
 
-        if (needs_sandboxing) {
-                /* Apply other MAC contexts late, but before seccomp syscall filtering, as those should really be last to
-                 * influence our own codepaths as little as possible. Moreover, applying MAC contexts usually requires
-                 * syscalls that are subject to seccomp filtering, hence should probably be applied before the syscalls
-                 * are restricted. */
+        if (context->oom_score_adjust_set) {
+                char t[DECIMAL_STR_MAX(context->oom_score_adjust)];
+                int fd;
 
-#if HAVE_SELINUX
-                if (use_selinux) {
-                        char *exec_context = mac_selinux_context_net ?: context->selinux_context;
+                exec_fast_spawn_format_int(t, context->oom_score_adjust);
 
-                        if (exec_context) {
-                                r = setexeccon(exec_context);
-                                if (r < 0) {
-                                        *exit_status = EXIT_SELINUX_CONTEXT;
-                                        return log_unit_error_errno(unit, r, "Failed to change SELinux context to %s: %m", exec_context);
-                                }
-                        }
-                }
-#endif
+                fd = open("/proc/self/oom_score_adj", O_WRONLY|O_CLOEXEC|O_NOCTTY);
+                if (fd >= 0) {
+                        r = write(fd, t, strlen(t)) < 0 ? -errno : 0;
+                        (void) close(fd);
+                } else
+                        r = -errno;
 
-#if HAVE_APPARMOR
-                if (use_apparmor && context->apparmor_profile) {
-                        r = aa_change_onexec(context->apparmor_profile);
-                        if (r < 0 && !context->apparmor_profile_ignore) {
-                                *exit_status = EXIT_APPARMOR_PROFILE;
-                                return log_unit_error_errno(unit, errno, "Failed to prepare AppArmor profile change to %s: %m", context->apparmor_profile);
-                        }
-                }
-#endif
+                if (r < 0 && !IN_SET(r, -EPERM, -EACCES))
+                        exec_fast_spawn_fail(s, EXIT_OOM_ADJUST, r);
+        }
 
-                /* PR_GET_SECUREBITS is not privileged, while PR_SET_SECUREBITS is. So to suppress potential EPERMs
-                 * we'll try not to call PR_SET_SECUREBITS unless necessary. */
-                if (prctl(PR_GET_SECUREBITS) != secure_bits)
-                        if (prctl(PR_SET_SECUREBITS, secure_bits) < 0) {
-                                *exit_status = EXIT_SECUREBITS;
-                                return log_unit_error_errno(unit, errno, "Failed to set process secure bits: %m");
-                        }
+        if (context->nice_set)
+                if (setpriority(PRIO_PROCESS, 0, context->nice) < 0)
+                        exec_fast_spawn_fail(s, EXIT_NICE, -errno);
+
+        if (context->cpu_sched_set) {
+                struct sched_param param = {
+                        .sched_priority = context->cpu_sched_priority,
+                };
+
+                if (sched_setscheduler(0,
+                                       context->cpu_sched_policy |
+                                       (context->cpu_sched_reset_on_fork ?
+                                        SCHED_RESET_ON_FORK : 0),
+                                       &param) < 0)
+                        exec_fast_spawn_fail(s, EXIT_SETSCHEDULER, -errno);
+        }
+
+        if (context->cpuset)
+                if (sched_setaffinity(0, CPU_ALLOC_SIZE(context->cpuset_ncpus), context->cpuset) < 0)
+                        exec_fast_spawn_fail(s, EXIT_CPUAFFINITY, -errno);
+
+        if (context->ioprio_set)
+                if (ioprio_set(IOPRIO_WHO_PROCESS, 0, context->ioprio) < 0)
+                        exec_fast_spawn_fail(s, EXIT_IOPRIO, -errno);
+
+        if (context->timer_slack_nsec != NSEC_INFINITY)
+                if (prctl(PR_SET_TIMERSLACK, context->timer_slack_nsec) < 0)
+                        exec_fast_spawn_fail(s, EXIT_TIMERSLACK, -errno);
+
+        if (context->personality != PERSONALITY_INVALID) {
+                r = safe_personality(context->personality);
+                if (r < 0)
+                        exec_fast_spawn_fail(s, EXIT_PERSONALITY, r);
+        }
 
-                if (context_has_no_new_privileges(context))
-                        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
-                                *exit_status = EXIT_NO_NEW_PRIVILEGES;
-                                return log_unit_error_errno(unit, errno, "Failed to disable new privileges: %m");
+        if (s->new_keyring) {
+                key_serial_t keyring;
+
+                /* See setup_keyring(), minus the logging */
+                keyring = keyctl(KEYCTL_JOIN_SESSION_KEYRING, 0, 0, 0, 0);
+                if (keyring == -1) {
+                        if (!IN_SET(errno, ENOSYS, EACCES, EPERM, EDQUOT))
+                                exec_fast_spawn_fail(s, EXIT_KEYRING, -errno);
+                } else {
+                        if (!sd_id128_is_null(s->invocation_id)) {
+                                key_serial_t key;
+
+                                key = add_key("user", "invocation_id", &s->invocation_id, sizeof(s->invocation_id), KEY_SPEC_SESSION_KEYRING);
+                                if (key != -1 &&
+                                    keyctl(KEYCTL_SETPERM, key,
+                                           KEY_POS_VIEW|KEY_POS_READ|KEY_POS_SEARCH|
+                                           KEY_USR_VIEW|KEY_USR_READ|KEY_USR_SEARCH, 0, 0) < 0)
+                                        exec_fast_spawn_fail(s, EXIT_KEYRING, -errno);
                         }
 
-#if HAVE_SECCOMP
-                r = apply_address_families(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_ADDRESS_FAMILIES;
-                        return log_unit_error_errno(unit, r, "Failed to restrict address families: %m");
+                        if (uid_is_valid(s->credentials.uid) || gid_is_valid(s->credentials.gid))
+                                if (keyctl(KEYCTL_CHOWN, keyring, s->credentials.uid, s->credentials.gid, 0) < 0)
+                                        exec_fast_spawn_fail(s, EXIT_KEYRING, -errno);
                 }
+        }
 
-                r = apply_memory_deny_write_execute(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to disable writing to executable memory: %m");
-                }
+        if (chdir(s->working_directory) < 0 && !context->working_directory_missing_ok)
+                exec_fast_spawn_fail(s, EXIT_CHDIR, -errno);
 
-                r = apply_restrict_realtime(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply realtime restrictions: %m");
-                }
+        /* A no-op, as we keep our own credentials, but for the order's sake */
+        if (s->credentials.needs_setuid) {
+                r = enforce_groups(s->credentials.gid, s->credentials.supplementary_gids, s->credentials.n_supplementary_gids);
+                if (r < 0)
+                        exec_fast_spawn_fail(s, EXIT_GROUP, r);
+        }
 
-                r = apply_restrict_namespaces(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply namespace restrictions: %m");
-                }
+        r = shift_fds(s->child_fds, n_fds);
+        if (r >= 0)
+                r = flags_fds(s->child_fds, s->n_storage_fds, s->n_socket_fds, context->non_blocking);
+        if (r < 0)
+                exec_fast_spawn_fail(s, EXIT_FDS, r);
 
-                r = apply_protect_sysctl(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply sysctl restrictions: %m");
-                }
+        r = apply_resource_limits(context, &s->credentials, &exit_status);
+        if (r < 0)
+                exec_fast_spawn_fail(s, exit_status, r);
 
-                r = apply_protect_kernel_modules(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply module loading restrictions: %m");
-                }
+        r = apply_credentials(context, &s->credentials, &secure_bits, &exit_status);
+        if (r < 0)
+                exec_fast_spawn_fail(s, exit_status, r);
 
-                r = apply_private_devices(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to set up private devices: %m");
-                }
+        r = apply_privilege_restrictions(context, &s->credentials, secure_bits, &exit_status);
+        if (r < 0)
+                exec_fast_spawn_fail(s, exit_status, r);
 
-                r = apply_syscall_archs(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply syscall architecture restrictions: %m");
-                }
+        if (s->listen_pid)
+                exec_fast_spawn_format_int(s->listen_pid, pid);
+        if (s->watchdog_pid)
+                exec_fast_spawn_format_int(s->watchdog_pid, pid);
 
-                r = apply_lock_personality(unit, context);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to lock personalities: %m");
-                }
+        execve(s->path, s->argv, s->envp);
 
-                /* This really should remain the last step before the execve(), to make sure our own code is unaffected
-                 * by the filter as little as possible. */
-                r = apply_syscall_filter(unit, context, needs_ambient_hack);
-                if (r < 0) {
-                        *exit_status = EXIT_SECCOMP;
-                        return log_unit_error_errno(unit, r, "Failed to apply system call filters: %m");
-                }
-#endif
+        if (errno == ENOENT && s->ignore_enoent)
+                exec_fast_spawn_fail(s, EXIT_SUCCESS, -errno);
+
+        exec_fast_spawn_fail(s, EXIT_EXEC, -errno);
+}
+
+static void *exec_fast_spawn_thread(void *p) {
+        _cleanup_(exec_fast_spawn_freep) ExecFastSpawn *s = p;
+        ExecFastSpawnReport report;
+        pid_t pid;
+        int r;
+
+        /* Only this thread is suspended while the child sets itself up, the manager carries on */
+
+        r = clone_vfork(exec_fast_spawn_child, s, &pid);
+        if (r < 0) {
+                /* In place of the PID */
+                pid = r;
+                (void) loop_write(s->report_fd, &pid, sizeof(pid), false);
+                return NULL;
+        }
+
+        /* The child has executed or exited by now. Closing the pipe without a report means it did the former
+         * without trouble. */
+        if (s->error < 0 || s->logger_error < 0) {
+                report = (ExecFastSpawnReport) {
+                        .exit_status = s->exit_status,
+                        .error = s->error,
+                        .logger_error = s->logger_error,
+                };
+
+                (void) loop_write(s->report_fd, &report, sizeof(report), false);
         }
 
-        if (!strv_isempty(context->unset_environment)) {
-                char **ee = NULL;
+        return NULL;
+}
 
-                ee = strv_env_delete(accum_env, 1, context->unset_environment);
-                if (!ee) {
-                        *exit_status = EXIT_MEMORY;
-                        return log_oom();
-                }
+static void exec_fast_spawn_log_report(Unit *u, const char *path, const ExecFastSpawnReport *report) {
+        assert(u);
+        assert(path);
+        assert(report);
+
+        /* Logs the child's failures like setup_output() and exec_child() would have */
+
+        if (report->logger_error < 0)
+                log_unit_warning_errno(u, report->logger_error, "Failed to connect to the journal socket, ignoring: %m");
+
+        if (report->error == -ENOENT && report->exit_status == EXIT_SUCCESS)
+                log_struct_errno(LOG_INFO, report->error,
+                                 "MESSAGE_ID=" SD_MESSAGE_SPAWN_FAILED_STR,
+                                 LOG_UNIT_ID(u),
+                                 LOG_UNIT_INVOCATION_ID(u),
+                                 LOG_UNIT_MESSAGE(u, "Executable %s missing, skipping: %m",
+                                                  path),
+                                 "EXECUTABLE=%s", path,
+                                 NULL);
+        else if (report->error < 0)
+                log_struct_errno(LOG_ERR, report->error,
+                                 "MESSAGE_ID=" SD_MESSAGE_SPAWN_FAILED_STR,
+                                 LOG_UNIT_ID(u),
+                                 LOG_UNIT_INVOCATION_ID(u),
+                                 LOG_UNIT_MESSAGE(u, "Failed at step %s spawning %s: %m",
+                                                  exit_status_to_string(report->exit_status, EXIT_STATUS_SYSTEMD),
+                                                  path),
+                                 "EXECUTABLE=%s", path,
+                                 NULL);
+}
+
+static int exec_fast_spawn_dispatch_report(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        _cleanup_(exec_fast_spawn_report_context_freep) ExecFastSpawnReportContext *c = userdata;
+        ExecFastSpawnReport report;
+        ssize_t n;
+        Unit *u;
 
-                strv_free(accum_env);
-                accum_env = ee;
+        assert(source);
+        assert(c);
+
+        /* EOF without a report if the child executed fine */
+        n = loop_read(fd, &report, sizeof(report), false);
+        if (n < 0)
+                log_warning_errno(n, "Failed to read spawn report of %s, ignoring: %m", c->unit_id);
+        else if (n == sizeof(report)) {
+                u = manager_get_unit(c->manager, c->unit_id);
+                if (u)
+                        exec_fast_spawn_log_report(u, c->path, &report);
         }
 
-        final_argv = replace_env_argv(argv, accum_env);
-        if (!final_argv) {
-                *exit_status = EXIT_MEMORY;
+        /* Also closes the fd */
+        sd_event_source_unref(source);
+        return 0;
+}
+
+static int exec_spawn_fast(
+                Unit *unit,
+                ExecCommand *command,
+                const ExecContext *context,
+                const ExecParameters *params,
+                char **argv,
+                int socket_fd,
+                int named_iofds[3],
+                int *fds,
+                unsigned n_storage_fds,
+                unsigned n_socket_fds,
+                char **files_env,
+                pid_t *ret) {
+
+        _cleanup_(exec_fast_spawn_report_context_freep) ExecFastSpawnReportContext *c = NULL;
+        _cleanup_(exec_fast_spawn_freep) ExecFastSpawn *s = NULL;
+        _cleanup_close_pair_ int pipefd[2] = { -1, -1 };
+        sd_event_source *source = NULL;
+        pid_t pid;
+        ssize_t n;
+        int r;
+
+        /* Prepares everything exec_child() would do in the child here, so that the child shares our address space
+         * rather than getting a copy of it, which is expensive for a manager with a lot of units. The child is
+         * spawned from a separate thread, as vfork() semantics suspend the caller until the child executed,
+         * which might take a while if it connects to the journal or changes to a directory on a network file
+         * system. */
+
+        s = new0(ExecFastSpawn, 1);
+        if (!s)
                 return log_oom();
-        }
+
+        s->stdio[STDIN_FILENO] = s->stdio[STDOUT_FILENO] = s->stdio[STDERR_FILENO] = -1;
+        s->report_fd = -1;
+
+        r = exec_fast_spawn_prepare(unit, command, context, params, argv, socket_fd, named_iofds, fds, n_storage_fds, n_socket_fds, files_env, s);
+        if (r < 0)
+                return log_unit_error_errno(unit, r, "Failed to prepare spawning %s: %m", command->path);
 
         if (DEBUG_LOGGING) {
                 _cleanup_free_ char *line;
 
-                line = exec_command_line(final_argv);
-                if (line) {
+                line = exec_command_line(s->argv);
+                if (line)
                         log_struct(LOG_DEBUG,
                                    "EXECUTABLE=%s", command->path,
                                    LOG_UNIT_MESSAGE(unit, "Executing: %s", line),
                                    LOG_UNIT_ID(unit),
                                    LOG_UNIT_INVOCATION_ID(unit),
                                    NULL);
-                }
         }
 
-        execve(command->path, final_argv, accum_env);
+        c = new0(ExecFastSpawnReportContext, 1);
+        if (!c)
+                return log_oom();
 
-        if (errno == ENOENT && (command->flags & EXEC_COMMAND_IGNORE_FAILURE)) {
+        c->manager = unit->manager;
+        c->unit_id = strdup(unit->id);
+        c->path = strdup(command->path);
+        if (!c->unit_id || !c->path)
+                return log_oom();
 
-                log_struct_errno(LOG_INFO, errno,
-                                 "MESSAGE_ID=" SD_MESSAGE_SPAWN_FAILED_STR,
-                                 LOG_UNIT_ID(unit),
-                                 LOG_UNIT_INVOCATION_ID(unit),
-                                 LOG_UNIT_MESSAGE(unit, "Executable %s missing, skipping: %m",
-                                                  command->path),
-                                 "EXECUTABLE=%s", command->path,
-                                 NULL);
+        if (pipe2(pipefd, O_CLOEXEC) < 0)
+                return log_unit_error_errno(unit, errno, "Failed to create pipe: %m");
 
-                return 0;
+        s->report_fd = pipefd[1];
+        pipefd[1] = -1;
+
+        r = asynchronous_job(exec_fast_spawn_thread, s);
+        if (r < 0)
+                return log_unit_error_errno(unit, r, "Failed to start spawner thread: %m");
+        s = NULL;
+
+        /* The child reports its PID before it does anything else */
+        n = loop_read(pipefd[0], &pid, sizeof(pid), true);
+        if (n < 0)
+                return log_unit_error_errno(unit, n, "Failed to read PID of spawned process: %m");
+        if (n != sizeof(pid)) {
+                log_unit_error(unit, "Spawned process didn't report its PID.");
+                return -EIO;
+        }
+        if (pid < 0)
+                return log_unit_error_errno(unit, pid, "Failed to fork: %m");
+
+        r = sd_event_add_io(unit->manager->event, &source, pipefd[0], EPOLLIN, exec_fast_spawn_dispatch_report, c);
+        if (r < 0)
+                log_unit_warning_errno(unit, r, "Failed to watch spawn report, failures of the spawned process won't be logged: %m");
+        else {
+                (void) sd_event_source_set_io_fd_own(source, true);
+                (void) sd_event_source_set_description(source, "exec-fast-spawn-report");
+
+                pipefd[0] = -1;
+                c = NULL;
         }
 
-        *exit_status = EXIT_EXEC;
-        return log_unit_error_errno(unit, errno, "Failed to execute command: %m");
+        *ret = pid;
+        return 0;
 }
 
 int exec_spawn(Unit *unit,
@@ -3456,6 +4744,7 @@ int exec_spawn(Unit *unit,
         int socket_fd, r;
         int named_iofds[3] = { -1, -1, -1 };
         char **argv;
+        usec_t begin;
         pid_t pid;
 
         assert(unit);
@@ -3465,6 +4754,8 @@ int exec_spawn(Unit *unit,
         assert(params);
         assert(params->fds || (params->n_storage_fds + params->n_socket_fds <= 0));
 
+        begin = now(CLOCK_MONOTONIC);
+
         if (context->std_input == EXEC_INPUT_SOCKET ||
             context->std_output == EXEC_OUTPUT_SOCKET ||
             context->std_error == EXEC_OUTPUT_SOCKET) {
@@ -3507,6 +4798,14 @@ int exec_spawn(Unit *unit,
                    LOG_UNIT_INVOCATION_ID(unit),
                    NULL);
 
+        if (exec_fast_spawn_supported(unit, command, context, params, runtime, argv)) {
+                r = exec_spawn_fast(unit, command, context, params, argv, socket_fd, named_iofds, fds, n_storage_fds, n_socket_fds, files_env, &pid);
+                if (r < 0)
+                        return r;
+
+                goto forked;
+        }
+
         pid = fork();
         if (pid < 0)
                 return log_unit_error_errno(unit, errno, "Failed to fork: %m");
@@ -3545,6 +4844,7 @@ int exec_spawn(Unit *unit,
                 _exit(exit_status);
         }
 
+forked:
         log_unit_debug(unit, "Forked %s as "PID_FMT, command->path, pid);
 
         /* We add the new process to the cgroup both in the child (so
@@ -3557,6 +4857,8 @@ int exec_spawn(Unit *unit,
 
         exec_status_start(&command->exec_status, pid);
 
+        manager_trace(unit->manager, MANAGER_TRACE_SPAWN, unit->id, begin);
+
         *ret = pid;
         return 0;
 }
@@ -0,0 +1,642 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "copy.h"
+#include "dirent-util.h"
+#include "exec-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "generator-cache.h"
+#include "log.h"
+#include "mkdir.h"
+#include "path-util.h"
+#include "proc-cmdline.h"
+#include "rm-rf.h"
+#include "siphash24.h"
+#include "string-util.h"
+#include "stdio-util.h"
+#include "strv.h"
+#include "user-util.h"
+#include "util.h"
+
+/* Bump this whenever the way the key is calculated or the layout of the cache changes */
+#define GENERATOR_CACHE_VERSION 1
+
+static const uint8_t generator_cache_hash_key[16] = {
+        0x5e, 0x1a, 0x2d, 0x84, 0x0b, 0x7c, 0x49, 0xe3,
+        0x9f, 0x36, 0xc1, 0x58, 0x22, 0xad, 0x70, 0x14
+};
+
+/* The generators whose output only depends on the kernel command line, the environment, whether we run in the initrd
+ * and the files listed here, and which hence don't need to be run again as long as none of these changed. Inputs
+ * ending in a slash refer to a directory and everything in it. Generators not listed here are always run.
+ *
+ * The fstab generator is not listed: its output also depends on whether fsck helpers exist, on where the mount points
+ * resolve to through symlinks, on whether /sys is writable and on the container we run in. */
+static const struct {
+        const char *name;
+        const char *inputs; /* NULSTR */
+        bool sysv;          /* Also depends on the SysV init scripts and the native units in the search path */
+} generator_cache_table[] = {
+        { "systemd-cryptsetup-generator",       "/etc/crypttab\0"                     },
+        { "systemd-debug-generator",            ""                                    },
+        { "systemd-hibernate-resume-generator", ""                                    },
+        { "systemd-veritysetup-generator",      ""                                    },
+        { "systemd-system-update-generator",    "/system-update\0"                    },
+        { "systemd-rc-local-generator",         RC_LOCAL_SCRIPT_PATH_START "\0"
+                                                RC_LOCAL_SCRIPT_PATH_STOP "\0"        },
+#if HAVE_SYSV_COMPAT
+        { "systemd-sysv-generator",             "",                             true  },
+#endif
+};
+
+static void hash_stat(struct siphash *state, const char *path) {
+        struct stat st;
+        int error = 0;
+
+        siphash24_compress(path, strlen(path) + 1, state);
+
+        if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                error = errno;
+                siphash24_compress(&error, sizeof(error), state);
+                return;
+        }
+
+        siphash24_compress(&error, sizeof(error), state);
+        siphash24_compress(&st.st_dev, sizeof(st.st_dev), state);
+        siphash24_compress(&st.st_ino, sizeof(st.st_ino), state);
+        siphash24_compress(&st.st_mode, sizeof(st.st_mode), state);
+        siphash24_compress(&st.st_size, sizeof(st.st_size), state);
+        siphash24_compress(&st.st_mtim, sizeof(st.st_mtim), state);
+        siphash24_compress(&st.st_ctim, sizeof(st.st_ctim), state);
+}
+
+static int hash_directory(struct siphash *state, const char *path) {
+        _cleanup_closedir_ DIR *d = NULL;
+        _cleanup_strv_free_ char **names = NULL;
+        struct dirent *de;
+        char **n;
+        int r;
+
+        hash_stat(state, path);
+
+        d = opendir(path);
+        if (!d)
+                return errno == ENOENT ? 0 : -errno;
+
+        FOREACH_DIRENT(de, d, return -errno) {
+                r = strv_extend(&names, de->d_name);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Directory order is not stable, hence sort the entries first */
+        strv_sort(names);
+
+        STRV_FOREACH(n, names) {
+                _cleanup_free_ char *p = NULL;
+
+                p = strjoin(path, "/", *n);
+                if (!p)
+                        return -ENOMEM;
+
+                hash_stat(state, p);
+        }
+
+        return 0;
+}
+
+static int hash_input(struct siphash *state, const char *input) {
+        _cleanup_free_ char *p = NULL;
+
+        if (!endswith(input, "/")) {
+                hash_stat(state, input);
+                return 0;
+        }
+
+        p = strndup(input, strlen(input) - 1);
+        if (!p)
+                return -ENOMEM;
+
+        return hash_directory(state, p);
+}
+
+static int hash_sysv(struct siphash *state, const LookupPaths *lp) {
+        static const char *const rcnd[] = { "rc1.d", "rc2.d", "rc3.d", "rc4.d", "rc5.d" };
+        _cleanup_strv_free_ char **init = NULL, **rc = NULL;
+        char **p;
+        size_t i;
+        int r;
+
+        /* The SysV generator reads all init scripts and the rcN.d symlinks, and skips scripts for which a native
+         * unit exists. Whether a native unit exists is covered by the modification time of the search path
+         * directories, leaving out the directories whose contents are generated at runtime. */
+
+        init = strv_split(SYSTEM_SYSVINIT_PATH, ":");
+        rc = strv_split(SYSTEM_SYSVRCND_PATH, ":");
+        if (!init || !rc)
+                return -ENOMEM;
+
+        STRV_FOREACH(p, init) {
+                r = hash_directory(state, *p);
+                if (r < 0)
+                        return r;
+        }
+
+        STRV_FOREACH(p, rc)
+                for (i = 0; i < ELEMENTSOF(rcnd); i++) {
+                        _cleanup_free_ char *d = NULL;
+
+                        d = strjoin(*p, "/", rcnd[i]);
+                        if (!d)
+                                return -ENOMEM;
+
+                        r = hash_directory(state, d);
+                        if (r < 0)
+                                return r;
+                }
+
+        STRV_FOREACH(p, lp->search_path) {
+                if (path_equal_ptr(*p, lp->generator) ||
+                    path_equal_ptr(*p, lp->generator_early) ||
+                    path_equal_ptr(*p, lp->generator_late) ||
+                    path_equal_ptr(*p, lp->transient))
+                        continue;
+
+                hash_stat(state, *p);
+        }
+
+        return 0;
+}
+
+int generator_cache_key(const char *path, const LookupPaths *lp, uint64_t *ret) {
+        _cleanup_free_ char *cmdline = NULL;
+        struct siphash state;
+        const char *name, *i;
+        unsigned version = GENERATOR_CACHE_VERSION;
+        bool initrd;
+        char **e;
+        size_t k;
+        int r;
+
+        assert(path);
+        assert(lp);
+        assert(ret);
+
+        /* Calculates a hash over everything the output of the specified generator depends on. Returns -EOPNOTSUPP
+         * if we don't know what that is. */
+
+        name = basename(path);
+        for (k = 0; k < ELEMENTSOF(generator_cache_table); k++)
+                if (streq(generator_cache_table[k].name, name))
+                        break;
+        if (k >= ELEMENTSOF(generator_cache_table))
+                return -EOPNOTSUPP;
+
+        r = proc_cmdline(&cmdline);
+        if (r < 0)
+                return r;
+
+        siphash24_init(&state, generator_cache_hash_key);
+        siphash24_compress(&version, sizeof(version), &state);
+
+        /* The generator binary itself */
+        hash_stat(&state, path);
+
+        initrd = in_initrd();
+        siphash24_compress(&initrd, sizeof(initrd), &state);
+        siphash24_compress(cmdline, strlen(cmdline) + 1, &state);
+
+        STRV_FOREACH(e, environ)
+                siphash24_compress(*e, strlen(*e) + 1, &state);
+
+        NULSTR_FOREACH(i, generator_cache_table[k].inputs) {
+                r = hash_input(&state, i);
+                if (r < 0)
+                        return r;
+        }
+
+        if (generator_cache_table[k].sysv) {
+                r = hash_sysv(&state, lp);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = siphash24_finalize(&state);
+        return 0;
+}
+
+static bool generator_cache_valid(const char *dir, uint64_t key) {
+        _cleanup_free_ char *p = NULL, *line = NULL;
+        char k[DECIMAL_STR_MAX(uint64_t)];
+
+        p = strjoin(dir, "/key");
+        if (!p)
+                return false;
+
+        if (read_one_line_file(p, &line) < 0)
+                return false;
+
+        xsprintf(k, "%016" PRIx64, key);
+        return streq(line, k);
+}
+
+static int generator_cache_store(const char *dir, uint64_t key) {
+        char k[DECIMAL_STR_MAX(uint64_t)];
+        const char *p;
+
+        p = strjoina(dir, "/key");
+        xsprintf(k, "%016" PRIx64, key);
+
+        return write_string_file(p, k, WRITE_STRING_FILE_CREATE|WRITE_STRING_FILE_ATOMIC);
+}
+
+static int generator_cache_merge(const char *dir, const LookupPaths *lp) {
+        const char *const subdirs[] = { "normal", "early", "late" };
+        const char *const targets[] = { lp->generator, lp->generator_early, lp->generator_late };
+        size_t i;
+        int r = 0, q;
+
+        /* Copies the output of a generator into the actual generator directories. Files that are already there,
+         * because an earlier generator or one that is not cached generated them, win. */
+
+        for (i = 0; i < ELEMENTSOF(subdirs); i++) {
+                const char *p;
+
+                p = strjoina(dir, "/", subdirs[i]);
+
+                q = copy_tree(p, targets[i], UID_INVALID, GID_INVALID, COPY_MERGE);
+                if (q < 0 && q != -ENOENT && r >= 0)
+                        r = q;
+        }
+
+        return r;
+}
+
+void generator_run_free_many(GeneratorRun *runs, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                free(runs[i].name);
+
+        free(runs);
+}
+
+int generators_run(char **generators, const LookupPaths *lp, usec_t timeout, GeneratorRun **ret, size_t *ret_n) {
+        _cleanup_strv_free_ char **run_paths = NULL;
+        _cleanup_free_ ExecResult *results = NULL;
+        _cleanup_free_ uint64_t *keys = NULL;
+        _cleanup_free_ size_t *run_index = NULL;
+        _cleanup_free_ char *root = NULL;
+        char ***run_argvs = NULL, **dirs = NULL;
+        GeneratorRun *runs = NULL;
+        size_t i, n, n_run = 0;
+        int r;
+
+        assert(lp);
+        assert(lp->generator);
+        assert(lp->generator_early);
+        assert(lp->generator_late);
+        assert(ret);
+        assert(ret_n);
+
+        /* Runs the specified generators in parallel. The generators listed in generator_cache_table write into their
+         * own directory in the cache, which is then merged into the actual generator directories. If the inputs of
+         * such a generator didn't change since it ran the last time, it's not run again, and its previous output is
+         * merged instead. All other generators are run as before, writing into the generator directories
+         * directly. */
+
+        n = strv_length(generators);
+
+        root = strappend(lp->generator, ".cache");
+        if (!root)
+                return -ENOMEM;
+
+        runs = new0(GeneratorRun, n);
+        keys = new0(uint64_t, n);
+        dirs = new0(char*, n);
+        run_index = new(size_t, n);
+        run_argvs = new0(char**, n + 1);
+        if (!runs || !keys || !dirs || !run_index || !run_argvs) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        for (i = 0; i < n; i++) {
+                _cleanup_free_ char *d = NULL, *normal = NULL, *early = NULL, *late = NULL;
+                char **argv;
+
+                runs[i].name = strdup(basename(generators[i]));
+                d = strjoin(root, "/", runs[i].name);
+                if (!runs[i].name || !d) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                r = generator_cache_key(generators[i], lp, keys + i);
+                if (r < 0) {
+                        if (r != -EOPNOTSUPP)
+                                log_debug_errno(r, "Failed to determine inputs of generator %s, not using cache: %m", generators[i]);
+
+                        /* Not cacheable, drop any output a previous version left behind */
+                        (void) rm_rf(d, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+                        argv = strv_new("", lp->generator, lp->generator_early, lp->generator_late, NULL);
+                        if (!argv) {
+                                r = -ENOMEM;
+                                goto finish;
+                        }
+                        run_argvs[n_run] = argv;
+
+                        r = strv_extend(&run_paths, generators[i]);
+                        if (r < 0)
+                                goto finish;
+
+                        run_index[n_run++] = i;
+                        continue;
+                }
+
+                if (generator_cache_valid(d, keys[i])) {
+                        runs[i].cached = true;
+                        dirs[i] = d;
+                        d = NULL;
+                        continue;
+                }
+
+                (void) rm_rf(d, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+                normal = strjoin(d, "/normal");
+                early = strjoin(d, "/early");
+                late = strjoin(d, "/late");
+                if (!normal || !early || !late) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                r = mkdir_p(normal, 0755);
+                if (r >= 0)
+                        r = mkdir_p(early, 0755);
+                if (r >= 0)
+                        r = mkdir_p(late, 0755);
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to create cache directory for generator %s: %m", generators[i]);
+                        goto finish;
+                }
+
+                argv = strv_new("", normal, early, late, NULL);
+                if (!argv) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+                run_argvs[n_run] = argv;
+
+                r = strv_extend(&run_paths, generators[i]);
+                if (r < 0)
+                        goto finish;
+
+                dirs[i] = d;
+                d = NULL;
+
+                run_index[n_run++] = i;
+        }
+
+        results = new(ExecResult, n_run);
+        if (!results) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        r = execute_binaries(run_paths, run_argvs, timeout, results);
+        if (r < 0)
+                goto finish;
+
+        for (i = 0; i < n_run; i++) {
+                GeneratorRun *g = runs + run_index[i];
+
+                g->begin = results[i].begin;
+                g->end = results[i].end;
+                g->status = results[i].status;
+
+                /* Store the key calculated before the run: if the inputs changed while the generator ran, the output
+                 * might reflect the old ones, and it is run again next time */
+                if (g->status == EXIT_SUCCESS && dirs[run_index[i]]) {
+                        r = generator_cache_store(dirs[run_index[i]], keys[run_index[i]]);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to store cache key of generator %s, ignoring: %m", g->name);
+                }
+        }
+
+        /* Merge in the order the generators are listed, so that the result doesn't depend on which one finished
+         * first */
+        for (i = 0; i < n; i++) {
+                usec_t begin;
+
+                if (!dirs[i])
+                        continue;
+
+                begin = now(CLOCK_MONOTONIC);
+
+                r = generator_cache_merge(dirs[i], lp);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to copy output of generator %s, ignoring: %m", runs[i].name);
+
+                if (runs[i].cached) {
+                        runs[i].begin = begin;
+                        runs[i].end = now(CLOCK_MONOTONIC);
+                }
+        }
+
+        *ret = runs;
+        *ret_n = n;
+        runs = NULL;
+        r = 0;
+
+finish:
+        if (runs)
+                generator_run_free_many(runs, n);
+        if (run_argvs)
+                for (i = 0; i < n_run; i++)
+                        strv_free(run_argvs[i]);
+        free(run_argvs);
+        if (dirs)
+                for (i = 0; i < n; i++)
+                        free(dirs[i]);
+        free(dirs);
+
+        return r;
+}
+
+typedef struct GeneratorOutput {
+        uint64_t hash;          /* Over the file type and the contents, or the symlink target */
+        struct timespec mtime;
+} GeneratorOutput;
+
+static int generator_output_hash(const char *path, const struct stat *st, uint64_t *ret) {
+        _cleanup_free_ char *contents = NULL;
+        struct siphash state;
+        size_t size = 0;
+        mode_t type;
+        int r;
+
+        assert(path);
+        assert(st);
+        assert(ret);
+
+        type = st->st_mode & S_IFMT;
+
+        if (S_ISLNK(st->st_mode)) {
+                r = readlink_malloc(path, &contents);
+                if (r < 0)
+                        return r;
+
+                size = strlen(contents);
+        } else if (S_ISREG(st->st_mode)) {
+                r = read_full_file(path, &contents, &size);
+                if (r < 0)
+                        return r;
+        }
+
+        siphash24_init(&state, generator_cache_hash_key);
+        siphash24_compress(&type, sizeof(type), &state);
+        if (contents)
+                siphash24_compress(contents, size, &state);
+
+        *ret = siphash24_finalize(&state);
+        return 0;
+}
+
+static int generator_outputs_walk(const char *path, Hashmap *h) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        int r;
+
+        d = opendir(path);
+        if (!d)
+                return errno == ENOENT ? 0 : -errno;
+
+        FOREACH_DIRENT(de, d, return -errno) {
+                _cleanup_free_ GeneratorOutput *o = NULL;
+                _cleanup_free_ char *p = NULL;
+                struct stat st;
+
+                p = strjoin(path, "/", de->d_name);
+                if (!p)
+                        return -ENOMEM;
+
+                if (lstat(p, &st) < 0) {
+                        if (errno == ENOENT)
+                                continue;
+
+                        return -errno;
+                }
+
+                if (S_ISDIR(st.st_mode)) {
+                        r = generator_outputs_walk(p, h);
+                        if (r < 0)
+                                return r;
+
+                        continue;
+                }
+
+                o = new(GeneratorOutput, 1);
+                if (!o)
+                        return -ENOMEM;
+
+                r = generator_output_hash(p, &st, &o->hash);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        return r;
+
+                o->mtime = st.st_mtim;
+
+                r = hashmap_put(h, p, o);
+                if (r < 0)
+                        return r;
+
+                p = NULL;
+                o = NULL;
+        }
+
+        return 0;
+}
+
+int generator_outputs_collect(const LookupPaths *lp, Hashmap **ret) {
+        _cleanup_hashmap_free_free_free_ Hashmap *h = NULL;
+        const char *dirs[] = { lp->generator, lp->generator_early, lp->generator_late };
+        size_t i;
+        int r;
+
+        assert(lp);
+        assert(ret);
+
+        /* Records a hash and the modification time of everything the generators wrote, keyed by path */
+
+        h = hashmap_new(&string_hash_ops);
+        if (!h)
+                return -ENOMEM;
+
+        for (i = 0; i < ELEMENTSOF(dirs); i++) {
+                if (!dirs[i])
+                        continue;
+
+                r = generator_outputs_walk(dirs[i], h);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = h;
+        h = NULL;
+
+        return 0;
+}
+
+int generator_outputs_keep_timestamps(const LookupPaths *lp, Hashmap *before) {
+        _cleanup_hashmap_free_free_free_ Hashmap *after = NULL;
+        GeneratorOutput *o, *old;
+        unsigned n_changed = 0;
+        Iterator i;
+        char *p;
+        int r;
+
+        assert(lp);
+
+        /* Generators write all their output anew when they are run again, hence everything they generated looks
+         * modified afterwards. Compares the output with what was recorded before the run, and gives files and
+         * symlinks whose contents didn't change their previous modification time back, so that only the units whose
+         * generated configuration changed are considered in need of a reload. Returns the number of outputs that
+         * were added, changed or removed. */
+
+        r = generator_outputs_collect(lp, &after);
+        if (r < 0)
+                return r;
+
+        HASHMAP_FOREACH_KEY(o, p, after, i) {
+                old = hashmap_get(before, p);
+                if (!old || old->hash != o->hash) {
+                        n_changed++;
+                        continue;
+                }
+
+                if (old->mtime.tv_sec == o->mtime.tv_sec && old->mtime.tv_nsec == o->mtime.tv_nsec)
+                        continue;
+
+                if (utimensat(AT_FDCWD, p, (const struct timespec[2]) { { .tv_nsec = UTIME_OMIT }, old->mtime },
+                              AT_SYMLINK_NOFOLLOW) < 0) {
+                        log_debug_errno(errno, "Failed to restore timestamp of %s, ignoring: %m", p);
+                        n_changed++;
+                }
+        }
+
+        HASHMAP_FOREACH_KEY(o, p, before, i)
+                if (!hashmap_contains(after, p))
+                        n_changed++;
+
+        return (int) n_changed;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include "hashmap.h"
+#include "path-lookup.h"
+#include "time-util.h"
+
+typedef struct GeneratorRun {
+        char *name;
+        usec_t begin, end;      /* CLOCK_MONOTONIC */
+        bool cached;            /* true if the output of a previous run was reused */
+        int status;             /* The exit status, or a negative errno */
+} GeneratorRun;
+
+int generator_cache_key(const char *path, const LookupPaths *lp, uint64_t *ret);
+
+int generators_run(char **generators, const LookupPaths *lp, usec_t timeout, GeneratorRun **ret, size_t *ret_n);
+void generator_run_free_many(GeneratorRun *runs, size_t n);
+
+int generator_outputs_collect(const LookupPaths *lp, Hashmap **ret);
+int generator_outputs_keep_timestamps(const LookupPaths *lp, Hashmap *before);
@@ -146,6 +146,7 @@ void job_uninstall(Job *j) {
 
         *pj = NULL;
 
+        unit_bump_generation(j->unit);
         unit_add_to_gc_queue(j->unit);
 
         hashmap_remove(j->manager->jobs, UINT32_TO_PTR(j->id));
@@ -225,6 +226,7 @@ Job* job_install(Job *j) {
         /* Install the job */
         *pj = j;
         j->installed = true;
+        unit_bump_generation(j->unit);
 
         j->manager->n_installed_jobs++;
         log_unit_debug(j->unit,
@@ -435,9 +437,8 @@ int job_type_merge_and_collapse(JobType *a, JobType b, Unit *u) {
 }
 
 static bool job_is_runnable(Job *j) {
-        Iterator i;
+        unsigned i;
         Unit *other;
-        void *v;
 
         assert(j);
         assert(j->installed);
@@ -465,7 +466,7 @@ static bool job_is_runnable(Job *j) {
                  * dependencies, regardless whether they are
                  * starting or stopping something. */
 
-                HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_AFTER], i)
+                UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_AFTER, i)
                         if (other->job)
                                 return false;
         }
@@ -473,7 +474,7 @@ static bool job_is_runnable(Job *j) {
         /* Also, if something else is being stopped and we should
          * change state after it, then let's wait. */
 
-        HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_BEFORE], i)
+        UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_BEFORE, i)
                 if (other->job &&
                     IN_SET(other->job->type, JOB_STOP, JOB_RESTART))
                         return false;
@@ -574,6 +575,9 @@ int job_run_and_invalidate(Job *j) {
         job_set_state(j, JOB_RUNNING);
         job_add_to_dbus_queue(j);
 
+        if (j->begin_usec > 0)
+                manager_trace(j->manager, MANAGER_TRACE_JOB_WAIT, j->unit->id, j->begin_usec);
+
 
         switch (j->type) {
 
@@ -831,12 +835,11 @@ static void job_emit_status_message(Unit *u, JobType t, JobResult result) {
 
 static void job_fail_dependencies(Unit *u, UnitDependency d) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[d], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, d, i) {
                 Job *j = other->job;
 
                 if (!j)
@@ -852,8 +855,7 @@ int job_finish_and_invalidate(Job *j, JobResult result, bool recursive, bool alr
         Unit *u;
         Unit *other;
         JobType t;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(j);
         assert(j->installed);
@@ -864,6 +866,9 @@ int job_finish_and_invalidate(Job *j, JobResult result, bool recursive, bool alr
 
         j->result = result;
 
+        if (j->state == JOB_RUNNING && j->begin_running_usec > 0)
+                manager_trace(j->manager, MANAGER_TRACE_JOB_RUN, u->id, j->begin_running_usec);
+
         log_unit_debug(u, "Job %s/%s finished, result=%s", u->id, job_type_to_string(t), job_result_to_string(result));
 
         /* If this job did nothing to respective unit we don't log the status message */
@@ -921,12 +926,12 @@ int job_finish_and_invalidate(Job *j, JobResult result, bool recursive, bool alr
 
 finish:
         /* Try to start the next jobs that can be started */
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_AFTER], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_AFTER, i)
                 if (other->job) {
                         job_add_to_run_queue(other->job);
                         job_add_to_gc_queue(other->job);
                 }
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BEFORE], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BEFORE, i)
                 if (other->job) {
                         job_add_to_run_queue(other->job);
                         job_add_to_gc_queue(other->job);
@@ -1066,6 +1071,86 @@ int job_serialize(Job *j, FILE *f) {
         return 0;
 }
 
+void job_deserialize_item(Job *j, const char *l, const char *v) {
+        assert(j);
+        assert(l);
+        assert(v);
+
+        if (streq(l, "job-id")) {
+
+                if (safe_atou32(v, &j->id) < 0)
+                        log_debug("Failed to parse job id value %s", v);
+
+        } else if (streq(l, "job-type")) {
+                JobType t;
+
+                t = job_type_from_string(v);
+                if (t < 0)
+                        log_debug("Failed to parse job type %s", v);
+                else if (t >= _JOB_TYPE_MAX_IN_TRANSACTION)
+                        log_debug("Cannot deserialize job of type %s", v);
+                else
+                        j->type = t;
+
+        } else if (streq(l, "job-state")) {
+                JobState s;
+
+                s = job_state_from_string(v);
+                if (s < 0)
+                        log_debug("Failed to parse job state %s", v);
+                else
+                        job_set_state(j, s);
+
+        } else if (streq(l, "job-irreversible")) {
+                int b;
+
+                b = parse_boolean(v);
+                if (b < 0)
+                        log_debug("Failed to parse job irreversible flag %s", v);
+                else
+                        j->irreversible = j->irreversible || b;
+
+        } else if (streq(l, "job-sent-dbus-new-signal")) {
+                int b;
+
+                b = parse_boolean(v);
+                if (b < 0)
+                        log_debug("Failed to parse job sent_dbus_new_signal flag %s", v);
+                else
+                        j->sent_dbus_new_signal = j->sent_dbus_new_signal || b;
+
+        } else if (streq(l, "job-ignore-order")) {
+                int b;
+
+                b = parse_boolean(v);
+                if (b < 0)
+                        log_debug("Failed to parse job ignore_order flag %s", v);
+                else
+                        j->ignore_order = j->ignore_order || b;
+
+        } else if (streq(l, "job-begin")) {
+                unsigned long long ull;
+
+                if (sscanf(v, "%llu", &ull) != 1)
+                        log_debug("Failed to parse job-begin value %s", v);
+                else
+                        j->begin_usec = ull;
+
+        } else if (streq(l, "job-begin-running")) {
+                unsigned long long ull;
+
+                if (sscanf(v, "%llu", &ull) != 1)
+                        log_debug("Failed to parse job-begin-running value %s", v);
+                else
+                        j->begin_running_usec = ull;
+
+        } else if (streq(l, "subscribed")) {
+
+                if (strv_extend(&j->deserialized_clients, v) < 0)
+                        log_oom();
+        }
+}
+
 int job_deserialize(Job *j, FILE *f) {
         assert(j);
         assert(f);
@@ -1095,79 +1180,7 @@ int job_deserialize(Job *j, FILE *f) {
                 } else
                         v = l+k;
 
-                if (streq(l, "job-id")) {
-
-                        if (safe_atou32(v, &j->id) < 0)
-                                log_debug("Failed to parse job id value %s", v);
-
-                } else if (streq(l, "job-type")) {
-                        JobType t;
-
-                        t = job_type_from_string(v);
-                        if (t < 0)
-                                log_debug("Failed to parse job type %s", v);
-                        else if (t >= _JOB_TYPE_MAX_IN_TRANSACTION)
-                                log_debug("Cannot deserialize job of type %s", v);
-                        else
-                                j->type = t;
-
-                } else if (streq(l, "job-state")) {
-                        JobState s;
-
-                        s = job_state_from_string(v);
-                        if (s < 0)
-                                log_debug("Failed to parse job state %s", v);
-                        else
-                                job_set_state(j, s);
-
-                } else if (streq(l, "job-irreversible")) {
-                        int b;
-
-                        b = parse_boolean(v);
-                        if (b < 0)
-                                log_debug("Failed to parse job irreversible flag %s", v);
-                        else
-                                j->irreversible = j->irreversible || b;
-
-                } else if (streq(l, "job-sent-dbus-new-signal")) {
-                        int b;
-
-                        b = parse_boolean(v);
-                        if (b < 0)
-                                log_debug("Failed to parse job sent_dbus_new_signal flag %s", v);
-                        else
-                                j->sent_dbus_new_signal = j->sent_dbus_new_signal || b;
-
-                } else if (streq(l, "job-ignore-order")) {
-                        int b;
-
-                        b = parse_boolean(v);
-                        if (b < 0)
-                                log_debug("Failed to parse job ignore_order flag %s", v);
-                        else
-                                j->ignore_order = j->ignore_order || b;
-
-                } else if (streq(l, "job-begin")) {
-                        unsigned long long ull;
-
-                        if (sscanf(v, "%llu", &ull) != 1)
-                                log_debug("Failed to parse job-begin value %s", v);
-                        else
-                                j->begin_usec = ull;
-
-                } else if (streq(l, "job-begin-running")) {
-                        unsigned long long ull;
-
-                        if (sscanf(v, "%llu", &ull) != 1)
-                                log_debug("Failed to parse job-begin-running value %s", v);
-                        else
-                                j->begin_running_usec = ull;
-
-                } else if (streq(l, "subscribed")) {
-
-                        if (strv_extend(&j->deserialized_clients, v) < 0)
-                                log_oom();
-                }
+                job_deserialize_item(j, l, v);
         }
 }
 
@@ -1274,8 +1287,7 @@ int job_get_timeout(Job *j, usec_t *timeout) {
 
 bool job_check_gc(Job *j) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(j);
 
@@ -1304,7 +1316,7 @@ bool job_check_gc(Job *j) {
 
         /* If a job is ordered after ours, and is to be started, then it needs to wait for us, regardless if we stop or
          * start, hence let's not GC in that case. */
-        HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_BEFORE], i) {
+        UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_BEFORE, i) {
                 if (!other->job)
                         continue;
 
@@ -1317,7 +1329,7 @@ bool job_check_gc(Job *j) {
 
         /* If we are going down, but something else is ordered After= us, then it needs to wait for us */
         if (IN_SET(j->type, JOB_STOP, JOB_RESTART))
-                HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_AFTER], i) {
+                UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_AFTER, i) {
                         if (!other->job)
                                 continue;
 
@@ -1394,8 +1406,7 @@ int job_get_before(Job *j, Job*** ret) {
         _cleanup_free_ Job** list = NULL;
         size_t n = 0, n_allocated = 0;
         Unit *other = NULL;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         /* Returns a list of all pending jobs that need to finish before this job may be started. */
 
@@ -1409,7 +1420,7 @@ int job_get_before(Job *j, Job*** ret) {
 
         if (IN_SET(j->type, JOB_START, JOB_VERIFY_ACTIVE, JOB_RELOAD)) {
 
-                HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_AFTER], i) {
+                UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_AFTER, i) {
                         if (!other->job)
                                 continue;
 
@@ -1419,7 +1430,7 @@ int job_get_before(Job *j, Job*** ret) {
                 }
         }
 
-        HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_BEFORE], i) {
+        UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_BEFORE, i) {
                 if (!other->job)
                         continue;
 
@@ -1443,15 +1454,14 @@ int job_get_after(Job *j, Job*** ret) {
         _cleanup_free_ Job** list = NULL;
         size_t n = 0, n_allocated = 0;
         Unit *other = NULL;
-        void *v;
-        Iterator i;
+        unsigned i;
 
         assert(j);
         assert(ret);
 
         /* Returns a list of all pending jobs that are waiting for this job to finish. */
 
-        HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_BEFORE], i) {
+        UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_BEFORE, i) {
                 if (!other->job)
                         continue;
 
@@ -1468,7 +1478,7 @@ int job_get_after(Job *j, Job*** ret) {
 
         if (IN_SET(j->type, JOB_STOP, JOB_RESTART)) {
 
-                HASHMAP_FOREACH_KEY(v, other, j->unit->dependencies[UNIT_AFTER], i) {
+                UNIT_FOREACH_DEPENDENCY(other, j->unit, UNIT_AFTER, i) {
                         if (!other->job)
                                 continue;
 
@@ -144,6 +144,10 @@ struct Job {
         Job* marker;
         unsigned generation;
 
+        /* Used for finding ordering cycles, valid if generation matches the current walk */
+        unsigned order_index;
+        unsigned order_lowlink;
+
         uint32_t id;
 
         JobType type;
@@ -174,6 +178,7 @@ struct Job {
         bool irreversible:1;
         bool in_gc_queue:1;
         bool ref_by_private_bus:1;
+        bool order_on_stack:1;
 };
 
 Job* job_new(Unit *unit, JobType type);
@@ -185,6 +190,7 @@ void job_uninstall(Job *j);
 void job_dump(Job *j, FILE*f, const char *prefix);
 int job_serialize(Job *j, FILE *f);
 int job_deserialize(Job *j, FILE *f);
+void job_deserialize_item(Job *j, const char *key, const char *value);
 int job_coldplug(Job *j);
 
 JobDependency* job_dependency_new(Job *subject, Job *object, bool matters, bool conflicts);
@@ -58,16 +58,16 @@ static int process_deps(Unit *u, UnitDependency dependency, const char *dir_suff
         char **p;
         int r;
 
-        r = unit_file_find_dropin_paths(NULL,
-                                        u->manager->lookup_paths.search_path,
-                                        u->manager->unit_path_cache,
-                                        dir_suffix,
-                                        NULL,
-                                        u->names,
-                                        &paths);
+        r = unit_find_dependency_dropin_paths(u, dir_suffix, &paths);
         if (r < 0)
                 return r;
 
+        /* Remember where the dependencies came from, so that unit_need_daemon_reload() notices added or removed
+         * symlinks */
+        r = strv_extend_strv(&u->dependency_dropin_paths, paths, false);
+        if (r < 0)
+                return log_oom();
+
         STRV_FOREACH(p, paths) {
                 const char *entry;
                 _cleanup_free_ char *target = NULL;
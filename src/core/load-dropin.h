@@ -33,4 +33,14 @@ static inline int unit_find_dropin_paths(Unit *u, char ***paths) {
                                                 paths);
 }
 
+static inline int unit_find_dependency_dropin_paths(Unit *u, const char *dir_suffix, char ***paths) {
+        return unit_file_find_dropin_paths(NULL,
+                                           u->manager->lookup_paths.search_path,
+                                           u->manager->unit_path_cache,
+                                           dir_suffix,
+                                           NULL,
+                                           u->names,
+                                           paths);
+}
+
 int unit_load_dropin(Unit *u);
@@ -129,6 +129,7 @@ static struct rlimit *arg_default_rlimit[_RLIMIT_MAX] = {};
 static uint64_t arg_capability_bounding_set = CAP_ALL;
 static nsec_t arg_timer_slack_nsec = NSEC_INFINITY;
 static usec_t arg_default_timer_accuracy_usec = 1 * USEC_PER_MINUTE;
+static usec_t arg_accounting_refresh_usec = DEFAULT_ACCOUNTING_REFRESH_USEC;
 static Set* arg_syscall_archs = NULL;
 static FILE* arg_serialization = NULL;
 static bool arg_default_cpu_accounting = false;
@@ -809,6 +810,7 @@ static int parse_config_file(void) {
                 { "Manager", "DefaultMemoryAccounting",   config_parse_bool,             0, &arg_default_memory_accounting         },
                 { "Manager", "DefaultTasksAccounting",    config_parse_bool,             0, &arg_default_tasks_accounting          },
                 { "Manager", "DefaultTasksMax",           config_parse_tasks_max,        0, &arg_default_tasks_max                 },
+                { "Manager", "AccountingRefreshSec",      config_parse_sec,              0, &arg_accounting_refresh_usec           },
                 { "Manager", "CtrlAltDelBurstAction",     config_parse_emergency_action, 0, &arg_cad_burst_action                  },
                 {}
         };
@@ -854,6 +856,7 @@ static void set_manager_defaults(Manager *m) {
         m->default_memory_accounting = arg_default_memory_accounting;
         m->default_tasks_accounting = arg_default_tasks_accounting;
         m->default_tasks_max = arg_default_tasks_max;
+        m->accounting_refresh_usec = arg_accounting_refresh_usec;
 
         manager_set_default_rlimits(m, arg_default_rlimit);
         manager_environment_add(m, NULL, arg_default_environment);
@@ -1195,6 +1198,21 @@ static int help(void) {
         return 0;
 }
 
+static bool reexecute_same_binary(void) {
+        struct stat a, b;
+
+        /* Checks whether the binary we are going to execute is still the one we are running from, i.e. it was not
+         * replaced by an update since we were started */
+
+        if (stat("/proc/self/exe", &a) < 0)
+                return false;
+
+        if (stat(SYSTEMD_BINARY_PATH, &b) < 0)
+                return false;
+
+        return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
 static int prepare_reexecute(Manager *m, FILE **_f, FDSet **_fds, bool switching_root) {
         _cleanup_fdset_free_ FDSet *fds = NULL;
         _cleanup_fclose_ FILE *f = NULL;
@@ -1216,7 +1234,10 @@ static int prepare_reexecute(Manager *m, FILE **_f, FDSet **_fds, bool switching
         if (!fds)
                 return log_oom();
 
-        r = manager_serialize(m, f, fds, switching_root);
+        /* When switching root, or reexecuting after an update, we might transition into a different version of
+         * systemd, which might not understand the binary format, hence stick to the text format every version
+         * understands in that case. */
+        r = manager_serialize(m, f, fds, switching_root, !switching_root && reexecute_same_binary());
         if (r < 0)
                 return log_error_errno(r, "Failed to serialize state: %m");
 
@@ -1783,6 +1804,20 @@ static int invoke_main_loop(
 
                 switch (m->exit_code) {
 
+                case MANAGER_RELOAD_INCREMENTAL:
+                        log_info("Reloading changed units.");
+
+                        r = manager_reload_incremental(m);
+                        if (r != -EBUSY) {
+                                if (r < 0)
+                                        log_warning_errno(r, "Failed to reload changed units, ignoring: %m");
+
+                                break;
+                        }
+
+                        log_info("Changes can't be applied incrementally, falling back to full reload.");
+                        _fallthrough_;
+
                 case MANAGER_RELOAD:
                         log_info("Reloading.");
 
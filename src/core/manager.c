@@ -20,6 +20,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <linux/kd.h>
 #include <signal.h>
 #include <stdio_ext.h>
@@ -27,6 +28,7 @@
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/reboot.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
@@ -49,6 +51,7 @@
 #include "bus-util.h"
 #include "clean-ipc.h"
 #include "clock-util.h"
+#include "conf-files.h"
 #include "dbus-job.h"
 #include "dbus-manager.h"
 #include "dbus-unit.h"
@@ -62,6 +65,7 @@
 #include "fd-util.h"
 #include "fileio.h"
 #include "fs-util.h"
+#include "generator-cache.h"
 #include "hashmap.h"
 #include "io-util.h"
 #include "label.h"
@@ -77,7 +81,11 @@
 #include "process-util.h"
 #include "ratelimit.h"
 #include "rm-rf.h"
+#include "serialize-binary.h"
+#include "service.h"
 #include "signal-util.h"
+#include "socket.h"
+#include "sparse-endian.h"
 #include "special.h"
 #include "stat-util.h"
 #include "string-table.h"
@@ -88,6 +96,7 @@
 #include "time-util.h"
 #include "transaction.h"
 #include "umask-util.h"
+#include "unit-file-index.h"
 #include "unit-name.h"
 #include "user-util.h"
 #include "util.h"
@@ -97,6 +106,9 @@
 #define NOTIFY_RCVBUF_SIZE (8*1024*1024)
 #define CGROUPS_AGENT_RCVBUF_SIZE (8*1024*1024)
 
+/* How many cgroups agent datagrams to process per event loop iteration */
+#define CGROUPS_AGENT_MAX_BATCH 64U
+
 /* Initial delay and the interval for printing status messages about running jobs */
 #define JOBS_IN_PROGRESS_WAIT_USEC (5*USEC_PER_SEC)
 #define JOBS_IN_PROGRESS_PERIOD_USEC (USEC_PER_SEC / 3)
@@ -113,6 +125,7 @@ static int manager_dispatch_run_queue(sd_event_source *source, void *userdata);
 static int manager_dispatch_sigchld(sd_event_source *source, void *userdata);
 static int manager_run_environment_generators(Manager *m);
 static int manager_run_generators(Manager *m);
+static void manager_free_trace(Manager *m);
 
 static void manager_watch_jobs_in_progress(Manager *m) {
         usec_t next;
@@ -673,6 +686,7 @@ int manager_new(UnitFileScope scope, unsigned test_run_flags, Manager **_m) {
         m->unit_file_scope = scope;
         m->exit_code = _MANAGER_EXIT_CODE_INVALID;
         m->default_timer_accuracy_usec = USEC_PER_MINUTE;
+        m->accounting_refresh_usec = DEFAULT_ACCOUNTING_REFRESH_USEC;
         m->default_tasks_accounting = true;
         m->default_tasks_max = UINT64_MAX;
         m->default_timeout_start_usec = DEFAULT_TIMEOUT_USEC;
@@ -1031,13 +1045,12 @@ enum {
 
 static void unit_gc_mark_good(Unit *u, unsigned gc_marker) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         u->gc_marker = gc_marker + GC_OFFSET_GOOD;
 
         /* Recursively mark referenced units as GOOD as well */
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REFERENCES], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REFERENCES, i)
                 if (other->gc_marker == gc_marker + GC_OFFSET_UNSURE)
                         unit_gc_mark_good(other, gc_marker);
 }
@@ -1045,8 +1058,7 @@ static void unit_gc_mark_good(Unit *u, unsigned gc_marker) {
 static void unit_gc_sweep(Unit *u, unsigned gc_marker) {
         Unit *other;
         bool is_bad;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
 
@@ -1064,7 +1076,7 @@ static void unit_gc_sweep(Unit *u, unsigned gc_marker) {
 
         is_bad = true;
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REFERENCED_BY], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REFERENCED_BY, i) {
                 unit_gc_sweep(other, gc_marker);
 
                 if (other->gc_marker == gc_marker + GC_OFFSET_GOOD)
@@ -1205,6 +1217,9 @@ Manager* manager_free(Manager *m) {
 
         hashmap_free(m->units);
         hashmap_free(m->units_by_invocation_id);
+        free(m->units_sorted);
+        manager_forget_unit_tombstones(m);
+        manager_free_trace(m);
         hashmap_free(m->jobs);
         hashmap_free(m->watch_pids);
         hashmap_free(m->watch_bus);
@@ -1241,6 +1256,7 @@ Manager* manager_free(Manager *m) {
 
         hashmap_free(m->cgroup_unit);
         set_free_free(m->unit_path_cache);
+        unit_file_index_shared_free();
 
         free(m->switch_root);
         free(m->switch_root_init);
@@ -1304,6 +1320,7 @@ static void manager_coldplug(Manager *m) {
 }
 
 static void manager_build_unit_path_cache(Manager *m) {
+        UnitFileIndex *idx;
         char **i;
         int r;
 
@@ -1318,23 +1335,41 @@ static void manager_build_unit_path_cache(Manager *m) {
         }
 
         /* This simply builds a list of files we know exist, so that
-         * we don't always have to go to disk */
+         * we don't always have to go to disk. The directories are
+         * taken from the unit file index, which we keep around
+         * between reloads and which only rereads what changed. We
+         * only need the top-level entries, hence don't descend into
+         * subdirectories, and leave them to the install logic. */
+
+        idx = unit_file_index_shared();
+        if (!idx) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        r = unit_file_index_update(idx, m->lookup_paths.search_path, 0);
+        if (r < 0)
+                goto fail;
+
+        log_debug("Unit file index up-to-date, reread %u directories.", idx->n_read);
 
         STRV_FOREACH(i, m->lookup_paths.search_path) {
-                _cleanup_closedir_ DIR *d = NULL;
-                struct dirent *de;
+                UnitFileIndexDir *d;
+                size_t k;
 
-                d = opendir(*i);
-                if (!d) {
-                        if (errno != ENOENT)
-                                log_warning_errno(errno, "Failed to open directory %s, ignoring: %m", *i);
+                d = unit_file_index_get_dir(idx, *i);
+                if (!d)
+                        continue;
+                if (d->error < 0) {
+                        if (d->error != -ENOENT)
+                                log_warning_errno(d->error, "Failed to open directory %s, ignoring: %m", *i);
                         continue;
                 }
 
-                FOREACH_DIRENT(de, d, r = -errno; goto fail) {
+                for (k = 0; k < d->n_entries; k++) {
                         char *p;
 
-                        p = strjoin(streq(*i, "/") ? "" : *i, "/", de->d_name);
+                        p = strjoin(streq(*i, "/") ? "" : *i, "/", d->entries[k].name);
                         if (!p) {
                                 r = -ENOMEM;
                                 goto fail;
@@ -1481,8 +1516,9 @@ int manager_startup(Manager *m, FILE *serialization, FDSet *fds) {
 }
 
 int manager_add_job(Manager *m, JobType type, Unit *unit, JobMode mode, sd_bus_error *e, Job **_ret) {
-        int r;
         Transaction *tr;
+        usec_t begin;
+        int r;
 
         assert(m);
         assert(type < _JOB_TYPE_MAX);
@@ -1497,6 +1533,7 @@ int manager_add_job(Manager *m, JobType type, Unit *unit, JobMode mode, sd_bus_e
 
         log_unit_debug(unit, "Trying to enqueue job %s/%s/%s", unit->id, job_type_to_string(type), job_mode_to_string(mode));
 
+        begin = now(CLOCK_MONOTONIC);
         type = job_type_collapse(type, unit);
 
         tr = transaction_new(mode == JOB_REPLACE_IRREVERSIBLY);
@@ -1527,11 +1564,13 @@ int manager_add_job(Manager *m, JobType type, Unit *unit, JobMode mode, sd_bus_e
                 *_ret = tr->anchor_job;
 
         transaction_free(tr);
+        manager_trace(m, MANAGER_TRACE_TRANSACTION, unit->id, begin);
         return 0;
 
 tr_abort:
         transaction_abort(tr);
         transaction_free(tr);
+        manager_trace(m, MANAGER_TRACE_TRANSACTION, unit->id, begin);
         return r;
 }
 
@@ -1615,6 +1654,301 @@ Unit *manager_get_unit(Manager *m, const char *name) {
         return hashmap_get(m->units, name);
 }
 
+int manager_get_units_sorted(Manager *m, Unit ***ret, size_t *ret_n) {
+        Iterator i;
+        const char *k;
+        Unit *u;
+        size_t n = 0;
+
+        assert(m);
+        assert(ret);
+        assert(ret_n);
+
+        /* Returns all units (but no aliases) ordered by their id. The array is rebuilt lazily whenever units are
+         * added, removed or renamed, and is owned by the manager. */
+
+        if (m->units_sorted_dirty || !m->units_sorted) {
+                if (!GREEDY_REALLOC(m->units_sorted, m->n_units_sorted_allocated, hashmap_size(m->units) + 1))
+                        return -ENOMEM;
+
+                HASHMAP_FOREACH_KEY(u, k, m->units, i)
+                        if (k == u->id)
+                                m->units_sorted[n++] = u;
+
+                qsort_safe(m->units_sorted, n, sizeof(Unit*), unit_compare_id);
+
+                m->n_units_sorted = n;
+                m->units_sorted_dirty = false;
+        }
+
+        *ret = m->units_sorted;
+        *ret_n = m->n_units_sorted;
+        return 0;
+}
+
+static bool list_units_states_indexed(char **states) {
+        char **p;
+
+        /* The per-state index covers active states only, filters that mention load or sub states need a full
+         * scan */
+
+        STRV_FOREACH(p, states)
+                if (unit_active_state_from_string(*p) < 0)
+                        return false;
+
+        return true;
+}
+
+int manager_list_units_page(
+                Manager *m,
+                char **states,
+                uint64_t types,
+                char **patterns,
+                uint64_t since,
+                const char *cursor,
+                unsigned max,
+                Unit ***ret,
+                size_t *ret_n,
+                bool *ret_more) {
+
+        _cleanup_free_ Unit **candidates = NULL, **page = NULL;
+        size_t n_candidates = 0, n_allocated = 0, n_page = 0, n_page_allocated = 0, n_units, l, h;
+        Unit **units, *u;
+        bool more = false;
+        char **p;
+        int r;
+
+        assert(m);
+        assert(ret);
+        assert(ret_n);
+        assert(ret_more);
+
+        /* Returns the units matching the specified active, load or sub states, types (as mask of 1 << UnitType)
+         * and name patterns, that changed after the specified generation, ordered by id. At most 'max' units
+         * following the one named by the cursor are returned, and 'ret_more' tells whether more are left. Empty
+         * filters match everything. */
+
+        /* Narrow down the set of units to look at via the per-state or per-type lists if we can, and use the
+         * array of all units sorted by id otherwise */
+        if (!strv_isempty(states) && list_units_states_indexed(states)) {
+                STRV_FOREACH(p, states) {
+                        if (strv_contains(p + 1, *p))
+                                continue;
+
+                        LIST_FOREACH(units_by_active_state, u, m->units_by_active_state[unit_active_state_from_string(*p)]) {
+                                if (!GREEDY_REALLOC(candidates, n_allocated, n_candidates + 1))
+                                        return -ENOMEM;
+
+                                candidates[n_candidates++] = u;
+                        }
+                }
+
+        } else if (types != 0) {
+                UnitType t;
+
+                for (t = 0; t < _UNIT_TYPE_MAX; t++) {
+                        if (!(types & (UINT64_C(1) << t)))
+                                continue;
+
+                        LIST_FOREACH(units_by_type, u, m->units_by_type[t]) {
+                                if (!GREEDY_REALLOC(candidates, n_allocated, n_candidates + 1))
+                                        return -ENOMEM;
+
+                                candidates[n_candidates++] = u;
+                        }
+                }
+        }
+
+        if (candidates) {
+                qsort_safe(candidates, n_candidates, sizeof(Unit*), unit_compare_id);
+                units = candidates;
+                n_units = n_candidates;
+        } else {
+                r = manager_get_units_sorted(m, &units, &n_units);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Skip to the first unit after the cursor */
+        l = 0;
+        h = n_units;
+        if (!isempty(cursor))
+                while (l < h) {
+                        size_t k = (l + h) / 2;
+
+                        if (strcmp(units[k]->id, cursor) <= 0)
+                                l = k + 1;
+                        else
+                                h = k;
+                }
+
+        for (; l < n_units; l++) {
+                u = units[l];
+
+                if (u->load_state == UNIT_MERGED)
+                        continue;
+
+                if (since > 0 && u->generation <= since)
+                        continue;
+
+                if (types != 0 && !(types & (UINT64_C(1) << u->type)))
+                        continue;
+
+                if (!strv_isempty(states) &&
+                    !strv_contains(states, unit_load_state_to_string(u->load_state)) &&
+                    !strv_contains(states, unit_active_state_to_string(unit_active_state(u))) &&
+                    !strv_contains(states, unit_sub_state_to_string(u)))
+                        continue;
+
+                if (!strv_isempty(patterns) &&
+                    !strv_fnmatch_or_empty(patterns, u->id, FNM_NOESCAPE))
+                        continue;
+
+                if (max > 0 && n_page >= max) {
+                        more = true;
+                        break;
+                }
+
+                if (!GREEDY_REALLOC(page, n_page_allocated, n_page + 1))
+                        return -ENOMEM;
+
+                page[n_page++] = u;
+        }
+
+        *ret = page;
+        *ret_n = n_page;
+        *ret_more = more;
+        page = NULL;
+
+        return 0;
+}
+
+void manager_add_unit_tombstone(Manager *m, const char *id) {
+        UnitTombstone *t;
+        char *copy;
+
+        assert(m);
+        assert(id);
+
+        /* Remembers that a unit went away, so that clients polling for changes learn about it. The ring buffer is
+         * bounded: once an entry is overwritten the horizon moves forward, and clients that are further behind
+         * need to resynchronize from scratch. */
+
+        if (!m->unit_tombstones) {
+                m->unit_tombstones = new0(UnitTombstone, UNIT_TOMBSTONES_MAX);
+                if (!m->unit_tombstones) {
+                        log_oom();
+                        m->unit_tombstones_horizon = ++m->unit_generation;
+                        return;
+                }
+        }
+
+        copy = strdup(id);
+        if (!copy) {
+                log_oom();
+                m->unit_tombstones_horizon = ++m->unit_generation;
+                return;
+        }
+
+        t = m->unit_tombstones + m->unit_tombstones_next;
+        if (t->id) {
+                m->unit_tombstones_horizon = t->generation;
+                free(t->id);
+        } else
+                m->n_unit_tombstones++;
+
+        t->id = copy;
+        t->generation = ++m->unit_generation;
+
+        m->unit_tombstones_next = (m->unit_tombstones_next + 1) % UNIT_TOMBSTONES_MAX;
+}
+
+void manager_forget_unit_tombstones(Manager *m) {
+        size_t k;
+
+        assert(m);
+
+        /* After a reload unit removals are not tracked individually, hence invalidate all generations handed out
+         * so far */
+
+        if (m->unit_tombstones)
+                for (k = 0; k < UNIT_TOMBSTONES_MAX; k++)
+                        free(m->unit_tombstones[k].id);
+
+        m->unit_tombstones = mfree(m->unit_tombstones);
+        m->n_unit_tombstones = m->unit_tombstones_next = 0;
+        m->unit_tombstones_horizon = ++m->unit_generation;
+}
+
+void manager_trace_range(Manager *m, ManagerTracePhase phase, const char *name, usec_t begin, usec_t end) {
+        ManagerTraceSpan *s;
+        char *copy = NULL;
+
+        assert(m);
+        assert(phase >= 0 && phase < _MANAGER_TRACE_PHASE_MAX);
+
+        /* Records a span of work of the specified phase. This is supposed to be cheap enough to be always enabled,
+         * hence we keep a fixed number of spans and overwrite the oldest ones. */
+
+        if (!m->trace_spans) {
+                m->trace_spans = new0(ManagerTraceSpan, MANAGER_TRACE_SPANS_MAX);
+                if (!m->trace_spans)
+                        return;
+        }
+
+        if (name) {
+                copy = strdup(name);
+                if (!copy)
+                        return;
+        }
+
+        s = m->trace_spans + m->trace_spans_next;
+        if (m->n_trace_spans >= MANAGER_TRACE_SPANS_MAX)
+                free(s->name);
+        else
+                m->n_trace_spans++;
+
+        *s = (ManagerTraceSpan) {
+                .phase = phase,
+                .name = copy,
+                .begin = begin,
+                .end = end,
+        };
+
+        m->trace_spans_next = (m->trace_spans_next + 1) % MANAGER_TRACE_SPANS_MAX;
+}
+
+void manager_trace(Manager *m, ManagerTracePhase phase, const char *name, usec_t begin) {
+        /* Records a span that started at 'begin' and ends now */
+        manager_trace_range(m, phase, name, begin, now(CLOCK_MONOTONIC));
+}
+
+ManagerTraceSpan *manager_trace_span(Manager *m, size_t i) {
+        assert(m);
+
+        /* Returns the i-th span, counting from the oldest one still recorded */
+
+        if (i >= m->n_trace_spans)
+                return NULL;
+
+        if (m->n_trace_spans < MANAGER_TRACE_SPANS_MAX)
+                return m->trace_spans + i;
+
+        return m->trace_spans + (m->trace_spans_next + i) % MANAGER_TRACE_SPANS_MAX;
+}
+
+static void manager_free_trace(Manager *m) {
+        size_t k;
+
+        assert(m);
+
+        for (k = 0; k < m->n_trace_spans; k++)
+                free(m->trace_spans[k].name);
+
+        m->trace_spans = mfree(m->trace_spans);
+        m->n_trace_spans = m->trace_spans_next = 0;
+}
+
 unsigned manager_dispatch_load_queue(Manager *m) {
         Unit *u;
         unsigned n = 0;
@@ -1631,9 +1965,13 @@ unsigned manager_dispatch_load_queue(Manager *m) {
          * tries to load its data until the queue is empty */
 
         while ((u = m->load_queue)) {
+                usec_t begin;
+
                 assert(u->in_load_queue);
 
+                begin = now(CLOCK_MONOTONIC);
                 unit_load(u);
+                manager_trace(m, MANAGER_TRACE_LOAD, u->id, begin);
                 n++;
         }
 
@@ -1879,33 +2217,55 @@ static unsigned manager_dispatch_dbus_queue(Manager *m) {
         return n;
 }
 
-static int manager_dispatch_cgroups_agent_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
-        Manager *m = userdata;
-        char buf[PATH_MAX+1];
-        ssize_t n;
+int manager_read_cgroups_agent(Manager *m, int fd) {
+        unsigned k;
 
-        n = recv(fd, buf, sizeof(buf), 0);
-        if (n < 0)
-                return log_error_errno(errno, "Failed to read cgroups agent message: %m");
-        if (n == 0) {
-                log_error("Got zero-length cgroups agent message, ignoring.");
-                return 0;
-        }
-        if ((size_t) n >= sizeof(buf)) {
-                log_error("Got overly long cgroups agent message, ignoring.");
-                return 0;
-        }
+        assert(m);
+        assert(fd >= 0);
 
-        if (memchr(buf, 0, n)) {
-                log_error("Got cgroups agent message with embedded NUL byte, ignoring.");
-                return 0;
+        /* When many cgroups run empty at the same time the agent sends us a burst of datagrams. Let's process all
+         * that are queued (up to a limit, so that we don't starve other event sources) in one go, rather than
+         * returning to the event loop for each one. Returns the number of datagrams read. */
+
+        for (k = 0; k < CGROUPS_AGENT_MAX_BATCH; k++) {
+                char buf[PATH_MAX+1];
+                ssize_t n;
+
+                n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+                if (n < 0) {
+                        if (IN_SET(errno, EINTR, EAGAIN))
+                                break;
+
+                        return log_error_errno(errno, "Failed to read cgroups agent message: %m");
+                }
+                if (n == 0) {
+                        log_error("Got zero-length cgroups agent message, ignoring.");
+                        continue;
+                }
+                if ((size_t) n >= sizeof(buf)) {
+                        log_error("Got overly long cgroups agent message, ignoring.");
+                        continue;
+                }
+
+                if (memchr(buf, 0, n)) {
+                        log_error("Got cgroups agent message with embedded NUL byte, ignoring.");
+                        continue;
+                }
+                buf[n] = 0;
+
+                manager_notify_cgroup_empty(m, buf);
+                (void) bus_forward_agent_released(m, buf);
         }
-        buf[n] = 0;
 
-        manager_notify_cgroup_empty(m, buf);
-        (void) bus_forward_agent_released(m, buf);
+        return (int) k;
+}
 
-        return 0;
+static int manager_dispatch_cgroups_agent_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        Manager *m = userdata;
+        int r;
+
+        r = manager_read_cgroups_agent(m, fd);
+        return r < 0 ? r : 0;
 }
 
 static void manager_invoke_notify_message(
@@ -2699,6 +3059,136 @@ void manager_send_unit_plymouth(Manager *m, Unit *u) {
                         log_error_errno(errno, "Failed to write Plymouth message: %m");
 }
 
+/* The binary serialization format used when reloading, and when reexecuting the same binary. It starts with a
+ * header, followed by a record for the manager state and one for each unit, and is terminated by an index of these
+ * records and a trailer pointing to it. The records consist of length-prefixed items, see serialize-binary.c. Thanks
+ * to the index the serialization may be mapped and the records handed to the deserializers individually, and units
+ * that fail to load are skipped without looking at their data. It is only written when we deserialize into the
+ * same binary again, as other versions of systemd we might reexecute into don't necessarily know it. */
+
+#define SERIALIZATION_MAGIC "SDSTATE"
+#define SERIALIZATION_VERSION 2
+
+enum {
+        SERIALIZATION_RECORD_MANAGER,
+        SERIALIZATION_RECORD_UNIT,
+};
+
+typedef struct SerializationHeader {
+        uint8_t magic[8];
+        le32_t version;
+        le32_t reserved;
+} _packed_ SerializationHeader;
+
+/* For unit records the payload is preceded by the NUL terminated unit name, name_size covers both */
+typedef struct SerializationIndexEntry {
+        le32_t type;
+        le32_t name_size;
+        le64_t offset;
+        le64_t size;
+} _packed_ SerializationIndexEntry;
+
+typedef struct SerializationTrailer {
+        le64_t index_offset;
+        le64_t n_entries;
+        le64_t n_units;
+        uint8_t magic[8];
+} _packed_ SerializationTrailer;
+
+typedef struct SerializationIndex {
+        SerializationIndexEntry *entries;
+        size_t n_entries;
+        size_t n_allocated;
+        uint64_t n_units;
+} SerializationIndex;
+
+static void serialization_index_done(SerializationIndex *idx) {
+        assert(idx);
+
+        idx->entries = mfree(idx->entries);
+}
+
+static int serialization_index_add(SerializationIndex *idx, FILE *f, uint32_t type, uint32_t name_size, off_t offset) {
+        off_t end;
+
+        assert(idx);
+        assert(f);
+
+        end = ftello(f);
+        if (end < 0)
+                return -errno;
+
+        if (!GREEDY_REALLOC(idx->entries, idx->n_allocated, idx->n_entries + 1))
+                return -ENOMEM;
+
+        idx->entries[idx->n_entries++] = (SerializationIndexEntry) {
+                .type = htole32(type),
+                .name_size = htole32(name_size),
+                .offset = htole64(offset),
+                .size = htole64(end - offset),
+        };
+
+        if (type == SERIALIZATION_RECORD_UNIT)
+                idx->n_units++;
+
+        return 0;
+}
+
+static int serialization_index_write(SerializationIndex *idx, FILE *f) {
+        static const uint8_t padding[8] = {};
+        SerializationTrailer t = {
+                .magic = SERIALIZATION_MAGIC,
+        };
+        off_t offset;
+
+        assert(idx);
+        assert(f);
+
+        offset = ftello(f);
+        if (offset < 0)
+                return -errno;
+
+        /* Align the index, so that it can be accessed directly when mapped */
+        if (offset % 8 != 0) {
+                fwrite(padding, 1, 8 - offset % 8, f);
+                offset += 8 - offset % 8;
+        }
+
+        fwrite(idx->entries, sizeof(SerializationIndexEntry), idx->n_entries, f);
+
+        t.index_offset = htole64(offset);
+        t.n_entries = htole64(idx->n_entries);
+        t.n_units = htole64(idx->n_units);
+        fwrite(&t, sizeof(t), 1, f);
+
+        return fflush_and_check(f);
+}
+
+static int serialization_record_write(FILE *f, FILE *text, char **buf, size_t *size) {
+        int r;
+
+        assert(f);
+        assert(text);
+        assert(buf);
+        assert(size);
+
+        /* Writes the lines the text serializers wrote to the memory stream as the items of a record, and rewinds
+         * the stream for the next record */
+
+        r = fflush_and_check(text);
+        if (r < 0)
+                return r;
+
+        r = serialize_binary_items(f, *buf, *size);
+        if (r < 0)
+                return r;
+
+        if (fseeko(text, 0, SEEK_SET) < 0)
+                return -errno;
+
+        return 0;
+}
+
 int manager_open_serialization(Manager *m, FILE **_f) {
         int fd;
         FILE *f;
@@ -2719,19 +3209,15 @@ int manager_open_serialization(Manager *m, FILE **_f) {
         return 0;
 }
 
-int manager_serialize(Manager *m, FILE *f, FDSet *fds, bool switching_root) {
+static int manager_serialize_items(Manager *m, FILE *f, FDSet *fds, bool switching_root) {
         ManagerTimestamp q;
         const char *t;
-        Iterator i;
-        Unit *u;
         int r;
 
         assert(m);
         assert(f);
         assert(fds);
 
-        m->n_reloading++;
-
         fprintf(f, "current-job-id=%"PRIu32"\n", m->current_job_id);
         fprintf(f, "n-installed-jobs=%u\n", m->n_installed_jobs);
         fprintf(f, "n-failed-jobs=%u\n", m->n_failed_jobs);
@@ -2802,311 +3288,1085 @@ int manager_serialize(Manager *m, FILE *f, FDSet *fds, bool switching_root) {
 
         (void) fputc('\n', f);
 
-        HASHMAP_FOREACH_KEY(u, t, m->units, i) {
-                if (u->id != t)
-                        continue;
-
-                /* Start marker */
-                fputs(u->id, f);
-                fputc('\n', f);
-
-                r = unit_serialize(u, f, fds, !switching_root);
-                if (r < 0) {
-                        m->n_reloading--;
-                        return r;
-                }
-        }
-
-        assert(m->n_reloading > 0);
-        m->n_reloading--;
-
-        if (ferror(f))
-                return -EIO;
-
-        r = bus_fdset_add_all(m, fds);
-        if (r < 0)
-                return r;
-
         return 0;
 }
 
-int manager_deserialize(Manager *m, FILE *f, FDSet *fds) {
-        int r = 0;
+static int manager_serialize_binary(Manager *m, FILE *f, FDSet *fds, bool switching_root) {
+        _cleanup_(serialization_index_done) SerializationIndex idx = {};
+        SerializationHeader h = {
+                .magic = SERIALIZATION_MAGIC,
+                .version = htole32(SERIALIZATION_VERSION),
+        };
+        _cleanup_free_ char *buf = NULL;
+        _cleanup_fclose_ FILE *text = NULL;
+        const char *t;
+        size_t size = 0;
+        off_t offset;
+        Iterator i;
+        Unit *u;
+        int r;
 
         assert(m);
         assert(f);
+        assert(fds);
 
-        log_debug("Deserializing state...");
+        /* The serializers still write text, which is collected in memory and written out as items record by
+         * record */
+        text = open_memstream(&buf, &size);
+        if (!text)
+                return -ENOMEM;
 
-        m->n_reloading++;
+        fwrite(&h, sizeof(h), 1, f);
+
+        offset = ftello(f);
+        if (offset < 0)
+                return -errno;
+
+        r = manager_serialize_items(m, text, fds, switching_root);
+        if (r < 0)
+                return r;
+
+        r = serialization_record_write(f, text, &buf, &size);
+        if (r < 0)
+                return r;
+
+        r = serialization_index_add(&idx, f, SERIALIZATION_RECORD_MANAGER, 0, offset);
+        if (r < 0)
+                return r;
+
+        HASHMAP_FOREACH_KEY(u, t, m->units, i) {
+                if (u->id != t)
+                        continue;
+
+                offset = ftello(f);
+                if (offset < 0)
+                        return -errno;
+
+                fputs(u->id, f);
+                fputc(0, f);
+
+                r = unit_serialize(u, text, fds, !switching_root);
+                if (r < 0)
+                        return r;
+
+                r = serialization_record_write(f, text, &buf, &size);
+                if (r < 0)
+                        return r;
+
+                r = serialization_index_add(&idx, f, SERIALIZATION_RECORD_UNIT, strlen(u->id) + 1, offset);
+                if (r < 0)
+                        return r;
+        }
+
+        return serialization_index_write(&idx, f);
+}
+
+int manager_serialize(Manager *m, FILE *f, FDSet *fds, bool switching_root, bool binary) {
+        const char *t;
+        Iterator i;
+        Unit *u;
+        int r;
+
+        assert(m);
+        assert(f);
+        assert(fds);
+
+        m->n_reloading++;
+
+        if (binary) {
+                r = manager_serialize_binary(m, f, fds, switching_root);
+                if (r < 0) {
+                        m->n_reloading--;
+                        return r;
+                }
+        } else {
+                r = manager_serialize_items(m, f, fds, switching_root);
+                if (r < 0) {
+                        m->n_reloading--;
+                        return r;
+                }
+
+                HASHMAP_FOREACH_KEY(u, t, m->units, i) {
+                        if (u->id != t)
+                                continue;
+
+                        /* Start marker */
+                        fputs(u->id, f);
+                        fputc('\n', f);
+
+                        r = unit_serialize(u, f, fds, !switching_root);
+                        if (r < 0) {
+                                m->n_reloading--;
+                                return r;
+                        }
+                }
+        }
+
+        assert(m->n_reloading > 0);
+        m->n_reloading--;
+
+        if (ferror(f))
+                return -EIO;
+
+        r = bus_fdset_add_all(m, fds);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+static int manager_deserialize_item(Manager *m, const char *l, const char *val, FDSet *fds) {
+        assert(m);
+        assert(l);
+        assert(val);
+
+        if (streq(l, "current-job-id")) {
+                uint32_t id;
+
+                if (safe_atou32(val, &id) < 0)
+                        log_notice("Failed to parse current job id value %s", val);
+                else
+                        m->current_job_id = MAX(m->current_job_id, id);
+
+        } else if (streq(l, "n-installed-jobs")) {
+                uint32_t n;
+
+                if (safe_atou32(val, &n) < 0)
+                        log_notice("Failed to parse installed jobs counter %s", val);
+                else
+                        m->n_installed_jobs += n;
+
+        } else if (streq(l, "n-failed-jobs")) {
+                uint32_t n;
+
+                if (safe_atou32(val, &n) < 0)
+                        log_notice("Failed to parse failed jobs counter %s", val);
+                else
+                        m->n_failed_jobs += n;
+
+        } else if (streq(l, "taint-usr")) {
+                int b;
+
+                b = parse_boolean(val);
+                if (b < 0)
+                        log_notice("Failed to parse taint /usr flag %s", val);
+                else
+                        m->taint_usr = m->taint_usr || b;
+
+        } else if (streq(l, "ready-sent")) {
+                int b;
+
+                b = parse_boolean(val);
+                if (b < 0)
+                        log_notice("Failed to parse ready-sent flag %s", val);
+                else
+                        m->ready_sent = m->ready_sent || b;
+
+        } else if (streq(l, "taint-logged")) {
+                int b;
+
+                b = parse_boolean(val);
+                if (b < 0)
+                        log_notice("Failed to parse taint-logged flag %s", val);
+                else
+                        m->taint_logged = m->taint_logged || b;
+
+        } else if (streq(l, "service-watchdogs")) {
+                int b;
+
+                b = parse_boolean(val);
+                if (b < 0)
+                        log_notice("Failed to parse service-watchdogs flag %s", val);
+                else
+                        m->service_watchdogs = b;
+
+        } else if (streq(l, "env")) {
+                _cleanup_free_ char *e = NULL;
+                int r;
+
+                e = strappend("env=", val);
+                if (!e)
+                        return -ENOMEM;
+
+                r = deserialize_environment(&m->environment, e);
+                if (r == -ENOMEM)
+                        return r;
+                if (r < 0)
+                        log_notice_errno(r, "Failed to parse environment entry: \"%s\": %m", e);
+
+        } else if (streq(l, "notify-fd")) {
+                int fd;
+
+                if (safe_atoi(val, &fd) < 0 || fd < 0 || !fdset_contains(fds, fd))
+                        log_notice("Failed to parse notify fd: \"%s\"", val);
+                else {
+                        m->notify_event_source = sd_event_source_unref(m->notify_event_source);
+                        safe_close(m->notify_fd);
+                        m->notify_fd = fdset_remove(fds, fd);
+                }
+
+        } else if (streq(l, "notify-socket")) {
+                char *n;
+
+                n = strdup(val);
+                if (!n)
+                        return -ENOMEM;
+
+                free(m->notify_socket);
+                m->notify_socket = n;
+
+        } else if (streq(l, "cgroups-agent-fd")) {
+                int fd;
+
+                if (safe_atoi(val, &fd) < 0 || fd < 0 || !fdset_contains(fds, fd))
+                        log_notice("Failed to parse cgroups agent fd: %s", val);
+                else {
+                        m->cgroups_agent_event_source = sd_event_source_unref(m->cgroups_agent_event_source);
+                        safe_close(m->cgroups_agent_fd);
+                        m->cgroups_agent_fd = fdset_remove(fds, fd);
+                }
+
+        } else if (streq(l, "user-lookup")) {
+                int fd0, fd1;
+
+                if (sscanf(val, "%i %i", &fd0, &fd1) != 2 || fd0 < 0 || fd1 < 0 || fd0 == fd1 || !fdset_contains(fds, fd0) || !fdset_contains(fds, fd1))
+                        log_notice("Failed to parse user lookup fd: %s", val);
+                else {
+                        m->user_lookup_event_source = sd_event_source_unref(m->user_lookup_event_source);
+                        safe_close_pair(m->user_lookup_fds);
+                        m->user_lookup_fds[0] = fdset_remove(fds, fd0);
+                        m->user_lookup_fds[1] = fdset_remove(fds, fd1);
+                }
+
+        } else if (streq(l, "dynamic-user"))
+                dynamic_user_deserialize_one(m, val, fds);
+        else if (streq(l, "destroy-ipc-uid"))
+                manager_deserialize_uid_refs_one(m, val);
+        else if (streq(l, "destroy-ipc-gid"))
+                manager_deserialize_gid_refs_one(m, val);
+        else if (streq(l, "subscribed")) {
+
+                if (strv_extend(&m->deserialized_subscribed, val) < 0)
+                        log_oom();
+        } else {
+                ManagerTimestamp q;
+
+                for (q = 0; q < _MANAGER_TIMESTAMP_MAX; q++) {
+                        const char *e;
+
+                        e = startswith(l, manager_timestamp_to_string(q));
+                        if (e && streq(e, "-timestamp"))
+                                break;
+                }
+
+                if (q < _MANAGER_TIMESTAMP_MAX) /* found it */
+                        dual_timestamp_deserialize(val, m->timestamps + q);
+                else if (!streq(l, "kdbus-fd")) /* ignore kdbus */
+                        log_notice("Unknown serialization item '%s'", l);
+        }
+
+        /* Parsing failures of individual items are not fatal */
+        return 0;
+}
+
+static int manager_deserialize_items(Manager *m, FILE *f, FDSet *fds) {
+        int r = 0;
+
+        assert(m);
+        assert(f);
+
+        for (;;) {
+                char line[LINE_MAX], *l, *v;
+                size_t k;
+
+                if (!fgets(line, sizeof(line), f)) {
+                        if (feof(f))
+                                r = 0;
+                        else
+                                r = -errno;
+
+                        goto finish;
+                }
+
+                char_array_0(line);
+                l = strstrip(line);
+
+                if (l[0] == 0)
+                        break;
+
+                k = strcspn(l, "=");
+
+                if (l[k] == '=') {
+                        l[k] = 0;
+                        v = l+k+1;
+                } else
+                        v = l+k;
+
+                r = manager_deserialize_item(m, l, v, fds);
+                if (r < 0)
+                        goto finish;
+        }
+
+finish:
+        if (ferror(f))
+                r = -EIO;
+
+        return r;
+}
+
+static int manager_deserialize_units_text(Manager *m, FILE *f, FDSet *fds) {
+        int r = 0;
+
+        assert(m);
+        assert(f);
+
+        for (;;) {
+                Unit *u;
+                char name[UNIT_NAME_MAX+2];
+                const char* unit_name;
+
+                /* Start marker */
+                if (!fgets(name, sizeof(name), f)) {
+                        if (feof(f))
+                                r = 0;
+                        else
+                                r = -errno;
+
+                        goto finish;
+                }
+
+                char_array_0(name);
+                unit_name = strstrip(name);
+
+                r = manager_load_unit(m, unit_name, NULL, NULL, &u);
+                if (r < 0) {
+                        log_notice_errno(r, "Failed to load unit \"%s\", skipping deserialization: %m", unit_name);
+                        if (r == -ENOMEM)
+                                goto finish;
+                        unit_deserialize_skip(f);
+                        continue;
+                }
+
+                r = unit_deserialize(u, f, fds);
+                if (r < 0) {
+                        log_notice_errno(r, "Failed to deserialize unit \"%s\": %m", unit_name);
+                        if (r == -ENOMEM)
+                                goto finish;
+                }
+        }
+
+finish:
+        if (ferror(f))
+                r = -EIO;
+
+        return r;
+}
+
+static int manager_deserialize_record(Manager *m, const uint8_t *p, size_t size, const SerializationIndexEntry *e, FDSet *fds) {
+        const char *unit_name = NULL;
+        uint64_t offset, sz;
+        uint32_t name_size;
+        Unit *u = NULL;
+        int r;
+
+        assert(m);
+        assert(p);
+        assert(e);
+
+        offset = le64toh(e->offset);
+        sz = le64toh(e->size);
+        name_size = le32toh(e->name_size);
+
+        if (offset > size || sz > size - offset || name_size > sz)
+                return -EBADMSG;
+
+        if (le32toh(e->type) == SERIALIZATION_RECORD_UNIT) {
+                unit_name = (const char*) p + offset;
+                if (name_size <= 1 || unit_name[name_size - 1] != 0)
+                        return -EBADMSG;
+
+                r = manager_load_unit(m, unit_name, NULL, NULL, &u);
+                if (r < 0) {
+                        log_notice_errno(r, "Failed to load unit \"%s\", skipping deserialization: %m", unit_name);
+                        return r == -ENOMEM ? r : 0;
+                }
+
+        } else if (le32toh(e->type) != SERIALIZATION_RECORD_MANAGER) {
+                log_debug("Unknown serialization record type %" PRIu32 ", ignoring.", le32toh(e->type));
+                return 0;
+        }
+
+        p += offset + name_size;
+        sz -= name_size;
+
+        if (u) {
+                r = unit_deserialize_binary(u, p, sz, fds);
+                if (r < 0) {
+                        log_notice_errno(r, "Failed to deserialize unit \"%s\": %m", unit_name);
+                        if (r == -ENOMEM)
+                                return r;
+                }
+
+                return 0;
+        }
 
         for (;;) {
-                char line[LINE_MAX];
-                const char *val, *l;
+                const char *l, *v;
+
+                r = deserialize_binary_item(&p, &sz, &l, &v);
+                if (r <= 0)
+                        return r;
+                if (isempty(l))
+                        return 0;
+
+                r = manager_deserialize_item(m, l, v, fds);
+                if (r < 0)
+                        return r;
+        }
+}
+
+static int manager_deserialize_binary(Manager *m, FILE *f, FDSet *fds) {
+        const SerializationIndexEntry *entries;
+        const SerializationTrailer *t;
+        uint64_t n_entries, n_units, index_offset, i;
+        struct stat st;
+        size_t size;
+        void *p;
+        int r = 0;
+
+        assert(m);
+        assert(f);
+
+        if (fstat(fileno(f), &st) < 0)
+                return -errno;
+
+        if (st.st_size < (off_t) (sizeof(SerializationHeader) + sizeof(SerializationTrailer)) || st.st_size > SSIZE_MAX)
+                return -EBADMSG;
+
+        size = (size_t) st.st_size;
+
+        p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        t = (const SerializationTrailer*) ((const uint8_t*) p + size - sizeof(SerializationTrailer));
+        index_offset = le64toh(t->index_offset);
+        n_entries = le64toh(t->n_entries);
+        n_units = le64toh(t->n_units);
+
+        if (memcmp(t->magic, SERIALIZATION_MAGIC, sizeof(t->magic)) != 0 ||
+            index_offset < sizeof(SerializationHeader) ||
+            index_offset % 8 != 0 ||
+            index_offset > size - sizeof(SerializationTrailer) ||
+            (size - sizeof(SerializationTrailer) - index_offset) % sizeof(SerializationIndexEntry) != 0 ||
+            n_entries != (size - sizeof(SerializationTrailer) - index_offset) / sizeof(SerializationIndexEntry) ||
+            n_units > n_entries ||
+            n_units > UINT_MAX) {
+                r = -EBADMSG;
+                goto finish;
+        }
+
+        /* We know how many units are going to be loaded, make room for them right-away */
+        r = hashmap_reserve(m->units, n_units);
+        if (r < 0)
+                goto finish;
+
+        entries = (const SerializationIndexEntry*) ((const uint8_t*) p + index_offset);
+        for (i = 0; i < n_entries; i++) {
+                r = manager_deserialize_record(m, p, index_offset, entries + i, fds);
+                if (r == -ENOMEM)
+                        goto finish;
+                if (r < 0)
+                        log_notice_errno(r, "Failed to deserialize record %" PRIu64 ", ignoring: %m", i);
+        }
+
+        r = 0;
+
+finish:
+        (void) munmap(p, size);
+        return r;
+}
+
+int manager_deserialize(Manager *m, FILE *f, FDSet *fds) {
+        SerializationHeader h;
+        off_t offset;
+        int r;
+
+        assert(m);
+        assert(f);
+
+        log_debug("Deserializing state...");
+
+        m->n_reloading++;
+
+        /* Check for the binary format first, and fall back to the text format otherwise */
+        offset = ftello(f);
+        if (offset == 0 &&
+            fread(&h, sizeof(h), 1, f) == 1 &&
+            memcmp(h.magic, SERIALIZATION_MAGIC, sizeof(h.magic)) == 0) {
+
+                if (le32toh(h.version) != SERIALIZATION_VERSION) {
+                        log_error("Unsupported serialization format version %" PRIu32 ".", le32toh(h.version));
+                        r = -EPROTONOSUPPORT;
+                } else
+                        r = manager_deserialize_binary(m, f, fds);
+        } else {
+                if (offset >= 0 && fseeko(f, offset, SEEK_SET) < 0)
+                        r = -errno;
+                else {
+                        r = manager_deserialize_items(m, f, fds);
+                        if (r >= 0)
+                                r = manager_deserialize_units_text(m, f, fds);
+                }
+        }
+
+        assert(m->n_reloading > 0);
+        m->n_reloading--;
+
+        return r;
+}
+
+int manager_reload(Manager *m) {
+        int r, q;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_fdset_free_ FDSet *fds = NULL;
+
+        assert(m);
+
+        r = manager_open_serialization(m, &f);
+        if (r < 0)
+                return r;
+
+        m->n_reloading++;
+        bus_manager_send_reloading(m, true);
+
+        fds = fdset_new();
+        if (!fds) {
+                m->n_reloading--;
+                return -ENOMEM;
+        }
+
+        /* We deserialize into the very same binary, hence the binary format can be used */
+        r = manager_serialize(m, f, fds, false, true);
+        if (r < 0) {
+                m->n_reloading--;
+                return r;
+        }
+
+        if (fseeko(f, 0, SEEK_SET) < 0) {
+                m->n_reloading--;
+                return -errno;
+        }
+
+        /* From here on there is no way back. */
+        manager_clear_jobs_and_units(m);
+        lookup_paths_flush_generator(&m->lookup_paths);
+        lookup_paths_free(&m->lookup_paths);
+        dynamic_user_vacuum(m, false);
+        m->uid_refs = hashmap_free(m->uid_refs);
+        m->gid_refs = hashmap_free(m->gid_refs);
+
+        q = lookup_paths_init(&m->lookup_paths, m->unit_file_scope, 0, NULL);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        q = manager_run_environment_generators(m);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        /* Find new unit paths */
+        q = manager_run_generators(m);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        lookup_paths_reduce(&m->lookup_paths);
+        manager_build_unit_path_cache(m);
+
+        /* First, enumerate what we can from all config files */
+        manager_enumerate(m);
+
+        /* Second, deserialize our stored data */
+        q = manager_deserialize(m, f, fds);
+        if (q < 0) {
+                log_error_errno(q, "Deserialization failed: %m");
+
+                if (r >= 0)
+                        r = q;
+        }
+
+        fclose(f);
+        f = NULL;
+
+        /* Re-register notify_fd as event source */
+        q = manager_setup_notify(m);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        q = manager_setup_cgroups_agent(m);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        q = manager_setup_user_lookup_fd(m);
+        if (q < 0 && r >= 0)
+                r = q;
+
+        /* Third, fire things up! */
+        manager_coldplug(m);
+
+        /* Release any dynamic users no longer referenced */
+        dynamic_user_vacuum(m, true);
+
+        /* Release any references to UIDs/GIDs no longer referenced, and destroy any IPC owned by them */
+        manager_vacuum_uid_refs(m);
+        manager_vacuum_gid_refs(m);
+
+        /* It might be safe to log to the journal now. */
+        manager_recheck_journal(m);
+
+        /* Sync current state of bus names with our set of listening units */
+        if (m->api_bus)
+                manager_sync_bus_names(m, m->api_bus);
+
+        manager_forget_unit_tombstones(m);
+
+        assert(m->n_reloading > 0);
+        m->n_reloading--;
+
+        m->send_reloading_done = true;
+
+        return r;
+}
+
+typedef struct ReloadDependency {
+        Unit *unit;
+        UnitDependency dependency;
+        char *other;
+        UnitDependencyMask mask;
+} ReloadDependency;
+
+static void reload_dependencies_free(ReloadDependency *deps, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                free(deps[i].other);
+
+        free(deps);
+}
+
+static bool unit_holds_ref(Unit *u, Unit *other) {
+        assert(u);
+        assert(other);
+
+        /* Checks whether u holds one of the UnitRef references that point to other */
+
+        if (UNIT_DEREF(u->slice) == other)
+                return true;
+
+        if (u->type == UNIT_SOCKET && UNIT_DEREF(SOCKET(u)->service) == other)
+                return true;
+
+        if (u->type == UNIT_SERVICE && UNIT_DEREF(SERVICE(u)->accept_socket) == other)
+                return true;
+
+        return false;
+}
+
+static int unit_get_neighbours(Unit *u, Set **ret) {
+        _cleanup_set_free_ Set *s = NULL;
+        UnitDependency d;
+        unsigned i;
+        Unit *other;
+        int r;
+
+        assert(u);
+        assert(ret);
+
+        /* Collects all units u has a dependency on, or that have a dependency on u. The latter are found through the
+         * inverse dependencies (and the References=/ReferencedBy= pair for those dependency types which have no
+         * inverse). */
+
+        s = set_new(NULL);
+        if (!s)
+                return -ENOMEM;
+
+        for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++)
+                UNIT_FOREACH_DEPENDENCY(other, u, d, i) {
+                        r = set_put(s, other);
+                        if (r < 0)
+                                return r;
+                }
+
+        *ret = s;
+        s = NULL;
+
+        return 0;
+}
+
+static bool manager_unit_file_appeared(Manager *m, Unit *u) {
+        _cleanup_free_ char *template = NULL;
+        char **dir;
+
+        assert(m);
+        assert(u);
 
-                if (!fgets(line, sizeof(line), f)) {
-                        if (feof(f))
-                                r = 0;
-                        else
-                                r = -errno;
+        /* Checks whether a unit that could not be found during its last load now has a fragment. This is based on
+         * the unit path cache, hence expects it to be up-to-date. */
 
-                        goto finish;
-                }
+        if (u->load_state != UNIT_NOT_FOUND)
+                return false;
 
-                char_array_0(line);
-                l = strstrip(line);
+        if (unit_name_is_valid(u->id, UNIT_NAME_INSTANCE))
+                (void) unit_name_template(u->id, &template);
 
-                if (l[0] == 0)
-                        break;
+        STRV_FOREACH(dir, m->lookup_paths.search_path) {
+                const char *p;
 
-                if ((val = startswith(l, "current-job-id="))) {
-                        uint32_t id;
+                p = strjoina(*dir, "/", u->id);
+                if (set_contains(m->unit_path_cache, p))
+                        return true;
 
-                        if (safe_atou32(val, &id) < 0)
-                                log_notice("Failed to parse current job id value %s", val);
-                        else
-                                m->current_job_id = MAX(m->current_job_id, id);
+                if (!template)
+                        continue;
 
-                } else if ((val = startswith(l, "n-installed-jobs="))) {
-                        uint32_t n;
+                p = strjoina(*dir, "/", template);
+                if (set_contains(m->unit_path_cache, p))
+                        return true;
+        }
 
-                        if (safe_atou32(val, &n) < 0)
-                                log_notice("Failed to parse installed jobs counter %s", val);
-                        else
-                                m->n_installed_jobs += n;
+        return false;
+}
 
-                } else if ((val = startswith(l, "n-failed-jobs="))) {
-                        uint32_t n;
+static int manager_find_dirty_units(Manager *m, Set **ret) {
+        _cleanup_set_free_ Set *dirty = NULL;
+        Iterator i;
+        Unit *u;
+        char *k;
+        int r;
 
-                        if (safe_atou32(val, &n) < 0)
-                                log_notice("Failed to parse failed jobs counter %s", val);
-                        else
-                                m->n_failed_jobs += n;
+        assert(m);
+        assert(ret);
 
-                } else if ((val = startswith(l, "taint-usr="))) {
-                        int b;
+        dirty = set_new(NULL);
+        if (!dirty)
+                return -ENOMEM;
 
-                        b = parse_boolean(val);
-                        if (b < 0)
-                                log_notice("Failed to parse taint /usr flag %s", val);
-                        else
-                                m->taint_usr = m->taint_usr || b;
+        HASHMAP_FOREACH_KEY(u, k, m->units, i) {
 
-                } else if ((val = startswith(l, "ready-sent="))) {
-                        int b;
+                /* ignore aliases */
+                if (u->id != k)
+                        continue;
 
-                        b = parse_boolean(val);
-                        if (b < 0)
-                                log_notice("Failed to parse ready-sent flag %s", val);
-                        else
-                                m->ready_sent = m->ready_sent || b;
+                if (u->load_state == UNIT_MERGED)
+                        continue;
+
+                if (!unit_need_daemon_reload(u) && !manager_unit_file_appeared(m, u))
+                        continue;
 
-                } else if ((val = startswith(l, "taint-logged="))) {
-                        int b;
+                log_unit_debug(u, "Configuration changed on disk, reloading unit.");
 
-                        b = parse_boolean(val);
-                        if (b < 0)
-                                log_notice("Failed to parse taint-logged flag %s", val);
-                        else
-                                m->taint_logged = m->taint_logged || b;
+                r = set_put(dirty, u);
+                if (r < 0)
+                        return r;
+        }
+
+        /* A UnitRef is dropped when the unit it points to is freed, hence also reload the units holding one. This
+         * covers slice membership and the socket/service pairing, which are set up while loading the holder. */
+        for (;;) {
+                _cleanup_set_free_ Set *holders = NULL;
 
-                } else if ((val = startswith(l, "service-watchdogs="))) {
-                        int b;
+                SET_FOREACH(u, dirty, i) {
+                        _cleanup_set_free_ Set *neighbours = NULL;
+                        Iterator j;
+                        Unit *other;
 
-                        b = parse_boolean(val);
-                        if (b < 0)
-                                log_notice("Failed to parse service-watchdogs flag %s", val);
-                        else
-                                m->service_watchdogs = b;
+                        if (!u->refs)
+                                continue;
 
-                } else if (startswith(l, "env=")) {
-                        r = deserialize_environment(&m->environment, l);
-                        if (r == -ENOMEM)
-                                goto finish;
+                        r = unit_get_neighbours(u, &neighbours);
                         if (r < 0)
-                                log_notice_errno(r, "Failed to parse environment entry: \"%s\": %m", l);
+                                return r;
 
-                } else if ((val = startswith(l, "notify-fd="))) {
-                        int fd;
+                        SET_FOREACH(other, neighbours, j) {
+                                if (set_contains(dirty, other) || !unit_holds_ref(other, u))
+                                        continue;
+
+                                r = set_ensure_allocated(&holders, NULL);
+                                if (r < 0)
+                                        return r;
 
-                        if (safe_atoi(val, &fd) < 0 || fd < 0 || !fdset_contains(fds, fd))
-                                log_notice("Failed to parse notify fd: \"%s\"", val);
-                        else {
-                                m->notify_event_source = sd_event_source_unref(m->notify_event_source);
-                                safe_close(m->notify_fd);
-                                m->notify_fd = fdset_remove(fds, fd);
+                                r = set_put(holders, other);
+                                if (r < 0)
+                                        return r;
                         }
+                }
 
-                } else if ((val = startswith(l, "notify-socket="))) {
-                        char *n;
+                if (set_isempty(holders))
+                        break;
 
-                        n = strdup(val);
-                        if (!n) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
+                r = set_move(dirty, holders);
+                if (r < 0)
+                        return r;
+        }
 
-                        free(m->notify_socket);
-                        m->notify_socket = n;
+        *ret = dirty;
+        dirty = NULL;
 
-                } else if ((val = startswith(l, "cgroups-agent-fd="))) {
-                        int fd;
+        return 0;
+}
 
-                        if (safe_atoi(val, &fd) < 0 || fd < 0 || !fdset_contains(fds, fd))
-                                log_notice("Failed to parse cgroups agent fd: %s", val);
-                        else {
-                                m->cgroups_agent_event_source = sd_event_source_unref(m->cgroups_agent_event_source);
-                                safe_close(m->cgroups_agent_fd);
-                                m->cgroups_agent_fd = fdset_remove(fds, fd);
-                        }
+static int manager_check_reload_incremental(Manager *m, Set *units) {
+        Iterator i;
+        Unit *u;
+        int r;
 
-                } else if ((val = startswith(l, "user-lookup="))) {
-                        int fd0, fd1;
+        assert(m);
 
-                        if (sscanf(val, "%i %i", &fd0, &fd1) != 2 || fd0 < 0 || fd1 < 0 || fd0 == fd1 || !fdset_contains(fds, fd0) || !fdset_contains(fds, fd1))
-                                log_notice("Failed to parse user lookup fd: %s", val);
-                        else {
-                                m->user_lookup_event_source = sd_event_source_unref(m->user_lookup_event_source);
-                                safe_close_pair(m->user_lookup_fds);
-                                m->user_lookup_fds[0] = fdset_remove(fds, fd0);
-                                m->user_lookup_fds[1] = fdset_remove(fds, fd1);
-                        }
+        /* Refuses the incremental reload for anything we cannot swap out without touching the rest of the unit
+         * graph. The caller is expected to fall back to a full reload then. */
 
-                } else if ((val = startswith(l, "dynamic-user=")))
-                        dynamic_user_deserialize_one(m, val, fds);
-                else if ((val = startswith(l, "destroy-ipc-uid=")))
-                        manager_deserialize_uid_refs_one(m, val);
-                else if ((val = startswith(l, "destroy-ipc-gid=")))
-                        manager_deserialize_gid_refs_one(m, val);
-                else if ((val = startswith(l, "subscribed="))) {
+        SET_FOREACH(u, units, i) {
+                _cleanup_set_free_ Set *neighbours = NULL;
+                unsigned n_refs = 0, n_known = 0;
+                Iterator j;
+                Unit *other;
+                UnitRef *ref;
 
-                        if (strv_extend(&m->deserialized_subscribed, val) < 0)
-                                log_oom();
-                } else {
-                        ManagerTimestamp q;
+                if (u->job || u->nop_job) {
+                        log_unit_debug(u, "Unit has a job queued, can't reload it incrementally.");
+                        return -EBUSY;
+                }
 
-                        for (q = 0; q < _MANAGER_TIMESTAMP_MAX; q++) {
-                                val = startswith(l, manager_timestamp_to_string(q));
-                                if (!val)
-                                        continue;
+                if (u->transient || u->perpetual) {
+                        log_unit_debug(u, "Unit is %s, can't reload it incrementally.", u->transient ? "transient" : "perpetual");
+                        return -EBUSY;
+                }
 
-                                val = startswith(val, "-timestamp=");
-                                if (val)
-                                        break;
-                        }
+                /* The state of these is taken from kernel tables, which are only read in full during enumeration */
+                if (IN_SET(u->type, UNIT_DEVICE, UNIT_MOUNT, UNIT_SWAP)) {
+                        log_unit_debug(u, "Unit type can't be reloaded incrementally.");
+                        return -EBUSY;
+                }
+
+                LIST_FOREACH(refs, ref, u->refs)
+                        n_refs++;
+
+                if (n_refs == 0)
+                        continue;
+
+                r = unit_get_neighbours(u, &neighbours);
+                if (r < 0)
+                        return r;
+
+                SET_FOREACH(other, neighbours, j)
+                        if (unit_holds_ref(other, u))
+                                n_known++;
 
-                        if (q < _MANAGER_TIMESTAMP_MAX) /* found it */
-                                dual_timestamp_deserialize(val, m->timestamps + q);
-                        else if (!startswith(l, "kdbus-fd=")) /* ignore kdbus */
-                                log_notice("Unknown serialization item '%s'", l);
+                /* Make sure all references are held by units we reload too, hence are rebuilt */
+                if (n_known != n_refs) {
+                        log_unit_debug(u, "Unit is referenced from elsewhere, can't reload it incrementally.");
+                        return -EBUSY;
                 }
         }
 
-        for (;;) {
-                Unit *u;
-                char name[UNIT_NAME_MAX+2];
-                const char* unit_name;
+        return 0;
+}
 
-                /* Start marker */
-                if (!fgets(name, sizeof(name), f)) {
-                        if (feof(f))
-                                r = 0;
-                        else
-                                r = -errno;
+static int manager_save_dependencies(Manager *m, Set *units, ReloadDependency **ret, size_t *ret_n) {
+        ReloadDependency *deps = NULL;
+        size_t n_deps = 0, n_allocated = 0;
+        Iterator i;
+        Unit *u;
+        int r;
 
-                        goto finish;
-                }
+        assert(m);
+        assert(ret);
+        assert(ret_n);
 
-                char_array_0(name);
-                unit_name = strstrip(name);
+        /* Freeing a unit also drops the dependencies other units have on it. Those created by the reloaded units
+         * themselves come back when they are loaded again, but the ones created by the units we keep need to be
+         * restored explicitly. Remember them by name, as the reloaded units are new objects afterwards. */
 
-                r = manager_load_unit(m, unit_name, NULL, NULL, &u);
-                if (r < 0) {
-                        log_notice_errno(r, "Failed to load unit \"%s\", skipping deserialization: %m", unit_name);
-                        if (r == -ENOMEM)
-                                goto finish;
-                        unit_deserialize_skip(f);
-                        continue;
-                }
+        SET_FOREACH(u, units, i) {
+                _cleanup_set_free_ Set *neighbours = NULL;
+                Iterator j;
+                Unit *other;
 
-                r = unit_deserialize(u, f, fds);
-                if (r < 0) {
-                        log_notice_errno(r, "Failed to deserialize unit \"%s\": %m", unit_name);
-                        if (r == -ENOMEM)
-                                goto finish;
+                r = unit_get_neighbours(u, &neighbours);
+                if (r < 0)
+                        goto fail;
+
+                SET_FOREACH(other, neighbours, j) {
+                        UnitDependency d;
+
+                        if (set_contains(units, other))
+                                continue;
+
+                        for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++) {
+                                UnitDependencyEntry *e;
+                                char *name;
+
+                                e = unit_dependency_list_find(&other->dependencies[d], u);
+                                if (!e || e->info.origin_mask == 0)
+                                        continue;
+
+                                name = strdup(u->id);
+                                if (!name) {
+                                        r = -ENOMEM;
+                                        goto fail;
+                                }
+
+                                if (!GREEDY_REALLOC(deps, n_allocated, n_deps + 1)) {
+                                        free(name);
+                                        r = -ENOMEM;
+                                        goto fail;
+                                }
+
+                                deps[n_deps++] = (ReloadDependency) {
+                                        .unit = other,
+                                        .dependency = d,
+                                        .other = name,
+                                        .mask = e->info.origin_mask,
+                                };
+                        }
                 }
         }
 
-finish:
-        if (ferror(f))
-                r = -EIO;
+        *ret = deps;
+        *ret_n = n_deps;
 
-        assert(m->n_reloading > 0);
-        m->n_reloading--;
+        return 0;
 
+fail:
+        reload_dependencies_free(deps, n_deps);
         return r;
 }
 
-int manager_reload(Manager *m) {
-        int r, q;
+int manager_reload_incremental(Manager *m) {
+        _cleanup_hashmap_free_free_free_ Hashmap *outputs = NULL;
         _cleanup_fclose_ FILE *f = NULL;
         _cleanup_fdset_free_ FDSet *fds = NULL;
+        _cleanup_set_free_ Set *units = NULL;
+        _cleanup_strv_free_ char **names = NULL;
+        ReloadDependency *deps = NULL;
+        size_t n_deps = 0, k;
+        Iterator i;
+        char **name;
+        Unit *u;
+        int r, q;
 
         assert(m);
 
-        r = manager_open_serialization(m, &f);
+        /* Reloads only the units whose unit files, drop-ins or .wants/.requires symlinks changed since they were
+         * loaded, and keeps everything else in memory as it is. Returns -EBUSY if the changes cannot be applied this
+         * way. */
+
+        /* Run the generators again. Their outputs that came out the same get their old timestamps back, so that
+         * only units whose generated configuration changed are picked up below. */
+        r = generator_outputs_collect(&m->lookup_paths, &outputs);
         if (r < 0)
                 return r;
 
-        m->n_reloading++;
-        bus_manager_send_reloading(m, true);
+        lookup_paths_flush_generator(&m->lookup_paths);
+        lookup_paths_free(&m->lookup_paths);
+
+        r = lookup_paths_init(&m->lookup_paths, m->unit_file_scope, 0, NULL);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to initialize unit search paths: %m");
+                return -EBUSY; /* Let the full reload start over */
+        }
+
+        (void) manager_run_environment_generators(m);
+        (void) manager_run_generators(m);
+
+        r = generator_outputs_keep_timestamps(&m->lookup_paths, outputs);
+        if (r < 0)
+                log_debug_errno(r, "Failed to compare generator output, ignoring: %m");
+        else
+                log_debug("%i generator outputs changed.", r);
+
+        lookup_paths_reduce(&m->lookup_paths);
+
+        /* Pick up added and removed files and directories, the checks below rely on the cache */
+        manager_build_unit_path_cache(m);
+
+        r = manager_find_dirty_units(m, &units);
+        if (r < 0)
+                return r;
+
+        r = manager_check_reload_incremental(m, units);
+        if (r < 0)
+                return r;
+
+        r = manager_open_serialization(m, &f);
+        if (r < 0)
+                return r;
 
         fds = fdset_new();
-        if (!fds) {
-                m->n_reloading--;
+        if (!fds)
                 return -ENOMEM;
-        }
 
-        r = manager_serialize(m, f, fds, false);
-        if (r < 0) {
-                m->n_reloading--;
+        r = manager_save_dependencies(m, units, &deps, &n_deps);
+        if (r < 0)
                 return r;
+
+        m->n_reloading++;
+        bus_manager_send_reloading(m, true);
+
+        SET_FOREACH(u, units, i) {
+                r = strv_extend(&names, u->id);
+                if (r < 0)
+                        goto finish;
+
+                fputs(u->id, f);
+                fputc('\n', f);
+
+                r = unit_serialize(u, f, fds, false);
+                if (r < 0)
+                        goto finish;
         }
 
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto finish;
+
         if (fseeko(f, 0, SEEK_SET) < 0) {
-                m->n_reloading--;
-                return -errno;
+                r = -errno;
+                goto finish;
         }
 
         /* From here on there is no way back. */
-        manager_clear_jobs_and_units(m);
-        lookup_paths_flush_generator(&m->lookup_paths);
-        lookup_paths_free(&m->lookup_paths);
-        dynamic_user_vacuum(m, false);
-        m->uid_refs = hashmap_free(m->uid_refs);
-        m->gid_refs = hashmap_free(m->gid_refs);
+        SET_FOREACH(u, units, i)
+                unit_free(u);
+        units = set_free(units);
 
-        q = lookup_paths_init(&m->lookup_paths, m->unit_file_scope, 0, NULL);
-        if (q < 0 && r >= 0)
-                r = q;
+        STRV_FOREACH(name, names) {
+                q = manager_load_unit_prepare(m, *name, NULL, NULL, &u);
+                if (q < 0) {
+                        log_warning_errno(q, "Failed to prepare loading of unit %s, ignoring: %m", *name);
+                        if (r >= 0)
+                                r = q;
+                }
+        }
 
-        q = manager_run_environment_generators(m);
-        if (q < 0 && r >= 0)
-                r = q;
+        manager_dispatch_load_queue(m);
 
-        /* Find new unit paths */
-        q = manager_run_generators(m);
-        if (q < 0 && r >= 0)
-                r = q;
+        for (k = 0; k < n_deps; k++) {
+                Unit *other;
 
-        lookup_paths_reduce(&m->lookup_paths);
-        manager_build_unit_path_cache(m);
+                other = manager_get_unit(m, deps[k].other);
+                if (!other)
+                        continue;
 
-        /* First, enumerate what we can from all config files */
-        manager_enumerate(m);
+                q = unit_add_dependency(deps[k].unit, deps[k].dependency, other, false, deps[k].mask);
+                if (q < 0) {
+                        log_unit_warning_errno(deps[k].unit, q, "Failed to restore %s dependency on %s, ignoring: %m",
+                                               unit_dependency_to_string(deps[k].dependency), deps[k].other);
+                        if (r >= 0)
+                                r = q;
+                }
+        }
 
-        /* Second, deserialize our stored data */
-        q = manager_deserialize(m, f, fds);
+        q = manager_deserialize_units_text(m, f, fds);
         if (q < 0) {
                 log_error_errno(q, "Deserialization failed: %m");
 
@@ -3114,39 +4374,33 @@ int manager_reload(Manager *m) {
                         r = q;
         }
 
-        fclose(f);
-        f = NULL;
-
-        /* Re-register notify_fd as event source */
-        q = manager_setup_notify(m);
-        if (q < 0 && r >= 0)
-                r = q;
+        f = safe_fclose(f);
 
-        q = manager_setup_cgroups_agent(m);
-        if (q < 0 && r >= 0)
-                r = q;
+        STRV_FOREACH(name, names) {
+                u = manager_get_unit(m, *name);
+                if (!u)
+                        continue;
 
-        q = manager_setup_user_lookup_fd(m);
-        if (q < 0 && r >= 0)
-                r = q;
+                q = unit_coldplug(unit_follow_merge(u));
+                if (q < 0)
+                        log_unit_warning_errno(u, q, "We couldn't coldplug %s, proceeding anyway: %m", u->id);
+        }
 
-        /* Third, fire things up! */
-        manager_coldplug(m);
+        log_debug("Reloaded %u changed units.", strv_length(names));
 
-        /* Release any dynamic users no longer referenced */
         dynamic_user_vacuum(m, true);
 
-        /* Release any references to UIDs/GIDs no longer referenced, and destroy any IPC owned by them */
         manager_vacuum_uid_refs(m);
         manager_vacuum_gid_refs(m);
 
-        /* It might be safe to log to the journal now. */
-        manager_recheck_journal(m);
-
-        /* Sync current state of bus names with our set of listening units */
         if (m->api_bus)
                 manager_sync_bus_names(m, m->api_bus);
 
+finish:
+        reload_dependencies_free(deps, n_deps);
+
+        manager_forget_unit_tombstones(m);
+
         assert(m->n_reloading > 0);
         m->n_reloading--;
 
@@ -3414,8 +4668,10 @@ static int manager_run_environment_generators(Manager *m) {
 }
 
 static int manager_run_generators(Manager *m) {
-        _cleanup_strv_free_ char **paths = NULL;
-        const char *argv[5];
+        _cleanup_strv_free_ char **paths = NULL, **generators = NULL;
+        GeneratorRun *runs = NULL;
+        size_t n_runs = 0, i;
+        usec_t begin;
         int r;
 
         assert(m);
@@ -3434,15 +4690,30 @@ static int manager_run_generators(Manager *m) {
         if (r < 0)
                 goto finish;
 
-        argv[0] = NULL; /* Leave this empty, execute_directory() will fill something in */
-        argv[1] = m->lookup_paths.generator;
-        argv[2] = m->lookup_paths.generator_early;
-        argv[3] = m->lookup_paths.generator_late;
-        argv[4] = NULL;
+        r = conf_files_list_strv(&generators, NULL, NULL, CONF_FILES_EXECUTABLE, (const char* const*) paths);
+        if (r < 0) {
+                log_error_errno(r, "Failed to enumerate generators: %m");
+                goto finish;
+        }
 
+        begin = now(CLOCK_MONOTONIC);
         RUN_WITH_UMASK(0022)
-                execute_directories((const char* const*) paths, DEFAULT_TIMEOUT_USEC,
-                                    NULL, NULL, (char**) argv);
+                r = generators_run(generators, &m->lookup_paths, DEFAULT_TIMEOUT_USEC, &runs, &n_runs);
+        if (r < 0)
+                log_error_errno(r, "Failed to run generators: %m");
+        manager_trace(m, MANAGER_TRACE_GENERATORS, NULL, begin);
+
+        for (i = 0; i < n_runs; i++) {
+                log_debug("Generator %s %s in %s.",
+                          runs[i].name,
+                          runs[i].cached ? "reused cached output" : "finished",
+                          format_timespan((char[FORMAT_TIMESPAN_MAX]) {}, FORMAT_TIMESPAN_MAX, runs[i].end - runs[i].begin, USEC_PER_MSEC));
+
+                manager_trace_range(m, MANAGER_TRACE_GENERATORS, runs[i].name, runs[i].begin, runs[i].end);
+        }
+
+        generator_run_free_many(runs, n_runs);
+        r = 0;
 
 finish:
         lookup_paths_trim_generator(&m->lookup_paths);
@@ -4152,3 +5423,15 @@ static const char *const manager_timestamp_table[_MANAGER_TIMESTAMP_MAX] = {
 };
 
 DEFINE_STRING_TABLE_LOOKUP(manager_timestamp, ManagerTimestamp);
+
+static const char *const manager_trace_phase_table[_MANAGER_TRACE_PHASE_MAX] = {
+        [MANAGER_TRACE_GENERATORS] = "generators",
+        [MANAGER_TRACE_LOAD] = "load",
+        [MANAGER_TRACE_TRANSACTION] = "transaction",
+        [MANAGER_TRACE_JOB_WAIT] = "job-wait",
+        [MANAGER_TRACE_JOB_RUN] = "job-run",
+        [MANAGER_TRACE_CGROUP_REALIZE] = "cgroup-realize",
+        [MANAGER_TRACE_SPAWN] = "spawn",
+};
+
+DEFINE_STRING_TABLE_LOOKUP(manager_trace_phase, ManagerTracePhase);
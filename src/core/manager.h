@@ -37,8 +37,42 @@
 /* Enforce upper limit how many names we allow */
 #define MANAGER_MAX_NAMES 131072 /* 128K */
 
+/* How long resource accounting counters are reused by default, see AccountingRefreshSec= */
+#define DEFAULT_ACCOUNTING_REFRESH_USEC (1*USEC_PER_SEC)
+
 typedef struct Manager Manager;
 
+/* How many removed units we remember for ListUnitsEx() */
+#define UNIT_TOMBSTONES_MAX 4096U
+
+typedef struct UnitTombstone {
+        char *id;
+        uint64_t generation;
+} UnitTombstone;
+
+/* How many spans the trace ring buffer holds, see manager_trace() */
+#define MANAGER_TRACE_SPANS_MAX 8192U
+
+/* The phases of the service manager's own work that are traced, in order to make it visible where time during boot
+ * (or any other activation) is spent besides in the units themselves */
+typedef enum ManagerTracePhase {
+        MANAGER_TRACE_GENERATORS,       /* Running the generators */
+        MANAGER_TRACE_LOAD,             /* Loading a unit's configuration */
+        MANAGER_TRACE_TRANSACTION,      /* Building and activating a transaction, named after its anchor unit */
+        MANAGER_TRACE_JOB_WAIT,         /* A job waiting for its dependencies, from its installation until it runs */
+        MANAGER_TRACE_JOB_RUN,          /* A job running, until it finished */
+        MANAGER_TRACE_CGROUP_REALIZE,   /* Creating and configuring a unit's cgroup */
+        MANAGER_TRACE_SPAWN,            /* Forking off a process, as seen from the manager */
+        _MANAGER_TRACE_PHASE_MAX,
+        _MANAGER_TRACE_PHASE_INVALID = -1
+} ManagerTracePhase;
+
+typedef struct ManagerTraceSpan {
+        ManagerTracePhase phase;
+        char *name;                     /* The unit or generator, or NULL for manager-wide work */
+        usec_t begin, end;              /* CLOCK_MONOTONIC */
+} ManagerTraceSpan;
+
 typedef enum ManagerState {
         MANAGER_INITIALIZING,
         MANAGER_STARTING,
@@ -54,6 +88,7 @@ typedef enum ManagerExitCode {
         MANAGER_OK,
         MANAGER_EXIT,
         MANAGER_RELOAD,
+        MANAGER_RELOAD_INCREMENTAL,
         MANAGER_REEXECUTE,
         MANAGER_REBOOT,
         MANAGER_POWEROFF,
@@ -90,6 +125,7 @@ typedef enum ManagerTimestamp {
 
 #include "execute.h"
 #include "job.h"
+#include "mount-table.h"
 #include "path-lookup.h"
 #include "show-status.h"
 #include "unit-name.h"
@@ -117,6 +153,24 @@ struct Manager {
          * type we maintain a per type linked list */
         LIST_HEAD(Unit, units_by_type[_UNIT_TYPE_MAX]);
 
+        /* The same by active state, and all units sorted by id, for ListUnitsEx() */
+        LIST_HEAD(Unit, units_by_active_state[_UNIT_ACTIVE_STATE_MAX]);
+        Unit **units_sorted;
+        size_t n_units_sorted, n_units_sorted_allocated;
+        bool units_sorted_dirty;
+
+        /* Bumped whenever anything ListUnits() returns changes, so that clients can ask for the changes since
+         * they last asked. The units removed in the meantime are remembered in a ring buffer, removals before
+         * the horizon have been forgotten. */
+        uint64_t unit_generation;
+        UnitTombstone *unit_tombstones;
+        size_t n_unit_tombstones, unit_tombstones_next;
+        uint64_t unit_tombstones_horizon;
+
+        /* The most recent trace spans, the oldest ones are overwritten first */
+        ManagerTraceSpan *trace_spans;
+        size_t n_trace_spans, trace_spans_next;
+
         /* Units that need to be loaded */
         LIST_HEAD(Unit, load_queue); /* this is actually more a stack than a queue, but uh. */
 
@@ -203,6 +257,10 @@ struct Manager {
         /* Data specific to the mount subsystem */
         struct libmnt_monitor *mount_monitor;
         sd_event_source *mount_event_source;
+        MountTable mount_table;
+        sd_event_source *mount_rescan_event_source;
+        RateLimit mount_rescan_ratelimit;
+        bool mount_rescan_utab;
 
         /* Data specific to the swap filesystem */
         FILE *proc_swaps;
@@ -301,6 +359,9 @@ struct Manager {
         uint64_t default_tasks_max;
         usec_t default_timer_accuracy_usec;
 
+        /* How long resource accounting counters read from the kernel are reused for, 0 to always read them anew */
+        usec_t accounting_refresh_usec;
+
         struct rlimit *rlimit[_RLIMIT_MAX];
 
         /* non-zero if we are reloading or reexecuting, */
@@ -380,6 +441,14 @@ int manager_startup(Manager *m, FILE *serialization, FDSet *fds);
 
 Job *manager_get_job(Manager *m, uint32_t id);
 Unit *manager_get_unit(Manager *m, const char *name);
+int manager_get_units_sorted(Manager *m, Unit ***ret, size_t *ret_n);
+int manager_list_units_page(Manager *m, char **states, uint64_t types, char **patterns, uint64_t since, const char *cursor, unsigned max, Unit ***ret, size_t *ret_n, bool *ret_more);
+void manager_add_unit_tombstone(Manager *m, const char *id);
+void manager_forget_unit_tombstones(Manager *m);
+
+void manager_trace(Manager *m, ManagerTracePhase phase, const char *name, usec_t begin);
+void manager_trace_range(Manager *m, ManagerTracePhase phase, const char *name, usec_t begin, usec_t end);
+ManagerTraceSpan *manager_trace_span(Manager *m, size_t i);
 
 int manager_get_job_from_dbus_path(Manager *m, const char *s, Job **_j);
 
@@ -401,6 +470,8 @@ void manager_clear_jobs(Manager *m);
 
 unsigned manager_dispatch_load_queue(Manager *m);
 
+int manager_read_cgroups_agent(Manager *m, int fd);
+
 int manager_environment_add(Manager *m, char **minus, char **plus);
 int manager_set_default_rlimits(Manager *m, struct rlimit **default_rlimit);
 
@@ -408,10 +479,11 @@ int manager_loop(Manager *m);
 
 int manager_open_serialization(Manager *m, FILE **_f);
 
-int manager_serialize(Manager *m, FILE *f, FDSet *fds, bool switching_root);
+int manager_serialize(Manager *m, FILE *f, FDSet *fds, bool switching_root, bool binary);
 int manager_deserialize(Manager *m, FILE *f, FDSet *fds);
 
 int manager_reload(Manager *m);
+int manager_reload_incremental(Manager *m);
 
 void manager_reset_failed(Manager *m);
 
@@ -467,3 +539,6 @@ void manager_disable_confirm_spawn(void);
 
 const char *manager_timestamp_to_string(ManagerTimestamp m) _const_;
 ManagerTimestamp manager_timestamp_from_string(const char *s) _pure_;
+
+const char *manager_trace_phase_to_string(ManagerTracePhase p) _const_;
+ManagerTracePhase manager_trace_phase_from_string(const char *s) _pure_;
@@ -0,0 +1,564 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "escape.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "log.h"
+#include "mount-table.h"
+#include "parse-util.h"
+#include "string-util.h"
+#include "util.h"
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct libmnt_table*, mnt_free_table);
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct libmnt_iter*, mnt_free_iter);
+
+static MountTableEntry* mount_table_entry_free(MountTableEntry *e) {
+        if (!e)
+                return NULL;
+
+        free(e->line);
+        free(e->what);
+        free(e->where);
+        free(e->fstype);
+        free(e->options);
+        free(e->user_options);
+
+        return mfree(e);
+}
+
+static void mount_table_unlink(MountTable *t, MountTableEntry *e) {
+        MountTableEntry *first;
+
+        assert(t);
+        assert(e);
+
+        if (e->where) {
+                first = hashmap_get(t->by_where, e->where);
+
+                LIST_REMOVE(same_where, first, e);
+                if (first)
+                        hashmap_replace(t->by_where, first->where, first);
+                else
+                        hashmap_remove(t->by_where, e->where);
+        }
+
+        if (e->what) {
+                first = hashmap_get(t->by_what, e->what);
+
+                LIST_REMOVE(same_what, first, e);
+                if (first)
+                        hashmap_replace(t->by_what, first->what, first);
+                else
+                        hashmap_remove(t->by_what, e->what);
+        }
+}
+
+static int mount_table_link(MountTable *t, MountTableEntry *e) {
+        MountTableEntry *first;
+        int r;
+
+        assert(t);
+        assert(e);
+        assert(e->what);
+        assert(e->where);
+
+        /* On failure the lists may be left inconsistent, callers drop the whole snapshot then */
+
+        r = hashmap_ensure_allocated(&t->by_where, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = hashmap_ensure_allocated(&t->by_what, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        first = hashmap_get(t->by_where, e->where);
+        LIST_PREPEND(same_where, first, e);
+
+        r = hashmap_replace(t->by_where, first->where, first);
+        if (r < 0)
+                return r;
+
+        first = hashmap_get(t->by_what, e->what);
+        LIST_PREPEND(same_what, first, e);
+
+        return hashmap_replace(t->by_what, first->what, first);
+}
+
+static void mount_table_entry_reset(MountTable *t, MountTableEntry *e) {
+        assert(t);
+        assert(e);
+
+        /* Drops everything we parsed from the line, but not the userspace options, as those don't show up in
+         * /proc/self/mountinfo */
+
+        mount_table_unlink(t, e);
+
+        e->what = mfree(e->what);
+        e->where = mfree(e->where);
+        e->fstype = mfree(e->fstype);
+        e->options = mfree(e->options);
+}
+
+static int mount_table_entry_set_fs(MountTable *t, MountTableEntry *e, struct libmnt_fs *fs, bool take_user_options) {
+        _cleanup_free_ char *what = NULL, *where = NULL, *options = NULL;
+        const char *source, *target;
+        int r;
+
+        assert(t);
+        assert(e);
+        assert(fs);
+
+        mount_table_entry_reset(t, e);
+
+        source = mnt_fs_get_source(fs);
+        target = mnt_fs_get_target(fs);
+
+        /* Entries without source or target are kept to track the line, but ignored otherwise */
+        if (!source || !target)
+                return 0;
+
+        if (cunescape(source, UNESCAPE_RELAX, &what) < 0)
+                return -ENOMEM;
+
+        if (cunescape(target, UNESCAPE_RELAX, &where) < 0)
+                return -ENOMEM;
+
+        if (take_user_options) {
+                /* The table was parsed by mnt_table_parse_mtab(), hence the options already include those from
+                 * utab. Remember the latter, for later updates which only look at the kernel's table. */
+                r = free_and_strdup(&e->user_options, mnt_fs_get_user_options(fs));
+                if (r < 0)
+                        return r;
+
+                options = strdup(strempty(mnt_fs_get_options(fs)));
+        } else if (e->user_options)
+                /* Merge them the same way libmount does */
+                options = strjoin(strempty(mnt_fs_get_options(fs)), ",", e->user_options);
+        else
+                options = strdup(strempty(mnt_fs_get_options(fs)));
+        if (!options)
+                return -ENOMEM;
+
+        e->fstype = strdup(strempty(mnt_fs_get_fstype(fs)));
+        if (!e->fstype)
+                return -ENOMEM;
+
+        e->what = what;
+        e->where = where;
+        e->options = options;
+        what = where = options = NULL;
+
+        return mount_table_link(t, e);
+}
+
+static int mountinfo_line_id(const char *line, int *ret) {
+        char buf[DECIMAL_STR_MAX(int)];
+        size_t n;
+
+        assert(line);
+        assert(ret);
+
+        n = strcspn(line, " ");
+        if (n == 0 || n >= sizeof(buf))
+                return -EINVAL;
+
+        memcpy(buf, line, n);
+        buf[n] = 0;
+
+        return safe_atoi(buf, ret);
+}
+
+static bool mountinfo_line_same_mount(const char *a, const char *b) {
+        unsigned k;
+
+        assert(b);
+
+        /* Compares the device number, the root and the mount point of two lines with the same mount ID. If they
+         * differ, the kernel handed the ID of a mount that went away to a new one. */
+
+        if (!a)
+                return false;
+
+        for (k = 0; k < 5; k++) {
+                size_t n, m;
+
+                n = strcspn(a, " ");
+                m = strcspn(b, " ");
+
+                /* Skip the mount ID and the parent ID, the latter changes when the mount is moved */
+                if (k >= 2 && (n != m || memcmp(a, b, n) != 0))
+                        return false;
+
+                a += n;
+                b += m;
+                a += strspn(a, " ");
+                b += strspn(b, " ");
+        }
+
+        return true;
+}
+
+static char *mountinfo_next_line(char **p) {
+        char *line, *e;
+
+        assert(p);
+
+        /* Splits off the next line, in place */
+
+        line = *p;
+        if (!line || *line == 0)
+                return NULL;
+
+        e = strchr(line, '\n');
+        if (e) {
+                *e = 0;
+                *p = e + 1;
+        } else
+                *p = NULL;
+
+        return line;
+}
+
+static void mount_table_flush_results(MountTable *t) {
+        size_t i;
+
+        assert(t);
+
+        for (i = 0; i < t->n_changed; i++)
+                t->changed[i]->changed = false;
+        t->n_changed = 0;
+
+        for (i = 0; i < t->n_removed; i++)
+                mount_table_entry_free(t->removed[i]);
+        t->n_removed = 0;
+}
+
+void mount_table_done(MountTable *t) {
+        MountTableEntry *e;
+
+        assert(t);
+
+        mount_table_flush_results(t);
+
+        t->by_where = hashmap_free(t->by_where);
+        t->by_what = hashmap_free(t->by_what);
+
+        while ((e = hashmap_steal_first(t->entries)))
+                mount_table_entry_free(e);
+        t->entries = hashmap_free(t->entries);
+
+        t->changed = mfree(t->changed);
+        t->n_changed_allocated = 0;
+        t->removed = mfree(t->removed);
+        t->n_removed_allocated = 0;
+
+        t->loaded = false;
+}
+
+static int mount_table_add_changed(MountTable *t, MountTableEntry *e) {
+        assert(t);
+        assert(e);
+
+        if (e->changed)
+                return 0;
+
+        if (!GREEDY_REALLOC(t->changed, t->n_changed_allocated, t->n_changed + 1))
+                return -ENOMEM;
+
+        t->changed[t->n_changed++] = e;
+        e->changed = true;
+
+        return 0;
+}
+
+static int mount_table_add_removed(MountTable *t, MountTableEntry *e) {
+        assert(t);
+        assert(e);
+
+        if (!GREEDY_REALLOC(t->removed, t->n_removed_allocated, t->n_removed + 1))
+                return -ENOMEM;
+
+        (void) hashmap_remove(t->entries, INT_TO_PTR(e->id));
+        mount_table_unlink(t, e);
+        t->removed[t->n_removed++] = e;
+
+        return 0;
+}
+
+static int mount_table_load_internal(MountTable *t, struct libmnt_table *tb, char *mountinfo) {
+        _cleanup_(mnt_free_iterp) struct libmnt_iter *i = NULL;
+        _cleanup_hashmap_free_ Hashmap *lines = NULL;
+        unsigned position = 0;
+        char *line;
+        int r;
+
+        lines = hashmap_new(NULL);
+        if (!lines)
+                return -ENOMEM;
+
+        while ((line = mountinfo_next_line(&mountinfo))) {
+                int id;
+
+                if (mountinfo_line_id(line, &id) < 0)
+                        continue;
+
+                r = hashmap_put(lines, INT_TO_PTR(id), line);
+                if (r < 0 && r != -EEXIST)
+                        return r;
+        }
+
+        t->entries = hashmap_new(NULL);
+        if (!t->entries)
+                return -ENOMEM;
+
+        i = mnt_new_iter(MNT_ITER_FORWARD);
+        if (!i)
+                return -ENOMEM;
+
+        t->generation++;
+
+        for (;;) {
+                MountTableEntry *e;
+                struct libmnt_fs *fs;
+
+                r = mnt_table_next_fs(tb, i, &fs);
+                if (r == 1)
+                        break;
+                if (r < 0)
+                        return r;
+
+                e = new0(MountTableEntry, 1);
+                if (!e)
+                        return -ENOMEM;
+
+                e->id = mnt_fs_get_id(fs);
+                e->position = position++;
+                e->generation = t->generation;
+
+                /* Without unique mount IDs, e.g. when libmount read a regular /etc/mtab, we can't do anything */
+                r = hashmap_put(t->entries, INT_TO_PTR(e->id), e);
+                if (r < 0) {
+                        mount_table_entry_free(e);
+                        return r;
+                }
+
+                /* The table and the lines were read separately. If they don't agree the entry is simply considered
+                 * changed on the next update. */
+                line = hashmap_get(lines, INT_TO_PTR(e->id));
+                if (line) {
+                        e->line = strdup(line);
+                        if (!e->line)
+                                return -ENOMEM;
+                }
+
+                r = mount_table_entry_set_fs(t, e, fs, true);
+                if (r < 0)
+                        return r;
+        }
+
+        t->loaded = true;
+
+        return 0;
+}
+
+int mount_table_load(MountTable *t, struct libmnt_table *tb, char *mountinfo) {
+        int r;
+
+        assert(t);
+        assert(tb);
+        assert(mountinfo);
+
+        /* Builds the snapshot from a table parsed by mnt_table_parse_mtab(), plus the raw contents of
+         * /proc/self/mountinfo. Nothing is reported as changed, the caller is expected to look at the whole table. */
+
+        mount_table_done(t);
+
+        r = mount_table_load_internal(t, tb, mountinfo);
+        if (r < 0)
+                mount_table_done(t);
+
+        return r;
+}
+
+static int mount_table_update_internal(MountTable *t, char *mountinfo) {
+        _cleanup_free_ char *changed = NULL; /* must outlive both streams */
+        _cleanup_(mnt_free_tablep) struct libmnt_table *tb = NULL;
+        _cleanup_(mnt_free_iterp) struct libmnt_iter *i = NULL;
+        _cleanup_fclose_ FILE *f = NULL, *g = NULL;
+        size_t size = 0, k;
+        unsigned position = 0;
+        MountTableEntry *e;
+        Iterator it;
+        char *line;
+        int r;
+
+        f = open_memstream(&changed, &size);
+        if (!f)
+                return -ENOMEM;
+
+        t->generation++;
+
+        while ((line = mountinfo_next_line(&mountinfo))) {
+                int id;
+
+                if (mountinfo_line_id(line, &id) < 0)
+                        continue;
+
+                e = hashmap_get(t->entries, INT_TO_PTR(id));
+                if (e) {
+                        if (e->generation == t->generation)
+                                continue;
+
+                        if (streq_ptr(e->line, line)) {
+                                e->generation = t->generation;
+                                e->position = position++;
+                                continue;
+                        }
+
+                        if (mountinfo_line_same_mount(e->line, line)) {
+                                e->generation = t->generation;
+                                e->position = position++;
+                                mount_table_entry_reset(t, e);
+                        } else {
+                                /* The kernel reuses the IDs of mounts that went away right away. Report the old
+                                 * mount as removed and the new one as added, without the userspace options of the
+                                 * old one. */
+                                r = mount_table_add_removed(t, e);
+                                if (r < 0)
+                                        return r;
+
+                                e = NULL;
+                        }
+                }
+
+                if (!e) {
+                        e = new0(MountTableEntry, 1);
+                        if (!e)
+                                return -ENOMEM;
+
+                        e->id = id;
+                        e->generation = t->generation;
+                        e->position = position++;
+
+                        r = hashmap_put(t->entries, INT_TO_PTR(id), e);
+                        if (r < 0) {
+                                mount_table_entry_free(e);
+                                return r;
+                        }
+                }
+
+                r = free_and_strdup(&e->line, line);
+                if (r < 0)
+                        return r;
+
+                r = mount_table_add_changed(t, e);
+                if (r < 0)
+                        return r;
+
+                fputs(line, f);
+                fputc('\n', f);
+        }
+
+        HASHMAP_FOREACH(e, t->entries, it) {
+                if (e->generation == t->generation)
+                        continue;
+
+                r = mount_table_add_removed(t, e);
+                if (r < 0)
+                        return r;
+        }
+
+        if (t->n_changed == 0)
+                return 0;
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                return r;
+
+        /* Only the lines that changed are handed to libmount */
+        g = fmemopen(changed, size, "re");
+        if (!g)
+                return -errno;
+
+        tb = mnt_new_table();
+        if (!tb)
+                return -ENOMEM;
+
+        i = mnt_new_iter(MNT_ITER_FORWARD);
+        if (!i)
+                return -ENOMEM;
+
+        r = mnt_table_parse_stream(tb, g, "/proc/self/mountinfo");
+        if (r < 0)
+                return r;
+
+        for (;;) {
+                struct libmnt_fs *fs;
+
+                r = mnt_table_next_fs(tb, i, &fs);
+                if (r == 1)
+                        break;
+                if (r < 0)
+                        return r;
+
+                e = hashmap_get(t->entries, INT_TO_PTR(mnt_fs_get_id(fs)));
+                if (!e || !e->changed)
+                        continue;
+
+                r = mount_table_entry_set_fs(t, e, fs, false);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Entries libmount didn't like are left without what and where, and are skipped by the caller */
+        for (k = 0; k < t->n_changed; k++)
+                if (!t->changed[k]->where)
+                        log_debug("Failed to parse mount table entry %i, ignoring.", t->changed[k]->id);
+
+        return 0;
+}
+
+int mount_table_update(MountTable *t, char *mountinfo) {
+        int r;
+
+        assert(t);
+        assert(t->loaded);
+        assert(mountinfo);
+
+        /* Compares the current contents of /proc/self/mountinfo with the snapshot, and records in t->changed and
+         * t->removed what is different. On failure the snapshot is dropped, and needs to be loaded again. */
+
+        mount_table_flush_results(t);
+
+        r = mount_table_update_internal(t, mountinfo);
+        if (r < 0)
+                mount_table_done(t);
+
+        return r;
+}
+
+MountTableEntry *mount_table_find_where(MountTable *t, const char *where) {
+        MountTableEntry *e, *found = NULL;
+
+        assert(t);
+        assert(where);
+
+        /* If something is mounted on top of something else, the later entry is the one that is visible */
+
+        LIST_FOREACH(same_where, e, hashmap_get(t->by_where, where))
+                if (!found || e->position > found->position)
+                        found = e;
+
+        return found;
+}
+
+MountTableEntry *mount_table_find_what(MountTable *t, const char *what) {
+        assert(t);
+        assert(what);
+
+        return hashmap_get(t->by_what, what);
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <libmount.h>
+#include <stdbool.h>
+
+#include "hashmap.h"
+#include "list.h"
+
+typedef struct MountTableEntry MountTableEntry;
+typedef struct MountTable MountTable;
+
+struct MountTableEntry {
+        int id;
+
+        /* The raw line from /proc/self/mountinfo, so that unchanged entries can be recognized without parsing */
+        char *line;
+
+        /* Unescaped, as passed on to the mount units */
+        char *what;
+        char *where;
+
+        char *fstype;
+        char *options;      /* kernel options, followed by the userspace options */
+        char *user_options; /* userspace options from /run/mount/utab, kept across incremental updates */
+
+        unsigned position;
+        unsigned generation;
+        bool changed;
+
+        /* Entries mounted on the same path, and entries of the same device */
+        LIST_FIELDS(MountTableEntry, same_where);
+        LIST_FIELDS(MountTableEntry, same_what);
+};
+
+/* A snapshot of /proc/self/mountinfo indexed by mount ID. When the kernel signals a change only the lines which differ
+ * from the snapshot are parsed again, and reported to the caller together with the entries that disappeared. */
+struct MountTable {
+        Hashmap *entries; /* mount id → MountTableEntry */
+        Hashmap *by_where; /* where → list of MountTableEntry */
+        Hashmap *by_what; /* what → list of MountTableEntry */
+        unsigned generation;
+        bool loaded;
+
+        /* Results of the last load or update, in the order of the mount table. Removed entries are owned by this
+         * array, and freed on the next load or update. */
+        MountTableEntry **changed;
+        size_t n_changed, n_changed_allocated;
+        MountTableEntry **removed;
+        size_t n_removed, n_removed_allocated;
+};
+
+void mount_table_done(MountTable *t);
+
+int mount_table_load(MountTable *t, struct libmnt_table *tb, char *mountinfo);
+int mount_table_update(MountTable *t, char *mountinfo);
+
+MountTableEntry *mount_table_find_where(MountTable *t, const char *where);
+MountTableEntry *mount_table_find_what(MountTable *t, const char *what);
@@ -29,6 +29,7 @@
 #include "dbus-mount.h"
 #include "escape.h"
 #include "exit-status.h"
+#include "fileio.h"
 #include "format-util.h"
 #include "fstab-util.h"
 #include "log.h"
@@ -68,6 +69,8 @@ static const UnitActiveState state_translation_table[_MOUNT_STATE_MAX] = {
 
 static int mount_dispatch_timer(sd_event_source *source, usec_t usec, void *userdata);
 static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+static bool mount_rescan_pending(Manager *m);
+static int mount_process_proc_self_mountinfo(Manager *m);
 
 static bool MOUNT_STATE_WITH_PROCESS(MountState state) {
         return IN_SET(state,
@@ -1277,7 +1280,10 @@ static void mount_sigchld_event(Unit *u, pid_t pid, int code, int status) {
                       "Mount process exited, code=%s status=%i", sigchld_code_to_string(code), status);
 
         /* Note that due to the io event priority logic, we can be sure the new mountinfo is loaded
-         * before we process the SIGCHLD for the mount command. */
+         * before we process the SIGCHLD for the mount command. Unless the rescan was delayed because of
+         * too many mount events, in which case we do it now. */
+        if (mount_rescan_pending(u->manager))
+                (void) mount_process_proc_self_mountinfo(u->manager);
 
         switch (m->state) {
 
@@ -1532,7 +1538,8 @@ static int mount_setup_unit(
                 const char *where,
                 const char *options,
                 const char *fstype,
-                bool set_flags) {
+                bool set_flags,
+                Unit **ret) {
 
         _cleanup_free_ char *e = NULL;
         MountSetupFlags flags;
@@ -1545,6 +1552,9 @@ static int mount_setup_unit(
         assert(options);
         assert(fstype);
 
+        if (ret)
+                *ret = NULL;
+
         /* Ignore API mount points. They should never be referenced in
          * dependencies ever. */
         if (mount_point_is_api(where) || mount_point_ignore(where))
@@ -1588,6 +1598,9 @@ static int mount_setup_unit(
         if (flags.just_changed)
                 unit_add_to_dbus_queue(u);
 
+        if (ret)
+                *ret = u;
+
         return 0;
 fail:
         log_warning_errno(r, "Failed to set up mount unit: %m");
@@ -1597,10 +1610,17 @@ fail:
 static int mount_load_proc_self_mountinfo(Manager *m, bool set_flags) {
         _cleanup_(mnt_free_tablep) struct libmnt_table *t = NULL;
         _cleanup_(mnt_free_iterp) struct libmnt_iter *i = NULL;
-        int r = 0;
+        _cleanup_free_ char *mountinfo = NULL;
+        int r = 0, k;
 
         assert(m);
 
+        /* The raw table is only needed to build the snapshot for later incremental updates. Read it first, if
+         * anything changes until libmount reads it again, that's picked up by the next update. */
+        k = read_full_file("/proc/self/mountinfo", &mountinfo, NULL);
+        if (k < 0)
+                log_debug_errno(k, "Failed to read /proc/self/mountinfo, ignoring: %m");
+
         t = mnt_new_table();
         if (!t)
                 return log_oom();
@@ -1642,18 +1662,92 @@ static int mount_load_proc_self_mountinfo(Manager *m, bool set_flags) {
 
                 (void) device_found_node(m, d, true, DEVICE_FOUND_MOUNT, set_flags);
 
-                k = mount_setup_unit(m, d, p, options, fstype, set_flags);
+                k = mount_setup_unit(m, d, p, options, fstype, set_flags, NULL);
                 if (r == 0 && k < 0)
                         r = k;
         }
 
+        if (mountinfo) {
+                k = mount_table_load(&m->mount_table, t, mountinfo);
+                if (k < 0)
+                        log_debug_errno(k, "Failed to build mount table snapshot, ignoring: %m");
+        } else
+                mount_table_done(&m->mount_table);
+
         return r;
 }
 
+static int mount_update_proc_self_mountinfo(Manager *m, Set **touched) {
+        _cleanup_free_ char *mountinfo = NULL;
+        MountTable *t = &m->mount_table;
+        size_t k;
+        int r;
+
+        assert(m);
+        assert(touched);
+
+        /* Like mount_load_proc_self_mountinfo(), but only looks at the entries which changed since the last
+         * time. Returns the units affected in 'touched'. */
+
+        r = read_full_file("/proc/self/mountinfo", &mountinfo, NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to read /proc/self/mountinfo: %m");
+
+        r = mount_table_update(t, mountinfo);
+        if (r < 0)
+                return log_error_errno(r, "Failed to update mount table: %m");
+
+        for (k = 0; k < t->n_changed + t->n_removed; k++) {
+                MountTableEntry *e, *top;
+                Unit *u = NULL;
+
+                e = k < t->n_changed ? t->changed[k] : t->removed[k - t->n_changed];
+                if (!e->where)
+                        continue;
+
+                if (k < t->n_changed)
+                        (void) device_found_node(m, e->what, true, DEVICE_FOUND_MOUNT, true);
+
+                /* If something is mounted on top, the unit reflects that one. If it changed too, it's handled on
+                 * its own. */
+                top = mount_table_find_where(t, e->where);
+                if (top && top != e && top->changed)
+                        continue;
+
+                if (top)
+                        (void) mount_setup_unit(m, top->what, top->where, top->options, top->fstype, true, &u);
+                else {
+                        _cleanup_free_ char *name = NULL;
+
+                        /* Nothing mounted there anymore */
+                        if (unit_name_from_path(e->where, ".mount", &name) < 0)
+                                continue;
+
+                        u = manager_get_unit(m, name);
+                }
+
+                if (!u)
+                        continue;
+
+                r = set_ensure_allocated(touched, NULL);
+                if (r < 0)
+                        return log_oom();
+
+                r = set_put(*touched, u);
+                if (r < 0)
+                        return log_oom();
+        }
+
+        return 0;
+}
+
 static void mount_shutdown(Manager *m) {
         assert(m);
 
         m->mount_event_source = sd_event_source_unref(m->mount_event_source);
+        m->mount_rescan_event_source = sd_event_source_unref(m->mount_rescan_event_source);
+
+        mount_table_done(&m->mount_table);
 
         mnt_unref_monitor(m->mount_monitor);
         m->mount_monitor = NULL;
@@ -1760,6 +1854,10 @@ static void mount_enumerate(Manager *m) {
                 }
 
                 (void) sd_event_source_set_description(m->mount_event_source, "mount-monitor-dispatch");
+
+                /* Container managers may mount and unmount a lot in a short time, rescan at most 5 times per
+                 * 100ms and coalesce the rest */
+                RATELIMIT_INIT(m->mount_rescan_ratelimit, 100 * USEC_PER_MSEC, 5);
         }
 
         r = mount_load_proc_self_mountinfo(m, false);
@@ -1772,41 +1870,106 @@ fail:
         mount_shutdown(m);
 }
 
-static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
-        _cleanup_set_free_ Set *around = NULL, *gone = NULL;
-        Manager *m = userdata;
+static void mount_process_unit(Mount *mount, Set **gone, Set **around) {
+        assert(mount);
+
+        if (!mount_is_mounted(mount)) {
+
+                /* A mount point is not around right now. It
+                 * might be gone, or might never have
+                 * existed. */
+
+                if (mount->from_proc_self_mountinfo &&
+                    mount->parameters_proc_self_mountinfo.what) {
+
+                        /* Remember that this device might just have disappeared */
+                        if (set_ensure_allocated(gone, &string_hash_ops) < 0 ||
+                            set_put(*gone, mount->parameters_proc_self_mountinfo.what) < 0)
+                                log_oom(); /* we don't care too much about OOM here... */
+                }
+
+                mount->from_proc_self_mountinfo = false;
+
+                switch (mount->state) {
+
+                case MOUNT_MOUNTED:
+                        /* This has just been unmounted by
+                         * somebody else, follow the state
+                         * change. */
+                        mount->result = MOUNT_SUCCESS; /* make sure we forget any earlier umount failures */
+                        mount_enter_dead(mount, MOUNT_SUCCESS);
+                        break;
+
+                default:
+                        break;
+                }
+
+        } else if (mount->just_mounted || mount->just_changed) {
+
+                /* A mount point was added or changed */
+
+                switch (mount->state) {
+
+                case MOUNT_DEAD:
+                case MOUNT_FAILED:
+
+                        /* This has just been mounted by somebody else, follow the state change, but let's
+                         * generate a new invocation ID for this implicitly and automatically. */
+                        (void) unit_acquire_invocation_id(UNIT(mount));
+                        mount_enter_mounted(mount, MOUNT_SUCCESS);
+                        break;
+
+                case MOUNT_MOUNTING:
+                        mount_set_state(mount, MOUNT_MOUNTING_DONE);
+                        break;
+
+                default:
+                        /* Nothing really changed, but let's
+                         * issue an notification call
+                         * nonetheless, in case somebody is
+                         * waiting for this. (e.g. file system
+                         * ro/rw remounts.) */
+                        mount_set_state(mount, mount->state);
+                        break;
+                }
+        }
+
+        if (mount_is_mounted(mount) &&
+            mount->from_proc_self_mountinfo &&
+            mount->parameters_proc_self_mountinfo.what) {
+
+                if (set_ensure_allocated(around, &string_hash_ops) < 0 ||
+                    set_put(*around, mount->parameters_proc_self_mountinfo.what) < 0)
+                        log_oom();
+        }
+
+        /* Reset the flags for later calls */
+        mount->is_mounted = mount->just_mounted = mount->just_changed = false;
+}
+
+static int mount_process_proc_self_mountinfo(Manager *m) {
+        _cleanup_set_free_ Set *around = NULL, *gone = NULL, *touched = NULL;
         const char *what;
         Iterator i;
+        bool full;
         Unit *u;
         int r;
 
         assert(m);
-        assert(revents & EPOLLIN);
 
-        if (fd == mnt_monitor_get_fd(m->mount_monitor)) {
-                bool rescan = false;
+        /* If a delayed rescan is pending, this one covers it */
+        if (m->mount_rescan_event_source)
+                (void) sd_event_source_set_enabled(m->mount_rescan_event_source, SD_EVENT_OFF);
 
-                /* Drain all events and verify that the event is valid.
-                 *
-                 * Note that libmount also monitors /run/mount mkdir if the
-                 * directory does not exist yet. The mkdir may generate event
-                 * which is irrelevant for us.
-                 *
-                 * error: r < 0; valid: r == 0, false positive: rc == 1 */
-                do {
-                        r = mnt_monitor_next_change(m->mount_monitor, NULL, NULL);
-                        if (r == 0)
-                                rescan = true;
-                        else if (r < 0)
-                                return log_error_errno(r, "Failed to drain libmount events");
-                } while (r == 0);
+        /* Changes to utab only affect the userspace mount options, which are only merged in by a full parse. If
+         * we don't have a snapshot to compare to, we need a full parse anyway. */
+        full = m->mount_rescan_utab || !m->mount_table.loaded;
+        m->mount_rescan_utab = false;
 
-                log_debug("libmount event [rescan: %s]", yes_no(rescan));
-                if (!rescan)
-                        return 0;
-        }
-
-        r = mount_load_proc_self_mountinfo(m, true);
+        if (full)
+                r = mount_load_proc_self_mountinfo(m, true);
+        else
+                r = mount_update_proc_self_mountinfo(m, &touched);
         if (r < 0) {
                 /* Reset flags, just in case, for later calls */
                 LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT]) {
@@ -1815,97 +1978,134 @@ static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents,
                         mount->is_mounted = mount->just_mounted = mount->just_changed = false;
                 }
 
+                /* Start from scratch next time */
+                mount_table_done(&m->mount_table);
                 return 0;
         }
 
         manager_dispatch_load_queue(m);
 
-        LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT]) {
-                Mount *mount = MOUNT(u);
+        if (full)
+                LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT])
+                        mount_process_unit(MOUNT(u), &gone, &around);
+        else
+                SET_FOREACH(u, touched, i)
+                        mount_process_unit(MOUNT(u), &gone, &around);
 
-                if (!mount_is_mounted(mount)) {
+        SET_FOREACH(what, gone, i) {
+                if (set_contains(around, what))
+                        continue;
 
-                        /* A mount point is not around right now. It
-                         * might be gone, or might never have
-                         * existed. */
+                /* When only looking at the changed entries, the device might still be mounted elsewhere */
+                if (!full && mount_table_find_what(&m->mount_table, what))
+                        continue;
 
-                        if (mount->from_proc_self_mountinfo &&
-                            mount->parameters_proc_self_mountinfo.what) {
+                /* Let the device units know that the device is no longer mounted */
+                (void) device_found_node(m, what, false, DEVICE_FOUND_MOUNT, true);
+        }
 
-                                /* Remember that this device might just have disappeared */
-                                if (set_ensure_allocated(&gone, &string_hash_ops) < 0 ||
-                                    set_put(gone, mount->parameters_proc_self_mountinfo.what) < 0)
-                                        log_oom(); /* we don't care too much about OOM here... */
-                        }
+        return 0;
+}
 
-                        mount->from_proc_self_mountinfo = false;
+static bool mount_rescan_pending(Manager *m) {
+        int enabled;
 
-                        switch (mount->state) {
+        assert(m);
 
-                        case MOUNT_MOUNTED:
-                                /* This has just been unmounted by
-                                 * somebody else, follow the state
-                                 * change. */
-                                mount->result = MOUNT_SUCCESS; /* make sure we forget any earlier umount failures */
-                                mount_enter_dead(mount, MOUNT_SUCCESS);
-                                break;
+        if (!m->mount_rescan_event_source)
+                return false;
 
-                        default:
-                                break;
-                        }
+        return sd_event_source_get_enabled(m->mount_rescan_event_source, &enabled) > 0;
+}
 
-                } else if (mount->just_mounted || mount->just_changed) {
+static int mount_dispatch_rescan(sd_event_source *source, usec_t usec, void *userdata) {
+        Manager *m = userdata;
 
-                        /* A mount point was added or changed */
+        assert(m);
 
-                        switch (mount->state) {
+        return mount_process_proc_self_mountinfo(m);
+}
 
-                        case MOUNT_DEAD:
-                        case MOUNT_FAILED:
+static int mount_schedule_rescan(Manager *m) {
+        usec_t until;
+        int r;
 
-                                /* This has just been mounted by somebody else, follow the state change, but let's
-                                 * generate a new invocation ID for this implicitly and automatically. */
-                                (void) unit_acquire_invocation_id(UNIT(mount));
-                                mount_enter_mounted(mount, MOUNT_SUCCESS);
-                                break;
+        assert(m);
 
-                        case MOUNT_MOUNTING:
-                                mount_set_state(mount, MOUNT_MOUNTING_DONE);
-                                break;
+        until = usec_add(m->mount_rescan_ratelimit.begin, m->mount_rescan_ratelimit.interval);
 
-                        default:
-                                /* Nothing really changed, but let's
-                                 * issue an notification call
-                                 * nonetheless, in case somebody is
-                                 * waiting for this. (e.g. file system
-                                 * ro/rw remounts.) */
-                                mount_set_state(mount, mount->state);
-                                break;
-                        }
-                }
+        if (m->mount_rescan_event_source) {
+                r = sd_event_source_set_time(m->mount_rescan_event_source, until);
+                if (r < 0)
+                        return r;
 
-                if (mount_is_mounted(mount) &&
-                    mount->from_proc_self_mountinfo &&
-                    mount->parameters_proc_self_mountinfo.what) {
+                return sd_event_source_set_enabled(m->mount_rescan_event_source, SD_EVENT_ONESHOT);
+        }
 
-                        if (set_ensure_allocated(&around, &string_hash_ops) < 0 ||
-                            set_put(around, mount->parameters_proc_self_mountinfo.what) < 0)
-                                log_oom();
-                }
+        r = sd_event_add_time(m->event, &m->mount_rescan_event_source, CLOCK_MONOTONIC, until, 0, mount_dispatch_rescan, m);
+        if (r < 0)
+                return r;
+
+        /* Same priority as the mount monitor itself, see mount_enumerate() */
+        r = sd_event_source_set_priority(m->mount_rescan_event_source, SD_EVENT_PRIORITY_NORMAL-10);
+        if (r < 0)
+                return r;
 
-                /* Reset the flags for later calls */
-                mount->is_mounted = mount->just_mounted = mount->just_changed = false;
+        (void) sd_event_source_set_description(m->mount_rescan_event_source, "mount-monitor-rescan");
+
+        return 0;
+}
+
+static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        Manager *m = userdata;
+        int r;
+
+        assert(m);
+        assert(revents & EPOLLIN);
+
+        if (fd == mnt_monitor_get_fd(m->mount_monitor)) {
+                bool rescan = false;
+
+                /* Drain all events and verify that the event is valid.
+                 *
+                 * Note that libmount also monitors /run/mount mkdir if the
+                 * directory does not exist yet. The mkdir may generate event
+                 * which is irrelevant for us.
+                 *
+                 * error: r < 0; valid: r == 0, false positive: rc == 1 */
+                do {
+                        int type;
+
+                        r = mnt_monitor_next_change(m->mount_monitor, NULL, &type);
+                        if (r == 0) {
+                                rescan = true;
+
+                                if (type == MNT_MONITOR_TYPE_USERSPACE)
+                                        m->mount_rescan_utab = true;
+                        } else if (r < 0)
+                                return log_error_errno(r, "Failed to drain libmount events");
+                } while (r == 0);
+
+                log_debug("libmount event [rescan: %s]", yes_no(rescan));
+                if (!rescan)
+                        return 0;
         }
 
-        SET_FOREACH(what, gone, i) {
-                if (set_contains(around, what))
-                        continue;
+        /* Already scheduled, all changes so far are picked up then */
+        if (mount_rescan_pending(m))
+                return 0;
 
-                /* Let the device units know that the device is no longer mounted */
-                (void) device_found_node(m, what, false, DEVICE_FOUND_MOUNT, true);
+        if (!ratelimit_test(&m->mount_rescan_ratelimit)) {
+                r = mount_schedule_rescan(m);
+                if (r >= 0) {
+                        log_debug("Too many mount table changes, delaying rescan.");
+                        return 0;
+                }
+
+                log_warning_errno(r, "Failed to schedule mount table rescan, rescanning right away: %m");
         }
 
-        return 0;
+        return mount_process_proc_self_mountinfo(m);
 }
 
 static void mount_reset_failed(Unit *u) {
@@ -903,15 +903,35 @@ static int apply_mount(
         return 0;
 }
 
-static int make_read_only(MountEntry *m, char **blacklist, FILE *proc_self_mountinfo) {
+static int make_read_only(MountEntry *m, char **blacklist, FILE *proc_self_mountinfo, MountInfo **mount_info) {
         int r = 0;
 
         assert(m);
         assert(proc_self_mountinfo);
+        assert(mount_info);
 
-        if (mount_entry_read_only(m))
-                r = bind_remount_recursive_with_mountinfo(mount_entry_path(m), true, blacklist, proc_self_mountinfo);
-        else if (m->mode == PRIVATE_DEV) { /* Superblock can be readonly but the submounts can't */
+        if (mount_entry_read_only(m)) {
+                /* The mount table is parsed only once, and we merely collect here what needs to be remounted. The
+                 * remounts are applied at the end, all in one go. */
+                if (!*mount_info) {
+                        r = mount_info_parse(proc_self_mountinfo, mount_info);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = mount_info_mark_remount(*mount_info, mount_entry_path(m), blacklist);
+                if (r == 0) {
+                        /* Not a mount point, which is unusual, as apply_mount() made it one. Apply what we collected
+                         * so far, and do this one the slow way, which changes the mount table. */
+                        r = mount_info_apply_remount(*mount_info, true);
+                        if (r < 0)
+                                return r;
+
+                        *mount_info = mount_info_free(*mount_info);
+
+                        r = bind_remount_recursive_with_mountinfo(mount_entry_path(m), true, blacklist, proc_self_mountinfo);
+                }
+        } else if (m->mode == PRIVATE_DEV) { /* Superblock can be readonly but the submounts can't */
                 if (mount(NULL, mount_entry_path(m), NULL, MS_REMOUNT|DEV_MOUNT_OPTIONS|MS_RDONLY, NULL) < 0)
                         r = -errno;
         } else
@@ -924,7 +944,7 @@ static int make_read_only(MountEntry *m, char **blacklist, FILE *proc_self_mount
         if (r == -ENOENT && m->ignore)
                 r = 0;
 
-        return r;
+        return r < 0 ? r : 0;
 }
 
 static bool namespace_info_mount_apivfs(const char *root_directory, const NamespaceInfo *ns_info) {
@@ -1223,6 +1243,7 @@ int setup_namespace(
 
         if (n_mounts > 0) {
                 _cleanup_fclose_ FILE *proc_self_mountinfo = NULL;
+                _cleanup_(mount_info_freep) MountInfo *mount_info = NULL;
                 char **blacklist;
                 unsigned j;
 
@@ -1249,7 +1270,13 @@ int setup_namespace(
 
                 /* Second round, flip the ro bits if necessary. */
                 for (m = mounts; m < mounts + n_mounts; ++m) {
-                        r = make_read_only(m, blacklist, proc_self_mountinfo);
+                        r = make_read_only(m, blacklist, proc_self_mountinfo, &mount_info);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                if (mount_info) {
+                        r = mount_info_apply_remount(mount_info, true);
                         if (r < 0)
                                 goto finish;
                 }
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "macro.h"
+#include "serialize-binary.h"
+#include "sparse-endian.h"
+#include "string-util.h"
+#include "unaligned.h"
+
+/* The items of a record of the binary serialization format: the sizes of the key and the value, each including
+ * the trailing NUL byte, as unaligned little-endian 32bit values, followed by the NUL terminated key and value.
+ * They may be handed to the deserializers right from the mapped serialization. An empty key corresponds to an
+ * empty line of the text format, and terminates a section, such as a serialized job. */
+
+#define ITEM_HEADER_SIZE (2 * sizeof(le32_t))
+
+static void serialize_binary_item(FILE *f, const char *key, const char *value) {
+        uint8_t h[ITEM_HEADER_SIZE];
+        size_t k, v;
+
+        k = strlen(key) + 1;
+        v = strlen(value) + 1;
+
+        unaligned_write_le32(h, k);
+        unaligned_write_le32(h + sizeof(le32_t), v);
+
+        fwrite(h, 1, sizeof(h), f);
+        fwrite(key, 1, k, f);
+        fwrite(value, 1, v, f);
+}
+
+int serialize_binary_items(FILE *f, char *text, size_t size) {
+        char *e;
+
+        assert(f);
+        assert(text || size == 0);
+
+        /* Writes the "key=value" lines the serializers of the units and of the manager produce as items. The lines
+         * are split in place. Like the text format parser we strip surrounding whitespace. */
+
+        e = text + size;
+        while (text < e) {
+                char *nl, *l, *v;
+                size_t k;
+
+                nl = memchr(text, '\n', e - text);
+                if (!nl)
+                        nl = e;
+                *nl = 0;
+
+                l = strstrip(text);
+                text = nl + 1;
+
+                k = strcspn(l, "=");
+                if (l[k] == '=') {
+                        l[k] = 0;
+                        v = l + k + 1;
+                } else
+                        v = l + k;
+
+                serialize_binary_item(f, l, v);
+        }
+
+        return ferror(f) ? -EIO : 0;
+}
+
+int deserialize_binary_item(const uint8_t **p, size_t *left, const char **ret_key, const char **ret_value) {
+        uint32_t k, v;
+
+        assert(p);
+        assert(left);
+        assert(ret_key);
+        assert(ret_value);
+
+        /* Returns 0 at the end of the record, 1 if an item was read */
+
+        if (*left == 0)
+                return 0;
+
+        if (*left < ITEM_HEADER_SIZE)
+                return -EBADMSG;
+
+        k = unaligned_read_le32(*p);
+        v = unaligned_read_le32(*p + sizeof(le32_t));
+
+        if (k == 0 || v == 0 ||
+            k > *left - ITEM_HEADER_SIZE ||
+            v > *left - ITEM_HEADER_SIZE - k)
+                return -EBADMSG;
+
+        *ret_key = (const char*) *p + ITEM_HEADER_SIZE;
+        *ret_value = *ret_key + k;
+
+        if ((*ret_key)[k - 1] != 0 || (*ret_value)[v - 1] != 0)
+                return -EBADMSG;
+
+        *p += ITEM_HEADER_SIZE + k + v;
+        *left -= ITEM_HEADER_SIZE + k + v;
+
+        return 1;
+}
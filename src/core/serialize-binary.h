@@ -0,0 +1,8 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+int serialize_binary_items(FILE *f, char *text, size_t size);
+int deserialize_binary_item(const uint8_t **p, size_t *left, const char **ret_key, const char **ret_value);
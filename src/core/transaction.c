@@ -30,6 +30,106 @@
 
 static void transaction_unlink_job(Transaction *tr, Job *j, bool delete_dependencies);
 
+typedef struct TransactionDeps {
+        /* All dependencies we look at, grouped by type. Those of type d are units[offset[d]] … units[offset[d+1]-1]. */
+        Unit **units;
+        unsigned offset[_UNIT_DEPENDENCY_MAX + 1];
+} TransactionDeps;
+
+static const bool transaction_dependency_used[_UNIT_DEPENDENCY_MAX] = {
+        [UNIT_REQUIRES] = true,
+        [UNIT_REQUISITE] = true,
+        [UNIT_WANTS] = true,
+        [UNIT_BINDS_TO] = true,
+        [UNIT_REQUIRED_BY] = true,
+        [UNIT_REQUISITE_OF] = true,
+        [UNIT_BOUND_BY] = true,
+        [UNIT_CONSISTS_OF] = true,
+        [UNIT_CONFLICTS] = true,
+        [UNIT_CONFLICTED_BY] = true,
+        [UNIT_BEFORE] = true,
+        [UNIT_PROPAGATES_RELOAD_TO] = true,
+};
+
+static TransactionDeps *transaction_deps_free(TransactionDeps *deps) {
+        if (!deps)
+                return NULL;
+
+        free(deps->units);
+        return mfree(deps);
+}
+
+static TransactionDeps *transaction_get_deps(Transaction *tr, Unit *u) {
+        TransactionDeps *deps;
+        UnitDependency d;
+        unsigned n = 0;
+
+        assert(tr);
+        assert(u);
+
+        /* Returns the dependencies of the unit as flat arrays. They are collected once per transaction, so that the
+         * walks over the dependency graph below don't have to iterate through the hashmaps of each unit again and
+         * again. */
+
+        deps = hashmap_get(tr->deps, u);
+        if (deps)
+                return deps;
+
+        deps = new0(TransactionDeps, 1);
+        if (!deps)
+                return NULL;
+
+        for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++)
+                if (transaction_dependency_used[d])
+                        n += unit_dependency_list_size(&u->dependencies[d]);
+
+        if (n > 0) {
+                deps->units = new(Unit*, n);
+                if (!deps->units)
+                        return transaction_deps_free(deps);
+        }
+
+        n = 0;
+        for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++) {
+                unsigned i;
+                Unit *other;
+
+                deps->offset[d] = n;
+
+                if (!transaction_dependency_used[d])
+                        continue;
+
+                UNIT_FOREACH_DEPENDENCY(other, u, d, i)
+                        deps->units[n++] = other;
+        }
+        deps->offset[_UNIT_DEPENDENCY_MAX] = n;
+
+        if (hashmap_put(tr->deps, u, deps) < 0)
+                return transaction_deps_free(deps);
+
+        return deps;
+}
+
+static Unit **transaction_deps_get(TransactionDeps *deps, UnitDependency d, unsigned *ret_n) {
+        assert(deps);
+        assert(ret_n);
+
+        *ret_n = deps->offset[d + 1] - deps->offset[d];
+        return deps->units + deps->offset[d];
+}
+
+static Job *transaction_get_job_for_unit(Transaction *tr, Unit *u) {
+        Job *j;
+
+        /* Returns the job for the unit in the transaction, or if there's none, the one already installed */
+
+        j = hashmap_get(tr->jobs, u);
+        if (j)
+                return j;
+
+        return u->job;
+}
+
 static void transaction_delete_job(Transaction *tr, Job *j, bool delete_dependencies) {
         assert(tr);
         assert(j);
@@ -358,145 +458,227 @@ static char* merge_unit_ids(const char* unit_log_field, char **pairs) {
         return ans;
 }
 
-static int transaction_verify_order_one(Transaction *tr, Job *j, Job *from, unsigned generation, sd_bus_error *e) {
-        Iterator i;
-        Unit *u;
-        void *v;
-        int r;
+static int transaction_break_order_cycle(Transaction *tr, Job *j, Job **scc, size_t n_scc, sd_bus_error *e) {
+        _cleanup_free_ Job **queue = NULL;
+        Job *k, *from = NULL, *delete = NULL;
+        _cleanup_free_ char **array = NULL, *unit_ids = NULL;
+        char **unit_id, **job_type;
+        size_t n_queue = 0, q, x;
 
         assert(tr);
         assert(j);
-        assert(!j->transaction_prev);
+        assert(scc);
+        assert(n_scc > 1);
 
-        /* Does a recursive sweep through the ordering graph, looking
-         * for a cycle. If we find a cycle we try to break it. */
+        /* The jobs in scc[] form a strongly connected component of the ordering graph that includes j, i.e. there is
+         * at least one cycle through them. Find the shortest one starting and ending in j, and try to break it by
+         * deleting one of the jobs on it. While doing so order_on_stack marks the members of the component, and
+         * marker points to where we came from, so that we can find our way back. */
 
-        /* Have we seen this before? */
-        if (j->generation == generation) {
-                Job *k, *delete = NULL;
-                _cleanup_free_ char **array = NULL, *unit_ids = NULL;
-                char **unit_id, **job_type;
+        queue = new(Job*, n_scc);
+        if (!queue)
+                return -ENOMEM;
 
-                /* If the marker is NULL we have been here already and
-                 * decided the job was loop-free from here. Hence
-                 * shortcut things and return right-away. */
-                if (!j->marker)
-                        return 0;
+        for (x = 0; x < n_scc; x++) {
+                scc[x]->order_on_stack = true;
+                scc[x]->marker = NULL;
+        }
 
-                /* So, the marker is not NULL and we already have been here. We have
-                 * a cycle. Let's try to break it. We go backwards in our path and
-                 * try to find a suitable job to remove. We use the marker to find
-                 * our way back, since smart how we are we stored our way back in
-                 * there. */
+        j->marker = j;
+        queue[n_queue++] = j;
 
-                for (k = from; k; k = ((k->generation == generation && k->marker != k) ? k->marker : NULL)) {
+        for (q = 0; q < n_queue && !from; q++) {
+                TransactionDeps *deps;
+                Unit **before;
+                unsigned n, l;
 
-                        /* For logging below */
-                        if (strv_push_pair(&array, k->unit->id, (char*) job_type_to_string(k->type)) < 0)
-                                log_oom();
+                deps = transaction_get_deps(tr, queue[q]->unit);
+                if (!deps)
+                        return -ENOMEM;
+
+                before = transaction_deps_get(deps, UNIT_BEFORE, &n);
+                for (l = 0; l < n; l++) {
+                        Job *o;
 
-                        if (!delete && hashmap_get(tr->jobs, k->unit) && !unit_matters_to_anchor(k->unit, k))
-                                /* Ok, we can drop this one, so let's do so. */
-                                delete = k;
+                        o = transaction_get_job_for_unit(tr, before[l]);
+                        if (!o || !o->order_on_stack)
+                                continue;
 
-                        /* Check if this in fact was the beginning of the cycle */
-                        if (k == j)
+                        if (o == j) {
+                                from = queue[q];
                                 break;
-                }
+                        }
 
-                unit_ids = merge_unit_ids(j->manager->unit_log_field, array); /* ignore error */
-
-                STRV_FOREACH_PAIR(unit_id, job_type, array)
-                        /* logging for j not k here to provide a consistent narrative */
-                        log_struct(LOG_WARNING,
-                                   "MESSAGE=%s: Found %s on %s/%s",
-                                   j->unit->id,
-                                   unit_id == array ? "ordering cycle" : "dependency",
-                                   *unit_id, *job_type,
-                                   unit_ids, NULL);
-
-                if (delete) {
-                        const char *status;
-                        /* logging for j not k here to provide a consistent narrative */
-                        log_struct(LOG_ERR,
-                                   "MESSAGE=%s: Job %s/%s deleted to break ordering cycle starting with %s/%s",
-                                   j->unit->id, delete->unit->id, job_type_to_string(delete->type),
-                                   j->unit->id, job_type_to_string(j->type),
-                                   unit_ids, NULL);
-
-                        if (log_get_show_color())
-                                status = ANSI_HIGHLIGHT_RED " SKIP " ANSI_NORMAL;
-                        else
-                                status = " SKIP ";
+                        if (o->marker)
+                                continue;
 
-                        unit_status_printf(delete->unit, status,
-                                           "Ordering cycle found, skipping %s");
-                        transaction_delete_unit(tr, delete->unit);
-                        return -EAGAIN;
+                        o->marker = queue[q];
+                        queue[n_queue++] = o;
                 }
+        }
 
-                log_struct(LOG_ERR,
-                           "MESSAGE=%s: Unable to break cycle starting with %s/%s",
-                           j->unit->id, j->unit->id, job_type_to_string(j->type),
-                           unit_ids, NULL);
+        for (x = 0; x < n_scc; x++)
+                scc[x]->order_on_stack = false;
 
-                return sd_bus_error_setf(e, BUS_ERROR_TRANSACTION_ORDER_IS_CYCLIC,
-                                         "Transaction order is cyclic. See system logs for details.");
+        assert(from);
+
+        for (k = from;; k = k->marker) {
+
+                /* For logging below */
+                if (strv_push_pair(&array, k->unit->id, (char*) job_type_to_string(k->type)) < 0)
+                        log_oom();
+
+                if (!delete && hashmap_get(tr->jobs, k->unit) && !unit_matters_to_anchor(k->unit, k))
+                        /* Ok, we can drop this one, so let's do so. */
+                        delete = k;
+
+                /* Check if this in fact was the beginning of the cycle */
+                if (k == j)
+                        break;
         }
 
-        /* Make the marker point to where we come from, so that we can
-         * find our way backwards if we want to break a cycle. We use
-         * a special marker for the beginning: we point to
-         * ourselves. */
-        j->marker = from ? from : j;
-        j->generation = generation;
+        unit_ids = merge_unit_ids(j->manager->unit_log_field, array); /* ignore error */
 
-        /* We assume that the dependencies are bidirectional, and
-         * hence can ignore UNIT_AFTER */
-        HASHMAP_FOREACH_KEY(v, u, j->unit->dependencies[UNIT_BEFORE], i) {
-                Job *o;
-
-                /* Is there a job for this unit? */
-                o = hashmap_get(tr->jobs, u);
-                if (!o) {
-                        /* Ok, there is no job for this in the
-                         * transaction, but maybe there is already one
-                         * running? */
-                        o = u->job;
-                        if (!o)
-                                continue;
-                }
+        STRV_FOREACH_PAIR(unit_id, job_type, array)
+                /* logging for j not k here to provide a consistent narrative */
+                log_struct(LOG_WARNING,
+                           "MESSAGE=%s: Found %s on %s/%s",
+                           j->unit->id,
+                           unit_id == array ? "ordering cycle" : "dependency",
+                           *unit_id, *job_type,
+                           unit_ids, NULL);
 
-                r = transaction_verify_order_one(tr, o, j, generation, e);
-                if (r < 0)
-                        return r;
+        if (delete) {
+                const char *status;
+                /* logging for j not k here to provide a consistent narrative */
+                log_struct(LOG_ERR,
+                           "MESSAGE=%s: Job %s/%s deleted to break ordering cycle starting with %s/%s",
+                           j->unit->id, delete->unit->id, job_type_to_string(delete->type),
+                           j->unit->id, job_type_to_string(j->type),
+                           unit_ids, NULL);
+
+                if (log_get_show_color())
+                        status = ANSI_HIGHLIGHT_RED " SKIP " ANSI_NORMAL;
+                else
+                        status = " SKIP ";
+
+                unit_status_printf(delete->unit, status,
+                                   "Ordering cycle found, skipping %s");
+                transaction_delete_unit(tr, delete->unit);
+                return -EAGAIN;
         }
 
-        /* Ok, let's backtrack, and remember that this entry is not on
-         * our path anymore. */
-        j->marker = NULL;
+        log_struct(LOG_ERR,
+                   "MESSAGE=%s: Unable to break cycle starting with %s/%s",
+                   j->unit->id, j->unit->id, job_type_to_string(j->type),
+                   unit_ids, NULL);
 
-        return 0;
+        return sd_bus_error_setf(e, BUS_ERROR_TRANSACTION_ORDER_IS_CYCLIC,
+                                 "Transaction order is cyclic. See system logs for details.");
 }
 
+typedef struct OrderFrame {
+        Job *job;
+        Unit **before;
+        unsigned n_before, next;
+} OrderFrame;
+
 static int transaction_verify_order(Transaction *tr, unsigned *generation, sd_bus_error *e) {
-        Job *j;
-        int r;
+        _cleanup_free_ OrderFrame *frames = NULL;
+        _cleanup_free_ Job **stack = NULL;
+        size_t n_frames = 0, n_frames_allocated = 0, n_stack = 0, n_stack_allocated = 0;
+        unsigned g, index = 0;
         Iterator i;
-        unsigned g;
+        Job *j;
 
         assert(tr);
         assert(generation);
 
-        /* Check if the ordering graph is cyclic. If it is, try to fix
-         * that up by dropping one of the jobs. */
+        /* Check if the ordering graph is cyclic. If it is, try to fix that up by dropping one of the jobs.
+         *
+         * This is Tarjan's algorithm for finding the strongly connected components of the graph, with an explicit
+         * stack instead of recursion. Nodes are the jobs in the transaction plus the installed jobs reachable from
+         * them, edges are the "Before" dependencies of their units. We assume that the dependencies are
+         * bidirectional, and hence can ignore "After". Any component with more than one job contains a cycle. */
 
         g = (*generation)++;
 
         HASHMAP_FOREACH(j, tr->jobs, i) {
-                r = transaction_verify_order_one(tr, j, NULL, g, e);
-                if (r < 0)
-                        return r;
+                Job *v = j;
+
+                if (v->generation == g)
+                        continue;
+
+                for (;;) {
+                        OrderFrame *f;
+
+                        if (v) {
+                                TransactionDeps *deps;
+
+                                /* Enter v */
+                                deps = transaction_get_deps(tr, v->unit);
+                                if (!deps)
+                                        return -ENOMEM;
+
+                                if (!GREEDY_REALLOC(frames, n_frames_allocated, n_frames + 1) ||
+                                    !GREEDY_REALLOC(stack, n_stack_allocated, n_stack + 1))
+                                        return -ENOMEM;
+
+                                v->generation = g;
+                                v->order_index = v->order_lowlink = index++;
+                                v->order_on_stack = true;
+                                stack[n_stack++] = v;
+
+                                f = frames + n_frames++;
+                                f->job = v;
+                                f->before = transaction_deps_get(deps, UNIT_BEFORE, &f->n_before);
+                                f->next = 0;
+
+                                v = NULL;
+                        }
+
+                        if (n_frames == 0)
+                                break;
+
+                        f = frames + n_frames - 1;
+
+                        if (f->next < f->n_before) {
+                                Job *o;
+
+                                o = transaction_get_job_for_unit(tr, f->before[f->next++]);
+                                if (!o)
+                                        continue;
+
+                                if (o->generation != g)
+                                        v = o;
+                                else if (o->order_on_stack)
+                                        f->job->order_lowlink = MIN(f->job->order_lowlink, o->order_index);
+
+                                continue;
+                        }
+
+                        /* Leave f->job, and propagate what it found to where we came from */
+                        n_frames--;
+                        if (n_frames > 0)
+                                frames[n_frames-1].job->order_lowlink = MIN(frames[n_frames-1].job->order_lowlink,
+                                                                            f->job->order_lowlink);
+
+                        if (f->job->order_lowlink == f->job->order_index) {
+                                size_t k = n_stack;
+
+                                /* f->job is the root of a component, which consists of it and everything above it on the
+                                 * stack */
+                                do {
+                                        k--;
+                                        stack[k]->order_on_stack = false;
+                                } while (stack[k] != f->job);
+
+                                if (n_stack - k > 1)
+                                        return transaction_break_order_cycle(tr, f->job, stack + k, n_stack - k, e);
+
+                                n_stack = k;
+                        }
+                }
         }
 
         return 0;
@@ -860,16 +1042,15 @@ static void transaction_unlink_job(Transaction *tr, Job *j, bool delete_dependen
 }
 
 void transaction_add_propagate_reload_jobs(Transaction *tr, Unit *unit, Job *by, bool ignore_order, sd_bus_error *e) {
-        Iterator i;
+        unsigned i;
         JobType nt;
         Unit *dep;
-        void *v;
         int r;
 
         assert(tr);
         assert(unit);
 
-        HASHMAP_FOREACH_KEY(v, dep, unit->dependencies[UNIT_PROPAGATES_RELOAD_TO], i) {
+        UNIT_FOREACH_DEPENDENCY(dep, unit, UNIT_PROPAGATES_RELOAD_TO, i) {
                 nt = job_type_collapse(JOB_TRY_RELOAD, dep);
                 if (nt == JOB_NOP)
                         continue;
@@ -884,28 +1065,30 @@ void transaction_add_propagate_reload_jobs(Transaction *tr, Unit *unit, Job *by,
         }
 }
 
-int transaction_add_job_and_dependencies(
+static int transaction_add_job_and_link(
                 Transaction *tr,
                 JobType type,
                 Unit *unit,
                 Job *by,
                 bool matters,
                 bool conflicts,
-                bool ignore_requirements,
                 bool ignore_order,
-                sd_bus_error *e) {
+                sd_bus_error *e,
+                Job **ret,
+                bool *ret_is_new) {
 
-        bool is_new;
-        Iterator i;
-        Unit *dep;
-        Job *ret;
-        void *v;
+        Job *j;
         int r;
 
         assert(tr);
         assert(type < _JOB_TYPE_MAX);
         assert(type < _JOB_TYPE_MAX_IN_TRANSACTION);
         assert(unit);
+        assert(ret);
+        assert(ret_is_new);
+
+        /* Adds a single job to the transaction, and links it to the job that pulled it in, but doesn't look at its
+         * dependencies yet */
 
         /* Before adding jobs for this unit, let's ensure that its state has been loaded
          * This matters when jobs are spawned as part of coldplugging itself (see e. g. path_coldplug()).
@@ -935,154 +1118,343 @@ int transaction_add_job_and_dependencies(
 
 
         /* First add the job. */
-        ret = transaction_add_one_job(tr, type, unit, &is_new);
-        if (!ret)
+        j = transaction_add_one_job(tr, type, unit, ret_is_new);
+        if (!j)
                 return -ENOMEM;
 
-        ret->ignore_order = ret->ignore_order || ignore_order;
+        j->ignore_order = j->ignore_order || ignore_order;
 
         /* Then, add a link to the job. */
         if (by) {
-                if (!job_dependency_new(by, ret, matters, conflicts))
+                if (!job_dependency_new(by, j, matters, conflicts))
                         return -ENOMEM;
         } else {
                 /* If the job has no parent job, it is the anchor job. */
                 assert(!tr->anchor_job);
-                tr->anchor_job = ret;
+                tr->anchor_job = j;
         }
 
-        if (is_new && !ignore_requirements && type != JOB_NOP) {
-                Set *following;
-
-                /* If we are following some other unit, make sure we
-                 * add all dependencies of everybody following. */
-                if (unit_following_set(ret->unit, &following) > 0) {
-                        SET_FOREACH(dep, following, i) {
-                                r = transaction_add_job_and_dependencies(tr, type, dep, ret, false, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        log_unit_full(dep,
-                                                      r == -ERFKILL ? LOG_INFO : LOG_WARNING,
-                                                      r, "Cannot add dependency job, ignoring: %s",
-                                                      bus_error_message(e, r));
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        *ret = j;
+        return 0;
+}
 
-                        set_free(following);
-                }
+typedef enum PullMode {
+        PULL_REQUIRED,      /* failures are fatal, unless the job type is not applicable */
+        PULL_FOLLOWING,     /* failures are logged and ignored, from here on the same for all below */
+        PULL_WANTED,
+        PULL_CONFLICTED_BY,
+        PULL_RELOAD,
+} PullMode;
+
+typedef struct Pull {
+        Unit *unit;
+        JobType type;
+        PullMode mode;
+        bool collapse:1;    /* whether type still needs to be collapsed for the unit */
+        bool matters:1;
+        bool conflicts:1;
+} Pull;
+
+typedef struct PullFrame {
+        Job *job;
+        size_t begin, next, end; /* The jobs this one pulls in, as indexes into the array of pulls */
+} PullFrame;
+
+typedef struct Puller {
+        PullFrame *frames;
+        size_t n_frames, n_frames_allocated;
+
+        Pull *pulls;
+        size_t n_pulls, n_pulls_allocated;
+} Puller;
+
+static void puller_done(Puller *p) {
+        assert(p);
+
+        p->frames = mfree(p->frames);
+        p->pulls = mfree(p->pulls);
+}
 
-                /* Finally, recursively add in all dependencies. */
-                if (IN_SET(type, JOB_START, JOB_RESTART)) {
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_REQUIRES], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_START, dep, ret, true, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        if (r != -EBADR) /* job type not applicable */
-                                                goto fail;
+static int puller_add(Puller *p, Unit *unit, JobType type, PullMode mode, bool collapse, bool matters, bool conflicts) {
+        Pull *l;
 
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        assert(p);
 
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_BINDS_TO], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_START, dep, ret, true, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        if (r != -EBADR) /* job type not applicable */
-                                                goto fail;
+        if (!GREEDY_REALLOC(p->pulls, p->n_pulls_allocated, p->n_pulls + 1))
+                return -ENOMEM;
 
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        l = p->pulls + p->n_pulls++;
+        *l = (Pull) {
+                .unit = unit,
+                .type = type,
+                .mode = mode,
+                .collapse = collapse,
+                .matters = matters,
+                .conflicts = conflicts,
+        };
 
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_WANTS], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_START, dep, ret, false, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        /* unit masked, job type not applicable and unit not found are not considered as errors. */
-                                        log_unit_full(dep,
-                                                      IN_SET(r, -ERFKILL, -EBADR, -ENOENT) ? LOG_DEBUG : LOG_WARNING,
-                                                      r, "Cannot add dependency job, ignoring: %s",
-                                                      bus_error_message(e, r));
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        return 0;
+}
 
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_REQUISITE], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_VERIFY_ACTIVE, dep, ret, true, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        if (r != -EBADR) /* job type not applicable */
-                                                goto fail;
+static int puller_add_many(Puller *p, TransactionDeps *deps, UnitDependency d, JobType type, PullMode mode, bool collapse, bool matters, bool conflicts) {
+        Unit **units;
+        unsigned n, k;
+        int r;
 
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        units = transaction_deps_get(deps, d, &n);
+        for (k = 0; k < n; k++) {
+                r = puller_add(p, units[k], type, mode, collapse, matters, conflicts);
+                if (r < 0)
+                        return r;
+        }
 
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_CONFLICTS], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_STOP, dep, ret, true, true, false, ignore_order, e);
-                                if (r < 0) {
-                                        if (r != -EBADR) /* job type not applicable */
-                                                goto fail;
+        return 0;
+}
 
-                                        sd_bus_error_free(e);
-                                }
-                        }
+static int puller_push(Puller *p, Transaction *tr, Job *j) {
+        TransactionDeps *deps;
+        Set *following;
+        PullFrame *f;
+        size_t begin;
+        Iterator i;
+        Unit *dep;
+        int r = 0;
 
-                        HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[UNIT_CONFLICTED_BY], i) {
-                                r = transaction_add_job_and_dependencies(tr, JOB_STOP, dep, ret, false, false, false, ignore_order, e);
-                                if (r < 0) {
-                                        log_unit_warning(dep,
-                                                         "Cannot add dependency job, ignoring: %s",
-                                                         bus_error_message(e, r));
-                                        sd_bus_error_free(e);
-                                }
-                        }
+        assert(p);
+        assert(tr);
+        assert(j);
 
-                }
+        /* Makes j the job whose dependencies are processed next, and queues what it pulls in, in the same order
+         * as we used to process them recursively. */
+
+        deps = transaction_get_deps(tr, j->unit);
+        if (!deps)
+                return -ENOMEM;
 
-                if (IN_SET(type, JOB_STOP, JOB_RESTART)) {
-                        static const UnitDependency propagate_deps[] = {
-                                UNIT_REQUIRED_BY,
-                                UNIT_REQUISITE_OF,
-                                UNIT_BOUND_BY,
-                                UNIT_CONSISTS_OF,
-                        };
-
-                        JobType ptype;
-                        unsigned j;
-
-                        /* We propagate STOP as STOP, but RESTART only
-                         * as TRY_RESTART, in order not to start
-                         * dependencies that are not around. */
-                        ptype = type == JOB_RESTART ? JOB_TRY_RESTART : type;
-
-                        for (j = 0; j < ELEMENTSOF(propagate_deps); j++)
-                                HASHMAP_FOREACH_KEY(v, dep, ret->unit->dependencies[propagate_deps[j]], i) {
-                                        JobType nt;
-
-                                        nt = job_type_collapse(ptype, dep);
-                                        if (nt == JOB_NOP)
-                                                continue;
-
-                                        r = transaction_add_job_and_dependencies(tr, nt, dep, ret, true, false, false, ignore_order, e);
-                                        if (r < 0) {
-                                                if (r != -EBADR) /* job type not applicable */
-                                                        goto fail;
-
-                                                sd_bus_error_free(e);
-                                        }
-                                }
+        if (!GREEDY_REALLOC(p->frames, p->n_frames_allocated, p->n_frames + 1))
+                return -ENOMEM;
+
+        begin = p->n_pulls;
+
+        /* If we are following some other unit, make sure we
+         * add all dependencies of everybody following. */
+        if (unit_following_set(j->unit, &following) > 0) {
+                SET_FOREACH(dep, following, i) {
+                        r = puller_add(p, dep, j->type, PULL_FOLLOWING, false, false, false);
+                        if (r < 0)
+                                break;
                 }
 
-                if (type == JOB_RELOAD)
-                        transaction_add_propagate_reload_jobs(tr, ret->unit, ret, ignore_order, e);
+                set_free(following);
+                if (r < 0)
+                        goto fail;
+        }
 
-                /* JOB_VERIFY_STARTED require no dependency handling */
+        if (IN_SET(j->type, JOB_START, JOB_RESTART)) {
+                r = puller_add_many(p, deps, UNIT_REQUIRES, JOB_START, PULL_REQUIRED, false, true, false);
+                if (r < 0)
+                        goto fail;
+
+                r = puller_add_many(p, deps, UNIT_BINDS_TO, JOB_START, PULL_REQUIRED, false, true, false);
+                if (r < 0)
+                        goto fail;
+
+                r = puller_add_many(p, deps, UNIT_WANTS, JOB_START, PULL_WANTED, false, false, false);
+                if (r < 0)
+                        goto fail;
+
+                r = puller_add_many(p, deps, UNIT_REQUISITE, JOB_VERIFY_ACTIVE, PULL_REQUIRED, false, true, false);
+                if (r < 0)
+                        goto fail;
+
+                r = puller_add_many(p, deps, UNIT_CONFLICTS, JOB_STOP, PULL_REQUIRED, false, true, true);
+                if (r < 0)
+                        goto fail;
+
+                r = puller_add_many(p, deps, UNIT_CONFLICTED_BY, JOB_STOP, PULL_CONFLICTED_BY, false, false, false);
+                if (r < 0)
+                        goto fail;
+        }
+
+        if (IN_SET(j->type, JOB_STOP, JOB_RESTART)) {
+                static const UnitDependency propagate_deps[] = {
+                        UNIT_REQUIRED_BY,
+                        UNIT_REQUISITE_OF,
+                        UNIT_BOUND_BY,
+                        UNIT_CONSISTS_OF,
+                };
+
+                JobType ptype;
+                unsigned k;
+
+                /* We propagate STOP as STOP, but RESTART only
+                 * as TRY_RESTART, in order not to start
+                 * dependencies that are not around. */
+                ptype = j->type == JOB_RESTART ? JOB_TRY_RESTART : j->type;
+
+                for (k = 0; k < ELEMENTSOF(propagate_deps); k++) {
+                        r = puller_add_many(p, deps, propagate_deps[k], ptype, PULL_REQUIRED, true, true, false);
+                        if (r < 0)
+                                goto fail;
+                }
+        }
+
+        if (j->type == JOB_RELOAD) {
+                r = puller_add_many(p, deps, UNIT_PROPAGATES_RELOAD_TO, JOB_TRY_RELOAD, PULL_RELOAD, true, false, false);
+                if (r < 0)
+                        goto fail;
         }
 
+        /* JOB_VERIFY_STARTED require no dependency handling */
+
+        f = p->frames + p->n_frames++;
+        f->job = j;
+        f->begin = f->next = begin;
+        f->end = p->n_pulls;
+
         return 0;
 
 fail:
+        p->n_pulls = begin;
         return r;
 }
 
+static void puller_pop(Puller *p) {
+        assert(p);
+        assert(p->n_frames > 0);
+
+        p->n_pulls = p->frames[--p->n_frames].begin;
+}
+
+static int pull_handle_error(const Pull *l, int r, sd_bus_error *e) {
+        assert(l);
+        assert(r < 0);
+
+        /* Decides whether failing to add the job for the pulled in unit makes the pulling job fail too. If not,
+         * logs and returns 0. */
+
+        switch (l->mode) {
+
+        case PULL_REQUIRED:
+                if (r != -EBADR) /* job type not applicable */
+                        return r;
+                break;
+
+        case PULL_FOLLOWING:
+                log_unit_full(l->unit,
+                              r == -ERFKILL ? LOG_INFO : LOG_WARNING,
+                              r, "Cannot add dependency job, ignoring: %s",
+                              bus_error_message(e, r));
+                break;
+
+        case PULL_WANTED:
+                /* unit masked, job type not applicable and unit not found are not considered as errors. */
+                log_unit_full(l->unit,
+                              IN_SET(r, -ERFKILL, -EBADR, -ENOENT) ? LOG_DEBUG : LOG_WARNING,
+                              r, "Cannot add dependency job, ignoring: %s",
+                              bus_error_message(e, r));
+                break;
+
+        case PULL_CONFLICTED_BY:
+                log_unit_warning(l->unit,
+                                 "Cannot add dependency job, ignoring: %s",
+                                 bus_error_message(e, r));
+                break;
+
+        case PULL_RELOAD:
+                log_unit_warning(l->unit,
+                                 "Cannot add dependency reload job, ignoring: %s",
+                                 bus_error_message(e, r));
+                break;
+
+        default:
+                assert_not_reached("Unknown pull mode");
+        }
+
+        sd_bus_error_free(e);
+        return 0;
+}
+
+int transaction_add_job_and_dependencies(
+                Transaction *tr,
+                JobType type,
+                Unit *unit,
+                Job *by,
+                bool matters,
+                bool conflicts,
+                bool ignore_requirements,
+                bool ignore_order,
+                sd_bus_error *e) {
+
+        _cleanup_(puller_done) Puller p = {};
+        bool is_new;
+        Job *j;
+        int r;
+
+        assert(tr);
+        assert(type < _JOB_TYPE_MAX);
+        assert(type < _JOB_TYPE_MAX_IN_TRANSACTION);
+        assert(unit);
+
+        /* Adds the job and everything it pulls in. This walks the dependency graph depth-first, in the same order as
+         * a recursive implementation would, but keeps track of the jobs whose dependencies are not completely
+         * processed yet in an explicit stack, so that deep dependency chains don't exhaust our own stack. */
+
+        r = transaction_add_job_and_link(tr, type, unit, by, matters, conflicts, ignore_order, e, &j, &is_new);
+        if (r < 0)
+                return r;
+
+        if (!is_new || ignore_requirements || type == JOB_NOP)
+                return 0;
+
+        r = puller_push(&p, tr, j);
+        if (r < 0)
+                return r;
+
+        while (p.n_frames > 0) {
+                PullFrame *f = p.frames + p.n_frames - 1;
+                const Pull *l;
+                JobType nt;
+
+                if (f->next >= f->end) {
+                        /* All dependencies of this job are in, return to the one that pulled it in */
+                        puller_pop(&p);
+                        continue;
+                }
+
+                l = p.pulls + f->next++;
+
+                nt = l->type;
+                if (l->collapse) {
+                        nt = job_type_collapse(nt, l->unit);
+                        if (nt == JOB_NOP)
+                                continue;
+                }
+
+                r = transaction_add_job_and_link(tr, nt, l->unit, f->job, l->matters, l->conflicts, ignore_order, e, &j, &is_new);
+                if (r >= 0 && is_new && nt != JOB_NOP)
+                        r = puller_push(&p, tr, j);
+                if (r >= 0)
+                        continue;
+
+                /* Adding the job failed. Depending on how it was pulled in this might make the job that pulled
+                 * it in fail as well, and so on. */
+                for (;;) {
+                        f = p.frames + p.n_frames - 1;
+
+                        r = pull_handle_error(p.pulls + f->next - 1, r, e);
+                        if (r >= 0)
+                                break;
+
+                        puller_pop(&p);
+                        if (p.n_frames == 0)
+                                return r;
+                }
+        }
+
+        return 0;
+}
+
 int transaction_add_isolate_jobs(Transaction *tr, Manager *m) {
         Iterator i;
         Unit *u;
@@ -1128,13 +1500,26 @@ Transaction *transaction_new(bool irreversible) {
         if (!tr->jobs)
                 return mfree(tr);
 
+        tr->deps = hashmap_new(NULL);
+        if (!tr->deps) {
+                hashmap_free(tr->jobs);
+                return mfree(tr);
+        }
+
         tr->irreversible = irreversible;
 
         return tr;
 }
 
 void transaction_free(Transaction *tr) {
+        TransactionDeps *deps;
+
         assert(hashmap_isempty(tr->jobs));
         hashmap_free(tr->jobs);
+
+        while ((deps = hashmap_steal_first(tr->deps)))
+                transaction_deps_free(deps);
+        hashmap_free(tr->deps);
+
         free(tr);
 }
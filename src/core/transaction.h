@@ -31,6 +31,7 @@ struct Transaction {
         /* Jobs to be added */
         Hashmap *jobs;      /* Unit object => Job object list 1:1 */
         Job *anchor_job;      /* the job the user asked for */
+        Hashmap *deps;      /* Unit object => snapshot of the unit's dependencies relevant to us */
         bool irreversible;
 };
 
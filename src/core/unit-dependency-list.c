@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "alloc-util.h"
+#include "unit.h"
+
+static unsigned unit_dependency_list_lower_bound(UnitDependencyList *l, const Unit *u) {
+        UnitDependencyEntry *e;
+        unsigned a = 0, b;
+
+        /* Returns the index of the first entry whose unit is not below u */
+
+        e = unit_dependency_list_entries(l);
+        b = l->n_entries;
+
+        while (a < b) {
+                unsigned m = a + (b - a) / 2;
+
+                if ((uintptr_t) e[m].unit < (uintptr_t) u)
+                        a = m + 1;
+                else
+                        b = m;
+        }
+
+        return a;
+}
+
+UnitDependencyEntry *unit_dependency_list_find(UnitDependencyList *l, const Unit *u) {
+        UnitDependencyEntry *e;
+        unsigned k;
+
+        assert(l);
+
+        k = unit_dependency_list_lower_bound(l, u);
+        if (k >= l->n_entries)
+                return NULL;
+
+        e = unit_dependency_list_entries(l) + k;
+        return e->unit == u ? e : NULL;
+}
+
+int unit_dependency_list_reserve(UnitDependencyList *l, unsigned n_add) {
+        UnitDependencyEntry *e;
+        unsigned n;
+
+        assert(l);
+
+        if (n_add > UINT_MAX - l->n_entries)
+                return -ENOMEM;
+
+        n = l->n_entries + n_add;
+
+        if (l->n_allocated == 0) {
+                if (n <= UNIT_DEPENDENCY_LIST_INLINE)
+                        return 0;
+
+                /* Move from the inline storage to an allocated array */
+                n = MAX(n, 4U);
+                e = new(UnitDependencyEntry, n);
+                if (!e)
+                        return -ENOMEM;
+
+                memcpy(e, l->inline_entries, l->n_entries * sizeof(UnitDependencyEntry));
+                l->entries = e;
+                l->n_allocated = n;
+                return 0;
+        }
+
+        if (n <= l->n_allocated)
+                return 0;
+
+        n = MAX(n, l->n_allocated * 2);
+        e = reallocarray(l->entries, n, sizeof(UnitDependencyEntry));
+        if (!e)
+                return -ENOMEM;
+
+        l->entries = e;
+        l->n_allocated = n;
+        return 0;
+}
+
+int unit_dependency_list_put(UnitDependencyList *l, Unit *u, UnitDependencyInfo info) {
+        UnitDependencyEntry *e;
+        unsigned k;
+        int r;
+
+        assert(l);
+        assert(u);
+
+        /* Adds an entry for u, returns -EEXIST if there's one already */
+
+        k = unit_dependency_list_lower_bound(l, u);
+        if (k < l->n_entries && unit_dependency_list_entries(l)[k].unit == u)
+                return -EEXIST;
+
+        r = unit_dependency_list_reserve(l, 1);
+        if (r < 0)
+                return r;
+
+        e = unit_dependency_list_entries(l);
+        memmove(e + k + 1, e + k, (l->n_entries - k) * sizeof(UnitDependencyEntry));
+        e[k] = (UnitDependencyEntry) {
+                .unit = u,
+                .info = info,
+        };
+        l->n_entries++;
+
+        return 1;
+}
+
+bool unit_dependency_list_remove(UnitDependencyList *l, const Unit *u, UnitDependencyInfo *ret_info) {
+        UnitDependencyEntry *e;
+        unsigned k;
+
+        assert(l);
+
+        k = unit_dependency_list_lower_bound(l, u);
+        e = unit_dependency_list_entries(l);
+        if (k >= l->n_entries || e[k].unit != u)
+                return false;
+
+        if (ret_info)
+                *ret_info = e[k].info;
+
+        memmove(e + k, e + k + 1, (l->n_entries - k - 1) * sizeof(UnitDependencyEntry));
+        l->n_entries--;
+
+        /* Go back to the inline storage once everything fits in there again */
+        if (l->n_allocated > 0 && l->n_entries <= UNIT_DEPENDENCY_LIST_INLINE) {
+                UnitDependencyEntry *a = l->entries;
+
+                memcpy(l->inline_entries, a, l->n_entries * sizeof(UnitDependencyEntry));
+                l->n_allocated = 0;
+                free(a);
+        }
+
+        return true;
+}
+
+bool unit_dependency_list_replace(UnitDependencyList *l, const Unit *old, Unit *u) {
+        UnitDependencyEntry *e, *f, t;
+        unsigned k;
+
+        assert(l);
+        assert(u);
+
+        /* Makes the entry of old refer to u instead, merging the masks into the entry of u if there's one already.
+         * This never allocates, and hence cannot fail. Returns false if there's no entry for old. */
+
+        e = unit_dependency_list_find(l, old);
+        if (!e)
+                return false;
+
+        f = unit_dependency_list_find(l, u);
+        if (f) {
+                f->info.origin_mask |= e->info.origin_mask;
+                f->info.destination_mask |= e->info.destination_mask;
+
+                assert_se(unit_dependency_list_remove(l, old, NULL));
+                return true;
+        }
+
+        t = *e;
+        t.unit = u;
+
+        /* Take the entry out, and put it back in at the position of u, all within the array we have */
+        k = e - unit_dependency_list_entries(l);
+        e = unit_dependency_list_entries(l);
+        memmove(e + k, e + k + 1, (l->n_entries - k - 1) * sizeof(UnitDependencyEntry));
+        l->n_entries--;
+
+        k = unit_dependency_list_lower_bound(l, u);
+        memmove(e + k + 1, e + k, (l->n_entries - k) * sizeof(UnitDependencyEntry));
+        e[k] = t;
+        l->n_entries++;
+
+        return true;
+}
+
+int unit_dependency_list_move(UnitDependencyList *l, UnitDependencyList *other) {
+        UnitDependencyEntry *e;
+        unsigned k;
+        int r;
+
+        assert(l);
+        assert(other);
+
+        /* Moves all entries of other into l. Entries present in both get their masks merged. On success other is
+         * empty afterwards. This allocates at most once, and hence cannot fail after a successful
+         * unit_dependency_list_reserve() for all entries of other. */
+
+        if (l->n_entries == 0) {
+                unit_dependency_list_free(l);
+                *l = *other;
+                *other = (UnitDependencyList) {};
+                return 0;
+        }
+
+        r = unit_dependency_list_reserve(l, other->n_entries);
+        if (r < 0)
+                return r;
+
+        e = unit_dependency_list_entries(other);
+        for (k = 0; k < other->n_entries; k++) {
+                UnitDependencyEntry *f;
+
+                f = unit_dependency_list_find(l, e[k].unit);
+                if (f) {
+                        f->info.origin_mask |= e[k].info.origin_mask;
+                        f->info.destination_mask |= e[k].info.destination_mask;
+                } else
+                        assert_se(unit_dependency_list_put(l, e[k].unit, e[k].info) > 0);
+        }
+
+        unit_dependency_list_free(other);
+        return 0;
+}
+
+void unit_dependency_list_free(UnitDependencyList *l) {
+        assert(l);
+
+        if (l->n_allocated > 0)
+                free(l->entries);
+
+        *l = (UnitDependencyList) {};
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+/* Included from unit.h, after UnitDependencyInfo has been defined */
+
+#include <stdbool.h>
+
+#include "macro.h"
+
+typedef struct UnitDependencyEntry {
+        Unit *unit;
+        UnitDependencyInfo info;
+} UnitDependencyEntry;
+
+/* The number of entries stored in the list itself. Most dependency types of most units have no entry or exactly one,
+ * hence only lists with more entries need an allocation of their own. */
+#define UNIT_DEPENDENCY_LIST_INLINE 1
+
+/* A set of units with a UnitDependencyInfo for each, kept sorted by the address of the unit, so that lookups can use
+ * binary search and iterating means walking through a single array. */
+typedef struct UnitDependencyList {
+        unsigned n_entries;
+        unsigned n_allocated; /* 0 as long as the entries are stored inline */
+        union {
+                UnitDependencyEntry inline_entries[UNIT_DEPENDENCY_LIST_INLINE];
+                UnitDependencyEntry *entries;
+        };
+} UnitDependencyList;
+
+static inline UnitDependencyEntry *unit_dependency_list_entries(UnitDependencyList *l) {
+        return l->n_allocated > 0 ? l->entries : l->inline_entries;
+}
+
+static inline unsigned unit_dependency_list_size(const UnitDependencyList *l) {
+        return l->n_entries;
+}
+
+static inline bool unit_dependency_list_isempty(const UnitDependencyList *l) {
+        return l->n_entries == 0;
+}
+
+static inline Unit *unit_dependency_list_first(UnitDependencyList *l) {
+        return l->n_entries > 0 ? unit_dependency_list_entries(l)[0].unit : NULL;
+}
+
+UnitDependencyEntry *unit_dependency_list_find(UnitDependencyList *l, const Unit *u);
+
+static inline bool unit_dependency_list_contains(UnitDependencyList *l, const Unit *u) {
+        return !!unit_dependency_list_find(l, u);
+}
+
+int unit_dependency_list_reserve(UnitDependencyList *l, unsigned n_add);
+int unit_dependency_list_put(UnitDependencyList *l, Unit *u, UnitDependencyInfo info);
+bool unit_dependency_list_remove(UnitDependencyList *l, const Unit *u, UnitDependencyInfo *ret_info);
+bool unit_dependency_list_replace(UnitDependencyList *l, const Unit *old, Unit *u);
+int unit_dependency_list_move(UnitDependencyList *l, UnitDependencyList *other);
+void unit_dependency_list_free(UnitDependencyList *l);
+
+/* Iterates through all units the unit u has a dependency of type d on. The list must not be modified while doing so,
+ * except by breaking out of the loop afterwards. */
+#define UNIT_FOREACH_DEPENDENCY(other, u, d, i)                         \
+        for ((i) = 0;                                                   \
+             (i) < (u)->dependencies[d].n_entries &&                    \
+                     ((other) = unit_dependency_list_entries(&(u)->dependencies[d])[i].unit, true); \
+             (i)++)
+
+/* Same, but also returns the UnitDependencyInfo of each entry */
+#define UNIT_FOREACH_DEPENDENCY_INFO(other, di, u, d, i)                \
+        for ((i) = 0;                                                   \
+             (i) < (u)->dependencies[d].n_entries &&                    \
+                     ((other) = unit_dependency_list_entries(&(u)->dependencies[d])[i].unit, \
+                      (di) = unit_dependency_list_entries(&(u)->dependencies[d])[i].info, \
+                      true);                                            \
+             (i)++)
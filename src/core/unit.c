@@ -52,6 +52,7 @@
 #include "parse-util.h"
 #include "path-util.h"
 #include "process-util.h"
+#include "serialize-binary.h"
 #include "set.h"
 #include "signal-util.h"
 #include "sparse-endian.h"
@@ -85,6 +86,7 @@ const UnitVTable * const unit_vtable[_UNIT_TYPE_MAX] = {
 static void maybe_warn_about_dependency(Unit *u, const char *other, UnitDependency dependency);
 
 Unit *unit_new(Manager *m, size_t size) {
+        CGroupController c;
         Unit *u;
 
         assert(m);
@@ -105,6 +107,8 @@ Unit *unit_new(Manager *m, size_t size) {
         u->unit_file_preset = -1;
         u->on_failure_job_mode = JOB_REPLACE;
         u->cgroup_inotify_wd = -1;
+        for (c = 0; c < _CGROUP_CONTROLLER_MAX; c++)
+                u->cgroup_fds[c] = -1;
         u->job_timeout = USEC_INFINITY;
         u->job_running_timeout = USEC_INFINITY;
         u->ref_uid = UID_INVALID;
@@ -271,6 +275,11 @@ int unit_add_name(Unit *u, const char *text) {
 
                 LIST_PREPEND(units_by_type, u->manager->units_by_type[t], u);
 
+                /* All unit types start out inactive */
+                LIST_PREPEND(units_by_active_state, u->manager->units_by_active_state[UNIT_INACTIVE], u);
+                u->indexed_active_state = UNIT_INACTIVE;
+                u->manager->units_sorted_dirty = true;
+
                 unit_init(u);
 
                 i = NULL;
@@ -313,6 +322,7 @@ int unit_choose_id(Unit *u, const char *name) {
                 return r;
 
         u->id = s;
+        u->manager->units_sorted_dirty = true;
 
         free(u->instance);
         u->instance = i;
@@ -438,10 +448,19 @@ void unit_add_to_gc_queue(Unit *u) {
         u->in_gc_queue = true;
 }
 
+void unit_bump_generation(Unit *u) {
+        assert(u);
+
+        u->generation = ++u->manager->unit_generation;
+}
+
 void unit_add_to_dbus_queue(Unit *u) {
         assert(u);
         assert(u->type != _UNIT_TYPE_INVALID);
 
+        /* Everything that changes the unit's properties ends up here, whether anybody is subscribed or not */
+        unit_bump_generation(u);
+
         if (u->load_state == UNIT_STUB || u->in_dbus_queue)
                 return;
 
@@ -457,25 +476,26 @@ void unit_add_to_dbus_queue(Unit *u) {
         u->in_dbus_queue = true;
 }
 
-static void bidi_set_free(Unit *u, Hashmap *h) {
-        Unit *other;
-        Iterator i;
-        void *v;
+static void bidi_set_free(Unit *u, UnitDependencyList *l) {
+        UnitDependencyEntry *e;
+        unsigned i;
 
         assert(u);
+        assert(l);
 
-        /* Frees the hashmap and makes sure we are dropped from the inverse pointers */
+        /* Frees the list and makes sure we are dropped from the inverse pointers */
 
-        HASHMAP_FOREACH_KEY(v, other, h, i) {
+        e = unit_dependency_list_entries(l);
+        for (i = 0; i < unit_dependency_list_size(l); i++) {
                 UnitDependency d;
 
                 for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++)
-                        hashmap_remove(other->dependencies[d], u);
+                        (void) unit_dependency_list_remove(&e[i].unit->dependencies[d], u, NULL);
 
-                unit_add_to_gc_queue(other);
+                unit_add_to_gc_queue(e[i].unit);
         }
 
-        hashmap_free(h);
+        unit_dependency_list_free(l);
 }
 
 static void unit_remove_transient(Unit *u) {
@@ -588,6 +608,9 @@ void unit_free(Unit *u) {
 
         unit_free_requires_mounts_for(u);
 
+        if (u->id && !MANAGER_IS_RELOADING(u->manager))
+                manager_add_unit_tombstone(u->manager, u->id);
+
         SET_FOREACH(t, u->names, i)
                 hashmap_remove_value(u->manager->units, t, u);
 
@@ -607,10 +630,13 @@ void unit_free(Unit *u) {
         }
 
         for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++)
-                bidi_set_free(u, u->dependencies[d]);
+                bidi_set_free(u, u->dependencies + d);
 
-        if (u->type != _UNIT_TYPE_INVALID)
+        if (u->type != _UNIT_TYPE_INVALID) {
                 LIST_REMOVE(units_by_type, u->manager->units_by_type[u->type], u);
+                LIST_REMOVE(units_by_active_state, u->manager->units_by_active_state[u->indexed_active_state], u);
+                u->manager->units_sorted_dirty = true;
+        }
 
         if (u->in_load_queue)
                 LIST_REMOVE(load_queue, u->manager->load_queue, u);
@@ -648,6 +674,7 @@ void unit_free(Unit *u) {
         free(u->fragment_path);
         free(u->source_path);
         strv_free(u->dropin_paths);
+        strv_free(u->dependency_dropin_paths);
         free(u->instance);
 
         free(u->job_timeout_reboot_arg);
@@ -716,23 +743,6 @@ static int set_complete_move(Set **s, Set **other) {
         return 0;
 }
 
-static int hashmap_complete_move(Hashmap **s, Hashmap **other) {
-        assert(s);
-        assert(other);
-
-        if (!*other)
-                return 0;
-
-        if (*s)
-                return hashmap_move(*s, *other);
-        else {
-                *s = *other;
-                *other = NULL;
-        }
-
-        return 0;
-}
-
 static int merge_names(Unit *u, Unit *other) {
         char *t;
         Iterator i;
@@ -763,24 +773,22 @@ static int reserve_dependencies(Unit *u, Unit *other, UnitDependency d) {
         assert(d < _UNIT_DEPENDENCY_MAX);
 
         /*
-         * If u does not have this dependency set allocated, there is no need
-         * to reserve anything. In that case other's set will be transferred
-         * as a whole to u by complete_move().
+         * If u does not have any dependency of this type, there is no need
+         * to reserve anything. In that case other's list will be transferred
+         * as a whole to u by unit_dependency_list_move().
          */
-        if (!u->dependencies[d])
+        if (unit_dependency_list_isempty(&u->dependencies[d]))
                 return 0;
 
         /* merge_dependencies() will skip a u-on-u dependency */
-        n_reserve = hashmap_size(other->dependencies[d]) - !!hashmap_get(other->dependencies[d], u);
+        n_reserve = unit_dependency_list_size(&other->dependencies[d]) - unit_dependency_list_contains(&other->dependencies[d], u);
 
-        return hashmap_reserve(u->dependencies[d], n_reserve);
+        return unit_dependency_list_reserve(&u->dependencies[d], n_reserve);
 }
 
 static void merge_dependencies(Unit *u, Unit *other, const char *other_id, UnitDependency d) {
-        Iterator i;
+        unsigned i;
         Unit *back;
-        void *v;
-        int r;
 
         /* Merges all dependencies of type 'd' of the unit 'other' into the deps of the unit 'u' */
 
@@ -789,7 +797,7 @@ static void merge_dependencies(Unit *u, Unit *other, const char *other_id, UnitD
         assert(d < _UNIT_DEPENDENCY_MAX);
 
         /* Fix backwards pointers. Let's iterate through all dependendent units of the other unit. */
-        HASHMAP_FOREACH_KEY(v, back, other->dependencies[d], i) {
+        UNIT_FOREACH_DEPENDENCY(back, other, d, i) {
                 UnitDependency k;
 
                 /* Let's now iterate through the dependencies of that dependencies of the other units, looking for
@@ -798,46 +806,24 @@ static void merge_dependencies(Unit *u, Unit *other, const char *other_id, UnitD
                 for (k = 0; k < _UNIT_DEPENDENCY_MAX; k++) {
                         if (back == u) {
                                 /* Do not add dependencies between u and itself. */
-                                if (hashmap_remove(back->dependencies[k], other))
+                                if (unit_dependency_list_remove(&back->dependencies[k], other, NULL))
                                         maybe_warn_about_dependency(u, other_id, k);
-                        } else {
-                                UnitDependencyInfo di_u, di_other, di_merged;
-
+                        } else
                                 /* Let's drop this dependency between "back" and "other", and let's create it between
                                  * "back" and "u" instead. Let's merge the bit masks of the dependency we are moving,
-                                 * and any such dependency which might already exist */
-
-                                di_other.data = hashmap_get(back->dependencies[k], other);
-                                if (!di_other.data)
-                                        continue; /* dependency isn't set, let's try the next one */
-
-                                di_u.data = hashmap_get(back->dependencies[k], u);
-
-                                di_merged = (UnitDependencyInfo) {
-                                        .origin_mask = di_u.origin_mask | di_other.origin_mask,
-                                        .destination_mask = di_u.destination_mask | di_other.destination_mask,
-                                };
-
-                                r = hashmap_remove_and_replace(back->dependencies[k], other, u, di_merged.data);
-                                if (r < 0)
-                                        log_warning_errno(r, "Failed to remove/replace: back=%s other=%s u=%s: %m", back->id, other_id, u->id);
-                                assert(r >= 0);
-
-                                /* assert_se(hashmap_remove_and_replace(back->dependencies[k], other, u, di_merged.data) >= 0); */
-                        }
+                                 * and any such dependency which might already exist. This is done in place and hence
+                                 * cannot fail. */
+                                (void) unit_dependency_list_replace(&back->dependencies[k], other, u);
                 }
 
         }
 
         /* Also do not move dependencies on u to itself */
-        back = hashmap_remove(other->dependencies[d], u);
-        if (back)
+        if (unit_dependency_list_remove(&other->dependencies[d], u, NULL))
                 maybe_warn_about_dependency(u, other_id, d);
 
         /* The move cannot fail. The caller must have performed a reservation. */
-        assert_se(hashmap_complete_move(&u->dependencies[d], &other->dependencies[d]) == 0);
-
-        other->dependencies[d] = hashmap_free(other->dependencies[d]);
+        assert_se(unit_dependency_list_move(&u->dependencies[d], &other->dependencies[d]) == 0);
 }
 
 int unit_merge(Unit *u, Unit *other) {
@@ -1234,8 +1220,9 @@ void unit_dump(Unit *u, FILE *f, const char *prefix) {
         for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++) {
                 UnitDependencyInfo di;
                 Unit *other;
+                unsigned j;
 
-                HASHMAP_FOREACH_KEY(di.data, other, u->dependencies[d], i) {
+                UNIT_FOREACH_DEPENDENCY_INFO(other, di, u, d, j) {
                         bool space = false;
 
                         fprintf(f, "%s\t%s: %s (", prefix, unit_dependency_to_string(d), other->id);
@@ -1361,7 +1348,7 @@ int unit_add_default_target_dependency(Unit *u, Unit *target) {
                 return 0;
 
         /* Don't create loops */
-        if (hashmap_get(target->dependencies[UNIT_BEFORE], u))
+        if (unit_dependency_list_contains(&target->dependencies[UNIT_BEFORE], u))
                 return 0;
 
         return unit_add_dependency(target, UNIT_AFTER, u, true, UNIT_DEPENDENCY_DEFAULT);
@@ -1383,10 +1370,9 @@ static int unit_add_target_dependencies(Unit *u) {
 
         for (k = 0; k < ELEMENTSOF(deps); k++) {
                 Unit *target;
-                Iterator i;
-                void *v;
+                unsigned i;
 
-                HASHMAP_FOREACH_KEY(v, target, u->dependencies[deps[k]], i) {
+                UNIT_FOREACH_DEPENDENCY(target, u, deps[k], i) {
                         r = unit_add_default_target_dependency(u, target);
                         if (r < 0)
                                 return r;
@@ -1541,7 +1527,7 @@ int unit_load(Unit *u) {
                 if (r < 0)
                         goto fail;
 
-                if (u->on_failure_job_mode == JOB_ISOLATE && hashmap_size(u->dependencies[UNIT_ON_FAILURE]) > 1) {
+                if (u->on_failure_job_mode == JOB_ISOLATE && unit_dependency_list_size(&u->dependencies[UNIT_ON_FAILURE]) > 1) {
                         log_unit_error(u, "More than one OnFailure= dependencies specified but OnFailureJobMode=isolate set. Refusing.");
                         r = -EINVAL;
                         goto fail;
@@ -1755,8 +1741,7 @@ bool unit_shall_confirm_spawn(Unit *u) {
 
 static bool unit_verify_deps(Unit *u) {
         Unit *other;
-        Iterator j;
-        void *v;
+        unsigned j;
 
         assert(u);
 
@@ -1765,9 +1750,9 @@ static bool unit_verify_deps(Unit *u) {
          * processing, but do not have any effect afterwards. We don't check BindsTo= dependencies that are not used in
          * conjunction with After= as for them any such check would make things entirely racy. */
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BINDS_TO], j) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BINDS_TO, j) {
 
-                if (!hashmap_contains(u->dependencies[UNIT_AFTER], other))
+                if (!unit_dependency_list_contains(&u->dependencies[UNIT_AFTER], other))
                         continue;
 
                 if (!UNIT_IS_ACTIVE_OR_RELOADING(unit_active_state(other))) {
@@ -1970,7 +1955,7 @@ bool unit_can_reload(Unit *u) {
         if (UNIT_VTABLE(u)->can_reload)
                 return UNIT_VTABLE(u)->can_reload(u);
 
-        if (!hashmap_isempty(u->dependencies[UNIT_PROPAGATES_RELOAD_TO]))
+        if (!unit_dependency_list_isempty(&u->dependencies[UNIT_PROPAGATES_RELOAD_TO]))
                 return true;
 
         return UNIT_VTABLE(u)->reload;
@@ -2003,10 +1988,9 @@ static void unit_check_unneeded(Unit *u) {
 
         for (j = 0; j < ELEMENTSOF(needed_dependencies); j++) {
                 Unit *other;
-                Iterator i;
-                void *v;
+                unsigned i;
 
-                HASHMAP_FOREACH_KEY(v, other, u->dependencies[needed_dependencies[j]], i)
+                UNIT_FOREACH_DEPENDENCY(other, u, needed_dependencies[j], i)
                         if (unit_active_or_pending(other) || unit_will_restart(other))
                                 return;
         }
@@ -2031,8 +2015,7 @@ static void unit_check_binds_to(Unit *u) {
         _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
         bool stop = false;
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
         int r;
 
         assert(u);
@@ -2043,7 +2026,7 @@ static void unit_check_binds_to(Unit *u) {
         if (unit_active_state(u) != UNIT_ACTIVE)
                 return;
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BINDS_TO], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BINDS_TO, i) {
                 if (other->job)
                         continue;
 
@@ -2079,87 +2062,83 @@ static void unit_check_binds_to(Unit *u) {
 }
 
 static void retroactively_start_dependencies(Unit *u) {
-        Iterator i;
+        unsigned i;
         Unit *other;
-        void *v;
 
         assert(u);
         assert(UNIT_IS_ACTIVE_OR_ACTIVATING(unit_active_state(u)));
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REQUIRES], i)
-                if (!hashmap_get(u->dependencies[UNIT_AFTER], other) &&
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REQUIRES, i)
+                if (!unit_dependency_list_contains(&u->dependencies[UNIT_AFTER], other) &&
                     !UNIT_IS_ACTIVE_OR_ACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_START, other, JOB_REPLACE, NULL, NULL);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BINDS_TO], i)
-                if (!hashmap_get(u->dependencies[UNIT_AFTER], other) &&
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BINDS_TO, i)
+                if (!unit_dependency_list_contains(&u->dependencies[UNIT_AFTER], other) &&
                     !UNIT_IS_ACTIVE_OR_ACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_START, other, JOB_REPLACE, NULL, NULL);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_WANTS], i)
-                if (!hashmap_get(u->dependencies[UNIT_AFTER], other) &&
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_WANTS, i)
+                if (!unit_dependency_list_contains(&u->dependencies[UNIT_AFTER], other) &&
                     !UNIT_IS_ACTIVE_OR_ACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_START, other, JOB_FAIL, NULL, NULL);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_CONFLICTS], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_CONFLICTS, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_STOP, other, JOB_REPLACE, NULL, NULL);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_CONFLICTED_BY], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_CONFLICTED_BY, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_STOP, other, JOB_REPLACE, NULL, NULL);
 }
 
 static void retroactively_stop_dependencies(Unit *u) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
         assert(UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(u)));
 
         /* Pull down units which are bound to us recursively if enabled */
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BOUND_BY], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BOUND_BY, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         manager_add_job(u->manager, JOB_STOP, other, JOB_REPLACE, NULL, NULL);
 }
 
 static void check_unneeded_dependencies(Unit *u) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
         assert(UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(u)));
 
         /* Garbage collect services that might not be needed anymore, if enabled */
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REQUIRES], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REQUIRES, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         unit_check_unneeded(other);
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_WANTS], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_WANTS, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         unit_check_unneeded(other);
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_REQUISITE], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_REQUISITE, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         unit_check_unneeded(other);
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_BINDS_TO], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_BINDS_TO, i)
                 if (!UNIT_IS_INACTIVE_OR_DEACTIVATING(unit_active_state(other)))
                         unit_check_unneeded(other);
 }
 
 void unit_start_on_failure(Unit *u) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
 
-        if (hashmap_size(u->dependencies[UNIT_ON_FAILURE]) <= 0)
+        if (unit_dependency_list_isempty(&u->dependencies[UNIT_ON_FAILURE]))
                 return;
 
         log_unit_info(u, "Triggering OnFailure= dependencies.");
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_ON_FAILURE], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_ON_FAILURE, i) {
                 int r;
 
                 r = manager_add_job(u->manager, JOB_START, other, u->on_failure_job_mode, NULL, NULL);
@@ -2170,12 +2149,11 @@ void unit_start_on_failure(Unit *u) {
 
 void unit_trigger_notify(Unit *u) {
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         assert(u);
 
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_TRIGGERED_BY], i)
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_TRIGGERED_BY, i)
                 if (UNIT_VTABLE(other)->trigger_notify)
                         UNIT_VTABLE(other)->trigger_notify(other, u);
 }
@@ -2200,7 +2178,10 @@ static int unit_log_resources(Unit *u) {
 
         /* Invoked whenever a unit enters failed or dead state. Logs information about consumed resources if resource
          * accounting was enabled for a unit. It does this in two ways: a friendly human readable string with reduced
-         * information and the complete data in structured fields. */
+         * information and the complete data in structured fields. Make sure to log the final values, and not what a
+         * client might have queried a moment ago. */
+
+        unit_invalidate_accounting_snapshot(u);
 
         (void) unit_get_cpu_usage(u, &nsec);
         if (nsec != NSEC_INFINITY) {
@@ -2325,6 +2306,34 @@ static void unit_update_on_console(Unit *u) {
 
 }
 
+int unit_compare_id(const void *a, const void *b) {
+        Unit * const *x = a, * const *y = b;
+
+        /* For sorting arrays of units by their ids with qsort() */
+
+        return strcmp((*x)->id, (*y)->id);
+}
+
+static void unit_update_active_state_index(Unit *u) {
+        UnitActiveState state;
+
+        assert(u);
+
+        /* Moves the unit to the list of its current active state. This is called whenever the state might have
+         * changed, hence it is derived from the unit itself rather than from what the caller thinks it is. */
+
+        if (u->type == _UNIT_TYPE_INVALID)
+                return;
+
+        state = unit_active_state(u);
+        if (u->indexed_active_state == state)
+                return;
+
+        LIST_REMOVE(units_by_active_state, u->manager->units_by_active_state[u->indexed_active_state], u);
+        LIST_PREPEND(units_by_active_state, u->manager->units_by_active_state[state], u);
+        u->indexed_active_state = state;
+}
+
 void unit_notify(Unit *u, UnitActiveState os, UnitActiveState ns, bool reload_success) {
         Manager *m;
         bool unexpected;
@@ -2341,6 +2350,11 @@ void unit_notify(Unit *u, UnitActiveState os, UnitActiveState ns, bool reload_su
 
         m = u->manager;
 
+        unit_update_active_state_index(u);
+
+        /* The processes of the unit likely changed, don't report the counters from before the state change */
+        unit_invalidate_accounting_snapshot(u);
+
         /* Update timestamps for state changes */
         if (!MANAGER_IS_RELOADING(m)) {
                 dual_timestamp_get(&u->state_change_timestamp);
@@ -2598,6 +2612,7 @@ int unit_watch_pid(Unit *u, pid_t pid) {
         if (r < 0)
                 return r;
 
+        unit_invalidate_accounting_snapshot(u);
         return 0;
 }
 
@@ -2607,6 +2622,8 @@ void unit_unwatch_pid(Unit *u, pid_t pid) {
         assert(u);
         assert(pid_is_valid(pid));
 
+        unit_invalidate_accounting_snapshot(u);
+
         /* First let's drop the unit in case it's keyed as "pid". */
         (void) hashmap_remove_value(u->manager->watch_pids, PID_TO_PTR(pid), u);
 
@@ -2707,49 +2724,39 @@ static void maybe_warn_about_dependency(Unit *u, const char *other, UnitDependen
                 log_unit_warning(u, "Dependency %s=%s dropped, merged into %s", unit_dependency_to_string(dependency), strna(other), u->id);
 }
 
-static int unit_add_dependency_hashmap(
-                Hashmap **h,
+static int unit_add_dependency_list(
+                UnitDependencyList *l,
                 Unit *other,
                 UnitDependencyMask origin_mask,
                 UnitDependencyMask destination_mask) {
 
-        UnitDependencyInfo info;
+        UnitDependencyEntry *e;
         int r;
 
-        assert(h);
+        assert(l);
         assert(other);
         assert(origin_mask < _UNIT_DEPENDENCY_MASK_FULL);
         assert(destination_mask < _UNIT_DEPENDENCY_MASK_FULL);
         assert(origin_mask > 0 || destination_mask > 0);
 
-        r = hashmap_ensure_allocated(h, NULL);
-        if (r < 0)
-                return r;
-
-        assert_cc(sizeof(void*) == sizeof(info));
-
-        info.data = hashmap_get(*h, other);
-        if (info.data) {
+        e = unit_dependency_list_find(l, other);
+        if (e) {
                 /* Entry already exists. Add in our mask. */
 
-                if ((info.origin_mask & origin_mask) == info.origin_mask &&
-                    (info.destination_mask & destination_mask) == info.destination_mask)
+                if ((e->info.origin_mask & origin_mask) == e->info.origin_mask &&
+                    (e->info.destination_mask & destination_mask) == e->info.destination_mask)
                         return 0; /* NOP */
 
-                info.origin_mask |= origin_mask;
-                info.destination_mask |= destination_mask;
-
-                r = hashmap_update(*h, other, info.data);
+                e->info.origin_mask |= origin_mask;
+                e->info.destination_mask |= destination_mask;
         } else {
-                info = (UnitDependencyInfo) {
-                        .origin_mask = origin_mask,
-                        .destination_mask = destination_mask,
-                };
-
-                r = hashmap_put(*h, other, info.data);
+                r = unit_dependency_list_put(l, other, (UnitDependencyInfo) {
+                                .origin_mask = origin_mask,
+                                .destination_mask = destination_mask,
+                        });
+                if (r < 0)
+                        return r;
         }
-        if (r < 0)
-                return r;
 
         return 1;
 }
@@ -2808,22 +2815,22 @@ int unit_add_dependency(
                 return 0;
         }
 
-        r = unit_add_dependency_hashmap(u->dependencies + d, other, mask, 0);
+        r = unit_add_dependency_list(u->dependencies + d, other, mask, 0);
         if (r < 0)
                 return r;
 
         if (inverse_table[d] != _UNIT_DEPENDENCY_INVALID && inverse_table[d] != d) {
-                r = unit_add_dependency_hashmap(other->dependencies + inverse_table[d], u, 0, mask);
+                r = unit_add_dependency_list(other->dependencies + inverse_table[d], u, 0, mask);
                 if (r < 0)
                         return r;
         }
 
         if (add_reference) {
-                r = unit_add_dependency_hashmap(u->dependencies + UNIT_REFERENCES, other, mask, 0);
+                r = unit_add_dependency_list(u->dependencies + UNIT_REFERENCES, other, mask, 0);
                 if (r < 0)
                         return r;
 
-                r = unit_add_dependency_hashmap(other->dependencies + UNIT_REFERENCED_BY, u, 0, mask);
+                r = unit_add_dependency_list(other->dependencies + UNIT_REFERENCED_BY, u, 0, mask);
                 if (r < 0)
                         return r;
         }
@@ -3233,6 +3240,7 @@ int unit_serialize(Unit *u, FILE *f, FDSet *fds, bool serialize_jobs) {
 
         bus_track_serialize(u->bus_track, f, "ref");
 
+        unit_invalidate_accounting_snapshot(u);
         for (m = 0; m < _CGROUP_IP_ACCOUNTING_METRIC_MAX; m++) {
                 uint64_t v;
 
@@ -3332,308 +3340,401 @@ void unit_serialize_item_format(Unit *u, FILE *f, const char *key, const char *f
         fputc('\n', f);
 }
 
-int unit_deserialize(Unit *u, FILE *f, FDSet *fds) {
-        ExecRuntime **rt = NULL;
-        size_t offset;
+static void unit_deserialize_item(Unit *u, ExecRuntime **rt, const char *l, const char *v, FDSet *fds) {
+        CGroupIPAccountingMetric m;
         int r;
 
         assert(u);
-        assert(f);
-        assert(fds);
+        assert(l);
+        assert(v);
 
-        offset = UNIT_VTABLE(u)->exec_runtime_offset;
-        if (offset > 0)
-                rt = (ExecRuntime**) ((uint8_t*) u + offset);
+        if (streq(l, "state-change-timestamp")) {
+                dual_timestamp_deserialize(v, &u->state_change_timestamp);
+                return;
+        } else if (streq(l, "inactive-exit-timestamp")) {
+                dual_timestamp_deserialize(v, &u->inactive_exit_timestamp);
+                return;
+        } else if (streq(l, "active-enter-timestamp")) {
+                dual_timestamp_deserialize(v, &u->active_enter_timestamp);
+                return;
+        } else if (streq(l, "active-exit-timestamp")) {
+                dual_timestamp_deserialize(v, &u->active_exit_timestamp);
+                return;
+        } else if (streq(l, "inactive-enter-timestamp")) {
+                dual_timestamp_deserialize(v, &u->inactive_enter_timestamp);
+                return;
+        } else if (streq(l, "condition-timestamp")) {
+                dual_timestamp_deserialize(v, &u->condition_timestamp);
+                return;
+        } else if (streq(l, "assert-timestamp")) {
+                dual_timestamp_deserialize(v, &u->assert_timestamp);
+                return;
+        } else if (streq(l, "condition-result")) {
 
-        for (;;) {
-                char line[LINE_MAX], *l, *v;
-                CGroupIPAccountingMetric m;
-                size_t k;
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse condition result value %s, ignoring.", v);
+                else
+                        u->condition_result = r;
 
-                if (!fgets(line, sizeof(line), f)) {
-                        if (feof(f))
-                                return 0;
-                        return -errno;
-                }
+                return;
 
-                char_array_0(line);
-                l = strstrip(line);
+        } else if (streq(l, "assert-result")) {
 
-                /* End marker */
-                if (isempty(l))
-                        break;
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse assert result value %s, ignoring.", v);
+                else
+                        u->assert_result = r;
 
-                k = strcspn(l, "=");
+                return;
 
-                if (l[k] == '=') {
-                        l[k] = 0;
-                        v = l+k+1;
-                } else
-                        v = l+k;
+        } else if (streq(l, "transient")) {
 
-                if (streq(l, "job")) {
-                        if (v[0] == '\0') {
-                                /* new-style serialized job */
-                                Job *j;
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse transient bool %s, ignoring.", v);
+                else
+                        u->transient = r;
 
-                                j = job_new_raw(u);
-                                if (!j)
-                                        return log_oom();
+                return;
 
-                                r = job_deserialize(j, f);
-                                if (r < 0) {
-                                        job_free(j);
-                                        return r;
-                                }
+        } else if (streq(l, "exported-invocation-id")) {
 
-                                r = hashmap_put(u->manager->jobs, UINT32_TO_PTR(j->id), j);
-                                if (r < 0) {
-                                        job_free(j);
-                                        return r;
-                                }
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse exported invocation ID bool %s, ignoring.", v);
+                else
+                        u->exported_invocation_id = r;
 
-                                r = job_install_deserialized(j);
-                                if (r < 0) {
-                                        hashmap_remove(u->manager->jobs, UINT32_TO_PTR(j->id));
-                                        job_free(j);
-                                        return r;
-                                }
-                        } else  /* legacy for pre-44 */
-                                log_unit_warning(u, "Update from too old systemd versions are unsupported, cannot deserialize job: %s", v);
-                        continue;
-                } else if (streq(l, "state-change-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->state_change_timestamp);
-                        continue;
-                } else if (streq(l, "inactive-exit-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->inactive_exit_timestamp);
-                        continue;
-                } else if (streq(l, "active-enter-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->active_enter_timestamp);
-                        continue;
-                } else if (streq(l, "active-exit-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->active_exit_timestamp);
-                        continue;
-                } else if (streq(l, "inactive-enter-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->inactive_enter_timestamp);
-                        continue;
-                } else if (streq(l, "condition-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->condition_timestamp);
-                        continue;
-                } else if (streq(l, "assert-timestamp")) {
-                        dual_timestamp_deserialize(v, &u->assert_timestamp);
-                        continue;
-                } else if (streq(l, "condition-result")) {
+                return;
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse condition result value %s, ignoring.", v);
-                        else
-                                u->condition_result = r;
+        } else if (streq(l, "exported-log-level-max")) {
 
-                        continue;
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse exported log level max bool %s, ignoring.", v);
+                else
+                        u->exported_log_level_max = r;
 
-                } else if (streq(l, "assert-result")) {
+                return;
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse assert result value %s, ignoring.", v);
-                        else
-                                u->assert_result = r;
+        } else if (streq(l, "exported-log-extra-fields")) {
 
-                        continue;
+                r = parse_boolean(v);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse exported log extra fields bool %s, ignoring.", v);
+                else
+                        u->exported_log_extra_fields = r;
 
-                } else if (streq(l, "transient")) {
+                return;
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse transient bool %s, ignoring.", v);
-                        else
-                                u->transient = r;
+        } else if (STR_IN_SET(l, "cpu-usage-base", "cpuacct-usage-base")) {
 
-                        continue;
+                r = safe_atou64(v, &u->cpu_usage_base);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse CPU usage base %s, ignoring.", v);
 
-                } else if (streq(l, "exported-invocation-id")) {
+                return;
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse exported invocation ID bool %s, ignoring.", v);
-                        else
-                                u->exported_invocation_id = r;
+        } else if (streq(l, "cpu-usage-last")) {
 
-                        continue;
+                r = safe_atou64(v, &u->cpu_usage_last);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to read CPU usage last %s, ignoring.", v);
 
-                } else if (streq(l, "exported-log-level-max")) {
+                return;
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse exported log level max bool %s, ignoring.", v);
-                        else
-                                u->exported_log_level_max = r;
+        } else if (streq(l, "cgroup")) {
 
-                        continue;
+                r = unit_set_cgroup_path(u, v);
+                if (r < 0)
+                        log_unit_debug_errno(u, r, "Failed to set cgroup path %s, ignoring: %m", v);
 
-                } else if (streq(l, "exported-log-extra-fields")) {
+                (void) unit_watch_cgroup(u);
 
-                        r = parse_boolean(v);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse exported log extra fields bool %s, ignoring.", v);
-                        else
-                                u->exported_log_extra_fields = r;
+                return;
+        } else if (streq(l, "cgroup-realized")) {
+                int b;
 
-                        continue;
+                b = parse_boolean(v);
+                if (b < 0)
+                        log_unit_debug(u, "Failed to parse cgroup-realized bool %s, ignoring.", v);
+                else
+                        u->cgroup_realized = b;
 
-                } else if (STR_IN_SET(l, "cpu-usage-base", "cpuacct-usage-base")) {
+                return;
 
-                        r = safe_atou64(v, &u->cpu_usage_base);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse CPU usage base %s, ignoring.", v);
+        } else if (streq(l, "cgroup-realized-mask")) {
 
-                        continue;
+                r = cg_mask_from_string(v, &u->cgroup_realized_mask);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse cgroup-realized-mask %s, ignoring.", v);
+                return;
 
-                } else if (streq(l, "cpu-usage-last")) {
+        } else if (streq(l, "cgroup-enabled-mask")) {
 
-                        r = safe_atou64(v, &u->cpu_usage_last);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to read CPU usage last %s, ignoring.", v);
+                r = cg_mask_from_string(v, &u->cgroup_enabled_mask);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse cgroup-enabled-mask %s, ignoring.", v);
+                return;
 
-                        continue;
+        } else if (streq(l, "cgroup-bpf-realized")) {
+                int i;
 
-                } else if (streq(l, "cgroup")) {
+                r = safe_atoi(v, &i);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse cgroup BPF state %s, ignoring.", v);
+                else
+                        u->cgroup_bpf_state =
+                                i < 0 ? UNIT_CGROUP_BPF_INVALIDATED :
+                                i > 0 ? UNIT_CGROUP_BPF_ON :
+                                UNIT_CGROUP_BPF_OFF;
 
-                        r = unit_set_cgroup_path(u, v);
-                        if (r < 0)
-                                log_unit_debug_errno(u, r, "Failed to set cgroup path %s, ignoring: %m", v);
+                return;
 
-                        (void) unit_watch_cgroup(u);
+        } else if (streq(l, "ref-uid")) {
+                uid_t uid;
 
-                        continue;
-                } else if (streq(l, "cgroup-realized")) {
-                        int b;
+                r = parse_uid(v, &uid);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse referenced UID %s, ignoring.", v);
+                else
+                        unit_ref_uid_gid(u, uid, GID_INVALID);
 
-                        b = parse_boolean(v);
-                        if (b < 0)
-                                log_unit_debug(u, "Failed to parse cgroup-realized bool %s, ignoring.", v);
-                        else
-                                u->cgroup_realized = b;
+                return;
 
-                        continue;
+        } else if (streq(l, "ref-gid")) {
+                gid_t gid;
 
-                } else if (streq(l, "cgroup-realized-mask")) {
+                r = parse_gid(v, &gid);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse referenced GID %s, ignoring.", v);
+                else
+                        unit_ref_uid_gid(u, UID_INVALID, gid);
 
-                        r = cg_mask_from_string(v, &u->cgroup_realized_mask);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse cgroup-realized-mask %s, ignoring.", v);
-                        continue;
+        } else if (streq(l, "ref")) {
 
-                } else if (streq(l, "cgroup-enabled-mask")) {
+                r = strv_extend(&u->deserialized_refs, v);
+                if (r < 0)
+                        log_oom();
+
+                return;
+        } else if (streq(l, "invocation-id")) {
+                sd_id128_t id;
 
-                        r = cg_mask_from_string(v, &u->cgroup_enabled_mask);
+                r = sd_id128_from_string(v, &id);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse invocation id %s, ignoring.", v);
+                else {
+                        r = unit_set_invocation_id(u, id);
                         if (r < 0)
-                                log_unit_debug(u, "Failed to parse cgroup-enabled-mask %s, ignoring.", v);
-                        continue;
+                                log_unit_warning_errno(u, r, "Failed to set invocation ID for unit: %m");
+                }
 
-                } else if (streq(l, "cgroup-bpf-realized")) {
-                        int i;
+                return;
+        }
 
-                        r = safe_atoi(v, &i);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse cgroup BPF state %s, ignoring.", v);
-                        else
-                                u->cgroup_bpf_state =
-                                        i < 0 ? UNIT_CGROUP_BPF_INVALIDATED :
-                                        i > 0 ? UNIT_CGROUP_BPF_ON :
-                                        UNIT_CGROUP_BPF_OFF;
+        /* Check if this is an IP accounting metric serialization field */
+        for (m = 0; m < _CGROUP_IP_ACCOUNTING_METRIC_MAX; m++)
+                if (streq(l, ip_accounting_metric_field[m]))
+                        break;
+        if (m < _CGROUP_IP_ACCOUNTING_METRIC_MAX) {
+                uint64_t c;
 
-                        continue;
+                r = safe_atou64(v, &c);
+                if (r < 0)
+                        log_unit_debug(u, "Failed to parse IP accounting value %s, ignoring.", v);
+                else
+                        u->ip_accounting_extra[m] = c;
+                return;
+        }
 
-                } else if (streq(l, "ref-uid")) {
-                        uid_t uid;
+        if (unit_can_serialize(u)) {
+                if (rt) {
+                        r = exec_runtime_deserialize_item(u, rt, l, v, fds);
+                        if (r < 0) {
+                                log_unit_warning(u, "Failed to deserialize runtime parameter '%s', ignoring.", l);
+                                return;
+                        }
 
-                        r = parse_uid(v, &uid);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse referenced UID %s, ignoring.", v);
-                        else
-                                unit_ref_uid_gid(u, uid, GID_INVALID);
+                        /* Returns positive if key was handled by the call */
+                        if (r > 0)
+                                return;
+                }
 
-                        continue;
+                r = UNIT_VTABLE(u)->deserialize_item(u, l, v, fds);
+                if (r < 0)
+                        log_unit_warning(u, "Failed to deserialize unit parameter '%s', ignoring.", l);
+        }
+}
 
-                } else if (streq(l, "ref-gid")) {
-                        gid_t gid;
+static int unit_install_deserialized_job(Unit *u, Job *j) {
+        int r;
 
-                        r = parse_gid(v, &gid);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse referenced GID %s, ignoring.", v);
-                        else
-                                unit_ref_uid_gid(u, UID_INVALID, gid);
+        assert(u);
+        assert(j);
 
-                } else if (streq(l, "ref")) {
+        r = hashmap_put(u->manager->jobs, UINT32_TO_PTR(j->id), j);
+        if (r < 0) {
+                job_free(j);
+                return r;
+        }
 
-                        r = strv_extend(&u->deserialized_refs, v);
-                        if (r < 0)
-                                log_oom();
+        r = job_install_deserialized(j);
+        if (r < 0) {
+                hashmap_remove(u->manager->jobs, UINT32_TO_PTR(j->id));
+                job_free(j);
+                return r;
+        }
 
-                        continue;
-                } else if (streq(l, "invocation-id")) {
-                        sd_id128_t id;
+        return 0;
+}
 
-                        r = sd_id128_from_string(v, &id);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse invocation id %s, ignoring.", v);
-                        else {
-                                r = unit_set_invocation_id(u, id);
-                                if (r < 0)
-                                        log_unit_warning_errno(u, r, "Failed to set invocation ID for unit: %m");
-                        }
+static void unit_deserialize_finish(Unit *u) {
+        assert(u);
 
-                        continue;
+        /* Versions before 228 did not carry a state change timestamp. In this case, take the current time. This is
+         * useful, so that timeouts based on this timestamp don't trigger too early, and is in-line with the logic from
+         * before 228 where the base for timeouts was not persistent across reboots. */
+
+        if (!dual_timestamp_is_set(&u->state_change_timestamp))
+                dual_timestamp_get(&u->state_change_timestamp);
+
+        unit_update_active_state_index(u);
+
+        /* Let's make sure that everything that is deserialized also gets any potential new cgroup settings applied
+         * after we are done. For that we invalidate anything already realized, so that we can realize it again. */
+        unit_invalidate_cgroup(u, _CGROUP_MASK_ALL);
+        unit_invalidate_cgroup_bpf(u);
+}
+
+static ExecRuntime **unit_deserialize_exec_runtime(Unit *u) {
+        size_t offset;
+
+        offset = UNIT_VTABLE(u)->exec_runtime_offset;
+        if (offset == 0)
+                return NULL;
+
+        return (ExecRuntime**) ((uint8_t*) u + offset);
+}
+
+int unit_deserialize(Unit *u, FILE *f, FDSet *fds) {
+        ExecRuntime **rt;
+        int r;
+
+        assert(u);
+        assert(f);
+        assert(fds);
+
+        rt = unit_deserialize_exec_runtime(u);
+
+        for (;;) {
+                char line[LINE_MAX], *l, *v;
+                size_t k;
+
+                if (!fgets(line, sizeof(line), f)) {
+                        if (feof(f))
+                                return 0;
+                        return -errno;
                 }
 
-                /* Check if this is an IP accounting metric serialization field */
-                for (m = 0; m < _CGROUP_IP_ACCOUNTING_METRIC_MAX; m++)
-                        if (streq(l, ip_accounting_metric_field[m]))
-                                break;
-                if (m < _CGROUP_IP_ACCOUNTING_METRIC_MAX) {
-                        uint64_t c;
+                char_array_0(line);
+                l = strstrip(line);
 
-                        r = safe_atou64(v, &c);
-                        if (r < 0)
-                                log_unit_debug(u, "Failed to parse IP accounting value %s, ignoring.", v);
-                        else
-                                u->ip_accounting_extra[m] = c;
+                /* End marker */
+                if (isempty(l))
+                        break;
+
+                k = strcspn(l, "=");
+
+                if (l[k] == '=') {
+                        l[k] = 0;
+                        v = l+k+1;
+                } else
+                        v = l+k;
+
+                if (streq(l, "job")) {
+                        if (v[0] == '\0') {
+                                /* new-style serialized job */
+                                Job *j;
+
+                                j = job_new_raw(u);
+                                if (!j)
+                                        return log_oom();
+
+                                r = job_deserialize(j, f);
+                                if (r < 0) {
+                                        job_free(j);
+                                        return r;
+                                }
+
+                                r = unit_install_deserialized_job(u, j);
+                                if (r < 0)
+                                        return r;
+                        } else  /* legacy for pre-44 */
+                                log_unit_warning(u, "Update from too old systemd versions are unsupported, cannot deserialize job: %s", v);
                         continue;
                 }
 
-                if (unit_can_serialize(u)) {
-                        if (rt) {
-                                r = exec_runtime_deserialize_item(u, rt, l, v, fds);
+                unit_deserialize_item(u, rt, l, v, fds);
+        }
+
+        unit_deserialize_finish(u);
+        return 0;
+}
+
+int unit_deserialize_binary(Unit *u, const uint8_t *p, size_t size, FDSet *fds) {
+        ExecRuntime **rt;
+        const char *l, *v;
+        int r;
+
+        assert(u);
+        assert(p || size == 0);
+        assert(fds);
+
+        /* Like unit_deserialize(), but for the items of a record of the binary serialization format, which are
+         * handed to the deserializers without copying or parsing them */
+
+        rt = unit_deserialize_exec_runtime(u);
+
+        for (;;) {
+                r = deserialize_binary_item(&p, &size, &l, &v);
+                if (r < 0)
+                        return r;
+                if (r == 0 || isempty(l))
+                        break;
+
+                if (streq(l, "job")) {
+                        Job *j;
+
+                        j = job_new_raw(u);
+                        if (!j)
+                                return log_oom();
+
+                        for (;;) {
+                                r = deserialize_binary_item(&p, &size, &l, &v);
                                 if (r < 0) {
-                                        log_unit_warning(u, "Failed to deserialize runtime parameter '%s', ignoring.", l);
-                                        continue;
+                                        job_free(j);
+                                        return r;
                                 }
+                                if (r == 0 || isempty(l))
+                                        break;
 
-                                /* Returns positive if key was handled by the call */
-                                if (r > 0)
-                                        continue;
+                                job_deserialize_item(j, l, v);
                         }
 
-                        r = UNIT_VTABLE(u)->deserialize_item(u, l, v, fds);
+                        r = unit_install_deserialized_job(u, j);
                         if (r < 0)
-                                log_unit_warning(u, "Failed to deserialize unit parameter '%s', ignoring.", l);
-                }
-        }
-
-        /* Versions before 228 did not carry a state change timestamp. In this case, take the current time. This is
-         * useful, so that timeouts based on this timestamp don't trigger too early, and is in-line with the logic from
-         * before 228 where the base for timeouts was not persistent across reboots. */
+                                return r;
 
-        if (!dual_timestamp_is_set(&u->state_change_timestamp))
-                dual_timestamp_get(&u->state_change_timestamp);
+                        continue;
+                }
 
-        /* Let's make sure that everything that is deserialized also gets any potential new cgroup settings applied
-         * after we are done. For that we invalidate anything already realized, so that we can realize it again. */
-        unit_invalidate_cgroup(u, _CGROUP_MASK_ALL);
-        unit_invalidate_cgroup_bpf(u);
+                unit_deserialize_item(u, rt, l, v, fds);
+        }
 
+        unit_deserialize_finish(u);
         return 0;
 }
 
@@ -3735,6 +3836,9 @@ int unit_coldplug(Unit *u) {
                         r = q;
         }
 
+        /* Make sure the index reflects the restored state, however the unit type restored it */
+        unit_update_active_state_index(u);
+
         return r;
 }
 
@@ -3763,6 +3867,28 @@ static bool fragment_mtime_newer(const char *path, usec_t mtime, bool path_maske
         return false;
 }
 
+static bool unit_dependency_dropins_changed(Unit *u) {
+        _cleanup_strv_free_ char **wants = NULL, **requires = NULL;
+
+        assert(u);
+
+        /* Checks whether symlinks were added to or removed from the .wants/ and .requires/ directories since the
+         * unit was loaded. Follows the order in which unit_load_dropin() looks at them. */
+
+        if (u->load_state != UNIT_LOADED)
+                return false;
+
+        if (unit_find_dependency_dropin_paths(u, ".wants", &wants) < 0)
+                return true;
+        if (unit_find_dependency_dropin_paths(u, ".requires", &requires) < 0)
+                return true;
+
+        if (strv_extend_strv(&wants, requires, false) < 0)
+                return true;
+
+        return !strv_equal(u->dependency_dropin_paths, wants);
+}
+
 bool unit_need_daemon_reload(Unit *u) {
         _cleanup_strv_free_ char **t = NULL;
         char **path;
@@ -3788,7 +3914,7 @@ bool unit_need_daemon_reload(Unit *u) {
                 if (fragment_mtime_newer(*path, u->dropin_mtime, false))
                         return true;
 
-        return false;
+        return unit_dependency_dropins_changed(u);
 }
 
 void unit_reset_failed(Unit *u) {
@@ -4418,6 +4544,7 @@ int unit_make_transient(Unit *u) {
 
         u->source_path = mfree(u->source_path);
         u->dropin_paths = strv_free(u->dropin_paths);
+        u->dependency_dropin_paths = strv_free(u->dependency_dropin_paths);
         u->fragment_mtime = u->source_mtime = u->dropin_mtime = 0;
 
         u->load_state = UNIT_STUB;
@@ -4666,8 +4793,7 @@ int unit_setup_exec_runtime(Unit *u) {
         ExecRuntime **rt;
         size_t offset;
         Unit *other;
-        Iterator i;
-        void *v;
+        unsigned i;
 
         offset = UNIT_VTABLE(u)->exec_runtime_offset;
         assert(offset > 0);
@@ -4678,7 +4804,7 @@ int unit_setup_exec_runtime(Unit *u) {
                 return 0;
 
         /* Try to get it from somebody else */
-        HASHMAP_FOREACH_KEY(v, other, u->dependencies[UNIT_JOINS_NAMESPACE_OF], i) {
+        UNIT_FOREACH_DEPENDENCY(other, u, UNIT_JOINS_NAMESPACE_OF, i) {
 
                 *rt = unit_get_exec_runtime(other);
                 if (*rt) {
@@ -5044,19 +5170,25 @@ int unit_fork_helper_process(Unit *u, const char *name, pid_t *ret) {
         return 0;
 }
 
-static void unit_update_dependency_mask(Unit *u, UnitDependency d, Unit *other, UnitDependencyInfo di) {
+static bool unit_update_dependency_mask(Unit *u, UnitDependency d, UnitDependencyEntry *e, UnitDependencyInfo di) {
+        Unit *other;
+
         assert(u);
         assert(d >= 0);
         assert(d < _UNIT_DEPENDENCY_MAX);
-        assert(other);
+        assert(e);
 
         if (di.origin_mask == 0 && di.destination_mask == 0) {
-                /* No bit set anymore, let's drop the whole entry */
-                assert_se(hashmap_remove(u->dependencies[d], other));
+                /* No bit set anymore, let's drop the whole entry. Note that this invalidates e. */
+                other = e->unit;
+                assert_se(unit_dependency_list_remove(&u->dependencies[d], other, NULL));
                 log_unit_debug(u, "%s lost dependency %s=%s", u->id, unit_dependency_to_string(d), other->id);
-        } else
-                /* Mask was reduced, let's update the entry */
-                assert_se(hashmap_update(u->dependencies[d], other, di.data) == 0);
+                return true;
+        }
+
+        /* Mask was reduced, let's update the entry */
+        e->info = di;
+        return false;
 }
 
 void unit_remove_dependencies(Unit *u, UnitDependencyMask mask) {
@@ -5070,46 +5202,51 @@ void unit_remove_dependencies(Unit *u, UnitDependencyMask mask) {
                 return;
 
         for (d = 0; d < _UNIT_DEPENDENCY_MAX; d++) {
-                bool done;
+                unsigned i = 0;
 
-                do {
+                /* Dropping an entry moves the following ones down by one, hence only advance if we kept it. Updating
+                 * the reverse dependencies only touches the lists of the other units, never this one. */
+                while (i < unit_dependency_list_size(&u->dependencies[d])) {
+                        UnitDependencyEntry *e;
                         UnitDependencyInfo di;
+                        UnitDependency q;
                         Unit *other;
-                        Iterator i;
 
-                        done = true;
-
-                        HASHMAP_FOREACH_KEY(di.data, other, u->dependencies[d], i) {
-                                UnitDependency q;
-
-                                if ((di.origin_mask & ~mask) == di.origin_mask)
-                                        continue;
-                                di.origin_mask &= ~mask;
-                                unit_update_dependency_mask(u, d, other, di);
+                        e = unit_dependency_list_entries(&u->dependencies[d]) + i;
+                        di = e->info;
+                        other = e->unit;
 
-                                /* We updated the dependency from our unit to the other unit now. But most dependencies
-                                 * imply a reverse dependency. Hence, let's delete that one too. For that we go through
-                                 * all dependency types on the other unit and delete all those which point to us and
-                                 * have the right mask set. */
+                        if ((di.origin_mask & ~mask) == di.origin_mask) {
+                                i++;
+                                continue;
+                        }
+                        di.origin_mask &= ~mask;
+                        if (!unit_update_dependency_mask(u, d, e, di))
+                                i++;
 
-                                for (q = 0; q < _UNIT_DEPENDENCY_MAX; q++) {
-                                        UnitDependencyInfo dj;
+                        /* We updated the dependency from our unit to the other unit now. But most dependencies
+                         * imply a reverse dependency. Hence, let's delete that one too. For that we go through
+                         * all dependency types on the other unit and delete all those which point to us and
+                         * have the right mask set. */
 
-                                        dj.data = hashmap_get(other->dependencies[q], u);
-                                        if ((dj.destination_mask & ~mask) == dj.destination_mask)
-                                                continue;
-                                        dj.destination_mask &= ~mask;
+                        for (q = 0; q < _UNIT_DEPENDENCY_MAX; q++) {
+                                UnitDependencyEntry *f;
+                                UnitDependencyInfo dj;
 
-                                        unit_update_dependency_mask(other, q, u, dj);
-                                }
+                                f = unit_dependency_list_find(&other->dependencies[q], u);
+                                if (!f)
+                                        continue;
 
-                                unit_add_to_gc_queue(other);
+                                dj = f->info;
+                                if ((dj.destination_mask & ~mask) == dj.destination_mask)
+                                        continue;
+                                dj.destination_mask &= ~mask;
 
-                                done = false;
-                                break;
+                                (void) unit_update_dependency_mask(other, q, f, dj);
                         }
 
-                } while (!done);
+                        unit_add_to_gc_queue(other);
+                }
         }
 }
 
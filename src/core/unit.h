@@ -105,8 +105,8 @@ typedef enum UnitDependencyMask {
         _UNIT_DEPENDENCY_MASK_FULL = (1 << 8) - 1,
 } UnitDependencyMask;
 
-/* The Unit's dependencies[] hashmaps use this structure as value. It has the same size as a void pointer, and thus can
- * be stored directly as hashmap value, without any indirection. Note that this stores two masks, as both the origin
+/* The Unit's dependencies[] lists and the requires_mounts_for hashmap use this structure as value. It has the same size
+ * as a void pointer, and thus can be stored directly as hashmap value, without any indirection. Note that this stores two masks, as both the origin
  * and the destination of a dependency might have created it. */
 typedef union UnitDependencyInfo {
         void *data;
@@ -117,6 +117,7 @@ typedef union UnitDependencyInfo {
 } UnitDependencyInfo;
 
 #include "job.h"
+#include "unit-dependency-list.h"
 
 struct UnitRef {
         /* Keeps tracks of references to a unit. This is useful so
@@ -145,9 +146,9 @@ struct Unit {
 
         Set *names;
 
-        /* For each dependency type we maintain a Hashmap whose key is the Unit* object, and the value encodes why the
-         * dependency exists, using the UnitDependencyInfo type */
-        Hashmap *dependencies[_UNIT_DEPENDENCY_MAX];
+        /* For each dependency type we maintain a list of the Unit* objects, each together with a UnitDependencyInfo
+         * encoding why the dependency exists */
+        UnitDependencyList dependencies[_UNIT_DEPENDENCY_MAX];
 
         /* Similar, for RequiresMountsFor= path dependencies. The key is the path, the value the UnitDependencyInfo type */
         Hashmap *requires_mounts_for;
@@ -158,6 +159,7 @@ struct Unit {
         char *fragment_path; /* if loaded from a config file this is the primary path to it */
         char *source_path; /* if converted, the source file */
         char **dropin_paths;
+        char **dependency_dropin_paths; /* .wants/ and .requires/ symlinks dependencies were loaded from */
 
         usec_t fragment_mtime;
         usec_t source_mtime;
@@ -210,6 +212,13 @@ struct Unit {
         /* Per type list */
         LIST_FIELDS(Unit, units_by_type);
 
+        /* Per active state list, updated in unit_notify() */
+        LIST_FIELDS(Unit, units_by_active_state);
+        UnitActiveState indexed_active_state;
+
+        /* See Manager.unit_generation */
+        uint64_t generation;
+
         /* All units which have requires_mounts_for set */
         LIST_FIELDS(Unit, has_requires_mounts_for);
 
@@ -278,6 +287,13 @@ struct Unit {
         CGroupMask cgroup_members_mask;
         int cgroup_inotify_wd;
 
+        /* Directory fds of our cgroup, one per controller hierarchy, which are only open while the cgroup is
+         * realized, the inode numbers of these directories, and the values we last wrote to their attributes, so
+         * that unchanged settings are not written again */
+        int cgroup_fds[_CGROUP_CONTROLLER_MAX];
+        ino_t cgroup_inodes[_CGROUP_CONTROLLER_MAX];
+        Hashmap *cgroup_attribute_cache;
+
         /* IP BPF Firewalling/accounting */
         int ip_accounting_ingress_map_fd;
         int ip_accounting_egress_map_fd;
@@ -292,6 +308,9 @@ struct Unit {
 
         uint64_t ip_accounting_extra[_CGROUP_IP_ACCOUNTING_METRIC_MAX];
 
+        /* The most recently read accounting counters, served to queries within the manager's refresh interval */
+        CGroupAccountingSnapshot accounting_snapshot[_CGROUP_SNAPSHOT_ENTRY_MAX];
+
         /* How to start OnFailure units */
         JobMode on_failure_job_mode;
 
@@ -592,7 +611,7 @@ extern const UnitVTable * const unit_vtable[_UNIT_TYPE_MAX];
 #define UNIT_HAS_CGROUP_CONTEXT(u) (UNIT_VTABLE(u)->cgroup_context_offset > 0)
 #define UNIT_HAS_KILL_CONTEXT(u) (UNIT_VTABLE(u)->kill_context_offset > 0)
 
-#define UNIT_TRIGGER(u) ((Unit*) hashmap_first_key((u)->dependencies[UNIT_TRIGGERS]))
+#define UNIT_TRIGGER(u) unit_dependency_list_first(&(u)->dependencies[UNIT_TRIGGERS])
 
 DEFINE_CAST(SERVICE, Service);
 DEFINE_CAST(SOCKET, Socket);
@@ -627,6 +646,7 @@ bool unit_check_gc(Unit *u);
 
 void unit_add_to_load_queue(Unit *u);
 void unit_add_to_dbus_queue(Unit *u);
+void unit_bump_generation(Unit *u);
 void unit_add_to_cleanup_queue(Unit *u);
 void unit_add_to_gc_queue(Unit *u);
 
@@ -664,6 +684,8 @@ int unit_reload(Unit *u);
 int unit_kill(Unit *u, KillWho w, int signo, sd_bus_error *error);
 int unit_kill_common(Unit *u, KillWho who, int signo, pid_t main_pid, pid_t control_pid, sd_bus_error *error);
 
+int unit_compare_id(const void *a, const void *b);
+
 void unit_notify(Unit *u, UnitActiveState os, UnitActiveState ns, bool reload_success);
 
 int unit_watch_pid(Unit *u, pid_t pid);
@@ -689,6 +711,7 @@ bool unit_can_serialize(Unit *u) _pure_;
 
 int unit_serialize(Unit *u, FILE *f, FDSet *fds, bool serialize_jobs);
 int unit_deserialize(Unit *u, FILE *f, FDSet *fds);
+int unit_deserialize_binary(Unit *u, const uint8_t *p, size_t size, FDSet *fds);
 void unit_deserialize_skip(FILE *f);
 
 int unit_serialize_item(Unit *u, FILE *f, const char *key, const char *value);
@@ -221,6 +221,9 @@ struct sd_bus {
         bool accept_fd:1;
         bool attach_timestamp:1;
         bool connected_signal:1;
+        bool coalesce_writes:1;
+        bool accept_memfd:1;
+        bool can_memfd:1;
 
         int use_memfd;
 
@@ -337,6 +340,12 @@ struct sd_bus {
 #define BUS_WQUEUE_MAX (192*1024)
 #define BUS_RQUEUE_MAX (192*1024)
 
+/* How many iovecs to gather from the write queue into a single sendmsg() at most */
+#define BUS_WRITE_BATCH_IOVEC_MAX 64
+
+/* How much to read beyond the current message, in order to pick up subsequent queued messages in the same syscall */
+#define BUS_READ_AHEAD_SIZE (64*1024)
+
 #define BUS_MESSAGE_SIZE_MAX (64*1024*1024)
 #define BUS_AUTH_SIZE_MAX (64*1024)
 
@@ -378,6 +387,8 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m);
 
 int bus_rqueue_make_room(sd_bus *bus);
 
+int bus_set_coalesce_writes(sd_bus *bus, bool b);
+
 bool bus_pid_changed(sd_bus *bus);
 
 char *bus_address_escape(const char *v);
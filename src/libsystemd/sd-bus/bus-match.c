@@ -77,6 +77,113 @@ static inline bool BUS_MATCH_CAN_HASH(enum bus_match_node_type t) {
                 (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST);
 }
 
+/* The dispatch index: every leaf of the tree is filed into exactly one bucket, keyed by the
+ * subset of (sender, interface, member, path) its match constrains to an exact value. On
+ * dispatch we hence only need to look up the keys a message produces for each of the (at most
+ * 16) subsets that are actually in use, and then check the remaining components of the few
+ * candidate leaves we find there. Matches on well-known sender names are not keyed on the
+ * sender, since without kdbus they may match any unique name. */
+
+enum {
+        MATCH_INDEX_SENDER    = 1 << 0,
+        MATCH_INDEX_INTERFACE = 1 << 1,
+        MATCH_INDEX_MEMBER    = 1 << 2,
+        MATCH_INDEX_PATH      = 1 << 3,
+        _MATCH_INDEX_MASK_MAX = 1 << 4,
+};
+
+struct bus_match_index_key {
+        unsigned mask;
+        const char *sender, *interface, *member, *path;
+};
+
+struct bus_match_index_entry {
+        unsigned seq;  /* position of the leaf in tree order, to invoke callbacks in the same order as the tree walk */
+        unsigned mask; /* the components already covered by the bucket key */
+        bool arg_has;  /* the match includes argNhas, the tree order hence depends on the message */
+        struct bus_match_node *leaf;
+};
+
+struct bus_match_index_bucket {
+        struct bus_match_index_key key;
+        struct bus_match_index_entry *entries;
+        size_t n_entries, n_allocated;
+};
+
+struct bus_match_index {
+        Hashmap *buckets;
+        unsigned n_leaves;
+        bool masks_used[_MATCH_INDEX_MASK_MAX];
+};
+
+#define MATCH_INDEX_CANDIDATES_STACK_MAX 64U
+
+static void match_index_key_hash_func(const void *p, struct siphash *state) {
+        const struct bus_match_index_key *k = p;
+
+        siphash24_compress(&k->mask, sizeof(k->mask), state);
+
+        if (k->sender)
+                string_hash_func(k->sender, state);
+        if (k->interface)
+                string_hash_func(k->interface, state);
+        if (k->member)
+                string_hash_func(k->member, state);
+        if (k->path)
+                string_hash_func(k->path, state);
+}
+
+static int match_index_key_compare_func(const void *a, const void *b) {
+        const struct bus_match_index_key *x = a, *y = b;
+        int r;
+
+        if (x->mask < y->mask)
+                return -1;
+        if (x->mask > y->mask)
+                return 1;
+
+        r = strcmp_ptr(x->sender, y->sender);
+        if (r != 0)
+                return r;
+
+        r = strcmp_ptr(x->interface, y->interface);
+        if (r != 0)
+                return r;
+
+        r = strcmp_ptr(x->member, y->member);
+        if (r != 0)
+                return r;
+
+        return strcmp_ptr(x->path, y->path);
+}
+
+static const struct hash_ops match_index_key_hash_ops = {
+        .hash = match_index_key_hash_func,
+        .compare = match_index_key_compare_func
+};
+
+static struct bus_match_index *bus_match_index_free(struct bus_match_index *index) {
+        struct bus_match_index_bucket *b;
+
+        if (!index)
+                return NULL;
+
+        while ((b = hashmap_steal_first(index->buckets))) {
+                free(b->entries);
+                free(b);
+        }
+
+        hashmap_free(index->buckets);
+        return mfree(index);
+}
+
+static void bus_match_index_invalidate(struct bus_match_node *root) {
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+
+        root->root.index = bus_match_index_free(root->root.index);
+}
+
 static void bus_match_node_free(struct bus_match_node *node) {
         assert(node);
         assert(node->parent);
@@ -258,6 +365,480 @@ static bool value_node_same(
         }
 }
 
+static void bus_match_get_test_values(
+                enum bus_match_node_type t,
+                sd_bus_message *m,
+                uint8_t *test_u8,
+                const char **test_str,
+                char ***test_strv) {
+
+        assert(m);
+        assert(test_u8);
+        assert(test_str);
+        assert(test_strv);
+
+        switch (t) {
+
+        case BUS_MATCH_MESSAGE_TYPE:
+                *test_u8 = m->header->type;
+                break;
+
+        case BUS_MATCH_SENDER:
+                *test_str = m->sender;
+                /* FIXME: resolve test_str from a well-known to a unique name first */
+                break;
+
+        case BUS_MATCH_DESTINATION:
+                *test_str = m->destination;
+                break;
+
+        case BUS_MATCH_INTERFACE:
+                *test_str = m->interface;
+                break;
+
+        case BUS_MATCH_MEMBER:
+                *test_str = m->member;
+                break;
+
+        case BUS_MATCH_PATH:
+        case BUS_MATCH_PATH_NAMESPACE:
+                *test_str = m->path;
+                break;
+
+        case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
+                (void) bus_message_get_arg(m, t - BUS_MATCH_ARG, test_str);
+                break;
+
+        case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
+                (void) bus_message_get_arg(m, t - BUS_MATCH_ARG_PATH, test_str);
+                break;
+
+        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
+                (void) bus_message_get_arg(m, t - BUS_MATCH_ARG_NAMESPACE, test_str);
+                break;
+
+        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
+                (void) bus_message_get_arg_strv(m, t - BUS_MATCH_ARG_HAS, test_strv);
+                break;
+
+        default:
+                assert_not_reached("Unknown match type.");
+        }
+}
+
+static int bus_match_run_leaf(
+                sd_bus *bus,
+                struct bus_match_node *node,
+                sd_bus_message *m) {
+
+        int r;
+
+        assert(node);
+        assert(node->type == BUS_MATCH_LEAF);
+        assert(m);
+
+        r = sd_bus_message_rewind(m, true);
+        if (r < 0)
+                return r;
+
+        /* Run the callback. */
+        if (node->leaf.callback->callback) {
+                _cleanup_(sd_bus_error_free) sd_bus_error error_buffer = SD_BUS_ERROR_NULL;
+                sd_bus_slot *slot;
+
+                slot = container_of(node->leaf.callback, sd_bus_slot, match_callback);
+                if (bus) {
+                        bus->current_slot = sd_bus_slot_ref(slot);
+                        bus->current_handler = node->leaf.callback->callback;
+                        bus->current_userdata = slot->userdata;
+                }
+                r = node->leaf.callback->callback(m, slot->userdata, &error_buffer);
+                if (bus) {
+                        bus->current_userdata = NULL;
+                        bus->current_handler = NULL;
+                        bus->current_slot = sd_bus_slot_unref(slot);
+                }
+
+                r = bus_maybe_reply_error(m, r, &error_buffer);
+                if (r != 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bus_match_index_add_leaf(struct bus_match_index *index, struct bus_match_node *leaf) {
+        struct bus_match_index_key key = {};
+        struct bus_match_index_bucket *b;
+        struct bus_match_node *n;
+        bool arg_has = false;
+        int r;
+
+        assert(index);
+        assert(leaf);
+        assert(leaf->type == BUS_MATCH_LEAF);
+
+        /* Determine which of the indexed components this match constrains, by walking up the tree */
+        for (n = leaf->parent; n && n->type == BUS_MATCH_VALUE; n = n->parent->parent) {
+
+                if (n->parent->type >= BUS_MATCH_ARG_HAS && n->parent->type <= BUS_MATCH_ARG_HAS_LAST)
+                        arg_has = true;
+
+                switch (n->parent->type) {
+
+                case BUS_MATCH_SENDER:
+                        if (n->value.str && n->value.str[0] == ':') {
+                                key.mask |= MATCH_INDEX_SENDER;
+                                key.sender = n->value.str;
+                        }
+                        break;
+
+                case BUS_MATCH_INTERFACE:
+                        key.mask |= MATCH_INDEX_INTERFACE;
+                        key.interface = n->value.str;
+                        break;
+
+                case BUS_MATCH_MEMBER:
+                        key.mask |= MATCH_INDEX_MEMBER;
+                        key.member = n->value.str;
+                        break;
+
+                case BUS_MATCH_PATH:
+                        key.mask |= MATCH_INDEX_PATH;
+                        key.path = n->value.str;
+                        break;
+
+                default:
+                        break;
+                }
+        }
+
+        b = hashmap_get(index->buckets, &key);
+        if (!b) {
+                b = new0(struct bus_match_index_bucket, 1);
+                if (!b)
+                        return -ENOMEM;
+
+                b->key = key;
+
+                r = hashmap_put(index->buckets, &b->key, b);
+                if (r < 0) {
+                        free(b);
+                        return r;
+                }
+
+                index->masks_used[key.mask] = true;
+        }
+
+        if (!GREEDY_REALLOC(b->entries, b->n_allocated, b->n_entries + 1))
+                return -ENOMEM;
+
+        b->entries[b->n_entries++] = (struct bus_match_index_entry) {
+                .seq = index->n_leaves++,
+                .mask = key.mask,
+                .arg_has = arg_has,
+                .leaf = leaf,
+        };
+
+        return 0;
+}
+
+static int bus_match_index_add_subtree(struct bus_match_index *index, struct bus_match_node *node) {
+        struct bus_match_node *c;
+        int r;
+
+        assert(index);
+        assert(node);
+
+        if (node->type == BUS_MATCH_LEAF)
+                return bus_match_index_add_leaf(index, node);
+
+        if (BUS_MATCH_CAN_HASH(node->type)) {
+                Iterator i;
+
+                HASHMAP_FOREACH(c, node->compare.children, i) {
+                        r = bus_match_index_add_subtree(index, c);
+                        if (r < 0)
+                                return r;
+                }
+        }
+
+        for (c = node->child; c; c = c->next) {
+                r = bus_match_index_add_subtree(index, c);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bus_match_index_build(struct bus_match_node *root) {
+        struct bus_match_index *index;
+        int r;
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+
+        if (root->root.index)
+                return 0;
+
+        index = new0(struct bus_match_index, 1);
+        if (!index)
+                return -ENOMEM;
+
+        index->buckets = hashmap_new(&match_index_key_hash_ops);
+        if (!index->buckets) {
+                free(index);
+                return -ENOMEM;
+        }
+
+        r = bus_match_index_add_subtree(index, root);
+        if (r < 0) {
+                bus_match_index_free(index);
+                return r;
+        }
+
+        root->root.index = index;
+        return 0;
+}
+
+static bool bus_match_leaf_test(struct bus_match_node *leaf, unsigned mask, sd_bus_message *m) {
+        struct bus_match_node *n;
+
+        assert(leaf);
+        assert(m);
+
+        /* Checks all components of the leaf's match that were not already covered by the index key */
+
+        for (n = leaf->parent; n && n->type == BUS_MATCH_VALUE; n = n->parent->parent) {
+                _cleanup_strv_free_ char **test_strv = NULL;
+                const char *test_str = NULL;
+                uint8_t test_u8 = 0;
+                enum bus_match_node_type t = n->parent->type;
+
+                if ((t == BUS_MATCH_SENDER && (mask & MATCH_INDEX_SENDER)) ||
+                    (t == BUS_MATCH_INTERFACE && (mask & MATCH_INDEX_INTERFACE)) ||
+                    (t == BUS_MATCH_MEMBER && (mask & MATCH_INDEX_MEMBER)) ||
+                    (t == BUS_MATCH_PATH && (mask & MATCH_INDEX_PATH)))
+                        continue;
+
+                bus_match_get_test_values(t, m, &test_u8, &test_str, &test_strv);
+
+                if (!value_node_test(n, t, test_u8, test_str, test_strv, m))
+                        return false;
+        }
+
+        return true;
+}
+
+static int match_index_entry_compare(const void *a, const void *b) {
+        const struct bus_match_index_entry *x = a, *y = b;
+
+        if (x->seq < y->seq)
+                return -1;
+        if (x->seq > y->seq)
+                return 1;
+        return 0;
+}
+
+struct bus_match_index_order {
+        sd_bus_message *message;
+        char **strv[BUS_MATCH_ARG_HAS_LAST - BUS_MATCH_ARG_HAS + 1];
+        bool strv_loaded[BUS_MATCH_ARG_HAS_LAST - BUS_MATCH_ARG_HAS + 1];
+};
+
+static size_t match_index_order_rank(struct bus_match_index_order *o, struct bus_match_node *value) {
+        unsigned arg;
+        char **i;
+
+        assert(o);
+        assert(value);
+        assert(value->type == BUS_MATCH_VALUE);
+
+        arg = value->parent->type - BUS_MATCH_ARG_HAS;
+
+        if (!o->strv_loaded[arg]) {
+                (void) bus_message_get_arg_strv(o->message, arg, &o->strv[arg]);
+                o->strv_loaded[arg] = true;
+        }
+
+        STRV_FOREACH(i, o->strv[arg])
+                if (streq(*i, value->value.str))
+                        return i - o->strv[arg];
+
+        return (size_t) -1;
+}
+
+static int match_index_entry_compare_message(const void *a, const void *b, void *userdata) {
+        const struct bus_match_index_entry *x = a, *y = b;
+        struct bus_match_node *p, *q, *n;
+        unsigned dx = 0, dy = 0;
+        size_t rx, ry;
+
+        /* The tree walk visits the children of an argNhas compare node in the order their values
+         * appear in the message's string array, not in tree order. Find the node where the paths of
+         * the two leaves split up, and if that's an argNhas compare node, order by the message. */
+
+        if (x->arg_has && y->arg_has && x->leaf != y->leaf) {
+                for (n = x->leaf; n; n = n->parent)
+                        dx++;
+                for (n = y->leaf; n; n = n->parent)
+                        dy++;
+
+                for (p = x->leaf; dx > dy; dx--)
+                        p = p->parent;
+                for (q = y->leaf; dy > dx; dy--)
+                        q = q->parent;
+
+                while (p->parent != q->parent) {
+                        p = p->parent;
+                        q = q->parent;
+                }
+
+                if (p != q &&
+                    p->parent->type >= BUS_MATCH_ARG_HAS && p->parent->type <= BUS_MATCH_ARG_HAS_LAST) {
+                        rx = match_index_order_rank(userdata, p);
+                        ry = match_index_order_rank(userdata, q);
+                        if (rx < ry)
+                                return -1;
+                        if (rx > ry)
+                                return 1;
+                }
+        }
+
+        return match_index_entry_compare(a, b);
+}
+
+static int bus_match_run_index(
+                sd_bus *bus,
+                struct bus_match_node *root,
+                sd_bus_message *m) {
+
+        struct bus_match_index_bucket *buckets[_MATCH_INDEX_MASK_MAX];
+        _cleanup_free_ struct bus_match_index_entry *allocated = NULL;
+        struct bus_match_index_entry *candidates;
+        size_t n_buckets = 0, n_candidates = 0, i;
+        bool arg_has = false;
+        unsigned mask;
+        int r;
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+        assert(root->root.index);
+        assert(m);
+
+        /* Look up the key this message produces for each subset of components in use */
+        for (mask = 0; mask < _MATCH_INDEX_MASK_MAX; mask++) {
+                struct bus_match_index_key key = {
+                        .mask = mask,
+                };
+                struct bus_match_index_bucket *b;
+
+                if (!root->root.index->masks_used[mask])
+                        continue;
+
+                if (mask & MATCH_INDEX_SENDER) {
+                        if (!m->sender)
+                                continue;
+                        key.sender = m->sender;
+                }
+                if (mask & MATCH_INDEX_INTERFACE) {
+                        if (!m->interface)
+                                continue;
+                        key.interface = m->interface;
+                }
+                if (mask & MATCH_INDEX_MEMBER) {
+                        if (!m->member)
+                                continue;
+                        key.member = m->member;
+                }
+                if (mask & MATCH_INDEX_PATH) {
+                        if (!m->path)
+                                continue;
+                        key.path = m->path;
+                }
+
+                b = hashmap_get(root->root.index->buckets, &key);
+                if (!b)
+                        continue;
+
+                buckets[n_buckets++] = b;
+                n_candidates += b->n_entries;
+        }
+
+        if (n_candidates == 0)
+                return 0;
+
+        /* Callbacks may modify the match tree, and hence invalidate the index. Let's hence take a copy
+         * of the candidate list before we start invoking anything. */
+        if (n_candidates <= MATCH_INDEX_CANDIDATES_STACK_MAX)
+                candidates = newa(struct bus_match_index_entry, n_candidates);
+        else {
+                candidates = allocated = new(struct bus_match_index_entry, n_candidates);
+                if (!candidates)
+                        return -ENOMEM;
+        }
+
+        for (i = 0, n_candidates = 0; i < n_buckets; i++) {
+                memcpy(candidates + n_candidates, buckets[i]->entries, buckets[i]->n_entries * sizeof(struct bus_match_index_entry));
+                n_candidates += buckets[i]->n_entries;
+        }
+
+        for (i = 0; i < n_candidates && !arg_has; i++)
+                arg_has = candidates[i].arg_has;
+
+        if (arg_has && n_candidates > 1) {
+                struct bus_match_index_order order = {
+                        .message = m,
+                };
+                unsigned k;
+
+                qsort_r(candidates, n_candidates, sizeof(struct bus_match_index_entry), match_index_entry_compare_message, &order);
+
+                for (k = 0; k < ELEMENTSOF(order.strv); k++)
+                        strv_free(order.strv[k]);
+        } else if (n_buckets > 1)
+                qsort(candidates, n_candidates, sizeof(struct bus_match_index_entry), match_index_entry_compare);
+
+        for (i = 0; i < n_candidates; i++) {
+                struct bus_match_node *leaf = candidates[i].leaf;
+
+                if (bus && leaf->leaf.callback->last_iteration == bus->iteration_counter)
+                        continue;
+
+                if (!bus_match_leaf_test(leaf, candidates[i].mask, m))
+                        continue;
+
+                if (bus)
+                        leaf->leaf.callback->last_iteration = bus->iteration_counter;
+
+                r = bus_match_run_leaf(bus, leaf, m);
+                if (r != 0)
+                        return r;
+
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
+        }
+
+        return 0;
+}
+
+int bus_match_run_tree(
+                sd_bus *bus,
+                struct bus_match_node *root,
+                sd_bus_message *m) {
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+        assert(m);
+
+        /* Run all children. Since we cannot have any siblings
+         * we won't call any. The children of the root node
+         * are compares or leaves, they will automatically
+         * call their siblings. */
+        return bus_match_run(bus, root->child, m);
+}
+
 int bus_match_run(
                 sd_bus *bus,
                 struct bus_match_node *node,
@@ -287,11 +868,12 @@ int bus_match_run(
 
         case BUS_MATCH_ROOT:
 
-                /* Run all children. Since we cannot have any siblings
-                 * we won't call any. The children of the root node
-                 * are compares or leaves, they will automatically
-                 * call their siblings. */
-                return bus_match_run(bus, node->child, m);
+                /* Use the precompiled index if we can, it reduces the work to a few hash table
+                 * lookups. If we can't build it, fall back to walking the tree. */
+                if (bus_match_index_build(node) >= 0)
+                        return bus_match_run_index(bus, node, m);
+
+                return bus_match_run_tree(bus, node, m);
 
         case BUS_MATCH_VALUE:
 
@@ -312,82 +894,19 @@ int bus_match_run(
                         node->leaf.callback->last_iteration = bus->iteration_counter;
                 }
 
-                r = sd_bus_message_rewind(m, true);
-                if (r < 0)
-                        return r;
-
                 /* Run the callback. And then invoke siblings. */
-                if (node->leaf.callback->callback) {
-                        _cleanup_(sd_bus_error_free) sd_bus_error error_buffer = SD_BUS_ERROR_NULL;
-                        sd_bus_slot *slot;
-
-                        slot = container_of(node->leaf.callback, sd_bus_slot, match_callback);
-                        if (bus) {
-                                bus->current_slot = sd_bus_slot_ref(slot);
-                                bus->current_handler = node->leaf.callback->callback;
-                                bus->current_userdata = slot->userdata;
-                        }
-                        r = node->leaf.callback->callback(m, slot->userdata, &error_buffer);
-                        if (bus) {
-                                bus->current_userdata = NULL;
-                                bus->current_handler = NULL;
-                                bus->current_slot = sd_bus_slot_unref(slot);
-                        }
-
-                        r = bus_maybe_reply_error(m, r, &error_buffer);
-                        if (r != 0)
-                                return r;
+                r = bus_match_run_leaf(bus, node, m);
+                if (r != 0)
+                        return r;
 
-                        if (bus && bus->match_callbacks_modified)
-                                return 0;
-                }
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
 
                 return bus_match_run(bus, node->next, m);
 
-        case BUS_MATCH_MESSAGE_TYPE:
-                test_u8 = m->header->type;
-                break;
-
-        case BUS_MATCH_SENDER:
-                test_str = m->sender;
-                /* FIXME: resolve test_str from a well-known to a unique name first */
-                break;
-
-        case BUS_MATCH_DESTINATION:
-                test_str = m->destination;
-                break;
-
-        case BUS_MATCH_INTERFACE:
-                test_str = m->interface;
-                break;
-
-        case BUS_MATCH_MEMBER:
-                test_str = m->member;
-                break;
-
-        case BUS_MATCH_PATH:
-        case BUS_MATCH_PATH_NAMESPACE:
-                test_str = m->path;
-                break;
-
-        case BUS_MATCH_ARG ... BUS_MATCH_ARG_LAST:
-                (void) bus_message_get_arg(m, node->type - BUS_MATCH_ARG, &test_str);
-                break;
-
-        case BUS_MATCH_ARG_PATH ... BUS_MATCH_ARG_PATH_LAST:
-                (void) bus_message_get_arg(m, node->type - BUS_MATCH_ARG_PATH, &test_str);
-                break;
-
-        case BUS_MATCH_ARG_NAMESPACE ... BUS_MATCH_ARG_NAMESPACE_LAST:
-                (void) bus_message_get_arg(m, node->type - BUS_MATCH_ARG_NAMESPACE, &test_str);
-                break;
-
-        case BUS_MATCH_ARG_HAS ... BUS_MATCH_ARG_HAS_LAST:
-                (void) bus_message_get_arg_strv(m, node->type - BUS_MATCH_ARG_HAS, &test_strv);
-                break;
-
         default:
-                assert_not_reached("Unknown match type.");
+                bus_match_get_test_values(node->type, m, &test_u8, &test_str, &test_strv);
+                break;
         }
 
         if (BUS_MATCH_CAN_HASH(node->type)) {
@@ -996,6 +1515,8 @@ int bus_match_add(
         assert(root);
         assert(callback);
 
+        bus_match_index_invalidate(root);
+
         n = root;
         for (i = 0; i < n_components; i++) {
                 r = bus_match_add_compare_value(
@@ -1023,6 +1544,8 @@ int bus_match_remove(
 
         assert(node->type == BUS_MATCH_LEAF);
 
+        bus_match_index_invalidate(root);
+
         callback->match_node = NULL;
 
         /* Free the leaf */
@@ -1098,6 +1621,8 @@ void bus_match_free(struct bus_match_node *node) {
 
         if (node->type != BUS_MATCH_ROOT)
                 bus_match_node_free(node);
+        else
+                bus_match_index_invalidate(node);
 }
 
 const char* bus_match_node_type_to_string(enum bus_match_node_type t, char buf[], size_t l) {
@@ -49,11 +49,18 @@ enum bus_match_node_type {
         _BUS_MATCH_NODE_TYPE_INVALID = -1
 };
 
+struct bus_match_index;
+
 struct bus_match_node {
         enum bus_match_node_type type;
         struct bus_match_node *parent, *next, *prev, *child;
 
         union {
+                struct {
+                        /* Precompiled dispatch index, dropped whenever the tree changes, and rebuilt
+                         * lazily on the next dispatch */
+                        struct bus_match_index *index;
+                } root;
                 struct {
                         char *str;
                         uint8_t u8;
@@ -81,6 +88,7 @@ enum bus_match_scope {
 };
 
 int bus_match_run(sd_bus *bus, struct bus_match_node *root, sd_bus_message *m);
+int bus_match_run_tree(sd_bus *bus, struct bus_match_node *root, sd_bus_message *m);
 
 int bus_match_add(struct bus_match_node *root, struct bus_match_component *components, unsigned n_components, struct match_callback *callback);
 int bus_match_remove(struct bus_match_node *root, struct match_callback *callback);
@@ -390,6 +390,42 @@ static int message_append_field_uint64(sd_bus_message *m, uint64_t h, uint64_t x
         return 0;
 }
 
+static int message_append_field_memfds(sd_bus_message *m) {
+        struct bus_body_part *part;
+        uint64_t offset = 0, *q;
+        unsigned i;
+        uint8_t *p;
+
+        assert(m);
+        assert(!BUS_MESSAGE_IS_GVARIANT(m));
+        assert(m->n_memfd_parts > 0);
+
+        /* (field id byte + (signature length + signature 'a(ttt)' + NUL) + 3 byte padding + array
+         * length + 4 byte padding + (body offset + memfd offset + size) for each passed part) */
+        p = message_extend_fields(m, 8, 16 + 24 * m->n_memfd_parts, false);
+        if (!p)
+                return -ENOMEM;
+
+        p[0] = BUS_MESSAGE_HEADER_MEMFDS;
+        p[1] = 6;
+        memcpy(p + 2, "a(ttt)", 7);
+        p[9] = p[10] = p[11] = 0;
+        ((uint32_t*) p)[3] = 24 * m->n_memfd_parts;
+
+        q = (uint64_t*) (p + 16);
+        MESSAGE_FOREACH_PART(part, i, m) {
+                if (part->memfd_passed) {
+                        *(q++) = offset;
+                        *(q++) = part->memfd_offset;
+                        *(q++) = part->size;
+                }
+
+                offset += part->size;
+        }
+
+        return 0;
+}
+
 static int message_append_reply_cookie(sd_bus_message *m, uint64_t cookie) {
         assert(m);
 
@@ -1319,6 +1355,7 @@ static void *message_extend_body(
                 add_new_part =
                         m->n_body_parts <= 0 ||
                         m->body_end->sealed ||
+                        m->body_end->memfd >= 0 ||
                         (padding != ALIGN_TO(m->body_end->size, align) - m->body_end->size) ||
                         (force_inline && m->body_end->size > MEMFD_MIN_SIZE);
                         /* If this must be an inlined extension, let's create a new part if
@@ -2519,6 +2556,65 @@ _public_ int sd_bus_message_append(sd_bus_message *m, const char *types, ...) {
         return r;
 }
 
+static bool message_use_memfd(sd_bus_message *m, size_t size) {
+        assert(m);
+
+        if (BUS_MESSAGE_IS_GVARIANT(m))
+                return false;
+
+        if (!m->bus->can_memfd)
+                return false;
+
+        /* Allocating, faulting in and sealing a fresh memfd for every message is more expensive than
+         * copying the data through the socket, hence only do this if explicitly requested. Data
+         * that is in a memfd already is passed as such in any case. */
+        return m->bus->use_memfd < 0 && size > 0;
+}
+
+static int message_append_part_memfd(sd_bus_message *m, size_t size, void **ret) {
+        _cleanup_close_ int fd = -1;
+        struct bus_body_part *part;
+        void *p;
+        int r;
+
+        assert(m);
+        assert(size > 0);
+        assert(ret);
+
+        fd = memfd_new("sd-bus-part");
+        if (fd < 0)
+                return fd;
+
+        r = memfd_set_size(fd, size);
+        if (r < 0)
+                return r;
+
+        /* Populate right-away, the caller is going to write the whole array anyway */
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        part = message_append_part(m);
+        if (!part) {
+                assert_se(munmap(p, size) >= 0);
+                return -ENOMEM;
+        }
+
+        /* The part stays writable until the message is sealed, only then the memfd is sealed, too */
+        part->memfd = fd;
+        part->data = part->mmap_begin = p;
+        part->mapped = PAGE_ALIGN(size);
+        part->munmap_this = true;
+        part->size = size;
+        fd = -1;
+
+        m->body_size += size;
+        message_extend_containers(m, size);
+
+        *ret = p;
+        return 0;
+}
+
 _public_ int sd_bus_message_append_array_space(
                 sd_bus_message *m,
                 char type,
@@ -2550,9 +2646,21 @@ _public_ int sd_bus_message_append_array_space(
         if (r < 0)
                 return r;
 
-        a = message_extend_body(m, align, size, false, false);
-        if (!a)
-                return -ENOMEM;
+        if (message_use_memfd(m, size)) {
+                /* Place the array in a memfd right-away, so that it can be passed without copying
+                 * it into the socket. */
+                a = message_extend_body(m, align, 0, false, false);
+                if (!a)
+                        return -ENOMEM;
+
+                r = message_append_part_memfd(m, size, &a);
+                if (r < 0)
+                        return r;
+        } else {
+                a = message_extend_body(m, align, size, false, false);
+                if (!a)
+                        return -ENOMEM;
+        }
 
         r = sd_bus_message_close_container(m);
         if (r < 0)
@@ -2871,18 +2979,78 @@ static int bus_message_close_header(sd_bus_message *m) {
                 m->footer_accessible = 1 + l + 2 + sz;
         } else {
                 m->header->dbus1.fields_size = m->fields_size;
-                m->header->dbus1.body_size = m->body_size;
+                m->header->dbus1.body_size = m->body_size - m->memfd_parts_size;
         }
 
         return 0;
 }
 
-_public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t timeout_usec) {
+static int message_pass_memfd_parts(sd_bus_message *m) {
         struct bus_body_part *part;
-        size_t a;
         unsigned i;
         int r;
 
+        assert(m);
+        assert(!m->sealed);
+
+        /* If the peer agreed to receive body parts as memfds, seal all memfd parts now, and append
+         * them to the fds of the message. They are then skipped when the body is written to the
+         * socket. Parts we allocated ourselves are writable up to this point, while memfds
+         * supplied by the caller are sealed already. */
+
+        if (BUS_MESSAGE_IS_GVARIANT(m))
+                return 0;
+
+        if (!m->bus->can_memfd || m->bus->use_memfd == 0)
+                return 0;
+
+        MESSAGE_FOREACH_PART(part, i, m) {
+                int *f, copy;
+
+                if (part->memfd < 0)
+                        continue;
+
+                if (!part->sealed) {
+                        /* First, unmap our own map to make sure we don't keep it busy, then
+                         * sync up the real memfd size, and finally try to seal */
+                        bus_body_part_unmap(part);
+
+                        r = memfd_set_size(part->memfd, part->size);
+                        if (r < 0)
+                                return r;
+
+                        if (memfd_set_sealed(part->memfd) < 0)
+                                continue;
+
+                        part->sealed = true;
+                }
+
+                copy = fcntl(part->memfd, F_DUPFD_CLOEXEC, 3);
+                if (copy < 0)
+                        return -errno;
+
+                f = realloc(m->fds, sizeof(int) * (m->n_fds + 1));
+                if (!f) {
+                        safe_close(copy);
+                        return -ENOMEM;
+                }
+
+                m->fds = f;
+                m->fds[m->n_fds++] = copy;
+                m->free_fds = true;
+
+                part->memfd_passed = true;
+                m->n_memfd_parts++;
+                m->memfd_parts_size += part->size;
+        }
+
+        return 0;
+}
+
+_public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t timeout_usec) {
+        size_t a;
+        int r;
+
         assert_return(m, -EINVAL);
 
         if (m->sealed)
@@ -2918,12 +3086,23 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
                         return r;
         }
 
+        r = message_pass_memfd_parts(m);
+        if (r < 0)
+                return r;
+
         if (m->n_fds > 0) {
                 r = message_append_field_uint32(m, BUS_MESSAGE_HEADER_UNIX_FDS, m->n_fds);
                 if (r < 0)
                         return r;
         }
 
+        /* This must come after the fd count, see message_peek_unix_fds() in bus-socket.c */
+        if (m->n_memfd_parts > 0) {
+                r = message_append_field_memfds(m);
+                if (r < 0)
+                        return r;
+        }
+
         r = bus_message_close_header(m);
         if (r < 0)
                 return r;
@@ -2943,34 +3122,6 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
         if (a > 0)
                 memzero((uint8_t*) BUS_MESSAGE_FIELDS(m) + m->fields_size, a);
 
-        /* If this is something we can send as memfd, then let's seal
-        the memfd now. Note that we can send memfds as payload only
-        for directed messages, and not for broadcasts. */
-        if (m->destination && m->bus->use_memfd) {
-                MESSAGE_FOREACH_PART(part, i, m)
-                        if (part->memfd >= 0 &&
-                            !part->sealed &&
-                            (part->size > MEMFD_MIN_SIZE || m->bus->use_memfd < 0) &&
-                            part != m->body_end) { /* The last part may never be sent as memfd */
-                                uint64_t sz;
-
-                                /* Try to seal it if that makes
-                                 * sense. First, unmap our own map to
-                                 * make sure we don't keep it busy. */
-                                bus_body_part_unmap(part);
-
-                                /* Then, sync up real memfd size */
-                                sz = part->size;
-                                r = memfd_set_size(part->memfd, sz);
-                                if (r < 0)
-                                        return r;
-
-                                /* Finally, try to seal */
-                                if (memfd_set_sealed(part->memfd) >= 0)
-                                        part->sealed = true;
-                        }
-        }
-
         m->root_container.end = m->user_body_size;
         m->root_container.index = 0;
         m->root_container.offset_index = 0;
@@ -5100,6 +5251,103 @@ static int message_skip_fields(
         }
 }
 
+static int message_attach_memfd_parts(sd_bus_message *m) {
+        const uint64_t *q = m->memfd_parts_field;
+        uint64_t body_size = 0;
+        size_t consumed = 0, inline_size;
+        uint8_t *inline_data;
+        unsigned i;
+
+        assert(m);
+        assert(m->n_memfd_parts > 0);
+
+        /* Rebuilds the body from the inline data we read from the socket, and the memfds passed
+         * along with it. The memfds are only mapped (read-only) when the respective part is
+         * actually accessed. */
+
+        if (m->n_memfd_parts > m->n_fds)
+                return -EBADMSG;
+
+        inline_data = m->n_body_parts > 0 ? m->body.data : NULL;
+        inline_size = m->n_body_parts > 0 ? m->body.size : 0;
+        m->n_body_parts = 0;
+
+        for (i = 0; i < m->n_memfd_parts; i++) {
+                uint64_t offset, memfd_offset, size, real_size;
+                struct bus_body_part *part;
+                int fd, r;
+
+                offset = BUS_MESSAGE_BSWAP64(m, q[i*3]);
+                memfd_offset = BUS_MESSAGE_BSWAP64(m, q[i*3+1]);
+                size = BUS_MESSAGE_BSWAP64(m, q[i*3+2]);
+
+                if (offset < body_size || offset - body_size > inline_size - consumed)
+                        return -EBADMSG;
+                if (size <= 0 || size > (uint32_t) -1 - offset)
+                        return -EBADMSG;
+
+                if (offset > body_size) {
+                        part = message_append_part(m);
+                        if (!part)
+                                return -ENOMEM;
+
+                        part->data = inline_data + consumed;
+                        part->size = offset - body_size;
+                        part->sealed = true;
+
+                        consumed += part->size;
+                }
+
+                /* Only accept memfds whose contents cannot change under our feet anymore */
+                fd = m->fds[m->n_fds - m->n_memfd_parts + i];
+
+                r = memfd_get_sealed(fd);
+                if (r < 0)
+                        return r == -EINVAL ? -EBADMSG : r;
+                if (r == 0)
+                        return -EBADMSG;
+
+                r = memfd_get_size(fd, &real_size);
+                if (r < 0)
+                        return r;
+                if (memfd_offset > real_size || size > real_size - memfd_offset)
+                        return -EBADMSG;
+
+                part = message_append_part(m);
+                if (!part)
+                        return -ENOMEM;
+
+                part->memfd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+                if (part->memfd < 0)
+                        return -errno;
+
+                part->memfd_offset = memfd_offset;
+                part->size = size;
+                part->sealed = true;
+                part->memfd_passed = true;
+
+                m->memfd_parts_size += size;
+                body_size = offset + size;
+        }
+
+        if (consumed < inline_size) {
+                struct bus_body_part *part;
+
+                part = message_append_part(m);
+                if (!part)
+                        return -ENOMEM;
+
+                part->data = inline_data + consumed;
+                part->size = inline_size - consumed;
+                part->sealed = true;
+        }
+
+        m->body_size += m->memfd_parts_size;
+        m->user_body_size = m->body_size;
+
+        return 0;
+}
+
 int bus_message_parse_fields(sd_bus_message *m) {
         size_t ri;
         int r;
@@ -5403,6 +5651,33 @@ int bus_message_parse_fields(sd_bus_message *m) {
                         unix_fds_set = true;
                         break;
 
+                case BUS_MESSAGE_HEADER_MEMFDS: {
+                        uint32_t *l;
+
+                        if (BUS_MESSAGE_IS_GVARIANT(m))
+                                return -EBADMSG;
+
+                        if (m->memfd_parts_field)
+                                return -EBADMSG;
+
+                        if (!m->bus->can_memfd)
+                                return -EBADMSG;
+
+                        if (!streq(signature, "a(ttt)"))
+                                return -EBADMSG;
+
+                        r = message_peek_fields(m, &ri, 4, 4, (void**) &l);
+                        if (r < 0)
+                                return r;
+
+                        m->n_memfd_parts = BUS_MESSAGE_BSWAP32(m, *l) / 24;
+                        if (m->n_memfd_parts <= 0 || m->n_memfd_parts * 24 != BUS_MESSAGE_BSWAP32(m, *l))
+                                return -EBADMSG;
+
+                        r = message_peek_fields(m, &ri, 8, m->n_memfd_parts * 24, (void**) &m->memfd_parts_field);
+                        break;
+                }
+
                 default:
                         if (!BUS_MESSAGE_IS_GVARIANT(m))
                                 r = message_skip_fields(m, &ri, (uint32_t) -1, (const char **) &signature);
@@ -5417,6 +5692,12 @@ int bus_message_parse_fields(sd_bus_message *m) {
         if (m->n_fds != unix_fds)
                 return -EBADMSG;
 
+        if (m->n_memfd_parts > 0) {
+                r = message_attach_memfd_parts(m);
+                if (r < 0)
+                        return r;
+        }
+
         switch (m->header->type) {
 
         case SD_BUS_MESSAGE_SIGNAL:
@@ -64,6 +64,7 @@ struct bus_body_part {
         bool munmap_this:1;
         bool sealed:1;
         bool is_zero:1;
+        bool memfd_passed:1;
 };
 
 struct sd_bus_message {
@@ -119,6 +120,11 @@ struct sd_bus_message {
         uint32_t n_fds;
         int *fds;
 
+        /* Body parts passed as memfds rather than inline, their fds are at the end of the fds array */
+        uint32_t n_memfd_parts;
+        size_t memfd_parts_size;
+        const void *memfd_parts_field;
+
         struct bus_container root_container, *containers;
         size_t n_containers;
         size_t containers_allocated;
@@ -170,6 +176,11 @@ static inline size_t BUS_MESSAGE_SIZE(sd_bus_message *m) {
                 m->body_size;
 }
 
+static inline size_t BUS_MESSAGE_WIRE_SIZE(sd_bus_message *m) {
+        /* The number of bytes actually written to the stream, i.e. without passed memfd parts */
+        return BUS_MESSAGE_SIZE(m) - m->memfd_parts_size;
+}
+
 static inline size_t BUS_MESSAGE_BODY_BEGIN(sd_bus_message *m) {
         return
                 sizeof(struct bus_header) +
@@ -94,6 +94,12 @@ enum {
         _BUS_MESSAGE_HEADER_MAX
 };
 
+/* Extension header field, only sent on connections that negotiated memfd passing during
+ * authentication. It lists the body parts that are not transferred inline but as sealed memfds,
+ * as "a(ttt)" of body offset, memfd offset and size. The memfds follow the regular fds, and are
+ * included in the BUS_MESSAGE_HEADER_UNIX_FDS count. */
+#define BUS_MESSAGE_HEADER_MEMFDS 0x6d
+
 /* RequestName parameters */
 
 enum  {
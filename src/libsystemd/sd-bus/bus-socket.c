@@ -43,6 +43,7 @@
 #include "signal-util.h"
 #include "stdio-util.h"
 #include "string-util.h"
+#include "unaligned.h"
 #include "user-util.h"
 #include "utf8.h"
 #include "util.h"
@@ -110,6 +111,10 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
                 goto fail;
 
         MESSAGE_FOREACH_PART(part, i, m)  {
+                /* Parts passed as memfd are not written to the stream */
+                if (part->memfd_passed)
+                        continue;
+
                 r = bus_body_part_map(part);
                 if (r < 0)
                         goto fail;
@@ -119,7 +124,7 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
                         goto fail;
         }
 
-        assert(n == m->n_iovec);
+        assert(n >= m->n_iovec);
 
         return 0;
 
@@ -178,15 +183,15 @@ static int bus_socket_write_auth(sd_bus *b) {
 }
 
 static int bus_socket_auth_verify_client(sd_bus *b) {
-        char *e, *f, *start;
+        char *e, *f, *g, *start;
         sd_id128_t peer;
         unsigned i;
         int r;
 
         assert(b);
 
-        /* We expect two response lines: "OK" and possibly
-         * "AGREE_UNIX_FD" */
+        /* We expect up to three response lines: "OK", and possibly
+         * "AGREE_UNIX_FD" and "AGREE_MEMFD" */
 
         e = memmem_safe(b->rbuffer, b->rbuffer_size, "\r\n", 2);
         if (!e)
@@ -203,6 +208,15 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                 start = e + 2;
         }
 
+        if (f && b->accept_memfd) {
+                g = memmem(f + 2, b->rbuffer_size - (f - (char*) b->rbuffer) - 2, "\r\n", 2);
+                if (!g)
+                        return 0;
+
+                start = g + 2;
+        } else
+                g = NULL;
+
         /* Nice! We got all the lines we need. First check the OK
          * line */
 
@@ -240,6 +254,14 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                         memcmp(e + 2, "AGREE_UNIX_FD",
                                STRLEN("AGREE_UNIX_FD")) == 0;
 
+        /* The memfd line is answered with "ERROR" by peers that don't know about it */
+        if (g)
+                b->can_memfd =
+                        b->can_fds &&
+                        (g - f == STRLEN("\r\nAGREE_MEMFD")) &&
+                        memcmp(f + 2, "AGREE_MEMFD",
+                               STRLEN("AGREE_MEMFD")) == 0;
+
         b->rbuffer_size -= (start - (char*) b->rbuffer);
         memmove(b->rbuffer, start, b->rbuffer_size);
 
@@ -485,6 +507,13 @@ static int bus_socket_auth_verify_server(sd_bus *b) {
                                 b->can_fds = true;
                                 r = bus_socket_auth_write(b, "AGREE_UNIX_FD\r\n");
                         }
+                } else if (line_equals(line, l, "NEGOTIATE_MEMFD")) {
+                        if (b->auth == _BUS_AUTH_INVALID || !b->accept_memfd || !b->can_fds)
+                                r = bus_socket_auth_write(b, "ERROR\r\n");
+                        else {
+                                b->can_memfd = true;
+                                r = bus_socket_auth_write(b, "AGREE_MEMFD\r\n");
+                        }
                 } else
                         r = bus_socket_auth_write(b, "ERROR\r\n");
 
@@ -653,7 +682,9 @@ static int bus_socket_start_auth_client(sd_bus *b) {
         if (!b->auth_buffer)
                 return -ENOMEM;
 
-        if (b->accept_fd)
+        if (b->accept_fd && b->accept_memfd)
+                auth_suffix = "\r\nNEGOTIATE_UNIX_FD\r\nNEGOTIATE_MEMFD\r\nBEGIN\r\n";
+        else if (b->accept_fd)
                 auth_suffix = "\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n";
         else
                 auth_suffix = "\r\nBEGIN\r\n";
@@ -683,6 +714,10 @@ int bus_socket_start_auth(sd_bus *b) {
                 if (sd_is_socket(b->output_fd, AF_UNIX, 0, 0) <= 0)
                         b->accept_fd = false;
 
+        /* memfds are passed like any other fd, hence require fd passing */
+        if (!b->accept_fd)
+                b->accept_memfd = false;
+
         if (b->is_server)
                 return bus_socket_read_auth(b);
         else
@@ -993,74 +1028,138 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
-int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+int bus_socket_write_message_batch(
+                sd_bus *bus,
+                sd_bus_message **messages,
+                size_t n_messages,
+                size_t *idx,
+                size_t *ret_n_written) {
+
+        sd_bus_message *first;
         struct iovec *iov;
+        size_t n_iovec = 0, n, i, written;
         ssize_t k;
-        size_t n;
         unsigned j;
         int r;
 
         assert(bus);
-        assert(m);
+        assert(messages);
+        assert(n_messages > 0);
         assert(idx);
+        assert(ret_n_written);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
-                return 0;
+        first = messages[0];
+        assert(*idx < BUS_MESSAGE_WIRE_SIZE(first));
 
-        r = bus_message_setup_iovec(m);
-        if (r < 0)
-                return r;
+        /* Gathers as many sealed messages from the specified array as possible into a single
+         * writev()/sendmsg(). File descriptors may only be passed along with the first message of a
+         * batch: the kernel attaches them to the first byte of the written data, and the receiver
+         * associates them with the message it is reading at that point. Hence, stop at the first
+         * following message that carries fds, and let it start the next batch. */
 
-        n = m->n_iovec * sizeof(struct iovec);
-        iov = alloca(n);
-        memcpy_safe(iov, m->iovec, n);
+        for (n = 0; n < n_messages; n++) {
+                sd_bus_message *m = messages[n];
+
+                if (n > 0 && m->n_fds > 0)
+                        break;
+
+                r = bus_message_setup_iovec(m);
+                if (r < 0)
+                        return r;
+
+                if (n > 0 && n_iovec + m->n_iovec > BUS_WRITE_BATCH_IOVEC_MAX)
+                        break;
+
+                n_iovec += m->n_iovec;
+        }
+
+        iov = newa(struct iovec, n_iovec);
+
+        for (i = 0, j = 0; i < n; i++) {
+                memcpy_safe(iov + j, messages[i]->iovec, messages[i]->n_iovec * sizeof(struct iovec));
+                j += messages[i]->n_iovec;
+        }
 
         j = 0;
         iovec_advance(iov, &j, *idx);
 
         if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
+                k = writev(bus->output_fd, iov, n_iovec);
         else {
                 struct msghdr mh = {
                         .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
+                        .msg_iovlen = n_iovec,
                 };
 
-                if (m->n_fds > 0 && *idx == 0) {
+                if (first->n_fds > 0 && *idx == 0) {
                         struct cmsghdr *control;
 
-                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * m->n_fds));
-                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
+                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * first->n_fds));
+                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * first->n_fds);
                         control->cmsg_level = SOL_SOCKET;
                         control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
+                        memcpy(CMSG_DATA(control), first->fds, sizeof(int) * first->n_fds);
                 }
 
                 k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
                 if (k < 0 && errno == ENOTSOCK) {
                         bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+                        k = writev(bus->output_fd, iov, n_iovec);
                 }
         }
 
         if (k < 0)
                 return errno == EAGAIN ? 0 : -errno;
 
-        *idx += (size_t) k;
+        /* Figure out how many messages made it out completely, and how far we got into the next one */
+        written = (size_t) k + *idx;
+        for (i = 0; i < n; i++) {
+                size_t sz;
+
+                sz = BUS_MESSAGE_WIRE_SIZE(messages[i]);
+                if (written < sz)
+                        break;
+
+                written -= sz;
+        }
+
+        *idx = written;
+        *ret_n_written = i;
         return 1;
 }
 
-static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
+int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+        size_t n_written;
+        int r;
+
+        assert(bus);
+        assert(m);
+        assert(idx);
+        assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
+
+        if (*idx >= BUS_MESSAGE_WIRE_SIZE(m))
+                return 0;
+
+        r = bus_socket_write_message_batch(bus, &m, 1, idx, &n_written);
+        if (r <= 0)
+                return r;
+
+        if (n_written > 0)
+                *idx = BUS_MESSAGE_WIRE_SIZE(m);
+
+        return 1;
+}
+
+static int message_size_need(const void *p, size_t size, size_t *need) {
         uint32_t a, b;
         uint8_t e;
         uint64_t sum;
 
-        assert(bus);
+        assert(p || size == 0);
         assert(need);
-        assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (bus->rbuffer_size < sizeof(struct bus_header)) {
+        if (size < sizeof(struct bus_header)) {
                 *need = sizeof(struct bus_header) + 8;
 
                 /* Minimum message size:
@@ -1082,10 +1181,10 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
                 return 0;
         }
 
-        a = ((const uint32_t*) bus->rbuffer)[1];
-        b = ((const uint32_t*) bus->rbuffer)[3];
+        a = unaligned_read_ne32((const uint8_t*) p + 4);
+        b = unaligned_read_ne32((const uint8_t*) p + 12);
 
-        e = ((const uint8_t*) bus->rbuffer)[0];
+        e = ((const uint8_t*) p)[0];
         if (e == BUS_LITTLE_ENDIAN) {
                 a = le32toh(a);
                 b = le32toh(b);
@@ -1103,53 +1202,251 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
         return 0;
 }
 
-static int bus_socket_make_message(sd_bus *bus, size_t size) {
+static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
+        assert(bus);
+        assert(need);
+        assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
+
+        return message_size_need(bus->rbuffer, bus->rbuffer_size, need);
+}
+
+static int message_peek_unix_fds(const uint8_t *p, size_t size, unsigned *ret) {
+        const struct bus_header *h = (const struct bus_header*) p;
+        size_t ri, end;
+        uint32_t fields_size;
+
+        assert(p);
+        assert(size >= sizeof(struct bus_header));
+        assert(ret);
+
+        /* Determines the number of file descriptors a dbus1 message expects, by scanning its header
+         * fields array for BUS_MESSAGE_HEADER_UNIX_FDS. This is needed to split up the fds received
+         * with a single read between the messages contained in it. Only fields with basic types are
+         * understood, for anything else -EOPNOTSUPP is returned. */
+
+        if (h->version != 1)
+                return -EOPNOTSUPP;
+
+        fields_size = h->endian == BUS_BIG_ENDIAN ? be32toh(h->dbus1.fields_size) : le32toh(h->dbus1.fields_size);
+        if (fields_size > size - sizeof(struct bus_header))
+                return -EBADMSG;
+
+        ri = sizeof(struct bus_header);
+        end = ri + fields_size;
+        *ret = 0;
+
+        while (ri < end) {
+                uint8_t field, l;
+                char type;
+                size_t sz, align;
+
+                ri = ALIGN_TO(ri, 8);
+                if (ri + 3 > end)
+                        return ri >= end ? 0 : -EBADMSG;
+
+                field = p[ri++];
+
+                /* The variant's signature must be a single basic type */
+                l = p[ri++];
+                if (l != 1 || ri + 2 > end)
+                        return -EOPNOTSUPP;
+                type = (char) p[ri];
+                ri += 2;
+
+                switch (type) {
+
+                case SD_BUS_TYPE_BYTE:
+                        align = sz = 1;
+                        break;
+
+                case SD_BUS_TYPE_INT16:
+                case SD_BUS_TYPE_UINT16:
+                        align = sz = 2;
+                        break;
+
+                case SD_BUS_TYPE_BOOLEAN:
+                case SD_BUS_TYPE_INT32:
+                case SD_BUS_TYPE_UINT32:
+                case SD_BUS_TYPE_UNIX_FD:
+                        align = sz = 4;
+                        break;
+
+                case SD_BUS_TYPE_INT64:
+                case SD_BUS_TYPE_UINT64:
+                case SD_BUS_TYPE_DOUBLE:
+                        align = sz = 8;
+                        break;
+
+                case SD_BUS_TYPE_STRING:
+                case SD_BUS_TYPE_OBJECT_PATH: {
+                        uint32_t n;
+
+                        ri = ALIGN_TO(ri, 4);
+                        if (ri + 4 > end)
+                                return -EBADMSG;
+
+                        n = unaligned_read_ne32(p + ri);
+                        n = h->endian == BUS_BIG_ENDIAN ? be32toh(n) : le32toh(n);
+
+                        align = 1;
+                        sz = 4 + (size_t) n + 1;
+                        break;
+                }
+
+                case SD_BUS_TYPE_SIGNATURE:
+                        if (ri >= end)
+                                return -EBADMSG;
+
+                        align = 1;
+                        sz = 1 + (size_t) p[ri] + 1;
+                        break;
+
+                default:
+                        return -EOPNOTSUPP;
+                }
+
+                ri = ALIGN_TO(ri, align);
+                if (sz > end || ri > end - sz)
+                        return -EBADMSG;
+
+                if (field == BUS_MESSAGE_HEADER_UNIX_FDS) {
+                        uint32_t n;
+
+                        if (type != SD_BUS_TYPE_UINT32)
+                                return -EBADMSG;
+
+                        n = unaligned_read_ne32(p + ri);
+                        *ret = h->endian == BUS_BIG_ENDIAN ? be32toh(n) : le32toh(n);
+                        return 0;
+                }
+
+                ri += sz;
+        }
+
+        return 0;
+}
+
+static int bus_socket_make_message(sd_bus *bus, size_t offset, size_t size) {
+        _cleanup_free_ int *remaining_fds = NULL;
         sd_bus_message *t;
+        unsigned n_fds;
         void *b;
         int r;
 
         assert(bus);
-        assert(bus->rbuffer_size >= size);
+        assert(bus->rbuffer_size >= offset + size);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
         r = bus_rqueue_make_room(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size > size) {
-                b = memdup((const uint8_t*) bus->rbuffer + size,
-                           bus->rbuffer_size - size);
+        /* If this message is the last complete data in the buffer, then all fds we collected so far
+         * belong to it. Otherwise, hand it exactly the number of fds it declares, and keep the rest
+         * for the messages following it. */
+        n_fds = bus->n_fds;
+        if (n_fds > 0 && offset + size < bus->rbuffer_size) {
+                unsigned n;
+
+                r = message_peek_unix_fds((const uint8_t*) bus->rbuffer + offset, size, &n);
+                if (r == -EBADMSG)
+                        return r;
+                if (r >= 0 && n < n_fds) {
+                        remaining_fds = newdup(int, bus->fds + n, bus->n_fds - n);
+                        if (!remaining_fds)
+                                return -ENOMEM;
+
+                        n_fds = n;
+                }
+        }
+
+        if (offset == 0 && size == bus->rbuffer_size) {
+                /* The common case: the buffer contains exactly one message, pass ownership of it, but
+                 * don't let the message pin the read-ahead space */
+                b = realloc(bus->rbuffer, size);
+                if (!b)
+                        b = bus->rbuffer;
+                bus->rbuffer = b;
+        } else {
+                b = memdup((const uint8_t*) bus->rbuffer + offset, size);
                 if (!b)
                         return -ENOMEM;
-        } else
-                b = NULL;
+        }
 
         r = bus_message_from_malloc(bus,
-                                    bus->rbuffer, size,
-                                    bus->fds, bus->n_fds,
+                                    b, size,
+                                    bus->fds, n_fds,
                                     NULL,
                                     &t);
         if (r < 0) {
-                free(b);
+                if (b != bus->rbuffer)
+                        free(b);
                 return r;
         }
 
-        bus->rbuffer = b;
-        bus->rbuffer_size -= size;
+        if (b == bus->rbuffer) {
+                bus->rbuffer = NULL;
+                bus->rbuffer_size = 0;
+        }
 
-        bus->fds = NULL;
-        bus->n_fds = 0;
+        if (remaining_fds) {
+                /* The message took ownership of the fds array, the rest continues in a new one */
+                bus->fds = remaining_fds;
+                bus->n_fds -= n_fds;
+                remaining_fds = NULL;
+        } else {
+                bus->fds = NULL;
+                bus->n_fds = 0;
+        }
 
         bus->rqueue[bus->rqueue_size++] = t;
 
         return 1;
 }
 
+static int bus_socket_make_messages(sd_bus *bus) {
+        size_t offset = 0, need;
+        int r, ret = 0;
+
+        assert(bus);
+
+        /* Turns all complete messages in the read buffer into message objects, and moves the remaining
+         * partial data to the beginning of the buffer */
+
+        while (bus->rbuffer) {
+                r = message_size_need((const uint8_t*) bus->rbuffer + offset, bus->rbuffer_size - offset, &need);
+                if (r < 0)
+                        return r;
+
+                if (bus->rbuffer_size - offset < need)
+                        break;
+
+                /* If the read queue ran full, leave the rest in the buffer for later, as long as we made
+                 * some progress. */
+                if (ret > 0 && bus->rqueue_size >= BUS_RQUEUE_MAX)
+                        break;
+
+                r = bus_socket_make_message(bus, offset, need);
+                if (r < 0)
+                        return r;
+
+                offset += need;
+                ret = 1;
+        }
+
+        if (offset > 0 && bus->rbuffer) {
+                memmove(bus->rbuffer, (const uint8_t*) bus->rbuffer + offset, bus->rbuffer_size - offset);
+                bus->rbuffer_size -= offset;
+        }
+
+        return ret;
+}
+
 int bus_socket_read_message(sd_bus *bus) {
         struct msghdr mh;
         struct iovec iov = {};
         ssize_t k;
-        size_t need;
+        size_t need, allocate;
         int r;
         void *b;
         union {
@@ -1166,16 +1463,21 @@ int bus_socket_read_message(sd_bus *bus) {
                 return r;
 
         if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+                return bus_socket_make_messages(bus);
+
+        /* Read a bit more than the current message needs, so that a burst of small messages queued by
+         * the peer is picked up with a single syscall. For large messages read exactly what is
+         * missing, so that the message buffer can be passed on without copying. */
+        allocate = need < BUS_READ_AHEAD_SIZE ? BUS_READ_AHEAD_SIZE : need;
 
-        b = realloc(bus->rbuffer, need);
+        b = realloc(bus->rbuffer, allocate);
         if (!b)
                 return -ENOMEM;
 
         bus->rbuffer = b;
 
         iov.iov_base = (uint8_t*) bus->rbuffer + bus->rbuffer_size;
-        iov.iov_len = need - bus->rbuffer_size;
+        iov.iov_len = allocate - bus->rbuffer_size;
 
         if (bus->prefer_readv)
                 k = readv(bus->input_fd, &iov, 1);
@@ -1238,7 +1540,7 @@ int bus_socket_read_message(sd_bus *bus) {
                 return r;
 
         if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+                return bus_socket_make_messages(bus);
 
         return 1;
 }
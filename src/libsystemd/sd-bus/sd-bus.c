@@ -257,6 +257,7 @@ _public_ int sd_bus_new(sd_bus **ret) {
         r->message_version = 1;
         r->creds_mask |= SD_BUS_CREDS_WELL_KNOWN_NAMES|SD_BUS_CREDS_UNIQUE_NAME;
         r->accept_fd = true;
+        r->use_memfd = 1;
         r->original_pid = getpid_cached();
         r->n_groups = (size_t) -1;
 
@@ -365,6 +366,16 @@ _public_ int sd_bus_negotiate_fds(sd_bus *bus, int b) {
         return 0;
 }
 
+_public_ int sd_bus_negotiate_memfd(sd_bus *bus, int b) {
+        assert_return(bus, -EINVAL);
+        assert_return(bus = bus_resolve(bus), -ENOPKG);
+        assert_return(bus->state == BUS_UNSET, -EPERM);
+        assert_return(!bus_pid_changed(bus), -ECHILD);
+
+        bus->accept_memfd = b;
+        return 0;
+}
+
 _public_ int sd_bus_negotiate_timestamp(sd_bus *bus, int b) {
         assert_return(bus, -EINVAL);
         assert_return(bus = bus_resolve(bus), -ENOPKG);
@@ -487,6 +498,18 @@ _public_ int sd_bus_get_connected_signal(sd_bus *bus) {
         return bus->connected_signal;
 }
 
+int bus_set_coalesce_writes(sd_bus *bus, bool b) {
+        assert(bus);
+
+        /* When enabled, sd_bus_send() never writes to the socket directly, but always appends to the
+         * write queue. The queue is then flushed in as few syscalls as possible the next time the bus
+         * is processed or flushed, or, if the bus is attached to an event loop, before the event loop
+         * goes to sleep the next time. This is useful for senders that generate bursts of messages. */
+
+        bus->coalesce_writes = b;
+        return 0;
+}
+
 static int synthesize_connected_signal(sd_bus *bus) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
         int r;
@@ -1659,6 +1682,10 @@ static int bus_remarshal_message(sd_bus *b, sd_bus_message **m) {
         if (b->message_endian != 0 && b->message_endian != (*m)->header->endian)
                 remarshal = true;
 
+        /* body parts passed as memfd, but the peer didn't agree to that */
+        if ((*m)->n_memfd_parts > 0 && !b->can_memfd)
+                remarshal = true;
+
         return remarshal ? bus_message_remarshal(b, m) : 0;
 }
 
@@ -1686,6 +1713,23 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m) {
         return sd_bus_message_seal(m, 0xFFFFFFFFULL, 0);
 }
 
+static void bus_log_sent_message(sd_bus_message *m) {
+        assert(m);
+
+        log_debug("Sent message type=%s sender=%s destination=%s path=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " signature=%s error-name=%s error-message=%s",
+                  bus_message_type_to_string(m->header->type),
+                  strna(sd_bus_message_get_sender(m)),
+                  strna(sd_bus_message_get_destination(m)),
+                  strna(sd_bus_message_get_path(m)),
+                  strna(sd_bus_message_get_interface(m)),
+                  strna(sd_bus_message_get_member(m)),
+                  BUS_MESSAGE_COOKIE(m),
+                  m->reply_cookie,
+                  strna(m->root_container.signature),
+                  strna(m->error.name),
+                  strna(m->error.message));
+}
+
 static int bus_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         int r;
 
@@ -1696,19 +1740,8 @@ static int bus_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         if (r <= 0)
                 return r;
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
-                log_debug("Sent message type=%s sender=%s destination=%s path=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " signature=%s error-name=%s error-message=%s",
-                          bus_message_type_to_string(m->header->type),
-                          strna(sd_bus_message_get_sender(m)),
-                          strna(sd_bus_message_get_destination(m)),
-                          strna(sd_bus_message_get_path(m)),
-                          strna(sd_bus_message_get_interface(m)),
-                          strna(sd_bus_message_get_member(m)),
-                          BUS_MESSAGE_COOKIE(m),
-                          m->reply_cookie,
-                          strna(m->root_container.signature),
-                          strna(m->error.name),
-                          strna(m->error.message));
+        if (*idx >= BUS_MESSAGE_WIRE_SIZE(m))
+                bus_log_sent_message(m);
 
         return r;
 }
@@ -1720,15 +1753,17 @@ static int dispatch_wqueue(sd_bus *bus) {
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
         while (bus->wqueue_size > 0) {
+                size_t n = 0, i;
 
-                r = bus_write_message(bus, bus->wqueue[0], &bus->windex);
+                /* Write out as many queued messages as we can with a single syscall */
+                r = bus_socket_write_message_batch(bus, bus->wqueue, bus->wqueue_size, &bus->windex, &n);
                 if (r < 0)
                         return r;
                 else if (r == 0)
                         /* Didn't do anything this time */
                         return ret;
-                else if (bus->windex >= BUS_MESSAGE_SIZE(bus->wqueue[0])) {
-                        /* Fully written. Let's drop the entry from
+                else if (n > 0) {
+                        /* Fully written. Let's drop the entries from
                          * the queue.
                          *
                          * This isn't particularly optimized, but
@@ -1738,10 +1773,13 @@ static int dispatch_wqueue(sd_bus *bus) {
                          * it got full, then all bets are off
                          * anyway. */
 
-                        bus->wqueue_size--;
-                        sd_bus_message_unref(bus->wqueue[0]);
-                        memmove(bus->wqueue, bus->wqueue + 1, sizeof(sd_bus_message*) * bus->wqueue_size);
-                        bus->windex = 0;
+                        for (i = 0; i < n; i++) {
+                                bus_log_sent_message(bus->wqueue[i]);
+                                sd_bus_message_unref(bus->wqueue[i]);
+                        }
+
+                        bus->wqueue_size -= n;
+                        memmove(bus->wqueue, bus->wqueue + n, sizeof(sd_bus_message*) * bus->wqueue_size);
 
                         ret = 1;
                 }
@@ -1842,7 +1880,7 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
         if (m->dont_send)
                 goto finish;
 
-        if (IN_SET(bus->state, BUS_RUNNING, BUS_HELLO) && bus->wqueue_size <= 0) {
+        if (IN_SET(bus->state, BUS_RUNNING, BUS_HELLO) && bus->wqueue_size <= 0 && !bus->coalesce_writes) {
                 size_t idx = 0;
 
                 r = bus_write_message(bus, m, &idx);
@@ -1855,7 +1893,7 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
                         return r;
                 }
 
-                if (idx < BUS_MESSAGE_SIZE(m))  {
+                if (idx < BUS_MESSAGE_WIRE_SIZE(m))  {
                         /* Wasn't fully written. So let's remember how
                          * much was written. Note that the first entry
                          * of the wqueue array is always allocated so
@@ -1867,7 +1905,8 @@ _public_ int sd_bus_send(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie) {
                 }
 
         } else {
-                /* Just append it to the queue. */
+                /* Just append it to the queue. If write coalescing is enabled this is where all messages
+                 * go, and they are written out in batches the next time the queue is dispatched. */
 
                 if (bus->wqueue_size >= BUS_WQUEUE_MAX)
                         return -ENOBUFS;
@@ -3350,6 +3389,13 @@ static int prepare_callback(sd_event_source *s, void *userdata) {
         assert(s);
         assert(bus);
 
+        /* Before we go to sleep, flush out what was queued up for coalescing since the last iteration */
+        if (bus->coalesce_writes && bus->wqueue_size > 0 && IN_SET(bus->state, BUS_RUNNING, BUS_HELLO)) {
+                r = dispatch_wqueue(bus);
+                if (r < 0)
+                        goto fail;
+        }
+
         e = sd_bus_get_events(bus);
         if (e < 0) {
                 r = e;
@@ -32,6 +32,7 @@
 #include "util.h"
 
 #define MAX_SIZE (2*1024*1024)
+#define BURST_SIZE 64
 
 static usec_t arg_loop_usec = 100 * USEC_PER_MSEC;
 
@@ -56,6 +57,8 @@ static void server(sd_bus *b, size_t *result) {
 
                 if (sd_bus_message_is_method_call(m, "benchmark.server", "Ping"))
                         assert_se(sd_bus_reply_method_return(m, NULL) >= 0);
+                else if (sd_bus_message_is_method_call(m, "benchmark.server", "Nop"))
+                        ;
                 else if (sd_bus_message_is_method_call(m, "benchmark.server", "Work")) {
                         const void *p;
                         size_t sz;
@@ -89,7 +92,7 @@ static void transaction(sd_bus *b, size_t sz, const char *server_name) {
         assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
 }
 
-static void client_bisect(const char *address, const char *server_name) {
+static void client_bisect(Type type, const char *address, const char *server_name, int fd) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
         size_t lsize, rsize, csize;
         sd_bus *b;
@@ -98,7 +101,15 @@ static void client_bisect(const char *address, const char *server_name) {
         r = sd_bus_new(&b);
         assert_se(r >= 0);
 
-        r = sd_bus_set_address(b, address);
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_negotiate_memfd(b, true);
         assert_se(r >= 0);
 
         r = sd_bus_start(b);
@@ -183,6 +194,9 @@ static void client_chart(Type type, const char *address, const char *server_name
                 assert_se(r >= 0);
         }
 
+        r = sd_bus_negotiate_memfd(b, true);
+        assert_se(r >= 0);
+
         r = sd_bus_start(b);
         assert_se(r >= 0);
 
@@ -222,10 +236,88 @@ static void client_chart(Type type, const char *address, const char *server_name
         sd_bus_unref(b);
 }
 
+static unsigned burst(sd_bus *b, const char *server_name, bool coalesce) {
+        unsigned n;
+        usec_t t;
+
+        assert_se(bus_set_coalesce_writes(b, coalesce) >= 0);
+
+        t = now(CLOCK_MONOTONIC);
+        for (n = 0;;) {
+                unsigned i;
+
+                for (i = 0; i < BURST_SIZE; i++) {
+                        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                        assert_se(sd_bus_message_new_method_call(b, &m, server_name, "/", "benchmark.server", "Nop") >= 0);
+                        assert_se(sd_bus_message_append(m, "t", (uint64_t) n + i) >= 0);
+                        assert_se(sd_bus_send(b, m, NULL) >= 0);
+                }
+
+                assert_se(sd_bus_flush(b) >= 0);
+
+                n += BURST_SIZE;
+                if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                        break;
+        }
+
+        /* Wait until the server processed everything */
+        assert_se(sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL) >= 0);
+
+        return (unsigned) ((n * USEC_PER_SEC) / (now(CLOCK_MONOTONIC) - t));
+}
+
+static void client_throughput(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        unsigned n_single, n_coalesced;
+        sd_bus *b;
+        int r;
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+
+                r = sd_bus_set_bus_client(b, true);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        /* Sends bursts of small messages, once with one syscall per message, and once with the write
+         * queue coalesced into batches. Reports messages per second. */
+
+        printf("SINGLE\tCOALESCED\n");
+
+        n_single = burst(b, server_name, false);
+        printf("%u\t", n_single);
+
+        n_coalesced = burst(b, server_name, true);
+        printf("%u\n", n_coalesced);
+
+        assert_se(bus_set_coalesce_writes(b, false) >= 0);
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", (uint64_t) n_coalesced) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+
+        sd_bus_unref(b);
+}
+
 int main(int argc, char *argv[]) {
         enum {
                 MODE_BISECT,
                 MODE_CHART,
+                MODE_THROUGHPUT,
         } mode = MODE_BISECT;
         Type type = TYPE_LEGACY;
         int i, pair[2] = { -1, -1 };
@@ -242,6 +334,9 @@ int main(int argc, char *argv[]) {
                 if (streq(argv[i], "chart")) {
                         mode = MODE_CHART;
                         continue;
+                } else if (streq(argv[i], "throughput")) {
+                        mode = MODE_THROUGHPUT;
+                        continue;
                 } else if (streq(argv[i], "legacy")) {
                         type = TYPE_LEGACY;
                         continue;
@@ -276,6 +371,9 @@ int main(int argc, char *argv[]) {
 
                 r = sd_bus_set_server(b, true, SD_ID128_NULL);
                 assert_se(r >= 0);
+
+                r = sd_bus_negotiate_memfd(b, true);
+                assert_se(r >= 0);
         } else {
                 r = sd_bus_set_address(b, address);
                 assert_se(r >= 0);
@@ -311,12 +409,16 @@ int main(int argc, char *argv[]) {
 
                 switch (mode) {
                 case MODE_BISECT:
-                        client_bisect(address, server_name);
+                        client_bisect(type, address, server_name, pair[1]);
                         break;
 
                 case MODE_CHART:
                         client_chart(type, address, server_name, pair[1]);
                         break;
+
+                case MODE_THROUGHPUT:
+                        client_throughput(type, address, server_name, pair[1]);
+                        break;
                 }
 
                 _exit(EXIT_SUCCESS);
@@ -330,6 +432,8 @@ int main(int argc, char *argv[]) {
 
         if (mode == MODE_BISECT)
                 printf("Copying/memfd are equally fast at %zu bytes\n", result);
+        else if (mode == MODE_THROUGHPUT)
+                printf("Coalesced writes transferred %zu messages/s\n", result);
 
         assert_se(waitpid(pid, NULL, 0) == pid);
 
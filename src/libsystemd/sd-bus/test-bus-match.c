@@ -26,11 +26,15 @@
 #include "macro.h"
 
 static bool mask[32];
+static unsigned order[32];
+static size_t n_order;
 
 static int filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
         log_info("Ran %u", PTR_TO_UINT(userdata));
         assert_se(PTR_TO_UINT(userdata) < ELEMENTSOF(mask));
         mask[PTR_TO_UINT(userdata)] = true;
+        assert_se(n_order < ELEMENTSOF(order));
+        order[n_order++] = PTR_TO_UINT(userdata);
         return 0;
 }
 
@@ -75,6 +79,166 @@ static int match_add(sd_bus_slot *slots, struct bus_match_node *root, const char
         return r;
 }
 
+static void run_both(struct bus_match_node *root, sd_bus_message *m, unsigned expected[], size_t n_expected) {
+        unsigned indexed[ELEMENTSOF(order)];
+        size_t n_indexed, i;
+
+        /* Dispatch through the index and by walking the tree, both must invoke the same callbacks in
+         * the same order */
+
+        zero(mask);
+        n_order = 0;
+        assert_se(bus_match_run(NULL, root, m) == 0);
+        memcpy(indexed, order, sizeof(order));
+        n_indexed = n_order;
+
+        zero(mask);
+        n_order = 0;
+        assert_se(bus_match_run_tree(NULL, root, m) == 0);
+
+        for (i = 0; i < n_order; i++)
+                log_debug("tree: %u, index: %u", order[i], i < n_indexed ? indexed[i] : 0);
+
+        assert_se(n_indexed == n_order);
+        assert_se(memcmp(indexed, order, n_order * sizeof(unsigned)) == 0);
+        assert_se(mask_contains(expected, n_expected));
+}
+
+static sd_bus_message *new_signal(sd_bus *bus, const char *sender, const char *path, const char *interface, const char *member) {
+        sd_bus_message *m;
+
+        assert_se(sd_bus_message_new_signal(bus, &m, path, interface, member) >= 0);
+        if (sender)
+                assert_se(sd_bus_message_set_sender(m, sender) >= 0);
+
+        return m;
+}
+
+static void test_path_namespace(sd_bus *bus) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        sd_bus_message *m;
+        sd_bus_slot slots[10];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(match_add(slots, &root, "path_namespace='/'", 1) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/foo'", 2) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/foo/bar'", 3) >= 0);
+        assert_se(match_add(slots, &root, "path_namespace='/foobar'", 4) >= 0);
+        assert_se(match_add(slots, &root, "path='/foo/bar'", 5) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.b',path_namespace='/foo'", 6) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.c',path_namespace='/foo'", 7) >= 0);
+        assert_se(match_add(slots, &root, "member='M',path_namespace='/foo/bar'", 8) >= 0);
+        assert_se(match_add(slots, &root, "path='/foo/bar',path_namespace='/foo'", 9) >= 0);
+
+        m = new_signal(bus, NULL, "/foo/bar", "a.b", "M");
+        assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 2, 3, 5, 6, 8, 9 }, 7);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, NULL, "/foobar/baz", "a.c", "M");
+        assert_se(sd_bus_message_seal(m, 2, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 4 }, 2);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, NULL, "/foo", "a.c", "N");
+        assert_se(sd_bus_message_seal(m, 3, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 2, 7 }, 3);
+        sd_bus_message_unref(m);
+
+        bus_match_free(&root);
+}
+
+static void test_sender(sd_bus *bus) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        sd_bus_message *m;
+        sd_bus_slot slots[10];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(match_add(slots, &root, "sender='org.example.Foo'", 1) >= 0);
+        assert_se(match_add(slots, &root, "sender=':1.42'", 2) >= 0);
+        assert_se(match_add(slots, &root, "sender=':1.43'", 3) >= 0);
+        assert_se(match_add(slots, &root, "sender='org.example.Foo',interface='a.b'", 4) >= 0);
+        assert_se(match_add(slots, &root, "sender=':1.42',interface='a.b',member='M'", 5) >= 0);
+        assert_se(match_add(slots, &root, "sender='org.example.Bar',member='M'", 6) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.b'", 7) >= 0);
+
+        /* Without kdbus we don't know the well-known names of a unique name, so they match any */
+        m = new_signal(bus, ":1.42", "/", "a.b", "M");
+        assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 2, 4, 5, 6, 7 }, 6);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, "org.example.Foo", "/", "a.b", "M");
+        assert_se(sd_bus_message_seal(m, 2, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 4, 7 }, 3);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, "org.example.Bar", "/", "a.c", "M");
+        assert_se(sd_bus_message_seal(m, 3, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 6 }, 1);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, NULL, "/", "a.b", "M");
+        assert_se(sd_bus_message_seal(m, 4, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 7 }, 1);
+        sd_bus_message_unref(m);
+
+        bus_match_free(&root);
+}
+
+static void test_arg_has_namespace(sd_bus *bus) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        sd_bus_message *m;
+        sd_bus_slot slots[16];
+
+        log_info("/* %s */", __func__);
+
+        assert_se(match_add(slots, &root, "arg0namespace='org.foo'", 1) >= 0);
+        assert_se(match_add(slots, &root, "arg0namespace='org.foo.bar'", 2) >= 0);
+        assert_se(match_add(slots, &root, "arg0namespace='org.foobar'", 3) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='a'", 4) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='b'", 5) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='c'", 6) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.b',arg1has='b'", 7) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.b',arg1has='c'", 8) >= 0);
+        assert_se(match_add(slots, &root, "member='M',arg1has='a'", 9) >= 0);
+        assert_se(match_add(slots, &root, "arg0namespace='org.foo',arg1has='c'", 10) >= 0);
+        assert_se(match_add(slots, &root, "arg0namespace='org.foo',arg1has='a'", 11) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='a',arg2has='y'", 12) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='b',arg2has='x'", 13) >= 0);
+        assert_se(match_add(slots, &root, "arg1has='b',arg2has='y'", 14) >= 0);
+        assert_se(match_add(slots, &root, "interface='a.b'", 15) >= 0);
+
+        /* The callbacks for argNhas are invoked in the order of the array in the message */
+        m = new_signal(bus, NULL, "/", "a.b", "M");
+        assert_se(sd_bus_message_append(m, "sasas", "org.foo.bar.baz", 3, "c", "a", "b", 2, "y", "x") >= 0);
+        assert_se(sd_bus_message_seal(m, 1, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 2, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 }, 14);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, NULL, "/", "a.b", "M");
+        assert_se(sd_bus_message_append(m, "sasas", "org.foobar", 2, "b", "a", 1, "y") >= 0);
+        assert_se(sd_bus_message_seal(m, 2, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 3, 4, 5, 7, 9, 12, 14, 15 }, 8);
+        sd_bus_message_unref(m);
+
+        m = new_signal(bus, NULL, "/", "a.c", "N");
+        assert_se(sd_bus_message_append(m, "sas", "org.foo", 3, "a", "c", "b") >= 0);
+        assert_se(sd_bus_message_seal(m, 3, 0) >= 0);
+        run_both(&root, m, (unsigned[]) { 1, 4, 5, 6, 10, 11 }, 6);
+        sd_bus_message_unref(m);
+
+        bus_match_free(&root);
+}
+
 static void test_match_scope(const char *match, enum bus_match_scope scope) {
         struct bus_match_component *components = NULL;
         unsigned n_components = 0;
@@ -92,7 +256,7 @@ int main(int argc, char *argv[]) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
         _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
         enum bus_match_node_type i;
-        sd_bus_slot slots[19];
+        sd_bus_slot slots[21];
         int r;
 
         r = sd_bus_open_user(&bus);
@@ -117,6 +281,8 @@ int main(int argc, char *argv[]) {
         assert_se(match_add(slots, &root, "arg4has='pa'", 16) >= 0);
         assert_se(match_add(slots, &root, "arg4has='po'", 17) >= 0);
         assert_se(match_add(slots, &root, "arg4='pi'", 18) >= 0);
+        assert_se(match_add(slots, &root, "member='waldo',interface='bar.x',path='/foo/bar'", 19) >= 0);
+        assert_se(match_add(slots, &root, "member='waldo',interface='quux.x',path='/foo/bar'", 20) >= 0);
 
         bus_match_dump(&root, 0);
 
@@ -126,10 +292,11 @@ int main(int argc, char *argv[]) {
 
         zero(mask);
         assert_se(bus_match_run(NULL, &root, m) == 0);
-        assert_se(mask_contains((unsigned[]) { 9, 8, 7, 5, 10, 12, 13, 14, 15, 16, 17 }, 11));
+        assert_se(mask_contains((unsigned[]) { 9, 8, 7, 5, 10, 12, 13, 14, 15, 16, 17, 19 }, 12));
 
         assert_se(bus_match_remove(&root, &slots[8].match_callback) >= 0);
         assert_se(bus_match_remove(&root, &slots[13].match_callback) >= 0);
+        assert_se(bus_match_remove(&root, &slots[19].match_callback) >= 0);
 
         bus_match_dump(&root, 0);
 
@@ -149,6 +316,10 @@ int main(int argc, char *argv[]) {
 
         bus_match_free(&root);
 
+        test_path_namespace(bus);
+        test_sender(bus);
+        test_arg_has_namespace(bus);
+
         test_match_scope("interface='foobar'", BUS_MATCH_GENERIC);
         test_match_scope("", BUS_MATCH_GENERIC);
         test_match_scope("interface='org.freedesktop.DBus.Local'", BUS_MATCH_LOCAL);
@@ -20,13 +20,17 @@
 
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "sd-bus.h"
 
 #include "bus-internal.h"
+#include "bus-message.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "log.h"
 #include "macro.h"
+#include "memfd-util.h"
 #include "util.h"
 
 struct context {
@@ -37,8 +41,13 @@ struct context {
 
         bool client_anonymous_auth;
         bool server_anonymous_auth;
+
+        bool client_negotiate_memfd;
+        bool server_negotiate_memfd;
 };
 
+#define BLOB_SIZE (1024*1024)
+
 static void *server(void *p) {
         struct context *c = p;
         sd_bus *bus = NULL;
@@ -53,6 +62,7 @@ static void *server(void *p) {
         assert_se(sd_bus_set_server(bus, 1, id) >= 0);
         assert_se(sd_bus_set_anonymous(bus, c->server_anonymous_auth) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->server_negotiate_unix_fds) >= 0);
+        assert_se(sd_bus_negotiate_memfd(bus, c->server_negotiate_memfd) >= 0);
         assert_se(sd_bus_start(bus) >= 0);
 
         while (!quit) {
@@ -80,9 +90,22 @@ static void *server(void *p) {
                 log_info("Got message! member=%s", strna(sd_bus_message_get_member(m)));
 
                 if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Exit")) {
+                        bool memfd;
+                        const uint8_t *blob;
+                        size_t sz, i;
 
                         assert_se((sd_bus_can_send(bus, 'h') >= 1) == (c->server_negotiate_unix_fds && c->client_negotiate_unix_fds));
 
+                        memfd = c->server_negotiate_unix_fds && c->client_negotiate_unix_fds &&
+                                c->server_negotiate_memfd && c->client_negotiate_memfd;
+                        assert_se(bus->can_memfd == memfd);
+                        assert_se((m->n_memfd_parts > 0) == memfd);
+
+                        assert_se(sd_bus_message_read_array(m, 'y', (const void**) &blob, &sz) >= 0);
+                        assert_se(sz == BLOB_SIZE);
+                        for (i = 0; i < sz; i++)
+                                assert_se(blob[i] == (uint8_t) i);
+
                         r = sd_bus_message_new_method_return(m, &reply);
                         if (r < 0) {
                                 log_error_errno(r, "Failed to allocate return: %m");
@@ -126,11 +149,15 @@ static int client(struct context *c) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
         _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
         sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_close_ int fd = -1;
+        uint8_t *blob;
+        size_t i;
         int r;
 
         assert_se(sd_bus_new(&bus) >= 0);
         assert_se(sd_bus_set_fd(bus, c->fds[1], c->fds[1]) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->client_negotiate_unix_fds) >= 0);
+        assert_se(sd_bus_negotiate_memfd(bus, c->client_negotiate_memfd) >= 0);
         assert_se(sd_bus_set_anonymous(bus, c->client_anonymous_auth) >= 0);
         assert_se(sd_bus_start(bus) >= 0);
 
@@ -144,6 +171,19 @@ static int client(struct context *c) {
         if (r < 0)
                 return log_error_errno(r, "Failed to allocate method call: %m");
 
+        fd = memfd_new_and_map("test-blob", BLOB_SIZE, (void**) &blob);
+        if (fd < 0)
+                return log_error_errno(fd, "Failed to allocate memfd: %m");
+
+        for (i = 0; i < BLOB_SIZE; i++)
+                blob[i] = (uint8_t) i;
+
+        assert_se(munmap(blob, BLOB_SIZE) >= 0);
+
+        r = sd_bus_message_append_array_memfd(m, 'y', fd, 0, BLOB_SIZE);
+        if (r < 0)
+                return log_error_errno(r, "Failed to append array: %m");
+
         r = sd_bus_call(bus, m, 0, &error, &reply);
         if (r < 0) {
                 log_error("Failed to issue method call: %s", bus_error_message(&error, -r));
@@ -154,7 +194,8 @@ static int client(struct context *c) {
 }
 
 static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_fds,
-                    bool client_anonymous_auth, bool server_anonymous_auth) {
+                    bool client_anonymous_auth, bool server_anonymous_auth,
+                    bool client_negotiate_memfd, bool server_negotiate_memfd) {
 
         struct context c;
         pthread_t s;
@@ -169,6 +210,8 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
         c.server_negotiate_unix_fds = server_negotiate_unix_fds;
         c.client_anonymous_auth = client_anonymous_auth;
         c.server_anonymous_auth = server_anonymous_auth;
+        c.client_negotiate_memfd = client_negotiate_memfd;
+        c.server_negotiate_memfd = server_negotiate_memfd;
 
         r = pthread_create(&s, NULL, server, &c);
         if (r != 0)
@@ -192,26 +235,41 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
 int main(int argc, char *argv[]) {
         int r;
 
-        r = test_one(true, true, false, false);
+        r = test_one(true, true, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, false, false, false);
+        r = test_one(true, false, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, true, false, false);
+        r = test_one(false, true, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, false, false, false);
+        r = test_one(false, false, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, true);
+        r = test_one(true, true, true, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, false, true);
+        r = test_one(true, true, false, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, false);
+        r = test_one(true, true, true, false, false, false);
         assert_se(r == -EPERM);
 
+        r = test_one(true, true, false, false, true, true);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, false, false, true, false);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, false, false, false, true);
+        assert_se(r >= 0);
+
+        r = test_one(false, true, false, false, true, true);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, true, true, true, true);
+        assert_se(r >= 0);
+
         return EXIT_SUCCESS;
 }
@@ -0,0 +1,224 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sd-bus.h"
+
+#include "alloc-util.h"
+#include "bus-internal.h"
+#include "bus-message.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "log.h"
+#include "macro.h"
+#include "util.h"
+
+static void connect_pair(int pair[2], sd_bus **ret_server, sd_bus **ret_client) {
+        sd_bus *a, *b;
+        sd_id128_t id;
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) >= 0);
+        assert_se(sd_id128_randomize(&id) >= 0);
+
+        assert_se(sd_bus_new(&a) >= 0);
+        assert_se(sd_bus_set_fd(a, pair[0], pair[0]) >= 0);
+        assert_se(sd_bus_set_server(a, true, id) >= 0);
+        assert_se(sd_bus_negotiate_fds(a, true) >= 0);
+        assert_se(sd_bus_start(a) >= 0);
+
+        assert_se(sd_bus_new(&b) >= 0);
+        assert_se(sd_bus_set_fd(b, pair[1], pair[1]) >= 0);
+        assert_se(sd_bus_negotiate_fds(b, true) >= 0);
+        assert_se(sd_bus_start(b) >= 0);
+
+        while (a->state != BUS_RUNNING || b->state != BUS_RUNNING) {
+                assert_se(sd_bus_process(a, NULL) >= 0);
+                assert_se(sd_bus_process(b, NULL) >= 0);
+        }
+
+        assert_se(a->can_fds && b->can_fds);
+
+        *ret_server = a;
+        *ret_client = b;
+}
+
+static sd_bus_message *read_signal(sd_bus *bus) {
+        for (;;) {
+                sd_bus_message *m = NULL;
+                int r;
+
+                r = sd_bus_process(bus, &m);
+                assert_se(r >= 0);
+
+                if (m && sd_bus_message_is_signal(m, "org.freedesktop.systemd.test", "Fds"))
+                        return m;
+
+                sd_bus_message_unref(m);
+                if (r == 0)
+                        assert_se(sd_bus_wait(bus, (uint64_t) -1) >= 0);
+        }
+}
+
+static bool same_file(int a, int b) {
+        struct stat sta, stb;
+
+        assert_se(fstat(a, &sta) >= 0);
+        assert_se(fstat(b, &stb) >= 0);
+
+        return sta.st_dev == stb.st_dev && sta.st_ino == stb.st_ino;
+}
+
+static void test_split_fds(void) {
+        static const unsigned n_fds[] = { 2, 0, 1, 3, 0 };
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        _cleanup_free_ uint8_t *buffer = NULL;
+        int pipes[ELEMENTSOF(n_fds)][3][2], fds[6];
+        size_t size = 0, n_total = 0;
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(fds))];
+        } control = {};
+        struct iovec iov;
+        struct msghdr mh = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+        };
+        struct cmsghdr *cmsg;
+        sd_bus_message *sent[ELEMENTSOF(n_fds)];
+        sd_bus *a, *b;
+        unsigned i, j;
+
+        log_info("/* %s */", __func__);
+
+        /* Several messages with fds, written with a single sendmsg() the way a peer coalescing its
+         * writes might do it. They arrive with a single read, and each message must get exactly the
+         * fds it declares. Every fd refers to its own pipe, so that they can be told apart. */
+
+        connect_pair(pair, &a, &b);
+
+        for (i = 0; i < ELEMENTSOF(n_fds); i++) {
+                void *blob;
+                size_t sz;
+
+                assert_se(sd_bus_message_new_signal(b, &sent[i], "/", "org.freedesktop.systemd.test", "Fds") >= 0);
+                assert_se(sd_bus_message_append(sent[i], "u", i) >= 0);
+
+                for (j = 0; j < n_fds[i]; j++) {
+                        assert_se(pipe2(pipes[i][j], O_CLOEXEC) >= 0);
+                        assert_se(sd_bus_message_append(sent[i], "h", pipes[i][j][0]) >= 0);
+                }
+
+                assert_se(sd_bus_message_seal(sent[i], i + 1, 0) >= 0);
+                assert_se(sent[i]->n_fds == n_fds[i]);
+
+                assert_se(bus_message_get_blob(sent[i], &blob, &sz) >= 0);
+                assert_se(buffer = realloc(buffer, size + sz));
+                memcpy(buffer + size, blob, sz);
+                size += sz;
+                free(blob);
+
+                for (j = 0; j < sent[i]->n_fds; j++)
+                        fds[n_total++] = sent[i]->fds[j];
+        }
+
+        assert_se(n_total == ELEMENTSOF(fds));
+
+        iov = IOVEC_MAKE(buffer, size);
+        mh.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        assert_se(sendmsg(pair[1], &mh, MSG_NOSIGNAL) == (ssize_t) size);
+
+        for (i = 0; i < ELEMENTSOF(n_fds); i++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                uint32_t k;
+
+                m = read_signal(a);
+                assert_se(sd_bus_message_read(m, "u", &k) >= 0);
+                assert_se(k == i);
+                assert_se(m->n_fds == n_fds[i]);
+
+                for (j = 0; j < n_fds[i]; j++) {
+                        int fd;
+
+                        assert_se(sd_bus_message_read(m, "h", &fd) >= 0);
+                        assert_se(same_file(fd, pipes[i][j][1]));
+                        safe_close_pair(pipes[i][j]);
+                }
+
+                sd_bus_message_unref(sent[i]);
+        }
+
+        assert_se(a->n_fds == 0);
+
+        sd_bus_flush_close_unref(a);
+        sd_bus_flush_close_unref(b);
+        pair[0] = pair[1] = -1;
+}
+
+static void test_coalesced_writes(void) {
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        _cleanup_close_ int fd = -1;
+        sd_bus *a, *b;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        /* The same when the messages are queued and written in batches by sd-bus itself */
+
+        connect_pair(pair, &a, &b);
+        assert_se(bus_set_coalesce_writes(b, true) >= 0);
+
+        fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+
+        for (i = 0; i < 1000; i++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+
+                assert_se(sd_bus_message_new_signal(b, &m, "/", "org.freedesktop.systemd.test", "Fds") >= 0);
+                assert_se(sd_bus_message_append(m, "u", i) >= 0);
+                if (i % 7 == 3)
+                        assert_se(sd_bus_message_append(m, "hh", fd, fd) >= 0);
+                else if (i % 5 == 0)
+                        assert_se(sd_bus_message_append(m, "h", fd) >= 0);
+
+                assert_se(sd_bus_send(b, m, NULL) >= 0);
+
+                if (i % 50 == 0)
+                        assert_se(sd_bus_flush(b) >= 0);
+        }
+
+        assert_se(sd_bus_flush(b) >= 0);
+
+        for (i = 0; i < 1000; i++) {
+                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                uint32_t k;
+
+                m = read_signal(a);
+                assert_se(sd_bus_message_read(m, "u", &k) >= 0);
+                assert_se(k == i);
+                assert_se(m->n_fds == (i % 7 == 3 ? 2 : i % 5 == 0 ? 1 : 0));
+        }
+
+        sd_bus_flush_close_unref(a);
+        sd_bus_flush_close_unref(b);
+        pair[0] = pair[1] = -1;
+}
+
+int main(int argc, char *argv[]) {
+        log_parse_environment();
+        log_open();
+
+        test_split_fds();
+        test_coalesced_writes();
+
+        return 0;
+}
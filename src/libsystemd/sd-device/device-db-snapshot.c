@@ -0,0 +1,624 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "device-db-snapshot.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "path-util.h"
+#include "refcnt.h"
+#include "string-util.h"
+#include "strv.h"
+#include "util.h"
+
+/*
+ * A compact copy of all of udev's database files in /run/udev/data/, written by udevd whenever its event queue runs
+ * empty. sd-device maps it and finds database entries with a binary search, instead of opening and reading a file
+ * for every device.
+ *
+ * A snapshot is never modified once written, except for the invalidation counter in its header: whatever changes a
+ * database file afterwards increments it, and from then on the snapshot is ignored until udevd replaces it. Each
+ * snapshot carries a generation number one higher than the one it replaced.
+ */
+
+static const uint8_t snapshot_signature[8] = { 'U', 'D', 'E', 'V', 'D', 'B', 'S', 'N' };
+
+struct snapshot_header {
+        uint8_t signature[8];
+        uint64_t generation;
+        uint64_t invalidated;           /* updated in place, see device_db_snapshot_invalidate() */
+        uint64_t n_entries;             /* sorted by id */
+        uint64_t entries_off;
+        uint64_t file_size;
+};
+
+struct snapshot_entry {
+        uint64_t id_off;
+        uint64_t data_off;              /* the contents of the database file, NUL-terminated */
+        uint64_t data_size;
+};
+
+struct DeviceDbSnapshot {
+        RefCount n_ref;
+        void *map;
+        size_t map_size;
+        dev_t dev;
+        ino_t ino;
+};
+
+static pthread_mutex_t current_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DeviceDbSnapshot *current = NULL;
+
+static inline const struct snapshot_header *snapshot_header(DeviceDbSnapshot *s) {
+        return s->map;
+}
+
+static inline const struct snapshot_entry *snapshot_entries(DeviceDbSnapshot *s) {
+        return (const struct snapshot_entry *) ((const uint8_t *) s->map + snapshot_header(s)->entries_off);
+}
+
+static inline const char *snapshot_string(DeviceDbSnapshot *s, uint64_t off) {
+        return (const char *) s->map + off;
+}
+
+static bool snapshot_verify(const void *map, uint64_t size) {
+        const struct snapshot_header *h = map;
+        const struct snapshot_entry *entries;
+        const char *prev = NULL;
+        uint64_t i;
+
+        if (memcmp(h->signature, snapshot_signature, sizeof(h->signature)) != 0 ||
+            h->file_size != size ||
+            h->entries_off < sizeof(struct snapshot_header) ||
+            h->entries_off > size ||
+            h->n_entries > (size - h->entries_off) / sizeof(struct snapshot_entry))
+                return false;
+
+        /* Make sure all strings are terminated and in order once, so that lookups don't have to care */
+        entries = (const struct snapshot_entry *) ((const uint8_t *) map + h->entries_off);
+        for (i = 0; i < h->n_entries; i++) {
+                const char *id = (const char *) map + entries[i].id_off;
+
+                if (entries[i].id_off >= size || !memchr(id, 0, size - entries[i].id_off))
+                        return false;
+                if (entries[i].data_off >= size || entries[i].data_size >= size - entries[i].data_off ||
+                    ((const char *) map)[entries[i].data_off + entries[i].data_size] != 0)
+                        return false;
+                if (prev && strcmp(prev, id) >= 0)
+                        return false;
+
+                prev = id;
+        }
+
+        return true;
+}
+
+int device_db_snapshot_open(const char *path, DeviceDbSnapshot **ret) {
+        _cleanup_close_ int fd = -1;
+        DeviceDbSnapshot *s;
+        struct stat st;
+        void *map;
+
+        assert(path);
+        assert(ret);
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if ((size_t) st.st_size < sizeof(struct snapshot_header))
+                return -EBADMSG;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        if (!snapshot_verify(map, st.st_size)) {
+                munmap(map, st.st_size);
+                return -EBADMSG;
+        }
+
+        s = new0(DeviceDbSnapshot, 1);
+        if (!s) {
+                munmap(map, st.st_size);
+                return -ENOMEM;
+        }
+
+        s->n_ref = REFCNT_INIT;
+        s->map = map;
+        s->map_size = st.st_size;
+        s->dev = st.st_dev;
+        s->ino = st.st_ino;
+
+        *ret = s;
+        return 0;
+}
+
+DeviceDbSnapshot *device_db_snapshot_ref(DeviceDbSnapshot *s) {
+        if (!s)
+                return NULL;
+
+        assert_se(REFCNT_INC(s->n_ref) >= 2);
+
+        return s;
+}
+
+DeviceDbSnapshot *device_db_snapshot_unref(DeviceDbSnapshot *s) {
+        if (!s)
+                return NULL;
+
+        if (REFCNT_DEC(s->n_ref) > 0)
+                return NULL;
+
+        munmap(s->map, s->map_size);
+        return mfree(s);
+}
+
+bool device_db_snapshot_is_valid(DeviceDbSnapshot *s) {
+        assert(s);
+
+        /* The counter is changed by other processes through their own mapping of the file */
+        return __atomic_load_n(&snapshot_header(s)->invalidated, __ATOMIC_ACQUIRE) == 0;
+}
+
+uint64_t device_db_snapshot_get_generation(DeviceDbSnapshot *s) {
+        assert(s);
+
+        return snapshot_header(s)->generation;
+}
+
+size_t device_db_snapshot_get_n_entries(DeviceDbSnapshot *s) {
+        assert(s);
+
+        return snapshot_header(s)->n_entries;
+}
+
+static const struct snapshot_entry *snapshot_find(DeviceDbSnapshot *s, const char *id) {
+        const struct snapshot_entry *entries = snapshot_entries(s);
+        uint64_t left = 0, right = snapshot_header(s)->n_entries;
+
+        while (left < right) {
+                uint64_t middle = left + (right - left) / 2;
+                int c;
+
+                c = strcmp(id, snapshot_string(s, entries[middle].id_off));
+                if (c == 0)
+                        return entries + middle;
+                if (c < 0)
+                        right = middle;
+                else
+                        left = middle + 1;
+        }
+
+        return NULL;
+}
+
+int device_db_snapshot_lookup(DeviceDbSnapshot *s, const char *id, char **ret_data, size_t *ret_size) {
+        const struct snapshot_entry *e;
+
+        assert(s);
+        assert(id);
+
+        /* Returns 1 and a copy of the database entry of the device if it has one, 0 if it has none, and -ESTALE if
+         * the snapshot cannot be trusted anymore */
+
+        if (!device_db_snapshot_is_valid(s))
+                return -ESTALE;
+
+        e = snapshot_find(s, id);
+        if (!e)
+                return 0;
+
+        if (ret_data) {
+                char *data;
+
+                data = memdup_suffix0(snapshot_string(s, e->data_off), e->data_size);
+                if (!data)
+                        return -ENOMEM;
+
+                *ret_data = data;
+        }
+
+        if (ret_size)
+                *ret_size = e->data_size;
+
+        return 1;
+}
+
+static bool data_has_tag(const char *data, size_t size, const char *tag) {
+        const char *p = data, *end = data + size;
+        size_t l;
+
+        l = strlen(tag);
+
+        while (p < end) {
+                const char *eol;
+
+                eol = memchr(p, '\n', end - p);
+                if (!eol)
+                        eol = end;
+
+                if ((size_t) (eol - p) == l + 2 && p[0] == 'G' && p[1] == ':' && memcmp(p + 2, tag, l) == 0)
+                        return true;
+
+                p = eol + 1;
+        }
+
+        return false;
+}
+
+int device_db_snapshot_get_tagged(DeviceDbSnapshot *s, const char *tag, char ***ret) {
+        _cleanup_strv_free_ char **ids = NULL;
+        const struct snapshot_entry *entries;
+        size_t n = 0, n_allocated = 0;
+        uint64_t i;
+
+        assert(s);
+        assert(tag);
+        assert(ret);
+
+        /* Returns the ids of all devices with the tag, in the same form as the entries of /run/udev/tags/<tag>/ */
+
+        if (!device_db_snapshot_is_valid(s))
+                return -ESTALE;
+
+        entries = snapshot_entries(s);
+        for (i = 0; i < snapshot_header(s)->n_entries; i++) {
+                if (!data_has_tag(snapshot_string(s, entries[i].data_off), entries[i].data_size, tag))
+                        continue;
+
+                if (!GREEDY_REALLOC(ids, n_allocated, n + 2))
+                        return -ENOMEM;
+
+                ids[n] = strdup(snapshot_string(s, entries[i].id_off));
+                if (!ids[n])
+                        return -ENOMEM;
+
+                ids[++n] = NULL;
+        }
+
+        if (!ids) {
+                ids = new0(char*, 1);
+                if (!ids)
+                        return -ENOMEM;
+        }
+
+        *ret = ids;
+        ids = NULL;
+
+        return 0;
+}
+
+DeviceDbSnapshot *device_db_snapshot_current(void) {
+        DeviceDbSnapshot *s = NULL;
+        struct stat st;
+
+        /* Returns a reference to the snapshot of the udev database, or NULL if there's no valid one. As long as the
+         * snapshot we have mapped stays valid, this is only a memory access. Once it was invalidated, the file
+         * system is only looked at to find out whether udevd has replaced it already. */
+
+        assert_se(pthread_mutex_lock(&current_mutex) == 0);
+
+        if (current && device_db_snapshot_is_valid(current)) {
+                s = device_db_snapshot_ref(current);
+                goto finish;
+        }
+
+        if (stat(DEVICE_DB_SNAPSHOT_PATH, &st) < 0) {
+                current = device_db_snapshot_unref(current);
+                goto finish;
+        }
+
+        if (current && current->dev == st.st_dev && current->ino == st.st_ino)
+                goto finish;
+
+        current = device_db_snapshot_unref(current);
+        if (device_db_snapshot_open(DEVICE_DB_SNAPSHOT_PATH, &current) < 0)
+                goto finish;
+
+        if (device_db_snapshot_is_valid(current))
+                s = device_db_snapshot_ref(current);
+
+finish:
+        assert_se(pthread_mutex_unlock(&current_mutex) == 0);
+        return s;
+}
+
+int device_db_read(const char *id, char **ret, size_t *ret_size) {
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *s = NULL;
+        const char *path;
+        int r;
+
+        assert(id);
+
+        /* Reads the database entry of a device, from the snapshot if possible, and from its file otherwise */
+
+        s = device_db_snapshot_current();
+        if (s) {
+                r = device_db_snapshot_lookup(s, id, ret, ret_size);
+                if (r > 0)
+                        return 0;
+                if (r == 0)
+                        return -ENOENT;
+        }
+
+        path = strjoina(DEVICE_DB_DIR "/", id);
+        return read_full_file(path, ret, ret_size);
+}
+
+struct snapshot_item {
+        char *id;
+        char *data;
+        size_t size;
+        bool borrowed;          /* points into the previous snapshot */
+};
+
+static int snapshot_item_compare(const void *a, const void *b) {
+        const struct snapshot_item *x = a, *y = b;
+
+        return strcmp(x->id, y->id);
+}
+
+static int snapshot_save(const char *path, uint64_t generation, uint64_t invalidated,
+                         const struct snapshot_item *items, size_t n_items) {
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ char *temp_path = NULL;
+        struct snapshot_header h = {
+                .generation = generation,
+                .invalidated = invalidated,
+                .n_entries = n_items,
+                .entries_off = sizeof(struct snapshot_header),
+        };
+        uint64_t off;
+        size_t i;
+        int r;
+
+        memcpy(h.signature, snapshot_signature, sizeof(h.signature));
+
+        off = h.entries_off + n_items * sizeof(struct snapshot_entry);
+        for (i = 0; i < n_items; i++)
+                off += strlen(items[i].id) + 1 + items[i].size + 1;
+        h.file_size = off;
+
+        r = fopen_temporary(path, &f, &temp_path);
+        if (r < 0)
+                return r;
+
+        (void) fchmod(fileno(f), 0644);
+
+        fwrite(&h, sizeof(h), 1, f);
+
+        off = h.entries_off + n_items * sizeof(struct snapshot_entry);
+        for (i = 0; i < n_items; i++) {
+                struct snapshot_entry e = {
+                        .id_off = off,
+                        .data_off = off + strlen(items[i].id) + 1,
+                        .data_size = items[i].size,
+                };
+
+                fwrite(&e, sizeof(e), 1, f);
+                off = e.data_off + e.data_size + 1;
+        }
+
+        for (i = 0; i < n_items; i++) {
+                fwrite(items[i].id, 1, strlen(items[i].id) + 1, f);
+                fwrite(items[i].data, 1, items[i].size, f);
+                fputc(0, f);
+        }
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto fail;
+
+        if (rename(temp_path, path) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        (void) unlink(temp_path);
+        return r;
+}
+
+static int id_compare(const void *a, const void *b) {
+        return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int snapshot_add_file(const char *db_dir, const char *id,
+                             struct snapshot_item **items, size_t *n_items, size_t *n_allocated) {
+        _cleanup_free_ char *p = NULL, *data = NULL, *copy = NULL;
+        size_t size;
+        int r;
+
+        p = path_join(NULL, db_dir, id);
+        if (!p)
+                return -ENOMEM;
+
+        r = read_full_file(p, &data, &size);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return r;
+
+        copy = strdup(id);
+        if (!copy)
+                return -ENOMEM;
+
+        if (!GREEDY_REALLOC(*items, *n_allocated, *n_items + 1))
+                return -ENOMEM;
+
+        (*items)[(*n_items)++] = (struct snapshot_item) {
+                .id = copy,
+                .data = data,
+                .size = size,
+        };
+        copy = data = NULL;
+
+        return 0;
+}
+
+static int snapshot_build(const char *db_dir, const char *path, bool full, char **changed) {
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *old = NULL;
+        _cleanup_strv_free_ char **sorted = NULL;
+        struct snapshot_item *items = NULL;
+        size_t n_items = 0, n_allocated = 0, i;
+        _cleanup_closedir_ DIR *d = NULL;
+        uint64_t generation = 1, invalidated;
+        struct dirent *de;
+        int r;
+
+        assert(db_dir);
+        assert(path);
+
+        /* Whatever changes database files after this point invalidates the snapshot at path. To notice changes made
+         * while we collect the files, make sure there is one to invalidate already, and remember its counter. */
+        r = device_db_snapshot_open(path, &old);
+        if (r < 0) {
+                r = snapshot_save(path, 0, 1, NULL, 0);
+                if (r < 0)
+                        return r;
+
+                r = device_db_snapshot_open(path, &old);
+                if (r < 0)
+                        return r;
+
+                /* Nothing to start from */
+                full = true;
+        } else
+                generation = device_db_snapshot_get_generation(old) + 1;
+
+        invalidated = __atomic_load_n(&snapshot_header(old)->invalidated, __ATOMIC_ACQUIRE);
+
+        if (full) {
+                d = opendir(db_dir);
+                if (!d && errno != ENOENT)
+                        return -errno;
+
+                if (d) {
+                        FOREACH_DIRENT(de, d, r = -errno; goto finish) {
+                                if (!dirent_is_file(de))
+                                        continue;
+
+                                r = snapshot_add_file(db_dir, de->d_name, &items, &n_items, &n_allocated);
+                                if (r < 0)
+                                        goto finish;
+                        }
+                }
+        } else {
+                const struct snapshot_entry *entries = snapshot_entries(old);
+                uint64_t n_entries = snapshot_header(old)->n_entries, j;
+
+                /* Take what didn't change from the previous snapshot, and read the files of what did */
+                sorted = strv_copy(changed);
+                if (!sorted)
+                        return -ENOMEM;
+                strv_sort(strv_uniq(sorted));
+
+                if (!GREEDY_REALLOC(items, n_allocated, n_entries + strv_length(sorted))) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                for (j = 0; j < n_entries; j++) {
+                        char *id = (char *) snapshot_string(old, entries[j].id_off);
+
+                        if (bsearch(&id, sorted, strv_length(sorted), sizeof(char *), id_compare))
+                                continue;
+
+                        items[n_items++] = (struct snapshot_item) {
+                                .id = id,
+                                .data = (char *) snapshot_string(old, entries[j].data_off),
+                                .size = entries[j].data_size,
+                                .borrowed = true,
+                        };
+                }
+
+                for (i = 0; sorted[i]; i++) {
+                        r = snapshot_add_file(db_dir, sorted[i], &items, &n_items, &n_allocated);
+                        if (r < 0)
+                                goto finish;
+                }
+        }
+
+        qsort_safe(items, n_items, sizeof(struct snapshot_item), snapshot_item_compare);
+
+        r = snapshot_save(path, generation, 0, items, n_items);
+        if (r < 0)
+                goto finish;
+
+        /* If a database file was changed while we were reading them, the new snapshot may be outdated already */
+        if (__atomic_load_n(&snapshot_header(old)->invalidated, __ATOMIC_ACQUIRE) != invalidated) {
+                (void) device_db_snapshot_invalidate(path);
+                r = 1;
+        } else
+                r = 0;
+
+finish:
+        for (i = 0; i < n_items; i++) {
+                if (items[i].borrowed)
+                        continue;
+
+                free(items[i].id);
+                free(items[i].data);
+        }
+        free(items);
+
+        return r;
+}
+
+int device_db_snapshot_write(const char *db_dir, const char *path) {
+
+        /* Writes a snapshot of all files in db_dir. Returns 1 if a file was changed meanwhile, and the snapshot
+         * is invalid right away. */
+
+        return snapshot_build(db_dir, path, true, NULL);
+}
+
+int device_db_snapshot_update(const char *db_dir, const char *path, char **changed) {
+
+        /* Like device_db_snapshot_write(), but only reads the files of the given ids, and takes everything else from
+         * the current snapshot. The ids need to cover all files changed since that was written. Writes a full
+         * snapshot if there's no usable one. */
+
+        return snapshot_build(db_dir, path, false, changed);
+}
+
+int device_db_snapshot_invalidate(const char *path) {
+        _cleanup_close_ int fd = -1;
+        struct snapshot_header *h;
+        struct stat st;
+
+        assert(path);
+
+        /* Marks the snapshot as out of date. Needs to be called whenever a database file was changed. */
+
+        fd = open(path, O_RDWR|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if ((size_t) st.st_size < sizeof(struct snapshot_header))
+                return 0;
+
+        h = mmap(NULL, sizeof(struct snapshot_header), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if (h == MAP_FAILED)
+                return -errno;
+
+        __atomic_add_fetch(&h->invalidated, 1, __ATOMIC_RELEASE);
+
+        munmap(h, sizeof(struct snapshot_header));
+        return 0;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+#define DEVICE_DB_DIR "/run/udev/data"
+#define DEVICE_DB_SNAPSHOT_PATH "/run/udev/data.bin"
+
+typedef struct DeviceDbSnapshot DeviceDbSnapshot;
+
+int device_db_snapshot_open(const char *path, DeviceDbSnapshot **ret);
+DeviceDbSnapshot *device_db_snapshot_ref(DeviceDbSnapshot *s);
+DeviceDbSnapshot *device_db_snapshot_unref(DeviceDbSnapshot *s);
+DEFINE_TRIVIAL_CLEANUP_FUNC(DeviceDbSnapshot*, device_db_snapshot_unref);
+
+bool device_db_snapshot_is_valid(DeviceDbSnapshot *s);
+uint64_t device_db_snapshot_get_generation(DeviceDbSnapshot *s);
+size_t device_db_snapshot_get_n_entries(DeviceDbSnapshot *s);
+
+int device_db_snapshot_lookup(DeviceDbSnapshot *s, const char *id, char **ret_data, size_t *ret_size);
+int device_db_snapshot_get_tagged(DeviceDbSnapshot *s, const char *tag, char ***ret);
+
+DeviceDbSnapshot *device_db_snapshot_current(void);
+int device_db_read(const char *id, char **ret, size_t *ret_size);
+
+int device_db_snapshot_write(const char *db_dir, const char *path);
+int device_db_snapshot_update(const char *db_dir, const char *path, char **changed);
+int device_db_snapshot_invalidate(const char *path);
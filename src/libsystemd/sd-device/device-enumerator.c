@@ -19,20 +19,24 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
+#include <signal.h>
+
 #include "sd-device.h"
 
 #include "alloc-util.h"
+#include "device-db-snapshot.h"
 #include "device-enumerator-private.h"
 #include "device-util.h"
 #include "dirent-util.h"
 #include "fd-util.h"
-#include "prioq.h"
 #include "set.h"
 #include "string-util.h"
 #include "strv.h"
 #include "util.h"
 
 #define DEVICE_ENUMERATE_MAX_DEPTH 256
+#define DEVICE_ENUMERATE_THREADS_MAX 16
 
 typedef enum DeviceEnumerationType {
         DEVICE_ENUMERATION_TYPE_DEVICES,
@@ -45,8 +49,13 @@ struct sd_device_enumerator {
         unsigned n_ref;
 
         DeviceEnumerationType type;
-        Prioq *devices;
+        sd_device **devices;
+        size_t n_devices, n_allocated, current_device_index;
         bool scan_uptodate;
+        bool sorted;
+
+        unsigned n_threads;
+        pthread_mutex_t *devices_lock;
 
         Set *match_subsystem;
         Set *nomatch_subsystem;
@@ -87,12 +96,12 @@ _public_ sd_device_enumerator *sd_device_enumerator_ref(sd_device_enumerator *en
 
 _public_ sd_device_enumerator *sd_device_enumerator_unref(sd_device_enumerator *enumerator) {
         if (enumerator && (-- enumerator->n_ref) == 0) {
-                sd_device *device;
+                size_t i;
 
-                while ((device = prioq_pop(enumerator->devices)))
-                        sd_device_unref(device);
+                for (i = 0; i < enumerator->n_devices; i++)
+                        sd_device_unref(enumerator->devices[i]);
 
-                prioq_free(enumerator->devices);
+                free(enumerator->devices);
 
                 set_free_free(enumerator->match_subsystem);
                 set_free_free(enumerator->nomatch_subsystem);
@@ -276,8 +285,16 @@ int device_enumerator_add_match_is_initialized(sd_device_enumerator *enumerator)
         return 0;
 }
 
+int device_enumerator_set_threads(sd_device_enumerator *enumerator, unsigned n_threads) {
+        assert_return(enumerator, -EINVAL);
+
+        enumerator->n_threads = MIN(n_threads, (unsigned) DEVICE_ENUMERATE_THREADS_MAX);
+
+        return 0;
+}
+
 static int device_compare(const void *_a, const void *_b) {
-        sd_device *a = (sd_device *)_a, *b = (sd_device *)_b;
+        sd_device *a = *(sd_device **)_a, *b = *(sd_device **)_b;
         const char *devpath_a, *devpath_b, *sound_a;
         bool delay_a, delay_b;
 
@@ -327,22 +344,36 @@ static int device_compare(const void *_a, const void *_b) {
 }
 
 int device_enumerator_add_device(sd_device_enumerator *enumerator, sd_device *device) {
-        int r;
+        int r = 0;
 
         assert_return(enumerator, -EINVAL);
         assert_return(device, -EINVAL);
 
-        r = prioq_ensure_allocated(&enumerator->devices, device_compare);
-        if (r < 0)
-                return r;
+        if (enumerator->devices_lock)
+                assert_se(pthread_mutex_lock(enumerator->devices_lock) == 0);
 
-        r = prioq_put(enumerator->devices, device, NULL);
-        if (r < 0)
-                return r;
+        if (GREEDY_REALLOC(enumerator->devices, enumerator->n_allocated, enumerator->n_devices + 1)) {
+                enumerator->devices[enumerator->n_devices++] = sd_device_ref(device);
+                enumerator->sorted = false;
+        } else
+                r = -ENOMEM;
 
-        sd_device_ref(device);
+        if (enumerator->devices_lock)
+                assert_se(pthread_mutex_unlock(enumerator->devices_lock) == 0);
 
-        return 0;
+        return r;
+}
+
+static void enumerator_unref_devices(sd_device_enumerator *enumerator) {
+        size_t i;
+
+        assert(enumerator);
+
+        for (i = 0; i < enumerator->n_devices; i++)
+                sd_device_unref(enumerator->devices[i]);
+
+        enumerator->n_devices = 0;
+        enumerator->current_device_index = 0;
 }
 
 static bool match_sysattr_value(sd_device *device, const char *sysattr, const char *match_value) {
@@ -586,11 +617,103 @@ static bool match_subsystem(sd_device_enumerator *enumerator, const char *subsys
         return false;
 }
 
+typedef struct DeviceScan {
+        sd_device_enumerator *enumerator;
+        const char *basedir;
+        char **subdirs;
+        size_t n_subdirs;
+        const char *subdir2;
+
+        pthread_mutex_t lock;
+        size_t next_subdir;
+        int r;
+} DeviceScan;
+
+static void *device_scan_thread(void *userdata) {
+        DeviceScan *scan = userdata;
+
+        assert(scan);
+
+        for (;;) {
+                size_t i;
+                int k;
+
+                assert_se(pthread_mutex_lock(&scan->lock) == 0);
+                i = scan->next_subdir < scan->n_subdirs ? scan->next_subdir++ : scan->n_subdirs;
+                assert_se(pthread_mutex_unlock(&scan->lock) == 0);
+
+                if (i >= scan->n_subdirs)
+                        break;
+
+                k = enumerator_scan_dir_and_add_devices(scan->enumerator, scan->basedir, scan->subdirs[i], scan->subdir2);
+                if (k < 0) {
+                        assert_se(pthread_mutex_lock(&scan->lock) == 0);
+                        scan->r = k;
+                        assert_se(pthread_mutex_unlock(&scan->lock) == 0);
+                }
+        }
+
+        return NULL;
+}
+
+static int enumerator_scan_subdirs(sd_device_enumerator *enumerator, const char *basedir, char **subdirs, size_t n_subdirs, const char *subdir2) {
+        DeviceScan scan = {
+                .enumerator = enumerator,
+                .basedir = basedir,
+                .subdirs = subdirs,
+                .n_subdirs = n_subdirs,
+                .subdir2 = subdir2,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+        };
+        pthread_t threads[DEVICE_ENUMERATE_THREADS_MAX];
+        unsigned n_threads = 0, i;
+
+        assert(enumerator);
+        assert(!enumerator->devices_lock);
+
+        /* Every subsystem directory is scanned by one thread at a time, the calling thread lends a hand. Each
+         * thread creates its own devices, only adding them to the enumerator is serialized. */
+        if (enumerator->n_threads > 1 && n_subdirs > 1) {
+                sigset_t ss, saved_ss;
+
+                /* No signals in the scanning threads, set the mask before creating them */
+                assert_se(sigfillset(&ss) >= 0);
+                if (pthread_sigmask(SIG_BLOCK, &ss, &saved_ss) == 0) {
+                        enumerator->devices_lock = &scan.lock;
+
+                        while (n_threads + 1 < MIN((size_t) enumerator->n_threads, n_subdirs)) {
+                                int r;
+
+                                r = pthread_create(&threads[n_threads], NULL, device_scan_thread, &scan);
+                                if (r > 0) {
+                                        log_debug_errno(r, "device-enumerator: failed to start scanning thread, continuing with %u: %m",
+                                                        n_threads + 1);
+                                        break;
+                                }
+
+                                n_threads++;
+                        }
+
+                        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                }
+        }
+
+        (void) device_scan_thread(&scan);
+
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        enumerator->devices_lock = NULL;
+
+        return scan.r;
+}
+
 static int enumerator_scan_dir(sd_device_enumerator *enumerator, const char *basedir, const char *subdir, const char *subsystem) {
         _cleanup_closedir_ DIR *dir = NULL;
+        _cleanup_strv_free_ char **subdirs = NULL;
+        size_t n_subdirs = 0, n_allocated = 0;
         char *path;
         struct dirent *dent;
-        int r = 0;
 
         path = strjoina("/sys/", basedir);
 
@@ -600,32 +723,136 @@ static int enumerator_scan_dir(sd_device_enumerator *enumerator, const char *bas
 
         log_debug("  device-enumerator: scanning %s", path);
 
+        /* Collect the subsystem directories first, so that they can be scanned in parallel. Subsystems that
+         * don't match are dropped here already, before looking at any of their devices. */
         FOREACH_DIRENT_ALL(dent, dir, return -errno) {
-                int k;
-
                 if (dent->d_name[0] == '.')
                         continue;
 
                 if (!match_subsystem(enumerator, subsystem ? : dent->d_name))
                         continue;
 
-                k = enumerator_scan_dir_and_add_devices(enumerator, basedir, dent->d_name, subdir);
-                if (k < 0)
-                        r = k;
+                if (!GREEDY_REALLOC(subdirs, n_allocated, n_subdirs + 2))
+                        return -ENOMEM;
+
+                subdirs[n_subdirs] = strdup(dent->d_name);
+                if (!subdirs[n_subdirs])
+                        return -ENOMEM;
+
+                subdirs[++n_subdirs] = NULL;
         }
 
-        return r;
+        return enumerator_scan_subdirs(enumerator, basedir, subdirs, n_subdirs, subdir);
+}
+
+static bool match_device_id(sd_device_enumerator *enumerator, const char *id) {
+        const char *sysname;
+        char *subsystem;
+
+        assert(enumerator);
+        assert(id);
+
+        /* The IDs of block devices and network interfaces tell the subsystem, the ones of devices without
+         * device node also the sysname. Devices that don't match can be skipped without looking at /sys. */
+        switch (id[0]) {
+
+        case 'b':
+                return match_subsystem(enumerator, "block");
+
+        case 'n':
+                return match_subsystem(enumerator, "net");
+
+        case '+':
+                sysname = strchr(id + 1, ':');
+                if (!sysname)
+                        return true;
+
+                subsystem = strndupa(id + 1, sysname - id - 1);
+                if (!match_subsystem(enumerator, subsystem))
+                        return false;
+
+                /* drivers have the subsystem of the bus in front of their name */
+                if (streq(subsystem, "drivers"))
+                        return true;
+
+                return match_sysname(enumerator, sysname + 1);
+
+        default:
+                return true;
+        }
+}
+
+static int enumerator_add_device_by_id(sd_device_enumerator *enumerator, const char *id) {
+        _cleanup_(sd_device_unrefp) sd_device *device = NULL;
+        const char *subsystem, *sysname;
+        int r;
+
+        assert(enumerator);
+        assert(id);
+
+        if (!match_device_id(enumerator, id))
+                return 0;
+
+        r = sd_device_new_from_device_id(&device, id);
+        if (r < 0)
+                /* this is necessarily racy, so ignore missing devices */
+                return r == -ENODEV ? 0 : r;
+
+        r = sd_device_get_subsystem(device, &subsystem);
+        if (r < 0)
+                return r;
+
+        if (!match_subsystem(enumerator, subsystem))
+                return 0;
+
+        r = sd_device_get_sysname(device, &sysname);
+        if (r < 0)
+                return r;
+
+        if (!match_sysname(enumerator, sysname))
+                return 0;
+
+        if (!match_parent(enumerator, device))
+                return 0;
+
+        if (!match_property(enumerator, device))
+                return 0;
+
+        if (!match_sysattr(enumerator, device))
+                return 0;
+
+        return device_enumerator_add_device(enumerator, device);
 }
 
 static int enumerator_scan_devices_tag(sd_device_enumerator *enumerator, const char *tag) {
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *snapshot = NULL;
         _cleanup_closedir_ DIR *dir = NULL;
         char *path;
         struct dirent *dent;
-        int r = 0;
+        int r = 0, k;
 
         assert(enumerator);
         assert(tag);
 
+        /* The tagged devices can be picked from the snapshot of the udev database without looking at the file
+         * system, as long as it's up-to-date */
+        snapshot = device_db_snapshot_current();
+        if (snapshot) {
+                _cleanup_strv_free_ char **ids = NULL;
+                char **id;
+
+                k = device_db_snapshot_get_tagged(snapshot, tag, &ids);
+                if (k >= 0) {
+                        STRV_FOREACH(id, ids) {
+                                k = enumerator_add_device_by_id(enumerator, *id);
+                                if (k < 0)
+                                        r = k;
+                        }
+
+                        return r;
+                }
+        }
+
         path = strjoina("/run/udev/tags/", tag);
 
         dir = opendir(path);
@@ -636,57 +863,13 @@ static int enumerator_scan_devices_tag(sd_device_enumerator *enumerator, const c
                         return log_error_errno(errno, "sd-device-enumerator: could not open tags directory %s: %m", path);
         }
 
-        /* TODO: filter away subsystems? */
-
         FOREACH_DIRENT_ALL(dent, dir, return -errno) {
-                _cleanup_(sd_device_unrefp) sd_device *device = NULL;
-                const char *subsystem, *sysname;
-                int k;
-
                 if (dent->d_name[0] == '.')
                         continue;
 
-                k = sd_device_new_from_device_id(&device, dent->d_name);
-                if (k < 0) {
-                        if (k != -ENODEV)
-                                /* this is necessarily racy, so ignore missing devices */
-                                r = k;
-
-                        continue;
-                }
-
-                k = sd_device_get_subsystem(device, &subsystem);
-                if (k < 0) {
-                        r = k;
-                        continue;
-                }
-
-                if (!match_subsystem(enumerator, subsystem))
-                        continue;
-
-                k = sd_device_get_sysname(device, &sysname);
-                if (k < 0) {
-                        r = k;
-                        continue;
-                }
-
-                if (!match_sysname(enumerator, sysname))
-                        continue;
-
-                if (!match_parent(enumerator, device))
-                        continue;
-
-                if (!match_property(enumerator, device))
-                        continue;
-
-                if (!match_sysattr(enumerator, device))
-                        continue;
-
-                k = device_enumerator_add_device(enumerator, device);
-                if (k < 0) {
+                k = enumerator_add_device_by_id(enumerator, dent->d_name);
+                if (k < 0)
                         r = k;
-                        continue;
-                }
         }
 
         return r;
@@ -836,7 +1019,6 @@ static int enumerator_scan_devices_all(sd_device_enumerator *enumerator) {
 }
 
 int device_enumerator_scan_devices(sd_device_enumerator *enumerator) {
-        sd_device *device;
         int r = 0, k;
 
         assert(enumerator);
@@ -845,8 +1027,7 @@ int device_enumerator_scan_devices(sd_device_enumerator *enumerator) {
             enumerator->type == DEVICE_ENUMERATION_TYPE_DEVICES)
                 return 0;
 
-        while ((device = prioq_pop(enumerator->devices)))
-                sd_device_unref(device);
+        enumerator_unref_devices(enumerator);
 
         if (!set_isempty(enumerator->match_tag)) {
                 k = enumerator_scan_devices_tags(enumerator);
@@ -878,7 +1059,7 @@ _public_ sd_device *sd_device_enumerator_get_device_first(sd_device_enumerator *
 
         enumerator->type = DEVICE_ENUMERATION_TYPE_DEVICES;
 
-        return prioq_peek(enumerator->devices);
+        return device_enumerator_get_first(enumerator);
 }
 
 _public_ sd_device *sd_device_enumerator_get_device_next(sd_device_enumerator *enumerator) {
@@ -888,13 +1069,10 @@ _public_ sd_device *sd_device_enumerator_get_device_next(sd_device_enumerator *e
             enumerator->type != DEVICE_ENUMERATION_TYPE_DEVICES)
                 return NULL;
 
-        sd_device_unref(prioq_pop(enumerator->devices));
-
-        return prioq_peek(enumerator->devices);
+        return device_enumerator_get_next(enumerator);
 }
 
 int device_enumerator_scan_subsystems(sd_device_enumerator *enumerator) {
-        sd_device *device;
         const char *subsysdir;
         int r = 0, k;
 
@@ -904,8 +1082,7 @@ int device_enumerator_scan_subsystems(sd_device_enumerator *enumerator) {
             enumerator->type == DEVICE_ENUMERATION_TYPE_SUBSYSTEMS)
                 return 0;
 
-        while ((device = prioq_pop(enumerator->devices)))
-                sd_device_unref(device);
+        enumerator_unref_devices(enumerator);
 
         /* modules */
         if (match_subsystem(enumerator, "module")) {
@@ -955,31 +1132,42 @@ _public_ sd_device *sd_device_enumerator_get_subsystem_first(sd_device_enumerato
 
         enumerator->type = DEVICE_ENUMERATION_TYPE_SUBSYSTEMS;
 
-        return prioq_peek(enumerator->devices);
+        return device_enumerator_get_first(enumerator);
 }
 
 _public_ sd_device *sd_device_enumerator_get_subsystem_next(sd_device_enumerator *enumerator) {
         assert_return(enumerator, NULL);
 
-        if (enumerator->scan_uptodate ||
+        if (!enumerator->scan_uptodate ||
             enumerator->type != DEVICE_ENUMERATION_TYPE_SUBSYSTEMS)
                 return NULL;
 
-        sd_device_unref(prioq_pop(enumerator->devices));
-
-        return prioq_peek(enumerator->devices);
+        return device_enumerator_get_next(enumerator);
 }
 
 sd_device *device_enumerator_get_first(sd_device_enumerator *enumerator) {
         assert_return(enumerator, NULL);
 
-        return prioq_peek(enumerator->devices);
+        /* The devices are sorted once, and stay around until the next scan, so the enumeration can be
+         * iterated over again without looking at /sys another time */
+        if (!enumerator->sorted) {
+                qsort_safe(enumerator->devices, enumerator->n_devices, sizeof(sd_device*), device_compare);
+                enumerator->sorted = true;
+        }
+
+        enumerator->current_device_index = 0;
+
+        if (enumerator->n_devices == 0)
+                return NULL;
+
+        return enumerator->devices[0];
 }
 
 sd_device *device_enumerator_get_next(sd_device_enumerator *enumerator) {
         assert_return(enumerator, NULL);
 
-        sd_device_unref(prioq_pop(enumerator->devices));
+        if (enumerator->current_device_index + 1 >= enumerator->n_devices)
+                return NULL;
 
-        return prioq_peek(enumerator->devices);
+        return enumerator->devices[++enumerator->current_device_index];
 }
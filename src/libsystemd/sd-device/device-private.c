@@ -26,6 +26,7 @@
 #include "sd-device.h"
 
 #include "alloc-util.h"
+#include "device-db-snapshot.h"
 #include "device-internal.h"
 #include "device-private.h"
 #include "device-util.h"
@@ -177,7 +178,6 @@ int device_ensure_usec_initialized(sd_device *device, sd_device *device_old) {
 
 static int device_read_db(sd_device *device) {
         _cleanup_free_ char *db = NULL;
-        char *path;
         const char *id, *value;
         char key;
         size_t db_len;
@@ -201,14 +201,12 @@ static int device_read_db(sd_device *device) {
         if (r < 0)
                 return r;
 
-        path = strjoina("/run/udev/data/", id);
-
-        r = read_full_file(path, &db, &db_len);
+        r = device_db_read(id, &db, &db_len);
         if (r < 0) {
                 if (r == -ENOENT)
                         return 0;
                 else
-                        return log_debug_errno(r, "sd-device: failed to read db '%s': %m", path);
+                        return log_debug_errno(r, "sd-device: failed to read db '%s': %m", id);
         }
 
         /* devices with a database entry are initialized */
@@ -1012,6 +1010,7 @@ int device_update_db(sd_device *device) {
                 if (r < 0 && errno != ENOENT)
                         return -errno;
 
+                (void) device_db_snapshot_invalidate(DEVICE_DB_SNAPSHOT_PATH);
                 return 0;
         }
 
@@ -1079,6 +1078,8 @@ int device_update_db(sd_device *device) {
                 goto fail;
         }
 
+        (void) device_db_snapshot_invalidate(DEVICE_DB_SNAPSHOT_PATH);
+
         log_debug("created %s file '%s' for '%s'", has_info ? "db" : "empty",
                   path, device->devpath);
 
@@ -1087,6 +1088,7 @@ int device_update_db(sd_device *device) {
 fail:
         (void) unlink(path);
         (void) unlink(path_tmp);
+        (void) device_db_snapshot_invalidate(DEVICE_DB_SNAPSHOT_PATH);
 
         return log_error_errno(r, "failed to create %s file '%s' for '%s'", has_info ? "db" : "empty", path, device->devpath);
 }
@@ -1108,6 +1110,8 @@ int device_delete_db(sd_device *device) {
         if (r < 0 && errno != ENOENT)
                 return -errno;
 
+        (void) device_db_snapshot_invalidate(DEVICE_DB_SNAPSHOT_PATH);
+
         return 0;
 }
 
@@ -26,6 +26,7 @@
 #include "sd-device.h"
 
 #include "alloc-util.h"
+#include "device-db-snapshot.h"
 #include "device-internal.h"
 #include "device-private.h"
 #include "device-util.h"
@@ -1308,7 +1309,6 @@ int device_get_id_filename(sd_device *device, const char **ret) {
 
 int device_read_db_aux(sd_device *device, bool force) {
         _cleanup_free_ char *db = NULL;
-        char *path;
         const char *id, *value;
         char key;
         size_t db_len;
@@ -1332,14 +1332,12 @@ int device_read_db_aux(sd_device *device, bool force) {
         if (r < 0)
                 return r;
 
-        path = strjoina("/run/udev/data/", id);
-
-        r = read_full_file(path, &db, &db_len);
+        r = device_db_read(id, &db, &db_len);
         if (r < 0) {
                 if (r == -ENOENT)
                         return 0;
                 else
-                        return log_debug_errno(r, "sd-device: failed to read db '%s': %m", path);
+                        return log_debug_errno(r, "sd-device: failed to read db '%s': %m", id);
         }
 
         /* devices with a database entry are initialized */
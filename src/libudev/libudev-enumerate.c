@@ -424,3 +424,9 @@ _public_ int udev_enumerate_scan_subsystems(struct udev_enumerate *udev_enumerat
 
         return device_enumerator_scan_subsystems(udev_enumerate->enumerator);
 }
+
+int udev_enumerate_set_threads(struct udev_enumerate *udev_enumerate, unsigned n_threads) {
+        assert_return(udev_enumerate, -EINVAL);
+
+        return device_enumerator_set_threads(udev_enumerate->enumerator, n_threads);
+}
@@ -64,6 +64,7 @@ struct udev_monitor {
         struct udev_list filter_subsystem_list;
         struct udev_list filter_tag_list;
         bool bound;
+        union udev_monitor_buffer *buffers;     /* for udev_monitor_receive_devices(), allocated on first use */
 };
 
 enum udev_monitor_netlink_group {
@@ -96,6 +97,11 @@ struct udev_monitor_netlink_header {
         unsigned int filter_tag_bloom_lo;
 };
 
+union udev_monitor_buffer {
+        struct udev_monitor_netlink_header nlh;
+        char raw[8192];
+};
+
 static struct udev_monitor *udev_monitor_new(struct udev *udev) {
         struct udev_monitor *udev_monitor;
 
@@ -493,6 +499,7 @@ _public_ struct udev_monitor *udev_monitor_unref(struct udev_monitor *udev_monit
                 close(udev_monitor->sock);
         udev_list_cleanup(&udev_monitor->filter_subsystem_list);
         udev_list_cleanup(&udev_monitor->filter_tag_list);
+        free(udev_monitor->buffers);
         return mfree(udev_monitor);
 }
 
@@ -564,6 +571,101 @@ tag:
         return 0;
 }
 
+static int monitor_parse_message(struct udev_monitor *udev_monitor, struct msghdr *smsg, ssize_t buflen,
+                                 struct udev_device **ret) {
+        union udev_monitor_buffer *buf = smsg->msg_iov[0].iov_base;
+        union sockaddr_union *snl = smsg->msg_name;
+        struct udev_device *udev_device;
+        struct cmsghdr *cmsg;
+        struct ucred *cred;
+        ssize_t bufpos;
+        bool is_initialized = false;
+
+        /* Checks a message received from the monitor socket, and turns it into a device. Returns 0 and NULL if the
+         * device does not pass the current filter. */
+
+        if (buflen < 32 || (smsg->msg_flags & MSG_TRUNC)) {
+                log_debug("invalid message length");
+                return -EINVAL;
+        }
+
+        if (snl->nl.nl_groups == 0) {
+                /* unicast message, check if we trust the sender */
+                if (udev_monitor->snl_trusted_sender.nl.nl_pid == 0 ||
+                    snl->nl.nl_pid != udev_monitor->snl_trusted_sender.nl.nl_pid) {
+                        log_debug("unicast netlink message ignored");
+                        return -EAGAIN;
+                }
+        } else if (snl->nl.nl_groups == UDEV_MONITOR_KERNEL) {
+                if (snl->nl.nl_pid > 0) {
+                        log_debug("multicast kernel netlink message from PID %"PRIu32" ignored",
+                                  snl->nl.nl_pid);
+                        return -EAGAIN;
+                }
+        }
+
+        cmsg = CMSG_FIRSTHDR(smsg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
+                log_debug("no sender credentials received, message ignored");
+                return -EAGAIN;
+        }
+
+        cred = (struct ucred *)CMSG_DATA(cmsg);
+        if (cred->uid != 0) {
+                log_debug("sender uid="UID_FMT", message ignored", cred->uid);
+                return -EAGAIN;
+        }
+
+        if (memcmp(buf->raw, "libudev", 8) == 0) {
+                /* udev message needs proper version magic */
+                if (buf->nlh.magic != htobe32(UDEV_MONITOR_MAGIC)) {
+                        log_debug("unrecognized message signature (%x != %x)",
+                                 buf->nlh.magic, htobe32(UDEV_MONITOR_MAGIC));
+                        return -EAGAIN;
+                }
+                if (buf->nlh.properties_off+32 > (size_t)buflen) {
+                        log_debug("message smaller than expected (%u > %zd)",
+                                  buf->nlh.properties_off+32, buflen);
+                        return -EAGAIN;
+                }
+
+                bufpos = buf->nlh.properties_off;
+
+                /* devices received from udev are always initialized */
+                is_initialized = true;
+        } else {
+                /* kernel message with header */
+                bufpos = strlen(buf->raw) + 1;
+                if ((size_t)bufpos < sizeof("a@/d") || bufpos >= buflen) {
+                        log_debug("invalid message length");
+                        return -EAGAIN;
+                }
+
+                /* check message header */
+                if (strstr(buf->raw, "@/") == NULL) {
+                        log_debug("unrecognized message header");
+                        return -EAGAIN;
+                }
+        }
+
+        udev_device = udev_device_new_from_nulstr(udev_monitor->udev, &buf->raw[bufpos], buflen - bufpos);
+        if (!udev_device)
+                return log_debug_errno(errno, "could not create device: %m");
+
+        if (is_initialized)
+                udev_device_set_is_initialized(udev_device);
+
+        /* skip device, if it does not pass the current filter */
+        if (!passes_filter(udev_monitor, udev_device)) {
+                udev_device_unref(udev_device);
+                *ret = NULL;
+                return 0;
+        }
+
+        *ret = udev_device;
+        return 1;
+}
+
 /**
  * udev_monitor_receive_device:
  * @udev_monitor: udev monitor
@@ -589,16 +691,10 @@ _public_ struct udev_device *udev_monitor_receive_device(struct udev_monitor *ud
         struct msghdr smsg;
         struct iovec iov;
         char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
-        struct cmsghdr *cmsg;
         union sockaddr_union snl;
-        struct ucred *cred;
-        union {
-                struct udev_monitor_netlink_header nlh;
-                char raw[8192];
-        } buf;
+        union udev_monitor_buffer buf;
         ssize_t buflen;
-        ssize_t bufpos;
-        bool is_initialized = false;
+        int r;
 
 retry:
         if (udev_monitor == NULL) {
@@ -622,126 +718,106 @@ retry:
                 return NULL;
         }
 
-        if (buflen < 32 || (smsg.msg_flags & MSG_TRUNC)) {
-                log_debug("invalid message length");
-                errno = EINVAL;
+        r = monitor_parse_message(udev_monitor, &smsg, buflen, &udev_device);
+        if (r < 0) {
+                errno = -r;
                 return NULL;
         }
+        if (r == 0) {
+                struct pollfd pfd[1];
+                int rc;
 
-        if (snl.nl.nl_groups == 0) {
-                /* unicast message, check if we trust the sender */
-                if (udev_monitor->snl_trusted_sender.nl.nl_pid == 0 ||
-                    snl.nl.nl_pid != udev_monitor->snl_trusted_sender.nl.nl_pid) {
-                        log_debug("unicast netlink message ignored");
-                        errno = EAGAIN;
-                        return NULL;
-                }
-        } else if (snl.nl.nl_groups == UDEV_MONITOR_KERNEL) {
-                if (snl.nl.nl_pid > 0) {
-                        log_debug("multicast kernel netlink message from PID %"PRIu32" ignored",
-                                  snl.nl.nl_pid);
-                        errno = EAGAIN;
-                        return NULL;
-                }
-        }
+                /* if something is queued, get next device */
+                pfd[0].fd = udev_monitor->sock;
+                pfd[0].events = POLLIN;
+                rc = poll(pfd, 1, 0);
+                if (rc > 0)
+                        goto retry;
 
-        cmsg = CMSG_FIRSTHDR(&smsg);
-        if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
-                log_debug("no sender credentials received, message ignored");
                 errno = EAGAIN;
                 return NULL;
         }
 
-        cred = (struct ucred *)CMSG_DATA(cmsg);
-        if (cred->uid != 0) {
-                log_debug("sender uid="UID_FMT", message ignored", cred->uid);
-                errno = EAGAIN;
-                return NULL;
-        }
+        return udev_device;
+}
 
-        if (memcmp(buf.raw, "libudev", 8) == 0) {
-                /* udev message needs proper version magic */
-                if (buf.nlh.magic != htobe32(UDEV_MONITOR_MAGIC)) {
-                        log_debug("unrecognized message signature (%x != %x)",
-                                 buf.nlh.magic, htobe32(UDEV_MONITOR_MAGIC));
-                        errno = EAGAIN;
-                        return NULL;
-                }
-                if (buf.nlh.properties_off+32 > (size_t)buflen) {
-                        log_debug("message smaller than expected (%u > %zd)",
-                                  buf.nlh.properties_off+32, buflen);
-                        errno = EAGAIN;
-                        return NULL;
-                }
+int udev_monitor_receive_devices(struct udev_monitor *udev_monitor, struct udev_device **ret, size_t n) {
+        struct mmsghdr msgs[UDEV_MONITOR_BATCH_MAX];
+        struct iovec iov[UDEV_MONITOR_BATCH_MAX];
+        union sockaddr_union snl[UDEV_MONITOR_BATCH_MAX];
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(struct ucred))];
+        } control[UDEV_MONITOR_BATCH_MAX];
+        int flags = MSG_WAITFORONE;
+        size_t i, k = 0;
 
-                bufpos = buf.nlh.properties_off;
+        assert(udev_monitor);
+        assert(ret);
+        assert(n > 0);
 
-                /* devices received from udev are always initialized */
-                is_initialized = true;
-        } else {
-                /* kernel message with header */
-                bufpos = strlen(buf.raw) + 1;
-                if ((size_t)bufpos < sizeof("a@/d") || bufpos >= buflen) {
-                        log_debug("invalid message length");
-                        errno = EAGAIN;
-                        return NULL;
-                }
+        /* Like udev_monitor_receive_device(), but picks up everything that is queued on the socket with a single
+         * syscall, up to n devices at a time. Returns the number of devices stored in ret, or -EAGAIN if none
+         * of the queued messages passed the filter. */
 
-                /* check message header */
-                if (strstr(buf.raw, "@/") == NULL) {
-                        log_debug("unrecognized message header");
-                        errno = EAGAIN;
-                        return NULL;
-                }
+        if (!udev_monitor->buffers) {
+                udev_monitor->buffers = new(union udev_monitor_buffer, UDEV_MONITOR_BATCH_MAX);
+                if (!udev_monitor->buffers)
+                        return -ENOMEM;
         }
 
-        udev_device = udev_device_new_from_nulstr(udev_monitor->udev, &buf.raw[bufpos], buflen - bufpos);
-        if (!udev_device) {
-                log_debug_errno(errno, "could not create device: %m");
-                return NULL;
-        }
+        n = MIN(n, (size_t) UDEV_MONITOR_BATCH_MAX);
+
+        for (;;) {
+                int m;
+
+                for (i = 0; i < n; i++) {
+                        iov[i] = (struct iovec) {
+                                .iov_base = udev_monitor->buffers + i,
+                                .iov_len = sizeof(union udev_monitor_buffer),
+                        };
+                        msgs[i] = (struct mmsghdr) {
+                                .msg_hdr = {
+                                        .msg_name = snl + i,
+                                        .msg_namelen = sizeof(snl[i]),
+                                        .msg_iov = iov + i,
+                                        .msg_iovlen = 1,
+                                        .msg_control = control + i,
+                                        .msg_controllen = sizeof(control[i]),
+                                },
+                        };
+                }
 
-        if (is_initialized)
-                udev_device_set_is_initialized(udev_device);
+                /* Only the first message is waited for if the socket is in blocking mode */
+                m = recvmmsg(udev_monitor->sock, msgs, n, flags, NULL);
+                if (m < 0) {
+                        if (errno != EAGAIN)
+                                log_debug_errno(errno, "unable to receive messages: %m");
+                        return -errno;
+                }
 
-        /* skip device, if it does not pass the current filter */
-        if (!passes_filter(udev_monitor, udev_device)) {
-                struct pollfd pfd[1];
-                int rc;
+                for (i = 0; i < (size_t) m; i++) {
+                        struct udev_device *udev_device;
 
-                udev_device_unref(udev_device);
+                        if (monitor_parse_message(udev_monitor, &msgs[i].msg_hdr, msgs[i].msg_len, &udev_device) <= 0)
+                                continue;
 
-                /* if something is queued, get next device */
-                pfd[0].fd = udev_monitor->sock;
-                pfd[0].events = POLLIN;
-                rc = poll(pfd, 1, 0);
-                if (rc > 0)
-                        goto retry;
+                        ret[k++] = udev_device;
+                }
 
-                errno = EAGAIN;
-                return NULL;
-        }
+                if (k > 0)
+                        return (int) k;
 
-        return udev_device;
+                /* Everything we got was dropped, look for more, but don't wait for it */
+                flags = MSG_DONTWAIT;
+        }
 }
 
-int udev_monitor_send_device(struct udev_monitor *udev_monitor,
-                             struct udev_monitor *destination, struct udev_device *udev_device)
-{
+static int monitor_prepare_message(struct udev_monitor *udev_monitor, struct udev_monitor *destination,
+                                   struct udev_device *udev_device, struct udev_monitor_netlink_header *nlh,
+                                   struct iovec iov[2], struct msghdr *smsg) {
         const char *buf, *val;
-        ssize_t blen, count;
-        struct udev_monitor_netlink_header nlh = {
-                .prefix = "libudev",
-                .magic = htobe32(UDEV_MONITOR_MAGIC),
-                .header_size = sizeof nlh,
-        };
-        struct iovec iov[2] = {
-                { .iov_base = &nlh, .iov_len = sizeof nlh },
-        };
-        struct msghdr smsg = {
-                .msg_iov = iov,
-                .msg_iovlen = 2,
-        };
+        ssize_t blen;
         struct udev_list_entry *list_entry;
         uint64_t tag_bloom_bits;
 
@@ -752,27 +828,33 @@ int udev_monitor_send_device(struct udev_monitor *udev_monitor,
         }
 
         /* fill in versioned header */
+        *nlh = (struct udev_monitor_netlink_header) {
+                .prefix = "libudev",
+                .magic = htobe32(UDEV_MONITOR_MAGIC),
+                .header_size = sizeof *nlh,
+        };
+
         val = udev_device_get_subsystem(udev_device);
-        nlh.filter_subsystem_hash = htobe32(util_string_hash32(val));
+        nlh->filter_subsystem_hash = htobe32(util_string_hash32(val));
 
         val = udev_device_get_devtype(udev_device);
         if (val != NULL)
-                nlh.filter_devtype_hash = htobe32(util_string_hash32(val));
+                nlh->filter_devtype_hash = htobe32(util_string_hash32(val));
 
         /* add tag bloom filter */
         tag_bloom_bits = 0;
         udev_list_entry_foreach(list_entry, udev_device_get_tags_list_entry(udev_device))
                 tag_bloom_bits |= util_string_bloom64(udev_list_entry_get_name(list_entry));
         if (tag_bloom_bits > 0) {
-                nlh.filter_tag_bloom_hi = htobe32(tag_bloom_bits >> 32);
-                nlh.filter_tag_bloom_lo = htobe32(tag_bloom_bits & 0xffffffff);
+                nlh->filter_tag_bloom_hi = htobe32(tag_bloom_bits >> 32);
+                nlh->filter_tag_bloom_lo = htobe32(tag_bloom_bits & 0xffffffff);
         }
 
         /* add properties list */
-        nlh.properties_off = iov[0].iov_len;
-        nlh.properties_len = blen;
-        iov[1].iov_base = (char *)buf;
-        iov[1].iov_len = blen;
+        nlh->properties_off = sizeof *nlh;
+        nlh->properties_len = blen;
+        iov[0] = (struct iovec) { .iov_base = nlh, .iov_len = sizeof *nlh };
+        iov[1] = (struct iovec) { .iov_base = (char *)buf, .iov_len = blen };
 
         /*
          * Use custom address for target, or the default one.
@@ -780,11 +862,29 @@ int udev_monitor_send_device(struct udev_monitor *udev_monitor,
          * If we send to a multicast group, we will get
          * ECONNREFUSED, which is expected.
          */
-        if (destination)
-                smsg.msg_name = &destination->snl;
-        else
-                smsg.msg_name = &udev_monitor->snl_destination;
-        smsg.msg_namelen = sizeof(struct sockaddr_nl);
+        *smsg = (struct msghdr) {
+                .msg_name = destination ? &destination->snl : &udev_monitor->snl_destination,
+                .msg_namelen = sizeof(struct sockaddr_nl),
+                .msg_iov = iov,
+                .msg_iovlen = 2,
+        };
+
+        return 0;
+}
+
+int udev_monitor_send_device(struct udev_monitor *udev_monitor,
+                             struct udev_monitor *destination, struct udev_device *udev_device)
+{
+        struct udev_monitor_netlink_header nlh;
+        struct iovec iov[2];
+        struct msghdr smsg;
+        ssize_t count;
+        int r;
+
+        r = monitor_prepare_message(udev_monitor, destination, udev_device, &nlh, iov, &smsg);
+        if (r < 0)
+                return r;
+
         count = sendmsg(udev_monitor->sock, &smsg, 0);
         if (count < 0) {
                 if (!destination && errno == ECONNREFUSED) {
@@ -798,6 +898,58 @@ int udev_monitor_send_device(struct udev_monitor *udev_monitor,
         return count;
 }
 
+int udev_monitor_send_devices(struct udev_monitor *udev_monitor, struct udev_monitor **destinations,
+                              struct udev_device **devices, size_t n) {
+        struct udev_monitor_netlink_header nlh[UDEV_MONITOR_BATCH_MAX];
+        struct iovec iov[UDEV_MONITOR_BATCH_MAX][2];
+        struct mmsghdr msgs[UDEV_MONITOR_BATCH_MAX] = {};
+        size_t i, sent = 0;
+        int r = 0;
+
+        assert(udev_monitor);
+        assert(devices || n == 0);
+
+        /* Like udev_monitor_send_device(), but passes up to UDEV_MONITOR_BATCH_MAX devices with a single
+         * syscall. destinations may be NULL, or contain NULL entries, to send to the default destination.
+         * Returns the number of devices passed on, in order. If that's fewer than n, passing on the next one
+         * failed, which is only reported as error if it was the first one. */
+
+        n = MIN(n, (size_t) UDEV_MONITOR_BATCH_MAX);
+
+        for (i = 0; i < n; i++) {
+                r = monitor_prepare_message(udev_monitor, destinations ? destinations[i] : NULL, devices[i],
+                                            nlh + i, iov[i], &msgs[i].msg_hdr);
+                if (r < 0) {
+                        n = i;
+                        break;
+                }
+        }
+
+        while (sent < n) {
+                int k;
+
+                k = sendmmsg(udev_monitor->sock, msgs + sent, n - sent, 0);
+                if (k < 0) {
+                        if (errno == ECONNREFUSED && !(destinations && destinations[sent])) {
+                                /* nobody listening on the multicast group, that's fine */
+                                sent++;
+                                continue;
+                        }
+
+                        r = -errno;
+                        break;
+                }
+
+                sent += k;
+        }
+
+        if (sent == 0 && r < 0)
+                return r;
+
+        log_debug("passed %zu devices to netlink monitor %p", sent, udev_monitor);
+        return (int) sent;
+}
+
 /**
  * udev_monitor_filter_add_match_subsystem_devtype:
  * @udev_monitor: the monitor
@@ -77,12 +77,19 @@ int udev_device_delete_db(struct udev_device *udev_device);
 int udev_device_tag_index(struct udev_device *dev, struct udev_device *dev_old, bool add);
 
 /* libudev-monitor.c - netlink/unix socket communication  */
+#define UDEV_MONITOR_BATCH_MAX 32
 int udev_monitor_disconnect(struct udev_monitor *udev_monitor);
 int udev_monitor_allow_unicast_sender(struct udev_monitor *udev_monitor, struct udev_monitor *sender);
 int udev_monitor_send_device(struct udev_monitor *udev_monitor,
                              struct udev_monitor *destination, struct udev_device *udev_device);
+int udev_monitor_send_devices(struct udev_monitor *udev_monitor, struct udev_monitor **destinations,
+                              struct udev_device **devices, size_t n);
+int udev_monitor_receive_devices(struct udev_monitor *udev_monitor, struct udev_device **ret, size_t n);
 struct udev_monitor *udev_monitor_new_from_netlink_fd(struct udev *udev, const char *name, int fd);
 
+/* libudev-enumerate.c */
+int udev_enumerate_set_threads(struct udev_enumerate *udev_enumerate, unsigned n_threads);
+
 /* libudev-list.c */
 struct udev_list_node {
         struct udev_list_node *next, *prev;
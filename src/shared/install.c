@@ -54,6 +54,7 @@
 #include "string-table.h"
 #include "string-util.h"
 #include "strv.h"
+#include "unit-file-index.h"
 #include "unit-name.h"
 
 #define UNIT_FILE_FOLLOW_SYMLINK_MAX 64
@@ -295,6 +296,64 @@ static int path_is_vendor(const LookupPaths *p, const char *path) {
         return path_equal(rpath, SYSTEM_DATA_UNIT_PATH);
 }
 
+/* While set, the index is not refreshed before each lookup, see install_index_pin() */
+static thread_local bool index_pinned = false;
+
+static int install_index_get(const LookupPaths *paths, UnitFileIndex **ret) {
+        UnitFileIndex *idx;
+        int r;
+
+        assert(paths);
+        assert(ret);
+
+        /* Returns the index of the search path and its subdirectories, brought up-to-date with what is on disk. This
+         * is cheap if nothing changed, as only the modification times of the directories are checked then. */
+
+        idx = unit_file_index_shared();
+        if (!idx)
+                return -ENOMEM;
+
+        if (!index_pinned) {
+                r = unit_file_index_update(idx, paths->search_path, UNIT_FILE_INDEX_RECURSIVE);
+                if (r < 0)
+                        return r;
+        }
+
+        *ret = idx;
+        return 0;
+}
+
+static int install_index_pin(const LookupPaths *paths, UnitFileIndex **ret) {
+        int r;
+
+        /* Refreshes the index once, and then uses it as it is for all lookups until unpinned again. Use this around
+         * loops doing a lot of lookups and nothing else. */
+
+        r = install_index_get(paths, ret);
+        if (r < 0)
+                return r;
+
+        index_pinned = true;
+        return 0;
+}
+
+static void install_index_unpin(UnitFileIndex **idx) {
+        if (*idx)
+                index_pinned = false;
+
+        *idx = NULL;
+}
+
+static void install_index_forget(const char *path) {
+        UnitFileIndex *idx;
+
+        /* We changed something on disk, make sure the index notices */
+
+        idx = unit_file_index_shared();
+        if (idx)
+                unit_file_index_forget(idx, path);
+}
+
 int unit_file_changes_add(
                 UnitFileChange **changes,
                 unsigned *n_changes,
@@ -470,6 +529,7 @@ static int create_symlink(
         mkdir_parents_label(new_path, 0755);
 
         if (symlink(old_path, new_path) >= 0) {
+                install_index_forget(new_path);
                 unit_file_changes_add(changes, n_changes, UNIT_FILE_SYMLINK, new_path, old_path);
                 return 1;
         }
@@ -507,6 +567,8 @@ static int create_symlink(
                 return r;
         }
 
+        install_index_forget(new_path);
+
         unit_file_changes_add(changes, n_changes, UNIT_FILE_UNLINK, new_path, NULL);
         unit_file_changes_add(changes, n_changes, UNIT_FILE_SYMLINK, new_path, old_path);
 
@@ -642,6 +704,7 @@ static int remove_marked_symlinks_fd(
                                 }
 
                                 (void) rmdir_parents(p, config_path);
+                                install_index_forget(p);
                         }
 
                         unit_file_changes_add(changes, n_changes, UNIT_FILE_UNLINK, p, NULL);
@@ -725,75 +788,127 @@ static bool is_symlink_with_known_name(const UnitFileInstallInfo *i, const char
         return false;
 }
 
-static int find_symlinks_fd(
+static int find_symlinks_match(
                 const char *root_dir,
                 UnitFileInstallInfo *i,
                 bool match_aliases,
-                int fd,
                 const char *path,
+                const char *name,
+                const char *target,
                 const char *config_path,
                 bool *same_name_link) {
 
-        _cleanup_closedir_ DIR *d = NULL;
-        struct dirent *de;
+        _cleanup_free_ char *p = NULL, *dest = NULL;
+        bool found_path, found_dest, b = false;
+        int q;
+
+        /* Checks whether the symlink name in the directory path, pointing to target, is one we are looking for */
+
+        /* Acquire symlink name */
+        p = path_make_absolute(name, path);
+        if (!p)
+                return -ENOMEM;
+
+        /* Make absolute */
+        if (!path_is_absolute(target))
+                dest = prefix_root(root_dir, target);
+        else
+                dest = strdup(target);
+        if (!dest)
+                return -ENOMEM;
+
+        /* Check if the symlink itself matches what we
+         * are looking for */
+        if (path_is_absolute(i->name))
+                found_path = path_equal(p, i->name);
+        else
+                found_path = streq(name, i->name);
+
+        /* Check if what the symlink points to
+         * matches what we are looking for */
+        if (path_is_absolute(i->name))
+                found_dest = path_equal(dest, i->name);
+        else
+                found_dest = streq(basename(dest), i->name);
+
+        if (found_path && found_dest) {
+                _cleanup_free_ char *t = NULL;
+
+                /* Filter out same name links in the main
+                 * config path */
+                t = path_make_absolute(i->name, config_path);
+                if (!t)
+                        return -ENOMEM;
+
+                b = path_equal(t, p);
+        }
+
+        if (b)
+                *same_name_link = true;
+        else if (found_path || found_dest) {
+                if (!match_aliases)
+                        return 1;
+
+                /* Check if symlink name is in the set of names used by [Install] */
+                q = is_symlink_with_known_name(i, name);
+                if (q < 0)
+                        return q;
+                if (q > 0)
+                        return 1;
+        }
+
+        return 0;
+}
+
+static int find_symlinks_in_dir(
+                const char *root_dir,
+                UnitFileInstallInfo *i,
+                bool match_aliases,
+                UnitFileIndex *idx,
+                UnitFileIndexDir *d,
+                const char *config_path,
+                bool *same_name_link) {
+
+        size_t k;
         int r = 0;
 
         assert(i);
-        assert(fd >= 0);
-        assert(path);
+        assert(idx);
+        assert(d);
         assert(config_path);
         assert(same_name_link);
 
-        d = fdopendir(fd);
-        if (!d) {
-                safe_close(fd);
-                return -errno;
-        }
-
-        FOREACH_DIRENT(de, d, return -errno) {
-
-                dirent_ensure_type(d, de);
+        for (k = 0; k < d->n_entries; k++) {
+                UnitFileIndexEntry *e = d->entries + k;
+                int q;
 
-                if (de->d_type == DT_DIR) {
+                if (e->type == DT_DIR) {
                         _cleanup_free_ char *p = NULL;
-                        int nfd, q;
+                        UnitFileIndexDir *sub;
 
-                        nfd = openat(fd, de->d_name, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_NOFOLLOW);
-                        if (nfd < 0) {
-                                if (errno == ENOENT)
-                                        continue;
+                        p = path_make_absolute(e->name, d->path);
+                        if (!p)
+                                return -ENOMEM;
 
+                        sub = unit_file_index_get_dir(idx, p);
+                        if (!sub || sub->error == -ENOENT)
+                                continue;
+                        if (sub->error < 0) {
                                 if (r == 0)
-                                        r = -errno;
+                                        r = sub->error;
                                 continue;
                         }
 
-                        p = path_make_absolute(de->d_name, path);
-                        if (!p) {
-                                safe_close(nfd);
-                                return -ENOMEM;
-                        }
-
-                        /* This will close nfd, regardless whether it succeeds or not */
-                        q = find_symlinks_fd(root_dir, i, match_aliases, nfd,
-                                             p, config_path, same_name_link);
+                        q = find_symlinks_in_dir(root_dir, i, match_aliases, idx, sub, config_path, same_name_link);
                         if (q > 0)
                                 return 1;
                         if (r == 0)
                                 r = q;
 
-                } else if (de->d_type == DT_LNK) {
-                        _cleanup_free_ char *p = NULL, *dest = NULL;
-                        bool found_path, found_dest, b = false;
-                        int q;
-
-                        /* Acquire symlink name */
-                        p = path_make_absolute(de->d_name, path);
-                        if (!p)
-                                return -ENOMEM;
+                } else if (e->type == DT_LNK) {
+                        const char *target;
 
-                        /* Acquire symlink destination */
-                        q = readlink_malloc(p, &dest);
+                        q = unit_file_index_entry_readlink(d, e, &target);
                         if (q == -ENOENT)
                                 continue;
                         if (q < 0) {
@@ -802,57 +917,10 @@ static int find_symlinks_fd(
                                 continue;
                         }
 
-                        /* Make absolute */
-                        if (!path_is_absolute(dest)) {
-                                char *x;
-
-                                x = prefix_root(root_dir, dest);
-                                if (!x)
-                                        return -ENOMEM;
-
-                                free(dest);
-                                dest = x;
-                        }
-
-                        /* Check if the symlink itself matches what we
-                         * are looking for */
-                        if (path_is_absolute(i->name))
-                                found_path = path_equal(p, i->name);
-                        else
-                                found_path = streq(de->d_name, i->name);
-
-                        /* Check if what the symlink points to
-                         * matches what we are looking for */
-                        if (path_is_absolute(i->name))
-                                found_dest = path_equal(dest, i->name);
-                        else
-                                found_dest = streq(basename(dest), i->name);
-
-                        if (found_path && found_dest) {
-                                _cleanup_free_ char *t = NULL;
-
-                                /* Filter out same name links in the main
-                                 * config path */
-                                t = path_make_absolute(i->name, config_path);
-                                if (!t)
-                                        return -ENOMEM;
-
-                                b = path_equal(t, p);
-                        }
-
-                        if (b)
-                                *same_name_link = true;
-                        else if (found_path || found_dest) {
-                                if (!match_aliases)
-                                        return 1;
-
-                                /* Check if symlink name is in the set of names used by [Install] */
-                                q = is_symlink_with_known_name(i, de->d_name);
-                                if (q < 0)
-                                        return q;
-                                if (q > 0)
-                                        return 1;
-                        }
+                        q = find_symlinks_match(root_dir, i, match_aliases, d->path, e->name, target,
+                                                config_path, same_name_link);
+                        if (q != 0)
+                                return q;
                 }
         }
 
@@ -861,27 +929,26 @@ static int find_symlinks_fd(
 
 static int find_symlinks(
                 const char *root_dir,
+                UnitFileIndex *idx,
                 UnitFileInstallInfo *i,
                 bool match_name,
                 const char *config_path,
                 bool *same_name_link) {
 
-        int fd;
+        UnitFileIndexDir *d;
 
+        assert(idx);
         assert(i);
         assert(config_path);
         assert(same_name_link);
 
-        fd = open(config_path, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
-        if (fd < 0) {
-                if (IN_SET(errno, ENOENT, ENOTDIR, EACCES))
-                        return 0;
-                return -errno;
-        }
+        d = unit_file_index_get_dir(idx, config_path);
+        if (!d || IN_SET(d->error, -ENOENT, -ENOTDIR, -EACCES))
+                return 0;
+        if (d->error < 0)
+                return d->error;
 
-        /* This takes possession of fd and closes it */
-        return find_symlinks_fd(root_dir, i, match_name, fd,
-                                config_path, config_path, same_name_link);
+        return find_symlinks_in_dir(root_dir, i, match_name, idx, d, config_path, same_name_link);
 }
 
 static int find_symlinks_in_scope(
@@ -893,16 +960,21 @@ static int find_symlinks_in_scope(
 
         bool same_name_link_runtime = false, same_name_link_config = false;
         bool enabled_in_runtime = false, enabled_at_all = false;
+        UnitFileIndex *idx;
         char **p;
         int r;
 
         assert(paths);
         assert(i);
 
+        r = install_index_get(paths, &idx);
+        if (r < 0)
+                return r;
+
         STRV_FOREACH(p, paths->search_path)  {
                 bool same_name_link = false;
 
-                r = find_symlinks(paths->root_dir, i, match_name, *p, &same_name_link);
+                r = find_symlinks(paths->root_dir, idx, i, match_name, *p, &same_name_link);
                 if (r < 0)
                         return r;
                 if (r > 0) {
@@ -1388,6 +1460,7 @@ static int unit_file_search(
         _cleanup_strv_free_ char **files = NULL;
         const char *dropin_dir_name = NULL;
         const char *dropin_template_dir_name = NULL;
+        UnitFileIndex *idx;
 
         char **p;
         int r;
@@ -1412,6 +1485,10 @@ static int unit_file_search(
                         return r;
         }
 
+        r = install_index_get(paths, &idx);
+        if (r < 0)
+                return r;
+
         STRV_FOREACH(p, paths->search_path) {
                 _cleanup_free_ char *path = NULL;
 
@@ -1419,6 +1496,10 @@ static int unit_file_search(
                 if (!path)
                         return -ENOMEM;
 
+                /* Don't bother with files we know don't exist */
+                if (unit_file_index_exists(idx, path) == 0)
+                        continue;
+
                 r = unit_file_load_or_readlink(c, info, path, paths->root_dir, flags);
 
                 if (r >= 0) {
@@ -1444,6 +1525,9 @@ static int unit_file_search(
                         if (!path)
                                 return -ENOMEM;
 
+                        if (unit_file_index_exists(idx, path) == 0)
+                                continue;
+
                         r = unit_file_load_or_readlink(c, info, path, paths->root_dir, flags);
                         if (r >= 0) {
                                 info->path = path;
@@ -2104,6 +2188,8 @@ int unit_file_unmask(
                         continue;
                 }
 
+                install_index_forget(path);
+
                 unit_file_changes_add(changes, n_changes, UNIT_FILE_UNLINK, path, NULL);
 
                 rp = skip_root(&paths, path);
@@ -2362,6 +2448,8 @@ int unit_file_revert(
 
                 unit_file_changes_add(changes, n_changes, UNIT_FILE_UNLINK, *i, NULL);
 
+                install_index_forget(*i);
+
                 rp = skip_root(&paths, *i);
                 q = mark_symlink_for_removal(&remove_symlinks_to, rp ?: *i);
                 if (q < 0)
@@ -3062,6 +3150,7 @@ int unit_file_preset_all(
         _cleanup_(install_context_done) InstallContext plus = {}, minus = {};
         _cleanup_lookup_paths_free_ LookupPaths paths = {};
         _cleanup_(presets_freep) Presets presets = {};
+        _cleanup_(install_index_unpin) UnitFileIndex *idx = NULL;
         const char *config_path = NULL;
         char **i;
         int r;
@@ -3082,36 +3171,38 @@ int unit_file_preset_all(
         if (r < 0)
                 return r;
 
-        STRV_FOREACH(i, paths.search_path) {
-                _cleanup_closedir_ DIR *d = NULL;
-                struct dirent *de;
+        /* Nothing is changed on disk until execute_preset() below, hence read the search path only once */
+        r = install_index_pin(&paths, &idx);
+        if (r < 0)
+                return r;
 
-                d = opendir(*i);
-                if (!d) {
-                        if (errno == ENOENT)
-                                continue;
+        STRV_FOREACH(i, paths.search_path) {
+                UnitFileIndexDir *d;
+                size_t k;
 
-                        return -errno;
-                }
+                d = unit_file_index_get_dir(idx, *i);
+                if (!d || d->error == -ENOENT)
+                        continue;
+                if (d->error < 0)
+                        return d->error;
 
-                FOREACH_DIRENT(de, d, return -errno) {
+                for (k = 0; k < d->n_entries; k++) {
+                        UnitFileIndexEntry *e = d->entries + k;
 
-                        if (!unit_name_is_valid(de->d_name, UNIT_NAME_ANY))
+                        if (!unit_name_is_valid(e->name, UNIT_NAME_ANY))
                                 continue;
 
-                        dirent_ensure_type(d, de);
-
-                        if (!IN_SET(de->d_type, DT_LNK, DT_REG))
+                        if (!IN_SET(e->type, DT_LNK, DT_REG))
                                 continue;
 
                         /* we don't pass changes[] in, because we want to handle errors on our own */
-                        r = preset_prepare_one(scope, &plus, &minus, &paths, de->d_name, presets, NULL, 0);
+                        r = preset_prepare_one(scope, &plus, &minus, &paths, e->name, presets, NULL, 0);
                         if (r == -ERFKILL)
                                 r = unit_file_changes_add(changes, n_changes,
-                                                          UNIT_FILE_IS_MASKED, de->d_name, NULL);
+                                                          UNIT_FILE_IS_MASKED, e->name, NULL);
                         else if (r == -ENOLINK)
                                 r = unit_file_changes_add(changes, n_changes,
-                                                          UNIT_FILE_IS_DANGLING, de->d_name, NULL);
+                                                          UNIT_FILE_IS_DANGLING, e->name, NULL);
                         else if (r == -EADDRNOTAVAIL) /* Ignore generated/transient units when applying preset */
                                 continue;
                         if (r < 0)
@@ -3119,6 +3210,8 @@ int unit_file_preset_all(
                 }
         }
 
+        install_index_unpin(&idx);
+
         return execute_preset(scope, &plus, &minus, &paths, config_path, NULL, mode, !!(flags & UNIT_FILE_FORCE), changes, n_changes);
 }
 
@@ -3144,6 +3237,7 @@ int unit_file_get_list(
                 char **patterns) {
 
         _cleanup_lookup_paths_free_ LookupPaths paths = {};
+        _cleanup_(install_index_unpin) UnitFileIndex *idx = NULL;
         char **i;
         int r;
 
@@ -3155,48 +3249,50 @@ int unit_file_get_list(
         if (r < 0)
                 return r;
 
-        STRV_FOREACH(i, paths.search_path) {
-                _cleanup_closedir_ DIR *d = NULL;
-                struct dirent *de;
+        /* We only read here, hence there's no need to refresh the index for each unit file we look at */
+        r = install_index_pin(&paths, &idx);
+        if (r < 0)
+                return r;
 
-                d = opendir(*i);
-                if (!d) {
-                        if (errno == ENOENT)
-                                continue;
-                        if (IN_SET(errno, ENOTDIR, EACCES)) {
-                                log_debug_errno(errno, "Failed to open \"%s\": %m", *i);
-                                continue;
-                        }
+        STRV_FOREACH(i, paths.search_path) {
+                UnitFileIndexDir *d;
+                size_t k;
 
-                        return -errno;
+                d = unit_file_index_get_dir(idx, *i);
+                if (!d || d->error == -ENOENT)
+                        continue;
+                if (IN_SET(d->error, -ENOTDIR, -EACCES)) {
+                        log_debug_errno(d->error, "Failed to open \"%s\": %m", *i);
+                        continue;
                 }
+                if (d->error < 0)
+                        return d->error;
 
-                FOREACH_DIRENT(de, d, return -errno) {
+                for (k = 0; k < d->n_entries; k++) {
                         _cleanup_(unit_file_list_free_onep) UnitFileList *f = NULL;
+                        UnitFileIndexEntry *e = d->entries + k;
 
-                        if (!unit_name_is_valid(de->d_name, UNIT_NAME_ANY))
+                        if (!unit_name_is_valid(e->name, UNIT_NAME_ANY))
                                 continue;
 
-                        if (!strv_fnmatch_or_empty(patterns, de->d_name, FNM_NOESCAPE))
+                        if (!strv_fnmatch_or_empty(patterns, e->name, FNM_NOESCAPE))
                                 continue;
 
-                        if (hashmap_get(h, de->d_name))
+                        if (hashmap_get(h, e->name))
                                 continue;
 
-                        dirent_ensure_type(d, de);
-
-                        if (!IN_SET(de->d_type, DT_LNK, DT_REG))
+                        if (!IN_SET(e->type, DT_LNK, DT_REG))
                                 continue;
 
                         f = new0(UnitFileList, 1);
                         if (!f)
                                 return -ENOMEM;
 
-                        f->path = path_make_absolute(de->d_name, *i);
+                        f->path = path_make_absolute(e->name, *i);
                         if (!f->path)
                                 return -ENOMEM;
 
-                        r = unit_file_lookup_state(scope, &paths, de->d_name, &f->state);
+                        r = unit_file_lookup_state(scope, &paths, e->name, &f->state);
                         if (r < 0)
                                 f->state = UNIT_FILE_BAD;
 
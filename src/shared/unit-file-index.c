@@ -0,0 +1,392 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "fs-util.h"
+#include "path-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "unit-file-index.h"
+#include "util.h"
+
+/* How many updates a directory stays in the index after it was last found in the search path */
+#define UNIT_FILE_INDEX_KEEP_GENERATIONS 8U
+
+static void unit_file_index_dir_clear(UnitFileIndexDir *d) {
+        size_t k;
+
+        assert(d);
+
+        for (k = 0; k < d->n_entries; k++) {
+                free(d->entries[k].name);
+                free(d->entries[k].symlink_target);
+        }
+
+        d->entries = mfree(d->entries);
+        d->n_entries = 0;
+}
+
+static UnitFileIndexDir *unit_file_index_dir_free(UnitFileIndexDir *d) {
+        if (!d)
+                return NULL;
+
+        unit_file_index_dir_clear(d);
+        free(d->path);
+        return mfree(d);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(UnitFileIndexDir*, unit_file_index_dir_free);
+
+int unit_file_index_new(UnitFileIndex **ret) {
+        _cleanup_(unit_file_index_freep) UnitFileIndex *idx = NULL;
+
+        assert(ret);
+
+        idx = new0(UnitFileIndex, 1);
+        if (!idx)
+                return -ENOMEM;
+
+        idx->dirs = hashmap_new(&string_hash_ops);
+        if (!idx->dirs)
+                return -ENOMEM;
+
+        *ret = idx;
+        idx = NULL;
+
+        return 0;
+}
+
+UnitFileIndex *unit_file_index_free(UnitFileIndex *idx) {
+        if (!idx)
+                return NULL;
+
+        hashmap_free_with_destructor(idx->dirs, unit_file_index_dir_free);
+        return mfree(idx);
+}
+
+static int entry_compare(const void *a, const void *b) {
+        const UnitFileIndexEntry *x = a, *y = b;
+
+        return strcmp(x->name, y->name);
+}
+
+static int unit_file_index_dir_read(UnitFileIndexDir *d, int fd) {
+        _cleanup_closedir_ DIR *dir = NULL;
+        size_t n_allocated = 0;
+        struct dirent *de;
+
+        assert(d);
+        assert(fd >= 0);
+
+        unit_file_index_dir_clear(d);
+
+        /* This takes possession of fd and closes it */
+        dir = fdopendir(fd);
+        if (!dir) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        FOREACH_DIRENT(de, dir, return -errno) {
+                UnitFileIndexEntry *e;
+
+                dirent_ensure_type(dir, de);
+
+                if (!GREEDY_REALLOC(d->entries, n_allocated, d->n_entries + 1))
+                        return -ENOMEM;
+
+                e = d->entries + d->n_entries;
+                *e = (UnitFileIndexEntry) {
+                        .type = de->d_type,
+                };
+
+                e->name = strdup(de->d_name);
+                if (!e->name)
+                        return -ENOMEM;
+
+                d->n_entries++;
+        }
+
+        qsort_safe(d->entries, d->n_entries, sizeof(UnitFileIndexEntry), entry_compare);
+        return 0;
+}
+
+static int unit_file_index_refresh(UnitFileIndex *idx, const char *path, UnitFileIndexFlags flags, usec_t now_usec) {
+        _cleanup_close_ int fd = -1;
+        UnitFileIndexDir *d;
+        struct stat st;
+        size_t k;
+        int r;
+
+        assert(idx);
+        assert(path);
+
+        d = hashmap_get(idx->dirs, path);
+        if (!d) {
+                _cleanup_(unit_file_index_dir_freep) UnitFileIndexDir *n = NULL;
+
+                n = new0(UnitFileIndexDir, 1);
+                if (!n)
+                        return -ENOMEM;
+
+                n->path = strdup(path);
+                if (!n->path)
+                        return -ENOMEM;
+
+                r = hashmap_put(idx->dirs, n->path, n);
+                if (r < 0)
+                        return r;
+
+                d = n;
+                n = NULL;
+        }
+
+        if (d->generation == idx->generation)
+                return 0; /* Already visited during this update, for example as part of another search path entry */
+        d->generation = idx->generation;
+
+        fd = open(path, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                d->error = -errno;
+                d->trusted = false;
+                unit_file_index_dir_clear(d);
+                return 0;
+        }
+
+        if (d->trusted &&
+            d->error == 0 &&
+            d->dev == st.st_dev &&
+            d->ino == st.st_ino &&
+            d->mtime == timespec_load(&st.st_mtim))
+                goto recurse;
+
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        d->mtime = timespec_load(&st.st_mtim);
+
+        /* Changes made within the granularity of the file system timestamps after we read the directory wouldn't be
+         * noticed, hence don't rely on the mtime if it is that recent, and read the directory again next time. */
+        d->trusted = d->mtime + USEC_PER_SEC < now_usec;
+
+        r = unit_file_index_dir_read(d, fd);
+        fd = -1;
+        if (r == -ENOMEM)
+                return r;
+        if (r < 0) {
+                unit_file_index_dir_clear(d);
+                d->trusted = false;
+        }
+        d->error = r;
+
+        idx->n_read++;
+
+recurse:
+        if (!(flags & UNIT_FILE_INDEX_RECURSIVE))
+                return 0;
+
+        for (k = 0; k < d->n_entries; k++) {
+                _cleanup_free_ char *p = NULL;
+
+                if (d->entries[k].type != DT_DIR)
+                        continue;
+
+                p = strjoin(streq(path, "/") ? "" : path, "/", d->entries[k].name);
+                if (!p)
+                        return -ENOMEM;
+
+                r = unit_file_index_refresh(idx, p, flags, now_usec);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+int unit_file_index_update(UnitFileIndex *idx, char **search_path, UnitFileIndexFlags flags) {
+        UnitFileIndexDir *d;
+        usec_t now_usec;
+        Iterator i;
+        char **p;
+        int r;
+
+        assert(idx);
+
+        /* Brings the index up-to-date with the directories in the search path, and with UNIT_FILE_INDEX_RECURSIVE
+         * also with all their subdirectories. Only the directories whose modification time changed are read
+         * again. */
+
+        idx->generation++;
+        idx->n_read = 0;
+        now_usec = now(CLOCK_REALTIME);
+
+        STRV_FOREACH(p, search_path) {
+                r = unit_file_index_refresh(idx, *p, flags, now_usec);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Drop what hasn't been reachable from the search path for a while. Note that the service manager and the
+         * install logic use slightly different search paths, hence let's not drop everything right away that the
+         * other one needs. */
+        HASHMAP_FOREACH(d, idx->dirs, i)
+                if (d->generation + UNIT_FILE_INDEX_KEEP_GENERATIONS < idx->generation) {
+                        hashmap_remove(idx->dirs, d->path);
+                        unit_file_index_dir_free(d);
+                }
+
+        return 0;
+}
+
+void unit_file_index_forget(UnitFileIndex *idx, const char *path) {
+        char *p, *e;
+
+        assert(idx);
+        assert(path);
+
+        /* Makes sure the next update reads path again if it is a directory, as well as all directories it is located
+         * in. Call this after modifying the file system below the search path, so that the change is picked up even
+         * if it happened within the granularity of the file system timestamps. Creating or removing a file might
+         * have created or removed the directories leading to it, too, hence we go all the way up. */
+
+        p = strdupa(path);
+        for (;;) {
+                UnitFileIndexDir *d;
+
+                d = hashmap_get(idx->dirs, isempty(p) ? "/" : p);
+                if (d)
+                        d->trusted = false;
+
+                e = strrchr(p, '/');
+                if (!e || isempty(p))
+                        break;
+
+                *e = 0;
+        }
+}
+
+UnitFileIndexDir *unit_file_index_get_dir(UnitFileIndex *idx, const char *path) {
+        UnitFileIndexDir *d;
+
+        assert(idx);
+        assert(path);
+
+        /* Only return what has been checked during the last update, everything else might be outdated */
+        d = hashmap_get(idx->dirs, path);
+        if (!d || d->generation != idx->generation)
+                return NULL;
+
+        return d;
+}
+
+UnitFileIndexEntry *unit_file_index_dir_find(UnitFileIndexDir *d, const char *name) {
+        UnitFileIndexEntry key = {
+                .name = (char*) name,
+        };
+
+        assert(d);
+        assert(name);
+
+        if (d->n_entries == 0)
+                return NULL;
+
+        return bsearch(&key, d->entries, d->n_entries, sizeof(UnitFileIndexEntry), entry_compare);
+}
+
+UnitFileIndexEntry *unit_file_index_find(UnitFileIndex *idx, const char *path) {
+        UnitFileIndexDir *d;
+        const char *e;
+
+        assert(idx);
+        assert(path);
+
+        e = strrchr(path, '/');
+        if (!e || e[1] == 0)
+                return NULL;
+
+        d = unit_file_index_get_dir(idx, e == path ? "/" : strndupa(path, e - path));
+        if (!d)
+                return NULL;
+
+        return unit_file_index_dir_find(d, e + 1);
+}
+
+int unit_file_index_exists(UnitFileIndex *idx, const char *path) {
+        UnitFileIndexDir *d;
+        const char *e;
+
+        assert(idx);
+        assert(path);
+
+        /* Returns > 0 if path exists, 0 if it is known not to exist, and -ENODATA if the index can't tell, because
+         * the directory isn't indexed or couldn't be read. */
+
+        e = strrchr(path, '/');
+        if (!e || e[1] == 0)
+                return -ENODATA;
+
+        d = unit_file_index_get_dir(idx, e == path ? "/" : strndupa(path, e - path));
+        if (!d)
+                return -ENODATA;
+
+        if (d->error == -ENOENT)
+                return 0;
+        if (d->error < 0)
+                return -ENODATA;
+
+        return !!unit_file_index_dir_find(d, e + 1);
+}
+
+int unit_file_index_entry_readlink(UnitFileIndexDir *d, UnitFileIndexEntry *e, const char **ret) {
+        const char *p;
+        int r;
+
+        assert(d);
+        assert(e);
+        assert(e->type == DT_LNK);
+        assert(ret);
+
+        /* Returns the target of a symlink, reading it on first use. The result is kept until the directory is read
+         * again, which happens whenever it changed, including when the symlink was replaced. */
+
+        if (!e->symlink_read) {
+                p = strjoina(streq(d->path, "/") ? "" : d->path, "/", e->name);
+
+                r = readlink_malloc(p, &e->symlink_target);
+                if (r == -ENOMEM)
+                        return r;
+
+                e->symlink_error = MIN(r, 0);
+                e->symlink_read = true;
+        }
+
+        if (e->symlink_error < 0)
+                return e->symlink_error;
+
+        *ret = e->symlink_target;
+        return 0;
+}
+
+static thread_local UnitFileIndex *shared = NULL;
+
+UnitFileIndex *unit_file_index_shared(void) {
+
+        /* Unit files are looked up by the service manager when loading units, and by the install logic, both in the
+         * service manager itself when called via the bus and in systemctl. Let's share one index per thread between
+         * them, and keep it around, so that refreshing it only has to read what changed since the last time. */
+
+        if (!shared)
+                (void) unit_file_index_new(&shared);
+
+        return shared;
+}
+
+void unit_file_index_shared_free(void) {
+        shared = unit_file_index_free(shared);
+}
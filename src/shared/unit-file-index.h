@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "hashmap.h"
+#include "macro.h"
+#include "time-util.h"
+
+typedef struct UnitFileIndexEntry {
+        char *name;
+        unsigned char type;       /* One of the DT_xyz constants, never DT_UNKNOWN */
+
+        /* Symlinks are only read on first use, see unit_file_index_entry_readlink() */
+        bool symlink_read;
+        char *symlink_target;
+        int symlink_error;
+} UnitFileIndexEntry;
+
+typedef struct UnitFileIndexDir {
+        char *path;
+
+        /* Negative errno if the directory couldn't be opened or read, in which case the entries are empty */
+        int error;
+
+        dev_t dev;
+        ino_t ino;
+        usec_t mtime;
+        bool trusted;             /* false if the mtime was too recent when we read the directory to rely on it */
+        unsigned generation;      /* The last update that visited this directory */
+
+        UnitFileIndexEntry *entries; /* Sorted by name */
+        size_t n_entries;
+} UnitFileIndexDir;
+
+/* An index of the unit search path: the contents of each directory, and optionally of its subdirectories.
+ * Directories are only read again if their modification time changed, hence refreshing an index that is mostly
+ * up-to-date costs one stat() per directory. */
+typedef struct UnitFileIndex {
+        Hashmap *dirs;            /* path → UnitFileIndexDir */
+        unsigned generation;
+        unsigned n_read;          /* Number of directories read during the last update */
+} UnitFileIndex;
+
+int unit_file_index_new(UnitFileIndex **ret);
+UnitFileIndex *unit_file_index_free(UnitFileIndex *idx);
+DEFINE_TRIVIAL_CLEANUP_FUNC(UnitFileIndex*, unit_file_index_free);
+
+typedef enum UnitFileIndexFlags {
+        UNIT_FILE_INDEX_RECURSIVE = 1 << 0, /* Also index the subdirectories, e.g. .wants/ and .d/ */
+} UnitFileIndexFlags;
+
+int unit_file_index_update(UnitFileIndex *idx, char **search_path, UnitFileIndexFlags flags);
+void unit_file_index_forget(UnitFileIndex *idx, const char *path);
+
+UnitFileIndexDir *unit_file_index_get_dir(UnitFileIndex *idx, const char *path);
+UnitFileIndexEntry *unit_file_index_dir_find(UnitFileIndexDir *d, const char *name);
+UnitFileIndexEntry *unit_file_index_find(UnitFileIndex *idx, const char *path);
+int unit_file_index_exists(UnitFileIndex *idx, const char *path);
+
+int unit_file_index_entry_readlink(UnitFileIndexDir *d, UnitFileIndexEntry *e, const char **ret);
+
+/* The index of this thread, shared by the service manager and the install logic */
+UnitFileIndex *unit_file_index_shared(void);
+void unit_file_index_shared_free(void);
@@ -85,6 +85,7 @@
 #include "strv.h"
 #include "terminal-util.h"
 #include "unit-def.h"
+#include "unit-file-index.h"
 #include "unit-name.h"
 #include "user-util.h"
 #include "util.h"
@@ -181,6 +182,7 @@ static OutputMode arg_output = OUTPUT_SHORT;
 static bool arg_plain = false;
 static bool arg_firmware_setup = false;
 static bool arg_now = false;
+static bool arg_incremental = false;
 static bool arg_jobs_before = false;
 static bool arg_jobs_after = false;
 
@@ -5634,8 +5636,10 @@ static int daemon_reload(int argc, char *argv[], void *userdata) {
                 break;
 
         case ACTION_SYSTEMCTL:
-                method = streq(argv[0], "daemon-reexec") ? "Reexecute" :
-                                     /* "daemon-reload" */ "Reload";
+                if (streq(argv[0], "daemon-reexec"))
+                        method = "Reexecute";
+                else /* "daemon-reload" */
+                        method = arg_incremental ? "ReloadIncremental" : "Reload";
                 break;
 
         default:
@@ -7201,6 +7205,7 @@ static void systemctl_help(void) {
                "     --kill-who=WHO   Who to send signal to\n"
                "  -s --signal=SIGNAL  Which signal to send\n"
                "     --now            Start or stop unit in addition to enabling or disabling it\n"
+               "     --incremental    On daemon-reload, only reload units whose files changed\n"
                "     --dry-run        Only print what would be done\n"
                "  -q --quiet          Suppress output\n"
                "     --wait           For (re)start, wait until service stopped again\n"
@@ -7474,6 +7479,7 @@ static int systemctl_parse_argv(int argc, char *argv[]) {
                 ARG_PRESET_MODE,
                 ARG_FIRMWARE_SETUP,
                 ARG_NOW,
+                ARG_INCREMENTAL,
                 ARG_MESSAGE,
                 ARG_WAIT,
         };
@@ -7523,6 +7529,7 @@ static int systemctl_parse_argv(int argc, char *argv[]) {
                 { "preset-mode",         required_argument, NULL, ARG_PRESET_MODE         },
                 { "firmware-setup",      no_argument,       NULL, ARG_FIRMWARE_SETUP      },
                 { "now",                 no_argument,       NULL, ARG_NOW                 },
+                { "incremental",         no_argument,       NULL, ARG_INCREMENTAL         },
                 { "message",             required_argument, NULL, ARG_MESSAGE             },
                 {}
         };
@@ -7842,6 +7849,10 @@ static int systemctl_parse_argv(int argc, char *argv[]) {
                         arg_now = true;
                         break;
 
+                case ARG_INCREMENTAL:
+                        arg_incremental = true;
+                        break;
+
                 case ARG_MESSAGE:
                         if (strv_extend(&arg_wall, optarg) < 0)
                                 return log_oom();
@@ -8775,6 +8786,8 @@ finish:
         free(arg_root);
         free(arg_esp_path);
 
+        unit_file_index_shared_free();
+
         /* Note that we return r here, not EXIT_SUCCESS, so that we can implement the LSB-like return codes */
         return r < 0 ? EXIT_FAILURE : r;
 }
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cgroup-util.h"
+#include "macro.h"
+#include "manager.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "test-helper.h"
+#include "tests.h"
+#include "time-util.h"
+#include "unit.h"
+
+static pid_t fork_into(Unit *u) {
+        pid_t pid;
+
+        pid = fork();
+        assert_se(pid >= 0);
+        if (pid == 0) {
+                pause();
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(cg_attach_everywhere(u->manager->cgroup_supported, u->cgroup_path, pid, NULL, NULL) >= 0);
+        return pid;
+}
+
+static void kill_and_reap(pid_t pid) {
+        assert_se(kill(pid, SIGKILL) >= 0);
+        assert_se(wait_for_terminate(pid, NULL) >= 0);
+}
+
+static uint64_t tasks_current(Unit *u) {
+        uint64_t v;
+
+        assert_se(unit_get_tasks_current(u, &v) >= 0);
+        return v;
+}
+
+static int test_accounting_snapshot(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        CGroupMask supported;
+        pid_t a, b, c;
+        Manager *m = NULL;
+        Unit *u;
+        int r;
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                puts("Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+        if (cg_mask_supported(&supported) < 0 || !(supported & CGROUP_MASK_PIDS)) {
+                puts("Skipping test: pids controller not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(set_unit_path(get_testdata_dir("")) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (IN_SET(r, -EPERM, -EACCES)) {
+                puts("manager_new: Permission denied. Skipping test.");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        assert_se(manager_load_unit(m, "parent.slice", NULL, NULL, &u) >= 0);
+        unit_get_cgroup_context(u)->tasks_accounting = true;
+        assert_se(unit_start(u) >= 0);
+        assert_se(u->cgroup_realized_mask & CGROUP_MASK_PIDS);
+
+        /* Within the refresh interval, the counter is served from the snapshot ... */
+        m->accounting_refresh_usec = USEC_INFINITY;
+        assert_se(tasks_current(u) == 0);
+        a = fork_into(u);
+        assert_se(tasks_current(u) == 0);
+
+        /* ... unless the processes of the unit changed in a way we know about */
+        assert_se(unit_watch_pid(u, a) >= 0);
+        assert_se(tasks_current(u) == 1);
+        b = fork_into(u);
+        assert_se(tasks_current(u) == 1);
+        kill_and_reap(a);
+        unit_unwatch_pid(u, a);
+        assert_se(tasks_current(u) == 1);
+        unit_invalidate_accounting_snapshot(u);
+        assert_se(tasks_current(u) == 1);
+
+        /* After the refresh interval the counter is read again */
+        m->accounting_refresh_usec = 100 * USEC_PER_MSEC;
+        unit_invalidate_accounting_snapshot(u);
+        assert_se(tasks_current(u) == 1);
+        c = fork_into(u);
+        assert_se(tasks_current(u) == 1);
+        usleep(m->accounting_refresh_usec);
+        assert_se(tasks_current(u) == 2);
+
+        /* And with caching turned off it always is */
+        m->accounting_refresh_usec = 0;
+        kill_and_reap(b);
+        assert_se(tasks_current(u) == 1);
+        kill_and_reap(c);
+        assert_se(tasks_current(u) == 0);
+
+        manager_free(m);
+
+        return 0;
+}
+
+int main(int argc, char* argv[]) {
+        log_parse_environment();
+        log_open();
+
+        return test_accounting_snapshot();
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cgroup-util.h"
+#include "fd-util.h"
+#include "list.h"
+#include "macro.h"
+#include "manager.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "test-helper.h"
+#include "tests.h"
+#include "unit.h"
+
+#define N_UNITS 70U
+
+static unsigned queue_length(Manager *m) {
+        unsigned n = 0;
+        Unit *u;
+
+        LIST_FOREACH(cgroup_empty_queue, u, m->cgroup_empty_queue) {
+                assert_se(u->in_cgroup_empty_queue);
+                n++;
+        }
+
+        return n;
+}
+
+static void send_path(int fd, const char *path) {
+        assert_se(send(fd, path, strlen(path), 0) == (ssize_t) strlen(path));
+}
+
+static int test_cgroup_empty_queue(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        Unit *units[N_UNITS];
+        Manager *m = NULL;
+        unsigned i;
+        int r;
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                puts("Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(set_unit_path(get_testdata_dir("")) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (IN_SET(r, -EPERM, -EACCES)) {
+                puts("manager_new: Permission denied. Skipping test.");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        for (i = 0; i < N_UNITS; i++) {
+                char name[STRLEN("emptyqueue.slice") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(name, "emptyqueue%02u.slice", i);
+                assert_se(manager_load_unit(m, name, NULL, NULL, units + i) >= 0);
+                assert_se(unit_start(units[i]) >= 0);
+                assert_se(units[i]->cgroup_path);
+        }
+        assert_se(queue_length(m) == 0);
+
+        /* Repeated notifications for the same cgroup are queued once, and the queue is dispatched in batches */
+        for (i = 0; i < 3 * N_UNITS; i++)
+                assert_se(manager_notify_cgroup_empty(m, units[i % N_UNITS]->cgroup_path) > 0);
+        assert_se(queue_length(m) == N_UNITS);
+
+        assert_se(manager_dispatch_cgroup_empty_queue(m) == 64);
+        assert_se(queue_length(m) == N_UNITS - 64);
+        assert_se(manager_dispatch_cgroup_empty_queue(m) == N_UNITS - 64);
+        assert_se(manager_dispatch_cgroup_empty_queue(m) == 0);
+        for (i = 0; i < N_UNITS; i++)
+                assert_se(!units[i]->in_cgroup_empty_queue);
+
+        /* The agent socket is drained in batches too, including datagrams we ignore */
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, pair) >= 0);
+        for (i = 0; i < 40; i++) {
+                send_path(pair[0], units[i]->cgroup_path);
+                send_path(pair[0], units[i]->cgroup_path);
+        }
+        send_path(pair[0], "");
+
+        assert_se(manager_read_cgroups_agent(m, pair[1]) == 64);
+        assert_se(queue_length(m) == 32);
+        assert_se(manager_read_cgroups_agent(m, pair[1]) == 17);
+        assert_se(manager_read_cgroups_agent(m, pair[1]) == 0);
+        assert_se(queue_length(m) == 40);
+        assert_se(manager_dispatch_cgroup_empty_queue(m) == 40);
+
+        manager_free(m);
+
+        return 0;
+}
+
+int main(int argc, char* argv[]) {
+        log_parse_environment();
+        log_open();
+
+        return test_cgroup_empty_queue();
+}
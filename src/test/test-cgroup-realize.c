@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "cgroup-util.h"
+#include "macro.h"
+#include "manager.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "test-helper.h"
+#include "tests.h"
+#include "unit.h"
+
+static void assert_pids_max(Unit *u, const char *expected) {
+        _cleanup_free_ char *v = NULL;
+
+        assert_se(cg_get_attribute("pids", u->cgroup_path, "pids.max", &v) >= 0);
+        assert_se(streq(strstrip(v), expected));
+}
+
+static void assert_no_fds(Unit *u) {
+        CGroupController c;
+
+        for (c = 0; c < _CGROUP_CONTROLLER_MAX; c++)
+                assert_se(u->cgroup_fds[c] < 0);
+}
+
+static int test_cgroup_realize(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        _cleanup_free_ char *p = NULL;
+        Unit *parent, *parent_deep;
+        CGroupMask supported;
+        Manager *m = NULL;
+        int r;
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                puts("Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+        if (cg_all_unified() > 0 || cg_mask_supported(&supported) < 0 || !(supported & CGROUP_MASK_PIDS)) {
+                puts("Skipping test: pids controller not available on a legacy hierarchy");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(set_unit_path(get_testdata_dir("")) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (IN_SET(r, -EPERM, -EACCES)) {
+                puts("manager_new: Permission denied. Skipping test.");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        assert_se(manager_load_unit(m, "parent.slice", NULL, NULL, &parent) >= 0);
+        assert_se(manager_load_unit(m, "parent-deep.slice", NULL, NULL, &parent_deep) >= 0);
+        assert_se(UNIT_DEREF(parent_deep->slice) == parent);
+
+        unit_get_cgroup_context(parent)->tasks_max = 42;
+        unit_get_cgroup_context(parent_deep)->tasks_max = 23;
+
+        assert_se(unit_start(parent) >= 0);
+        assert_se(unit_start(parent_deep) >= 0);
+        assert_se(parent->cgroup_realized && parent_deep->cgroup_realized);
+        assert_pids_max(parent, "42");
+        assert_pids_max(parent_deep, "23");
+
+        /* The directories are not kept open once realized */
+        assert_no_fds(parent);
+        assert_no_fds(parent_deep);
+
+        /* Queued units are realized parents first, and each of them once */
+        while (manager_dispatch_cgroup_realize_queue(m) > 0)
+                ;
+        unit_invalidate_cgroup(parent_deep, CGROUP_MASK_PIDS);
+        unit_invalidate_cgroup(parent, CGROUP_MASK_PIDS);
+        assert_se(parent->in_cgroup_realize_queue && parent_deep->in_cgroup_realize_queue);
+        assert_se(manager_dispatch_cgroup_realize_queue(m) == 2);
+        assert_se(!m->cgroup_realize_queue);
+        assert_se(manager_dispatch_cgroup_realize_queue(m) == 0);
+        assert_pids_max(parent, "42");
+        assert_pids_max(parent_deep, "23");
+        assert_no_fds(parent);
+        assert_no_fds(parent_deep);
+
+        /* An unchanged value is not written again, ... */
+        assert_se(cg_set_attribute("pids", parent_deep->cgroup_path, "pids.max", "99") >= 0);
+        unit_invalidate_cgroup(parent_deep, CGROUP_MASK_PIDS);
+        assert_se(manager_dispatch_cgroup_realize_queue(m) == 1);
+        assert_pids_max(parent_deep, "99");
+
+        /* ... but it is if the cgroup was created again behind our back, as it starts out with the defaults then */
+        assert_se(cg_get_path("pids", parent_deep->cgroup_path, NULL, &p) >= 0);
+        assert_se(rmdir(p) >= 0);
+        assert_se(mkdir(p, 0755) >= 0);
+        assert_pids_max(parent_deep, "max");
+        unit_invalidate_cgroup(parent_deep, CGROUP_MASK_PIDS);
+        assert_se(manager_dispatch_cgroup_realize_queue(m) == 1);
+        assert_pids_max(parent_deep, "23");
+
+        /* And a changed value is written */
+        unit_get_cgroup_context(parent_deep)->tasks_max = 7;
+        unit_invalidate_cgroup(parent_deep, CGROUP_MASK_PIDS);
+        assert_se(manager_dispatch_cgroup_realize_queue(m) == 1);
+        assert_pids_max(parent_deep, "7");
+
+        manager_free(m);
+
+        return 0;
+}
+
+int main(int argc, char* argv[]) {
+        int r;
+
+        log_parse_environment();
+        log_open();
+
+        r = test_cgroup_realize();
+
+        return r;
+}
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "device-db-snapshot.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "time-util.h"
+
+static void write_db(const char *dir, const char *id, const char *contents) {
+        _cleanup_free_ char *p = NULL;
+
+        assert_se(p = path_join(NULL, dir, id));
+        assert_se(write_string_file(p, contents, WRITE_STRING_FILE_CREATE) >= 0);
+}
+
+static void test_snapshot(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *tmp = NULL;
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *s = NULL, *s2 = NULL;
+        _cleanup_free_ char *dir = NULL, *path = NULL, *data = NULL;
+        _cleanup_strv_free_ char **ids = NULL;
+        size_t size;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(mkdtemp_malloc("/tmp/test-device-db-snapshot-XXXXXX", &tmp) >= 0);
+        assert_se(dir = path_join(NULL, tmp, "data"));
+        assert_se(path = path_join(NULL, tmp, "data.bin"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        write_db(dir, "b8:0", "S:disk/by-id/foo\nL:0\nE:ID_FOO=1\nG:systemd\nG:uaccess\n");
+        write_db(dir, "c1:3", "I:12345\nE:ID_BAR=1\n");
+        write_db(dir, "n3", "G:systemd-foo\n");
+        write_db(dir, "+input:input1", "G:seat\nG:systemd\n");
+        write_db(dir, ".#b8:1XXXXXX", "G:systemd\n");
+
+        /* Without a database there's nothing to find */
+        assert_se(device_db_snapshot_write("/nonexistent", path) >= 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_is_valid(s));
+        assert_se(device_db_snapshot_get_generation(s) == 1);
+        assert_se(device_db_snapshot_get_n_entries(s) == 0);
+        assert_se(device_db_snapshot_lookup(s, "b8:0", NULL, NULL) == 0);
+
+        /* Another snapshot replaces it, and invalidating the new one doesn't affect the old one */
+        assert_se(device_db_snapshot_write(dir, path) >= 0);
+        assert_se(device_db_snapshot_open(path, &s2) >= 0);
+        assert_se(device_db_snapshot_get_generation(s2) == 2);
+        assert_se(device_db_snapshot_get_n_entries(s2) == 4);
+
+        assert_se(device_db_snapshot_lookup(s2, "b8:0", &data, &size) == 1);
+        assert_se(streq(data, "S:disk/by-id/foo\nL:0\nE:ID_FOO=1\nG:systemd\nG:uaccess\n"));
+        assert_se(size == strlen(data));
+        data = mfree(data);
+        assert_se(device_db_snapshot_lookup(s2, "c1:3", &data, NULL) == 1);
+        assert_se(streq(data, "I:12345\nE:ID_BAR=1\n"));
+        data = mfree(data);
+        assert_se(device_db_snapshot_lookup(s2, "b8:1", NULL, NULL) == 0);
+        assert_se(device_db_snapshot_lookup(s2, ".#b8:1XXXXXX", NULL, NULL) == 0);
+        assert_se(device_db_snapshot_lookup(s2, "n", NULL, NULL) == 0);
+        assert_se(device_db_snapshot_lookup(s2, "n30", NULL, NULL) == 0);
+
+        assert_se(device_db_snapshot_get_tagged(s2, "systemd", &ids) >= 0);
+        assert_se(strv_equal(ids, STRV_MAKE("+input:input1", "b8:0")));
+        ids = strv_free(ids);
+        assert_se(device_db_snapshot_get_tagged(s2, "uaccess", &ids) >= 0);
+        assert_se(strv_equal(ids, STRV_MAKE("b8:0")));
+        ids = strv_free(ids);
+        assert_se(device_db_snapshot_get_tagged(s2, "systemd-", &ids) >= 0);
+        assert_se(strv_isempty(ids));
+        ids = strv_free(ids);
+
+        /* Changing the database invalidates the snapshot, also for everybody who has it mapped already */
+        assert_se(device_db_snapshot_invalidate(path) >= 0);
+        assert_se(!device_db_snapshot_is_valid(s2));
+        assert_se(device_db_snapshot_is_valid(s));
+        assert_se(device_db_snapshot_lookup(s2, "b8:0", NULL, NULL) == -ESTALE);
+        assert_se(device_db_snapshot_get_tagged(s2, "systemd", &ids) == -ESTALE);
+        s = device_db_snapshot_unref(s);
+        s2 = device_db_snapshot_unref(s2);
+
+        write_db(dir, "b8:0", "G:systemd\n");
+        assert_se(device_db_snapshot_write(dir, path) >= 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_is_valid(s));
+        assert_se(device_db_snapshot_get_generation(s) == 3);
+        assert_se(device_db_snapshot_lookup(s, "b8:0", &data, NULL) == 1);
+        assert_se(streq(data, "G:systemd\n"));
+        s = device_db_snapshot_unref(s);
+
+        /* A broken snapshot is refused, and replaced by the next one */
+        assert_se(truncate(path, 100) >= 0);
+        assert_se(device_db_snapshot_open(path, &s) == -EBADMSG);
+        assert_se(device_db_snapshot_write(dir, path) >= 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_is_valid(s));
+        assert_se(device_db_snapshot_get_n_entries(s) == 4);
+}
+
+static void test_update(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *tmp = NULL;
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *s = NULL;
+        _cleanup_free_ char *dir = NULL, *path = NULL, *data = NULL, *p = NULL;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(mkdtemp_malloc("/tmp/test-device-db-snapshot-XXXXXX", &tmp) >= 0);
+        assert_se(dir = path_join(NULL, tmp, "data"));
+        assert_se(path = path_join(NULL, tmp, "data.bin"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        write_db(dir, "b8:0", "E:ID_FOO=1\n");
+        write_db(dir, "b8:1", "E:ID_FOO=2\n");
+        write_db(dir, "c1:3", "E:ID_FOO=3\n");
+
+        /* Without a snapshot to start from, all files are read */
+        assert_se(device_db_snapshot_update(dir, path, NULL) == 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_get_generation(s) == 1);
+        assert_se(device_db_snapshot_get_n_entries(s) == 3);
+        s = device_db_snapshot_unref(s);
+
+        /* Only the listed entries are read again, the others are taken from the previous snapshot, even if their
+         * files changed */
+        write_db(dir, "b8:0", "E:ID_FOO=10\n");
+        write_db(dir, "b8:1", "E:ID_FOO=20\n");
+        write_db(dir, "n3", "E:ID_FOO=30\n");
+        assert_se(p = path_join(NULL, dir, "c1:3"));
+        assert_se(unlink(p) >= 0);
+        assert_se(device_db_snapshot_update(dir, path, STRV_MAKE("n3", "b8:1", "c1:3", "b8:1", "b8:2")) == 0);
+
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_is_valid(s));
+        assert_se(device_db_snapshot_get_generation(s) == 2);
+        assert_se(device_db_snapshot_get_n_entries(s) == 3);
+        assert_se(device_db_snapshot_lookup(s, "b8:0", &data, NULL) == 1);
+        assert_se(streq(data, "E:ID_FOO=1\n"));
+        data = mfree(data);
+        assert_se(device_db_snapshot_lookup(s, "b8:1", &data, NULL) == 1);
+        assert_se(streq(data, "E:ID_FOO=20\n"));
+        data = mfree(data);
+        assert_se(device_db_snapshot_lookup(s, "n3", &data, NULL) == 1);
+        assert_se(streq(data, "E:ID_FOO=30\n"));
+        data = mfree(data);
+        assert_se(device_db_snapshot_lookup(s, "c1:3", NULL, NULL) == 0);
+        assert_se(device_db_snapshot_lookup(s, "b8:2", NULL, NULL) == 0);
+        s = device_db_snapshot_unref(s);
+
+        /* Nothing changed, the entries are copied over */
+        assert_se(device_db_snapshot_update(dir, path, NULL) == 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_get_generation(s) == 3);
+        assert_se(device_db_snapshot_get_n_entries(s) == 3);
+        assert_se(device_db_snapshot_lookup(s, "b8:0", &data, NULL) == 1);
+        assert_se(streq(data, "E:ID_FOO=1\n"));
+        data = mfree(data);
+        s = device_db_snapshot_unref(s);
+
+        /* A full one picks up everything */
+        assert_se(device_db_snapshot_write(dir, path) == 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        assert_se(device_db_snapshot_lookup(s, "b8:0", &data, NULL) == 1);
+        assert_se(streq(data, "E:ID_FOO=10\n"));
+}
+
+static void test_performance(unsigned n_devices) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX], buf3[FORMAT_TIMESPAN_MAX], buf4[FORMAT_TIMESPAN_MAX];
+        _cleanup_(rm_rf_physical_and_freep) char *tmp = NULL;
+        _cleanup_(device_db_snapshot_unrefp) DeviceDbSnapshot *s = NULL;
+        _cleanup_free_ char *dir = NULL, *path = NULL;
+        _cleanup_strv_free_ char **ids = NULL;
+        usec_t ts, build, update, files, snapshot;
+        unsigned i;
+
+        log_info("/* %s(%u) */", __func__, n_devices);
+
+        assert_se(mkdtemp_malloc("/tmp/test-device-db-snapshot-XXXXXX", &tmp) >= 0);
+        assert_se(dir = path_join(NULL, tmp, "data"));
+        assert_se(path = path_join(NULL, tmp, "data.bin"));
+        assert_se(mkdir(dir, 0755) >= 0);
+
+        for (i = 0; i < n_devices; i++) {
+                char id[32], contents[256];
+
+                xsprintf(id, "b%u:%u", 8 + i / 256, i % 256);
+                xsprintf(contents, "S:disk/by-id/wwn-%u\nS:disk/by-path/pci-0000:00:%u\nI:%u\nE:ID_SERIAL=%u\nG:systemd\n",
+                         i, i, i, i);
+                write_db(dir, id, contents);
+        }
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(device_db_snapshot_write(dir, path) >= 0);
+        assert_se(device_db_snapshot_open(path, &s) >= 0);
+        build = now(CLOCK_MONOTONIC) - ts;
+
+        /* What udevd does after an event */
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(device_db_snapshot_update(dir, path, STRV_MAKE("b8:0")) >= 0);
+        update = now(CLOCK_MONOTONIC) - ts;
+
+        /* What sd-device did for every device so far, and what it does now */
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_devices; i++) {
+                _cleanup_free_ char *p = NULL, *data = NULL;
+                char id[32];
+
+                xsprintf(id, "b%u:%u", 8 + i / 256, i % 256);
+                assert_se(p = path_join(NULL, dir, id));
+                assert_se(read_full_file(p, &data, NULL) >= 0);
+        }
+        files = now(CLOCK_MONOTONIC) - ts;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_devices; i++) {
+                _cleanup_free_ char *data = NULL;
+                char id[32];
+
+                xsprintf(id, "b%u:%u", 8 + i / 256, i % 256);
+                assert_se(device_db_snapshot_lookup(s, id, &data, NULL) == 1);
+        }
+        snapshot = now(CLOCK_MONOTONIC) - ts;
+
+        assert_se(device_db_snapshot_get_tagged(s, "systemd", &ids) >= 0);
+        assert_se(strv_length(ids) == n_devices);
+
+        log_info("%u devices: writing the snapshot took %s, updating one entry %s, reading all database files %s, looking them up in the snapshot %s",
+                 n_devices, format_timespan(buf1, sizeof(buf1), build, 1),
+                 format_timespan(buf4, sizeof(buf4), update, 1),
+                 format_timespan(buf2, sizeof(buf2), files, 1),
+                 format_timespan(buf3, sizeof(buf3), snapshot, 1));
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 5000;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        test_snapshot();
+        test_update();
+        test_performance(n);
+
+        return 0;
+}
@@ -0,0 +1,108 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "sd-device.h"
+
+#include "alloc-util.h"
+#include "device-enumerator-private.h"
+#include "device-util.h"
+#include "log.h"
+#include "macro.h"
+#include "parse-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "time-util.h"
+
+static char **enumerate(unsigned n_threads, const char *subsystem, usec_t *ret_duration) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        _cleanup_strv_free_ char **syspaths = NULL, **again = NULL;
+        char **ret;
+        sd_device *d;
+        usec_t ts;
+
+        ts = now(CLOCK_MONOTONIC);
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        assert_se(device_enumerator_set_threads(e, n_threads) >= 0);
+        if (subsystem)
+                assert_se(sd_device_enumerator_add_match_subsystem(e, subsystem, true) >= 0);
+
+        FOREACH_DEVICE(e, d) {
+                const char *syspath, *s;
+
+                assert_se(sd_device_get_syspath(d, &syspath) >= 0);
+                if (subsystem)
+                        assert_se(sd_device_get_subsystem(d, &s) >= 0 && streq(s, subsystem));
+
+                assert_se(strv_extend(&syspaths, syspath) >= 0);
+        }
+
+        if (ret_duration)
+                *ret_duration = now(CLOCK_MONOTONIC) - ts;
+
+        /* The devices stay around, another iteration returns the same ones without scanning again */
+        FOREACH_DEVICE(e, d) {
+                const char *syspath;
+
+                assert_se(sd_device_get_syspath(d, &syspath) >= 0);
+                assert_se(strv_extend(&again, syspath) >= 0);
+        }
+
+        assert_se(strv_equal(syspaths, again));
+
+        ret = syspaths;
+        syspaths = NULL;
+
+        return ret;
+}
+
+static void test_threads(const char *subsystem) {
+        _cleanup_strv_free_ char **serial = NULL;
+        unsigned n;
+
+        log_info("/* %s(%s) */", __func__, strna(subsystem));
+
+        serial = enumerate(1, subsystem, NULL);
+
+        /* The order is the same no matter how many threads found the devices */
+        for (n = 2; n <= 32; n *= 2) {
+                _cleanup_strv_free_ char **parallel = NULL;
+
+                parallel = enumerate(n, subsystem, NULL);
+                assert_se(strv_equal(serial, parallel));
+        }
+}
+
+static void test_performance(unsigned n_threads) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX];
+        _cleanup_strv_free_ char **serial = NULL, **parallel = NULL;
+        usec_t serial_duration, parallel_duration;
+
+        log_info("/* %s(%u) */", __func__, n_threads);
+
+        serial = enumerate(1, NULL, &serial_duration);
+        parallel = enumerate(n_threads, NULL, &parallel_duration);
+
+        log_info("%u devices: scanning /sys took %s, with %u threads %s",
+                 strv_length(serial), format_timespan(buf1, sizeof(buf1), serial_duration, 1),
+                 n_threads, format_timespan(buf2, sizeof(buf2), parallel_duration, 1));
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 8;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        test_threads(NULL);
+        test_threads("block");
+        test_threads("nonexistent");
+        test_performance(n);
+
+        return 0;
+}
@@ -28,6 +28,19 @@
 #include "test-helper.h"
 #include "tests.h"
 
+static bool has_trace_span(Manager *m, ManagerTracePhase phase, const char *name) {
+        ManagerTraceSpan *t;
+        size_t i;
+
+        for (i = 0; (t = manager_trace_span(m, i)); i++)
+                if (t->phase == phase && streq_ptr(t->name, name)) {
+                        assert_se(t->begin <= t->end);
+                        return true;
+                }
+
+        return false;
+}
+
 int main(int argc, char *argv[]) {
         _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
         _cleanup_(sd_bus_error_free) sd_bus_error err = SD_BUS_ERROR_NULL;
@@ -68,6 +81,10 @@ int main(int argc, char *argv[]) {
         assert_se(r == 0);
         manager_dump_jobs(m, stdout, "\t");
 
+        assert_se(has_trace_span(m, MANAGER_TRACE_LOAD, "c.service"));
+        assert_se(has_trace_span(m, MANAGER_TRACE_TRANSACTION, "c.service"));
+        assert_se(!has_trace_span(m, MANAGER_TRACE_LOAD, "d.service"));
+
         printf("Load2:\n");
         manager_clear_jobs(m);
         assert_se(manager_load_unit(m, "d.service", NULL, NULL, &d) >= 0);
@@ -116,32 +133,32 @@ int main(int argc, char *argv[]) {
         assert_se(manager_add_job(m, JOB_START, h, JOB_FAIL, NULL, &j) == 0);
         manager_dump_jobs(m, stdout, "\t");
 
-        assert_se(!hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
-        assert_se(!hashmap_get(b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
-        assert_se(!hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
-        assert_se(!hashmap_get(c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(!unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
+        assert_se(!unit_dependency_list_contains(&b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(!unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
+        assert_se(!unit_dependency_list_contains(&c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
 
         assert_se(unit_add_dependency(a, UNIT_PROPAGATES_RELOAD_TO, b, true, UNIT_DEPENDENCY_UDEV) == 0);
         assert_se(unit_add_dependency(a, UNIT_PROPAGATES_RELOAD_TO, c, true, UNIT_DEPENDENCY_PROC_SWAP) == 0);
 
-        assert_se(hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
-        assert_se(hashmap_get(b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
-        assert_se(hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
-        assert_se(hashmap_get(c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
+        assert_se(unit_dependency_list_contains(&b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
+        assert_se(unit_dependency_list_contains(&c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
 
         unit_remove_dependencies(a, UNIT_DEPENDENCY_UDEV);
 
-        assert_se(!hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
-        assert_se(!hashmap_get(b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
-        assert_se(hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
-        assert_se(hashmap_get(c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(!unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
+        assert_se(!unit_dependency_list_contains(&b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
+        assert_se(unit_dependency_list_contains(&c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
 
         unit_remove_dependencies(a, UNIT_DEPENDENCY_PROC_SWAP);
 
-        assert_se(!hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
-        assert_se(!hashmap_get(b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
-        assert_se(!hashmap_get(a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
-        assert_se(!hashmap_get(c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(!unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], b));
+        assert_se(!unit_dependency_list_contains(&b->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
+        assert_se(!unit_dependency_list_contains(&a->dependencies[UNIT_PROPAGATES_RELOAD_TO], c));
+        assert_se(!unit_dependency_list_contains(&c->dependencies[UNIT_RELOAD_PROPAGATED_FROM], a));
 
         manager_free(m);
 
@@ -353,6 +353,57 @@ static void test_environment_gathering(void) {
         assert_se(endswith(strv_env_get(env, "PATH"), ":/no/such/file"));
 }
 
+static void test_execute_binaries(void) {
+        char template[] = "/tmp/test-exec-util.XXXXXXX";
+        char **argvs[4] = {};
+        _cleanup_strv_free_ char **paths = NULL;
+        _cleanup_free_ char *contents = NULL;
+        const char *name, *name2, *name3, *out;
+        ExecResult results[3];
+        size_t i;
+
+        assert_se(mkdtemp(template));
+
+        log_info("/* %s */", __func__);
+
+        name = strjoina(template, "/foo");
+        name2 = strjoina(template, "/bar");
+        name3 = strjoina(template, "/masked");
+        out = strjoina(template, "/out");
+
+        assert_se(write_string_file(name,
+                                    "#!/bin/sh\necho $1 >$2\n",
+                                    WRITE_STRING_FILE_CREATE) == 0);
+        assert_se(write_string_file(name2,
+                                    "#!/bin/sh\nexit 3\n",
+                                    WRITE_STRING_FILE_CREATE) == 0);
+        assert_se(symlink("/dev/null", name3) == 0);
+
+        assert_se(chmod(name, 0755) == 0);
+        assert_se(chmod(name2, 0755) == 0);
+
+        assert_se(paths = strv_new(name, name2, name3, NULL));
+        assert_se(argvs[0] = strv_new("", "hello", out, NULL));
+        assert_se(argvs[1] = strv_new("", NULL));
+        assert_se(argvs[2] = strv_new("", NULL));
+
+        assert_se(execute_binaries(paths, argvs, DEFAULT_TIMEOUT_USEC, results) >= 0);
+
+        assert_se(results[0].status == EXIT_SUCCESS);
+        assert_se(results[0].begin > 0);
+        assert_se(results[0].end >= results[0].begin);
+        assert_se(results[1].status == 3);
+        assert_se(results[2].status == 0);
+
+        assert_se(read_one_line_file(out, &contents) >= 0);
+        assert_se(streq(contents, "hello"));
+
+        for (i = 0; i < ELEMENTSOF(argvs); i++)
+                strv_free(argvs[i]);
+
+        (void) rm_rf(template, REMOVE_ROOT|REMOVE_PHYSICAL);
+}
+
 int main(int argc, char *argv[]) {
         log_set_max_level(LOG_DEBUG);
         log_parse_environment();
@@ -363,6 +414,7 @@ int main(int argc, char *argv[]) {
         test_execution_order();
         test_stdout_gathering();
         test_environment_gathering();
+        test_execute_binaries();
 
         return 0;
 }
@@ -402,6 +402,29 @@ static void test_exec_environmentfile(Manager *m) {
         (void) unlink("/tmp/test-exec_environmentfile.conf");
 }
 
+static void test_exec_fastspawn(Manager *m) {
+        _cleanup_free_ char *forked = NULL, *fast = NULL;
+
+        /* Simple services are spawned without fork(), unless this is turned off. Either way they need to end up with
+         * the same credentials, umask and resource limits. */
+
+        assert_se(setenv("SYSTEMD_EXEC_FAST_SPAWN", "0", 1) == 0);
+        test(m, "exec-fastspawn@fork.service", 0, CLD_EXITED);
+        assert_se(unsetenv("SYSTEMD_EXEC_FAST_SPAWN") == 0);
+        test(m, "exec-fastspawn@fast.service", 0, CLD_EXITED);
+
+        assert_se(read_full_file("/tmp/test-exec-fastspawn-fork", &forked, NULL) >= 0);
+        assert_se(read_full_file("/tmp/test-exec-fastspawn-fast", &fast, NULL) >= 0);
+        assert_se(startswith(forked, "0027\n1000\n2000\n"));
+        assert_se(streq(forked, fast));
+
+        (void) unlink("/tmp/test-exec-fastspawn-fork");
+        (void) unlink("/tmp/test-exec-fastspawn-fast");
+
+        /* The failure is reported back by the child, and logged asynchronously */
+        test(m, "exec-fastspawn-missing.service", EXIT_EXEC, CLD_EXITED);
+}
+
 static void test_exec_passenvironment(Manager *m) {
         /* test-execute runs under MANAGER_USER which, by default, forwards all
          * variables present in the environment, but only those that are
@@ -550,6 +573,7 @@ int main(int argc, char *argv[]) {
                 test_exec_cpuaffinity,
                 test_exec_environment,
                 test_exec_environmentfile,
+                test_exec_fastspawn,
                 test_exec_group,
                 test_exec_ignoresigpipe,
                 test_exec_inaccessiblepaths,
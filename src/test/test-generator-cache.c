@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "def.h"
+#include "fileio.h"
+#include "generator-cache.h"
+#include "hashmap.h"
+#include "log.h"
+#include "mkdir.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "strv.h"
+
+static void write_generator(const char *path, const char *script) {
+        assert_se(write_string_file(path, script, WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(chmod(path, 0755) >= 0);
+}
+
+static void test_generators_run(const char *root) {
+        _cleanup_strv_free_ char **generators = NULL;
+        _cleanup_free_ char *generator = NULL, *early = NULL, *late = NULL;
+        LookupPaths lp = {};
+        GeneratorRun *runs;
+        size_t n;
+        unsigned k;
+        uint64_t key;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(generator = strjoin(root, "/generator"));
+        assert_se(early = strjoin(root, "/generator.early"));
+        assert_se(late = strjoin(root, "/generator.late"));
+        lp.generator = generator;
+        lp.generator_early = early;
+        lp.generator_late = late;
+
+        /* The debug generator only depends on the kernel command line, hence is cached, the other one isn't known
+         * and is always run, writing into the generator directories directly */
+        assert_se(generators = strv_new(strjoina(root, "/systemd-debug-generator"),
+                                        strjoina(root, "/other-generator"),
+                                        NULL));
+        write_generator(generators[0], "#!/bin/sh\necho first >$1/a.service\n");
+        write_generator(generators[1], "#!/bin/sh\necho second >$1/c.service\necho second >$3/b.service\n");
+
+        assert_se(generator_cache_key(generators[0], &lp, &key) >= 0);
+        assert_se(generator_cache_key(generators[1], &lp, &key) == -EOPNOTSUPP);
+
+        for (k = 0; k < 3; k++) {
+                _cleanup_free_ char *contents = NULL;
+
+                assert_se(mkdir_p(generator, 0755) >= 0);
+                assert_se(mkdir_p(early, 0755) >= 0);
+                assert_se(mkdir_p(late, 0755) >= 0);
+
+                if (k == 2)
+                        /* Changing the generator itself invalidates its cached output */
+                        write_generator(generators[0], "#!/bin/sh\necho changed >$1/a.service\n");
+
+                assert_se(generators_run(generators, &lp, DEFAULT_TIMEOUT_USEC, &runs, &n) >= 0);
+                assert_se(n == 2);
+
+                assert_se(streq(runs[0].name, "systemd-debug-generator"));
+                assert_se(runs[0].cached == (k == 1));
+                assert_se(runs[0].status == 0);
+                assert_se(runs[0].end >= runs[0].begin);
+                assert_se(!runs[1].cached);
+                assert_se(runs[1].status == 0);
+
+                assert_se(read_one_line_file(strjoina(generator, "/a.service"), &contents) >= 0);
+                assert_se(streq(contents, k == 2 ? "changed" : "first"));
+                assert_se(access(strjoina(generator, "/c.service"), F_OK) >= 0);
+                assert_se(access(strjoina(late, "/b.service"), F_OK) >= 0);
+                assert_se(access(strjoina(generator, ".cache/other-generator"), F_OK) < 0 && errno == ENOENT);
+
+                generator_run_free_many(runs, n);
+
+                assert_se(rm_rf(generator, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+                assert_se(rm_rf(early, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+                assert_se(rm_rf(late, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+}
+
+static void test_inputs_changed_during_run(const char *root) {
+        _cleanup_strv_free_ char **generators = NULL;
+        _cleanup_free_ char *generator = NULL, *early = NULL, *late = NULL;
+        LookupPaths lp = {};
+        GeneratorRun *runs;
+        size_t n;
+        unsigned k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(generator = strjoin(root, "/generator"));
+        assert_se(early = strjoin(root, "/generator.early"));
+        assert_se(late = strjoin(root, "/generator.late"));
+        lp.generator = generator;
+        lp.generator_early = early;
+        lp.generator_late = late;
+
+        /* The generator modifies one of its inputs, itself, while it runs. Its output must not be taken as valid for
+         * the new inputs. */
+        assert_se(generators = strv_new(strjoina(root, "/systemd-debug-generator"), NULL));
+        write_generator(generators[0], "#!/bin/sh\necho first >$1/a.service\nsleep 0.01\ntouch $0\n");
+
+        for (k = 0; k < 2; k++) {
+                assert_se(mkdir_p(generator, 0755) >= 0);
+                assert_se(mkdir_p(early, 0755) >= 0);
+                assert_se(mkdir_p(late, 0755) >= 0);
+
+                assert_se(generators_run(generators, &lp, DEFAULT_TIMEOUT_USEC, &runs, &n) >= 0);
+                assert_se(n == 1);
+                assert_se(!runs[0].cached);
+                assert_se(runs[0].status == 0);
+                generator_run_free_many(runs, n);
+
+                assert_se(rm_rf(generator, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+                assert_se(rm_rf(early, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+                assert_se(rm_rf(late, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        }
+}
+
+static void write_output(const char *path, const char *contents, const struct timespec *ts) {
+        assert_se(write_string_file_ts(path, contents, WRITE_STRING_FILE_CREATE|WRITE_STRING_FILE_ATOMIC, ts) >= 0);
+}
+
+static void assert_mtime(const char *path, const struct stat *expected, bool same) {
+        struct stat st;
+
+        assert_se(lstat(path, &st) >= 0);
+        assert_se((st.st_mtim.tv_sec == expected->st_mtim.tv_sec &&
+                   st.st_mtim.tv_nsec == expected->st_mtim.tv_nsec) == same);
+}
+
+static void test_outputs_keep_timestamps(const char *root) {
+        _cleanup_hashmap_free_free_free_ Hashmap *before = NULL;
+        _cleanup_free_ char *generator = NULL, *early = NULL, *late = NULL;
+        struct stat same, changed, link;
+        LookupPaths lp = {};
+        struct timespec ts;
+        const char *p;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(generator = strjoin(root, "/generator"));
+        assert_se(early = strjoin(root, "/generator.early"));
+        assert_se(late = strjoin(root, "/generator.late"));
+        lp.generator = generator;
+        lp.generator_early = early;
+        lp.generator_late = late;
+
+        /* Write some output with a timestamp in the past, as a generator would have done on an earlier run */
+        timespec_store(&ts, now(CLOCK_REALTIME) - USEC_PER_HOUR);
+        assert_se(mkdir_p(strjoina(generator, "/a.service.d"), 0755) >= 0);
+        write_output(strjoina(generator, "/a.service"), "same", &ts);
+        write_output(strjoina(generator, "/a.service.d/x.conf"), "old", &ts);
+        write_output(strjoina(generator, "/removed.service"), "gone", &ts);
+        assert_se(mkdir_p(strjoina(late, "/b.target.wants"), 0755) >= 0);
+        p = strjoina(late, "/b.target.wants/a.service");
+        assert_se(symlink("../a.service", p) >= 0);
+        assert_se(utimensat(AT_FDCWD, p, (const struct timespec[2]) { ts, ts }, AT_SYMLINK_NOFOLLOW) >= 0);
+
+        assert_se(lstat(strjoina(generator, "/a.service"), &same) >= 0);
+        assert_se(lstat(strjoina(generator, "/a.service.d/x.conf"), &changed) >= 0);
+        assert_se(lstat(p, &link) >= 0);
+
+        assert_se(generator_outputs_collect(&lp, &before) >= 0);
+        assert_se(hashmap_size(before) == 4);
+
+        /* Run the "generators" again: everything is written anew, one file changed, one is gone and one is new */
+        assert_se(rm_rf(generator, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        assert_se(rm_rf(late, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        assert_se(mkdir_p(strjoina(generator, "/a.service.d"), 0755) >= 0);
+        assert_se(write_string_file(strjoina(generator, "/a.service"), "same", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(write_string_file(strjoina(generator, "/a.service.d/x.conf"), "new", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(write_string_file(strjoina(generator, "/added.service"), "new", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(mkdir_p(strjoina(late, "/b.target.wants"), 0755) >= 0);
+        assert_se(symlink("../a.service", p) >= 0);
+
+        assert_mtime(strjoina(generator, "/a.service"), &same, false);
+        assert_mtime(p, &link, false);
+
+        assert_se(generator_outputs_keep_timestamps(&lp, before) == 3);
+
+        /* Unchanged output looks untouched, everything else keeps its new timestamp */
+        assert_mtime(strjoina(generator, "/a.service"), &same, true);
+        assert_mtime(p, &link, true);
+        assert_mtime(strjoina(generator, "/a.service.d/x.conf"), &changed, false);
+
+        /* And a second comparison against the same snapshot finds the same changes */
+        assert_se(generator_outputs_keep_timestamps(&lp, before) == 3);
+
+        assert_se(rm_rf(generator, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        assert_se(rm_rf(late, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        char root[] = "/tmp/test-generator-cache.XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+        log_open();
+
+        assert_se(mkdtemp(root));
+
+        test_generators_run(root);
+        test_inputs_changed_during_run(root);
+        test_outputs_keep_timestamps(root);
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "libudev.h"
+
+#include "alloc-util.h"
+#include "libudev-private.h"
+#include "log.h"
+#include "macro.h"
+#include "parse-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "time-util.h"
+#include "udev-util.h"
+
+static struct udev *udev;
+
+static struct udev_device *make_device(unsigned seqnum, const char *subsystem) {
+        struct udev_device *dev;
+        char buf[256];
+        int n;
+
+        n = snprintf(buf, sizeof(buf), "ACTION=add%cDEVPATH=/devices/virtual/%s/test%u%cSUBSYSTEM=%s%cSEQNUM=%u",
+                     0, subsystem, seqnum, 0, subsystem, 0, seqnum);
+        assert_se(n > 0 && (size_t) n < sizeof(buf));
+        assert_se(dev = udev_device_new_from_nulstr(udev, buf, n + 1));
+
+        return dev;
+}
+
+static void make_monitors(struct udev_monitor **ret_sender, struct udev_monitor **ret_receiver, const char *subsystem) {
+        struct udev_monitor *sender, *receiver;
+
+        /* The same setup as udevd uses to pass devices on to its workers */
+        assert_se(sender = udev_monitor_new_from_netlink(udev, NULL));
+        assert_se(udev_monitor_enable_receiving(sender) >= 0);
+
+        assert_se(receiver = udev_monitor_new_from_netlink(udev, NULL));
+        assert_se(udev_monitor_allow_unicast_sender(receiver, sender) >= 0);
+        if (subsystem)
+                assert_se(udev_monitor_filter_add_match_subsystem_devtype(receiver, subsystem, NULL) >= 0);
+        assert_se(udev_monitor_enable_receiving(receiver) >= 0);
+
+        *ret_sender = sender;
+        *ret_receiver = receiver;
+}
+
+static void test_batch(void) {
+        struct udev_monitor *sender, *receiver, *destinations[UDEV_MONITOR_BATCH_MAX];
+        struct udev_device *devs[UDEV_MONITOR_BATCH_MAX], *received[UDEV_MONITOR_BATCH_MAX + 5];
+        unsigned seqnum = 1, expected = 1;
+        int i, r;
+
+        log_info("/* %s */", __func__);
+
+        make_monitors(&sender, &receiver, NULL);
+
+        for (i = 0; i < UDEV_MONITOR_BATCH_MAX; i++)
+                destinations[i] = receiver;
+
+        while (seqnum <= 200) {
+                int n = seqnum % UDEV_MONITOR_BATCH_MAX + 1;
+
+                for (i = 0; i < n; i++)
+                        devs[i] = make_device(seqnum++, "test");
+
+                assert_se(udev_monitor_send_devices(sender, destinations, devs, n) == n);
+
+                for (i = 0; i < n; i++)
+                        udev_device_unref(devs[i]);
+
+                /* Everything that was queued is picked up at once, in order */
+                r = udev_monitor_receive_devices(receiver, received, ELEMENTSOF(received));
+                assert_se(r == n);
+
+                for (i = 0; i < r; i++) {
+                        char devpath[64];
+
+                        xsprintf(devpath, "/devices/virtual/test/test%u", expected);
+                        assert_se(udev_device_get_seqnum(received[i]) == expected);
+                        assert_se(streq(udev_device_get_devpath(received[i]), devpath));
+                        assert_se(udev_device_get_is_initialized(received[i]));
+                        expected++;
+
+                        udev_device_unref(received[i]);
+                }
+        }
+
+        assert_se(udev_monitor_receive_devices(receiver, received, ELEMENTSOF(received)) == -EAGAIN);
+
+        udev_monitor_unref(receiver);
+        udev_monitor_unref(sender);
+}
+
+static void test_filter(void) {
+        struct udev_monitor *sender, *receiver;
+        struct udev_device *devs[UDEV_MONITOR_BATCH_MAX], *received[UDEV_MONITOR_BATCH_MAX];
+        struct udev_monitor *destinations[UDEV_MONITOR_BATCH_MAX];
+        int i, r;
+
+        log_info("/* %s */", __func__);
+
+        make_monitors(&sender, &receiver, "block");
+
+        for (i = 0; i < UDEV_MONITOR_BATCH_MAX; i++) {
+                devs[i] = make_device(i + 1, i % 4 == 0 ? "block" : "net");
+                destinations[i] = receiver;
+        }
+
+        assert_se(udev_monitor_send_devices(sender, destinations, devs, UDEV_MONITOR_BATCH_MAX) == UDEV_MONITOR_BATCH_MAX);
+
+        r = udev_monitor_receive_devices(receiver, received, ELEMENTSOF(received));
+        assert_se(r == UDEV_MONITOR_BATCH_MAX / 4);
+        for (i = 0; i < r; i++) {
+                assert_se(streq(udev_device_get_subsystem(received[i]), "block"));
+                assert_se(udev_device_get_seqnum(received[i]) == (unsigned long long) i * 4 + 1);
+                udev_device_unref(received[i]);
+        }
+
+        /* If nothing passes the filter, there's nothing to return */
+        assert_se(udev_monitor_send_devices(sender, destinations, devs + 1, 3) == 3);
+        assert_se(udev_monitor_receive_devices(receiver, received, ELEMENTSOF(received)) == -EAGAIN);
+
+        for (i = 0; i < UDEV_MONITOR_BATCH_MAX; i++)
+                udev_device_unref(devs[i]);
+
+        udev_monitor_unref(receiver);
+        udev_monitor_unref(sender);
+}
+
+static void test_performance(unsigned n_events) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX];
+        struct udev_monitor *sender, *receiver, *destinations[UDEV_MONITOR_BATCH_MAX];
+        _cleanup_free_ struct udev_device **devs = NULL;
+        struct udev_device *received[UDEV_MONITOR_BATCH_MAX];
+        usec_t ts, single, batched;
+        unsigned i, k;
+
+        log_info("/* %s(%u) */", __func__, n_events);
+
+        /* A device storm: bursts of events, passed on and picked up one by one, and then in batches */
+
+        make_monitors(&sender, &receiver, NULL);
+
+        assert_se(devs = new(struct udev_device*, n_events));
+        for (i = 0; i < n_events; i++)
+                devs[i] = make_device(i + 1, "test");
+        for (i = 0; i < UDEV_MONITOR_BATCH_MAX; i++)
+                destinations[i] = receiver;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_events; i += k) {
+                unsigned j;
+
+                k = MIN(n_events - i, (unsigned) UDEV_MONITOR_BATCH_MAX);
+
+                for (j = 0; j < k; j++)
+                        assert_se(udev_monitor_send_device(sender, receiver, devs[i + j]) > 0);
+                for (j = 0; j < k; j++) {
+                        _cleanup_udev_device_unref_ struct udev_device *d = NULL;
+
+                        assert_se(d = udev_monitor_receive_device(receiver));
+                }
+        }
+        single = now(CLOCK_MONOTONIC) - ts;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_events; i += k) {
+                int j, r;
+
+                k = MIN(n_events - i, (unsigned) UDEV_MONITOR_BATCH_MAX);
+
+                assert_se(udev_monitor_send_devices(sender, destinations, devs + i, k) == (int) k);
+                r = udev_monitor_receive_devices(receiver, received, ELEMENTSOF(received));
+                assert_se(r == (int) k);
+                for (j = 0; j < r; j++)
+                        udev_device_unref(received[j]);
+        }
+        batched = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("%u events: passing them on one by one took %s, in batches of up to %u it took %s",
+                 n_events, format_timespan(buf1, sizeof(buf1), single, 1),
+                 UDEV_MONITOR_BATCH_MAX, format_timespan(buf2, sizeof(buf2), batched, 1));
+
+        for (i = 0; i < n_events; i++)
+                udev_device_unref(devs[i]);
+
+        udev_monitor_unref(receiver);
+        udev_monitor_unref(sender);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 10000;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        /* sending to another netlink port needs privileges, and monitors only accept messages from root */
+        if (geteuid() != 0) {
+                log_info("Skipping test: not root");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(udev = udev_new());
+
+        test_batch();
+        test_filter();
+        test_performance(n);
+
+        udev_unref(udev);
+
+        return 0;
+}
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fdset.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "manager.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "test-helper.h"
+#include "tests.h"
+
+#define N_TARGETS 10U
+#define N_SERVICES 5U
+
+static char **list(Manager *m, char **states, uint64_t types, char **patterns, uint64_t since, unsigned max) {
+        _cleanup_free_ char *cursor = NULL;
+        char **l = NULL;
+        bool more;
+
+        /* Collects all pages, and checks that each but the last is full */
+
+        do {
+                _cleanup_free_ Unit **units = NULL;
+                size_t n, i;
+
+                assert_se(manager_list_units_page(m, states, types, patterns, since, cursor, max, &units, &n, &more) >= 0);
+                assert_se(!more || n == max);
+
+                for (i = 0; i < n; i++)
+                        assert_se(strv_extend(&l, units[i]->id) >= 0);
+
+                if (more) {
+                        free(cursor);
+                        assert_se(cursor = strdup(units[n - 1]->id));
+                }
+        } while (more);
+
+        return l;
+}
+
+static void assert_names(char **l, const char *format, unsigned first, unsigned step, unsigned n) {
+        char name[STRLEN("list-test-.service") + DECIMAL_STR_MAX(unsigned)];
+        unsigned i;
+
+        assert_se(strv_length(l) == n);
+
+        for (i = 0; i < n; i++) {
+                xsprintf(name, format, first + i * step);
+                assert_se(streq(l[i], name));
+        }
+}
+
+static Manager *start_manager(FILE *serialization, FDSet *fds) {
+        Manager *m;
+        unsigned i;
+
+        assert_se(manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m) >= 0);
+        assert_se(manager_startup(m, serialization, fds) >= 0);
+
+        for (i = 0; i < N_TARGETS + N_SERVICES; i++) {
+                char name[STRLEN("list-test-.service") + DECIMAL_STR_MAX(unsigned)];
+                Unit *u;
+
+                if (i < N_TARGETS)
+                        xsprintf(name, "list-test-%02u.target", i);
+                else
+                        xsprintf(name, "list-test-%02u.service", i - N_TARGETS);
+
+                assert_se(manager_load_unit(m, name, NULL, NULL, &u) >= 0);
+                assert_se(u->load_state == UNIT_LOADED);
+        }
+
+        return m;
+}
+
+static void test_list_units(void) {
+        char **active = STRV_MAKE("active"), **dead = STRV_MAKE("dead"), **all = STRV_MAKE("list-test-*"),
+                **loaded_inactive = STRV_MAKE("loaded", "inactive"), **l;
+        _cleanup_fdset_free_ FDSet *fds = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        uint64_t generation;
+        Manager *m;
+        unsigned i, max;
+        Unit *u;
+
+        log_info("/* %s */", __func__);
+
+        m = start_manager(NULL, NULL);
+
+        for (i = 0; i < N_TARGETS; i += 2) {
+                char name[STRLEN("list-test-.target") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(name, "list-test-%02u.target", i);
+                assert_se(u = manager_get_unit(m, name));
+                assert_se(unit_start(u) >= 0);
+                assert_se(unit_active_state(u) == UNIT_ACTIVE);
+        }
+
+        /* Whatever the page size, the pages add up to the same ordered list */
+        for (max = 0; max <= N_TARGETS; max++) {
+                /* The per-state index */
+                l = list(m, active, 0, all, 0, max);
+                assert_names(l, "list-test-%02u.target", 0, 2, N_TARGETS / 2);
+                strv_free(l);
+
+                /* The per-type index */
+                l = list(m, NULL, UINT64_C(1) << UNIT_SERVICE, all, 0, max);
+                assert_names(l, "list-test-%02u.service", 0, 1, N_SERVICES);
+                strv_free(l);
+
+                /* Sub states need a full scan */
+                l = list(m, dead, UINT64_C(1) << UNIT_TARGET, all, 0, max);
+                assert_names(l, "list-test-%02u.target", 1, 2, N_TARGETS / 2);
+                strv_free(l);
+        }
+
+        /* Patterns, and a state list mixing load and active states */
+        l = list(m, loaded_inactive, 0, STRV_MAKE("list-test-0[0-3].*"), 0, 1);
+        assert_se(strv_equal(l, STRV_MAKE("list-test-00.service", "list-test-00.target", "list-test-01.service",
+                                          "list-test-01.target", "list-test-02.service", "list-test-02.target",
+                                          "list-test-03.service", "list-test-03.target")));
+        strv_free(l);
+
+        /* Only what changed since a generation */
+        generation = m->unit_generation;
+        assert_se(u = manager_get_unit(m, "list-test-02.target"));
+        assert_se(unit_stop(u) >= 0);
+        l = list(m, NULL, 0, all, generation, 1);
+        assert_se(strv_equal(l, STRV_MAKE("list-test-02.target")));
+        strv_free(l);
+        l = list(m, active, 0, all, generation, 1);
+        assert_se(strv_isempty(l));
+        strv_free(l);
+
+        /* The per-state index is restored after a round trip through the serialization */
+        assert_se(manager_open_serialization(m, &f) >= 0);
+        assert_se(fds = fdset_new());
+        assert_se(manager_serialize(m, f, fds, false, true) >= 0);
+        assert_se(fseeko(f, 0, SEEK_SET) >= 0);
+        manager_free(m);
+
+        m = start_manager(f, fds);
+
+        for (max = 0; max <= 3; max++) {
+                l = list(m, active, 0, all, 0, max);
+                assert_se(strv_equal(l, STRV_MAKE("list-test-00.target", "list-test-04.target",
+                                                  "list-test-06.target", "list-test-08.target")));
+                strv_free(l);
+        }
+
+        manager_free(m);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL, *unit_dir = NULL;
+        Manager *m;
+        unsigned i;
+        int r;
+
+        log_parse_environment();
+        log_open();
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                log_notice_errno(r, "Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(mkdtemp_malloc("/tmp/test-manager-list-units-XXXXXX", &unit_dir) >= 0);
+
+        for (i = 0; i < N_TARGETS + N_SERVICES; i++) {
+                char name[STRLEN("list-test-.service") + DECIMAL_STR_MAX(unsigned)];
+                const char *p;
+
+                if (i < N_TARGETS)
+                        xsprintf(name, "list-test-%02u.target", i);
+                else
+                        xsprintf(name, "list-test-%02u.service", i - N_TARGETS);
+
+                p = strjoina(unit_dir, "/", name);
+                assert_se(write_string_file(p, i < N_TARGETS ? "[Unit]\n" : "[Service]\nExecStart=/bin/true\n",
+                                            WRITE_STRING_FILE_CREATE) >= 0);
+        }
+
+        assert_se(set_unit_path(unit_dir) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (MANAGER_SKIP_TEST(r)) {
+                log_notice_errno(r, "Skipping test: manager_new: %m");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        manager_free(m);
+
+        test_list_units();
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "manager.h"
+#include "mkdir.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "test-helper.h"
+#include "tests.h"
+
+static void write_unit(const char *dir, const char *name, const char *contents, usec_t mtime) {
+        struct timespec ts;
+        const char *p;
+
+        p = strjoina(dir, "/", name);
+        assert_se(write_string_file_ts(p, contents,
+                                       WRITE_STRING_FILE_CREATE|WRITE_STRING_FILE_ATOMIC|WRITE_STRING_FILE_AVOID_NEWLINE,
+                                       timespec_store(&ts, mtime)) >= 0);
+}
+
+static void test_reload_incremental(const char *dir) {
+        Unit *a, *b, *c, *u;
+        Manager *m;
+        usec_t t;
+        const char *p;
+
+        t = now(CLOCK_REALTIME);
+
+        write_unit(dir, "a.service", "[Unit]\nDescription=A\n[Service]\nExecStart=/bin/true\n", t);
+        write_unit(dir, "b.service", "[Unit]\nDescription=B\nWants=a.service\nAfter=a.service\n[Service]\nExecStart=/bin/true\n", t);
+        write_unit(dir, "c.service", "[Unit]\nDescription=C\n[Service]\nExecStart=/bin/true\n", t);
+
+        assert_se(manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m) >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        assert_se(manager_load_unit(m, "a.service", NULL, NULL, &a) >= 0);
+        assert_se(manager_load_unit(m, "b.service", NULL, NULL, &b) >= 0);
+        assert_se(manager_load_unit(m, "c.service", NULL, NULL, &c) >= 0);
+        assert_se(streq(a->description, "A"));
+
+        /* Nothing changed, nothing is reloaded */
+        assert_se(manager_reload_incremental(m) >= 0);
+        assert_se(manager_get_unit(m, "a.service") == a);
+        assert_se(manager_get_unit(m, "b.service") == b);
+
+        /* Change a.service, b.service is kept but its dependencies on a.service survive */
+        write_unit(dir, "a.service", "[Unit]\nDescription=A2\n[Service]\nExecStart=/bin/true\n", t + USEC_PER_SEC);
+        assert_se(unit_need_daemon_reload(a));
+        assert_se(!unit_need_daemon_reload(b));
+
+        assert_se(manager_reload_incremental(m) >= 0);
+        assert_se(manager_get_unit(m, "b.service") == b);
+        assert_se(manager_get_unit(m, "c.service") == c);
+        assert_se(u = manager_get_unit(m, "a.service"));
+        assert_se(streq(u->description, "A2"));
+        assert_se(!unit_need_daemon_reload(u));
+        assert_se(unit_dependency_list_contains(&b->dependencies[UNIT_WANTS], u));
+        assert_se(unit_dependency_list_contains(&b->dependencies[UNIT_AFTER], u));
+        assert_se(unit_dependency_list_contains(&u->dependencies[UNIT_WANTED_BY], b));
+        assert_se(unit_dependency_list_contains(&u->dependencies[UNIT_BEFORE], b));
+
+        /* Add a .wants/ symlink for c.service to b.service */
+        p = strjoina(dir, "/b.service.wants");
+        assert_se(mkdir_p(p, 0755) >= 0);
+        p = strjoina(p, "/c.service");
+        assert_se(symlink("../c.service", p) >= 0);
+        assert_se(!unit_need_daemon_reload(b)); /* The new directory is not in the path cache yet */
+
+        assert_se(manager_reload_incremental(m) >= 0);
+        assert_se(manager_get_unit(m, "c.service") == c);
+        assert_se(u = manager_get_unit(m, "b.service"));
+        assert_se(unit_dependency_list_contains(&u->dependencies[UNIT_WANTS], c));
+        assert_se(unit_dependency_list_contains(&c->dependencies[UNIT_WANTED_BY], u));
+
+        /* And remove it again */
+        assert_se(unlink(p) >= 0);
+        assert_se(unit_need_daemon_reload(u));
+
+        assert_se(manager_reload_incremental(m) >= 0);
+        assert_se(u = manager_get_unit(m, "b.service"));
+        assert_se(!unit_dependency_list_contains(&u->dependencies[UNIT_WANTS], c));
+        assert_se(unit_dependency_list_contains(&u->dependencies[UNIT_WANTS], manager_get_unit(m, "a.service")));
+
+        manager_free(m);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL, *unit_dir = NULL;
+        Manager *m;
+        int r;
+
+        log_parse_environment();
+        log_open();
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                log_notice_errno(r, "Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(mkdtemp_malloc("/tmp/test-manager-reload-XXXXXX", &unit_dir) >= 0);
+        assert_se(set_unit_path(unit_dir) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (MANAGER_SKIP_TEST(r)) {
+                log_notice_errno(r, "Skipping test: manager_new: %m");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        manager_free(m);
+
+        test_reload_incremental(unit_dir);
+
+        return EXIT_SUCCESS;
+}
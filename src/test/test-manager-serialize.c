@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "alloc-util.h"
+#include "env-util.h"
+#include "fd-util.h"
+#include "fdset.h"
+#include "fileio.h"
+#include "log.h"
+#include "manager.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "serialize-binary.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "test-helper.h"
+#include "tests.h"
+
+static void test_items(void) {
+        _cleanup_free_ char *text = NULL, *buf = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        const char *k, *v;
+        const uint8_t *p;
+        size_t size = 0, left;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(text = strdup("a=1\n b=x=y \nflag\njob\njob-id=3\n\n"));
+
+        assert_se(f = open_memstream(&buf, &size));
+        assert_se(serialize_binary_items(f, text, strlen(text)) >= 0);
+        assert_se(fflush_and_check(f) >= 0);
+
+        p = (const uint8_t*) buf;
+        left = size;
+
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "a") && streq(v, "1"));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "b") && streq(v, "x=y"));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "flag") && streq(v, ""));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "job") && streq(v, ""));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "job-id") && streq(v, "3"));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 1);
+        assert_se(streq(k, "") && streq(v, ""));
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == 0);
+
+        /* A truncated record is refused */
+        p = (const uint8_t*) buf;
+        left = size - 1;
+        while (deserialize_binary_item(&p, &left, &k, &v) > 0)
+                ;
+        assert_se(left > 0);
+        assert_se(deserialize_binary_item(&p, &left, &k, &v) == -EBADMSG);
+}
+
+static void test_round_trip(unsigned n_units, bool binary) {
+        _cleanup_fdset_free_ FDSet *fds = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ sd_id128_t *ids = NULL;
+        char name[sizeof("serialize-test-.service") + DECIMAL_STR_MAX(unsigned)], buf[FORMAT_TIMESPAN_MAX];
+        uint32_t job_id = 0;
+        Manager *m;
+        usec_t ts;
+        unsigned i;
+
+        log_info("/* %s(%u, %s) */", __func__, n_units, binary ? "binary" : "text");
+
+        assert_se(ids = new(sd_id128_t, n_units));
+
+        assert_se(manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m) >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        for (i = 0; i < n_units; i++) {
+                Unit *u;
+
+                xsprintf(name, "serialize-test-%u.service", i);
+
+                assert_se(u = unit_new(m, sizeof(Service)));
+                assert_se(unit_add_name(u, name) >= 0);
+
+                assert_se(sd_id128_randomize(ids + i) >= 0);
+                assert_se(unit_set_invocation_id(u, ids[i]) >= 0);
+
+                if (i == 0) {
+                        Job *j;
+
+                        assert_se(j = job_new(u, JOB_START));
+                        assert_se(job_install(j) == j);
+                        job_id = j->id;
+                }
+        }
+
+        m->n_failed_jobs = 7;
+        assert_se(strv_env_replace(&m->environment, strdup("SERIALIZE_TEST=a=b")) >= 0);
+
+        assert_se(manager_open_serialization(m, &f) >= 0);
+        assert_se(fds = fdset_new());
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(manager_serialize(m, f, fds, false, binary) >= 0);
+        log_info("Serialized %u units in %s.", n_units, format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - ts, 0));
+
+        assert_se(fseeko(f, 0, SEEK_SET) >= 0);
+        manager_free(m);
+
+        assert_se(manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m) >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(manager_deserialize(m, f, fds) >= 0);
+        log_info("Deserialized %u units in %s.", n_units, format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - ts, 0));
+
+        for (i = 0; i < n_units; i++) {
+                Unit *u;
+
+                xsprintf(name, "serialize-test-%u.service", i);
+
+                assert_se(u = manager_get_unit(m, name));
+                assert_se(sd_id128_equal(u->invocation_id, ids[i]));
+
+                if (i == 0)
+                        assert_se(u->job && u->job->id == job_id && u->job->type == JOB_START);
+                else
+                        assert_se(!u->job);
+        }
+
+        assert_se(m->n_failed_jobs == 7);
+        assert_se(streq_ptr(strv_env_get(m->environment, "SERIALIZE_TEST"), "a=b"));
+
+        manager_free(m);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        unsigned n_units = 1000;
+        Manager *m;
+        int r;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_units) >= 0);
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                log_notice_errno(r, "Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(set_unit_path(get_testdata_dir("")) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (MANAGER_SKIP_TEST(r)) {
+                log_notice_errno(r, "Skipping test: manager_new: %m");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        manager_free(m);
+
+        test_items();
+
+        /* The binary format is used for reloading and reexecuting the same binary, the text format otherwise */
+        test_round_trip(n_units, true);
+        test_round_trip(n_units, false);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "log.h"
+#include "mount-table.h"
+#include "parse-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "time-util.h"
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(struct libmnt_table*, mnt_free_table);
+
+static char *make_mountinfo(unsigned n, unsigned skip, const char *extra) {
+        _cleanup_fclose_ FILE *f = NULL;
+        char *s = NULL;
+        size_t size;
+        unsigned i;
+
+        assert_se(f = open_memstream(&s, &size));
+
+        fputs("20 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n", f);
+        for (i = 0; i < n; i++) {
+                if (i == skip)
+                        continue;
+
+                fprintf(f, "%u 20 0:%u / /run/test/%u rw,nosuid,nodev shared:%u - tmpfs tmpfs rw,size=1024k\n",
+                        100 + i, 100 + i, i, 100 + i);
+        }
+        if (extra)
+                fputs(extra, f);
+
+        assert_se(fflush_and_check(f) >= 0);
+        f = safe_fclose(f);
+
+        return s;
+}
+
+static void load(MountTable *t, const char *mountinfo) {
+        _cleanup_(mnt_free_tablep) struct libmnt_table *tb = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ char *copy = NULL;
+
+        /* Real users get the table from mnt_table_parse_mtab(), but that only reads the real files */
+        assert_se(f = fmemopen((void*) mountinfo, strlen(mountinfo), "re"));
+        assert_se(tb = mnt_new_table());
+        assert_se(mnt_table_parse_stream(tb, f, "/proc/self/mountinfo") >= 0);
+
+        assert_se(copy = strdup(mountinfo));
+        assert_se(mount_table_load(t, tb, copy) >= 0);
+        assert_se(t->loaded);
+        assert_se(t->n_changed == 0);
+        assert_se(t->n_removed == 0);
+}
+
+static void update(MountTable *t, const char *mountinfo, size_t n_changed, size_t n_removed) {
+        _cleanup_free_ char *copy = NULL;
+
+        assert_se(copy = strdup(mountinfo));
+        assert_se(mount_table_update(t, copy) >= 0);
+
+        log_debug("changed=%zu removed=%zu", t->n_changed, t->n_removed);
+        assert_se(t->n_changed == n_changed);
+        assert_se(t->n_removed == n_removed);
+}
+
+static void test_basic(void) {
+        _cleanup_free_ char *a = NULL, *b = NULL, *c = NULL, *d = NULL;
+        MountTable t = {};
+        MountTableEntry *e;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(a = make_mountinfo(10, (unsigned) -1, NULL));
+        load(&t, a);
+        assert_se(hashmap_size(t.entries) == 11);
+
+        assert_se(e = mount_table_find_where(&t, "/run/test/3"));
+        assert_se(e->id == 103);
+        assert_se(streq(e->what, "tmpfs"));
+        assert_se(streq(e->fstype, "tmpfs"));
+        assert_se(streq(e->options, "rw,nosuid,nodev,size=1024k"));
+
+        /* Nothing changed */
+        update(&t, a, 0, 0);
+
+        /* One mount added, with an escaped path */
+        assert_se(b = make_mountinfo(10, (unsigned) -1, "200 20 0:200 / /run/test/with\\040space rw - tmpfs tmpfs rw\n"));
+        update(&t, b, 1, 0);
+        assert_se(t.changed[0]->id == 200);
+        assert_se(streq(t.changed[0]->where, "/run/test/with space"));
+        assert_se(mount_table_find_where(&t, "/run/test/with space") == t.changed[0]);
+
+        /* Mounted on top of another one, and the original one remounted read-only */
+        assert_se(c = make_mountinfo(10, (unsigned) -1,
+                                     "200 20 0:200 / /run/test/with\\040space ro - tmpfs tmpfs ro\n"
+                                     "201 200 0:201 / /run/test/with\\040space rw - ramfs ramfs rw\n"));
+        update(&t, c, 2, 0);
+        assert_se(t.changed[0]->id == 200);
+        assert_se(streq(t.changed[0]->options, "ro"));
+        assert_se(t.changed[1]->id == 201);
+        assert_se(mount_table_find_where(&t, "/run/test/with space")->id == 201);
+
+        /* The top one goes away again, and one of the others too */
+        assert_se(d = make_mountinfo(10, 5, "200 20 0:200 / /run/test/with\\040space ro - tmpfs tmpfs ro\n"));
+        update(&t, d, 0, 2);
+        assert_se(IN_SET(t.removed[0]->id, 105, 201));
+        assert_se(IN_SET(t.removed[1]->id, 105, 201));
+        assert_se(mount_table_find_where(&t, "/run/test/with space")->id == 200);
+        assert_se(!mount_table_find_where(&t, "/run/test/5"));
+        assert_se(mount_table_find_what(&t, "ramfs") == NULL);
+        assert_se(mount_table_find_what(&t, "/dev/sda1")->id == 20);
+
+        mount_table_done(&t);
+        assert_se(!t.loaded);
+}
+
+static void test_user_options(void) {
+        _cleanup_free_ char *a = NULL, *b = NULL;
+        MountTable t = {};
+        MountTableEntry *e;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(a = make_mountinfo(3, (unsigned) -1, NULL));
+        load(&t, a);
+
+        /* Pretend utab had an entry for this one */
+        assert_se(e = mount_table_find_where(&t, "/run/test/1"));
+        assert_se(free_and_strdup(&e->user_options, "_netdev") >= 0);
+
+        assert_se(b = strreplace(a, "/run/test/1 rw,", "/run/test/1 ro,"));
+        update(&t, b, 1, 0);
+        assert_se(streq(t.changed[0]->options, "ro,nosuid,nodev,size=1024k,_netdev"));
+
+        mount_table_done(&t);
+}
+
+static void test_id_reuse(void) {
+        _cleanup_free_ char *a = NULL, *b = NULL, *c = NULL;
+        MountTable t = {};
+        MountTableEntry *e;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(a = make_mountinfo(3, (unsigned) -1, "300 20 8:2 / /a rw - ext4 /dev/sda2 rw\n"));
+        load(&t, a);
+
+        assert_se(e = mount_table_find_where(&t, "/a"));
+        assert_se(free_and_strdup(&e->user_options, "_netdev") >= 0);
+
+        /* umount /a, then mount /b, and the kernel hands out the same ID again */
+        assert_se(b = make_mountinfo(3, (unsigned) -1, "300 20 8:3 / /b rw - ext4 /dev/sda3 rw\n"));
+        update(&t, b, 1, 1);
+        assert_se(t.removed[0]->id == 300);
+        assert_se(streq(t.removed[0]->where, "/a"));
+        assert_se(streq(t.removed[0]->what, "/dev/sda2"));
+        assert_se(t.changed[0]->id == 300);
+        assert_se(t.changed[0] != t.removed[0]);
+        assert_se(streq(t.changed[0]->where, "/b"));
+        assert_se(!t.changed[0]->user_options);
+        assert_se(streq(t.changed[0]->options, "rw"));
+        assert_se(!mount_table_find_where(&t, "/a"));
+        assert_se(!mount_table_find_what(&t, "/dev/sda2"));
+        assert_se(mount_table_find_where(&t, "/b") == t.changed[0]);
+        assert_se(mount_table_find_what(&t, "/dev/sda3") == t.changed[0]);
+
+        /* Moving a mount changes the parent ID only, that is still the same mount */
+        assert_se(c = make_mountinfo(3, (unsigned) -1, "300 101 8:3 / /b ro - ext4 /dev/sda3 ro\n"));
+        update(&t, c, 1, 0);
+        assert_se(t.changed[0]->id == 300);
+        assert_se(streq(t.changed[0]->options, "ro"));
+
+        mount_table_done(&t);
+}
+
+static void test_performance(unsigned n) {
+        _cleanup_free_ char *a = NULL, *b = NULL;
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX];
+        MountTable t = {};
+        usec_t ts, full, incremental;
+        unsigned i;
+
+        log_info("/* %s(%u) */", __func__, n);
+
+        assert_se(a = make_mountinfo(n, (unsigned) -1, NULL));
+        assert_se(b = make_mountinfo(n, (unsigned) -1, "99999 20 0:9999 / /run/test/new rw - tmpfs tmpfs rw\n"));
+
+        /* What each mount event used to cost: parsing the full table with libmount */
+        ts = now(CLOCK_PROCESS_CPUTIME_ID);
+        for (i = 0; i < 10; i++)
+                load(&t, i % 2 ? a : b);
+        full = (now(CLOCK_PROCESS_CPUTIME_ID) - ts) / 10;
+
+        /* And now, only the differences */
+        ts = now(CLOCK_PROCESS_CPUTIME_ID);
+        for (i = 0; i < 10; i++)
+                update(&t, i % 2 ? a : b, !(i % 2), i % 2);
+        incremental = (now(CLOCK_PROCESS_CPUTIME_ID) - ts) / 10;
+
+        log_info("CPU time per mount event with %u mounts: full parse %s, incremental %s",
+                 n, format_timespan(buf1, sizeof(buf1), full, 1),
+                 format_timespan(buf2, sizeof(buf2), incremental, 1));
+
+        mount_table_done(&t);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 5000;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        test_basic();
+        test_user_options();
+        test_id_reuse();
+        test_performance(n);
+
+        return 0;
+}
@@ -31,6 +31,7 @@
 #include "path-util.h"
 #include "rm-rf.h"
 #include "string-util.h"
+#include "strv.h"
 
 static void test_mount_propagation_flags(const char *name, int ret, unsigned long expected) {
         long unsigned flags;
@@ -261,6 +262,71 @@ static void test_path_is_mount_point(void) {
         assert_se(rm_rf(tmp_dir, REMOVE_ROOT|REMOVE_PHYSICAL) == 0);
 }
 
+static void test_mount_info(void) {
+        static const char mountinfo[] =
+                "20 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+                "21 20 0:21 / /usr ro,nosuid,nodev - ext4 /dev/sda2 rw\n"
+                "22 20 0:22 / /home rw,noexec,noatime - tmpfs tmpfs rw\n"
+                "23 22 0:23 / /home/a rw - tmpfs tmpfs rw\n"
+                "24 22 0:24 / /home/a/b rw - tmpfs tmpfs rw\n"
+                "25 20 0:25 / /home-x rw - tmpfs tmpfs rw\n"
+                "26 20 0:26 / /proc/sys/fs/binfmt_misc rw - autofs systemd-1 rw\n"
+                "27 20 0:27 / /mnt rw - autofs systemd-1 rw\n"
+                "28 27 0:28 / /mnt ro,nodev - ext4 /dev/sdb1 rw\n"
+                "29 22 0:29 / /home/with\\040space rw - tmpfs tmpfs rw\n"
+                "30 21 0:30 / /usr rw - tmpfs tmpfs rw\n";
+
+        _cleanup_(mount_info_freep) MountInfo *mi = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        MountInfoEntry *e;
+        char **blacklist = STRV_MAKE("/home/a", "/usr");
+        size_t i;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(f = fmemopen((void*) mountinfo, strlen(mountinfo), "re"));
+        assert_se(mount_info_parse(f, &mi) >= 0);
+
+        /* Stacked mounts are collapsed, and subtrees are contiguous */
+        assert_se(mi->n_entries == 9);
+        for (i = 1; i < mi->n_entries; i++)
+                assert_se(path_compare(mi->entries[i-1].path, mi->entries[i].path) < 0);
+
+        assert_se(e = mount_info_find(mi, "/usr"));
+        assert_se(e->flags == 0);
+        assert_se(e = mount_info_find(mi, "/home"));
+        assert_se(e->flags == (MS_NOEXEC|MS_NOATIME));
+        assert_se(e = mount_info_find(mi, "/mnt"));
+        assert_se(!e->autofs);
+        assert_se(e->flags == (MS_RDONLY|MS_NODEV));
+        assert_se(e = mount_info_find(mi, "/proc/sys/fs/binfmt_misc"));
+        assert_se(e->autofs);
+        assert_se(mount_info_find(mi, "/home/with space"));
+        assert_se(!mount_info_find(mi, "/home/b"));
+
+        /* The blacklist applies to everything below the prefix, but never to the prefix itself */
+        assert_se(mount_info_mark_remount(mi, "/home", blacklist) > 0);
+        assert_se(mount_info_mark_remount(mi, "/usr", blacklist) > 0);
+        assert_se(mount_info_mark_remount(mi, "/home/b", blacklist) == 0);
+        assert_se(mount_info_mark_remount(mi, "/proc/sys/fs/binfmt_misc", NULL) > 0);
+
+        assert_se(mount_info_find(mi, "/home")->remount);
+        assert_se(mount_info_find(mi, "/home/with space")->remount);
+        assert_se(!mount_info_find(mi, "/home/a")->remount);
+        assert_se(!mount_info_find(mi, "/home/a/b")->remount);
+        assert_se(!mount_info_find(mi, "/home-x")->remount);
+        assert_se(mount_info_find(mi, "/usr")->remount);
+        assert_se(!mount_info_find(mi, "/")->remount);
+        assert_se(!mount_info_find(mi, "/proc/sys/fs/binfmt_misc")->remount);
+
+        /* Everything, except for what's blacklisted or not triggered */
+        assert_se(mount_info_mark_remount(mi, "/", blacklist) > 0);
+        assert_se(!mount_info_find(mi, "/home/a")->remount);
+        assert_se(mount_info_find(mi, "/home-x")->remount);
+        assert_se(mount_info_find(mi, "/mnt")->remount);
+        assert_se(!mount_info_find(mi, "/proc/sys/fs/binfmt_misc")->remount);
+}
+
 int main(int argc, char *argv[]) {
 
         log_set_max_level(LOG_DEBUG);
@@ -275,6 +341,7 @@ int main(int argc, char *argv[]) {
 
         test_mnt_id();
         test_path_is_mount_point();
+        test_mount_info();
 
         return 0;
 }
@@ -18,13 +18,17 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <sched.h>
+#include <sys/mount.h>
 #include <sys/socket.h>
 
 #include "alloc-util.h"
 #include "fd-util.h"
 #include "namespace.h"
 #include "process-util.h"
+#include "stdio-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 
 static void test_tmpdir(const char *id, const char *A, const char *B) {
@@ -122,6 +126,82 @@ static void test_netns(void) {
         assert_se(n == 1);
 }
 
+static void test_setup_namespace_performance(unsigned n) {
+        char root[] = "/tmp/test-namespace-mounts.XXXXXX";
+        char buf[FORMAT_TIMESPAN_MAX];
+        pid_t pid;
+        int r;
+
+        log_info("/* %s(%u) */", __func__, n);
+
+        if (geteuid() > 0) {
+                log_info("Skipping test: not root");
+                return;
+        }
+
+        /* Measures how long it takes to set up the mount namespace of a service with ProtectSystem=strict and a
+         * couple of ReadWritePaths= and ReadOnlyPaths=, when the host has n mounts, i.e. the part of the service start
+         * latency that depends on the number of mounts. */
+
+        assert_se(mkdtemp(root));
+
+        r = safe_fork("(bench)", FORK_DEATHSIG|FORK_LOG|FORK_WAIT, NULL);
+        assert_se(r >= 0);
+        if (r == 0) {
+                _cleanup_strv_free_ char **read_write = NULL, **read_only = NULL;
+                usec_t ts, total = 0;
+                unsigned i;
+
+                assert_se(unshare(CLONE_NEWNS) >= 0);
+                assert_se(mount(NULL, "/", NULL, MS_PRIVATE|MS_REC, NULL) >= 0);
+
+                assert_se(mount("tmpfs", root, "tmpfs", 0, NULL) >= 0);
+
+                for (i = 0; i < n; i++) {
+                        char p[strlen(root) + 1 + DECIMAL_STR_MAX(unsigned)];
+
+                        xsprintf(p, "%s/%u", root, i);
+                        assert_se(mkdir(p, 0755) >= 0);
+                        assert_se(mount("tmpfs", p, "tmpfs", 0, NULL) >= 0);
+                }
+
+                /* A few read-only and writable exceptions, as typical for such services */
+                for (i = 0; i < 20; i++) {
+                        char p[strlen(root) + 1 + DECIMAL_STR_MAX(unsigned)];
+
+                        xsprintf(p, "%s/%u", root, i);
+                        assert_se(strv_extend(i % 2 ? &read_only : &read_write, p) >= 0);
+                }
+
+                for (i = 0; i < 10; i++) {
+                        ts = now(CLOCK_MONOTONIC);
+
+                        r = safe_fork("(ns)", FORK_DEATHSIG|FORK_LOG, &pid);
+                        assert_se(r >= 0);
+                        if (r == 0) {
+                                static const NamespaceInfo ns_info = {};
+
+                                r = setup_namespace(NULL, NULL, &ns_info,
+                                                    read_write, read_only, NULL, NULL,
+                                                    NULL, 0, NULL, NULL,
+                                                    PROTECT_HOME_NO, PROTECT_SYSTEM_STRICT,
+                                                    MS_SHARED, 0);
+                                _exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+                        }
+
+                        assert_se(wait_for_terminate_and_check("(ns)", pid, WAIT_LOG) == EXIT_SUCCESS);
+                        total += now(CLOCK_MONOTONIC) - ts;
+                }
+
+                log_info("Setting up a namespace with %u host mounts took %s",
+                         n, format_timespan(buf, sizeof(buf), total / 10, 1));
+
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(rmdir(root) >= 0);
+}
+
 int main(int argc, char *argv[]) {
         sd_id128_t bid;
         char boot_id[SD_ID128_STRING_MAX];
@@ -146,6 +226,8 @@ int main(int argc, char *argv[]) {
 
         test_tmpdir("sys-devices-pci0000:00-0000:00:1a.0-usb3-3\\x2d1-3\\x2d1:1.0-bluetooth-hci0.device", z, zz);
 
+        test_setup_namespace_performance(1000);
+
         test_netns();
 
         return 0;
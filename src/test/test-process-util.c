@@ -20,6 +20,7 @@
 ***/
 
 #include <sched.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/personality.h>
 #include <sys/prctl.h>
@@ -520,6 +521,102 @@ static void test_safe_fork(void) {
         assert_se(status.si_status == 88);
 }
 
+static int clone_vfork_child(void *userdata) {
+        int *shared = userdata;
+
+        /* Writes to our memory are visible to the parent */
+        *shared = 4711;
+
+        return 77;
+}
+
+static int clone_vfork_exec(void *userdata) {
+        char *const argv[] = { (char*) "true", NULL };
+
+        (void) reset_signal_mask();
+        execv(userdata, argv);
+        _exit(EXIT_FAILURE);
+}
+
+static void test_clone_vfork(void) {
+        siginfo_t status;
+        int shared = 0;
+        pid_t pid;
+
+        if (!CLONE_VFORK_SUPPORTED) {
+                log_info("clone_vfork() is not supported on this architecture, skipping %s", __func__);
+                return;
+        }
+
+        assert_se(clone_vfork(clone_vfork_child, &shared, &pid) >= 0);
+
+        /* The child already ran to completion, as we are suspended until it exits */
+        assert_se(shared == 4711);
+
+        assert_se(wait_for_terminate(pid, &status) >= 0);
+        assert_se(status.si_code == CLD_EXITED);
+        assert_se(status.si_status == 77);
+
+        if (access("/bin/true", X_OK) < 0)
+                return;
+
+        assert_se(clone_vfork(clone_vfork_exec, (char*) "/bin/true", &pid) >= 0);
+        assert_se(wait_for_terminate(pid, &status) >= 0);
+        assert_se(status.si_code == CLD_EXITED);
+        assert_se(status.si_status == EXIT_SUCCESS);
+}
+
+#define SPAWN_ITERATIONS 200U
+#define SPAWN_BALLAST (256U * 1024U * 1024U)
+
+static void test_clone_vfork_measure(void) {
+        siginfo_t status;
+        void *ballast;
+        unsigned i;
+        usec_t t, q;
+        pid_t pid;
+
+        if (!CLONE_VFORK_SUPPORTED) {
+                log_info("clone_vfork() is not supported on this architecture, skipping %s", __func__);
+                return;
+        }
+
+        if (access("/bin/true", X_OK) < 0)
+                return;
+
+        /* A large, fully populated heap made of small pages, similar to PID 1 managing a lot of units, to show what
+         * copying the page tables costs */
+        ballast = mmap(NULL, SPAWN_BALLAST, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (ballast == MAP_FAILED)
+                return;
+        (void) madvise(ballast, SPAWN_BALLAST, MADV_NOHUGEPAGE);
+        memset(ballast, 0x55, SPAWN_BALLAST);
+
+        t = now(CLOCK_MONOTONIC);
+        for (i = 0; i < SPAWN_ITERATIONS; i++) {
+                pid = fork();
+                assert_se(pid >= 0);
+                if (pid == 0)
+                        (void) clone_vfork_exec((char*) "/bin/true");
+
+                assert_se(wait_for_terminate(pid, &status) >= 0);
+        }
+        q = now(CLOCK_MONOTONIC) - t;
+
+        log_info("       fork()+execve(): %llu/s", (unsigned long long) (SPAWN_ITERATIONS*USEC_PER_SEC/q));
+
+        t = now(CLOCK_MONOTONIC);
+        for (i = 0; i < SPAWN_ITERATIONS; i++) {
+                assert_se(clone_vfork(clone_vfork_exec, (char*) "/bin/true", &pid) >= 0);
+                assert_se(wait_for_terminate(pid, &status) >= 0);
+        }
+        q = now(CLOCK_MONOTONIC) - t;
+
+        log_info("clone_vfork()+execve(): %llu/s", (unsigned long long) (SPAWN_ITERATIONS*USEC_PER_SEC/q));
+
+        assert_se(munmap(ballast, SPAWN_BALLAST) >= 0);
+}
+
 static void test_pid_to_ptr(void) {
 
         assert_se(PTR_TO_PID(NULL) == 0);
@@ -566,6 +663,8 @@ int main(int argc, char *argv[]) {
         test_getpid_cached();
         test_getpid_measure();
         test_safe_fork();
+        test_clone_vfork();
+        test_clone_vfork_measure();
         test_pid_to_ptr();
 
         return 0;
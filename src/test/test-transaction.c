@@ -0,0 +1,219 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "bus-util.h"
+#include "log.h"
+#include "manager.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "test-helper.h"
+#include "tests.h"
+
+static Unit *make_unit(Manager *m, UnitType t, const char *format, unsigned i) {
+        char name[UNIT_NAME_MAX + 1];
+        Unit *u;
+
+        assert_se(snprintf(name, sizeof(name), format, i) < (int) sizeof(name));
+
+        assert_se(u = unit_new(m, unit_vtable[t]->object_size));
+        assert_se(unit_add_name(u, name) >= 0);
+
+        /* Pretend the unit was loaded from a unit file */
+        u->load_state = UNIT_LOADED;
+
+        return u;
+}
+
+static void test_fan(Manager *m, unsigned n_units) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        char buf[FORMAT_TIMESPAN_MAX];
+        Unit *target, *u, *prev = NULL;
+        usec_t ts;
+        unsigned i;
+        Job *j;
+
+        log_info("/* %s(%u) */", __func__, n_units);
+
+        /* A target pulling in a lot of units, similar to local-fs.target on systems with a lot of mounts. Each
+         * unit requires and is ordered after the previous one, and every tenth one also conflicts with a unit
+         * that isn't running. */
+
+        target = make_unit(m, UNIT_TARGET, "fan-test-%u.target", n_units);
+
+        for (i = 0; i < n_units; i++) {
+                u = make_unit(m, UNIT_SERVICE, "fan-test-%u.service", i);
+
+                assert_se(unit_add_two_dependencies(target, UNIT_AFTER, UNIT_WANTS, u, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+                if (prev)
+                        assert_se(unit_add_two_dependencies(u, UNIT_AFTER, UNIT_REQUIRES, prev, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+                if (i % 10 == 0) {
+                        Unit *c;
+
+                        c = make_unit(m, UNIT_SERVICE, "fan-test-conflict-%u.service", i);
+                        assert_se(unit_add_dependency(u, UNIT_CONFLICTS, c, true, UNIT_DEPENDENCY_FILE) >= 0);
+                }
+
+                prev = u;
+        }
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(manager_add_job(m, JOB_START, target, JOB_REPLACE, &error, &j) >= 0);
+        log_info("Built and activated transaction for %u units in %s.",
+                 n_units, format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - ts, 0));
+
+        /* The target and all units. The stop jobs for the conflicting units are redundant, as they aren't running. */
+        assert_se(hashmap_size(m->jobs) == 1 + n_units);
+
+        manager_clear_jobs(m);
+}
+
+static void test_cycle(Manager *m, unsigned n_units) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        char buf[FORMAT_TIMESPAN_MAX];
+        Unit *target, *u, *first = NULL, *prev = NULL;
+        usec_t ts;
+        unsigned i;
+        Job *j;
+
+        log_info("/* %s(%u) */", __func__, n_units);
+
+        /* A long ordering chain of units that are merely wanted, which closes into a cycle. Exactly one of the jobs
+         * has to be dropped to break it. */
+
+        target = make_unit(m, UNIT_TARGET, "cycle-test-%u.target", n_units);
+
+        for (i = 0; i < n_units; i++) {
+                u = make_unit(m, UNIT_SERVICE, "cycle-test-%u.service", i);
+
+                assert_se(unit_add_dependency(target, UNIT_WANTS, u, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+                if (prev)
+                        assert_se(unit_add_dependency(u, UNIT_AFTER, prev, true, UNIT_DEPENDENCY_FILE) >= 0);
+                else
+                        first = u;
+
+                prev = u;
+        }
+
+        assert_se(unit_add_dependency(first, UNIT_AFTER, prev, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(manager_add_job(m, JOB_START, target, JOB_REPLACE, &error, &j) >= 0);
+        log_info("Built transaction and broke cycle of %u units in %s.",
+                 n_units, format_timespan(buf, sizeof(buf), now(CLOCK_MONOTONIC) - ts, 0));
+
+        assert_se(hashmap_size(m->jobs) == n_units);
+
+        manager_clear_jobs(m);
+}
+
+static void test_unbreakable_cycle(Manager *m) {
+        Unit *a, *b;
+        Job *j;
+
+        log_info("/* %s */", __func__);
+
+        /* Two units requiring each other, ordered in both directions. Neither of the jobs may be dropped. */
+
+        a = make_unit(m, UNIT_SERVICE, "unbreakable-test-%u.service", 0);
+        b = make_unit(m, UNIT_SERVICE, "unbreakable-test-%u.service", 1);
+
+        assert_se(unit_add_two_dependencies(a, UNIT_AFTER, UNIT_REQUIRES, b, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_two_dependencies(b, UNIT_AFTER, UNIT_REQUIRES, a, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+        assert_se(manager_add_job(m, JOB_START, a, JOB_REPLACE, NULL, &j) == -EDEADLK);
+        assert_se(hashmap_isempty(m->jobs));
+}
+
+static void test_failing_dependencies(Manager *m) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        Unit *target, *ok, *masked, *missing, *a, *b, *c;
+        Job *j;
+
+        log_info("/* %s */", __func__);
+
+        /* Units that are masked or not found are ignored when only wanted, but fail the whole transaction when
+         * required, also when that's a few levels down */
+
+        target = make_unit(m, UNIT_TARGET, "failing-test-%u.target", 0);
+        ok = make_unit(m, UNIT_SERVICE, "failing-test-ok-%u.service", 0);
+        masked = make_unit(m, UNIT_SERVICE, "failing-test-masked-%u.service", 0);
+        masked->load_state = UNIT_MASKED;
+        missing = make_unit(m, UNIT_SERVICE, "failing-test-missing-%u.service", 0);
+        missing->load_state = UNIT_NOT_FOUND;
+
+        assert_se(unit_add_dependency(target, UNIT_WANTS, ok, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_dependency(target, UNIT_WANTS, masked, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_dependency(target, UNIT_WANTS, missing, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+        assert_se(manager_add_job(m, JOB_START, target, JOB_REPLACE, &error, &j) >= 0);
+        assert_se(hashmap_size(m->jobs) == 2);
+        assert_se(ok->job && !masked->job && !missing->job);
+        manager_clear_jobs(m);
+
+        a = make_unit(m, UNIT_SERVICE, "failing-test-a-%u.service", 0);
+        b = make_unit(m, UNIT_SERVICE, "failing-test-b-%u.service", 0);
+        c = make_unit(m, UNIT_SERVICE, "failing-test-c-%u.service", 0);
+        assert_se(unit_add_dependency(a, UNIT_REQUIRES, b, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_dependency(b, UNIT_REQUIRES, c, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_dependency(c, UNIT_REQUIRES, missing, true, UNIT_DEPENDENCY_FILE) >= 0);
+        assert_se(unit_add_dependency(a, UNIT_WANTS, ok, true, UNIT_DEPENDENCY_FILE) >= 0);
+
+        sd_bus_error_free(&error);
+        assert_se(manager_add_job(m, JOB_START, a, JOB_REPLACE, &error, &j) == -ENOENT);
+        assert_se(hashmap_isempty(m->jobs));
+
+        /* Stopping doesn't care about the load state, and propagates to everything that is running and requires
+         * the unit */
+        sd_bus_error_free(&error);
+        SERVICE(a)->state = SERVICE(b)->state = SERVICE(c)->state = SERVICE_RUNNING;
+        assert_se(manager_add_job(m, JOB_STOP, missing, JOB_REPLACE, &error, &j) >= 0);
+        assert_se(hashmap_size(m->jobs) == 4);
+        assert_se(missing->job == j);
+        assert_se(a->job && a->job->type == JOB_STOP);
+        assert_se(b->job && b->job->type == JOB_STOP);
+        assert_se(c->job && c->job->type == JOB_STOP);
+        assert_se(!ok->job);
+        manager_clear_jobs(m);
+        SERVICE(a)->state = SERVICE(b)->state = SERVICE(c)->state = SERVICE_DEAD;
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        unsigned n_units = 2000;
+        Manager *m;
+        int r;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_units) >= 0);
+
+        r = enter_cgroup_subroot();
+        if (r == -ENOMEDIUM) {
+                log_notice_errno(r, "Skipping test: cgroupfs not available");
+                return EXIT_TEST_SKIP;
+        }
+
+        assert_se(set_unit_path(get_testdata_dir("")) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_MINIMAL, &m);
+        if (MANAGER_SKIP_TEST(r)) {
+                log_notice_errno(r, "Skipping test: manager_new: %m");
+                return EXIT_TEST_SKIP;
+        }
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        test_fan(m, n_units);
+        test_cycle(m, n_units);
+        test_unbreakable_cycle(m);
+        test_failing_dependencies(m);
+
+        manager_free(m);
+
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "random-util.h"
+#include "string-util.h"
+#include "time-util.h"
+#include "udev.h"
+
+/* What udevd did before the index existed: compare with every earlier event in the queue */
+static bool is_busy_linear(struct udev_event_index_entry *entries, size_t n, struct udev_event_index_entry *entry) {
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                struct udev_event_index_entry *e = entries + i;
+                size_t common, el, l;
+
+                if (!e->node)
+                        continue;
+                if (e->seqnum >= entry->seqnum)
+                        break;
+
+                if (major(entry->devnum) != 0 && entry->devnum == e->devnum && entry->is_block == e->is_block)
+                        return true;
+                if (entry->ifindex != 0 && entry->ifindex == e->ifindex)
+                        return true;
+                if (entry->devpath_old && streq(e->devpath, entry->devpath_old))
+                        return true;
+
+                el = strlen(e->devpath);
+                l = strlen(entry->devpath);
+                common = MIN(el, l);
+                if (memcmp(e->devpath, entry->devpath, common) != 0)
+                        continue;
+
+                if (el == l) {
+                        if (major(entry->devnum) != 0 && (entry->devnum != e->devnum || entry->is_block != e->is_block))
+                                continue;
+                        if (entry->ifindex != 0 && entry->ifindex != e->ifindex)
+                                continue;
+                        return true;
+                }
+
+                if (entry->devpath[common] == '/' || e->devpath[common] == '/')
+                        return true;
+        }
+
+        return false;
+}
+
+static struct udev_event_index_entry *add(struct udev_event_index *idx, struct udev_event_index_entry *entries, size_t *n,
+                                          const char *devpath, dev_t devnum, bool is_block, int ifindex) {
+        struct udev_event_index_entry *e = entries + *n;
+
+        *e = (struct udev_event_index_entry) {
+                .seqnum = ++*n,
+                .devpath = devpath,
+                .devnum = devnum,
+                .is_block = is_block,
+                .ifindex = ifindex,
+        };
+
+        assert_se(udev_event_index_add(idx, e) >= 0);
+        return e;
+}
+
+static void test_basic(void) {
+        struct udev_event_index_entry entries[16], *disk, *part, *part_again, *other, *net, *net_renamed, *char_dev, *moved;
+        struct udev_event_index *idx;
+        size_t n = 0;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(idx = udev_event_index_new());
+
+        disk = add(idx, entries, &n, "/devices/pci0000:00/host0/block/sda", makedev(8, 0), true, 0);
+        part = add(idx, entries, &n, "/devices/pci0000:00/host0/block/sda/sda1", makedev(8, 1), true, 0);
+        part_again = add(idx, entries, &n, "/devices/pci0000:00/host0/block/sda/sda1", makedev(8, 1), true, 0);
+        other = add(idx, entries, &n, "/devices/pci0000:00/host0/block/sdaa", makedev(65, 160), true, 0);
+        char_dev = add(idx, entries, &n, "/devices/virtual/misc/foo", makedev(8, 1), false, 0);
+        net = add(idx, entries, &n, "/devices/virtual/net/eth0", 0, false, 2);
+        net_renamed = add(idx, entries, &n, "/devices/virtual/net/eth1", 0, false, 2);
+
+        /* The first event for a device and its siblings don't wait, children and later events for the same one do */
+        assert_se(!udev_event_index_is_busy(idx, disk));
+        assert_se(udev_event_index_is_busy(idx, part));
+        assert_se(udev_event_index_is_busy(idx, part_again));
+        assert_se(!udev_event_index_is_busy(idx, other));
+        assert_se(!udev_event_index_is_busy(idx, char_dev));
+        assert_se(!udev_event_index_is_busy(idx, net));
+        assert_se(udev_event_index_is_busy(idx, net_renamed));
+
+        /* A move waits for events on the old name */
+        moved = add(idx, entries, &n, "/devices/virtual/misc/bar", 0, false, 0);
+        moved->devpath_old = "/devices/virtual/misc/foo";
+        assert_se(udev_event_index_is_busy(idx, moved));
+        udev_event_index_remove(idx, char_dev);
+        assert_se(!udev_event_index_is_busy(idx, moved));
+
+        /* Once the parent is done, only the earlier event for the same device is left to wait for */
+        udev_event_index_remove(idx, disk);
+        assert_se(!udev_event_index_is_busy(idx, part));
+        assert_se(udev_event_index_is_busy(idx, part_again));
+        udev_event_index_remove(idx, part);
+        assert_se(!udev_event_index_is_busy(idx, part_again));
+
+        udev_event_index_remove(idx, net);
+        assert_se(!udev_event_index_is_busy(idx, net_renamed));
+
+        /* A later event for a parent waits for earlier ones for its children */
+        disk = add(idx, entries, &n, "/devices/pci0000:00/host0/block/sda", makedev(8, 0), true, 0);
+        assert_se(udev_event_index_is_busy(idx, disk));
+        udev_event_index_remove(idx, part_again);
+        assert_se(!udev_event_index_is_busy(idx, disk));
+
+        udev_event_index_remove(idx, disk);
+        udev_event_index_remove(idx, other);
+        udev_event_index_remove(idx, net_renamed);
+        udev_event_index_remove(idx, moved);
+
+        udev_event_index_free(idx);
+}
+
+static void test_random(void) {
+        static const char *const devpaths[] = {
+                "/devices/a",
+                "/devices/a/b",
+                "/devices/a/b/c",
+                "/devices/a/bb",
+                "/devices/a/b/d",
+                "/devices/ab",
+                "/devices/ab/c",
+                "/devices/x/y/z",
+        };
+        struct udev_event_index_entry entries[2000];
+        struct udev_event_index *idx;
+        size_t n = 0, i, k;
+
+        log_info("/* %s */", __func__);
+
+        /* Compare against the straightforward implementation, with lots of events on a few devices */
+
+        assert_se(idx = udev_event_index_new());
+
+        for (k = 0; k < ELEMENTSOF(entries); k++) {
+                uint64_t r = random_u64();
+                struct udev_event_index_entry *e;
+
+                e = add(idx, entries, &n, devpaths[r % ELEMENTSOF(devpaths)],
+                        (r >> 8) % 4 ? 0 : makedev(8, (r >> 10) % 4), (r >> 12) % 2, (r >> 13) % 4 ? 0 : (r >> 15) % 3 + 1);
+                if ((r >> 17) % 8 == 0)
+                        e->devpath_old = devpaths[(r >> 20) % ELEMENTSOF(devpaths)];
+
+                /* Let some of the events finish */
+                if ((r >> 24) % 2 == 0)
+                        for (i = 0; i < n; i++)
+                                if (entries[i].node && !is_busy_linear(entries, n, entries + i)) {
+                                        udev_event_index_remove(idx, entries + i);
+                                        break;
+                                }
+
+                for (i = 0; i < n; i++)
+                        if (entries[i].node)
+                                assert_se(udev_event_index_is_busy(idx, entries + i) == is_busy_linear(entries, n, entries + i));
+        }
+
+        for (i = 0; i < n; i++)
+                udev_event_index_remove(idx, entries + i);
+
+        udev_event_index_free(idx);
+}
+
+static void test_coldplug(unsigned n_disks) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX], buf3[FORMAT_TIMESPAN_MAX];
+        _cleanup_free_ struct udev_event_index_entry *entries = NULL;
+        _cleanup_free_ char **devpaths = NULL;
+        struct udev_event_index *idx;
+        size_t n = 0, n_events, i, done, ready_linear = 0, ready_index = 0;
+        usec_t ts, linear, indexed, drain;
+        unsigned d, p;
+
+        log_info("/* %s(%u) */", __func__, n_disks);
+
+        /* What "udevadm trigger" causes on a storage server: one event for each disk and four partitions on it, all
+         * queued at once. Measure how long it takes udevd to figure out which of them may be started right away. */
+
+        n_events = n_disks * 5;
+        assert_se(entries = new0(struct udev_event_index_entry, n_events));
+        assert_se(devpaths = new0(char*, n_events));
+        assert_se(idx = udev_event_index_new());
+
+        for (d = 0; d < n_disks; d++)
+                for (p = 0; p < 5; p++) {
+                        if (p == 0)
+                                assert_se(asprintf(devpaths + n, "/devices/pci0000:00/0000:00:%02x.0/host%u/target%u:0:0/%u:0:0:0/block/sd%u",
+                                                   d % 32, d / 64, d, d, d) >= 0);
+                        else
+                                assert_se(asprintf(devpaths + n, "%s/sd%up%u", devpaths[n - p], d, p) >= 0);
+
+                        add(idx, entries, &n, devpaths[n], makedev(8 + d / 16, (d % 16) * 16 + p), true, 0);
+                }
+
+        ts = now(CLOCK_PROCESS_CPUTIME_ID);
+        for (i = 0; i < n; i++)
+                if (!is_busy_linear(entries, n, entries + i))
+                        ready_linear++;
+        linear = now(CLOCK_PROCESS_CPUTIME_ID) - ts;
+
+        ts = now(CLOCK_PROCESS_CPUTIME_ID);
+        for (i = 0; i < n; i++)
+                if (!udev_event_index_is_busy(idx, entries + i))
+                        ready_index++;
+        indexed = now(CLOCK_PROCESS_CPUTIME_ID) - ts;
+
+        /* Only the disks may start, their partitions have to wait */
+        assert_se(ready_linear == n_disks);
+        assert_se(ready_index == n_disks);
+
+        /* And now process the whole queue, like udevd does: look for events that may start, and finish them */
+        ts = now(CLOCK_PROCESS_CPUTIME_ID);
+        for (done = 0; done < n; )
+                for (i = 0; i < n; i++)
+                        if (entries[i].node && !udev_event_index_is_busy(idx, entries + i)) {
+                                udev_event_index_remove(idx, entries + i);
+                                done++;
+                        }
+        drain = now(CLOCK_PROCESS_CPUTIME_ID) - ts;
+
+        log_info("%zu queued events: checking them all took %s with linear scans, %s with the index; processing the queue took %s",
+                 n, format_timespan(buf1, sizeof(buf1), linear, 1),
+                 format_timespan(buf2, sizeof(buf2), indexed, 1),
+                 format_timespan(buf3, sizeof(buf3), drain, 1));
+
+        for (i = 0; i < n; i++)
+                free(devpaths[i]);
+
+        udev_event_index_free(idx);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 1000;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        test_basic();
+        test_random();
+        test_coldplug(n);
+
+        return 0;
+}
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "time-util.h"
+#include "udev.h"
+
+static char *tmp, *stackdir, *slink;
+
+static void add(const char *name, int priority) {
+        char *devnode;
+
+        devnode = strjoina(tmp, "/", name);
+        assert_se(udev_node_link_update(NULL, stackdir, slink, name, devnode, priority, true) >= 0);
+}
+
+static void remove_device(const char *name) {
+        assert_se(udev_node_link_update(NULL, stackdir, slink, name, NULL, 0, false) >= 0);
+}
+
+static bool link_points_to(const char *name) {
+        _cleanup_free_ char *target = NULL;
+
+        if (readlink_malloc(slink, &target) < 0)
+                return false;
+
+        return streq(basename(target), name);
+}
+
+static void test_link_stack(void) {
+        _cleanup_free_ char *owner = NULL;
+        char *p;
+
+        log_info("/* %s */", __func__);
+
+        add("sd0", 0);
+        assert_se(link_points_to("sd0"));
+
+        /* higher priorities win, among the same priority the device added last wins */
+        add("sd1", 10);
+        assert_se(link_points_to("sd1"));
+        add("sd2", 0);
+        assert_se(link_points_to("sd1"));
+        add("sd3", 10);
+        assert_se(link_points_to("sd3"));
+
+        remove_device("sd3");
+        assert_se(link_points_to("sd1"));
+        remove_device("sd1");
+        assert_se(link_points_to("sd0") || link_points_to("sd2"));
+
+        /* a device may change its priority */
+        add("sd0", -5);
+        add("sd0", 20);
+        assert_se(link_points_to("sd0"));
+        p = strjoina(stackdir, "/-5/sd0");
+        assert_se(access(p, F_OK) < 0 && errno == ENOENT);
+        p = strjoina(stackdir, "/-5");
+        assert_se(access(p, F_OK) < 0 && errno == ENOENT);
+
+        /* a device that can't be added to the stack doesn't take the link */
+        p = strjoina(stackdir, "/30");
+        assert_se(touch(p) >= 0);
+        assert_se(udev_node_link_update(NULL, stackdir, slink, "sd4", strjoina(tmp, "/sd4"), 30, true) < 0);
+        assert_se(link_points_to("sd0"));
+        assert_se(readlink_malloc(strjoina(stackdir, "/.owner"), &owner) >= 0);
+        assert_se(streq(owner, "20/sd0"));
+        assert_se(unlink(p) >= 0);
+
+        /* devices that went away without being removed are ignored */
+        p = strjoina(tmp, "/sd0");
+        assert_se(unlink(p) >= 0);
+        remove_device("sd4");
+        assert_se(link_points_to("sd2"));
+        assert_se(touch(p) >= 0);
+
+        /* entries written by older versions are dropped, without udev there's nothing to look them up with */
+        p = strjoina(stackdir, "/.owner");
+        assert_se(unlink(p) >= 0);
+        p = strjoina(stackdir, "/b8:0");
+        assert_se(touch(p) >= 0);
+        remove_device("sd0");
+        assert_se(access(p, F_OK) < 0 && errno == ENOENT);
+        assert_se(link_points_to("sd2"));
+
+        /* the last device takes the link and the stack with it */
+        remove_device("sd2");
+        assert_se(access(slink, F_OK) < 0 && errno == ENOENT);
+        assert_se(access(stackdir, F_OK) < 0 && errno == ENOENT);
+
+        remove_device("sd2");
+}
+
+static void test_performance(unsigned n_devices) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX];
+        usec_t ts, added, removed;
+        unsigned i;
+
+        log_info("/* %s(%u) */", __func__, n_devices);
+
+        /* many paths to the same multipath device, all claiming the same by-id link */
+        for (i = 0; i < n_devices; i++) {
+                _cleanup_free_ char *p = NULL;
+
+                assert_se(asprintf(&p, "%s/path%u", tmp, i) >= 0);
+                assert_se(touch(p) >= 0);
+        }
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_devices; i++) {
+                char name[32];
+
+                xsprintf(name, "path%u", i);
+                add(name, i % 3);
+        }
+        added = now(CLOCK_MONOTONIC) - ts;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_devices; i++) {
+                char name[32];
+
+                xsprintf(name, "path%u", i);
+                remove_device(name);
+        }
+        removed = now(CLOCK_MONOTONIC) - ts;
+
+        assert_se(access(slink, F_OK) < 0 && errno == ENOENT);
+
+        log_info("%u devices claiming the same link: adding them took %s, removing them %s",
+                 n_devices, format_timespan(buf1, sizeof(buf1), added, 1),
+                 format_timespan(buf2, sizeof(buf2), removed, 1));
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 5000, i;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        assert_se(mkdtemp_malloc("/tmp/test-udev-node-XXXXXX", &tmp) >= 0);
+        assert_se(stackdir = path_join(NULL, tmp, "links/\\x2fdisk\\x2fby-id\\x2ffoo"));
+        assert_se(slink = path_join(NULL, tmp, "disk/by-id/foo"));
+
+        for (i = 0; i < 5; i++) {
+                _cleanup_free_ char *p = NULL;
+
+                assert_se(asprintf(&p, "%s/sd%u", tmp, i) >= 0);
+                assert_se(touch(p) >= 0);
+        }
+
+        test_link_stack();
+        test_performance(n);
+
+        free(slink);
+        free(stackdir);
+        (void) rm_rf(tmp, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(tmp);
+
+        return 0;
+}
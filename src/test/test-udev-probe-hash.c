@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fd-util.h"
+#include "fileio.h"
+#include "log.h"
+#include "siphash24.h"
+#include "udev.h"
+#include "unaligned.h"
+
+#define MiB (1024U * 1024U)
+#define IMAGE_SIZE (8U * MiB)
+
+/* where the extended partition starts, in 512 byte sectors, and its second logical partition's table */
+#define EXTENDED_START (3U * MiB / 512U)
+#define EBR2_OFFSET (4U * MiB / 512U)
+
+static const uint8_t key[16] = { 0x1e, 0x4b, 0x0d, 0x6c, 0x37, 0x8a, 0x42, 0x91,
+                                 0x5f, 0x20, 0xe3, 0x7b, 0xc4, 0x09, 0xa6, 0x58 };
+
+static uint64_t hash_fd(int fd) {
+        struct siphash state;
+
+        siphash24_init(&state, key);
+        assert_se(udev_probe_hash_area(fd, &state) >= 0);
+
+        return siphash24_finalize(&state);
+}
+
+static void write_byte(int fd, uint64_t offset, uint8_t b) {
+        assert_se(pwrite(fd, &b, 1, offset) == 1);
+}
+
+static void write_table(int fd, uint64_t sector, uint8_t type, uint32_t link) {
+        uint8_t b[512] = {};
+
+        b[446 + 4] = type;
+        unaligned_write_le32(b + 446 + 8, link);
+        b[510] = 0x55;
+        b[511] = 0xaa;
+
+        assert_se(pwrite(fd, b, sizeof(b), sector * 512) == sizeof(b));
+}
+
+static void test_probe_hash(void) {
+        char t[] = "/tmp/test-udev-probe-hash-XXXXXX";
+        _cleanup_close_ int fd = -1;
+        uint64_t h;
+
+        log_info("/* %s */", __func__);
+
+        fd = mkostemp_safe(t);
+        assert_se(fd >= 0);
+        assert_se(unlink(t) >= 0);
+        assert_se(ftruncate(fd, IMAGE_SIZE) >= 0);
+
+        /* an MBR whose extended partition starts beyond the head, with a second logical partition whose
+         * table lies in the middle of the image, too */
+        write_table(fd, 0, 0x05, EXTENDED_START);
+        write_table(fd, EXTENDED_START, 0x05, EBR2_OFFSET - EXTENDED_START);
+        write_table(fd, EBR2_OFFSET, 0x83, 0);
+
+        h = hash_fd(fd);
+        assert_se(hash_fd(fd) == h);
+
+        /* data which no superblock or partition table lives in: the hash stays, probing is skipped */
+        write_byte(fd, 5 * MiB, 0xff);
+        write_byte(fd, EBR2_OFFSET * 512 + 512, 0xff);
+        assert_se(hash_fd(fd) == h);
+
+        /* the head of the device */
+        write_byte(fd, 64 * 1024, 0xff);
+        assert_se(hash_fd(fd) != h);
+        write_byte(fd, 64 * 1024, 0);
+        assert_se(hash_fd(fd) == h);
+
+        /* the tail of the device */
+        write_byte(fd, IMAGE_SIZE - 4096, 0xff);
+        assert_se(hash_fd(fd) != h);
+        write_byte(fd, IMAGE_SIZE - 4096, 0);
+        assert_se(hash_fd(fd) == h);
+
+        /* the tables of the logical partitions, wherever they are */
+        write_byte(fd, EXTENDED_START * 512 + 446 + 12, 0x01);
+        assert_se(hash_fd(fd) != h);
+        write_byte(fd, EXTENDED_START * 512 + 446 + 12, 0);
+        assert_se(hash_fd(fd) == h);
+
+        write_byte(fd, EBR2_OFFSET * 512 + 446 + 4, 0x82);
+        assert_se(hash_fd(fd) != h);
+        write_byte(fd, EBR2_OFFSET * 512 + 446 + 4, 0x83);
+        assert_se(hash_fd(fd) == h);
+
+        /* the size */
+        assert_se(ftruncate(fd, IMAGE_SIZE + MiB) >= 0);
+        assert_se(hash_fd(fd) != h);
+}
+
+static void test_probe_hash_not_block(void) {
+        _cleanup_close_pair_ int p[2] = { -1, -1 };
+        struct siphash state;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(pipe2(p, O_CLOEXEC) >= 0);
+
+        siphash24_init(&state, key);
+        assert_se(udev_probe_hash_area(p[0], &state) == -ENOTBLK);
+}
+
+int main(int argc, char *argv[]) {
+        log_parse_environment();
+        log_open();
+
+        test_probe_hash();
+        test_probe_hash_not_block();
+
+        return 0;
+}
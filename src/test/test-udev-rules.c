@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "libudev-private.h"
+#include "log.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "strv.h"
+#include "time-util.h"
+#include "udev-util.h"
+#include "udev.h"
+
+static struct udev *udev;
+
+static const char rules_text[] =
+        "ACTION==\"add\", SUBSYSTEM==\"net\", ENV{NET_ADD}=\"1\"\n"
+        "ACTION==\"remove\", ENV{REMOVE}=\"1\"\n"
+        "SUBSYSTEM==\"block|net\", KERNEL==\"lo\", ENV{LO}=\"1\"\n"
+        "KERNEL==\"eth*\", ENV{ETH}=\"1\"\n"
+        "SUBSYSTEM!=\"net\", ENV{NOT_NET}=\"1\"\n"
+        "SUBSYSTEM==\"|net\", ENV{EMPTY_OR_NET}=\"1\"\n"
+        "SUBSYSTEM==\"net\", GOTO=\"net_end\"\n"
+        "ENV{NOT_SKIPPED}=\"1\"\n"
+        "SUBSYSTEM==\"block\", LABEL=\"net_end\"\n"
+        "ACTION==\"add\", ENV{AFTER_LABEL}=\"1\"\n";
+
+static void apply(struct udev_rules *rules, const char *action, const char *devpath, const char *subsystem,
+                  char **expected) {
+        static const char *const properties[] = {
+                "NET_ADD", "REMOVE", "LO", "ETH", "NOT_NET", "EMPTY_OR_NET", "NOT_SKIPPED", "AFTER_LABEL",
+        };
+        _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
+        struct udev_event *event;
+        char buf[1024];
+        size_t i;
+        int n;
+
+        n = snprintf(buf, sizeof(buf), "ACTION=%s%cDEVPATH=%s%cSUBSYSTEM=%s%cSEQNUM=1", action, 0, devpath, 0, subsystem, 0);
+        assert_se(n > 0 && (size_t) n < sizeof(buf));
+        assert_se(dev = udev_device_new_from_nulstr(udev, buf, n + 1));
+        assert_se(event = udev_event_new(dev));
+
+        udev_rules_apply_to_event(rules, event, 10 * USEC_PER_SEC, 5 * USEC_PER_SEC, NULL);
+
+        for (i = 0; i < ELEMENTSOF(properties); i++)
+                assert_se(!!udev_device_get_property_value(dev, properties[i]) == strv_contains(expected, properties[i]));
+
+        udev_event_unref(event);
+}
+
+static void test_rules(struct udev_rules *rules) {
+        apply(rules, "add", "/devices/virtual/net/lo", "net",
+              STRV_MAKE("NET_ADD", "LO", "EMPTY_OR_NET", "AFTER_LABEL"));
+        apply(rules, "remove", "/devices/virtual/net/lo", "net",
+              STRV_MAKE("REMOVE", "LO", "EMPTY_OR_NET"));
+        apply(rules, "change", "/devices/virtual/net/eth0", "net",
+              STRV_MAKE("ETH", "EMPTY_OR_NET"));
+        apply(rules, "add", "/devices/virtual/block/lo", "block",
+              STRV_MAKE("LO", "NOT_NET", "NOT_SKIPPED", "AFTER_LABEL"));
+        apply(rules, "add", "/devices/virtual/misc/lo", "misc",
+              STRV_MAKE("NOT_NET", "NOT_SKIPPED", "AFTER_LABEL"));
+}
+
+static void test_cache(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *tmp = NULL;
+        _cleanup_free_ char *rules_file = NULL, *cache = NULL;
+        struct udev_rules *rules;
+        const char *dirs[2] = {};
+        struct stat st, st2;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(mkdtemp_malloc("/tmp/test-udev-rules-XXXXXX", &tmp) >= 0);
+        assert_se(rules_file = path_join(NULL, tmp, "50-test.rules"));
+        assert_se(cache = path_join(NULL, tmp, "rules.bin"));
+        dirs[0] = tmp;
+
+        assert_se(write_string_file(rules_file, rules_text, WRITE_STRING_FILE_CREATE) >= 0);
+
+        /* The first time around the rules are parsed and the cache is written */
+        assert_se(rules = udev_rules_new_from_dirs(udev, -1, dirs, cache));
+        assert_se(stat(cache, &st) >= 0);
+        test_rules(rules);
+        udev_rules_unref(rules);
+
+        /* Then the rules are loaded from the cache, which stays as it is */
+        assert_se(rules = udev_rules_new_from_dirs(udev, -1, dirs, cache));
+        assert_se(stat(cache, &st2) >= 0);
+        assert_se(st.st_ino == st2.st_ino);
+        test_rules(rules);
+        udev_rules_unref(rules);
+
+        /* A different way to resolve names, or changed rules, invalidate the cache */
+        assert_se(rules = udev_rules_new_from_dirs(udev, 0, dirs, cache));
+        assert_se(stat(cache, &st2) >= 0);
+        assert_se(st.st_ino != st2.st_ino);
+        udev_rules_unref(rules);
+        st = st2;
+
+        assert_se(write_string_file(rules_file, "ACTION==\"add\", ENV{NET_ADD}=\"1\"", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(rules = udev_rules_new_from_dirs(udev, 0, dirs, cache));
+        assert_se(stat(cache, &st2) >= 0);
+        assert_se(st.st_ino != st2.st_ino);
+        apply(rules, "add", "/devices/virtual/block/lo", "block", STRV_MAKE("NET_ADD"));
+        udev_rules_unref(rules);
+
+        /* A broken cache is ignored and replaced */
+        assert_se(truncate(cache, 20) >= 0);
+        assert_se(rules = udev_rules_new_from_dirs(udev, 0, dirs, cache));
+        assert_se(stat(cache, &st2) >= 0);
+        assert_se(st2.st_size > 20);
+        apply(rules, "add", "/devices/virtual/block/lo", "block", STRV_MAKE("NET_ADD"));
+        udev_rules_unref(rules);
+}
+
+static void test_performance(unsigned n_rules) {
+        char buf1[FORMAT_TIMESPAN_MAX], buf2[FORMAT_TIMESPAN_MAX], buf3[FORMAT_TIMESPAN_MAX];
+        static const char *const subsystems[] = { "block", "net", "input", "usb", "tty", "sound", "drm", "scsi" };
+        _cleanup_(rm_rf_physical_and_freep) char *tmp = NULL;
+        _cleanup_free_ char *rules_file = NULL, *cache = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        struct udev_rules *rules;
+        const char *dirs[2] = {};
+        usec_t ts, parse, load, events;
+        unsigned i;
+
+        log_info("/* %s(%u) */", __func__, n_rules);
+
+        /* A rules set that looks like the usual ones: most rules only apply to specific subsystems, actions or
+         * device names, each of them has a couple of matches and assignments */
+
+        assert_se(mkdtemp_malloc("/tmp/test-udev-rules-XXXXXX", &tmp) >= 0);
+        assert_se(rules_file = path_join(NULL, tmp, "50-test.rules"));
+        assert_se(cache = path_join(NULL, tmp, "rules.bin"));
+        dirs[0] = tmp;
+
+        assert_se(f = fopen(rules_file, "we"));
+        for (i = 0; i < n_rules; i++)
+                fprintf(f, "ACTION==\"%s\", SUBSYSTEM==\"%s\", KERNEL==\"dev%u\", ATTR{foo}==\"bar\", ENV{FOO_%u}=\"%u\", SYMLINK+=\"foo%u\"\n",
+                        i % 3 ? "add" : "change", subsystems[i % ELEMENTSOF(subsystems)], i % 100, i, i, i);
+        assert_se(fflush_and_check(f) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(rules = udev_rules_new_from_dirs(udev, 0, dirs, cache));
+        parse = now(CLOCK_MONOTONIC) - ts;
+        udev_rules_unref(rules);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(rules = udev_rules_new_from_dirs(udev, 0, dirs, cache));
+        load = now(CLOCK_MONOTONIC) - ts;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < 1000; i++) {
+                _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
+                struct udev_event *event;
+                char buf[1024];
+                int n;
+
+                n = snprintf(buf, sizeof(buf), "ACTION=add%cDEVPATH=/devices/virtual/%s/dev%u%cSUBSYSTEM=%s%cSEQNUM=1",
+                             0, subsystems[i % ELEMENTSOF(subsystems)], i % 100, 0, subsystems[i % ELEMENTSOF(subsystems)], 0);
+                assert_se(n > 0 && (size_t) n < sizeof(buf));
+                assert_se(dev = udev_device_new_from_nulstr(udev, buf, n + 1));
+                assert_se(event = udev_event_new(dev));
+                udev_rules_apply_to_event(rules, event, 10 * USEC_PER_SEC, 5 * USEC_PER_SEC, NULL);
+                udev_event_unref(event);
+        }
+        events = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("%u rules: parsing took %s, loading them from the cache %s, 1000 events took %s",
+                 n_rules, format_timespan(buf1, sizeof(buf1), parse, 1),
+                 format_timespan(buf2, sizeof(buf2), load, 1),
+                 format_timespan(buf3, sizeof(buf3), events, 1));
+
+        udev_rules_unref(rules);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 2000;
+
+        log_parse_environment();
+        log_open();
+
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+
+        assert_se(udev = udev_new());
+
+        test_cache();
+        test_performance(n);
+
+        udev_unref(udev);
+
+        return 0;
+}
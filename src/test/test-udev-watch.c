@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include "alloc-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "time-util.h"
+#include "udev.h"
+
+static void test_debounce_deadline(void) {
+        const usec_t d = 200 * USEC_PER_MSEC;
+        usec_t first = 10 * USEC_PER_SEC;
+
+        log_info("/* %s */", __func__);
+
+        /* the first close arms the timer */
+        assert_se(udev_watch_debounce_deadline(first, first, d, 5) == first + d);
+
+        /* further ones push it back */
+        assert_se(udev_watch_debounce_deadline(first, first + 50 * USEC_PER_MSEC, d, 5) == first + 250 * USEC_PER_MSEC);
+        assert_se(udev_watch_debounce_deadline(first, first + 3 * d, d, 5) == first + 4 * d);
+        assert_se(udev_watch_debounce_deadline(first, first + 4 * d, d, 5) == first + 5 * d);
+
+        /* but not beyond max times the debounce interval after the first one */
+        assert_se(udev_watch_debounce_deadline(first, first + 4 * d + 1, d, 5) == first + 5 * d);
+        assert_se(udev_watch_debounce_deadline(first, first + 60 * USEC_PER_SEC, d, 5) == first + 5 * d);
+
+        /* without debouncing it is sent right away */
+        assert_se(udev_watch_debounce_deadline(first, first, 0, 5) == first);
+        assert_se(udev_watch_debounce_deadline(first, first + USEC_PER_SEC, d, 1) == first + d);
+}
+
+static void test_synthesize_change(void) {
+        char t[] = "/tmp/test-udev-watch-XXXXXX";
+        _cleanup_free_ char *s = NULL;
+        const char *p;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(mkdtemp(t));
+
+        assert_se(udev_watch_synthesize_change(t) >= 0);
+
+        p = strjoina(t, "/uevent");
+        assert_se(read_one_line_file(p, &s) >= 0);
+        assert_se(streq(s, "change 00000000-0000-0000-0000-000000000000 UDEVWATCH=1"));
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        log_parse_environment();
+        log_open();
+
+        test_debounce_deadline();
+        test_synthesize_change();
+
+        return 0;
+}
@@ -0,0 +1,202 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include "alloc-util.h"
+#include "log.h"
+#include "unit.h"
+
+#define N_UNITS 64
+
+static Unit units[N_UNITS];
+
+static UnitDependencyInfo make_info(UnitDependencyMask origin, UnitDependencyMask destination) {
+        return (UnitDependencyInfo) {
+                .origin_mask = origin,
+                .destination_mask = destination,
+        };
+}
+
+static void check_sorted(UnitDependencyList *l) {
+        UnitDependencyEntry *e;
+        unsigned i;
+
+        e = unit_dependency_list_entries(l);
+        for (i = 1; i < unit_dependency_list_size(l); i++)
+                assert_se(e[i-1].unit < e[i].unit);
+}
+
+static void test_inline(void) {
+        UnitDependencyList l = {};
+        UnitDependencyInfo di;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(unit_dependency_list_isempty(&l));
+        assert_se(!unit_dependency_list_first(&l));
+        assert_se(!unit_dependency_list_contains(&l, &units[0]));
+
+        assert_se(unit_dependency_list_put(&l, &units[3], make_info(UNIT_DEPENDENCY_FILE, 0)) > 0);
+        assert_se(unit_dependency_list_put(&l, &units[3], make_info(UNIT_DEPENDENCY_UDEV, 0)) == -EEXIST);
+        assert_se(unit_dependency_list_size(&l) == 1);
+        assert_se(l.n_allocated == 0);
+        assert_se(unit_dependency_list_first(&l) == &units[3]);
+        assert_se(unit_dependency_list_find(&l, &units[3])->info.origin_mask == UNIT_DEPENDENCY_FILE);
+
+        assert_se(!unit_dependency_list_remove(&l, &units[2], &di));
+        assert_se(unit_dependency_list_remove(&l, &units[3], &di));
+        assert_se(di.origin_mask == UNIT_DEPENDENCY_FILE);
+        assert_se(unit_dependency_list_isempty(&l));
+
+        unit_dependency_list_free(&l);
+}
+
+static void test_grow_shrink(void) {
+        UnitDependencyList l = {};
+        unsigned i, n;
+        Unit *other;
+
+        log_info("/* %s */", __func__);
+
+        /* Insert in an order that is neither ascending nor descending */
+        for (i = 0; i < N_UNITS; i++) {
+                unsigned k = (i * 37) % N_UNITS;
+
+                assert_se(unit_dependency_list_put(&l, &units[k], make_info(0, UNIT_DEPENDENCY_IMPLICIT)) > 0);
+                check_sorted(&l);
+        }
+
+        assert_se(unit_dependency_list_size(&l) == N_UNITS);
+        assert_se(l.n_allocated >= N_UNITS);
+
+        for (i = 0; i < N_UNITS; i++)
+                assert_se(unit_dependency_list_contains(&l, &units[i]));
+
+        for (i = 0; i < N_UNITS; i += 2)
+                assert_se(unit_dependency_list_remove(&l, &units[i], NULL));
+
+        check_sorted(&l);
+        for (i = 0; i < N_UNITS; i++)
+                assert_se(unit_dependency_list_contains(&l, &units[i]) == (i % 2 == 1));
+
+        for (i = 1; i < N_UNITS - 2; i += 2)
+                assert_se(unit_dependency_list_remove(&l, &units[i], NULL));
+
+        /* Back to inline storage */
+        assert_se(unit_dependency_list_size(&l) == 1);
+        assert_se(l.n_allocated == 0);
+        assert_se(unit_dependency_list_first(&l) == &units[N_UNITS - 1]);
+
+        unit_dependency_list_free(&l);
+
+        /* Iterating via the unit */
+        for (i = 0; i < 5; i++)
+                assert_se(unit_dependency_list_put(&units[0].dependencies[UNIT_WANTS], &units[i + 1], make_info(UNIT_DEPENDENCY_FILE, 0)) > 0);
+
+        n = 0;
+        UNIT_FOREACH_DEPENDENCY(other, &units[0], UNIT_WANTS, i) {
+                assert_se(other > &units[0] && other <= &units[5]);
+                n++;
+        }
+        assert_se(n == 5);
+
+        unit_dependency_list_free(&units[0].dependencies[UNIT_WANTS]);
+}
+
+static void test_move(void) {
+        UnitDependencyList a = {}, b = {};
+        UnitDependencyEntry *e;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        /* Moving into an empty list transfers the storage */
+        for (i = 0; i < 10; i++)
+                assert_se(unit_dependency_list_put(&b, &units[i], make_info(UNIT_DEPENDENCY_FILE, 0)) > 0);
+
+        assert_se(unit_dependency_list_move(&a, &b) == 0);
+        assert_se(unit_dependency_list_size(&a) == 10);
+        assert_se(unit_dependency_list_isempty(&b));
+        assert_se(b.n_allocated == 0);
+
+        /* Moving into a populated list merges the masks of duplicates */
+        for (i = 5; i < 15; i++)
+                assert_se(unit_dependency_list_put(&b, &units[i], make_info(UNIT_DEPENDENCY_UDEV, UNIT_DEPENDENCY_PATH)) > 0);
+
+        assert_se(unit_dependency_list_reserve(&a, unit_dependency_list_size(&b)) == 0);
+        assert_se(unit_dependency_list_move(&a, &b) == 0);
+        assert_se(unit_dependency_list_size(&a) == 15);
+        assert_se(unit_dependency_list_isempty(&b));
+        check_sorted(&a);
+
+        assert_se(e = unit_dependency_list_find(&a, &units[2]));
+        assert_se(e->info.origin_mask == UNIT_DEPENDENCY_FILE);
+        assert_se(e->info.destination_mask == 0);
+
+        assert_se(e = unit_dependency_list_find(&a, &units[7]));
+        assert_se(e->info.origin_mask == (UNIT_DEPENDENCY_FILE|UNIT_DEPENDENCY_UDEV));
+        assert_se(e->info.destination_mask == UNIT_DEPENDENCY_PATH);
+
+        assert_se(e = unit_dependency_list_find(&a, &units[12]));
+        assert_se(e->info.origin_mask == UNIT_DEPENDENCY_UDEV);
+
+        unit_dependency_list_free(&a);
+        unit_dependency_list_free(&b);
+}
+
+static void test_replace(void) {
+        UnitDependencyList l = {};
+        UnitDependencyEntry *e;
+        unsigned i, n_allocated;
+
+        log_info("/* %s */", __func__);
+
+        /* Inline storage, the replacement takes the place of the old entry */
+        assert_se(unit_dependency_list_put(&l, &units[3], make_info(UNIT_DEPENDENCY_FILE, 0)) > 0);
+        assert_se(!unit_dependency_list_replace(&l, &units[4], &units[5]));
+        assert_se(unit_dependency_list_replace(&l, &units[3], &units[5]));
+        assert_se(l.n_allocated == 0);
+        assert_se(unit_dependency_list_first(&l) == &units[5]);
+        assert_se(unit_dependency_list_find(&l, &units[5])->info.origin_mask == UNIT_DEPENDENCY_FILE);
+        unit_dependency_list_free(&l);
+
+        /* Two entries, merged into one. This must not shrink the allocation to the inline storage and grow it again
+         * afterwards, as that might fail. */
+        assert_se(unit_dependency_list_put(&l, &units[1], make_info(UNIT_DEPENDENCY_FILE, 0)) > 0);
+        assert_se(unit_dependency_list_put(&l, &units[2], make_info(UNIT_DEPENDENCY_UDEV, UNIT_DEPENDENCY_PATH)) > 0);
+        assert_se(unit_dependency_list_replace(&l, &units[2], &units[1]));
+        assert_se(unit_dependency_list_size(&l) == 1);
+        assert_se(e = unit_dependency_list_find(&l, &units[1]));
+        assert_se(e->info.origin_mask == (UNIT_DEPENDENCY_FILE|UNIT_DEPENDENCY_UDEV));
+        assert_se(e->info.destination_mask == UNIT_DEPENDENCY_PATH);
+        unit_dependency_list_free(&l);
+
+        /* Moving entries around in a full array keeps it sorted, and doesn't reallocate */
+        for (i = 0; i < N_UNITS; i += 2)
+                assert_se(unit_dependency_list_put(&l, &units[i], make_info(0, UNIT_DEPENDENCY_IMPLICIT)) > 0);
+        n_allocated = l.n_allocated;
+
+        assert_se(unit_dependency_list_replace(&l, &units[0], &units[N_UNITS - 1]));
+        assert_se(unit_dependency_list_replace(&l, &units[N_UNITS - 2], &units[1]));
+        assert_se(unit_dependency_list_replace(&l, &units[20], &units[31]));
+        check_sorted(&l);
+        assert_se(l.n_allocated == n_allocated);
+        assert_se(unit_dependency_list_size(&l) == N_UNITS / 2);
+        assert_se(unit_dependency_list_first(&l) == &units[1]);
+        assert_se(!unit_dependency_list_contains(&l, &units[0]));
+        assert_se(!unit_dependency_list_contains(&l, &units[20]));
+        assert_se(unit_dependency_list_contains(&l, &units[31]));
+        assert_se(unit_dependency_list_contains(&l, &units[N_UNITS - 1]));
+
+        unit_dependency_list_free(&l);
+}
+
+int main(int argc, char *argv[]) {
+        log_parse_environment();
+        log_open();
+
+        test_inline();
+        test_grow_shrink();
+        test_move();
+        test_replace();
+
+        return 0;
+}
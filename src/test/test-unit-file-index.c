@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fileio.h"
+#include "fs-util.h"
+#include "log.h"
+#include "mkdir.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "strv.h"
+#include "unit-file-index.h"
+
+static void set_old_mtime(const char *path) {
+        struct timespec ts[2] = {
+                { .tv_sec = 1000000000 },
+                { .tv_sec = 1000000000 },
+        };
+
+        /* Pretend the directory was last changed long ago, so that the index trusts its mtime */
+        assert_se(utimensat(AT_FDCWD, path, ts, 0) >= 0);
+}
+
+static void test_basic(const char *root) {
+        _cleanup_(unit_file_index_freep) UnitFileIndex *idx = NULL;
+        _cleanup_strv_free_ char **search_path = NULL;
+        UnitFileIndexEntry *e;
+        UnitFileIndexDir *d;
+        const char *p, *q, *wants, *target;
+
+        log_info("/* %s */", __func__);
+
+        p = strjoina(root, "/etc");
+        q = strjoina(root, "/usr");
+        wants = strjoina(root, "/etc/multi-user.target.wants");
+        assert_se(search_path = strv_new(p, q, strjoina(root, "/missing"), NULL));
+
+        assert_se(mkdir_p(wants, 0755) >= 0);
+        assert_se(mkdir_p(q, 0755) >= 0);
+        assert_se(write_string_file(strjoina(q, "/a.service"), "[Unit]\n", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(symlink("/usr/a.service", strjoina(wants, "/a.service")) >= 0);
+        assert_se(symlink("a.service", strjoina(q, "/b.service")) >= 0);
+        set_old_mtime(p);
+        set_old_mtime(q);
+        set_old_mtime(wants);
+
+        assert_se(unit_file_index_new(&idx) >= 0);
+
+        /* Without UNIT_FILE_INDEX_RECURSIVE only the search path itself is read */
+        assert_se(unit_file_index_update(idx, search_path, 0) >= 0);
+        assert_se(idx->n_read == 2);
+        assert_se(unit_file_index_get_dir(idx, p));
+        assert_se(!unit_file_index_get_dir(idx, wants));
+
+        /* And the subdirectories are read when asked for */
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(idx->n_read == 1);
+
+        assert_se(d = unit_file_index_get_dir(idx, q));
+        assert_se(d->error == 0);
+        assert_se(d->n_entries == 2);
+        assert_se(streq(d->entries[0].name, "a.service"));
+        assert_se(d->entries[0].type == DT_REG);
+        assert_se(streq(d->entries[1].name, "b.service"));
+        assert_se(d->entries[1].type == DT_LNK);
+
+        /* Symlinks are read on first use */
+        assert_se(!d->entries[1].symlink_read);
+        assert_se(unit_file_index_entry_readlink(d, d->entries + 1, &target) >= 0);
+        assert_se(streq(target, "a.service"));
+        assert_se(d->entries[1].symlink_read);
+
+        assert_se(e = unit_file_index_find(idx, strjoina(wants, "/a.service")));
+        assert_se(unit_file_index_entry_readlink(unit_file_index_get_dir(idx, wants), e, &target) >= 0);
+        assert_se(streq(target, "/usr/a.service"));
+
+        assert_se(d = unit_file_index_get_dir(idx, strjoina(root, "/missing")));
+        assert_se(d->error == -ENOENT);
+
+        assert_se(unit_file_index_exists(idx, strjoina(q, "/a.service")) > 0);
+        assert_se(unit_file_index_exists(idx, strjoina(q, "/c.service")) == 0);
+        assert_se(unit_file_index_exists(idx, strjoina(root, "/missing/a.service")) == 0);
+        assert_se(unit_file_index_exists(idx, strjoina(root, "/elsewhere/a.service")) == -ENODATA);
+
+        /* Nothing changed, nothing is read again */
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(idx->n_read == 0);
+
+        /* A change in a subdirectory only causes that one to be read again */
+        assert_se(unlink(strjoina(wants, "/a.service")) >= 0);
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(idx->n_read == 1);
+        assert_se(!unit_file_index_find(idx, strjoina(wants, "/a.service")));
+
+        /* Changes within the timestamp granularity are picked up after unit_file_index_forget() */
+        set_old_mtime(wants);
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(symlink("/usr/a.service", strjoina(wants, "/a.service")) >= 0);
+        set_old_mtime(wants);
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(!unit_file_index_find(idx, strjoina(wants, "/a.service")));
+        unit_file_index_forget(idx, strjoina(wants, "/a.service"));
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(unit_file_index_find(idx, strjoina(wants, "/a.service")));
+
+        /* Removed directories disappear from the index */
+        assert_se(rm_rf(wants, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+        assert_se(unit_file_index_update(idx, search_path, UNIT_FILE_INDEX_RECURSIVE) >= 0);
+        assert_se(!unit_file_index_get_dir(idx, wants));
+}
+
+static void test_shared(void) {
+        UnitFileIndex *idx;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(idx = unit_file_index_shared());
+        assert_se(unit_file_index_shared() == idx);
+        assert_se(unit_file_index_update(idx, STRV_MAKE("/nonexistent"), 0) >= 0);
+        assert_se(idx->generation == 1);
+
+        /* Freeing it starts over with an empty index on the next use */
+        unit_file_index_shared_free();
+        assert_se(idx = unit_file_index_shared());
+        assert_se(idx->generation == 0);
+        assert_se(hashmap_isempty(idx->dirs));
+        unit_file_index_shared_free();
+}
+
+int main(int argc, char *argv[]) {
+        char root[] = "/tmp/test-unit-file-index.XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+        log_parse_environment();
+        log_open();
+
+        assert_se(mkdtemp(root));
+
+        test_basic(root);
+        test_shared();
+
+        assert_se(rm_rf(root, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
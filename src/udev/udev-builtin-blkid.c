@@ -35,9 +35,13 @@
 #include "efivars.h"
 #include "fd-util.h"
 #include "gpt.h"
+#include "siphash24.h"
 #include "string-util.h"
+#include "udev-util.h"
 #include "udev.h"
 
+#define PROBE_HASH_KEY SD_ID128_MAKE(8d,5c,3e,0a,b1,4f,47,62,9e,27,d3,c8,55,1b,a0,f4)
+
 static void print_property(struct udev_device *dev, bool test, const char *name, const char *value) {
         char s[256];
 
@@ -222,7 +226,65 @@ static int probe_superblocks(blkid_probe pr) {
         return blkid_do_safeprobe(pr);
 }
 
+/* Hash everything the probe looks at: its options, the areas of the device where superblocks and partition
+ * tables are kept, and for a partition, the ones of the disk with the partition table it is listed in. */
+static int probe_hash(struct udev_device *dev, int fd, int argc, char *argv[], char **ret) {
+        struct udev_device *parent;
+        struct siphash state;
+        int i, r;
+
+        siphash24_init(&state, PROBE_HASH_KEY.bytes);
+
+        for (i = 0; i < argc; i++)
+                siphash24_compress(argv[i], strlen(argv[i]) + 1, &state);
+
+        r = udev_probe_hash_area(fd, &state);
+        if (r < 0)
+                return r;
+
+        parent = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+        if (parent) {
+                _cleanup_close_ int parent_fd = -1;
+
+                parent_fd = open(udev_device_get_devnode(parent), O_RDONLY|O_CLOEXEC);
+                if (parent_fd < 0)
+                        return -errno;
+
+                r = udev_probe_hash_area(parent_fd, &state);
+                if (r < 0)
+                        return r;
+        }
+
+        if (asprintf(ret, "%016" PRIx64, siphash24_finalize(&state)) < 0)
+                return -ENOMEM;
+
+        return 0;
+}
+
+/* Copy over what the probe found the last time, if the device was probed with the same hash */
+static bool probe_reuse(struct udev_device *dev, const char *hash, bool test) {
+        _cleanup_udev_device_unref_ struct udev_device *dev_db = NULL;
+        struct udev_list_entry *entry;
+
+        dev_db = udev_device_new_from_syspath(udev_device_get_udev(dev), udev_device_get_syspath(dev));
+        if (!dev_db)
+                return false;
+
+        if (!streq_ptr(udev_device_get_property_value(dev_db, "ID_BLKID_HASH"), hash))
+                return false;
+
+        udev_list_entry_foreach(entry, udev_device_get_properties_list_entry(dev_db)) {
+                const char *key = udev_list_entry_get_name(entry);
+
+                if (startswith(key, "ID_FS_") || startswith(key, "ID_PART_"))
+                        udev_builtin_add_property(dev, test, key, udev_list_entry_get_value(entry));
+        }
+
+        return true;
+}
+
 static int builtin_blkid(struct udev_device *dev, int argc, char *argv[], bool test) {
+        _cleanup_free_ char *hash = NULL;
         const char *root_partition;
         int64_t offset = 0;
         bool noraid = false;
@@ -276,6 +338,22 @@ static int builtin_blkid(struct udev_device *dev, int argc, char *argv[], bool t
                 goto out;
         }
 
+        /* A "change" event is synthesized whenever a device with the "watch" option was written to, see
+         * udev_watch_synthesize_change(). Most writes don't touch anything the probe looks at, the result of the
+         * last probe is reused for them. Other "change" events, e.g. for new media, are always probed, without
+         * reading the device twice. */
+        if (streq_ptr(udev_device_get_action(dev), "change") &&
+            streq_ptr(udev_device_get_property_value(dev, "SYNTH_ARG_UDEVWATCH"), "1")) {
+                err = probe_hash(dev, fd, argc, argv, &hash);
+                if (err < 0)
+                        log_debug_errno(err, "Failed to hash probed areas of %s, ignoring: %m", udev_device_get_devnode(dev));
+                else if (probe_reuse(dev, hash, test)) {
+                        log_debug("probed areas of %s unchanged, not probing again", udev_device_get_devnode(dev));
+                        udev_builtin_add_property(dev, test, "ID_BLKID_HASH", hash);
+                        return EXIT_SUCCESS;
+                }
+        }
+
         err = blkid_probe_set_device(pr, fd, offset, 0);
         if (err < 0)
                 goto out;
@@ -312,6 +390,9 @@ static int builtin_blkid(struct udev_device *dev, int argc, char *argv[], bool t
         if (is_gpt)
                 find_gpt_root(dev, pr, test);
 
+        if (hash)
+                udev_builtin_add_property(dev, test, "ID_BLKID_HASH", hash);
+
 out:
         if (err < 0)
                 return EXIT_FAILURE;
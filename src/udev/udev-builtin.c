@@ -28,6 +28,7 @@
 static bool initialized;
 
 static const struct udev_builtin *builtins[] = {
+        [UDEV_BUILTIN_ATA_ID] = &udev_builtin_ata_id,
 #if HAVE_BLKID
         [UDEV_BUILTIN_BLKID] = &udev_builtin_blkid,
 #endif
@@ -0,0 +1,410 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "alloc-util.h"
+#include "hashmap.h"
+#include "prioq.h"
+#include "string-util.h"
+#include "udev.h"
+
+/*
+ * Tracks the events in udevd's queue, so that we can quickly tell whether an event has to wait for an earlier one:
+ * an event for the same device (by device node or network interface index), or for a parent or child device.
+ *
+ * Events are hooked into a tree of devpath components, with one node per component. Each node knows the smallest
+ * sequence number of all events in its subtree, and keeps its children in a priority queue ordered by that, so
+ * that finding out whether there's an earlier event for a child device is a single lookup. Parent devices are found
+ * by walking up the tree. Events with a device node or network interface are additionally kept in a hashmap of
+ * events sharing that device node or interface. Hence, whether an event is busy can be determined in O(depth) instead
+ * of looking at each queued event.
+ */
+
+struct udev_event_index_node {
+        char *name;
+        struct udev_event_index_node *parent;
+        Hashmap *children;                              /* name → struct udev_event_index_node */
+        Prioq *children_by_seqnum;                      /* ordered by min_seqnum */
+        unsigned prioq_idx;                             /* in the parent's children_by_seqnum */
+        unsigned long long int min_seqnum;              /* of all events in this subtree, ULLONG_MAX if there are none */
+        LIST_HEAD(struct udev_event_index_entry, entries);
+};
+
+struct udev_event_index_bucket {
+        uint64_t key;
+        LIST_HEAD(struct udev_event_index_entry, entries);
+};
+
+struct udev_event_index {
+        struct udev_event_index_node root;
+        Hashmap *by_devnum;                             /* dev_t → struct udev_event_index_bucket */
+        Hashmap *by_ifindex;                            /* ifindex → struct udev_event_index_bucket */
+};
+
+static int node_compare(const void *a, const void *b) {
+        const struct udev_event_index_node *x = a, *y = b;
+
+        if (x->min_seqnum < y->min_seqnum)
+                return -1;
+        if (x->min_seqnum > y->min_seqnum)
+                return 1;
+
+        return 0;
+}
+
+static void node_free(struct udev_event_index_node *node) {
+        struct udev_event_index_node *child;
+
+        if (!node)
+                return;
+
+        while ((child = hashmap_steal_first(node->children)))
+                node_free(child);
+
+        hashmap_free(node->children);
+        prioq_free(node->children_by_seqnum);
+        free(node->name);
+        free(node);
+}
+
+struct udev_event_index *udev_event_index_new(void) {
+        struct udev_event_index *idx;
+
+        idx = new0(struct udev_event_index, 1);
+        if (!idx)
+                return NULL;
+
+        idx->root.min_seqnum = ULLONG_MAX;
+        idx->root.prioq_idx = PRIOQ_IDX_NULL;
+
+        return idx;
+}
+
+static void bucket_free_all(Hashmap *h) {
+        struct udev_event_index_bucket *b;
+
+        while ((b = hashmap_steal_first(h)))
+                free(b);
+
+        hashmap_free(h);
+}
+
+struct udev_event_index *udev_event_index_free(struct udev_event_index *idx) {
+        struct udev_event_index_node *child;
+
+        if (!idx)
+                return NULL;
+
+        while ((child = hashmap_steal_first(idx->root.children)))
+                node_free(child);
+
+        hashmap_free(idx->root.children);
+        prioq_free(idx->root.children_by_seqnum);
+
+        bucket_free_all(idx->by_devnum);
+        bucket_free_all(idx->by_ifindex);
+
+        return mfree(idx);
+}
+
+static struct udev_event_index_node *node_get_child(struct udev_event_index_node *node, const char *name, size_t n) {
+        char buf[n + 1];
+
+        memcpy(buf, name, n);
+        buf[n] = 0;
+
+        return hashmap_get(node->children, buf);
+}
+
+static int node_add_child(struct udev_event_index_node *node, const char *name, size_t n, struct udev_event_index_node **ret) {
+        struct udev_event_index_node *child;
+        int r;
+
+        r = hashmap_ensure_allocated(&node->children, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        r = prioq_ensure_allocated(&node->children_by_seqnum, node_compare);
+        if (r < 0)
+                return r;
+
+        child = new0(struct udev_event_index_node, 1);
+        if (!child)
+                return -ENOMEM;
+
+        child->parent = node;
+        child->min_seqnum = ULLONG_MAX;
+        child->prioq_idx = PRIOQ_IDX_NULL;
+
+        child->name = strndup(name, n);
+        if (!child->name) {
+                free(child);
+                return -ENOMEM;
+        }
+
+        /* The child is added to the priority queue right away, at the very end, so that updating its position later
+         * on can't fail */
+        r = prioq_put(node->children_by_seqnum, child, &child->prioq_idx);
+        if (r < 0) {
+                node_free(child);
+                return r;
+        }
+
+        r = hashmap_put(node->children, child->name, child);
+        if (r < 0) {
+                prioq_remove(node->children_by_seqnum, child, &child->prioq_idx);
+                node_free(child);
+                return r;
+        }
+
+        *ret = child;
+        return 0;
+}
+
+static void node_prune(struct udev_event_index *idx, struct udev_event_index_node *node) {
+
+        /* Drops nodes that have neither events nor children anymore */
+
+        while (node != &idx->root && LIST_IS_EMPTY(node->entries) && hashmap_isempty(node->children)) {
+                struct udev_event_index_node *parent = node->parent;
+
+                hashmap_remove(parent->children, node->name);
+                prioq_remove(parent->children_by_seqnum, node, &node->prioq_idx);
+                node_free(node);
+
+                node = parent;
+        }
+}
+
+static void node_update(struct udev_event_index_node *node) {
+
+        /* Recalculates the smallest sequence number of the subtree of node and all its parents, after an event was
+         * added to or removed from node */
+
+        for (; node; node = node->parent) {
+                struct udev_event_index_entry *e;
+                struct udev_event_index_node *first;
+                unsigned long long int m = ULLONG_MAX;
+
+                LIST_FOREACH(same_devpath, e, node->entries)
+                        m = MIN(m, e->seqnum);
+
+                first = prioq_peek(node->children_by_seqnum);
+                if (first)
+                        m = MIN(m, first->min_seqnum);
+
+                if (m == node->min_seqnum)
+                        break;
+
+                node->min_seqnum = m;
+
+                if (node->parent)
+                        prioq_reshuffle(node->parent->children_by_seqnum, node, &node->prioq_idx);
+        }
+}
+
+static struct udev_event_index_node *node_find(struct udev_event_index *idx, const char *devpath) {
+        struct udev_event_index_node *node = &idx->root;
+        const char *p = devpath;
+
+        for (;;) {
+                size_t n;
+
+                p += strspn(p, "/");
+                if (*p == 0)
+                        return node;
+
+                n = strcspn(p, "/");
+                node = node_get_child(node, p, n);
+                if (!node)
+                        return NULL;
+
+                p += n;
+        }
+}
+
+static int bucket_add(Hashmap **h, uint64_t key, struct udev_event_index_bucket **ret) {
+        struct udev_event_index_bucket *b;
+        int r;
+
+        b = hashmap_get(*h, &key);
+        if (b) {
+                *ret = b;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(h, &uint64_hash_ops);
+        if (r < 0)
+                return r;
+
+        b = new0(struct udev_event_index_bucket, 1);
+        if (!b)
+                return -ENOMEM;
+
+        b->key = key;
+
+        r = hashmap_put(*h, &b->key, b);
+        if (r < 0) {
+                free(b);
+                return r;
+        }
+
+        *ret = b;
+        return 0;
+}
+
+static void bucket_prune(Hashmap *h, struct udev_event_index_bucket *b) {
+        if (!b || !LIST_IS_EMPTY(b->entries))
+                return;
+
+        hashmap_remove(h, &b->key);
+        free(b);
+}
+
+int udev_event_index_add(struct udev_event_index *idx, struct udev_event_index_entry *entry) {
+        struct udev_event_index_node *node = &idx->root;
+        const char *p;
+        int r;
+
+        assert(idx);
+        assert(entry);
+        assert(entry->devpath);
+        assert(!entry->node);
+
+        if (major(entry->devnum) != 0) {
+                r = bucket_add(&idx->by_devnum, entry->devnum, &entry->devnum_bucket);
+                if (r < 0)
+                        goto fail;
+
+                LIST_PREPEND(same_devnum, entry->devnum_bucket->entries, entry);
+        }
+
+        if (entry->ifindex != 0) {
+                r = bucket_add(&idx->by_ifindex, entry->ifindex, &entry->ifindex_bucket);
+                if (r < 0)
+                        goto fail;
+
+                LIST_PREPEND(same_ifindex, entry->ifindex_bucket->entries, entry);
+        }
+
+        for (p = entry->devpath;;) {
+                struct udev_event_index_node *child;
+                size_t n;
+
+                p += strspn(p, "/");
+                if (*p == 0)
+                        break;
+
+                n = strcspn(p, "/");
+
+                child = node_get_child(node, p, n);
+                if (!child) {
+                        r = node_add_child(node, p, n, &child);
+                        if (r < 0) {
+                                node_prune(idx, node);
+                                goto fail;
+                        }
+                }
+
+                node = child;
+                p += n;
+        }
+
+        entry->node = node;
+        LIST_PREPEND(same_devpath, node->entries, entry);
+        node_update(node);
+
+        return 0;
+
+fail:
+        udev_event_index_remove(idx, entry);
+        return r;
+}
+
+void udev_event_index_remove(struct udev_event_index *idx, struct udev_event_index_entry *entry) {
+        assert(idx);
+        assert(entry);
+
+        if (entry->devnum_bucket) {
+                LIST_REMOVE(same_devnum, entry->devnum_bucket->entries, entry);
+                bucket_prune(idx->by_devnum, entry->devnum_bucket);
+                entry->devnum_bucket = NULL;
+        }
+
+        if (entry->ifindex_bucket) {
+                LIST_REMOVE(same_ifindex, entry->ifindex_bucket->entries, entry);
+                bucket_prune(idx->by_ifindex, entry->ifindex_bucket);
+                entry->ifindex_bucket = NULL;
+        }
+
+        if (entry->node) {
+                struct udev_event_index_node *node = entry->node;
+
+                LIST_REMOVE(same_devpath, node->entries, entry);
+                entry->node = NULL;
+
+                node_update(node);
+                node_prune(idx, node);
+        }
+}
+
+bool udev_event_index_is_busy(struct udev_event_index *idx, struct udev_event_index_entry *entry) {
+        struct udev_event_index_entry *e;
+        struct udev_event_index_node *node, *first;
+
+        assert(idx);
+        assert(entry);
+        assert(entry->node);
+
+        /* Checks whether there's an earlier event in the index that this one has to wait for */
+
+        /* check major/minor */
+        if (entry->devnum_bucket)
+                LIST_FOREACH(same_devnum, e, entry->devnum_bucket->entries)
+                        if (e->seqnum < entry->seqnum && e->is_block == entry->is_block)
+                                return true;
+
+        /* check network device ifindex */
+        if (entry->ifindex_bucket)
+                LIST_FOREACH(same_ifindex, e, entry->ifindex_bucket->entries)
+                        if (e->seqnum < entry->seqnum)
+                                return true;
+
+        /* check our old name */
+        if (entry->devpath_old) {
+                node = node_find(idx, entry->devpath_old);
+                if (node)
+                        LIST_FOREACH(same_devpath, e, node->entries)
+                                if (e->seqnum < entry->seqnum)
+                                        return true;
+        }
+
+        /* identical device event found */
+        LIST_FOREACH(same_devpath, e, entry->node->entries) {
+                if (e->seqnum >= entry->seqnum)
+                        continue;
+
+                /* devices names might have changed/swapped in the meantime */
+                if (major(entry->devnum) != 0 && (entry->devnum != e->devnum || entry->is_block != e->is_block))
+                        continue;
+                if (entry->ifindex != 0 && entry->ifindex != e->ifindex)
+                        continue;
+
+                return true;
+        }
+
+        /* parent device event found */
+        for (node = entry->node->parent; node; node = node->parent)
+                LIST_FOREACH(same_devpath, e, node->entries)
+                        if (e->seqnum < entry->seqnum)
+                                return true;
+
+        /* child device event found */
+        first = prioq_peek(entry->node->children_by_seqnum);
+        if (first && first->min_seqnum < entry->seqnum)
+                return true;
+
+        return false;
+}
@@ -22,20 +22,27 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "alloc-util.h"
 #include "device-nodes.h"
 #include "dirent-util.h"
+#include "fd-util.h"
+#include "fileio.h"
 #include "format-util.h"
 #include "fs-util.h"
+#include "mkdir.h"
+#include "parse-util.h"
 #include "selinux-util.h"
 #include "smack-util.h"
 #include "stdio-util.h"
 #include "string-util.h"
+#include "udev-util.h"
 #include "udev.h"
 
-static int node_symlink(struct udev_device *dev, const char *node, const char *slink) {
+static int node_symlink(const char *id, const char *node, const char *slink) {
         struct stat stats;
         char target[UTIL_PATH_SIZE];
         char *s;
@@ -102,7 +109,7 @@ static int node_symlink(struct udev_device *dev, const char *node, const char *s
         }
 
         log_debug("atomically replace '%s'", slink);
-        strscpyl(slink_tmp, sizeof(slink_tmp), slink, ".tmp-", udev_device_get_id_filename(dev), NULL);
+        strscpyl(slink_tmp, sizeof(slink_tmp), slink, ".tmp-", id, NULL);
         unlink(slink_tmp);
         do {
                 err = mkdir_parents_label(slink_tmp, 0755);
@@ -127,99 +134,333 @@ exit:
         return err;
 }
 
+/*
+ * Every device claiming a symlink is recorded in /run/udev/links/<escaped link>/<priority>/<device id>, a
+ * symlink to the device node. The device currently owning the link is recorded in .owner, a symlink to its
+ * entry. Adding a device only needs to compare its priority with the owner's, and only when the owner goes
+ * away the directory of the highest priority is looked at, never any of the other devices. The stack is
+ * locked while it and the link are updated, so that workers handling devices which claim the same link
+ * don't step on each other.
+ */
+static int link_stack_open(const char *stackdir, bool create) {
+        for (;;) {
+                _cleanup_close_ int fd = -1;
+                struct stat st;
+                int r;
+
+                if (create) {
+                        r = mkdir_p(stackdir, 0755);
+                        if (r < 0)
+                                return r;
+                }
+
+                fd = open(stackdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC|O_NOFOLLOW);
+                if (fd < 0) {
+                        if (errno == ENOENT && create)
+                                continue;
+                        return -errno;
+                }
+
+                if (flock(fd, LOCK_EX) < 0)
+                        return -errno;
+
+                if (fstat(fd, &st) < 0)
+                        return -errno;
+
+                if (st.st_nlink > 0) {
+                        r = fd;
+                        fd = -1;
+                        return r;
+                }
+
+                /* the last device left the stack while we were waiting for the lock, look again */
+        }
+}
+
+static int link_stack_remove(int stackfd, const char *id) {
+        _cleanup_closedir_ DIR *dir = NULL;
+        struct dirent *dent;
+
+        dir = xopendirat(stackfd, ".", O_NOFOLLOW);
+        if (!dir)
+                return -errno;
+
+        /* the priority of the device might have changed since it was added */
+        FOREACH_DIRENT(dent, dir, return -errno) {
+                int priority;
+
+                if (safe_atoi(dent->d_name, &priority) < 0) {
+                        /* an entry from before the stack knew about priorities */
+                        if (streq(dent->d_name, id))
+                                (void) unlinkat(stackfd, id, 0);
+                        continue;
+                }
+
+                if (unlinkat(stackfd, strjoina(dent->d_name, "/", id), 0) >= 0)
+                        (void) unlinkat(stackfd, dent->d_name, AT_REMOVEDIR);
+        }
+
+        return 0;
+}
+
+static int link_stack_add(int stackfd, const char *id, const char *devnode, int priority) {
+        char bucket[DECIMAL_STR_MAX(int)];
+        int r;
+
+        r = link_stack_remove(stackfd, id);
+        if (r < 0)
+                return r;
+
+        xsprintf(bucket, "%i", priority);
+        if (mkdirat(stackfd, bucket, 0755) < 0 && errno != EEXIST)
+                return -errno;
+
+        if (symlinkat(devnode, stackfd, strjoina(bucket, "/", id)) < 0)
+                return -errno;
+
+        return 0;
+}
+
+static int link_stack_migrate(struct udev *udev, int stackfd, const char *id, int *ret_priority) {
+        _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
+        const char *devnode;
+        int r;
+
+        /* Older versions only recorded the device ID, look up its priority and device node once */
+        (void) unlinkat(stackfd, id, 0);
+
+        if (!udev)
+                return 0;
+
+        dev = udev_device_new_from_device_id(udev, id);
+        if (!dev)
+                return 0;
+
+        devnode = udev_device_get_devnode(dev);
+        if (!devnode)
+                return 0;
+
+        r = link_stack_add(stackfd, id, devnode, udev_device_get_devlink_priority(dev));
+        if (r < 0)
+                return r;
+
+        *ret_priority = udev_device_get_devlink_priority(dev);
+        return 1;
+}
+
+static int priority_compare_reverse(const void *a, const void *b) {
+        const int *x = a, *y = b;
+
+        if (*x > *y)
+                return -1;
+        if (*x < *y)
+                return 1;
+        return 0;
+}
+
+static int link_stack_get_owner(int stackfd, int *ret_priority, char **ret_id, char **ret_devnode) {
+        _cleanup_free_ char *owner = NULL, *devnode = NULL, *id = NULL;
+        const char *slash;
+        int priority, r;
+
+        r = readlinkat_malloc(stackfd, ".owner", &owner);
+        if (r < 0)
+                return r;
+
+        slash = strchr(owner, '/');
+        if (!slash)
+                return -EINVAL;
+
+        r = safe_atoi(strndupa(owner, slash - owner), &priority);
+        if (r < 0)
+                return r;
+
+        /* the owner left the stack, or changed its priority */
+        r = readlinkat_malloc(stackfd, owner, &devnode);
+        if (r < 0)
+                return r;
+
+        if (access(devnode, F_OK) < 0)
+                return -errno;
+
+        id = strdup(slash + 1);
+        if (!id)
+                return -ENOMEM;
+
+        *ret_priority = priority;
+        *ret_id = id;
+        *ret_devnode = devnode;
+        id = devnode = NULL;
+        return 0;
+}
+
+static int link_stack_set_owner(int stackfd, int priority, const char *id) {
+        char *owner;
+
+        owner = newa(char, DECIMAL_STR_MAX(int) + 1 + strlen(id) + 1);
+        sprintf(owner, "%i/%s", priority, id);
+
+        if (unlinkat(stackfd, ".owner", 0) < 0 && errno != ENOENT)
+                return -errno;
+
+        if (symlinkat(owner, stackfd, ".owner") < 0)
+                return -errno;
+
+        return 0;
+}
+
 /* find device node of device with highest priority */
-static const char *link_find_prioritized(struct udev_device *dev, bool add, const char *stackdir, char *buf, size_t bufsize) {
-        struct udev *udev = udev_device_get_udev(dev);
-        DIR *dir;
+static int link_stack_find_prioritized(struct udev *udev, int stackfd, const char *skip_id,
+                                       int *ret_priority, char **ret_id, char **ret_devnode) {
+        _cleanup_closedir_ DIR *dir = NULL;
+        _cleanup_free_ int *priorities = NULL;
+        size_t n_priorities = 0, n_allocated = 0, i;
         struct dirent *dent;
-        int priority = 0;
-        const char *target = NULL;
 
-        if (add) {
-                priority = udev_device_get_devlink_priority(dev);
-                strscpy(buf, bufsize, udev_device_get_devnode(dev));
-                target = buf;
+        dir = xopendirat(stackfd, ".", O_NOFOLLOW);
+        if (!dir)
+                return -errno;
+
+        FOREACH_DIRENT(dent, dir, return -errno) {
+                int priority;
+
+                if (safe_atoi(dent->d_name, &priority) < 0) {
+                        if (streq(dent->d_name, skip_id) || link_stack_migrate(udev, stackfd, dent->d_name, &priority) <= 0)
+                                continue;
+                }
+
+                if (!GREEDY_REALLOC(priorities, n_allocated, n_priorities + 1))
+                        return -ENOMEM;
+
+                priorities[n_priorities++] = priority;
         }
 
-        dir = opendir(stackdir);
-        if (dir == NULL)
-                return target;
-        FOREACH_DIRENT_ALL(dent, dir, break) {
-                struct udev_device *dev_db;
+        qsort_safe(priorities, n_priorities, sizeof(int), priority_compare_reverse);
 
-                if (dent->d_name[0] == '\0')
-                        break;
-                if (dent->d_name[0] == '.')
-                        continue;
+        for (i = 0; i < n_priorities; i++) {
+                _cleanup_closedir_ DIR *bucket = NULL;
+                char name[DECIMAL_STR_MAX(int)];
+                bool empty = true;
 
-                log_debug("found '%s' claiming '%s'", dent->d_name, stackdir);
+                if (i > 0 && priorities[i] == priorities[i - 1])
+                        continue;
 
-                /* did we find ourself? */
-                if (streq(dent->d_name, udev_device_get_id_filename(dev)))
+                xsprintf(name, "%i", priorities[i]);
+                bucket = xopendirat(stackfd, name, O_NOFOLLOW);
+                if (!bucket)
                         continue;
 
-                dev_db = udev_device_new_from_device_id(udev, dent->d_name);
-                if (dev_db != NULL) {
-                        const char *devnode;
-
-                        devnode = udev_device_get_devnode(dev_db);
-                        if (devnode != NULL) {
-                                if (target == NULL || udev_device_get_devlink_priority(dev_db) > priority) {
-                                        log_debug("'%s' claims priority %i for '%s'",
-                                                  udev_device_get_syspath(dev_db), udev_device_get_devlink_priority(dev_db), stackdir);
-                                        priority = udev_device_get_devlink_priority(dev_db);
-                                        strscpy(buf, bufsize, devnode);
-                                        target = buf;
-                                }
-                        }
-                        udev_device_unref(dev_db);
+                FOREACH_DIRENT(dent, bucket, return -errno) {
+                        _cleanup_free_ char *devnode = NULL, *id = NULL;
+
+                        empty = false;
+
+                        if (streq(dent->d_name, skip_id))
+                                continue;
+
+                        if (readlinkat_malloc(dirfd(bucket), dent->d_name, &devnode) < 0)
+                                continue;
+
+                        /* skip devices which went away without us noticing */
+                        if (access(devnode, F_OK) < 0)
+                                continue;
+
+                        id = strdup(dent->d_name);
+                        if (!id)
+                                return -ENOMEM;
+
+                        log_debug("'%s' claims priority %i for '%s'", id, priorities[i], devnode);
+
+                        *ret_priority = priorities[i];
+                        *ret_id = id;
+                        *ret_devnode = devnode;
+                        id = devnode = NULL;
+                        return 1;
                 }
+
+                if (empty)
+                        (void) unlinkat(stackfd, name, AT_REMOVEDIR);
         }
-        closedir(dir);
-        return target;
+
+        return 0;
 }
 
 /* manage "stack of names" with possibly specified device priorities */
-static void link_update(struct udev_device *dev, const char *slink, bool add) {
-        char name_enc[UTIL_PATH_SIZE];
-        char filename[UTIL_PATH_SIZE * 2];
-        char dirname[UTIL_PATH_SIZE];
-        const char *target;
-        char buf[UTIL_PATH_SIZE];
+int udev_node_link_update(struct udev *udev, const char *stackdir, const char *slink,
+                          const char *id, const char *devnode, int priority, bool add) {
+        _cleanup_free_ char *owner_id = NULL, *owner_devnode = NULL;
+        _cleanup_close_ int fd = -1;
+        const char *target = NULL;
+        int r, owner_priority;
+
+        assert(stackdir);
+        assert(slink);
+        assert(id);
+        assert(!add || devnode);
+
+        fd = link_stack_open(stackdir, add);
+        if (fd < 0 && fd != -ENOENT)
+                return log_error_errno(fd, "failed to open '%s': %m", stackdir);
+
+        if (fd >= 0) {
+                if (add) {
+                        /* without an entry in the stack, the device must not become the owner of the link */
+                        r = link_stack_add(fd, id, devnode, priority);
+                        if (r < 0)
+                                return log_error_errno(r, "failed to add '%s' to '%s': %m", id, stackdir);
+                } else {
+                        r = link_stack_remove(fd, id);
+                        if (r < 0)
+                                log_error_errno(r, "failed to remove '%s' from '%s': %m", id, stackdir);
+                }
 
-        util_path_encode(slink + STRLEN("/dev"), name_enc, sizeof(name_enc));
-        strscpyl(dirname, sizeof(dirname), "/run/udev/links/", name_enc, NULL);
-        strscpyl(filename, sizeof(filename), dirname, "/", udev_device_get_id_filename(dev), NULL);
+                r = link_stack_get_owner(fd, &owner_priority, &owner_id, &owner_devnode);
+                if (r < 0 || streq(owner_id, id)) {
+                        owner_id = mfree(owner_id);
+                        owner_devnode = mfree(owner_devnode);
 
-        if (!add && unlink(filename) == 0)
-                rmdir(dirname);
+                        r = link_stack_find_prioritized(udev, fd, id, &owner_priority, &owner_id, &owner_devnode);
+                        if (r < 0)
+                                return log_error_errno(r, "failed to read '%s': %m", stackdir);
+                        if (r == 0)
+                                (void) unlinkat(fd, ".owner", 0);
+                        else
+                                (void) link_stack_set_owner(fd, owner_priority, owner_id);
+                }
+
+                target = owner_devnode;
+        }
+
+        /* the device being added wins over devices of the same priority */
+        if (add && (!target || priority >= owner_priority)) {
+                target = devnode;
+                (void) link_stack_set_owner(fd, priority, id);
+        }
 
-        target = link_find_prioritized(dev, add, dirname, buf, sizeof(buf));
         if (target == NULL) {
                 log_debug("no reference left, remove '%s'", slink);
                 if (unlink(slink) == 0)
                         rmdir_parents(slink, "/");
+                if (fd >= 0)
+                        (void) rmdir(stackdir);
         } else {
                 log_debug("creating link '%s' to '%s'", slink, target);
-                node_symlink(dev, target, slink);
+                node_symlink(id, target, slink);
         }
 
-        if (add) {
-                int err;
+        return 0;
+}
+
+static void link_update(struct udev_device *dev, const char *slink, bool add) {
+        char name_enc[UTIL_PATH_SIZE];
+        char dirname[UTIL_PATH_SIZE];
 
-                do {
-                        int fd;
+        util_path_encode(slink + STRLEN("/dev"), name_enc, sizeof(name_enc));
+        strscpyl(dirname, sizeof(dirname), "/run/udev/links/", name_enc, NULL);
 
-                        err = mkdir_parents(filename, 0755);
-                        if (!IN_SET(err, 0, -ENOENT))
-                                break;
-                        fd = open(filename, O_WRONLY|O_CREAT|O_CLOEXEC|O_TRUNC|O_NOFOLLOW, 0444);
-                        if (fd >= 0)
-                                close(fd);
-                        else
-                                err = -errno;
-                } while (err == -ENOENT);
-        }
+        (void) udev_node_link_update(udev_device_get_udev(dev), dirname, slink,
+                                     udev_device_get_id_filename(dev), udev_device_get_devnode(dev),
+                                     udev_device_get_devlink_priority(dev), add);
 }
 
 void udev_node_update_old_links(struct udev_device *dev, struct udev_device *dev_old) {
@@ -351,7 +592,7 @@ void udev_node_add(struct udev_device *dev, bool apply,
         xsprintf_dev_num_path(filename,
                               streq(udev_device_get_subsystem(dev), "block") ? "block" : "char",
                               udev_device_get_devnum(dev));
-        node_symlink(dev, udev_device_get_devnode(dev), filename);
+        node_symlink(udev_device_get_id_filename(dev), udev_device_get_devnode(dev), filename);
 
         /* create/update symlinks, add symlinks to name index */
         udev_list_entry_foreach(list_entry, udev_device_get_devlinks_list_entry(dev))
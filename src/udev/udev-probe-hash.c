@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <errno.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "macro.h"
+#include "siphash24.h"
+#include "udev.h"
+#include "unaligned.h"
+
+/* File systems, RAID, LVM and ZFS keep their superblocks, labels and metadata, and MBR and GPT their partition
+ * tables, within this much of the beginning or the end of a block device. Only the extended partition tables
+ * of MBR can be anywhere, they are followed separately. */
+#define PROBE_AREA_HEAD (2U * 1024U * 1024U)
+#define PROBE_AREA_TAIL (1U * 1024U * 1024U)
+#define PROBE_HASH_BUFFER_SIZE (128U * 1024U)
+#define MAX_LOGICAL_PARTITIONS 256
+
+static int hash_range(int fd, uint8_t *buf, uint64_t offset, uint64_t size, struct siphash *state) {
+        while (size > 0) {
+                ssize_t l;
+
+                l = pread(fd, buf, MIN(size, (uint64_t) PROBE_HASH_BUFFER_SIZE), offset);
+                if (l < 0)
+                        return -errno;
+                if (l == 0)
+                        break;
+
+                siphash24_compress(buf, l, state);
+                offset += l;
+                size -= l;
+        }
+
+        return 0;
+}
+
+static uint32_t mbr_find_extended(const uint8_t *mbr) {
+        unsigned i;
+
+        if (mbr[510] != 0x55 || mbr[511] != 0xaa)
+                return 0;
+
+        for (i = 0; i < 4; i++) {
+                const uint8_t *e = mbr + 446 + i * 16;
+
+                if (IN_SET(e[4], 0x05, 0x0f, 0x85))
+                        return unaligned_read_le32(e + 8);
+        }
+
+        return 0;
+}
+
+static int hash_extended_partitions(int fd, unsigned sector_size, uint8_t *buf, struct siphash *state) {
+        uint64_t start, next;
+        unsigned n;
+        ssize_t l;
+
+        l = pread(fd, buf, 512, 0);
+        if (l < 0)
+                return -errno;
+        if (l != 512)
+                return 0;
+
+        start = mbr_find_extended(buf);
+        if (start == 0)
+                return 0;
+
+        /* each logical partition comes with its own table, which links to the next one */
+        for (next = start, n = 0; n < MAX_LOGICAL_PARTITIONS; n++) {
+                uint32_t link;
+
+                l = pread(fd, buf, 512, next * sector_size);
+                if (l < 0)
+                        return -errno;
+
+                siphash24_compress(buf, l, state);
+                if (l != 512)
+                        break;
+
+                link = mbr_find_extended(buf);
+                if (link == 0)
+                        break;
+
+                next = start + link;
+        }
+
+        return 0;
+}
+
+/* Hashes the areas of a block device (or an image file) where superblocks and partition tables are kept, for
+ * the blkid builtin to tell whether probing it again could find anything new */
+int udev_probe_hash_area(int fd, struct siphash *state) {
+        _cleanup_free_ uint8_t *buf = NULL;
+        unsigned sector_size = 512;
+        struct stat st;
+        uint64_t size;
+        int r;
+
+        assert(fd >= 0);
+        assert(state);
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (S_ISREG(st.st_mode))
+                size = st.st_size;
+        else if (S_ISBLK(st.st_mode)) {
+                int ssz;
+
+                if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+                        return -errno;
+                if (ioctl(fd, BLKSSZGET, &ssz) < 0)
+                        return -errno;
+
+                sector_size = ssz;
+        } else
+                return -ENOTBLK;
+
+        buf = malloc(PROBE_HASH_BUFFER_SIZE);
+        if (!buf)
+                return -ENOMEM;
+
+        siphash24_compress(&size, sizeof(size), state);
+
+        r = hash_range(fd, buf, 0, MIN(size, (uint64_t) PROBE_AREA_HEAD), state);
+        if (r < 0)
+                return r;
+
+        if (size > PROBE_AREA_HEAD) {
+                uint64_t offset = MAX(size - PROBE_AREA_TAIL, (uint64_t) PROBE_AREA_HEAD);
+
+                r = hash_range(fd, buf, offset, size - offset, state);
+                if (r < 0)
+                        return r;
+        }
+
+        return hash_extended_partitions(fd, sector_size, buf, state);
+}
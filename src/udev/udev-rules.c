@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,10 +35,13 @@
 #include "dirent-util.h"
 #include "escape.h"
 #include "fd-util.h"
+#include "fileio.h"
 #include "fs-util.h"
 #include "glob-util.h"
+#include "hashmap.h"
 #include "path-util.h"
 #include "proc-cmdline.h"
+#include "siphash24.h"
 #include "stat-util.h"
 #include "stdio-util.h"
 #include "strbuf.h"
@@ -65,10 +69,27 @@ static const char* const rules_dirs[] = {
         NULL
 };
 
+/* The keys the prefilter knows about: rules which only match specific values of these are skipped right away for
+ * events with any other value */
+enum rules_filter_key {
+        RULES_FILTER_ACTION,
+        RULES_FILTER_SUBSYSTEM,
+        RULES_FILTER_KERNEL,
+        _RULES_FILTER_MAX,
+};
+
+struct rules_filter_value {
+        char *value;
+        unsigned int *rules;            /* token indices of the rules matching only on this and other values */
+        size_t n_rules;
+        size_t n_allocated;
+};
+
 struct udev_rules {
         struct udev *udev;
         usec_t dirs_ts_usec;
         int resolve_names;
+        char **dirs;
 
         /* every key in the rules file becomes a token */
         struct token *tokens;
@@ -78,6 +99,18 @@ struct udev_rules {
         /* all key strings are copied and de-duplicated in a single continuous string buffer */
         struct strbuf *strbuf;
 
+        /* when loaded from the compiled rules cache, the tokens and the strings point into this mapping */
+        void *map;
+        size_t map_size;
+        char *strings;
+
+        /* prefilter: bitmaps over the token indices, with bits set for the TK_RULE and TK_END tokens, and for
+         * the rules which only match specific values of a key */
+        size_t filter_words;
+        uint64_t *filter_rules;
+        uint64_t *filter_constrained[_RULES_FILTER_MAX];
+        Hashmap *filter_values[_RULES_FILTER_MAX];      /* value → struct rules_filter_value */
+
         /* during rule parsing, uid/gid lookup results are cached */
         struct uid_gid *uids;
         unsigned int uids_cur;
@@ -88,7 +121,10 @@ struct udev_rules {
 };
 
 static char *rules_str(struct udev_rules *rules, unsigned int off) {
-        return rules->strbuf->buf + off;
+        if (rules->strbuf)
+                return rules->strbuf->buf + off;
+
+        return rules->strings + off;
 }
 
 static unsigned int rules_add_string(struct udev_rules *rules, const char *s) {
@@ -332,7 +368,7 @@ static void dump_token(struct udev_rules *rules, struct token *token) {
         enum operation_type op = token->key.op;
         enum string_glob_type glob = token->key.glob;
         const char *value = rules_str(rules, token->key.value_off);
-        const char *attr = &rules->strbuf->buf[token->key.attr_off];
+        const char *attr = rules_str(rules, token->key.attr_off);
 
         switch (type) {
         case TK_RULE:
@@ -342,9 +378,9 @@ static void dump_token(struct udev_rules *rules, struct token *token) {
                         unsigned int idx = (tk_ptr - tks_ptr) / sizeof(struct token);
 
                         log_debug("* RULE %s:%u, token: %u, count: %u, label: '%s'",
-                                  &rules->strbuf->buf[token->rule.filename_off], token->rule.filename_line,
+                                  rules_str(rules, token->rule.filename_off), token->rule.filename_line,
                                   idx, token->rule.token_count,
-                                  &rules->strbuf->buf[token->rule.label_off]);
+                                  rules_str(rules, token->rule.label_off));
                         break;
                 }
         case TK_M_ACTION:
@@ -1529,37 +1565,376 @@ static int parse_file(struct udev_rules *rules, const char *filename) {
         return 0;
 }
 
-struct udev_rules *udev_rules_new(struct udev *udev, int resolve_names) {
-        struct udev_rules *rules;
-        struct udev_list file_list;
-        struct token end_token;
-        char **files, **f;
+/* Bump this whenever the layout of the cache or the way the key is calculated changes */
+#define RULES_CACHE_VERSION 1
+
+static const uint8_t rules_cache_signature[8] = { 'U', 'D', 'E', 'V', 'R', 'U', 'L', 'E' };
+
+static const uint8_t rules_cache_hash_key[16] = {
+        0x3b, 0x91, 0x0e, 0xd7, 0x62, 0x4f, 0xa8, 0x15,
+        0xc4, 0x7d, 0x2a, 0x96, 0x53, 0xe0, 0x1f, 0xb8
+};
+
+/* The compiled rules cache only lives in /run, hence it is written in native byte order and is simply the token
+ * array and the string buffer, like they are kept in memory */
+struct rules_cache_header {
+        uint8_t signature[8];
+        uint64_t key;
+        uint64_t token_size;
+        uint64_t tokens_off;
+        uint64_t n_tokens;
+        uint64_t strings_off;
+        uint64_t strings_len;
+        uint64_t file_size;
+};
+
+static void rules_cache_hash_file(struct siphash *state, const char *path) {
+        _cleanup_free_ char *contents = NULL;
+        size_t size;
         int r;
 
-        rules = new0(struct udev_rules, 1);
-        if (rules == NULL)
-                return NULL;
-        rules->udev = udev;
-        rules->resolve_names = resolve_names;
-        udev_list_init(udev, &file_list, true);
+        siphash24_compress(path, strlen(path) + 1, state);
+
+        r = read_full_file(path, &contents, &size);
+        siphash24_compress(&r, sizeof(r), state);
+        if (r < 0)
+                return;
+
+        siphash24_compress(&size, sizeof(size), state);
+        siphash24_compress(contents, size, state);
+}
+
+static uint64_t rules_cache_key(struct udev_rules *rules, char **files) {
+        struct siphash state;
+        uint64_t version = RULES_CACHE_VERSION, token_size = sizeof(struct token);
+        enum udev_builtin_cmd cmd;
+        char **f;
+
+        /* Everything the compiled rules depend on: the contents of all rules files, the builtins compiled in, and if
+         * names are resolved while parsing, the user and group databases. Users and groups that are not in the files
+         * are not covered, but the same was already true for names looked up once when the rules are loaded. */
+
+        siphash24_init(&state, rules_cache_hash_key);
+        siphash24_compress(&version, sizeof(version), &state);
+        siphash24_compress(PACKAGE_VERSION, strlen(PACKAGE_VERSION) + 1, &state);
+        siphash24_compress(&token_size, sizeof(token_size), &state);
+        siphash24_compress(&rules->resolve_names, sizeof(rules->resolve_names), &state);
+
+        for (cmd = 0; cmd < UDEV_BUILTIN_MAX; cmd++) {
+                const char *name = strempty(udev_builtin_name(cmd));
+
+                siphash24_compress(name, strlen(name) + 1, &state);
+        }
+
+        STRV_FOREACH(f, files)
+                rules_cache_hash_file(&state, *f);
+
+        if (rules->resolve_names > 0) {
+                rules_cache_hash_file(&state, "/etc/passwd");
+                rules_cache_hash_file(&state, "/etc/group");
+        }
+
+        return siphash24_finalize(&state);
+}
+
+static int rules_cache_load(struct udev_rules *rules, const char *path, uint64_t key) {
+        const struct rules_cache_header *h;
+        _cleanup_close_ int fd = -1;
+        struct token *tokens;
+        struct stat st;
+        char *strings;
+        void *map;
+        int r;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if ((size_t) st.st_size < sizeof(struct rules_cache_header))
+                return -EBADMSG;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        h = map;
+        if (memcmp(h->signature, rules_cache_signature, sizeof(h->signature)) != 0 ||
+            h->file_size != (uint64_t) st.st_size ||
+            h->token_size != sizeof(struct token) ||
+            h->n_tokens == 0 ||
+            h->tokens_off < sizeof(struct rules_cache_header) ||
+            h->tokens_off + h->n_tokens * sizeof(struct token) > h->strings_off ||
+            h->strings_len == 0 ||
+            h->strings_off + h->strings_len != h->file_size) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        if (h->key != key) {
+                r = -ESTALE;
+                goto fail;
+        }
+
+        tokens = (struct token *) ((uint8_t *) map + h->tokens_off);
+        strings = (char *) map + h->strings_off;
+        if (tokens[h->n_tokens - 1].type != TK_END || strings[h->strings_len - 1] != 0) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        rules->map = map;
+        rules->map_size = st.st_size;
+        rules->tokens = tokens;
+        rules->token_cur = h->n_tokens;
+        rules->strings = strings;
+
+        return 0;
+
+fail:
+        munmap(map, st.st_size);
+        return r;
+}
+
+static int rules_cache_save(struct udev_rules *rules, const char *path, uint64_t key) {
+        _cleanup_fclose_ FILE *f = NULL;
+        _cleanup_free_ char *temp_path = NULL;
+        struct rules_cache_header h = {
+                .key = key,
+                .token_size = sizeof(struct token),
+                .tokens_off = sizeof(struct rules_cache_header),
+                .n_tokens = rules->token_cur,
+                .strings_len = rules->strbuf->len,
+        };
+        int r;
+
+        memcpy(h.signature, rules_cache_signature, sizeof(h.signature));
+        h.strings_off = h.tokens_off + h.n_tokens * sizeof(struct token);
+        h.file_size = h.strings_off + h.strings_len;
+
+        r = fopen_temporary(path, &f, &temp_path);
+        if (r < 0)
+                return r;
+
+        (void) fchmod(fileno(f), 0644);
+
+        fwrite(&h, sizeof(h), 1, f);
+        fwrite(rules->tokens, sizeof(struct token), rules->token_cur, f);
+        fwrite(rules->strbuf->buf, 1, rules->strbuf->len, f);
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                goto fail;
+
+        if (rename(temp_path, path) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        (void) unlink(temp_path);
+        return r;
+}
+
+static int rules_filter_key_from_token(enum token_type type) {
+        switch (type) {
+        case TK_M_ACTION:
+                return RULES_FILTER_ACTION;
+        case TK_M_SUBSYSTEM:
+                return RULES_FILTER_SUBSYSTEM;
+        case TK_M_KERNEL:
+                return RULES_FILTER_KERNEL;
+        default:
+                return -1;
+        }
+}
+
+static void bitmap_words_set(uint64_t *words, unsigned int n) {
+        words[n / 64] |= UINT64_C(1) << (n % 64);
+}
+
+static bool bitmap_words_isset(const uint64_t *words, unsigned int n) {
+        return words[n / 64] & (UINT64_C(1) << (n % 64));
+}
+
+static int rules_filter_add_value(struct udev_rules *rules, enum rules_filter_key k,
+                                  const char *value, size_t len, unsigned int rule) {
+        struct rules_filter_value *v;
+        char buf[len + 1];
+        int r;
+
+        memcpy(buf, value, len);
+        buf[len] = 0;
+
+        v = hashmap_get(rules->filter_values[k], buf);
+        if (!v) {
+                r = hashmap_ensure_allocated(&rules->filter_values[k], &string_hash_ops);
+                if (r < 0)
+                        return r;
+
+                v = new0(struct rules_filter_value, 1);
+                if (!v)
+                        return -ENOMEM;
+
+                v->value = strdup(buf);
+                if (!v->value) {
+                        free(v);
+                        return -ENOMEM;
+                }
+
+                r = hashmap_put(rules->filter_values[k], v->value, v);
+                if (r < 0) {
+                        free(v->value);
+                        free(v);
+                        return r;
+                }
+        }
+
+        if (!GREEDY_REALLOC(v->rules, v->n_allocated, v->n_rules + 1))
+                return -ENOMEM;
+
+        v->rules[v->n_rules++] = rule;
+        return 0;
+}
+
+static int rules_filter_build(struct udev_rules *rules) {
+        unsigned int i, rule = 0;
+        int k, r;
+
+        /* Matches are sorted by token type within each rule, and all matches that come before the ACTION, KERNEL
+         * and SUBSYSTEM ones are free of side effects. Hence a rule with ACTION=="add", or KERNEL=="sd*|nvme*"
+         * with a plain list of alternatives, may be skipped as a whole for events that don't have one of the
+         * values listed. Remember which rules only match which values, so that the rules that cannot match an event
+         * can be masked out before it is processed. */
+
+        rules->filter_words = DIV_ROUND_UP(rules->token_cur, 64);
+
+        rules->filter_rules = new0(uint64_t, rules->filter_words);
+        if (!rules->filter_rules)
+                return -ENOMEM;
+
+        for (k = 0; k < _RULES_FILTER_MAX; k++) {
+                rules->filter_constrained[k] = new0(uint64_t, rules->filter_words);
+                if (!rules->filter_constrained[k])
+                        return -ENOMEM;
+        }
+
+        for (i = 0; i < rules->token_cur; i++) {
+                struct token *t = rules->tokens + i;
+                const char *s;
+
+                if (IN_SET(t->type, TK_RULE, TK_END)) {
+                        bitmap_words_set(rules->filter_rules, i);
+                        rule = i;
+                        continue;
+                }
+
+                k = rules_filter_key_from_token(t->type);
+                if (k < 0)
+                        continue;
+                if (t->key.op != OP_MATCH || !IN_SET(t->key.glob, GL_PLAIN, GL_SPLIT))
+                        continue;
+
+                bitmap_words_set(rules->filter_constrained[k], rule);
+
+                s = rules_str(rules, t->key.value_off);
+                for (;;) {
+                        size_t n;
+
+                        n = strcspn(s, "|");
+                        r = rules_filter_add_value(rules, k, s, n, rule);
+                        if (r < 0)
+                                return r;
+
+                        if (s[n] == 0)
+                                break;
+                        s += n + 1;
+                }
+        }
+
+        return 0;
+}
+
+static void rules_filter_free(struct udev_rules *rules) {
+        struct rules_filter_value *v;
+        int k;
+
+        for (k = 0; k < _RULES_FILTER_MAX; k++) {
+                while ((v = hashmap_steal_first(rules->filter_values[k]))) {
+                        free(v->value);
+                        free(v->rules);
+                        free(v);
+                }
+
+                rules->filter_values[k] = hashmap_free(rules->filter_values[k]);
+                rules->filter_constrained[k] = mfree(rules->filter_constrained[k]);
+        }
+
+        rules->filter_rules = mfree(rules->filter_rules);
+        rules->filter_words = 0;
+}
+
+static void rules_filter_apply(struct udev_rules *rules, struct udev_device *dev, uint64_t *mask, uint64_t *tmp) {
+        const char *values[_RULES_FILTER_MAX] = {
+                [RULES_FILTER_ACTION] = udev_device_get_action(dev),
+                [RULES_FILTER_SUBSYSTEM] = udev_device_get_subsystem(dev),
+                [RULES_FILTER_KERNEL] = udev_device_get_sysname(dev),
+        };
+        size_t w;
+        int k;
+
+        /* Calculates the rules that may match the device, as the bitmap of their TK_RULE tokens */
+
+        memcpy(mask, rules->filter_rules, rules->filter_words * sizeof(uint64_t));
+
+        for (k = 0; k < _RULES_FILTER_MAX; k++) {
+                struct rules_filter_value *v;
+                size_t i;
+
+                for (w = 0; w < rules->filter_words; w++)
+                        tmp[w] = ~rules->filter_constrained[k][w];
+
+                v = hashmap_get(rules->filter_values[k], strempty(values[k]));
+                if (v)
+                        for (i = 0; i < v->n_rules; i++)
+                                bitmap_words_set(tmp, v->rules[i]);
+
+                for (w = 0; w < rules->filter_words; w++)
+                        mask[w] &= tmp[w];
+        }
+}
+
+static unsigned int rules_filter_next(struct udev_rules *rules, const uint64_t *mask, unsigned int i) {
+        size_t w = i / 64;
+        uint64_t m;
+
+        /* Returns the next token index at or after i of a rule that may match, or of the TK_END token */
+
+        m = mask[w] & (UINT64_MAX << (i % 64));
+        while (m == 0) {
+                assert(w + 1 < rules->filter_words);
+                m = mask[++w];
+        }
+
+        return w * 64 + __builtin_ctzll(m);
+}
+
+static int rules_parse(struct udev_rules *rules, char **files) {
+        struct token end_token;
+        char **f;
 
         /* init token array and string buffer */
         rules->tokens = malloc(PREALLOC_TOKEN * sizeof(struct token));
         if (rules->tokens == NULL)
-                return udev_rules_unref(rules);
+                return -ENOMEM;
         rules->token_max = PREALLOC_TOKEN;
 
         rules->strbuf = strbuf_new();
         if (!rules->strbuf)
-                return udev_rules_unref(rules);
-
-        udev_rules_check_timestamp(rules);
-
-        r = conf_files_list_strv(&files, ".rules", NULL, 0, rules_dirs);
-        if (r < 0) {
-                log_error_errno(r, "failed to enumerate rules files: %m");
-                return udev_rules_unref(rules);
-        }
+                return -ENOMEM;
 
         /*
          * The offset value in the rules strct is limited; add all
@@ -1571,8 +1946,6 @@ struct udev_rules *udev_rules_new(struct udev *udev, int resolve_names) {
         STRV_FOREACH(f, files)
                 parse_file(rules, *f);
 
-        strv_free(files);
-
         memzero(&end_token, sizeof(struct token));
         end_token.type = TK_END;
         add_token(rules, &end_token);
@@ -1594,16 +1967,83 @@ struct udev_rules *udev_rules_new(struct udev *udev, int resolve_names) {
         rules->gids_max = 0;
 
         dump_rules(rules);
+        return 0;
+}
+
+struct udev_rules *udev_rules_new_from_dirs(struct udev *udev, int resolve_names,
+                                            const char *const *dirs, const char *cache_path) {
+        struct udev_rules *rules;
+        _cleanup_strv_free_ char **files = NULL;
+        uint64_t key = 0;
+        int r;
+
+        rules = new0(struct udev_rules, 1);
+        if (rules == NULL)
+                return NULL;
+        rules->udev = udev;
+        rules->resolve_names = resolve_names;
+
+        rules->dirs = strv_copy((char**) dirs);
+        if (!rules->dirs)
+                return udev_rules_unref(rules);
+
+        udev_rules_check_timestamp(rules);
+
+        r = conf_files_list_strv(&files, ".rules", NULL, 0, dirs);
+        if (r < 0) {
+                log_error_errno(r, "failed to enumerate rules files: %m");
+                return udev_rules_unref(rules);
+        }
+
+        if (cache_path) {
+                key = rules_cache_key(rules, files);
+
+                r = rules_cache_load(rules, cache_path, key);
+                if (r >= 0)
+                        log_debug("Loaded %u compiled rules tokens from %s", rules->token_cur, cache_path);
+                else if (r != -ENOENT)
+                        log_debug_errno(r, "Not using compiled rules from %s, parsing rules files: %m", cache_path);
+        }
+
+        if (!rules->map) {
+                r = rules_parse(rules, files);
+                if (r < 0) {
+                        log_oom();
+                        return udev_rules_unref(rules);
+                }
+
+                if (cache_path) {
+                        r = rules_cache_save(rules, cache_path, key);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to write compiled rules to %s, ignoring: %m", cache_path);
+                }
+        }
+
+        r = rules_filter_build(rules);
+        if (r < 0) {
+                log_oom();
+                return udev_rules_unref(rules);
+        }
+
         return rules;
 }
 
+struct udev_rules *udev_rules_new(struct udev *udev, int resolve_names) {
+        return udev_rules_new_from_dirs(udev, resolve_names, rules_dirs, "/run/udev/rules.bin");
+}
+
 struct udev_rules *udev_rules_unref(struct udev_rules *rules) {
         if (rules == NULL)
                 return NULL;
-        free(rules->tokens);
+        rules_filter_free(rules);
+        if (rules->map)
+                munmap(rules->map, rules->map_size);
+        else
+                free(rules->tokens);
         strbuf_cleanup(rules->strbuf);
         free(rules->uids);
         free(rules->gids);
+        strv_free(rules->dirs);
         return mfree(rules);
 }
 
@@ -1611,7 +2051,7 @@ bool udev_rules_check_timestamp(struct udev_rules *rules) {
         if (!rules)
                 return false;
 
-        return paths_check_timestamp(rules_dirs, &rules->dirs_ts_usec, true);
+        return paths_check_timestamp((const char* const*) rules->dirs, &rules->dirs_ts_usec, true);
 }
 
 static int match_key(struct udev_rules *rules, struct token *token, const char *val) {
@@ -1750,6 +2190,7 @@ void udev_rules_apply_to_event(struct udev_rules *rules,
         struct token *rule;
         enum escape_type esc = ESCAPE_UNSET;
         bool can_set_name;
+        uint64_t *mask, *tmp;
         int r;
 
         if (rules->tokens == NULL)
@@ -1759,8 +2200,13 @@ void udev_rules_apply_to_event(struct udev_rules *rules,
                         (major(udev_device_get_devnum(event->dev)) > 0 ||
                          udev_device_get_ifindex(event->dev) > 0));
 
+        /* find the rules that can possibly match this event */
+        mask = newa(uint64_t, rules->filter_words);
+        tmp = newa(uint64_t, rules->filter_words);
+        rules_filter_apply(rules, event->dev, mask, tmp);
+
         /* loop through token list, match, run actions or forward to next rule */
-        cur = &rules->tokens[0];
+        cur = &rules->tokens[rules_filter_next(rules, mask, 0)];
         rule = cur;
         for (;;) {
                 dump_token(rules, cur);
@@ -1768,6 +2214,9 @@ void udev_rules_apply_to_event(struct udev_rules *rules,
                 case TK_RULE:
                         /* current rule */
                         rule = cur;
+                        /* skip rules which can't match, which we might get to by GOTO or from the previous rule */
+                        if (!bitmap_words_isset(mask, cur - rules->tokens))
+                                goto nomatch;
                         /* possibly skip rules which want to set NAME, SYMLINK, OWNER, GROUP, MODE */
                         if (!can_set_name && rule->rule.can_set_name)
                                 goto nomatch;
@@ -2434,8 +2883,8 @@ void udev_rules_apply_to_event(struct udev_rules *rules,
                 cur++;
                 continue;
         nomatch:
-                /* fast-forward to next rule */
-                cur = rule + rule->rule.token_count;
+                /* fast-forward to the next rule that may match */
+                cur = &rules->tokens[rules_filter_next(rules, mask, rule + rule->rule.token_count - rules->tokens)];
         }
 }
 
@@ -25,7 +25,9 @@
 #include <unistd.h>
 
 #include "dirent-util.h"
+#include "fileio.h"
 #include "stdio-util.h"
+#include "string-util.h"
 #include "udev.h"
 
 static int inotify_fd = -1;
@@ -151,3 +153,27 @@ struct udev_device *udev_watch_lookup(struct udev *udev, int wd) {
 
         return udev_device_new_from_device_id(udev, device);
 }
+
+/* A "change" is sent once the device was left alone for debounce_usec. If it keeps being closed after writing, it
+ * is sent anyway after max times that. */
+usec_t udev_watch_debounce_deadline(usec_t first_usec, usec_t now_usec, usec_t debounce_usec, unsigned max) {
+        assert(max > 0);
+
+        return MIN(now_usec, first_usec + (max - 1) * debounce_usec) + debounce_usec;
+}
+
+/* Kernels since 4.13 take a UUID and arguments after the action, which end up in the uevent as
+ * SYNTH_ARG_<KEY>=<VALUE>, where the key may only consist of letters and digits. This marks the "change" as
+ * caused by the watch, see builtin_blkid(). */
+int udev_watch_synthesize_change(const char *syspath) {
+        const char *filename;
+        int r;
+
+        filename = strjoina(syspath, "/uevent");
+
+        r = write_string_file(filename, "change 00000000-0000-0000-0000-000000000000 UDEVWATCH=1", WRITE_STRING_FILE_CREATE);
+        if (r == -EINVAL)
+                r = write_string_file(filename, "change", WRITE_STRING_FILE_CREATE);
+
+        return r;
+}
@@ -28,6 +28,7 @@
 
 #include "label.h"
 #include "libudev-private.h"
+#include "list.h"
 #include "macro.h"
 #include "strv.h"
 #include "util.h"
@@ -68,9 +69,32 @@ struct udev_watch {
         char *name;
 };
 
+struct udev_event_index_node;
+struct udev_event_index_bucket;
+
+/* An event in udevd's queue, as far as the ordering between events is concerned */
+struct udev_event_index_entry {
+        unsigned long long int seqnum;
+        const char *devpath;
+        const char *devpath_old;
+        dev_t devnum;
+        bool is_block;
+        int ifindex;
+
+        /* maintained by udev_event_index_add() and udev_event_index_remove() */
+        struct udev_event_index_node *node;
+        struct udev_event_index_bucket *devnum_bucket;
+        struct udev_event_index_bucket *ifindex_bucket;
+        LIST_FIELDS(struct udev_event_index_entry, same_devpath);
+        LIST_FIELDS(struct udev_event_index_entry, same_devnum);
+        LIST_FIELDS(struct udev_event_index_entry, same_ifindex);
+};
+
 /* udev-rules.c */
 struct udev_rules;
 struct udev_rules *udev_rules_new(struct udev *udev, int resolve_names);
+struct udev_rules *udev_rules_new_from_dirs(struct udev *udev, int resolve_names,
+                                            const char *const *dirs, const char *cache_path);
 struct udev_rules *udev_rules_unref(struct udev_rules *rules);
 bool udev_rules_check_timestamp(struct udev_rules *rules);
 void udev_rules_apply_to_event(struct udev_rules *rules, struct udev_event *event,
@@ -104,6 +128,12 @@ void udev_watch_restore(struct udev *udev);
 void udev_watch_begin(struct udev *udev, struct udev_device *dev);
 void udev_watch_end(struct udev *udev, struct udev_device *dev);
 struct udev_device *udev_watch_lookup(struct udev *udev, int wd);
+usec_t udev_watch_debounce_deadline(usec_t first_usec, usec_t now_usec, usec_t debounce_usec, unsigned max);
+int udev_watch_synthesize_change(const char *syspath);
+
+/* udev-probe-hash.c */
+struct siphash;
+int udev_probe_hash_area(int fd, struct siphash *state);
 
 /* udev-node.c */
 void udev_node_add(struct udev_device *dev, bool apply,
@@ -111,6 +141,16 @@ void udev_node_add(struct udev_device *dev, bool apply,
                    struct udev_list *seclabel_list);
 void udev_node_remove(struct udev_device *dev);
 void udev_node_update_old_links(struct udev_device *dev, struct udev_device *dev_old);
+int udev_node_link_update(struct udev *udev, const char *stackdir, const char *slink,
+                          const char *id, const char *devnode, int priority, bool add);
+
+/* udev-event-index.c */
+struct udev_event_index;
+struct udev_event_index *udev_event_index_new(void);
+struct udev_event_index *udev_event_index_free(struct udev_event_index *idx);
+int udev_event_index_add(struct udev_event_index *idx, struct udev_event_index_entry *entry);
+void udev_event_index_remove(struct udev_event_index *idx, struct udev_event_index_entry *entry);
+bool udev_event_index_is_busy(struct udev_event_index *idx, struct udev_event_index_entry *entry);
 
 /* udev-ctrl.c */
 struct udev_ctrl;
@@ -147,6 +187,7 @@ int udev_ctrl_get_set_children_max(struct udev_ctrl_msg *ctrl_msg);
 
 /* built-in commands */
 enum udev_builtin_cmd {
+        UDEV_BUILTIN_ATA_ID,
 #if HAVE_BLKID
         UDEV_BUILTIN_BLKID,
 #endif
@@ -175,6 +216,7 @@ struct udev_builtin {
         bool (*validate)(struct udev *udev);
         bool run_once;
 };
+extern const struct udev_builtin udev_builtin_ata_id;
 #if HAVE_BLKID
 extern const struct udev_builtin udev_builtin_blkid;
 #endif
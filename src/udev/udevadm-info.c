@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "device-db-snapshot.h"
 #include "dirent-util.h"
 #include "fd-util.h"
 #include "string-util.h"
@@ -228,6 +229,9 @@ static void cleanup_db(struct udev *udev) {
         dir1 = opendir("/run/udev/data");
         if (dir1 != NULL)
                 cleanup_dir(dir1, S_ISVTX, 1);
+        /* udevd only reads what its events changed into the next snapshot, make it start from scratch */
+        (void) device_db_snapshot_invalidate(DEVICE_DB_SNAPSHOT_PATH);
+        (void) unlink(DEVICE_DB_SNAPSHOT_PATH);
 
         dir2 = opendir("/run/udev/links");
         if (dir2 != NULL)
@@ -119,12 +119,18 @@ static int adm_trigger(struct udev *udev, int argc, char *argv[]) {
         } device_type = TYPE_DEVICES;
         const char *action = "change";
         _cleanup_udev_enumerate_unref_ struct udev_enumerate *udev_enumerate = NULL;
+        long n_cpus;
         int c, r;
 
         udev_enumerate = udev_enumerate_new(udev);
         if (udev_enumerate == NULL)
                 return 1;
 
+        /* Looking at all of /sys takes a while on big machines, let one thread per CPU share the work */
+        n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n_cpus > 1)
+                (void) udev_enumerate_set_threads(udev_enumerate, n_cpus);
+
         while ((c = getopt_long(argc, argv, "vnt:c:s:S:a:A:p:g:y:b:Vh", options, NULL)) >= 0) {
                 const char *key;
                 const char *val;
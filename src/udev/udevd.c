@@ -48,6 +48,7 @@
 #include "cgroup-util.h"
 #include "cpu-set-util.h"
 #include "dev-setup.h"
+#include "device-db-snapshot.h"
 #include "fd-util.h"
 #include "fileio.h"
 #include "format-util.h"
@@ -60,6 +61,7 @@
 #include "proc-cmdline.h"
 #include "process-util.h"
 #include "selinux-util.h"
+#include "set.h"
 #include "signal-util.h"
 #include "socket-util.h"
 #include "string-util.h"
@@ -75,12 +77,21 @@ static unsigned arg_children_max;
 static int arg_exec_delay;
 static usec_t arg_event_timeout_usec = 180 * USEC_PER_SEC;
 static usec_t arg_event_timeout_warn_usec = 180 * USEC_PER_SEC / 3;
+static usec_t arg_watch_debounce_usec = 200 * USEC_PER_MSEC;
+
+/* How long idle workers are kept around after the queue ran empty, so that events arriving in short succession, like
+ * during coldplug, don't need a new worker forked for each of them */
+#define WORKER_IDLE_TIMEOUT_USEC (3 * USEC_PER_SEC)
+
+/* A device that keeps being written to still gets a "change" event after this many debounce windows */
+#define WATCH_DEBOUNCE_MAX 5
 
 typedef struct Manager {
         struct udev *udev;
         sd_event *event;
         Hashmap *workers;
         LIST_HEAD(struct event, events);
+        struct udev_event_index *events_index;
         const char *cgroup;
         pid_t pid; /* the process that originally allocated the manager object */
 
@@ -96,11 +107,17 @@ typedef struct Manager {
         sd_event_source *ctrl_event;
         sd_event_source *uevent_event;
         sd_event_source *inotify_event;
+        sd_event_source *kill_workers_event;
+
+        Hashmap *watch_changes;
+        unsigned n_watch_changes_pending;
 
         usec_t last_usec;
 
         bool stop_exec_queue:1;
         bool exit:1;
+        Set *db_snapshot_changed;       /* ids of the database entries the workers might have changed */
+        bool db_snapshot_rebuild:1;     /* or all of them */
 } Manager;
 
 enum event_state {
@@ -117,18 +134,20 @@ struct event {
         struct udev_device *dev_kernel;
         struct worker *worker;
         enum event_state state;
-        unsigned long long int delaying_seqnum;
-        unsigned long long int seqnum;
-        const char *devpath;
-        size_t devpath_len;
-        const char *devpath_old;
-        dev_t devnum;
-        int ifindex;
-        bool is_block;
+        struct udev_event_index_entry index;
         sd_event_source *timeout_warning;
         sd_event_source *timeout;
 };
 
+/* Closing a watched device after writing to it results in a synthesized "change" event. Closes in short
+ * succession are coalesced, the event is sent once the device was left alone for a while. */
+struct watch_change {
+        Manager *manager;
+        int wd;
+        usec_t first_usec;
+        sd_event_source *timeout;
+};
+
 static void event_queue_cleanup(Manager *manager, enum event_state type);
 
 enum worker_state {
@@ -151,6 +170,34 @@ struct worker {
 struct worker_message {
 };
 
+static void manager_db_snapshot_changed(Manager *manager, struct udev_device *dev) {
+        const char *id;
+        char *copy;
+        int r;
+
+        /* Remember the device, so that the next snapshot only needs to read its database entry */
+
+        if (manager->db_snapshot_rebuild)
+                return;
+
+        id = udev_device_get_id_filename(dev);
+        if (!id) {
+                manager->db_snapshot_rebuild = true;
+                return;
+        }
+
+        if (set_contains(manager->db_snapshot_changed, id))
+                return;
+
+        r = set_ensure_allocated(&manager->db_snapshot_changed, &string_hash_ops);
+        if (r >= 0) {
+                copy = strdup(id);
+                r = copy ? set_consume(manager->db_snapshot_changed, copy) : -ENOMEM;
+        }
+        if (r < 0)
+                manager->db_snapshot_rebuild = true;
+}
+
 static void event_free(struct event *event) {
         int r;
 
@@ -159,16 +206,21 @@ static void event_free(struct event *event) {
         assert(event->manager);
 
         LIST_REMOVE(event, event->manager->events, event);
+        udev_event_index_remove(event->manager->events_index, &event->index);
         udev_device_unref(event->dev);
         udev_device_unref(event->dev_kernel);
 
         sd_event_source_unref(event->timeout_warning);
         sd_event_source_unref(event->timeout);
 
-        if (event->worker)
+        if (event->worker) {
                 event->worker->event = NULL;
 
-        if (LIST_IS_EMPTY(event->manager->events)) {
+                /* the worker might have changed the database */
+                manager_db_snapshot_changed(event->manager, event->dev);
+        }
+
+        if (LIST_IS_EMPTY(event->manager->events) && event->manager->n_watch_changes_pending == 0) {
                 /* only clean up the queue from the process that created it */
                 if (event->manager->pid == getpid_cached()) {
                         r = unlink("/run/udev/queue");
@@ -248,7 +300,7 @@ static int on_event_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
         kill_and_sigcont(event->worker->pid, SIGKILL);
         event->worker->state = WORKER_KILLED;
 
-        log_error("seq %llu '%s' killed", udev_device_get_seqnum(event->dev), event->devpath);
+        log_error("seq %llu '%s' killed", udev_device_get_seqnum(event->dev), event->index.devpath);
 
         return 1;
 }
@@ -258,7 +310,7 @@ static int on_event_timeout_warning(sd_event_source *s, uint64_t usec, void *use
 
         assert(event);
 
-        log_warning("seq %llu '%s' is taking a long time", udev_device_get_seqnum(event->dev), event->devpath);
+        log_warning("seq %llu '%s' is taking a long time", udev_device_get_seqnum(event->dev), event->index.devpath);
 
         return 1;
 }
@@ -289,6 +341,29 @@ static void worker_attach_event(struct worker *worker, struct event *event) {
                                  usec + arg_event_timeout_usec, USEC_PER_SEC, on_event_timeout, event);
 }
 
+static void watch_change_free(struct watch_change *change) {
+        if (!change)
+                return;
+
+        hashmap_remove(change->manager->watch_changes, INT_TO_PTR(change->wd));
+
+        if (change->timeout) {
+                sd_event_source_unref(change->timeout);
+                change->manager->n_watch_changes_pending--;
+        }
+
+        free(change);
+}
+
+static void manager_watch_changes_free(Manager *manager) {
+        struct watch_change *change;
+
+        while ((change = hashmap_first(manager->watch_changes)))
+                watch_change_free(change);
+
+        manager->watch_changes = hashmap_free(manager->watch_changes);
+}
+
 static void manager_free(Manager *manager) {
         if (!manager)
                 return;
@@ -298,11 +373,15 @@ static void manager_free(Manager *manager) {
         sd_event_source_unref(manager->ctrl_event);
         sd_event_source_unref(manager->uevent_event);
         sd_event_source_unref(manager->inotify_event);
+        sd_event_source_unref(manager->kill_workers_event);
+        manager_watch_changes_free(manager);
 
         udev_unref(manager->udev);
         sd_event_unref(manager->event);
         manager_workers_free(manager);
         event_queue_cleanup(manager, EVENT_UNDEF);
+        udev_event_index_free(manager->events_index);
+        set_free_free(manager->db_snapshot_changed);
 
         udev_monitor_unref(manager->monitor);
         udev_ctrl_unref(manager->ctrl);
@@ -369,6 +448,8 @@ static void worker_spawn(Manager *manager, struct event *event) {
                 manager->ctrl_event = sd_event_source_unref(manager->ctrl_event);
                 manager->uevent_event = sd_event_source_unref(manager->uevent_event);
                 manager->inotify_event = sd_event_source_unref(manager->inotify_event);
+                manager->kill_workers_event = sd_event_source_unref(manager->kill_workers_event);
+                manager_watch_changes_free(manager);
 
                 manager->event = sd_event_unref(manager->event);
 
@@ -580,6 +661,29 @@ static void event_run(Manager *manager, struct event *event) {
         worker_spawn(manager, event);
 }
 
+static void event_run_batch(Manager *manager, struct event **events, struct worker **workers, size_t n) {
+        struct udev_monitor *destinations[UDEV_MONITOR_BATCH_MAX];
+        struct udev_device *devices[UDEV_MONITOR_BATCH_MAX];
+        size_t i;
+        int r;
+
+        assert(manager);
+        assert(n <= UDEV_MONITOR_BATCH_MAX);
+
+        for (i = 0; i < n; i++) {
+                destinations[i] = workers[i]->monitor;
+                devices[i] = events[i]->dev;
+        }
+
+        r = udev_monitor_send_devices(manager->monitor, destinations, devices, n);
+        for (i = 0; i < (size_t) MAX(r, 0); i++)
+                worker_attach_event(workers[i], events[i]);
+
+        /* Whatever was not passed on takes the slow path, which gets rid of workers not accepting messages */
+        for (; i < n; i++)
+                event_run(manager, events[i]);
+}
+
 static int event_queue_insert(Manager *manager, struct udev_device *dev) {
         struct event *event;
         int r;
@@ -602,13 +706,21 @@ static int event_queue_insert(Manager *manager, struct udev_device *dev) {
         event->dev = dev;
         event->dev_kernel = udev_device_shallow_clone(dev);
         udev_device_copy_properties(event->dev_kernel, dev);
-        event->seqnum = udev_device_get_seqnum(dev);
-        event->devpath = udev_device_get_devpath(dev);
-        event->devpath_len = strlen(event->devpath);
-        event->devpath_old = udev_device_get_devpath_old(dev);
-        event->devnum = udev_device_get_devnum(dev);
-        event->is_block = streq("block", udev_device_get_subsystem(dev));
-        event->ifindex = udev_device_get_ifindex(dev);
+        event->index = (struct udev_event_index_entry) {
+                .seqnum = udev_device_get_seqnum(dev),
+                .devpath = udev_device_get_devpath(dev),
+                .devpath_old = udev_device_get_devpath_old(dev),
+                .devnum = udev_device_get_devnum(dev),
+                .is_block = streq("block", udev_device_get_subsystem(dev)),
+                .ifindex = udev_device_get_ifindex(dev),
+        };
+
+        r = udev_event_index_add(manager->events_index, &event->index);
+        if (r < 0) {
+                udev_device_unref(event->dev_kernel);
+                free(event);
+                return r;
+        }
 
         log_debug("seq %llu queued, '%s' '%s'", udev_device_get_seqnum(dev),
              udev_device_get_action(dev), udev_device_get_subsystem(dev));
@@ -641,76 +753,6 @@ static void manager_kill_workers(Manager *manager) {
         }
 }
 
-/* lookup event for identical, parent, child device */
-static bool is_devpath_busy(Manager *manager, struct event *event) {
-        struct event *loop_event;
-        size_t common;
-
-        /* check if queue contains events we depend on */
-        LIST_FOREACH(event, loop_event, manager->events) {
-                /* we already found a later event, earlier can not block us, no need to check again */
-                if (loop_event->seqnum < event->delaying_seqnum)
-                        continue;
-
-                /* event we checked earlier still exists, no need to check again */
-                if (loop_event->seqnum == event->delaying_seqnum)
-                        return true;
-
-                /* found ourself, no later event can block us */
-                if (loop_event->seqnum >= event->seqnum)
-                        break;
-
-                /* check major/minor */
-                if (major(event->devnum) != 0 && event->devnum == loop_event->devnum && event->is_block == loop_event->is_block)
-                        return true;
-
-                /* check network device ifindex */
-                if (event->ifindex != 0 && event->ifindex == loop_event->ifindex)
-                        return true;
-
-                /* check our old name */
-                if (event->devpath_old != NULL && streq(loop_event->devpath, event->devpath_old)) {
-                        event->delaying_seqnum = loop_event->seqnum;
-                        return true;
-                }
-
-                /* compare devpath */
-                common = MIN(loop_event->devpath_len, event->devpath_len);
-
-                /* one devpath is contained in the other? */
-                if (memcmp(loop_event->devpath, event->devpath, common) != 0)
-                        continue;
-
-                /* identical device event found */
-                if (loop_event->devpath_len == event->devpath_len) {
-                        /* devices names might have changed/swapped in the meantime */
-                        if (major(event->devnum) != 0 && (event->devnum != loop_event->devnum || event->is_block != loop_event->is_block))
-                                continue;
-                        if (event->ifindex != 0 && event->ifindex != loop_event->ifindex)
-                                continue;
-                        event->delaying_seqnum = loop_event->seqnum;
-                        return true;
-                }
-
-                /* parent device event found */
-                if (event->devpath[common] == '/') {
-                        event->delaying_seqnum = loop_event->seqnum;
-                        return true;
-                }
-
-                /* child device event found */
-                if (loop_event->devpath[common] == '/') {
-                        event->delaying_seqnum = loop_event->seqnum;
-                        return true;
-                }
-
-                /* no matching device */
-                continue;
-        }
-
-        return false;
-}
-
 static int on_exit_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
         Manager *manager = userdata;
 
@@ -741,6 +783,9 @@ static void manager_exit(Manager *manager) {
 
         manager->inotify_event = sd_event_source_unref(manager->inotify_event);
         manager->fd_inotify = safe_close(manager->fd_inotify);
+        manager_watch_changes_free(manager);
+        if (LIST_IS_EMPTY(manager->events))
+                (void) unlink("/run/udev/queue");
 
         manager->uevent_event = sd_event_source_unref(manager->uevent_event);
         manager->monitor = udev_monitor_unref(manager->monitor);
@@ -776,7 +821,10 @@ static void manager_reload(Manager *manager) {
 }
 
 static void event_queue_start(Manager *manager) {
-        struct event *event;
+        struct event *event, *batch[UDEV_MONITOR_BATCH_MAX];
+        struct worker *worker, *idle[UDEV_MONITOR_BATCH_MAX];
+        size_t n = 0, n_idle = 0;
+        Iterator i;
         usec_t usec;
 
         assert(manager);
@@ -785,6 +833,9 @@ static void event_queue_start(Manager *manager) {
             manager->exit || manager->stop_exec_queue)
                 return;
 
+        /* there is work to do again, keep the idle workers */
+        manager->kill_workers_event = sd_event_source_unref(manager->kill_workers_event);
+
         assert_se(sd_event_now(manager->event, CLOCK_MONOTONIC, &usec) >= 0);
         /* check for changed config, every 3 seconds at most */
         if (manager->last_usec == 0 ||
@@ -804,16 +855,39 @@ static void event_queue_start(Manager *manager) {
                         return;
         }
 
+        /* Pair up as many events as possible with idle workers, and pass them on with a single syscall */
+        HASHMAP_FOREACH(worker, manager->workers, i) {
+                if (worker->state != WORKER_IDLE)
+                        continue;
+
+                idle[n_idle++] = worker;
+                if (n_idle >= ELEMENTSOF(idle))
+                        break;
+        }
+
         LIST_FOREACH(event,event,manager->events) {
                 if (event->state != EVENT_QUEUED)
                         continue;
 
                 /* do not start event if parent or child event is still running */
-                if (is_devpath_busy(manager, event))
+                if (udev_event_index_is_busy(manager->events_index, &event->index))
                         continue;
 
+                if (n < n_idle) {
+                        batch[n++] = event;
+                        continue;
+                }
+
+                if (n > 0) {
+                        event_run_batch(manager, batch, idle, n);
+                        n = n_idle = 0;
+                }
+
                 event_run(manager, event);
         }
+
+        if (n > 0)
+                event_run_batch(manager, batch, idle, n);
 }
 
 static void event_queue_cleanup(Manager *manager, enum event_state match_type) {
@@ -901,22 +975,27 @@ static int on_worker(sd_event_source *s, int fd, uint32_t revents, void *userdat
 
 static int on_uevent(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
         Manager *manager = userdata;
-        struct udev_device *dev;
-        int r;
+        struct udev_device *devs[UDEV_MONITOR_BATCH_MAX];
+        bool queued = false;
+        int i, n, r;
 
         assert(manager);
 
-        dev = udev_monitor_receive_device(manager->monitor);
-        if (dev) {
-                udev_device_ensure_usec_initialized(dev, NULL);
-                r = event_queue_insert(manager, dev);
+        /* Pick up the whole burst of uevents at once, and only then look for events to start */
+        n = udev_monitor_receive_devices(manager->monitor, devs, ELEMENTSOF(devs));
+        for (i = 0; i < n; i++) {
+                udev_device_ensure_usec_initialized(devs[i], NULL);
+                r = event_queue_insert(manager, devs[i]);
                 if (r < 0)
-                        udev_device_unref(dev);
+                        udev_device_unref(devs[i]);
                 else
-                        /* we have fresh events, try to schedule them */
-                        event_queue_start(manager);
+                        queued = true;
         }
 
+        if (queued)
+                /* we have fresh events, try to schedule them */
+                event_queue_start(manager);
+
         return 1;
 }
 
@@ -1011,7 +1090,6 @@ static int on_ctrl_msg(sd_event_source *s, int fd, uint32_t revents, void *userd
 }
 
 static int synthesize_change(struct udev_device *dev) {
-        char filename[UTIL_PATH_SIZE];
         int r;
 
         if (streq_ptr("block", udev_device_get_subsystem(dev)) &&
@@ -1085,8 +1163,7 @@ static int synthesize_change(struct udev_device *dev) {
                  * work, synthesize "change" for the disk and all partitions.
                  */
                 log_debug("device %s closed, synthesising 'change'", udev_device_get_devnode(dev));
-                strscpyl(filename, sizeof(filename), udev_device_get_syspath(dev), "/uevent", NULL);
-                write_string_file(filename, "change", WRITE_STRING_FILE_CREATE);
+                (void) udev_watch_synthesize_change(udev_device_get_syspath(dev));
 
                 udev_list_entry_foreach(item, udev_enumerate_get_list_entry(e)) {
                         _cleanup_udev_device_unref_ struct udev_device *d = NULL;
@@ -1100,16 +1177,95 @@ static int synthesize_change(struct udev_device *dev) {
 
                         log_debug("device %s closed, synthesising partition '%s' 'change'",
                                   udev_device_get_devnode(dev), udev_device_get_devnode(d));
-                        strscpyl(filename, sizeof(filename), udev_device_get_syspath(d), "/uevent", NULL);
-                        write_string_file(filename, "change", WRITE_STRING_FILE_CREATE);
+                        (void) udev_watch_synthesize_change(udev_device_get_syspath(d));
                 }
 
                 return 0;
         }
 
         log_debug("device %s closed, synthesising 'change'", udev_device_get_devnode(dev));
-        strscpyl(filename, sizeof(filename), udev_device_get_syspath(dev), "/uevent", NULL);
-        write_string_file(filename, "change", WRITE_STRING_FILE_CREATE);
+        (void) udev_watch_synthesize_change(udev_device_get_syspath(dev));
+
+        return 0;
+}
+
+static int on_watch_change_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
+        _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
+        struct watch_change *change = userdata;
+        Manager *manager = change->manager;
+        int r;
+
+        change->timeout = sd_event_source_unref(change->timeout);
+        manager->n_watch_changes_pending--;
+
+        dev = udev_watch_lookup(manager->udev, change->wd);
+        watch_change_free(change);
+
+        if (dev) {
+                synthesize_change(dev);
+
+                /* queue the resulting uevent right away, see on_inotify() */
+                on_uevent(NULL, -1, 0, manager);
+        }
+
+        if (manager->n_watch_changes_pending == 0 && LIST_IS_EMPTY(manager->events)) {
+                r = unlink("/run/udev/queue");
+                if (r < 0 && errno != ENOENT)
+                        log_warning_errno(errno, "could not unlink /run/udev/queue: %m");
+        }
+
+        return 1;
+}
+
+static int watch_change_queue(Manager *manager, int wd) {
+        struct watch_change *change;
+        usec_t usec;
+        int r;
+
+        assert(manager);
+
+        assert_se(sd_event_now(manager->event, CLOCK_MONOTONIC, &usec) >= 0);
+
+        change = hashmap_get(manager->watch_changes, INT_TO_PTR(wd));
+        if (!change) {
+                r = hashmap_ensure_allocated(&manager->watch_changes, NULL);
+                if (r < 0)
+                        return r;
+
+                change = new0(struct watch_change, 1);
+                if (!change)
+                        return -ENOMEM;
+
+                change->manager = manager;
+                change->wd = wd;
+
+                r = hashmap_put(manager->watch_changes, INT_TO_PTR(wd), change);
+                if (r < 0) {
+                        free(change);
+                        return r;
+                }
+        }
+
+        /* another close while the change is pending, push it back, but not forever */
+        if (change->timeout)
+                return sd_event_source_set_time(change->timeout,
+                                                udev_watch_debounce_deadline(change->first_usec, usec,
+                                                                             arg_watch_debounce_usec, WATCH_DEBOUNCE_MAX));
+
+        r = sd_event_add_time(manager->event, &change->timeout, CLOCK_MONOTONIC,
+                              udev_watch_debounce_deadline(usec, usec, arg_watch_debounce_usec, WATCH_DEBOUNCE_MAX),
+                              10 * USEC_PER_MSEC, on_watch_change_timeout, change);
+        if (r < 0)
+                return r;
+
+        change->first_usec = usec;
+
+        /* udevadm settle needs to wait for the "change" event, too */
+        if (manager->n_watch_changes_pending++ == 0 && LIST_IS_EMPTY(manager->events)) {
+                r = touch("/run/udev/queue");
+                if (r < 0)
+                        log_warning_errno(r, "could not touch /run/udev/queue: %m");
+        }
 
         return 0;
 }
@@ -1119,6 +1275,7 @@ static int on_inotify(sd_event_source *s, int fd, uint32_t revents, void *userda
         union inotify_event_buffer buffer;
         struct inotify_event *e;
         ssize_t l;
+        int r;
 
         assert(manager);
 
@@ -1133,6 +1290,17 @@ static int on_inotify(sd_event_source *s, int fd, uint32_t revents, void *userda
         FOREACH_INOTIFY_EVENT(e, buffer, l) {
                 _cleanup_udev_device_unref_ struct udev_device *dev = NULL;
 
+                if (e->mask & IN_CLOSE_WRITE && arg_watch_debounce_usec > 0) {
+                        r = watch_change_queue(manager, e->wd);
+                        if (r >= 0)
+                                continue;
+
+                        log_warning_errno(r, "Failed to delay 'change' for watch %i, synthesising it right away: %m", e->wd);
+                }
+
+                if (e->mask & IN_IGNORED)
+                        watch_change_free(hashmap_get(manager->watch_changes, INT_TO_PTR(e->wd)));
+
                 dev = udev_watch_lookup(manager->udev, e->wd);
                 if (!dev)
                         continue;
@@ -1212,7 +1380,7 @@ static int on_sigchld(sd_event_source *s, const struct signalfd_siginfo *si, voi
 
                 if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
                         if (worker->event) {
-                                log_error("worker ["PID_FMT"] failed while handling '%s'", pid, worker->event->devpath);
+                                log_error("worker ["PID_FMT"] failed while handling '%s'", pid, worker->event->index.devpath);
                                 /* delete state from disk */
                                 udev_device_delete_db(worker->event->dev);
                                 udev_device_tag_index(worker->event->dev, NULL, false);
@@ -1230,6 +1398,19 @@ static int on_sigchld(sd_event_source *s, const struct signalfd_siginfo *si, voi
         return 1;
 }
 
+static int on_kill_workers_event(sd_event_source *s, uint64_t usec, void *userdata) {
+        Manager *manager = userdata;
+
+        assert(manager);
+
+        log_debug("cleanup idle workers");
+        manager_kill_workers(manager);
+
+        manager->kill_workers_event = sd_event_source_unref(manager->kill_workers_event);
+
+        return 1;
+}
+
 static int on_post(sd_event_source *s, void *userdata) {
         Manager *manager = userdata;
         int r;
@@ -1237,11 +1418,38 @@ static int on_post(sd_event_source *s, void *userdata) {
         assert(manager);
 
         if (LIST_IS_EMPTY(manager->events)) {
-                /* no pending events */
+                /* no pending events, bring the snapshot of the database up-to-date for sd-device */
+                if ((manager->db_snapshot_rebuild || !set_isempty(manager->db_snapshot_changed)) && !manager->exit) {
+                        _cleanup_free_ char **changed = NULL;
+
+                        if (manager->db_snapshot_rebuild)
+                                r = device_db_snapshot_write(DEVICE_DB_DIR, DEVICE_DB_SNAPSHOT_PATH);
+                        else {
+                                changed = set_get_strv(manager->db_snapshot_changed);
+                                r = changed ? device_db_snapshot_update(DEVICE_DB_DIR, DEVICE_DB_SNAPSHOT_PATH, changed) : -ENOMEM;
+                        }
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to write snapshot of the udev database, ignoring: %m");
+
+                        /* On failure, or if something else changed the database meanwhile, start over next time */
+                        manager->db_snapshot_rebuild = r != 0;
+                        set_clear_free(manager->db_snapshot_changed);
+                }
+
                 if (!hashmap_isempty(manager->workers)) {
-                        /* there are idle workers */
-                        log_debug("cleanup idle workers");
-                        manager_kill_workers(manager);
+                        /* there are idle workers, keep them around for a bit in case more events come in */
+                        if (!manager->kill_workers_event && !manager->exit) {
+                                usec_t usec;
+
+                                assert_se(sd_event_now(manager->event, CLOCK_MONOTONIC, &usec) >= 0);
+                                r = sd_event_add_time(manager->event, &manager->kill_workers_event, CLOCK_MONOTONIC,
+                                                      usec + WORKER_IDLE_TIMEOUT_USEC, USEC_PER_SEC,
+                                                      on_kill_workers_event, manager);
+                                if (r < 0) {
+                                        log_debug_errno(r, "Failed to create timer to kill idle workers, killing them right away: %m");
+                                        manager_kill_workers(manager);
+                                }
+                        }
                 } else {
                         /* we are idle */
                         if (manager->exit) {
@@ -1351,6 +1559,7 @@ static int listen_fds(int *rctrl, int *rnetlink) {
  *   udev.children_max=<number of workers>     events are fully serialized if set to 1
  *   udev.exec_delay=<number of seconds>       delay execution of every executed program
  *   udev.event_timeout=<number of seconds>    seconds to wait before terminating an event
+ *   udev.watch_debounce=<time>                coalesce "change" events of watched devices within this time
  */
 static int parse_proc_cmdline_item(const char *key, const char *value, void *data) {
         int r = 0;
@@ -1394,6 +1603,13 @@ static int parse_proc_cmdline_item(const char *key, const char *value, void *dat
 
                 r = safe_atoi(value, &arg_exec_delay);
 
+        } else if (proc_cmdline_key_streq(key, "udev.watch_debounce")) {
+
+                if (proc_cmdline_value_missing(key, value))
+                        return 0;
+
+                r = parse_sec(value, &arg_watch_debounce_usec);
+
         } else if (startswith(key, "udev."))
                 log_warning("Unknown udev kernel command line option \"%s\"", key);
 
@@ -1413,12 +1629,18 @@ static void help(void) {
                "  -c --children-max=INT       Set maximum number of workers\n"
                "  -e --exec-delay=SECONDS     Seconds to wait before executing RUN=\n"
                "  -t --event-timeout=SECONDS  Seconds to wait before terminating an event\n"
+               "     --watch-debounce=TIME    Coalesce 'change' events of watched devices\n"
+               "                              within this time\n"
                "  -N --resolve-names=early|late|never\n"
                "                              When to resolve users and groups\n"
                , program_invocation_short_name);
 }
 
 static int parse_argv(int argc, char *argv[]) {
+        enum {
+                ARG_WATCH_DEBOUNCE = 0x100,
+        };
+
         static const struct option options[] = {
                 { "daemon",             no_argument,            NULL, 'd' },
                 { "debug",              no_argument,            NULL, 'D' },
@@ -1426,6 +1648,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "exec-delay",         required_argument,      NULL, 'e' },
                 { "event-timeout",      required_argument,      NULL, 't' },
                 { "resolve-names",      required_argument,      NULL, 'N' },
+                { "watch-debounce",     required_argument,      NULL, ARG_WATCH_DEBOUNCE },
                 { "help",               no_argument,            NULL, 'h' },
                 { "version",            no_argument,            NULL, 'V' },
                 {}
@@ -1463,6 +1686,11 @@ static int parse_argv(int argc, char *argv[]) {
                                 arg_event_timeout_warn_usec = (arg_event_timeout_usec / 3) ? : 1;
                         }
                         break;
+                case ARG_WATCH_DEBOUNCE:
+                        r = parse_sec(optarg, &arg_watch_debounce_usec);
+                        if (r < 0)
+                                log_warning("Invalid --watch-debounce ignored: %s", optarg);
+                        break;
                 case 'D':
                         arg_debug = true;
                         break;
@@ -1509,6 +1737,7 @@ static int manager_new(Manager **ret, int fd_ctrl, int fd_uevent, const char *cg
 
         manager->fd_inotify = -1;
         manager->worker_watch[WRITE_END] = -1;
+        manager->db_snapshot_rebuild = true;
         manager->worker_watch[READ_END] = -1;
 
         manager->udev = udev_new();
@@ -1524,6 +1753,10 @@ static int manager_new(Manager **ret, int fd_ctrl, int fd_uevent, const char *cg
         LIST_HEAD_INIT(manager->events);
         udev_list_init(manager->udev, &manager->properties, true);
 
+        manager->events_index = udev_event_index_new();
+        if (!manager->events_index)
+                return log_oom();
+
         manager->cgroup = cgroup;
 
         manager->ctrl = udev_ctrl_new_from_fd(manager->udev, fd_ctrl);